@@ -23,19 +23,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <SDL/SDL.h>
 #include <SDL/SDL_thread.h>
 
 #include <sys/sys.h>
+#include <sys/snapshot.h>
+#include <sys/fuzz.h>
+#include <config.h>
 #include <arm/arm.h>
 #include <arm/mmu.h>
 #include <arm/uops.h>
 #include <arm/ops.h>
+#include <arm/jit.h>
+#include <arm/stats.h>
+#include <arm/profile.h>
+#include <arm/btrace.h>
 #include <util/atomic.h>
 
-struct cpu_struct cpu; // the cpu
+__thread struct cpu_struct cpu; // the core running on this thread
 
 struct cpu_types {
 	const char *name;
@@ -63,11 +71,45 @@ static const struct cpu_types cpu_types[] = {
 	{ NULL, 0, 0, 0, 0 },
 };
 
-int initialize_cpu(const char *cpu_type)
+/* saves off what the cores are going to be, they're built on their own threads by start_cpu */
+struct cpu_cluster *initialize_cpu(struct machine *m, const char *cpu_type)
+{
+	struct cpu_cluster *cluster;
+
+	cluster = calloc(1, sizeof(struct cpu_cluster));
+	cluster->machine = m;
+	cluster->core_type = cpu_type;
+
+	cluster->num_cores = atoi(get_config_key_string("cpu", "cores", "1"));
+	if(cluster->num_cores < 1)
+		cluster->num_cores = 1;
+	if(cluster->num_cores > MAX_CPU_CORES) {
+		printf("cpu: %d cores is more than the %d supported, clamping\n", cluster->num_cores, MAX_CPU_CORES);
+		cluster->num_cores = MAX_CPU_CORES;
+	}
+
+	cluster->rendezvous_lock = SDL_CreateMutex();
+	cluster->rendezvous_cond = SDL_CreateCond();
+
+	return cluster;
+}
+
+/* set up the state of the core running on this thread */
+static void initialize_core(struct cpu_cluster *cluster, int core_id)
 {
 	const struct cpu_types *t;
+	const char *cpu_core_type = cluster->core_type;
 
 	memset(&cpu, 0, sizeof(cpu));
+	cpu.core_id = core_id;
+	cpu.cluster = cluster;
+	cpu.idle_lock = SDL_CreateMutex();
+	cpu.idle_cond = SDL_CreateCond();
+	cpu.idle_detect = get_config_key_bool("cpu", "idle_detect", TRUE);
+	cpu.poll_addr = 0xffffffff;
+	cpu.next_event = ~(dword)0;
+	cpu.cover_map = cluster->cover_map;
+	cpu.semihosting = cluster->semihosting;
 
 	// build the condition table
 	build_condition_table();
@@ -76,9 +118,9 @@ int initialize_cpu(const char *cpu_type)
 	cpu.isa = ARM_V4;
 	cpu.core = ARM7;
 
-	if(cpu_type) {
+	if(cpu_core_type) {
 		for(t = cpu_types; t->name; t++) {
-			if(!strcasecmp(t->name, cpu_type)) {
+			if(!strcasecmp(t->name, cpu_core_type)) {
 				cpu.isa = t->isa;
 				cpu.core = t->core;
 				
@@ -96,107 +138,373 @@ int initialize_cpu(const char *cpu_type)
 	/* initialize the uop cache */
 	uop_init();
 
-	return 0;
+#if WITH_JIT
+	jit_init();
+#endif
+
+	// every core comes out of reset at the reset vector
+	atomic_store_relaxed(&cpu.pending_exceptions, EX_RESET);
+	atomic_store_relaxed(&cpu.event_request, TRUE);
+	cluster->cores[core_id] = &cpu;
 }
 
-void reset_cpu(void)
+void reset_cpu(struct cpu_cluster *cluster)
 {
-	atomic_or(&cpu.pending_exceptions, EX_RESET); // schedule a reset	
+	int i;
+
+	for(i = 0; i < cluster->num_cores; i++) {
+		if(cluster->cores[i]) {
+			atomic_or_relaxed(&cluster->cores[i]->pending_exceptions, EX_RESET); // schedule a reset
+			cpu_request_event(cluster->cores[i]);
+			cpu_wake(cluster->cores[i]);
+		}
+	}
+}
+
+/*
+ * the cores come out of reset at entry rather than the reset vector, in thumb state if
+ * bit 0 of it is set. symbol_file is where the profiler and the trace name things from.
+ */
+void set_cpu_entry_point(struct cpu_cluster *cluster, armaddr_t entry, const char *symbol_file)
+{
+	cluster->entry_point = entry;
+	cluster->has_entry_point = TRUE;
+	cluster->symbol_file = symbol_file;
+}
+
+/*
+ * count the edges from branches to their targets into map, the way afl does, before
+ * the cores start. they run the cover dispatch loop, which does it at the branches.
+ */
+void set_cpu_cover_map(struct cpu_cluster *cluster, byte *map)
+{
+	cluster->cover_map = map;
+}
+
+/* before start_cpu, for [debug] semihosting, see sys/semihost.h */
+void set_cpu_semihosting(struct cpu_cluster *cluster, bool semihosting)
+{
+	cluster->semihosting = semihosting;
 }
 
 static int cpu_startup_thread_entry(void *args)
 {
-	SDL_Event event;
+	struct cpu_cluster *cluster = (struct cpu_cluster *)args;
 
-	// start the uop engine
+	// the cores come up one at a time, so the next free slot is ours
+	machine_enter(cluster->machine);
+	initialize_core(cluster, cluster->starting_core);
+	snapshot_core_started(cluster);
+
+	// hold off until the rest of the cores are up and can be interrupted
+	SDL_SemPost(cluster->cores_up);
+	SDL_SemWait(cluster->cores_go);
+	start_instruction_budget(cluster);
+	btrace_core_started(cluster);
+
+	// start the uop engine, it only comes back when the machine is stopped
 	uop_dispatch_loop();
 
 	// run the decoder loop
 //	decoder_loop();
 
-	// the cpu bailed for some reason, push a quit event into the SDL event queue
-	event.type = SDL_QUIT;
-	SDL_PushEvent(&event);
+	stats_core_stopped(cluster);
+	SDL_SemPost(cluster->cores_stopped);
+
+	// the devices can still get at this core until the machine is torn down,
+	// and its state lives on this thread
+	SDL_SemWait(cluster->cores_done);
+
+	uop_shutdown();
+#if WITH_JIT
+	jit_shutdown();
+#endif
+	SDL_DestroyCond(cpu.idle_cond);
+	SDL_DestroyMutex(cpu.idle_lock);
 
 	return 0;
 }
 
 static Uint32 speedtimer(Uint32 interval, void *param)
 {
-	static struct perf_counters old_perf_counters;
-	struct perf_counters delta_perf_counter;
+	struct cpu_cluster *cluster = (struct cpu_cluster *)param;
+	struct perf_counters *old_perf_counters = &cluster->speedtimer_counters;
+	struct perf_counters total, delta_perf_counter;
+	enum uop_instrumentation level;
 	int i;
+
+	// runs on the timer thread, so add up what all of the cores have done
+	level = cluster->cores[0]->instrumentation;
 	
+	cpu_stats_snapshot(cluster, &total);
 	for(i=0; i<MAX_PERF_COUNTER; i++) {
-		delta_perf_counter.count[i] = cpu.perf_counters.count[i] - old_perf_counters.count[i];
-		old_perf_counters.count[i] = cpu.perf_counters.count[i];
+		delta_perf_counter.count[i] = total.count[i] - old_perf_counters->count[i];
+		old_perf_counters->count[i] = total.count[i];
 	}
 
 #if COUNT_CYCLES
-	printf("%d cycles/sec, ",
-		delta_perf_counter.count[CYCLE_COUNT]);
+	if(level >= UOP_INSTRUMENTATION_CYCLES)
+		printf("%lld cycles/sec, ",
+			(long long)delta_perf_counter.count[CYCLE_COUNT]);
 #endif
-	printf("%7d ins/sec, %7d ins decodes/sec, exceptions/sec %5d\n", 
-		   delta_perf_counter.count[INS_COUNT],
-		   delta_perf_counter.count[INS_DECODE],
-		   delta_perf_counter.count[EXCEPTIONS]);
+	printf("%7lld ins/sec, %7lld ins decodes/sec, exceptions/sec %5lld, codepage invalidates/sec %5lld, idle parks/sec %5lld\n", 
+		   (long long)delta_perf_counter.count[INS_COUNT],
+		   (long long)delta_perf_counter.count[INS_DECODE],
+		   (long long)delta_perf_counter.count[EXCEPTIONS],
+		   (long long)delta_perf_counter.count[CODEPAGE_INVALIDATE],
+		   (long long)delta_perf_counter.count[IDLE_PARK]);
+	printf("%7lld KB codepages live, %7lld KB peak, codepage evictions/sec %5lld, preloads/sec %5lld, slow mmu translates/sec %5lld\n",
+		   (long long)cluster->cores[0]->perf_counters.count[CODEPAGE_MEM_LIVE] / 1024,
+		   (long long)cluster->cores[0]->perf_counters.count[CODEPAGE_MEM_PEAK] / 1024,
+		   (long long)delta_perf_counter.count[CODEPAGE_EVICT],
+		   (long long)delta_perf_counter.count[CODEPAGE_PRELOAD],
+		   (long long)delta_perf_counter.count[MMU_SLOW_TRANSLATE]);
 #if COUNT_MMU_OPS
-	printf("%7d slow mmu translates/sec, %7d ins fetches, %7d mmu reads, %7d mmu writes, %7d fastpath, %7d slowpath\n", 
-		   delta_perf_counter.count[MMU_SLOW_TRANSLATE],
-		   delta_perf_counter.count[MMU_INS_FETCH],
-		   delta_perf_counter.count[MMU_READ],
-		   delta_perf_counter.count[MMU_WRITE],
-		   delta_perf_counter.count[MMU_FASTPATH],
-		   delta_perf_counter.count[MMU_SLOWPATH]);
+	printf("%7lld ins fetches, %7lld mmu reads, %7lld mmu writes, %7lld fastpath, %7lld slowpath, %7lld ldm/stm fastpath, %7lld fastmem, %7lld big page hits\n", 
+		   (long long)delta_perf_counter.count[MMU_INS_FETCH],
+		   (long long)delta_perf_counter.count[MMU_READ],
+		   (long long)delta_perf_counter.count[MMU_WRITE],
+		   (long long)delta_perf_counter.count[MMU_FASTPATH],
+		   (long long)delta_perf_counter.count[MMU_SLOWPATH],
+		   (long long)delta_perf_counter.count[MMU_MULTIPLE_FASTPATH],
+		   (long long)delta_perf_counter.count[MMU_FASTMEM],
+		   (long long)delta_perf_counter.count[MMU_BIG_PAGE_HIT]);
+#endif
+
+	// the rest are only counted by the full dispatch loop
+	if(level < UOP_INSTRUMENTATION_FULL)
+		return interval;
+
+#if COUNT_BRANCH_CACHE
+	printf("%7lld branch cache hits/sec, %7lld misses, %7lld return stack hits, %7lld misses\n",
+		   (long long)delta_perf_counter.count[BRANCH_CACHE_HIT],
+		   (long long)delta_perf_counter.count[BRANCH_CACHE_MISS],
+		   (long long)delta_perf_counter.count[RSB_HIT],
+		   (long long)delta_perf_counter.count[RSB_MISS]);
 #endif
 #if COUNT_ARM_OPS
-	printf("\tSC %d NOP %d L %d S %d DP %d MUL %d B %d MISC %d\n",
-		   delta_perf_counter.count[OP_SKIPPED_CONDITION],
-		   delta_perf_counter.count[OP_NOP],
-		   delta_perf_counter.count[OP_LOAD],
-		   delta_perf_counter.count[OP_STORE],
-		   delta_perf_counter.count[OP_DATA_PROC],
-		   delta_perf_counter.count[OP_MUL],
-		   delta_perf_counter.count[OP_BRANCH],
-		   delta_perf_counter.count[OP_MISC]);
+	printf("\tSC %lld NOP %lld L %lld S %lld DP %lld MUL %lld B %lld MISC %lld\n",
+		   (long long)delta_perf_counter.count[OP_SKIPPED_CONDITION],
+		   (long long)delta_perf_counter.count[OP_NOP],
+		   (long long)delta_perf_counter.count[OP_LOAD],
+		   (long long)delta_perf_counter.count[OP_STORE],
+		   (long long)delta_perf_counter.count[OP_DATA_PROC],
+		   (long long)delta_perf_counter.count[OP_MUL],
+		   (long long)delta_perf_counter.count[OP_BRANCH],
+		   (long long)delta_perf_counter.count[OP_MISC]);
 #endif
 
 #if COUNT_UOPS
 	for(i=0; i < MAX_UOP_OPCODE; i++) {
-		printf("\tuop opcode %3d (%s): %d\n", i, uop_opcode_to_str(i), delta_perf_counter.count[UOP_BASE + i]);
+		printf("\tuop opcode %3d (%s): %lld\n", i, uop_opcode_to_str(i), (long long)delta_perf_counter.count[UOP_BASE + i]);
+	}
+#endif
+#if COUNT_FUSIONS
+	for(i=0; i < NUM_FUSED_OPCODES; i++) {
+		printf("\tfused %s: %lld\n", uop_opcode_to_str(FIRST_FUSED_OPCODE + i), (long long)delta_perf_counter.count[FUSION_BASE + i]);
 	}
 #endif
 #if COUNT_ARITH_UOPS
 	for(i=0; i < 16; i++) {
-		printf("\tuop arith opcode %2d (%s): %d\n", i, dp_op_to_str(i), delta_perf_counter.count[UOP_ARITH_OPCODE + i]);
+		printf("\tuop arith opcode %2d (%s): %lld\n", i, dp_op_to_str(i), (long long)delta_perf_counter.count[UOP_ARITH_OPCODE + i]);
 	}
 #endif
 
 	return interval;
 }
 
-int start_cpu(void)
+int start_cpu(struct cpu_cluster *cluster)
 {
-	// spawn a new thread for the cpu
-	SDL_CreateThread(&cpu_startup_thread_entry, NULL);
+	int i;
+
+	if(start_stats(cluster) < 0 || start_btrace(cluster) < 0)
+		return -1;
+
+	// spawn a new thread for each core, they set themselves up on the way in.
+	// none of them run until cores[] is completely filled in
+	cluster->cores_up = SDL_CreateSemaphore(0);
+	cluster->cores_go = SDL_CreateSemaphore(0);
+	cluster->cores_stopped = SDL_CreateSemaphore(0);
+	cluster->cores_done = SDL_CreateSemaphore(0);
+	for(i = 0; i < cluster->num_cores; i++) {
+		cluster->starting_core = i;
+		cluster->threads[i] = SDL_CreateThread(&cpu_startup_thread_entry, cluster);
+		SDL_SemWait(cluster->cores_up);
+	}
+	for(i = 0; i < cluster->num_cores; i++)
+		SDL_SemPost(cluster->cores_go);
 
-#if DUMP_STATS
 	// add a function that goes off once a second
-	SDL_AddTimer(1000, &speedtimer, NULL);
-#endif
+	if(get_config_key_bool("stats", "print", DUMP_STATS))
+		cluster->speedtimer = SDL_AddTimer(1000, &speedtimer, cluster);
 
-	return 0;
+	return start_profile(cluster);
 }
 
-void set_cpu_mode(int new_mode)
+/*
+ * pull every core out of its dispatch loop and wait for the threads to finish.
+ * safe to call from any thread but the cores' own, anything that could still
+ * interrupt a core has to be shut off first, the cores' state goes away with them.
+ */
+void stop_cpu(struct cpu_cluster *cluster)
 {
-	reg_t *bank;
-	int old_mode = cpu.cpsr & PSR_MODE_MASK;
+	int i;
 
-	CPU_TRACE(4, "mode change: 0x%x to 0x%x\n", old_mode, new_mode);
+	if(cluster->speedtimer) {
+		SDL_RemoveTimer(cluster->speedtimer);
+		cluster->speedtimer = NULL;
+	}
+	cpu_request_stop(cluster);
 
-	if(old_mode == new_mode)
+	// the counters are final once every core is out of its dispatch loop
+	for(i = 0; i < cluster->num_cores; i++) {
+		if(cluster->threads[i])
+			SDL_SemWait(cluster->cores_stopped);
+	}
+	stop_stats(cluster);
+	stop_profile(cluster);
+
+	for(i = 0; i < cluster->num_cores; i++) {
+		if(cluster->threads[i])
+			SDL_SemPost(cluster->cores_done);
+	}
+	for(i = 0; i < cluster->num_cores; i++) {
+		if(cluster->threads[i]) {
+			SDL_WaitThread(cluster->threads[i], NULL);
+			cluster->threads[i] = NULL;
+		}
+		cluster->cores[i] = NULL;
+	}
+
+	stop_btrace(cluster);
+}
+
+/* ask the cores to stop at the end of their current block, without waiting for them */
+void cpu_request_stop(struct cpu_cluster *cluster)
+{
+	int i;
+
+	cluster->stopping = TRUE;
+	for(i = 0; i < cluster->num_cores; i++) {
+		if(cluster->cores[i]) {
+			cluster->cores[i]->restart_dispatch = TRUE;
+			cpu_request_event(cluster->cores[i]);
+			cpu_wake(cluster->cores[i]);
+		}
+	}
+
+	// nobody waits for a rendezvous the stopped cores won't get to
+	SDL_LockMutex(cluster->rendezvous_lock);
+	SDL_CondBroadcast(cluster->rendezvous_cond);
+	SDL_UnlockMutex(cluster->rendezvous_lock);
+}
+
+/*
+ * start a rendezvous, from anywhere. each core gets pulled out to uop_dispatch_loop
+ * at the end of its block, parked cores included, and r is run there. returns -1
+ * without doing anything if there's already one under way. r has to stay around until
+ * it's done.
+ */
+int cpu_request_rendezvous(struct cpu_cluster *cluster, const struct cpu_rendezvous *r)
+{
+	int i;
+
+	SDL_LockMutex(cluster->rendezvous_lock);
+	if(cluster->rendezvous || cluster->stopping) {
+		SDL_UnlockMutex(cluster->rendezvous_lock);
+		return -1;
+	}
+	cluster->rendezvous_generation++;
+	cluster->rendezvous_count = 0;
+	cluster->rendezvous = r;
+	SDL_UnlockMutex(cluster->rendezvous_lock);
+
+	for(i = 0; i < cluster->num_cores; i++) {
+		cluster->cores[i]->restart_dispatch = TRUE;
+		cpu_request_event(cluster->cores[i]);
+		cpu_wake(cluster->cores[i]);
+	}
+
+	return 0;
+}
+
+/* from uop_dispatch_loop, between blocks, once a rendezvous has been asked for */
+void cpu_rendezvous_arrive(void)
+{
+	struct cpu_cluster *cluster = cpu.cluster;
+	const struct cpu_rendezvous *r;
+	unsigned int generation;
+
+	SDL_LockMutex(cluster->rendezvous_lock);
+	r = cluster->rendezvous;
+	generation = cluster->rendezvous_generation;
+	if(!r || cpu.rendezvous_seen == generation) {
+		// already been, the core came back out for something else
+		SDL_UnlockMutex(cluster->rendezvous_lock);
 		return;
+	}
+	cpu.rendezvous_seen = generation;
+	SDL_UnlockMutex(cluster->rendezvous_lock);
+
+	if(r->each)
+		r->each(r->arg);
+
+	SDL_LockMutex(cluster->rendezvous_lock);
+	if(++cluster->rendezvous_count == cluster->num_cores) {
+		// the last one here, the rest are waiting
+		SDL_UnlockMutex(cluster->rendezvous_lock);
+		if(r->last)
+			r->last(r->arg);
+		SDL_LockMutex(cluster->rendezvous_lock);
+
+		cluster->rendezvous = NULL;
+		SDL_CondBroadcast(cluster->rendezvous_cond);
+	} else {
+		while(cluster->rendezvous == r && cluster->rendezvous_generation == generation && !cluster->stopping)
+			SDL_CondWait(cluster->rendezvous_cond, cluster->rendezvous_lock);
+	}
+	SDL_UnlockMutex(cluster->rendezvous_lock);
+}
+
+void destroy_cpu(struct cpu_cluster *cluster)
+{
+	if(cluster->cores_up)
+		SDL_DestroySemaphore(cluster->cores_up);
+	if(cluster->cores_go)
+		SDL_DestroySemaphore(cluster->cores_go);
+	if(cluster->cores_stopped)
+		SDL_DestroySemaphore(cluster->cores_stopped);
+	if(cluster->cores_done)
+		SDL_DestroySemaphore(cluster->cores_done);
+	SDL_DestroyCond(cluster->rendezvous_cond);
+	SDL_DestroyMutex(cluster->rendezvous_lock);
+	free(cluster);
+}
+
+/*
+ * where each mode keeps its sp, lr and spsr while it's not the one running, as an
+ * offset into the cpu struct. usr and sys share a bank, and have no spsr, but get a
+ * slot for one anyway so every bank looks the same. fiq banks r8-r12 as well, it and
+ * the reserved modes are left at 0 and go through swap_banked_regs.
+ */
+static const unsigned short mode_bank[PSR_MODE_MASK + 1] = {
+	[PSR_MODE_user] = offsetof(struct cpu_struct, usr_regs),
+	[PSR_MODE_sys] = offsetof(struct cpu_struct, usr_regs),
+	[PSR_MODE_irq] = offsetof(struct cpu_struct, irq_regs),
+	[PSR_MODE_svc] = offsetof(struct cpu_struct, svc_regs),
+	[PSR_MODE_abt] = offsetof(struct cpu_struct, abt_regs),
+	[PSR_MODE_und] = offsetof(struct cpu_struct, und_regs),
+};
+
+static inline reg_t *get_mode_bank(int mode)
+{
+	return (reg_t *)((byte *)&cpu + mode_bank[mode]);
+}
+
+/* the general case of switching banks, for when fiq is one side of it */
+static void swap_banked_regs(int old_mode, int new_mode)
+{
+	reg_t *bank;
 
 	// save the regs from the mode we're coming from
 	switch(old_mode) {
@@ -272,10 +580,38 @@ restore_3reg:
 			cpu.spsr = bank[2];  // spsr
 			break;
 	}
+}
+
+void set_cpu_mode(int new_mode)
+{
+	int old_mode = cpu.cpsr & PSR_MODE_MASK;
+
+	CPU_TRACE(4, "mode change: 0x%x to 0x%x\n", old_mode, new_mode);
+
+	if(old_mode == new_mode)
+		return;
+
+	if(likely(mode_bank[old_mode] && mode_bank[new_mode & PSR_MODE_MASK])) {
+		// everything but fiq, just sp, lr and spsr to swap
+		reg_t *old_bank = get_mode_bank(old_mode);
+		reg_t *new_bank = get_mode_bank(new_mode & PSR_MODE_MASK);
+
+		old_bank[0] = cpu.r[13];
+		old_bank[1] = cpu.r[14];
+		old_bank[2] = cpu.spsr;
+		cpu.r[13] = new_bank[0];
+		cpu.r[14] = new_bank[1];
+		cpu.spsr = new_bank[2];
+	} else {
+		swap_banked_regs(old_mode, new_mode);
+	}
 
 	// set the mode bits
 	cpu.cpsr &= ~PSR_MODE_MASK;
 	cpu.cpsr |= new_mode;
+
+	// privileged and user accesses go through different memory accessors
+	mmu_select_access();
 }
 
 /* access the "user" mode registers */
@@ -311,40 +647,150 @@ void put_reg_user(int num, reg_t data)
 	}
 }
 
-void raise_irq(void)
+/* would an interrupt pending on this core get it going again */
+static bool cpu_has_wakeup(bool wfi)
 {
-	CPU_TRACE(5, "raise_irq\n");
-	atomic_or(&cpu.pending_exceptions, EX_IRQ);
+	int pending = atomic_load_relaxed(&cpu.pending_exceptions);
+	int mask = EX_RESET;
+
+	// wfi comes back for masked interrupts too, it's up to the guest to check
+	if(wfi || !(cpu.cpsr & PSR_IRQ_MASK))
+		mask |= EX_IRQ;
+	if(wfi || !(cpu.cpsr & PSR_FIQ_MASK))
+		mask |= EX_FIQ;
+
+	return (pending & mask) || cpu.restart_dispatch;
 }
 
-void lower_irq(void)
+/*
+ * put the host thread for this core to sleep until it has an interrupt to take.
+ * with a timeout it's a poll park instead, and any wakeup at all brings it back,
+ * since the device it's watching may have changed. anything that makes an exception
+ * pending on a core has to cpu_wake() it afterwards.
+ */
+void cpu_idle(bool wfi, int timeout_ms)
 {
-	CPU_TRACE(5, "lower_irq\n");
-	atomic_and(&cpu.pending_exceptions, ~EX_IRQ);
+	// nothing happens in guest time while the core is stopped, skip ahead to the next event
+	if(cpu.events) {
+		if(cpu.guest_time < cpu.next_event)
+			cpu.guest_time = cpu.next_event;
+		return;
+	}
+
+	SDL_LockMutex(cpu.idle_lock);
+
+	// publish that we're asleep before the last look, the waker checks in the other order
+	atomic_set(&cpu.idle, TRUE);
+	inc_perf_counter(IDLE_PARK);
+	if(timeout_ms == 0) {
+		while(!cpu_has_wakeup(wfi))
+			SDL_CondWait(cpu.idle_cond, cpu.idle_lock);
+	} else if(!cpu_has_wakeup(wfi)) {
+		SDL_CondWaitTimeout(cpu.idle_cond, cpu.idle_lock, timeout_ms);
+	}
+	atomic_set(&cpu.idle, FALSE);
+
+	SDL_UnlockMutex(cpu.idle_lock);
 }
 
-void raise_fiq(void)
+/*
+ * the branch closing one of the loops that were spotted at decode time was taken.
+ * a branch to itself is only ever left through an exception, so it's as good as wfi.
+ * a short loop back is only idle if every time around it reads the same value out of
+ * the same device register and writes nothing, then it gets parked after a few passes.
+ * device state changes wake it early, the timeout covers anything that doesn't.
+ */
+#define IDLE_POLL_PASSES	16
+#define IDLE_POLL_TIMEOUT	10 // ms
+
+void cpu_idle_branch(int flags)
 {
-	CPU_TRACE(5, "raise_fiq\n");
-	atomic_or(&cpu.pending_exceptions, EX_FIQ);
+	int poll_flags;
+
+	if(flags & UOPBFLAGS_IDLE_LOOP) {
+		cpu_idle(FALSE, 0);
+		return;
+	}
+
+	poll_flags = cpu.poll_flags;
+	cpu.poll_flags = 0;
+	if(poll_flags != POLL_READ) {
+		cpu.poll_count = 0;
+		return;
+	}
+
+	if(++cpu.poll_count < IDLE_POLL_PASSES)
+		return;
+
+	cpu.poll_count = 0;
+	cpu_idle(FALSE, IDLE_POLL_TIMEOUT);
 }
 
-void lower_fiq(void)
+/* kick a core out of cpu_idle, if it's in there */
+void cpu_wake(struct cpu_struct *core)
 {
-	CPU_TRACE(5, "lower_fiq\n");
-	atomic_and(&cpu.pending_exceptions, ~EX_FIQ);
+	// a locked op, so the caller's store of the reason is visible before we look
+	if(!atomic_or(&core->idle, 0))
+		return;
+
+	SDL_LockMutex(core->idle_lock);
+	SDL_CondSignal(core->idle_cond);
+	SDL_UnlockMutex(core->idle_lock);
+}
+
+/* something changed in the machine a polling core might be waiting on */
+void cpu_wake_all(struct cpu_cluster *cluster)
+{
+	int i;
+
+	for(i = 0; i < cluster->num_cores; i++) {
+		if(cluster->cores[i])
+			cpu_wake(cluster->cores[i]);
+	}
+}
+
+/*
+ * these come in from the device threads, so go through the cluster rather than the local core.
+ * they stay full barriers, the pic's set_core_irq_status() needs the line ordered against its state
+ */
+void raise_irq(struct cpu_cluster *cluster, int core)
+{
+	CPU_TRACE(5, "raise_irq core %d\n", core);
+	atomic_or(&cluster->cores[core]->pending_exceptions, EX_IRQ);
+	cpu_request_event(cluster->cores[core]);
+	cpu_wake(cluster->cores[core]);
+}
+
+void lower_irq(struct cpu_cluster *cluster, int core)
+{
+	CPU_TRACE(5, "lower_irq core %d\n", core);
+	atomic_and(&cluster->cores[core]->pending_exceptions, ~EX_IRQ);
+}
+
+void raise_fiq(struct cpu_cluster *cluster, int core)
+{
+	CPU_TRACE(5, "raise_fiq core %d\n", core);
+	atomic_or(&cluster->cores[core]->pending_exceptions, EX_FIQ);
+	cpu_request_event(cluster->cores[core]);
+	cpu_wake(cluster->cores[core]);
+}
+
+void lower_fiq(struct cpu_cluster *cluster, int core)
+{
+	CPU_TRACE(5, "lower_fiq core %d\n", core);
+	atomic_and(&cluster->cores[core]->pending_exceptions, ~EX_FIQ);
 }
 
 void signal_data_abort(armaddr_t addr)
 {
 	CPU_TRACE(4, "data abort at 0x%08x\n", addr);
-	atomic_or(&cpu.pending_exceptions, EX_DATA_ABT);
+	raise_exception(EX_DATA_ABT);
 }
 
 void signal_prefetch_abort(armaddr_t addr)
 {
 	CPU_TRACE(4, "prefetch abort at 0x%08x\n", addr);
-	atomic_or(&cpu.pending_exceptions, EX_PREFETCH);
+	raise_exception(EX_PREFETCH);
 }
 
 void install_coprocessor(int cp_num, struct arm_coprocessor *coproc)
@@ -462,24 +908,78 @@ int build_condition_table(void)
 	return 0;
 }
 
+/*
+ * the exceptions after reset, in the order they're taken in. the link register is the
+ * next instruction plus lr_offset, and one more in thumb. irq and fiq stay pending
+ * until whatever raised them lowers them. returns_to_pc is for the handlers that
+ * usually come back to cpu.pc, the next instruction or the one a prefetch abort
+ * stopped at, which is worth remembering on the return stack for them.
+ */
+static const struct exception_vector {
+	unsigned int ex;
+	int mode;
+	armaddr_t offset;
+	armaddr_t lr_offset;
+	bool stays_pending;
+	bool returns_to_pc;
+	int trace_level;
+	const char *name;
+} exception_vectors[] = {
+	{ EX_UNDEFINED, PSR_MODE_und, 0x4, 0, FALSE, TRUE, 3, "undefined instruction" },
+	{ EX_SWI, PSR_MODE_svc, 0x8, 0, FALSE, TRUE, 5, "swi" },
+	{ EX_PREFETCH, PSR_MODE_abt, 0xc, 4, FALSE, TRUE, 4, "prefetch abort" },
+	{ EX_DATA_ABT, PSR_MODE_abt, 0x10, 4, FALSE, FALSE, 4, "data abort" },
+	{ EX_FIQ, PSR_MODE_fiq, 0x1c, 4, TRUE, TRUE, 5, "FIQ" },
+	{ EX_IRQ, PSR_MODE_irq, 0x18, 4, TRUE, TRUE, 5, "IRQ" },
+};
+
+static void take_exception(const struct exception_vector *e)
+{
+	unsigned int thumb = get_condition(PSR_THUMB) ? 1 : 0;
+	reg_t cpsr = get_cpsr();
+
+	set_condition(PSR_THUMB, FALSE); // move to arm
+	set_condition(PSR_IRQ_MASK, TRUE);
+	set_cpu_mode(e->mode);
+
+	// after the switch, so they go in the right bank when the mode doesn't change
+	cpu.r[LR] = cpu.pc + e->lr_offset + thumb;
+	cpu.spsr = cpsr;
+
+	if(!e->stays_pending)
+		atomic_and_relaxed(&cpu.pending_exceptions, ~e->ex);
+
+	uop_exception_entry(cpu.exception_base + e->offset, e->returns_to_pc);
+
+	CPU_TRACE(e->trace_level, "EX: %s, lr 0x%08x\n", e->name, cpu.r[LR]);
+	inc_perf_counter(EXCEPTIONS);
+}
+
 // return value of true means something was processed, and thus a possible mode change
 bool process_pending_exceptions(void)
 {
 	// a irq or fiq may happen asychronously in another thread
+	unsigned int pending = atomic_load_relaxed(&cpu.pending_exceptions);
+	size_t i;
 
-	CPU_TRACE(5, "process_pending_exceptions: pending ex 0x%x\n", cpu.pending_exceptions);
+	CPU_TRACE(5, "process_pending_exceptions: pending ex 0x%x\n", pending);
 
 	// system reset
-	if(cpu.pending_exceptions & EX_RESET) {
+	if(pending & EX_RESET) {
 		// go to a default state
-		cpu.cpsr = PSR_IRQ_MASK | PSR_FIQ_MASK;
-		put_reg(PC, cpu.exception_base + 0x0);
+		if(cpu.cluster->has_entry_point) {
+			put_cpsr(PSR_IRQ_MASK | PSR_FIQ_MASK | ((cpu.cluster->entry_point & 1) ? PSR_THUMB : 0));
+			put_reg(PC, cpu.cluster->entry_point);
+		} else {
+			put_cpsr(PSR_IRQ_MASK | PSR_FIQ_MASK);
+			put_reg(PC, cpu.exception_base + 0x0);
+		}
 		cpu.curr_cp = NULL;
 
 		set_cpu_mode(PSR_MODE_svc);
 
 		// mask all other pending exceptions except for irq or fiq
-		atomic_and(&cpu.pending_exceptions, (EX_FIQ|EX_IRQ));
+		atomic_and_relaxed(&cpu.pending_exceptions, (EX_FIQ|EX_IRQ));
 
 		CPU_TRACE(3, "EX: cpu reset!\n");
 		inc_perf_counter(EXCEPTIONS);
@@ -487,134 +987,190 @@ bool process_pending_exceptions(void)
 		return TRUE;
 	}
 
-	// undefined instruction
-	if(cpu.pending_exceptions & EX_UNDEFINED) {
-		cpu.und_regs[1] = cpu.pc + (get_condition(PSR_THUMB) ? 1 : 0); // next instruction after the undefined instruction
-		cpu.und_regs[2] = cpu.cpsr;
-		put_reg(PC, cpu.exception_base + 0x4);
-
-		if(get_condition(PSR_THUMB))
-			cpu.curr_cp = NULL; // reset the codepage
-		set_condition(PSR_THUMB, FALSE); // move to arm
-		set_condition(PSR_IRQ_MASK, TRUE);
-		set_cpu_mode(PSR_MODE_und);
-
-		atomic_and(&cpu.pending_exceptions, ~EX_UNDEFINED);
-
-		CPU_TRACE(3, "EX: undefined instruction at 0x%08x\n", cpu.und_regs[1] - 4);
-		inc_perf_counter(EXCEPTIONS);
+	// irq and fiq wait for as long as they're masked
+	pending &= ~(cpu.cpsr & (PSR_IRQ_MASK|PSR_FIQ_MASK));
 
-		return TRUE;
+	for(i = 0; i < sizeof(exception_vectors) / sizeof(exception_vectors[0]); i++) {
+		if(pending & exception_vectors[i].ex) {
+			take_exception(&exception_vectors[i]);
+			return TRUE;
+		}
 	}
 
-	// SWI instruction
-	if(cpu.pending_exceptions & EX_SWI) {
-		cpu.svc_regs[1] = cpu.pc + (get_condition(PSR_THUMB) ? 1 : 0); // next instruction after the swi instruction
-		cpu.svc_regs[2] = cpu.cpsr;
-		put_reg(PC, cpu.exception_base + 0x8);
+	return FALSE;
+}
 
-		if(get_condition(PSR_THUMB))
-			cpu.curr_cp = NULL; // reset the codepage
-		set_condition(PSR_THUMB, FALSE); // move to arm
-		set_condition(PSR_IRQ_MASK, TRUE);
-		set_cpu_mode(PSR_MODE_svc);
+/* queue event to go off delay instructions from now on this core, replacing any earlier schedule */
+void cpu_schedule_event(struct cpu_event *event, dword delay, cpu_event_callback callback, void *arg)
+{
+	struct cpu_event **prev;
 
-		atomic_and(&cpu.pending_exceptions, ~EX_SWI);
+	if(event->scheduled)
+		cpu_cancel_event(event);
 
-		CPU_TRACE(5, "EX: swi\n");
-		inc_perf_counter(EXCEPTIONS);
+	event->when = cpu.guest_time + delay;
+	event->callback = callback;
+	event->arg = arg;
+	event->scheduled = TRUE;
 
-		return TRUE;
+	// keep the list sorted, there are only ever a handful
+	for(prev = &cpu.events; *prev; prev = &(*prev)->next) {
+		if((*prev)->when > event->when)
+			break;
 	}
+	event->next = *prev;
+	*prev = event;
 
-	// prefetch abort
-	if(cpu.pending_exceptions & EX_PREFETCH) {
-		cpu.abt_regs[1] = cpu.pc + 4 + (get_condition(PSR_THUMB) ? 1 : 0); // next instruction after the aborted instruction
-		cpu.abt_regs[2] = cpu.cpsr;
-		put_reg(PC, cpu.exception_base + 0xc);
-
-		if(get_condition(PSR_THUMB))
-			cpu.curr_cp = NULL; // reset the codepage
-		set_condition(PSR_THUMB, FALSE); // move to arm
-		set_condition(PSR_IRQ_MASK, TRUE);
-		set_cpu_mode(PSR_MODE_abt);
+	cpu.next_event = cpu.events->when;
+}
 
-		atomic_and(&cpu.pending_exceptions, ~EX_PREFETCH);
+void cpu_cancel_event(struct cpu_event *event)
+{
+	struct cpu_event **prev;
 
-		CPU_TRACE(4, "EX: prefetch abort\n");
-		inc_perf_counter(EXCEPTIONS);
+	if(!event->scheduled)
+		return;
 
-		return TRUE;
+	for(prev = &cpu.events; *prev; prev = &(*prev)->next) {
+		if(*prev == event) {
+			*prev = event->next;
+			break;
+		}
 	}
+	event->next = NULL;
+	event->scheduled = FALSE;
 
-	// data abort
-	if(cpu.pending_exceptions & EX_DATA_ABT) {
-		cpu.abt_regs[1] = cpu.pc + 4 + (get_condition(PSR_THUMB) ? 1 : 0); // +8 from faulting instruction
-		cpu.abt_regs[2] = cpu.cpsr;
-		put_reg(PC, cpu.exception_base + 0x10);
+	cpu.next_event = cpu.events ? cpu.events->when : ~(dword)0;
+}
 
-		if(get_condition(PSR_THUMB))
-			cpu.curr_cp = NULL; // reset the codepage
-		set_condition(PSR_THUMB, FALSE); // move to arm
-		set_condition(PSR_IRQ_MASK, TRUE);
-		set_cpu_mode(PSR_MODE_abt);
+/*
+ * called by the dispatcher between blocks when an event was requested or one is due.
+ * runs the due events, then takes the highest priority pending exception.
+ * returns FALSE if the next block can't start where it was going to.
+ */
+bool cpu_service_events(void)
+{
+	// clear the request before looking, anything raised from here on sets it again
+	atomic_set(&cpu.event_request, FALSE);
 
-		atomic_and(&cpu.pending_exceptions, ~EX_DATA_ABT);
+	while(cpu.events && cpu.events->when <= cpu.guest_time) {
+		struct cpu_event *event = cpu.events;
 
-		CPU_TRACE(4, "EX: data abort\n");
-		inc_perf_counter(EXCEPTIONS);
+		cpu.events = event->next;
+		event->next = NULL;
+		event->scheduled = FALSE;
+		cpu.next_event = cpu.events ? cpu.events->when : ~(dword)0;
 
-		return TRUE;
+		// may well schedule itself again
+		event->callback(event->arg);
 	}
 
-	// fiq
-	if(cpu.pending_exceptions & EX_FIQ && !(cpu.cpsr & PSR_FIQ_MASK)) {
-		cpu.fiq_regs[6] = cpu.pc + 4 + (get_condition(PSR_THUMB) ? 1 : 0); // address of next instruction + 4
-		cpu.fiq_regs[7] = cpu.cpsr;
-		put_reg(PC, cpu.exception_base + 0x1c);
+	if(cpu.restart_dispatch)
+		return FALSE;
 
-		if(get_condition(PSR_THUMB))
-			cpu.curr_cp = NULL; // reset the codepage
-		set_condition(PSR_THUMB, FALSE); // move to arm
-		set_condition(PSR_IRQ_MASK, TRUE);
-		set_cpu_mode(PSR_MODE_fiq);
+	if(atomic_load_relaxed(&cpu.pending_exceptions) & ~(cpu.cpsr & (PSR_IRQ_MASK|PSR_FIQ_MASK))) {
+		if(process_pending_exceptions()) {
+			// come back after the mode switch if there's something else waiting
+			if(atomic_load_relaxed(&cpu.pending_exceptions) & ~(cpu.cpsr & (PSR_IRQ_MASK|PSR_FIQ_MASK)))
+				cpu_request_event(&cpu);
+			return FALSE;
+		}
+	}
 
-		CPU_TRACE(5, "EX: FIQ\n");
-		inc_perf_counter(EXCEPTIONS);
+	return TRUE;
+}
 
-		return TRUE;
+/* this core's registers, mmu and cp15 into s, between blocks */
+void cpu_save_state(struct snapshot *s)
+{
+	struct snapshot_cpu state;
+	struct snapshot_mmu mmu_state;
+
+	memset(&state, 0, sizeof(state));
+	// a write to r15 doesn't get to cpu.pc until the start of the next block
+	state.pc = cpu.r15_dirty ? cpu.r[PC] : cpu.pc;
+	state.cpsr = get_cpsr();
+	memcpy(state.r, cpu.r, sizeof(state.r));
+	state.spsr = cpu.spsr;
+	state.old_cpsr = cpu.old_cpsr;
+	state.exception_base = cpu.exception_base;
+	state.pending_exceptions = atomic_load_relaxed(&cpu.pending_exceptions) & ~(EX_IRQ|EX_FIQ);
+	memcpy(state.usr_regs_low, cpu.usr_regs_low, sizeof(state.usr_regs_low));
+	memcpy(state.usr_regs, cpu.usr_regs, sizeof(state.usr_regs));
+	memcpy(state.irq_regs, cpu.irq_regs, sizeof(state.irq_regs));
+	memcpy(state.svc_regs, cpu.svc_regs, sizeof(state.svc_regs));
+	memcpy(state.abt_regs, cpu.abt_regs, sizeof(state.abt_regs));
+	memcpy(state.und_regs, cpu.und_regs, sizeof(state.und_regs));
+	memcpy(state.fiq_regs, cpu.fiq_regs, sizeof(state.fiq_regs));
+	state.guest_time = cpu.guest_time;
+	snapshot_put(s, SNAPSHOT_TAG_CPU(cpu.core_id), &state, sizeof(state));
+
+	mmu_save_state(&mmu_state);
+	snapshot_put(s, SNAPSHOT_TAG_MMU(cpu.core_id), &mmu_state, sizeof(mmu_state));
+
+	if(cpu.coproc[15].installed) {
+		struct snapshot_cp15 cp15_state;
+
+		cp15_save_state(&cp15_state);
+		snapshot_put(s, SNAPSHOT_TAG_CP15(cpu.core_id), &cp15_state, sizeof(cp15_state));
 	}
+}
 
-	// irq
-	if(cpu.pending_exceptions & EX_IRQ && !(cpu.cpsr & PSR_IRQ_MASK)) {
-		cpu.irq_regs[1] = cpu.pc + 4 + (get_condition(PSR_THUMB) ? 1 : 0); // address of next instruction + 4
-		cpu.irq_regs[2] = cpu.cpsr;
-		put_reg(PC, cpu.exception_base + 0x18);
+/*
+ * on the core's own thread as it comes up, in place of the reset it was going to take.
+ * it has no codepages yet, so there's nothing decoded against the old state to throw out.
+ */
+int cpu_restore_state(struct snapshot *s)
+{
+	const struct snapshot_cpu *state = snapshot_get(s, SNAPSHOT_TAG_CPU(cpu.core_id), sizeof(struct snapshot_cpu));
+	const struct snapshot_mmu *mmu_state = snapshot_get(s, SNAPSHOT_TAG_MMU(cpu.core_id), sizeof(struct snapshot_mmu));
+	const struct snapshot_cp15 *cp15_state = snapshot_get(s, SNAPSHOT_TAG_CP15(cpu.core_id), sizeof(struct snapshot_cp15));
 
-		if(get_condition(PSR_THUMB))
-			cpu.curr_cp = NULL; // reset the codepage
-		set_condition(PSR_THUMB, FALSE); // move to arm
-		set_condition(PSR_IRQ_MASK, TRUE);
-		set_cpu_mode(PSR_MODE_irq);
+	if(!state || !mmu_state) {
+		printf("cpu: core %d isn't in the snapshot, it starts from reset\n", cpu.core_id);
+		return -1;
+	}
 
-		CPU_TRACE(5, "EX: IRQ\n");
-		inc_perf_counter(EXCEPTIONS);
+	// the registers go back as they were, already banked for the mode in the cpsr
+	memcpy(cpu.r, state->r, sizeof(state->r));
+	put_reg(PC, state->pc);
+	cpu.pc = state->pc;
+	put_cpsr(state->cpsr);
+	cpu.spsr = state->spsr;
+	cpu.old_cpsr = state->old_cpsr;
+	memcpy(cpu.usr_regs_low, state->usr_regs_low, sizeof(state->usr_regs_low));
+	memcpy(cpu.usr_regs, state->usr_regs, sizeof(state->usr_regs));
+	memcpy(cpu.irq_regs, state->irq_regs, sizeof(state->irq_regs));
+	memcpy(cpu.svc_regs, state->svc_regs, sizeof(state->svc_regs));
+	memcpy(cpu.abt_regs, state->abt_regs, sizeof(state->abt_regs));
+	memcpy(cpu.und_regs, state->und_regs, sizeof(state->und_regs));
+	memcpy(cpu.fiq_regs, state->fiq_regs, sizeof(state->fiq_regs));
+	set_exception_base(state->exception_base);
+	cpu.guest_time = state->guest_time;
+	cpu.curr_cp = NULL;
+
+	// instead of the reset. the devices can already raise interrupts on the core, the
+	// interrupt lines come back from the pic
+	atomic_and_relaxed(&cpu.pending_exceptions, ~EX_RESET);
+	atomic_or_relaxed(&cpu.pending_exceptions, state->pending_exceptions & ~(EX_RESET|EX_IRQ|EX_FIQ));
+	cpu_request_event(&cpu);
+
+	if(cp15_state && cpu.coproc[15].installed)
+		cp15_restore_state(cp15_state);
+	mmu_restore_state(mmu_state); // picks the accessors for the restored mode too
 
-		return TRUE;
-	}
-	
-	return FALSE;	
+	return 0;
 }
 
 void dump_cpu(void)
 {
-	printf("cpu_dump: ins %d\n", get_instruction_count());
+	printf("cpu_dump: ins %llu\n", (unsigned long long)get_instruction_count());
 	printf("r0:   0x%08x r1:   0x%08x r2:   0x%08x r3:   0x%08x\n", cpu.r[0], cpu.r[1], cpu.r[2], cpu.r[3]);
 	printf("r4:   0x%08x r5:   0x%08x r6:   0x%08x r7:   0x%08x\n", cpu.r[4], cpu.r[5], cpu.r[6], cpu.r[7]);
 	printf("r8:   0x%08x r9:   0x%08x r10:  0x%08x r11:  0x%08x\n", cpu.r[8], cpu.r[9], cpu.r[10], cpu.r[11]);
 	printf("r12:  0x%08x sp:   0x%08x lr:   0x%08x r15:  0x%08x pc:   0x%08x\n", cpu.r[12], cpu.r[13], cpu.r[14], cpu.r[15], cpu.pc);
 	printf("cpsr: 0x%08x (%c %c%c%c%c) spsr: 0x%08x\n",
-		cpu.cpsr,
+		get_cpsr(),
 		get_condition(PSR_THUMB) ? 'T':' ',
 		get_condition(PSR_CC_NEG) ? 'N':' ',
 		get_condition(PSR_CC_ZERO) ? 'Z':' ',
@@ -657,6 +1213,7 @@ void panic_cpu(const char *fmt, ...)
 {
 	va_list ap;	
 
+	trace_flush();
 	printf("panic: ");
 
 	va_start(ap, fmt);
@@ -667,6 +1224,9 @@ void panic_cpu(const char *fmt, ...)
 
 	dump_sys();
 
+	// when fuzzing, afl sees the run crash
+	fuzz_crash();
+
     shutdown_cpu();
 }
 
@@ -30,7 +30,7 @@ typedef void (*decode_stage_func)(struct uop *op);
 
 static void bad_decode(struct uop *op)
 {
-	panic_cpu("bad_decode: ins 0x%08x at 0x%08x\n", op->undecoded.raw_instruction, cpu.pc - 4);
+	decode_panic("bad_decode: ins 0x%08x at 0x%08x\n", op->undecoded.raw_instruction, cpu.pc - 4);
 }
 
 // opcode[27:25] == 0b000
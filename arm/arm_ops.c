@@ -79,10 +79,8 @@ void op_branch(struct uop *op)
 	}
 
 	pc = get_reg(PC);
-	if(L) {
-		op->flags |= UOPBFLAGS_LINK;
-		op->b_immediate.link_target = pc - 4;
-	}
+	if(L)
+		op->flags |= UOPBFLAGS_LINK; // links to pc - 4, the next instruction
 	op->b_immediate.target = (pc + offset) & 0xfffffffe;
 
 	// this translates to branch immediate
@@ -93,10 +91,10 @@ void op_branch(struct uop *op)
 	op->cond = (ins >> COND_SHIFT) & COND_MASK;
 	if(op->cond == COND_SPECIAL)
 		op->cond = COND_AL;
-	op->b_immediate.target_cp = NULL; 
+	op->b_immediate.target_cp = CP_HANDLE_NONE;
 
 	CPU_TRACE(5, "\t\tbranch: L %d x %d offset %d pc 0x%x target 0x%x link target 0x%x\n", 
-		L?1:0, exchange?1:0, offset, pc, op->b_immediate.target, op->b_immediate.link_target);
+		L?1:0, exchange?1:0, offset, pc, op->b_immediate.target, L ? pc - 4 : 0);
 
 	if(exchange) {
 		op->opcode = B_IMMEDIATE; // B_IMMEDIATE_LOCAL is not allowed, since switching
@@ -126,6 +124,7 @@ void op_bx(struct uop *op)
 	op->flags |= UOPBFLAGS_SETTHUMB_COND;
 	op->b_reg.reg = Rm;
 	op->b_reg.link_offset = -4;
+	op->b_reg.target_cp = CP_HANDLE_NONE;
 
 	if(L)
 		op->flags |= UOPBFLAGS_LINK;
@@ -268,8 +267,9 @@ void op_bkpt(struct uop *op)
 
 	op->opcode = BKPT;
 	op->cond = COND_AL;
+	op->swi.comment = (BITS_SHIFT(ins, 19, 8) << 4) | BITS(ins, 3, 0);
 
-	CPU_TRACE(5, "bkpt 0x%x\n", ins & 0x00ffffff);	
+	CPU_TRACE(5, "bkpt 0x%x\n", op->swi.comment);	
 }
 
 void op_swi(struct uop *op)
@@ -278,6 +278,7 @@ void op_swi(struct uop *op)
 
 	op->opcode = SWI;
 	op->cond = (ins >> COND_SHIFT) & COND_MASK;
+	op->swi.comment = ins & 0x00ffffff;
 
 	CPU_TRACE(5, "swi 0x%x\n", ins & 0x00ffffff);	
 }
@@ -756,7 +757,7 @@ void op_load_store(struct uop *op)
 
 	// look for an unhandled form (user mode access)
 	if(!P && W) {
-		panic_cpu("op_load_store: user mode access unhandled\n");
+		decode_panic("op_load_store: user mode access unhandled\n");
 	}
 
 	// look for a particular case that decodes to a very simple uop
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+
+#include <sys/sys.h>
+#include <config.h>
+#include <arm/arm.h>
+#include <arm/mmu.h>
+#include <arm/uops.h>
+#include <arm/btrace.h>
+
+#define DEFAULT_BTRACE_SIZE 64 // MB per core
+
+struct btrace_file {
+	struct btrace_header *header;
+	size_t size;
+	struct btrace_core cores[MAX_CPU_CORES];
+};
+
+int start_btrace(struct cpu_cluster *cluster)
+{
+	struct btrace_file *bt;
+	struct btrace_header *header;
+	const char *path = get_config_key_string("trace", "file", NULL);
+	const char *records = get_config_key_string("trace", "records", "block");
+	uint64_t ring_records;
+	size_t names = 0, ring_offset;
+	char *p;
+	int i, fd;
+
+	if (!path)
+		return 0;
+
+	// the biggest power of 2 number of records that fits
+	ring_records = strtoull(get_config_key_string("trace", "size", "0"), NULL, 0) * 1024 * 1024 / sizeof(struct btrace_record);
+	if (ring_records == 0)
+		ring_records = DEFAULT_BTRACE_SIZE * 1024 * 1024 / sizeof(struct btrace_record);
+	while (ring_records & (ring_records - 1))
+		ring_records &= ring_records - 1;
+
+	for (i = 0; i < MAX_UOP_OPCODE; i++)
+		names += strlen(uop_opcode_to_str(i)) + 1;
+	if (cluster->symbol_file)
+		names += strlen(cluster->symbol_file) + 1;
+	ring_offset = (sizeof(struct btrace_header) + names + MMU_PAGESIZE - 1) & ~(size_t)(MMU_PAGESIZE - 1);
+
+	bt = calloc(1, sizeof(struct btrace_file));
+	bt->size = ring_offset + cluster->num_cores * ring_records * sizeof(struct btrace_record);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		SYS_TRACE(0, "trace: couldn't create %s\n", path);
+		free(bt);
+		return -1;
+	}
+	if (ftruncate(fd, bt->size) < 0 ||
+			(header = mmap(NULL, bt->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		SYS_TRACE(0, "trace: couldn't map %llu bytes of %s\n", (unsigned long long)bt->size, path);
+		close(fd);
+		free(bt);
+		return -1;
+	}
+	close(fd);
+
+	header->version = BTRACE_VERSION;
+	header->record_size = sizeof(struct btrace_record);
+	header->num_cores = cluster->num_cores;
+	header->num_opcodes = MAX_UOP_OPCODE;
+	header->names_offset = sizeof(struct btrace_header);
+	header->ring_records = ring_records;
+	header->ring_offset = ring_offset;
+	p = (char *)header + header->names_offset;
+	for (i = 0; i < MAX_UOP_OPCODE; i++) {
+		strcpy(p, uop_opcode_to_str(i));
+		p += strlen(p) + 1;
+	}
+	if (cluster->symbol_file) {
+		header->symbols_offset = p - (char *)header;
+		strcpy(p, cluster->symbol_file);
+	}
+	header->magic = BTRACE_MAGIC;
+	bt->header = header;
+
+	for (i = 0; i < cluster->num_cores; i++) {
+		struct btrace_core *t = &bt->cores[i];
+
+		t->ring = (struct btrace_record *)((byte *)header + ring_offset) + i * ring_records;
+		t->mask = ring_records - 1;
+		t->file_head = &header->head[i];
+		t->ins = !strcasecmp(records, "ins") || !strcasecmp(records, "mem");
+		t->mem = !strcasecmp(records, "mem");
+	}
+
+	SYS_TRACE(0, "trace: recording %s records to %s, %llu per core\n", records, path, (unsigned long long)ring_records);
+
+	cluster->btrace = bt;
+
+	return 0;
+}
+
+/* on each core's own thread as it starts, its dispatch loop and mmu accessors follow cpu.btrace */
+void btrace_core_started(struct cpu_cluster *cluster)
+{
+	if (!cluster->btrace)
+		return;
+
+	cpu.btrace = &cluster->btrace->cores[cpu.core_id];
+	mmu_select_access();
+}
+
+/* once the cores have stopped, make the last of their records count */
+void stop_btrace(struct cpu_cluster *cluster)
+{
+	struct btrace_file *bt = cluster->btrace;
+	int i;
+
+	if (!bt)
+		return;
+
+	for (i = 0; i < cluster->num_cores; i++)
+		*bt->cores[i].file_head = bt->cores[i].head;
+
+	munmap(bt->header, bt->size);
+	free(bt);
+	cluster->btrace = NULL;
+}
@@ -27,6 +27,7 @@
 #include <unistd.h>
 
 #include <sys/sys.h>
+#include <sys/snapshot.h>
 #include <arm/arm.h>
 #include <arm/mmu.h>
 #include <util/atomic.h>
@@ -37,7 +38,7 @@ struct system_coproc {
 	word process_id; // cr13
 };
 
-static struct system_coproc cp15;
+static __thread struct system_coproc cp15; // per core
 
 static void op_cp15_reg_transfer(word ins, void *data)
 {
@@ -67,7 +68,11 @@ static void op_cp15_reg_transfer(word ins, void *data)
 	switch(CRn) {
 		case 0: // id register
 			if(L) {
-				val = cp15.id;
+				// the arm11 mpcore cpu id register, so smp guests can tell the cores apart
+				if(opcode_2 == 5)
+					val = get_core_id();
+				else
+					val = cp15.id;
 				goto loadval;
 			}
 			goto done;
@@ -133,10 +138,18 @@ static void op_cp15_reg_transfer(word ins, void *data)
 			if (!L) {
 				switch(CRm) {
 					case 0: // wait for interrupt
+						cpu_idle(TRUE, 0);
 						goto done;
 					case 5: // various forms of ICache invalidation
 					case 7: // invalidate Icache + Dcache
-						flush_all_codepages();
+						if (opcode_2 == 1) {
+							// a single line by virtual address, only that page has to go.
+							// stores are caught as they happen, this is for anything that got
+							// into memory behind the cpu's back
+							flush_codepages_at(get_reg(Rd));
+						} else {
+							flush_all_codepages();
+						}
 						goto done;
 					case 6: // invalidate dcache
 						goto done;
@@ -163,14 +176,24 @@ static void op_cp15_reg_transfer(word ins, void *data)
 				goto donothing;
 			}
 		case 8: // tlb flush
-			if (L) {
+			if (!L) {
 				switch(CRm) {
 					case 7: // unified TLB 
 					case 5: // instruction TLB
-						flush_all_codepages();
-						// fall through
 					case 6: // data TLB
-						mmu_invalidate_tcache();
+						// the codepages are physically tagged and get revalidated, don't need to toss them
+						switch(opcode_2) {
+							case 1: // single entry by mva
+							case 3: // by mva, all asids
+								mmu_invalidate_tcache_page(get_reg(Rd));
+								break;
+							case 2: // on asid match
+								mmu_invalidate_tcache_asid(get_reg(Rd));
+								break;
+							default: // everything
+								mmu_invalidate_tcache();
+								break;
+						}
 						goto done;
 				}
 			}
@@ -183,6 +206,15 @@ static void op_cp15_reg_transfer(word ins, void *data)
 		case 12: // unpredictable
 			goto donothing;
 		case 13: // process id register
+			if(opcode_2 == 1) { // context id, the asid the mmu tags translations with
+				if(L) {
+					val = mmu_get_register(MMU_CONTEXT_ID_REG);
+					goto loadval;
+				} else {
+					mmu_set_register(MMU_CONTEXT_ID_REG, get_reg(Rd));
+					goto done;
+				}
+			}
 			if(L) {
 				val = cp15.process_id;
 				goto loadval;
@@ -299,6 +331,21 @@ static void op_cp15_load_store(word ins, void *data)
 }
 
 
+void cp15_save_state(struct snapshot_cp15 *state)
+{
+	state->id = cp15.id;
+	state->cr1 = cp15.cr1;
+	state->process_id = cp15.process_id;
+}
+
+/* the exception base and mmu flags cr1 sets are put back along with the rest of the core */
+void cp15_restore_state(const struct snapshot_cp15 *state)
+{
+	cp15.id = state->id;
+	cp15.cr1 = state->cr1;
+	cp15.process_id = state->process_id;
+}
+
 void install_cp15(void)
 {
 	struct arm_coprocessor cp15_coproc;
@@ -0,0 +1,1034 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <debug.h>
+#include <options.h>
+#include <config.h>
+#include <arm/arm.h>
+#include <arm/mmu.h>
+#include <arm/jit.h>
+
+#if WITH_JIT
+
+#include <sys/mman.h>
+
+/*
+ * A template translator for x86-64. Hot basic blocks in a codepage are turned
+ * into a straight line of host code. The guest registers a block uses the most
+ * live in host registers from its entry to its exit. The simple ALU and compare
+ * uops are emitted natively against them, and loads and stores probe the
+ * translation cache inline and go straight to host memory when it hits.
+ * Everything else is a direct call to the out of line uop handler, with the
+ * cached registers written back in front of it and reloaded after. Condition
+ * checks, pc bookkeeping and the data abort check after memory ops are done
+ * inline, so a block runs start to end without going back through the dispatcher.
+ */
+
+#define JIT_CODE_SIZE		(16*1024*1024)
+#define JIT_MAX_BLOCKS		65536
+#define JIT_HASHSIZE		16384
+#define JIT_MAX_BLOCK_LEN	256
+#define JIT_THRESHOLD		64		// executions of a block before it's translated
+#define JIT_MAX_INS_SIZE	512		// generous worst case bytes of host code for a single uop
+#define JIT_CACHE_REGS		4		// guest registers held in r12-r15
+
+struct jit_block {
+	struct jit_block *next;
+	struct uop *entry;
+	int count;
+	int (*code)(void);
+};
+
+static __thread struct jit_state {
+	byte *code;			// executable buffer, never writable at the same time
+	size_t code_used;
+	size_t page_size;
+
+	struct jit_block *blocks;
+	int blocks_used;
+	struct jit_block *hash[JIT_HASHSIZE];
+
+	int threshold;
+	const struct mmu_tcache_probe *probe;
+
+	// stats
+	int translations;
+	int flushes;
+} jit;
+
+__thread bool jit_enabled;
+__thread bool jit_native_ops = TRUE;
+
+/* host registers, by encoding */
+enum {
+	HOST_RAX = 0, HOST_RCX = 1, HOST_RDX = 2, HOST_RBX = 3,
+	HOST_RSI = 6, HOST_RDI = 7, HOST_R8 = 8, HOST_R12 = 12,
+};
+
+struct jit_emitter {
+	byte *start;
+	byte *ptr;
+
+	// guest registers kept in r12-r15 for the whole block
+	signed char slot[16];			// which one a guest register lives in, -1 if it's only in cpu.r[]
+	byte cached[JIT_CACHE_REGS];	// and the other way around
+	int num_cached;
+	unsigned int dirty;				// cached registers cpu.r[] is behind on, as a bitmap
+};
+
+#define CPU_OFFSET(field) ((int32_t)offsetof(struct cpu_struct, field))
+#define REG_OFFSET(reg) (CPU_OFFSET(r) + (int32_t)sizeof(reg_t) * (reg))
+#define REG_BIT(reg) (1u << (reg))
+
+static inline void emit8(struct jit_emitter *e, byte b)
+{
+	*e->ptr++ = b;
+}
+
+static inline void emit32(struct jit_emitter *e, uint32_t w)
+{
+	memcpy(e->ptr, &w, 4);
+	e->ptr += 4;
+}
+
+static inline void emit64(struct jit_emitter *e, uint64_t d)
+{
+	memcpy(e->ptr, &d, 8);
+	e->ptr += 8;
+}
+
+/* rbx holds &cpu for the whole block */
+
+// mov dword [rbx + disp], imm32
+static void emit_store_imm32(struct jit_emitter *e, int32_t disp, uint32_t imm)
+{
+	emit8(e, 0xc7); emit8(e, 0x83); emit32(e, disp); emit32(e, imm);
+}
+
+// mov rax, imm64; mov [rbx + disp], rax
+static void emit_store_imm64(struct jit_emitter *e, int32_t disp, uint64_t imm)
+{
+	emit8(e, 0x48); emit8(e, 0xb8); emit64(e, imm);
+	emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0x83); emit32(e, disp);
+}
+
+// mov eax, [rbx + disp]
+static void emit_load_eax(struct jit_emitter *e, int32_t disp)
+{
+	emit8(e, 0x8b); emit8(e, 0x83); emit32(e, disp);
+}
+
+// mov [rbx + disp], r32
+static void emit_store_field(struct jit_emitter *e, int hreg, int32_t disp)
+{
+	if(hreg >= 8)
+		emit8(e, 0x44);
+	emit8(e, 0x89); emit8(e, 0x83 | (hreg & 7) << 3); emit32(e, disp);
+}
+
+// <op> eax, imm32 (add 0x05, sub 0x2d, and 0x25, or 0x0d)
+static void emit_alu_eax_imm32(struct jit_emitter *e, byte opcode, uint32_t imm)
+{
+	emit8(e, opcode); emit32(e, imm);
+}
+
+// <op> r32, r/m32 between a host register and a guest register, wherever that lives
+// (mov 0x8b, add 0x03, sub 0x2b, and 0x23, or 0x0b)
+static void emit_guest_op(struct jit_emitter *e, byte opcode, int hreg, int reg)
+{
+	byte rex = 0x40 | (hreg >= 8 ? 0x04 : 0);
+
+	if(e->slot[reg] >= 0) {
+		// <op> r32, r1Xd
+		emit8(e, rex | 0x01);
+		emit8(e, opcode);
+		emit8(e, 0xc0 | (hreg & 7) << 3 | ((HOST_R12 + e->slot[reg]) & 7));
+	} else {
+		// <op> r32, [rbx + disp]
+		if(rex != 0x40)
+			emit8(e, rex);
+		emit8(e, opcode);
+		emit8(e, 0x83 | (hreg & 7) << 3);
+		emit32(e, REG_OFFSET(reg));
+	}
+}
+
+static void emit_get_reg(struct jit_emitter *e, int hreg, int reg)
+{
+	emit_guest_op(e, 0x8b, hreg, reg);
+}
+
+// the other direction, mov r1Xd, r32 or mov [rbx + disp], r32
+static void emit_put_reg(struct jit_emitter *e, int hreg, int reg)
+{
+	if(e->slot[reg] >= 0) {
+		emit8(e, 0x41 | (hreg >= 8 ? 0x04 : 0));
+		emit8(e, 0x89);
+		emit8(e, 0xc0 | (hreg & 7) << 3 | ((HOST_R12 + e->slot[reg]) & 7));
+		e->dirty |= REG_BIT(reg);
+	} else {
+		emit_store_field(e, hreg, REG_OFFSET(reg));
+	}
+}
+
+static void emit_put_reg_imm(struct jit_emitter *e, int reg, uint32_t imm)
+{
+	if(e->slot[reg] >= 0) {
+		// mov r1Xd, imm32
+		emit8(e, 0x41); emit8(e, 0xb8 | ((HOST_R12 + e->slot[reg]) & 7)); emit32(e, imm);
+		e->dirty |= REG_BIT(reg);
+	} else {
+		emit_store_imm32(e, REG_OFFSET(reg), imm);
+	}
+}
+
+/* bring cpu.r[] up to date with the cached registers, leaves them marked dirty for the caller to sort out */
+static void emit_cache_writeback(struct jit_emitter *e)
+{
+	int i;
+
+	for(i = 0; i < e->num_cached; i++) {
+		if(e->dirty & REG_BIT(e->cached[i])) {
+			// mov [rbx + disp], r1Xd
+			emit8(e, 0x44); emit8(e, 0x89); emit8(e, 0x83 | ((HOST_R12 + i) & 7) << 3); emit32(e, REG_OFFSET(e->cached[i]));
+		}
+	}
+}
+
+/* and pick them all up again after something that works on cpu.r[] */
+static void emit_cache_reload(struct jit_emitter *e)
+{
+	int i;
+
+	for(i = 0; i < e->num_cached; i++) {
+		// mov r1Xd, [rbx + disp]
+		emit8(e, 0x44); emit8(e, 0x8b); emit8(e, 0x83 | ((HOST_R12 + i) & 7) << 3); emit32(e, REG_OFFSET(e->cached[i]));
+	}
+}
+
+// <write back>; mov eax, count; pop r15..r12; pop rbx; ret
+static void emit_return(struct jit_emitter *e, int count)
+{
+	int i;
+
+	emit_cache_writeback(e);
+	emit8(e, 0xb8); emit32(e, count);
+	if(e->num_cached > 0) {
+		for(i = JIT_CACHE_REGS - 1; i >= 0; i--) {
+			emit8(e, 0x41); emit8(e, 0x58 | ((HOST_R12 + i) & 7));
+		}
+	}
+	emit8(e, 0x5b);
+	emit8(e, 0xc3);
+}
+
+// jcc rel32 with a placeholder, returns the address of the displacement to patch
+static byte *emit_jcc(struct jit_emitter *e, byte cc)
+{
+	byte *patch;
+
+	emit8(e, 0x0f); emit8(e, cc);
+	patch = e->ptr;
+	emit32(e, 0);
+	return patch;
+}
+
+// jmp rel32, patched the same way
+static byte *emit_jmp(struct jit_emitter *e)
+{
+	byte *patch;
+
+	emit8(e, 0xe9);
+	patch = e->ptr;
+	emit32(e, 0);
+	return patch;
+}
+
+static void patch_jcc(struct jit_emitter *e, byte *patch)
+{
+	int32_t rel = (int32_t)(e->ptr - (patch + 4));
+	memcpy(patch, &rel, 4);
+}
+
+/* put the pc state where the interpreter would have it right before running slot 'index' */
+static void emit_pc_sync(struct jit_emitter *e, struct uop *entry, armaddr_t pc, int pc_inc, int index)
+{
+	emit_store_imm32(e, CPU_OFFSET(pc), pc + index * pc_inc);
+	emit_store_imm32(e, REG_OFFSET(PC), pc + (index + 1) * pc_inc);
+	emit_store_imm64(e, CPU_OFFSET(cp_pc), (uint64_t)(uintptr_t)(entry + index));
+}
+
+static bool uop_is_memory(struct uop *op)
+{
+	switch(op->opcode) {
+		case LOAD_IMMEDIATE_WORD:
+		case LOAD_IMMEDIATE_HALFWORD:
+		case LOAD_IMMEDIATE_BYTE:
+		case LOAD_IMMEDIATE_OFFSET:
+		case LOAD_SCALED_REG_OFFSET:
+		case STORE_IMMEDIATE_OFFSET:
+		case STORE_SCALED_REG_OFFSET:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/*
+ * can the uop be emitted natively, and if so which guest registers it reads and
+ * writes, as bitmaps. everything else goes through the out of line handler.
+ */
+static bool native_uop_regs(struct uop *op, unsigned int *reads, unsigned int *writes)
+{
+	*reads = *writes = 0;
+
+	// the handlers do the op counting
+	if(!jit_native_ops)
+		return FALSE;
+
+	switch(op->opcode) {
+		case NOP:
+			return TRUE;
+		case MOV_IMM:
+			*writes = REG_BIT(op->simple_dp_imm.dest_reg);
+			return TRUE;
+		case MOV_REG:
+			*reads = REG_BIT(op->simple_dp_reg.source2_reg);
+			*writes = REG_BIT(op->simple_dp_reg.dest_reg);
+			return TRUE;
+		case ADD_IMM:
+		case AND_IMM:
+		case ORR_IMM:
+			*reads = REG_BIT(op->simple_dp_imm.source_reg);
+			*writes = REG_BIT(op->simple_dp_imm.dest_reg);
+			return TRUE;
+		case ADD_REG:
+			*reads = REG_BIT(op->simple_dp_reg.source_reg) | REG_BIT(op->simple_dp_reg.source2_reg);
+			*writes = REG_BIT(op->simple_dp_reg.dest_reg);
+			return TRUE;
+
+		// the rest stay away from the pc entirely
+		case MOV_IMM_PAIR:
+			*writes = REG_BIT(UOP_PAIR_REG(op, 0)) | REG_BIT(UOP_PAIR_REG(op, 1));
+			break;
+#if LAZY_FLAGS
+		case CMP_IMM_S:
+			*reads = REG_BIT(op->simple_dp_imm.source_reg);
+			break;
+		case ADD_IMM_S:
+			*reads = REG_BIT(op->simple_dp_imm.source_reg);
+			*writes = REG_BIT(op->simple_dp_imm.dest_reg);
+			break;
+		case CMP_REG_S:
+		case CMN_REG_S:
+			*reads = REG_BIT(op->simple_dp_reg.source_reg) | REG_BIT(op->simple_dp_reg.source2_reg);
+			break;
+		case ADD_REG_S:
+		case SUB_REG_S:
+			*reads = REG_BIT(op->simple_dp_reg.source_reg) | REG_BIT(op->simple_dp_reg.source2_reg);
+			*writes = REG_BIT(op->simple_dp_reg.dest_reg);
+			break;
+#endif
+		case LOAD_IMMEDIATE_WORD:
+		case LOAD_IMMEDIATE_HALFWORD:
+		case LOAD_IMMEDIATE_BYTE:
+			*writes = REG_BIT(op->load_immediate.target_reg);
+			break;
+		case LOAD_IMMEDIATE_OFFSET:
+		case STORE_IMMEDIATE_OFFSET:
+			if((op->flags & UOPLSFLAGS_SIZE_MASK) == UOPLSFLAGS_SIZE_DWORD)
+				return FALSE;
+			*reads = REG_BIT(op->load_store_immediate_offset.source_reg);
+			if(op->opcode == LOAD_IMMEDIATE_OFFSET)
+				*writes = REG_BIT(op->load_store_immediate_offset.target_reg);
+			else
+				*reads |= REG_BIT(op->load_store_immediate_offset.target_reg);
+			if(op->flags & UOPLSFLAGS_WRITEBACK)
+				*writes |= REG_BIT(op->load_store_immediate_offset.source_reg);
+			break;
+		case LOAD_SCALED_REG_OFFSET:
+		case STORE_SCALED_REG_OFFSET:
+			// only a plain lsl, and nothing post indexed (the handlers write back the unindexed base there)
+			if((op->flags & UOPLSFLAGS_SIZE_MASK) == UOPLSFLAGS_SIZE_DWORD || (op->flags & UOPLSFLAGS_POSTINDEX) ||
+			   op->load_store_scaled_reg_offset.shift_op != 0)
+				return FALSE;
+			*reads = REG_BIT(op->load_store_scaled_reg_offset.source_reg) | REG_BIT(op->load_store_scaled_reg_offset.source2_reg);
+			if(op->opcode == LOAD_SCALED_REG_OFFSET)
+				*writes = REG_BIT(op->load_store_scaled_reg_offset.target_reg);
+			else
+				*reads |= REG_BIT(op->load_store_scaled_reg_offset.target_reg);
+			if(op->flags & UOPLSFLAGS_WRITEBACK)
+				*writes |= REG_BIT(op->load_store_scaled_reg_offset.source_reg);
+			break;
+		default:
+			return FALSE;
+	}
+
+	return !((*reads | *writes) & REG_BIT(PC));
+}
+
+/* does a natively emitted uop use r15 as a source */
+static bool uop_reads_pc(struct uop *op)
+{
+	unsigned int reads, writes;
+
+	return native_uop_regs(op, &reads, &writes) && (reads & REG_BIT(PC));
+}
+
+/* emit host code for the simple uops */
+static void emit_native_uop(struct jit_emitter *e, struct uop *op)
+{
+	switch(op->opcode) {
+		case NOP:
+			break;
+		case MOV_IMM:
+			emit_put_reg_imm(e, op->simple_dp_imm.dest_reg, op->simple_dp_imm.immediate);
+			break;
+		case MOV_IMM_PAIR:
+			emit_put_reg_imm(e, UOP_PAIR_REG(op, 0), op->mov_imm_pair.immediate);
+			emit_put_reg_imm(e, UOP_PAIR_REG(op, 1), op->mov_imm_pair.immediate2);
+			break;
+		case MOV_REG:
+			emit_get_reg(e, HOST_RAX, op->simple_dp_reg.source2_reg);
+			emit_put_reg(e, HOST_RAX, op->simple_dp_reg.dest_reg);
+			break;
+		case ADD_IMM:
+		case AND_IMM:
+		case ORR_IMM: {
+			static const byte alu_opcode[] = { [ADD_IMM] = 0x05, [AND_IMM] = 0x25, [ORR_IMM] = 0x0d };
+
+			emit_get_reg(e, HOST_RAX, op->simple_dp_imm.source_reg);
+			emit_alu_eax_imm32(e, alu_opcode[op->opcode], op->simple_dp_imm.immediate);
+			emit_put_reg(e, HOST_RAX, op->simple_dp_imm.dest_reg);
+			break;
+		}
+		case ADD_REG:
+			emit_get_reg(e, HOST_RAX, op->simple_dp_reg.source_reg);
+			emit_guest_op(e, 0x03, HOST_RAX, op->simple_dp_reg.source2_reg);
+			emit_put_reg(e, HOST_RAX, op->simple_dp_reg.dest_reg);
+			break;
+#if LAZY_FLAGS
+		// the flags are left pending, the same way set_sub_flags() and set_add_flags() leave them
+		case CMP_IMM_S:
+		case ADD_IMM_S: {
+			bool sub = op->opcode == CMP_IMM_S;
+
+			emit_get_reg(e, HOST_RAX, op->simple_dp_imm.source_reg);
+			emit_store_field(e, HOST_RAX, CPU_OFFSET(flags_a));
+			emit_alu_eax_imm32(e, sub ? 0x2d : 0x05, op->simple_dp_imm.immediate);
+			emit_store_field(e, HOST_RAX, CPU_OFFSET(flags_result));
+			emit_store_imm32(e, CPU_OFFSET(flags_b), op->simple_dp_imm.immediate);
+			emit_store_imm32(e, CPU_OFFSET(flags_op), sub ? LAZY_FLAGS_SUB : LAZY_FLAGS_ADD);
+			if(!sub)
+				emit_put_reg(e, HOST_RAX, op->simple_dp_imm.dest_reg);
+			break;
+		}
+		case CMP_REG_S:
+		case CMN_REG_S:
+		case ADD_REG_S:
+		case SUB_REG_S: {
+			bool sub = op->opcode == CMP_REG_S || op->opcode == SUB_REG_S;
+
+			emit_get_reg(e, HOST_RAX, op->simple_dp_reg.source_reg);
+			emit_get_reg(e, HOST_RCX, op->simple_dp_reg.source2_reg);
+			emit_store_field(e, HOST_RAX, CPU_OFFSET(flags_a));
+			emit_store_field(e, HOST_RCX, CPU_OFFSET(flags_b));
+			// sub eax, ecx or add eax, ecx
+			emit8(e, sub ? 0x29 : 0x01); emit8(e, 0xc8);
+			emit_store_field(e, HOST_RAX, CPU_OFFSET(flags_result));
+			emit_store_imm32(e, CPU_OFFSET(flags_op), sub ? LAZY_FLAGS_SUB : LAZY_FLAGS_ADD);
+			if(op->opcode == ADD_REG_S || op->opcode == SUB_REG_S)
+				emit_put_reg(e, HOST_RAX, op->simple_dp_reg.dest_reg);
+			break;
+		}
+#endif
+		default:
+			ASSERT(0);
+	}
+}
+
+#if LAZY_FLAGS
+/* out of line check for the conditions the inline code leaves alone, doesn't touch cpu.r[] */
+static int jit_check_condition(int cond)
+{
+	return check_condition(cond);
+}
+#endif
+
+/*
+ * emit the test in front of a conditional uop. with a pending flag setting op the
+ * common conditions are worked out from it directly, the way check_condition()
+ * does: N and Z from the result, and after a compare the x86 flags of a cmp of
+ * the same operands are the arm ones, with C inverted. cpsr is only looked at
+ * when it's up to date. the branches that skip the uop go in skips[].
+ */
+static int emit_cond_check(struct jit_emitter *e, byte cond, byte **skips)
+{
+	int n = 0;
+#if LAZY_FLAGS
+	// jcc opcodes taken when the condition fails, 0 if it needs more than one test
+	static const byte result_jcc[16] = {
+		[COND_EQ] = 0x85, [COND_NE] = 0x84, [COND_MI] = 0x89, [COND_PL] = 0x88,
+	};
+	static const byte sub_jcc[16] = {
+		[COND_CS] = 0x82, [COND_CC] = 0x83, [COND_HI] = 0x86, [COND_LS] = 0x87,
+		[COND_GE] = 0x8c, [COND_LT] = 0x8d, [COND_GT] = 0x8e, [COND_LE] = 0x8f,
+	};
+	byte *table, *call, *body[2];
+	int bodies = 0;
+
+	// cmp dword [rbx + flags_op], LAZY_FLAGS_NONE; je table
+	emit8(e, 0x83); emit8(e, 0xbb); emit32(e, CPU_OFFSET(flags_op)); emit8(e, LAZY_FLAGS_NONE);
+	table = emit_jcc(e, 0x84);
+
+	if(result_jcc[cond]) {
+		// cmp dword [rbx + flags_result], 0; j<!cond> skip
+		emit8(e, 0x83); emit8(e, 0xbb); emit32(e, CPU_OFFSET(flags_result)); emit8(e, 0);
+		skips[n++] = emit_jcc(e, result_jcc[cond]);
+	} else {
+		if(sub_jcc[cond]) {
+			// cmp dword [rbx + flags_op], LAZY_FLAGS_SUB; jne call
+			// mov eax, [rbx + flags_a]; cmp eax, [rbx + flags_b]; j<!cond> skip; jmp body
+			emit8(e, 0x83); emit8(e, 0xbb); emit32(e, CPU_OFFSET(flags_op)); emit8(e, LAZY_FLAGS_SUB);
+			call = emit_jcc(e, 0x85);
+			emit_load_eax(e, CPU_OFFSET(flags_a));
+			emit8(e, 0x3b); emit8(e, 0x83); emit32(e, CPU_OFFSET(flags_b));
+			skips[n++] = emit_jcc(e, sub_jcc[cond]);
+			body[bodies++] = emit_jmp(e);
+			patch_jcc(e, call);
+		}
+
+		// mov edi, cond; mov rax, jit_check_condition; call rax; test eax, eax; jz skip
+		emit8(e, 0xbf); emit32(e, cond);
+		emit8(e, 0x48); emit8(e, 0xb8); emit64(e, (uint64_t)(uintptr_t)jit_check_condition);
+		emit8(e, 0xff); emit8(e, 0xd0);
+		emit8(e, 0x85); emit8(e, 0xc0);
+		skips[n++] = emit_jcc(e, 0x84);
+	}
+	body[bodies++] = emit_jmp(e);
+	patch_jcc(e, table);
+#endif
+
+	// mov eax, [cpsr]; shr eax, 28; movzx eax, word [rbx + rax*2 + condition_table]; bt eax, cond; jnc skip
+	emit_load_eax(e, CPU_OFFSET(cpsr));
+	emit8(e, 0xc1); emit8(e, 0xe8); emit8(e, COND_SHIFT);
+	emit8(e, 0x0f); emit8(e, 0xb7); emit8(e, 0x84); emit8(e, 0x43); emit32(e, CPU_OFFSET(condition_table));
+	emit8(e, 0x0f); emit8(e, 0xba); emit8(e, 0xe0); emit8(e, cond);
+	skips[n++] = emit_jcc(e, 0x83);
+#if LAZY_FLAGS
+	while(bodies > 0)
+		patch_jcc(e, body[--bodies]);
+#endif
+
+	return n;
+}
+
+static void emit_handler_call(struct jit_emitter *e, struct uop *op)
+{
+	// mov rdi, op; mov rax, handler; call rax
+	emit8(e, 0x48); emit8(e, 0xbf); emit64(e, (uint64_t)(uintptr_t)op);
+	emit8(e, 0x48); emit8(e, 0xb8); emit64(e, (uint64_t)(uintptr_t)uop_handler_funcs[op->opcode]);
+	emit8(e, 0xff); emit8(e, 0xd0);
+}
+
+/*
+ * after a handler that can take a data abort, leave the block if it did, or if a
+ * store tossed our own codepage. the handler saw cpu.r[], nothing is dirty.
+ */
+static void emit_fault_check(struct jit_emitter *e, int count)
+{
+	// test dword [rbx + pending_exceptions], EX_DATA_ABT; jnz out
+	// cmp qword [rbx + curr_cp], 0; jne next
+	// out: <return>
+	byte *out, *next;
+
+	emit8(e, 0xf7); emit8(e, 0x83); emit32(e, CPU_OFFSET(pending_exceptions)); emit32(e, EX_DATA_ABT);
+	out = emit_jcc(e, 0x85);
+	emit8(e, 0x48); emit8(e, 0x83); emit8(e, 0xbb); emit32(e, CPU_OFFSET(curr_cp)); emit8(e, 0);
+	next = emit_jcc(e, 0x85);
+	patch_jcc(e, out);
+	emit_return(e, count);
+	patch_jcc(e, next);
+}
+
+/*
+ * loads and stores. the address is worked out into eax, and what gets written back
+ * to the base into r8d, then the most recently used way of its translation cache
+ * set is checked the way mmu_tcache_lookup() does it. a hit goes straight to host
+ * memory. a miss moves the page to the front of its set if it can, for next time,
+ * and has the handler do the access against an up to date cpu.r[].
+ */
+static void emit_memory_uop(struct jit_emitter *e, struct uop *op, struct uop *entry, armaddr_t pc, int pc_inc, int index, int count)
+{
+	const struct mmu_tcache_probe *probe = jit.probe;
+	bool load = op->opcode != STORE_IMMEDIATE_OFFSET && op->opcode != STORE_SCALED_REG_OFFSET;
+	bool sign = load && (op->flags & UOPLSFLAGS_SIGN_EXTEND);
+	bool writeback = FALSE;
+	int size, target, base = 0;
+	byte *misses[3], *fill, *done;
+	int num_misses = 0;
+	unsigned int dirty;
+
+	// the pc relative forms have it in the opcode instead
+	switch(op->flags & UOPLSFLAGS_SIZE_MASK) {
+		case UOPLSFLAGS_SIZE_WORD: size = 4; break;
+		case UOPLSFLAGS_SIZE_HALFWORD: size = 2; break;
+		default: size = 1; break;
+	}
+
+	switch(op->opcode) {
+		case LOAD_IMMEDIATE_WORD:
+		case LOAD_IMMEDIATE_HALFWORD:
+		case LOAD_IMMEDIATE_BYTE:
+			target = op->load_immediate.target_reg;
+			size = op->opcode == LOAD_IMMEDIATE_WORD ? 4 : op->opcode == LOAD_IMMEDIATE_HALFWORD ? 2 : 1;
+			sign = sign && size != 4;
+
+			// mov eax, address
+			emit8(e, 0xb8); emit32(e, op->load_immediate.address);
+			break;
+		case LOAD_IMMEDIATE_OFFSET:
+		case STORE_IMMEDIATE_OFFSET: {
+			word offset = op->load_store_immediate_offset.offset;
+
+			target = op->load_store_immediate_offset.target_reg;
+			base = op->load_store_immediate_offset.source_reg;
+			writeback = op->flags & UOPLSFLAGS_WRITEBACK;
+
+			emit_get_reg(e, HOST_RAX, base);
+			if(op->flags & UOPLSFLAGS_POSTINDEX) {
+				// lea r8d, [rax + offset]
+				if(writeback) {
+					emit8(e, 0x44); emit8(e, 0x8d); emit8(e, 0x80); emit32(e, offset);
+				}
+			} else {
+				if(offset != 0)
+					emit_alu_eax_imm32(e, 0x05, offset);
+				// mov r8d, eax
+				if(writeback) {
+					emit8(e, 0x41); emit8(e, 0x89); emit8(e, 0xc0);
+				}
+			}
+			break;
+		}
+		case LOAD_SCALED_REG_OFFSET:
+		case STORE_SCALED_REG_OFFSET:
+			target = op->load_store_scaled_reg_offset.target_reg;
+			base = op->load_store_scaled_reg_offset.source_reg;
+			writeback = op->flags & UOPLSFLAGS_WRITEBACK;
+
+			// ecx = index << shift, then add or subtract it
+			emit_get_reg(e, HOST_RAX, base);
+			emit_get_reg(e, HOST_RCX, op->load_store_scaled_reg_offset.source2_reg);
+			if(op->load_store_scaled_reg_offset.shift_immediate != 0) {
+				emit8(e, 0xc1); emit8(e, 0xe1); emit8(e, op->load_store_scaled_reg_offset.shift_immediate);
+			}
+			emit8(e, (op->flags & UOPLSFLAGS_NEGATE_OFFSET) ? 0x29 : 0x01); emit8(e, 0xc8);
+			if(writeback) {
+				emit8(e, 0x41); emit8(e, 0x89); emit8(e, 0xc0);
+			}
+			break;
+		default:
+			ASSERT(0);
+			return;
+	}
+
+	// mov edi, value
+	if(!load)
+		emit_get_reg(e, HOST_RDI, target);
+
+	// unaligned accesses are left to the handler. test al, size - 1; jnz miss
+	if(size > 1) {
+		emit8(e, 0xa8); emit8(e, size - 1);
+		misses[num_misses++] = emit_jcc(e, 0x85);
+	}
+
+	// rcx = the set. mov ecx, eax; shr ecx, page shift; and ecx, set_mask; shl ecx, set_shift; mov rdx, sets; add rcx, rdx
+	emit8(e, 0x89); emit8(e, 0xc1);
+	emit8(e, 0xc1); emit8(e, 0xe9); emit8(e, MMU_PAGESIZE_SHIFT);
+	emit8(e, 0x81); emit8(e, 0xe1); emit32(e, probe->set_mask);
+	emit8(e, 0xc1); emit8(e, 0xe1); emit8(e, probe->set_shift);
+	emit8(e, 0x48); emit8(e, 0xba); emit64(e, (uint64_t)(uintptr_t)probe->sets);
+	emit8(e, 0x48); emit8(e, 0x01); emit8(e, 0xd1);
+
+	// the tag of the first way. mov edx, eax; and edx, ~(page size - 1); mov rsi, tag_base; or rdx, [rsi];
+	// cmp rdx, [rcx + tag]; jne fill
+	emit8(e, 0x89); emit8(e, 0xc2);
+	emit8(e, 0x81); emit8(e, 0xe2); emit32(e, ~(MMU_PAGESIZE - 1));
+	emit8(e, 0x48); emit8(e, 0xbe); emit64(e, (uint64_t)(uintptr_t)probe->tag_base);
+	emit8(e, 0x48); emit8(e, 0x0b); emit8(e, 0x16);
+	emit8(e, 0x48); emit8(e, 0x3b); emit8(e, 0x91); emit32(e, probe->tag_offset);
+	fill = emit_jcc(e, 0x85);
+
+	// the permission, for the mode the core is in by now. mov rdx, &access; mov edx, [rdx]; test [rcx + flags], edx; jz miss
+	emit8(e, 0x48); emit8(e, 0xba); emit64(e, (uint64_t)(uintptr_t)(load ? &probe->read_access : &probe->write_access));
+	emit8(e, 0x8b); emit8(e, 0x12);
+	emit8(e, 0x85); emit8(e, 0x91); emit32(e, probe->flags_offset);
+	misses[num_misses++] = emit_jcc(e, 0x84);
+
+	// and somewhere in host memory. mov rdx, [rcx + delta]; test rdx, rdx; jz miss
+	emit8(e, 0x48); emit8(e, 0x8b); emit8(e, 0x91); emit32(e, load ? probe->read_delta_offset : probe->write_delta_offset);
+	emit8(e, 0x48); emit8(e, 0x85); emit8(e, 0xd2);
+	misses[num_misses++] = emit_jcc(e, 0x84);
+
+	if(load) {
+		// mov eax, [rax + rdx], or movzx/movsx eax, word/byte [rax + rdx]
+		if(size == 4) {
+			emit8(e, 0x8b);
+		} else {
+			emit8(e, 0x0f);
+			emit8(e, size == 2 ? (sign ? 0xbf : 0xb7) : (sign ? 0xbe : 0xb6));
+		}
+		emit8(e, 0x04); emit8(e, 0x10);
+		emit_put_reg(e, HOST_RAX, target);
+	} else {
+		// mov [rax + rdx], edi/di/dil
+		if(size == 2)
+			emit8(e, 0x66);
+		else if(size == 1)
+			emit8(e, 0x40);
+		emit8(e, size == 1 ? 0x88 : 0x89); emit8(e, 0x3c); emit8(e, 0x10);
+	}
+	if(writeback)
+		emit_put_reg(e, HOST_R8, base);
+	done = emit_jmp(e);
+
+	// fill: mov edi, eax; mov esi, write; mov rax, mmu_tcache_fill; call rax
+	patch_jcc(e, fill);
+	emit8(e, 0x89); emit8(e, 0xc7);
+	emit8(e, 0xbe); emit32(e, !load);
+	emit8(e, 0x48); emit8(e, 0xb8); emit64(e, (uint64_t)(uintptr_t)mmu_tcache_fill);
+	emit8(e, 0xff); emit8(e, 0xd0);
+
+	// miss: the handler does it over again from the top
+	while(num_misses > 0)
+		patch_jcc(e, misses[--num_misses]);
+	dirty = e->dirty;
+	emit_cache_writeback(e);
+	e->dirty = 0;
+	emit_pc_sync(e, entry, pc, pc_inc, index + 1);
+	emit_handler_call(e, op);
+	emit_cache_reload(e);
+	emit_fault_check(e, count + 1);
+	e->dirty = dirty;
+
+	patch_jcc(e, done);
+}
+
+/*
+ * the native uops of the block share up to four host registers for the guest
+ * registers they use the most. a cached register is loaded once on the way in and
+ * written back on the way out, but also around every handler call in between, so
+ * it's only worth it for one that's used more often than that.
+ */
+static void jit_alloc_cache(struct jit_emitter *e, struct uop *entry)
+{
+	int uses[16];
+	int calls = 0;
+	int i, reg;
+
+	memset(uses, 0, sizeof(uses));
+	for(i = 0; i < JIT_MAX_BLOCK_LEN; i++) {
+		struct uop *op = entry + i;
+		unsigned int reads, writes;
+
+		// the same stopping points as the translation
+		if(op->opcode == DECODE_ME_ARM || op->opcode == DECODE_ME_THUMB || op->opcode >= MAX_UOP_OPCODE ||
+		   uop_handler_funcs[op->opcode] == NULL)
+			break;
+
+		if(native_uop_regs(op, &reads, &writes)) {
+			for(reg = 0; reg < PC; reg++)
+				uses[reg] += ((reads >> reg) & 1) + ((writes >> reg) & 1);
+			// a miss in the memory ops goes around the cache too, but that's the rare case
+		} else if(!(op->block_flags & UOP_BLOCK_END)) {
+			calls++;
+		}
+
+		if(op->block_flags & UOP_BLOCK_END)
+			break;
+		if(op->opcode == MOV_IMM_PAIR)
+			i++;
+	}
+
+	memset(e->slot, -1, sizeof(e->slot));
+	e->num_cached = 0;
+	e->dirty = 0;
+	while(e->num_cached < JIT_CACHE_REGS) {
+		int best = -1;
+
+		for(reg = 0; reg < PC; reg++) {
+			if(e->slot[reg] < 0 && uses[reg] > calls + 1 && (best < 0 || uses[reg] > uses[best]))
+				best = reg;
+		}
+		if(best < 0)
+			break;
+
+		e->slot[best] = e->num_cached;
+		e->cached[e->num_cached++] = best;
+	}
+}
+
+/*
+ * the pages of the code buffer are either writable or executable, never both.
+ * a block's worth of them are opened up for writing while it's emitted and
+ * turned back into code before anything jumps into them.
+ */
+static bool jit_protect(byte *start, size_t len, int prot)
+{
+	uintptr_t first = (uintptr_t)start & ~(jit.page_size - 1);
+	uintptr_t last = ((uintptr_t)start + len + jit.page_size - 1) & ~(jit.page_size - 1);
+
+	return mprotect((void *)first, last - first, prot) == 0;
+}
+
+static bool jit_translate(struct jit_block *b)
+{
+	struct jit_emitter e;
+	struct uop *op;
+	armaddr_t pc = cpu.pc;
+	int pc_inc = cpu.curr_cp->pc_inc;
+	int i;			// codepage slot
+	int count = 0;	// uops run, what the dispatcher counts instructions by
+
+	if(jit.code_used + JIT_MAX_BLOCK_LEN * JIT_MAX_INS_SIZE > JIT_CODE_SIZE)
+		return FALSE;
+
+	e.start = e.ptr = jit.code + jit.code_used;
+	if(!jit_protect(e.start, JIT_MAX_BLOCK_LEN * JIT_MAX_INS_SIZE, PROT_READ|PROT_WRITE))
+		return FALSE;
+
+	jit_alloc_cache(&e, b->entry);
+
+	// push rbx; push r12..r15 (all four, the stack stays 16 byte aligned for the calls); mov rbx, &cpu
+	emit8(&e, 0x53);
+	if(e.num_cached > 0) {
+		for(i = 0; i < JIT_CACHE_REGS; i++) {
+			emit8(&e, 0x41); emit8(&e, 0x50 | ((HOST_R12 + i) & 7));
+		}
+	}
+	emit8(&e, 0x48); emit8(&e, 0xbb); emit64(&e, (uint64_t)(uintptr_t)&cpu);
+	emit_cache_reload(&e);
+
+	for(i = 0; i < JIT_MAX_BLOCK_LEN; i++, count++) {
+		byte *skips[4];
+		int num_skips = 0;
+		unsigned int reads, writes;
+		bool native, memory;
+
+		op = b->entry + i;
+
+		// stop in front of anything that hasn't been decoded yet, the interpreter gets it
+		if(op->opcode == DECODE_ME_ARM || op->opcode == DECODE_ME_THUMB || op->opcode >= MAX_UOP_OPCODE ||
+		   uop_handler_funcs[op->opcode] == NULL)
+			break;
+
+		// native ops don't look at the pc, everything else gets the interpreter's view of it and of cpu.r[]
+		native = native_uop_regs(op, &reads, &writes);
+		memory = native && uop_is_memory(op);
+		if(!native) {
+			emit_cache_writeback(&e);
+			e.dirty = 0;
+			emit_pc_sync(&e, b->entry, pc, pc_inc, i + 1);
+		} else if(uop_reads_pc(op)) {
+			emit_store_imm32(&e, REG_OFFSET(PC), pc + (i + 2) * pc_inc);
+		}
+
+		if(op->cond != COND_AL)
+			num_skips = emit_cond_check(&e, op->cond, skips);
+
+		if(memory) {
+			emit_memory_uop(&e, op, b->entry, pc, pc_inc, i, count);
+		} else if(native) {
+			emit_native_uop(&e, op);
+		} else {
+			emit_handler_call(&e, op);
+			if(!(op->block_flags & UOP_BLOCK_END))
+				emit_cache_reload(&e);
+		}
+
+		while(num_skips > 0)
+			patch_jcc(&e, skips[--num_skips]);
+
+		if(op->block_flags & UOP_BLOCK_END) {
+			// whatever ended the block has already set up the next pc
+			emit_return(&e, count + 1);
+			break;
+		}
+
+		// a store into our own codepage tosses it
+		if(!memory && (op->block_flags & UOP_BLOCK_MAYFAULT))
+			emit_fault_check(&e, count + 1);
+
+		// a fused pair steps over the next slot itself
+		if(op->opcode == MOV_IMM_PAIR)
+			i++;
+	}
+
+	if(count == 0) {
+		jit_protect(e.start, JIT_MAX_BLOCK_LEN * JIT_MAX_INS_SIZE, PROT_READ|PROT_EXEC);
+		return FALSE; // nothing worth running
+	}
+
+	if(i >= JIT_MAX_BLOCK_LEN || !(op->block_flags & UOP_BLOCK_END) || op->opcode == DECODE_ME_ARM || op->opcode == DECODE_ME_THUMB) {
+		// fell off the end of what we translated, leave the pc pointing at the next slot
+		emit_pc_sync(&e, b->entry, pc, pc_inc, i);
+		emit_return(&e, count);
+	}
+
+	if(!jit_protect(e.start, JIT_MAX_BLOCK_LEN * JIT_MAX_INS_SIZE, PROT_READ|PROT_EXEC))
+		return FALSE;
+
+	b->code = (int (*)(void))e.start;
+	jit.code_used += e.ptr - e.start;
+	jit.code_used = (jit.code_used + 15) & ~15;
+	jit.translations++;
+
+	UOP_TRACE(4, "jit: translated block at pc 0x%x, %d uops, %d registers cached, %d bytes\n",
+		pc, count, e.num_cached, (int)(e.ptr - e.start));
+
+	return TRUE;
+}
+
+static inline unsigned int jit_hash(struct uop *op)
+{
+	return ((uintptr_t)op / sizeof(struct uop)) % JIT_HASHSIZE;
+}
+
+void jit_flush(void)
+{
+	if(!jit_enabled)
+		return;
+
+	UOP_TRACE(4, "jit: flushing %d blocks, %d bytes of code\n", jit.blocks_used, (int)jit.code_used);
+
+	memset(jit.hash, 0, sizeof(jit.hash));
+	jit.blocks_used = 0;
+	jit.code_used = 0;
+	jit.flushes++;
+}
+
+void jit_invalidate(struct uop *start, int len)
+{
+	int i;
+
+	if(!jit_enabled)
+		return;
+
+	// the code space isn't reclaimed until the next flush, just unhook the blocks
+	for(i = 0; i < len; i++) {
+		struct jit_block **prev = &jit.hash[jit_hash(start + i)];
+
+		while(*prev != NULL) {
+			if((*prev)->entry == start + i)
+				*prev = (*prev)->next;
+			else
+				prev = &(*prev)->next;
+		}
+	}
+}
+
+int jit_execute(struct uop *op)
+{
+	struct jit_block *b;
+	unsigned int hash;
+
+	hash = jit_hash(op);
+	for(b = jit.hash[hash]; b != NULL; b = b->next) {
+		if(b->entry == op)
+			break;
+	}
+
+	if(likely(b != NULL)) {
+		if(likely(b->code != NULL))
+			return b->code();
+	} else {
+		if(jit.blocks_used == JIT_MAX_BLOCKS)
+			jit_flush();
+
+		// start tracking this block
+		b = &jit.blocks[jit.blocks_used++];
+		b->entry = op;
+		b->count = 0;
+		b->code = NULL;
+		b->next = jit.hash[hash];
+		jit.hash[hash] = b;
+	}
+
+	if(++b->count < jit.threshold)
+		return 0;
+
+	if(!jit_translate(b)) {
+		if(jit.code_used + JIT_MAX_BLOCK_LEN * JIT_MAX_INS_SIZE > JIT_CODE_SIZE) {
+			// out of code space, start over
+			jit_flush();
+		} else {
+			// probably starts on an undecoded instruction, try again later
+			b->count = 0;
+		}
+		return 0;
+	}
+
+	return b->code();
+}
+
+void jit_init(void)
+{
+	jit_enabled = get_config_key_bool("cpu", "jit", FALSE);
+	if(!jit_enabled)
+		return;
+
+	memset(&jit, 0, sizeof(jit));
+	jit.threshold = atoi(get_config_key_string("cpu", "jit_threshold", "0"));
+	if(jit.threshold <= 0)
+		jit.threshold = JIT_THRESHOLD;
+
+	jit.page_size = sysconf(_SC_PAGESIZE);
+	jit.probe = mmu_get_tcache_probe();
+	jit.code = mmap(NULL, JIT_CODE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	jit.blocks = calloc(JIT_MAX_BLOCKS, sizeof(struct jit_block));
+	if(jit.code == MAP_FAILED || jit.blocks == NULL) {
+		printf("jit: failed to allocate translation cache, disabling\n");
+		jit_enabled = FALSE;
+		return;
+	}
+
+	printf("jit: enabled, threshold %d\n", jit.threshold);
+}
+
+void jit_shutdown(void)
+{
+	if(!jit_enabled)
+		return;
+
+	munmap(jit.code, JIT_CODE_SIZE);
+	free(jit.blocks);
+	jit_enabled = FALSE;
+}
+
+#endif
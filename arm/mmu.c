@@ -24,13 +24,17 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 
 #include <sys/sys.h>
+#include <sys/fastmem.h>
+#include <sys/snapshot.h>
 #include <arm/arm.h>
 #include <arm/mmu.h>
 #include <util/atomic.h>
 #include <util/endian.h>
+#include <arm/btrace.h>
 
 #if COUNT_MMU_OPS
 #define mmu_inc_perf_counter(x) inc_perf_counter(x)
@@ -58,19 +62,75 @@ enum mmu_domain_check_results {
 	CLIENT,
 };
 
-#define TCACHE_PRESENT     0x1
-#define TCACHE_WRITE       0x2
-#define TCACHE_PRIVILEDGED 0x4
+/* what the page walk allowed, worked out once for every mode so a page only gets walked once */
+#define TCACHE_USER_READ   0x1
+#define TCACHE_USER_WRITE  0x2
+#define TCACHE_PRIV_READ   0x4
+#define TCACHE_PRIV_WRITE  0x8
+#define TCACHE_ALL_ACCESS  0xf
+#define TCACHE_CODE        0x10 // page with decoded instructions, stores are kept off the fast path
 
+/*
+ * an entry is only live if the generation in the top half of its tag matches the
+ * current one, so flushing the whole cache is a single increment. entries are
+ * padded out to a cache line each so a probe never straddles two.
+ */
 struct translation_cache_entry {
-	unsigned int flags;
-	armaddr_t vaddr;
-	armaddr_t paddr_delta; // difference between the vaddr and paddr (only need an add to come up with the real address)
+	dword tag; // generation << 32 | vaddr | asid | TCACHE_TAG_VALID, so a lookup is a single compare
 	unsigned long hostaddr_delta; // if nonzero, add this to the addr and cast to void * to get the address in the host's memory space	
-};
+	unsigned long write_hostaddr_delta; // same for stores, zero for code pages so they can be caught
+	armaddr_t paddr_delta; // difference between the vaddr and paddr (only need an add to come up with the real address)
+	unsigned int flags;
+	const struct mem_region *region; // what the page is in the memory map, for when it can't be done through host memory
+} __attribute__((aligned(64)));
 
-#define NUM_TCACHE_ENTRIES 4096
 #define TCACHE_PAGESIZE MMU_PAGESIZE
+#define TCACHE_ASID_MASK  0xff
+#define TCACHE_TAG_VALID  0x100
+
+/*
+ * each bank is set associative, with the most recently used way of a set kept
+ * in slot 0 so the common case is still one compare. whatever falls off the end
+ * of a set goes into a small victim buffer before it's lost for good.
+ */
+#define NUM_TCACHE_SETS 1024
+#define NUM_TCACHE_WAYS 4
+#define NUM_TCACHE_VICTIMS 8
+
+struct translation_cache_bank {
+	struct translation_cache_entry set[NUM_TCACHE_SETS][NUM_TCACHE_WAYS];
+	struct translation_cache_entry victim[NUM_TCACHE_VICTIMS];
+	unsigned int next_victim;
+};
+
+/*
+ * sections and large pages are also remembered whole, in a small fully associative
+ * array that's looked in when a 4KB page misses. a hit there fills in the 4KB entry
+ * without walking the tables, so a 1MB section is walked once instead of 256 times.
+ */
+#define NUM_TCACHE_BIG 16
+#define TCACHE_SECTION_SIZE (1024*1024)
+#define TCACHE_LARGE_PAGE_SIZE (64*1024)
+
+struct translation_cache_big_entry {
+	dword tag; // same as a 4KB entry, with the vaddr aligned to the size
+	armaddr_t size_mask; // ~(size - 1)
+	armaddr_t paddr_delta;
+	unsigned int flags;
+};
+
+/*
+ * the first level descriptors of the last few megabytes that pointed at a second
+ * level table, along with where that table is in host memory. a miss on a page next
+ * to one that was just walked goes straight to the second level.
+ */
+#define NUM_PTABLE_CACHE 8
+
+struct ptable_cache_entry {
+	dword tag; // same as a tcache entry, for the megabyte
+	word ttable_entry;
+	const byte *ptable; // host address of the second level table, NULL if it isn't plain memory
+};
 
 /* ARM mmu, specifically the arm926ejs variant */
 
@@ -78,27 +138,103 @@ struct mmu_state_struct {
 	bool present;
 	word flags;
 	armaddr_t translation_table;
+	const byte *translation_table_host; // NULL if the table isn't in plain memory
 	word domain_access_control;
 	word fault_status;
 	word fault_address;
 	
 	bool fault;
 
-	struct translation_cache_entry tcache_user_read[NUM_TCACHE_ENTRIES];
-	struct translation_cache_entry tcache_user_write[NUM_TCACHE_ENTRIES];
-	struct translation_cache_entry tcache_priviledged_read[NUM_TCACHE_ENTRIES];
-	struct translation_cache_entry tcache_priviledged_write[NUM_TCACHE_ENTRIES];
+	/* translations are tagged with the low bits of the context id (armv6 style asid) */
+	word context_id;
+	armaddr_t asid;
+	bool asid_switching; // the guest has used the context id, so ttb writes don't flush
+
+	/* bumped on every full flush, tag_base is what a live entry for the current asid has on top of its vaddr */
+	word generation;
+	dword tag_base;
+
+	struct translation_cache_bank tcache;
+	struct translation_cache_big_entry big[NUM_TCACHE_BIG];
+	unsigned int next_big;
+
+	struct ptable_cache_entry ptable_cache[NUM_PTABLE_CACHE];
+
+	/* for translated code's inline lookups */
+	struct mmu_tcache_probe probe;
+
+	/* the machine's fastmem window while nothing needs checking (no translation, no alignment faults) */
+	byte *fastmem;
+
+	/* one bit per physical page, set if there may be codepages decoded out of it */
+	word code_pages[(1 << (32 - MMU_PAGESIZE_SHIFT)) / 32];
 };
 
-static struct mmu_state_struct mmu; // defaults to off
+static __thread struct mmu_state_struct mmu; // per core, defaults to off
+
+static void update_tcache_tag_base(void)
+{
+	mmu.tag_base = ((dword)mmu.generation << 32) | mmu.asid | TCACHE_TAG_VALID;
+}
+
+static void update_fastmem(void)
+{
+#if WITH_FASTMEM
+	if((!mmu.present || !(mmu.flags & MMU_ENABLED_FLAG)) && !(mmu.flags & MMU_ALIGNMENT_FAULT_FLAG))
+		mmu.fastmem = sys_get_fastmem();
+	else
+		mmu.fastmem = NULL;
+#endif
+}
+
+/* the table is 16KB aligned, so it never straddles two of the sys layer's banks */
+static void resolve_translation_table(void)
+{
+	mmu.translation_table_host = sys_get_mem_ptr(mmu.translation_table & ~0x3fff);
+}
 
 void mmu_init(int with_mmu)
 {
 	memset(&mmu, 0, sizeof(mmu));
+	update_tcache_tag_base();
 
 	if(with_mmu) {
 		mmu.present = TRUE;
+		resolve_translation_table();
 	}
+	update_fastmem();
+	mmu_select_access();
+}
+
+void mmu_save_state(struct snapshot_mmu *state)
+{
+	state->present = mmu.present;
+	state->flags = mmu.flags;
+	state->translation_table = mmu.translation_table;
+	state->domain_access_control = mmu.domain_access_control;
+	state->fault_status = mmu.fault_status;
+	state->fault_address = mmu.fault_address;
+	state->context_id = mmu.context_id;
+	state->asid_switching = mmu.asid_switching;
+}
+
+/* on a core that's just come up, so there's nothing cached to throw away */
+void mmu_restore_state(const struct snapshot_mmu *state)
+{
+	mmu.present = state->present;
+	mmu.flags = state->flags;
+	mmu.translation_table = state->translation_table;
+	mmu.domain_access_control = state->domain_access_control;
+	mmu.fault_status = state->fault_status;
+	mmu.fault_address = state->fault_address;
+	mmu.context_id = state->context_id;
+	mmu.asid = state->context_id & TCACHE_ASID_MASK;
+	mmu.asid_switching = state->asid_switching;
+
+	resolve_translation_table();
+	update_tcache_tag_base();
+	update_fastmem();
+	mmu_select_access();
 }
 
 word mmu_set_flags(word flags)
@@ -108,6 +244,8 @@ word mmu_set_flags(word flags)
 	if (flags != oldflags) {
 		MMU_TRACE(5, "mmu_set_flags: flags 0x%08x\n", flags);
 		mmu.flags = flags;
+		update_fastmem();
+		mmu_select_access();
 
 		/* it may have changed S or R or mmu enable bit, flush our translation cache */
 		mmu_invalidate_tcache();
@@ -128,7 +266,14 @@ void mmu_set_register(enum mmu_registers reg, word val)
 	switch(reg) {
 		case MMU_TRANS_TABLE_REG:
 			mmu.translation_table = val;
-			mmu_invalidate_tcache(); // TLB flush
+			resolve_translation_table();
+			if(mmu.asid_switching) {
+				/* the asid tags keep the old address space's translations apart, the
+				 * guest flushes explicitly if it's reusing one */
+				codepage_translations_changed();
+			} else {
+				mmu_invalidate_tcache(); // TLB flush
+			}
 			break;
 		case MMU_DOMAIN_ACCESS_CONTROL_REG:
 			mmu.domain_access_control = val;
@@ -140,6 +285,13 @@ void mmu_set_register(enum mmu_registers reg, word val)
 		case MMU_FAULT_ADDRESS_REG:
 			mmu.fault_address = val;
 			break;
+		case MMU_CONTEXT_ID_REG:
+			mmu.context_id = val;
+			mmu.asid = val & TCACHE_ASID_MASK;
+			mmu.asid_switching = TRUE;
+			update_tcache_tag_base();
+			codepage_translations_changed(); // same virtual addresses, different translations
+			break;
 	}
 }
 
@@ -155,85 +307,284 @@ word mmu_get_register(enum mmu_registers reg)
 			return mmu.fault_status;
 		case MMU_FAULT_ADDRESS_REG:
 			return mmu.fault_address;
+		case MMU_CONTEXT_ID_REG:
+			return mmu.context_id;
 	}
 	return 0;
 }
 
 /* translation cache code */
-void mmu_invalidate_tcache(void)
+static void invalidate_tcache_bank(struct translation_cache_bank *bank)
 {
-	int i;
+	int i, j;
 
-	for(i = 0; i < NUM_TCACHE_ENTRIES; i++)  {
-		mmu.tcache_user_read[i].flags = 0;
+	for(i = 0; i < NUM_TCACHE_SETS; i++) {
+		for(j = 0; j < NUM_TCACHE_WAYS; j++)
+			bank->set[i][j].tag = 0;
 	}
-	for(i = 0; i < NUM_TCACHE_ENTRIES; i++)  {
-		mmu.tcache_priviledged_read[i].flags = 0;
-	}
-	for(i = 0; i < NUM_TCACHE_ENTRIES; i++)  {
-		mmu.tcache_user_write[i].flags = 0;
-	}
-	for(i = 0; i < NUM_TCACHE_ENTRIES; i++)  {
-		mmu.tcache_priviledged_write[i].flags = 0;
+	for(i = 0; i < NUM_TCACHE_VICTIMS; i++)
+		bank->victim[i].tag = 0;
+}
+
+static void invalidate_tcache_big(void)
+{
+	int i;
+
+	for(i = 0; i < NUM_TCACHE_BIG; i++)
+		mmu.big[i].tag = 0;
+}
+
+void mmu_invalidate_tcache(void)
+{
+	inc_perf_counter(MMU_TLB_FLUSH);
+
+	/* codepages are kept across this, but have to be translated again before they're used */
+	codepage_translations_changed();
+
+	/* everything tagged with the old generation is dead. only when it wraps
+	 * around could something that old look live again, so wipe it properly then */
+	mmu.generation++;
+	update_tcache_tag_base();
+	if(unlikely(mmu.generation == 0)) {
+		invalidate_tcache_bank(&mmu.tcache);
+		invalidate_tcache_big();
+		memset(mmu.ptable_cache, 0, sizeof(mmu.ptable_cache));
 	}
 }
 
+static inline bool tcache_entry_live(struct translation_cache_entry *ent)
+{
+	return (ent->tag & TCACHE_TAG_VALID) && (word)(ent->tag >> 32) == mmu.generation;
+}
+
+static inline bool tcache_big_entry_live(struct translation_cache_big_entry *ent)
+{
+	return (ent->tag & TCACHE_TAG_VALID) && (word)(ent->tag >> 32) == mmu.generation;
+}
+
 static inline int tcache_hash(armaddr_t vaddr)
 {
-	return (vaddr / TCACHE_PAGESIZE) % NUM_TCACHE_ENTRIES;
+	return (vaddr / TCACHE_PAGESIZE) % NUM_TCACHE_SETS;
 }
 
-static inline struct translation_cache_entry *lookup_tcache_entry(armaddr_t vaddr, bool write, bool priviledged)
+static inline dword tcache_tag(armaddr_t vaddr_page)
 {
-	struct translation_cache_entry *tcache;
+	return mmu.tag_base | vaddr_page;
+}
 
-	/* This inefficient looking switch of the tcache bank to search in is actually
-	 * somewhat faster than trying to calculate the bank dynamically.
-	 * In every case this routine is emitted, the write boolean is hard coded, so half
+static inline armaddr_t tcache_entry_vaddr(struct translation_cache_entry *ent)
+{
+	return (armaddr_t)ent->tag & ~(TCACHE_PAGESIZE-1);
+}
+
+static inline unsigned int tcache_access(bool write, bool priviledged)
+{
+	/* In every case this routine is emitted, the write boolean is hard coded, so half
 	 * of these tests go away immediately, and the other test is pretty easy to make
 	 */
 	if(write) {
-		if(priviledged) {
-			tcache = mmu.tcache_priviledged_write;
-		} else {
-			tcache = mmu.tcache_user_write;
-		}
+		return priviledged ? TCACHE_PRIV_WRITE : TCACHE_USER_WRITE;
 	} else {
-		if(priviledged) {
-			tcache = mmu.tcache_priviledged_read;
-		} else {
-			tcache = mmu.tcache_user_read;
+		return priviledged ? TCACHE_PRIV_READ : TCACHE_USER_READ;
+	}
+}
+
+/* make room in slot 0 of a set, pushing the least recently used way out to the victim buffer */
+static void tcache_push_set(struct translation_cache_bank *bank, struct translation_cache_entry *set)
+{
+	int i;
+
+	if(tcache_entry_live(&set[NUM_TCACHE_WAYS-1])) {
+		bank->victim[bank->next_victim] = set[NUM_TCACHE_WAYS-1];
+		bank->next_victim = (bank->next_victim + 1) % NUM_TCACHE_VICTIMS;
+	}
+	for(i = NUM_TCACHE_WAYS - 1; i > 0; i--)
+		set[i] = set[i-1];
+}
+
+/* the entry wasn't in slot 0, look through the rest of the set and the victims */
+static struct translation_cache_entry *lookup_tcache_entry_slow(struct translation_cache_bank *bank, struct translation_cache_entry *set, dword tag)
+{
+	struct translation_cache_entry temp;
+	int i;
+
+	for(i = 1; i < NUM_TCACHE_WAYS; i++) {
+		if(set[i].tag == tag) {
+			/* move it to the front */
+			temp = set[i];
+			for(; i > 0; i--)
+				set[i] = set[i-1];
+			set[0] = temp;
+			return &set[0];
+		}
+	}
+
+	for(i = 0; i < NUM_TCACHE_VICTIMS; i++) {
+		if(bank->victim[i].tag == tag) {
+			/* pull it back into the set, whatever gets pushed out takes its place */
+			temp = bank->victim[i];
+			bank->victim[i].tag = 0;
+			bank->next_victim = i;
+			tcache_push_set(bank, set);
+			set[0] = temp;
+			return &set[0];
 		}
-	}		
+	}
 
-	return &tcache[tcache_hash(vaddr)];
+	return NULL;
 }
 
-static void add_tcache_entry(armaddr_t vaddr, armaddr_t paddr, bool write, bool priviledged)
+static inline bool is_code_page(armaddr_t paddr)
+{
+	unsigned int page = paddr >> MMU_PAGESIZE_SHIFT;
+
+	return (mmu.code_pages[page / 32] & (1U << (page % 32))) != 0;
+}
+
+static struct translation_cache_entry *add_tcache_entry(armaddr_t vaddr, armaddr_t paddr, unsigned int access)
 {
 	struct translation_cache_entry *ent;
 	void *host_ptr;
+	dword tag = tcache_tag(vaddr);
 	
-	/* fill out the entry */
-	ent = lookup_tcache_entry(vaddr, write, priviledged);
-	ent->vaddr = vaddr;
-
-	/* ask the sys layer if we can get a direct pointer */
-	host_ptr = sys_get_mem_ptr(paddr);
+	/* fill out the entry, it goes in as the most recently used way of its set.
+	 * it may already be there if it was missing the permission for this access */
+	struct translation_cache_entry *set = mmu.tcache.set[tcache_hash(vaddr)];
+	if(set[0].tag != tag && lookup_tcache_entry_slow(&mmu.tcache, set, tag) == NULL)
+		tcache_push_set(&mmu.tcache, set);
+	ent = &set[0];
+	ent->tag = tag;
+
+	/* ask the sys layer what's there, and if we can get a direct pointer */
+	ent->region = sys_get_mem_region(paddr);
+	host_ptr = sys_region_get_ptr(ent->region, paddr);
 	if(host_ptr != NULL)
 		ent->hostaddr_delta = (unsigned long)host_ptr - vaddr; // bit of pointer math here to speed up the eventual translation
 	else
 		ent->hostaddr_delta = 0;
+	ent->write_hostaddr_delta = ent->hostaddr_delta;
 	ent->paddr_delta = paddr - vaddr;
-	ent->flags = 0;
-	if(write)
-		ent->flags |= TCACHE_WRITE;
-	if(priviledged)
-		ent->flags |= TCACHE_PRIVILEDGED;
-	ent->flags |= TCACHE_PRESENT;
+	ent->flags = access;
+
+	/* stores into decoded instructions have to go through the slow path so they can be caught */
+	if(is_code_page(paddr)) {
+		ent->write_hostaddr_delta = 0;
+		ent->flags |= TCACHE_CODE;
+	}
+
+//	printf("add_tcache_entry: vaddr 0x%x paddr 0x%x access 0x%x hostaddr_delta 0x%x paddr_delta 0x%x\n",
+//		vaddr, paddr, access, ent->hostaddr_delta, ent->paddr_delta);
+
+	return ent;
+}
+
+/* remember a whole section or large page, the 4KB entry for the page being touched is added separately */
+static void add_tcache_big_entry(armaddr_t vaddr, armaddr_t paddr, armaddr_t size, unsigned int access)
+{
+	struct translation_cache_big_entry *ent = NULL;
+	dword tag = tcache_tag(vaddr & ~(size-1));
+	int i;
+
+	/* replace it if it's already there, it may have been missing a permission */
+	for(i = 0; i < NUM_TCACHE_BIG; i++) {
+		if(mmu.big[i].tag == tag && mmu.big[i].size_mask == ~(size-1)) {
+			ent = &mmu.big[i];
+			break;
+		}
+	}
+	if(!ent) {
+		ent = &mmu.big[mmu.next_big];
+		mmu.next_big = (mmu.next_big + 1) % NUM_TCACHE_BIG;
+	}
 
-//	printf("add_tcache_entry: vaddr 0x%x paddr 0x%x write %d priviledged %d hostaddr_delta 0x%x paddr_delta 0x%x\n",
-//		vaddr, paddr, write, priviledged, ent->hostaddr_delta, ent->paddr_delta);
+	ent->tag = tag;
+	ent->size_mask = ~(size-1);
+	ent->paddr_delta = (paddr & ~(size-1)) - (vaddr & ~(size-1));
+	ent->flags = access;
+}
+
+/* the 4KB page missed, see if it's in a section or large page we already walked */
+static struct translation_cache_entry *lookup_tcache_big_entry(armaddr_t vaddr_page)
+{
+	int i;
+
+	for(i = 0; i < NUM_TCACHE_BIG; i++) {
+		struct translation_cache_big_entry *ent = &mmu.big[i];
+
+		if(ent->tag == tcache_tag(vaddr_page & ent->size_mask)) {
+			mmu_inc_perf_counter(MMU_BIG_PAGE_HIT);
+			return add_tcache_entry(vaddr_page, vaddr_page + ent->paddr_delta, ent->flags);
+		}
+	}
+
+	return NULL;
+}
+
+static void protect_tcache_entry(struct translation_cache_entry *ent, armaddr_t paddr)
+{
+	if(tcache_entry_live(ent) && tcache_entry_vaddr(ent) + ent->paddr_delta == paddr) {
+		ent->write_hostaddr_delta = 0;
+		ent->flags |= TCACHE_CODE;
+	}
+}
+
+static void protect_tcache_entries(struct translation_cache_bank *bank, armaddr_t paddr)
+{
+	int i, j;
+
+	for(i = 0; i < NUM_TCACHE_SETS; i++) {
+		for(j = 0; j < NUM_TCACHE_WAYS; j++)
+			protect_tcache_entry(&bank->set[i][j], paddr);
+	}
+	for(i = 0; i < NUM_TCACHE_VICTIMS; i++)
+		protect_tcache_entry(&bank->victim[i], paddr);
+}
+
+/*
+ * the codepage loader is about to decode instructions out of this physical page.
+ * knock any write translations for it off the fast path, there may be more than
+ * one if the page is mapped at several virtual addresses.
+ */
+void mmu_mark_code_page(armaddr_t paddr)
+{
+	unsigned int page = paddr >> MMU_PAGESIZE_SHIFT;
+
+	if(is_code_page(paddr))
+		return;
+
+	MMU_TRACE(5, "mmu_mark_code_page: paddr 0x%x\n", paddr);
+
+	mmu.code_pages[page / 32] |= (1U << (page % 32));
+
+	paddr &= ~(TCACHE_PAGESIZE-1);
+	protect_tcache_entries(&mmu.tcache, paddr);
+#if WITH_FASTMEM
+	sys_fastmem_protect(paddr, TRUE);
+#endif
+}
+
+/*
+ * a store is going into a page that was marked as code. throw away whatever was
+ * decoded out of it, and if we came in through a tcache entry put it back on the fast path.
+ */
+static void mmu_code_page_write(struct translation_cache_entry *ent, armaddr_t paddr)
+{
+	unsigned int page = paddr >> MMU_PAGESIZE_SHIFT;
+
+	if(is_code_page(paddr)) {
+		MMU_TRACE(5, "mmu_code_page_write: paddr 0x%x\n", paddr);
+
+		mmu.code_pages[page / 32] &= ~(1U << (page % 32));
+		invalidate_codepages_phys(paddr & ~(TCACHE_PAGESIZE-1));
+#if WITH_FASTMEM
+		sys_fastmem_protect(paddr, FALSE);
+#endif
+	}
+
+	if(ent) {
+		ent->write_hostaddr_delta = ent->hostaddr_delta;
+		ent->flags &= ~TCACHE_CODE;
+	}
 }
 
 static enum mmu_domain_check_results mmu_domain_check(int domain)
@@ -287,8 +638,30 @@ static enum mmu_permission_results mmu_permission_check(int AP, int SR, bool pri
 	}
 }
 
+/* what a client domain's AP bits allow, in every mode */
+static unsigned int mmu_access_check(int AP)
+{
+	int SR = BITS_SHIFT(mmu.flags, 9, 8);
+	unsigned int access = 0;
+
+	switch(mmu_permission_check(AP, SR, TRUE)) {
+		case READ_WRITE: access |= TCACHE_PRIV_WRITE; // fallthrough
+		case READ_ONLY: access |= TCACHE_PRIV_READ; // fallthrough
+		case NO_ACCESS: break;
+	}
+	switch(mmu_permission_check(AP, SR, FALSE)) {
+		case READ_WRITE: access |= TCACHE_USER_WRITE; // fallthrough
+		case READ_ONLY: access |= TCACHE_USER_READ; // fallthrough
+		case NO_ACCESS: break;
+	}
+
+	return access;
+}
+
 static void mmu_signal_fault(int status, int domain, armaddr_t address, enum mmu_access_type type)
 {
+	inc_perf_counter(MMU_SLOW_FAULT);
+
 	mmu.fault_status = status | (domain << 4);
 	mmu.fault_address = address;
 	if(type == INSTRUCTION_FETCH)
@@ -301,6 +674,7 @@ static void mmu_signal_fault(int status, int domain, armaddr_t address, enum mmu
 static void mmu_2nd_level_translate(unsigned int ptable_entry, armaddr_t address, armaddr_t *translated_address, enum mmu_access_type type, bool write, bool priviledged, int domain)
 {
 	int subpage = 0;
+	unsigned int access = TCACHE_ALL_ACCESS;
 
 	MMU_TRACE(7, "\t2nd level translate: ptable_entry 0x%08x\n", ptable_entry);
 	
@@ -340,8 +714,8 @@ static void mmu_2nd_level_translate(unsigned int ptable_entry, armaddr_t address
 		int AP = (ptable_entry >> (subpage * 2 + 4)) & 0x3;
 	
 		/* do perm check on AP bits */
-		enum mmu_permission_results allowed_perms = mmu_permission_check(AP, BITS_SHIFT(mmu.flags, 9, 8), priviledged);
-		if(allowed_perms == NO_ACCESS || (allowed_perms == READ_ONLY && write)) {
+		access = mmu_access_check(AP);
+		if(!(access & tcache_access(write, priviledged))) {
 			/* page permission fault */
 			mmu_signal_fault(0xf, domain, address, type);
 			return;
@@ -351,30 +725,71 @@ static void mmu_2nd_level_translate(unsigned int ptable_entry, armaddr_t address
 	}
 	
 	/* add a translation entry */
-	add_tcache_entry(address & ~(TCACHE_PAGESIZE-1), *translated_address & ~(TCACHE_PAGESIZE-1), write, priviledged);
+	add_tcache_entry(address & ~(TCACHE_PAGESIZE-1), *translated_address & ~(TCACHE_PAGESIZE-1), access);
+
+	/* a large page can be remembered whole if its four subpages all have the same permissions */
+	if((ptable_entry & 0x3) == 1 &&
+			(domain_check == MANAGER || BITS_SHIFT(ptable_entry, 11, 4) == ((ptable_entry >> 4) & 0x3) * 0x55))
+		add_tcache_big_entry(address, *translated_address, TCACHE_LARGE_PAGE_SIZE, access);
+}
+
+/* page table walks read descriptors straight out of host memory when they can */
+static inline word read_descriptor(const byte *table_host, armaddr_t table, unsigned int offset)
+{
+	if(likely(table_host != NULL))
+		return READ_MEM_WORD(table_host + offset);
+	return sys_read_mem_word(table + offset);
+}
+
+/* hang on to a second level table for the megabyte, pcache is already set if it came from there */
+static struct ptable_cache_entry *remember_ptable(struct ptable_cache_entry *pcache, armaddr_t address, word ttable_entry, armaddr_t ptable)
+{
+	if(pcache)
+		return pcache;
+
+	pcache = &mmu.ptable_cache[(address >> 20) % NUM_PTABLE_CACHE];
+	pcache->tag = tcache_tag(address & ~(TCACHE_SECTION_SIZE-1));
+	pcache->ttable_entry = ttable_entry;
+	pcache->ptable = sys_get_mem_ptr(ptable);
+	return pcache;
 }
 
 static armaddr_t mmu_slow_translate(armaddr_t address, enum mmu_access_type type, bool write, bool priviledged)
 {
+	struct ptable_cache_entry *pcache;
 	armaddr_t translated_addr;
 	unsigned int ttable_entry;
 	unsigned int ptable_entry;
 	int domain;
 
-	mmu_inc_perf_counter(MMU_SLOW_TRANSLATE);
+	inc_perf_counter(MMU_SLOW_TRANSLATE);
+	inc_perf_counter(type == INSTRUCTION_FETCH ? MMU_SLOW_FETCH : write ? MMU_SLOW_WRITE : MMU_SLOW_READ);
+
+	/* the failed lookup that got us here leaves an entry it found, without the access bits, at the front of the set */
+	if(mmu.tcache.set[tcache_hash(address)][0].tag == tcache_tag(address & ~(TCACHE_PAGESIZE-1)))
+		inc_perf_counter(MMU_SLOW_PERMISSION);
 
 	if(!mmu.present || !(mmu.flags & MMU_ENABLED_FLAG)) {
-		/* no mmu? create a identity translation cache entry */
+		/* no mmu? create a identity translation cache entry, good for the whole megabyte */
+		inc_perf_counter(MMU_SLOW_MMU_OFF);
 		armaddr_t aligned_address = address & ~(TCACHE_PAGESIZE-1);
-		add_tcache_entry(aligned_address, aligned_address, write, priviledged);
+		add_tcache_entry(aligned_address, aligned_address, TCACHE_ALL_ACCESS);
+		add_tcache_big_entry(address, address, TCACHE_SECTION_SIZE, TCACHE_ALL_ACCESS);
 		return address;
 	}
 
 	// used as an extended way to signal a translation fault from this and lower routines to the caller
 	mmu.fault = FALSE;
 
-	/* read in the translation table entry */
-	ttable_entry = sys_read_mem_word(mmu.translation_table + (address >> 20) * 4);
+	/* read in the translation table entry, unless it's one we've just walked through */
+	pcache = &mmu.ptable_cache[(address >> 20) % NUM_PTABLE_CACHE];
+	if(pcache->tag == tcache_tag(address & ~(TCACHE_SECTION_SIZE-1))) {
+		ttable_entry = pcache->ttable_entry;
+		inc_perf_counter(MMU_SLOW_PTABLE_CACHED);
+	} else {
+		ttable_entry = read_descriptor(mmu.translation_table_host, mmu.translation_table & ~0x3fff, (address >> 20) * 4);
+		pcache = NULL;
+	}
 
 	MMU_TRACE(7, "\tttable_entry 0x%08x\n", ttable_entry);
 
@@ -384,6 +799,8 @@ static armaddr_t mmu_slow_translate(armaddr_t address, enum mmu_access_type type
 	/* do something based off the first level descriptor type */
 	switch(ttable_entry & 0x3) {
 		case 2: { // section
+			unsigned int access = TCACHE_ALL_ACCESS;
+
 			/* domain check */
 			enum mmu_domain_check_results domain_check = mmu_domain_check(domain);
 			if(domain_check == DOMAIN_FAULT) {
@@ -394,8 +811,8 @@ static armaddr_t mmu_slow_translate(armaddr_t address, enum mmu_access_type type
 				/* permission check */
 				int AP = BITS_SHIFT(ttable_entry, 11, 10);
 
-				enum mmu_permission_results allowed_perms = mmu_permission_check(AP, BITS_SHIFT(mmu.flags, 9, 8), priviledged);
-				if(allowed_perms == NO_ACCESS || (allowed_perms == READ_ONLY && write)) {
+				access = mmu_access_check(AP);
+				if(!(access & tcache_access(write, priviledged))) {
 					/* section permission fault */
 					mmu_signal_fault(0xd, domain, address, type);
 					return 0;
@@ -406,19 +823,23 @@ static armaddr_t mmu_slow_translate(armaddr_t address, enum mmu_access_type type
 			translated_addr = BITS(ttable_entry, 31, 20) | BITS(address, 19, 0);
 			MMU_TRACE(7, "\tsection, translated_addr 0x%08x\n", translated_addr);
 
-			/* add a translation entry */
-			add_tcache_entry(address & ~(TCACHE_PAGESIZE-1), translated_addr & ~(TCACHE_PAGESIZE-1), write, priviledged);
+			/* add a translation entry, and one for the rest of the section */
+			add_tcache_entry(address & ~(TCACHE_PAGESIZE-1), translated_addr & ~(TCACHE_PAGESIZE-1), access);
+			add_tcache_big_entry(address, translated_addr, TCACHE_SECTION_SIZE, access);
+			inc_perf_counter(MMU_SLOW_SECTION);
 
 			break;
 		}
 		case 1: // coarse page table
-			ptable_entry = sys_read_mem_word(BITS(ttable_entry, 31, 10));
+			pcache = remember_ptable(pcache, address, ttable_entry, BITS(ttable_entry, 31, 10));
+			ptable_entry = read_descriptor(pcache->ptable, BITS(ttable_entry, 31, 10), BITS_SHIFT(address, 19, 12) * 4);
 
 			/* do a second level translation */
 			mmu_2nd_level_translate(ptable_entry, address, &translated_addr, type, write, priviledged, domain);
 			break;
 		case 3: // fine page table
-			ptable_entry = sys_read_mem_word(BITS(ttable_entry, 31, 12));
+			pcache = remember_ptable(pcache, address, ttable_entry, BITS(ttable_entry, 31, 12));
+			ptable_entry = read_descriptor(pcache->ptable, BITS(ttable_entry, 31, 12), BITS_SHIFT(address, 19, 10) * 4);
 
 			/* do a second level translation */
 			mmu_2nd_level_translate(ptable_entry, address, &translated_addr, type, write, priviledged, domain);
@@ -429,30 +850,121 @@ static armaddr_t mmu_slow_translate(armaddr_t address, enum mmu_access_type type
 			return 0;
 	}
 
+	if((ttable_entry & 0x3) != 2 && !mmu.fault)
+		inc_perf_counter(MMU_SLOW_PAGE);
+
 	return translated_addr;
 }
 
 static inline struct translation_cache_entry *mmu_tcache_lookup(armaddr_t address, bool write, bool priviledged)
 {
+	struct translation_cache_entry *set = mmu.tcache.set[tcache_hash(address)];
 	struct translation_cache_entry *tcache_ent;
+	dword tag = tcache_tag(address & ~(TCACHE_PAGESIZE-1));
+
+	/* 
+	 * NOTE: the permission bits were filled in after a full permission check was
+	 * performed and if any of the global settings changed that may effect permissions
+	 * the entire cache was wiped
+	 */
 
 	/* do a fast lookup */
-	tcache_ent = lookup_tcache_entry(address, write, priviledged);
-	if(likely(tcache_ent->flags & TCACHE_PRESENT)) {
-		armaddr_t vaddr_page = address & ~(TCACHE_PAGESIZE-1);
-		if(likely(tcache_ent->vaddr == vaddr_page)) {
-			/* 
-			 * NOTE: permissions are implicitly checked by the fact that the entry exists
-			 * at all. The entry was added after a full permission check was performed
-			 * and if any of the global settings changed that may effect permissions
-			 * the entire cache was wiped
-			 */
-
-			/* we have the entry */
-			return tcache_ent;
+	if(likely(set[0].tag == tag))
+		tcache_ent = &set[0];
+	else
+		tcache_ent = lookup_tcache_entry_slow(&mmu.tcache, set, tag);
+	if(unlikely(!tcache_ent))
+		tcache_ent = lookup_tcache_big_entry(address & ~(TCACHE_PAGESIZE-1));
+
+	if(likely(tcache_ent && (tcache_ent->flags & tcache_access(write, priviledged))))
+		return tcache_ent;
+	return NULL;
+}
+
+/* drop the translations for one page, in every address space */
+static void invalidate_tcache_bank_page(struct translation_cache_bank *bank, armaddr_t vaddr_page)
+{
+	struct translation_cache_entry *set = bank->set[tcache_hash(vaddr_page)];
+	int i;
+
+	for(i = 0; i < NUM_TCACHE_WAYS; i++) {
+		if(tcache_entry_live(&set[i]) && tcache_entry_vaddr(&set[i]) == vaddr_page)
+			set[i].tag = 0;
+	}
+	for(i = 0; i < NUM_TCACHE_VICTIMS; i++) {
+		if(tcache_entry_live(&bank->victim[i]) && tcache_entry_vaddr(&bank->victim[i]) == vaddr_page)
+			bank->victim[i].tag = 0;
+	}
+}
+
+/* and any section or large page it's part of */
+static void invalidate_tcache_big_page(armaddr_t vaddr_page)
+{
+	int i;
+
+	for(i = 0; i < NUM_TCACHE_BIG; i++) {
+		struct translation_cache_big_entry *ent = &mmu.big[i];
+
+		if(tcache_big_entry_live(ent) && ((armaddr_t)ent->tag & ~(TCACHE_PAGESIZE-1)) == (vaddr_page & ent->size_mask))
+			ent->tag = 0;
+	}
+}
+
+/*
+ * tlb invalidate single entry by mva. the low bits may carry an asid, but without
+ * global page support kernel mappings are tagged with whatever asid was live when
+ * they were loaded, so the page goes in all of them.
+ */
+void mmu_invalidate_tcache_page(armaddr_t mva)
+{
+	armaddr_t vaddr_page = mva & ~(TCACHE_PAGESIZE-1);
+
+	inc_perf_counter(MMU_TLB_FLUSH_PAGE);
+	codepage_translations_changed();
+
+	invalidate_tcache_bank_page(&mmu.tcache, vaddr_page);
+	invalidate_tcache_big_page(vaddr_page);
+
+	/* the walk may have been through a table that's changed too */
+	mmu.ptable_cache[(vaddr_page >> 20) % NUM_PTABLE_CACHE].tag = 0;
+}
+
+static void invalidate_tcache_bank_asid(struct translation_cache_bank *bank, armaddr_t asid)
+{
+	int i, j;
+
+	for(i = 0; i < NUM_TCACHE_SETS; i++) {
+		for(j = 0; j < NUM_TCACHE_WAYS; j++) {
+			if(tcache_entry_live(&bank->set[i][j]) && (bank->set[i][j].tag & TCACHE_ASID_MASK) == asid)
+				bank->set[i][j].tag = 0;
 		}
 	}
-	return NULL;
+	for(i = 0; i < NUM_TCACHE_VICTIMS; i++) {
+		if(tcache_entry_live(&bank->victim[i]) && (bank->victim[i].tag & TCACHE_ASID_MASK) == asid)
+			bank->victim[i].tag = 0;
+	}
+}
+
+/* tlb invalidate on asid match, throws out one address space and leaves the rest */
+void mmu_invalidate_tcache_asid(word asid)
+{
+	int i;
+
+	asid &= TCACHE_ASID_MASK;
+
+	inc_perf_counter(MMU_TLB_FLUSH_ASID);
+	if(asid == mmu.asid)
+		codepage_translations_changed();
+
+	invalidate_tcache_bank_asid(&mmu.tcache, asid);
+	for(i = 0; i < NUM_TCACHE_BIG; i++) {
+		if(tcache_big_entry_live(&mmu.big[i]) && (mmu.big[i].tag & TCACHE_ASID_MASK) == asid)
+			mmu.big[i].tag = 0;
+	}
+	for(i = 0; i < NUM_PTABLE_CACHE; i++) {
+		if((mmu.ptable_cache[i].tag & TCACHE_ASID_MASK) == asid)
+			mmu.ptable_cache[i].tag = 0;
+	}
 }
 
 /* instruction fetches */
@@ -473,7 +985,7 @@ bool mmu_read_instruction_word(armaddr_t address, word *data, bool priviledged)
 		} else {
 			/* slow path, must call into system layer to get memory */
 			mmu_inc_perf_counter(MMU_SLOWPATH);
-			*data = sys_read_mem_word(address);
+			*data = sys_region_read_word(tcache_ent->region, address + tcache_ent->paddr_delta);
 			return FALSE;
 		}
 	}
@@ -504,7 +1016,7 @@ bool mmu_read_instruction_halfword(armaddr_t address, halfword *data, bool privi
 		} else {
 			/* slow path, must call into system layer to get memory */
 			mmu_inc_perf_counter(MMU_SLOWPATH);
-			*data = sys_read_mem_halfword(address + tcache_ent->paddr_delta);
+			*data = sys_region_read_halfword(tcache_ent->region, address + tcache_ent->paddr_delta);
 			return FALSE;
 		}
 	}
@@ -518,112 +1030,295 @@ bool mmu_read_instruction_halfword(armaddr_t address, halfword *data, bool privi
 	return FALSE;
 }
 
-/* regular memory fetches */
+/* 
+ * translate a whole page for instruction fetches at once, for the codepage loader.
+ * *paddr is set to the physical page. if the page is plain memory, *host_ptr is set to
+ * the start of it in host memory, otherwise it's NULL and the page has to be read
+ * through the routines above.
+ */
+bool mmu_get_instruction_page(armaddr_t address, bool priviledged, armaddr_t *paddr, const void **host_ptr)
+{
+	struct translation_cache_entry *tcache_ent;
+	armaddr_t page = address & ~(TCACHE_PAGESIZE-1);
+
+	mmu_inc_perf_counter(MMU_INS_FETCH);
 
-bool mmu_read_mem_word(armaddr_t address, word *data)
+	tcache_ent = mmu_tcache_lookup(page, FALSE, priviledged);
+	if(!tcache_ent) {
+		/* this will add a translation cache entry for the page */
+		mmu_slow_translate(page, INSTRUCTION_FETCH, FALSE, priviledged);
+		if(mmu.fault)
+			return TRUE;
+		tcache_ent = mmu_tcache_lookup(page, FALSE, priviledged);
+	}
+
+	*paddr = tcache_ent ? page + tcache_ent->paddr_delta : page;
+	if(tcache_ent && tcache_ent->hostaddr_delta != 0)
+		*host_ptr = (const void *)(page + tcache_ent->hostaddr_delta);
+	else
+		*host_ptr = NULL;
+
+	return FALSE;
+}
+
+/*
+ * look up the physical page for an instruction fetch, only if the translation is cached.
+ * never faults, returns TRUE if *paddr was filled in.
+ */
+bool mmu_probe_instruction_page(armaddr_t address, bool priviledged, armaddr_t *paddr)
 {
-	MMU_TRACE(10, "mmu_read_mem_word: addr 0x%x, data 0x%x\n", address, data);
+	struct translation_cache_entry *tcache_ent;
+	armaddr_t page = address & ~(TCACHE_PAGESIZE-1);
 
-	mmu_inc_perf_counter(MMU_READ);
+	if(!mmu.present || !(mmu.flags & MMU_ENABLED_FLAG)) {
+		*paddr = page;
+		return TRUE;
+	}
 
-	// alignment check
-	if(unlikely(address & 3)) {
-		if(mmu.flags & MMU_ALIGNMENT_FAULT_FLAG) {
-			mmu.fault_status = 0x1;
-			mmu.fault_address = address;
-			signal_data_abort(address);
-			return TRUE;			
-		}
+	tcache_ent = mmu_tcache_lookup(page, FALSE, priviledged);
+	if(!tcache_ent)
+		return FALSE;
+
+	*paddr = page + tcache_ent->paddr_delta;
+	return TRUE;
+}
+
+/* 
+ * host pointer to a run of len bytes starting at address, for ldm/stm.
+ * never faults: returns NULL if the run isn't wholly inside a page that is
+ * already in the translation cache and backed by host memory, in which case
+ * the caller goes word by word through the regular routines.
+ */
+void *mmu_get_data_range(armaddr_t address, int len, bool write)
+{
+	struct translation_cache_entry *tcache_ent;
+	unsigned long delta;
+
+	if(unlikely(address & 3))
+		return NULL;
+	if(unlikely((address & (TCACHE_PAGESIZE-1)) + len > TCACHE_PAGESIZE))
+		return NULL;
+	if(unlikely(cpu.btrace != NULL) && cpu.btrace->mem)
+		return NULL; // word by word through the accessors, so each one is recorded
+
+	tcache_ent = mmu_tcache_lookup(address, write, arm_in_priviledged());
+	if(unlikely(!tcache_ent))
+		return NULL;
+
+	delta = write ? tcache_ent->write_hostaddr_delta : tcache_ent->hostaddr_delta;
+	if(unlikely(delta == 0))
+		return NULL;
+
+	mmu_inc_perf_counter(MMU_MULTIPLE_FASTPATH);
+	return (void *)(address + delta);
+}
+
+/*
+ * host pointer to as much of the *len bytes at address as is in the one page, for
+ * a buffer copied in or out in one go, *len is cut down to that. it never faults
+ * either, NULL means going through the regular routines a byte at a time, which
+ * brings the translation into the cache for the page after.
+ */
+void *mmu_get_data_run(armaddr_t address, size_t *len, bool write)
+{
+	struct translation_cache_entry *tcache_ent;
+	size_t left = TCACHE_PAGESIZE - (address & (TCACHE_PAGESIZE-1));
+	unsigned long delta;
+
+	if(*len > left)
+		*len = left;
+	if(unlikely(cpu.btrace != NULL) && cpu.btrace->mem)
+		return NULL;
+
+	tcache_ent = mmu_tcache_lookup(address, write, arm_in_priviledged());
+	if(!tcache_ent && (!mmu.present || !(mmu.flags & MMU_ENABLED_FLAG))) {
+		// can't fault with the mmu off, fill it in (fastmem accesses never do)
+		mmu_slow_translate(address, DATA, write, arm_in_priviledged());
+		tcache_ent = mmu_tcache_lookup(address, write, arm_in_priviledged());
 	}
+	if(!tcache_ent)
+		return NULL;
 
-	/* do a translation lookup */
-	bool priviledged = arm_in_priviledged();
-	struct translation_cache_entry *tcache_ent = mmu_tcache_lookup(address, FALSE, priviledged);
-	if(likely(tcache_ent)) {
-		if(likely(tcache_ent->hostaddr_delta != 0)) {
-			/* fast path, can read directly from host memory */
-			mmu_inc_perf_counter(MMU_FASTPATH);
-			*data = READ_MEM_WORD((void *)(address + tcache_ent->hostaddr_delta));
-			return FALSE;
-		} else {
-			/* slow path, must call into system layer to get memory */
-			mmu_inc_perf_counter(MMU_SLOWPATH);
-			*data = sys_read_mem_word(address + tcache_ent->paddr_delta);
-			return FALSE;
-		}
+	delta = write ? tcache_ent->write_hostaddr_delta : tcache_ent->hostaddr_delta;
+	if(delta == 0)
+		return NULL;
+
+	return (void *)(address + delta);
+}
+
+/*
+ * the data accessors are compiled once for every combination of the things they
+ * would otherwise have to test on each access: whether the mmu is translating, the
+ * mode the core is in, alignment faults and tracing. the variant is a constant in
+ * each copy, so the checks that don't apply fold away. mmu_access points at the
+ * set matching the current state and is only changed when that state is.
+ */
+#define MMU_ACCESS_TRANSLATE 0x1
+#define MMU_ACCESS_PRIV      0x2
+#define MMU_ACCESS_ALIGN     0x4
+#define MMU_ACCESS_TRACE     0x8
+#define MMU_ACCESS_VARIANTS  16
+
+static inline __ALWAYS_INLINE word read_host_mem(const void *ptr, int size)
+{
+	switch(size) {
+		case 4: return READ_MEM_WORD(ptr);
+		case 2: return READ_MEM_HALFWORD(ptr);
+		default: return READ_MEM_BYTE(ptr);
 	}
+}
 
-	/* do a slow lookup which will add a translation cache entry for the next time */
-	address = mmu_slow_translate(address, DATA, FALSE, priviledged);
-	if(mmu.fault)
-		return TRUE;
+static inline __ALWAYS_INLINE word read_sys_mem(armaddr_t address, int size)
+{
+	switch(size) {
+		case 4: return sys_read_mem_word(address);
+		case 2: return sys_read_mem_halfword(address);
+		default: return sys_read_mem_byte(address);
+	}
+}
 
-	*data = sys_read_mem_word(address);
-	return FALSE;
+/* the region was already looked up when the translation was cached */
+static inline __ALWAYS_INLINE word read_region_mem(const struct mem_region *region, armaddr_t address, int size)
+{
+	switch(size) {
+		case 4: return sys_region_read_word(region, address);
+		case 2: return sys_region_read_halfword(region, address);
+		default: return sys_region_read_byte(region, address);
+	}
 }
 
-bool mmu_read_mem_halfword(armaddr_t address, halfword *data)
+static inline __ALWAYS_INLINE void write_host_mem(void *ptr, word data, int size)
 {
-	MMU_TRACE(10, "mmu_read_mem_halfword: addr 0x%x, data 0x%x\n", address, data);
+	switch(size) {
+		case 4: WRITE_MEM_WORD(ptr, data); break;
+		case 2: WRITE_MEM_HALFWORD(ptr, data); break;
+		default: WRITE_MEM_BYTE(ptr, data); break;
+	}
+}
 
-	mmu_inc_perf_counter(MMU_READ);
+static inline __ALWAYS_INLINE void write_sys_mem(armaddr_t address, word data, int size)
+{
+	switch(size) {
+		case 4: sys_write_mem_word(address, data); break;
+		case 2: sys_write_mem_halfword(address, data); break;
+		default: sys_write_mem_byte(address, data); break;
+	}
+}
 
-	// alignment check
-	if(address & 1) {
-		if(mmu.flags & MMU_ALIGNMENT_FAULT_FLAG) {
-			mmu.fault_status = 0x1;
-			mmu.fault_address = address;
-			signal_data_abort(address);
-			return TRUE;			
-		}
+static inline __ALWAYS_INLINE void write_region_mem(const struct mem_region *region, armaddr_t address, word data, int size)
+{
+	switch(size) {
+		case 4: sys_region_write_word(region, address, data); break;
+		case 2: sys_region_write_halfword(region, address, data); break;
+		default: sys_region_write_byte(region, address, data); break;
 	}
+}
 
-	/* do a translation lookup */
-	bool priviledged = arm_in_priviledged();
-	struct translation_cache_entry *tcache_ent = mmu_tcache_lookup(address, FALSE, priviledged);
-	if(tcache_ent) {
-		if(tcache_ent->hostaddr_delta != 0) {
-			/* fast path, can read directly from host memory */
-			mmu_inc_perf_counter(MMU_FASTPATH);
-			*data = READ_MEM_HALFWORD((void *)(address + tcache_ent->hostaddr_delta));
-			return FALSE;
-		} else {
-			/* slow path, must call into system layer to get memory */
-			mmu_inc_perf_counter(MMU_SLOWPATH);
-			*data = sys_read_mem_halfword(address + tcache_ent->paddr_delta);
-			return FALSE;
+/*
+ * with the mmu off the guest physical address space is mirrored in the fastmem
+ * window, so an access is a single host load or store. these return TRUE if it
+ * was done that way, FALSE if it hit something that isn't plain ram (or a page
+ * with decoded instructions in it, for stores) and has to go the regular way.
+ */
+static inline __ALWAYS_INLINE bool mmu_fastmem_read(armaddr_t address, word *data, int size)
+{
+#if WITH_FASTMEM
+	bool fault;
+
+	if(unlikely(mmu.fastmem == NULL))
+		return FALSE;
+
+	switch(size) {
+		case 4:
+			fault = fastmem_read_word(mmu.fastmem + address, data);
+			break;
+		case 2: {
+			halfword val;
+			fault = fastmem_read_halfword(mmu.fastmem + address, &val);
+			*data = val;
+			break;
+		}
+		default: {
+			byte val;
+			fault = fastmem_read_byte(mmu.fastmem + address, &val);
+			*data = val;
+			break;
 		}
 	}
-
-	/* do a slow lookup which will add a translation cache entry for the next time */
-	address = mmu_slow_translate(address, DATA, FALSE, priviledged);
-	if(mmu.fault)
+	if(likely(!fault)) {
+		mmu_inc_perf_counter(MMU_FASTMEM);
 		return TRUE;
+	}
+#endif
+	return FALSE;
+}
 
-	*data = sys_read_mem_halfword(address);
+static inline __ALWAYS_INLINE bool mmu_fastmem_write(armaddr_t address, word data, int size)
+{
+#if WITH_FASTMEM
+	bool fault;
+
+	if(unlikely(mmu.fastmem == NULL))
+		return FALSE;
+
+	switch(size) {
+		case 4: fault = fastmem_write_word(mmu.fastmem + address, data); break;
+		case 2: fault = fastmem_write_halfword(mmu.fastmem + address, data); break;
+		default: fault = fastmem_write_byte(mmu.fastmem + address, data); break;
+	}
+	if(likely(!fault)) {
+		mmu_inc_perf_counter(MMU_FASTMEM);
+		return TRUE;
+	}
+#endif
 	return FALSE;
+}
 
+static inline __ALWAYS_INLINE bool mmu_alignment_fault(armaddr_t address, int size, unsigned int variant)
+{
+	if((variant & MMU_ACCESS_ALIGN) && unlikely(address & (size - 1))) {
+		mmu.fault_status = 0x1;
+		mmu.fault_address = address;
+		signal_data_abort(address);
+		return TRUE;
+	}
+	return FALSE;
 }
 
-bool mmu_read_mem_byte(armaddr_t address, byte *data)
+/* regular memory fetches */
+
+static inline __ALWAYS_INLINE bool mmu_read_mem(armaddr_t address, word *data, int size, unsigned int variant)
 {
-	MMU_TRACE(10, "mmu_read_mem_byte: addr 0x%x, data 0x%x\n", address, data);
+	/* with the mmu off every translation cache entry allows everything */
+	bool priviledged = !(variant & MMU_ACCESS_TRANSLATE) || (variant & MMU_ACCESS_PRIV);
+	struct translation_cache_entry *tcache_ent;
+
+	if(variant & MMU_ACCESS_TRACE) {
+		MMU_TRACE(10, "mmu_read_mem: addr 0x%x, size %d\n", address, size);
+		if(cpu.btrace)
+			btrace_mem(BTRACE_READ, address, size, 0);
+	}
 
 	mmu_inc_perf_counter(MMU_READ);
 
+	if(!(variant & (MMU_ACCESS_TRANSLATE | MMU_ACCESS_ALIGN)) && mmu_fastmem_read(address, data, size))
+		return FALSE;
+
+	if(mmu_alignment_fault(address, size, variant))
+		return TRUE;
+
 	/* do a translation lookup */
-	bool priviledged = arm_in_priviledged();
-	struct translation_cache_entry *tcache_ent = mmu_tcache_lookup(address, FALSE, priviledged);
-	if(tcache_ent) {
-		if(tcache_ent->hostaddr_delta != 0) {
+	tcache_ent = mmu_tcache_lookup(address, FALSE, priviledged);
+	if(likely(tcache_ent)) {
+		if(likely(tcache_ent->hostaddr_delta != 0)) {
 			/* fast path, can read directly from host memory */
 			mmu_inc_perf_counter(MMU_FASTPATH);
-			*data = READ_MEM_BYTE((void *)(address + tcache_ent->hostaddr_delta));
+			*data = read_host_mem((void *)(address + tcache_ent->hostaddr_delta), size);
 			return FALSE;
 		} else {
 			/* slow path, must call into system layer to get memory */
 			mmu_inc_perf_counter(MMU_SLOWPATH);
-			*data = sys_read_mem_byte(address + tcache_ent->paddr_delta);
+			*data = read_region_mem(tcache_ent->region, address + tcache_ent->paddr_delta, size);
 			return FALSE;
 		}
 	}
@@ -633,41 +1328,45 @@ bool mmu_read_mem_byte(armaddr_t address, byte *data)
 	if(mmu.fault)
 		return TRUE;
 
-	*data = sys_read_mem_byte(address);
+	*data = read_sys_mem(address, size);
 	return FALSE;
 }
 
 /* regular memory writes */
 
-bool mmu_write_mem_word(armaddr_t address, word data)
+static inline __ALWAYS_INLINE bool mmu_write_mem(armaddr_t address, word data, int size, unsigned int variant)
 {
-	MMU_TRACE(10, "mmu_write_mem_word: addr 0x%x, data 0x%x\n", address, data);
+	bool priviledged = !(variant & MMU_ACCESS_TRANSLATE) || (variant & MMU_ACCESS_PRIV);
+	struct translation_cache_entry *tcache_ent;
+
+	if(variant & MMU_ACCESS_TRACE) {
+		MMU_TRACE(10, "mmu_write_mem: addr 0x%x, data 0x%x, size %d\n", address, data, size);
+		if(cpu.btrace)
+			btrace_mem(BTRACE_WRITE, address, size, data);
+	}
 
 	mmu_inc_perf_counter(MMU_WRITE);
 
-	// alignment check
-	if(address & 3) {
-		if(mmu.flags & MMU_ALIGNMENT_FAULT_FLAG) {
-			mmu.fault_status = 0x1;
-			mmu.fault_address = address;
-			signal_data_abort(address);
-			return TRUE;			
-		}
-	}
+	if(!(variant & (MMU_ACCESS_TRANSLATE | MMU_ACCESS_ALIGN)) && mmu_fastmem_write(address, data, size))
+		return FALSE;
+
+	if(mmu_alignment_fault(address, size, variant))
+		return TRUE;
 
 	/* do a translation lookup */
-	bool priviledged = arm_in_priviledged();
-	struct translation_cache_entry *tcache_ent = mmu_tcache_lookup(address, TRUE, priviledged);
-	if(tcache_ent) {
-		if(tcache_ent->hostaddr_delta != 0) {
-			/* fast path, can read directly from host memory */
+	tcache_ent = mmu_tcache_lookup(address, TRUE, priviledged);
+	if(likely(tcache_ent)) {
+		if(likely(tcache_ent->write_hostaddr_delta != 0)) {
+			/* fast path, can write directly to host memory */
 			mmu_inc_perf_counter(MMU_FASTPATH);
-			WRITE_MEM_WORD((void *)(address + tcache_ent->hostaddr_delta), data);
+			write_host_mem((void *)(address + tcache_ent->write_hostaddr_delta), data, size);
 			return FALSE;
 		} else {
 			/* slow path, must call into system layer to get memory */
 			mmu_inc_perf_counter(MMU_SLOWPATH);
-			sys_write_mem_word(address + tcache_ent->paddr_delta, data);
+			if(unlikely(tcache_ent->flags & TCACHE_CODE))
+				mmu_code_page_write(tcache_ent, address + tcache_ent->paddr_delta);
+			write_region_mem(tcache_ent->region, address + tcache_ent->paddr_delta, data, size);
 			return FALSE;
 		}
 	}
@@ -677,81 +1376,238 @@ bool mmu_write_mem_word(armaddr_t address, word data)
 	if(mmu.fault)
 		return TRUE;
 
-	sys_write_mem_word(address, data);
+	if(unlikely(is_code_page(address)))
+		mmu_code_page_write(NULL, address);
+	write_sys_mem(address, data, size);
 	return FALSE;
 }
 
-bool mmu_write_mem_halfword(armaddr_t address, halfword data)
-{
-	MMU_TRACE(10, "mmu_write_mem_halfword: addr 0x%x, data 0x%x\n", address, data);
+#define MMU_ACCESSORS(v) \
+static bool mmu_read_mem_word_##v(armaddr_t address, word *data) \
+{ \
+	return mmu_read_mem(address, data, 4, v); \
+} \
+static bool mmu_read_mem_halfword_##v(armaddr_t address, halfword *data) \
+{ \
+	word val; \
+	if(mmu_read_mem(address, &val, 2, v)) \
+		return TRUE; \
+	*data = val; \
+	return FALSE; \
+} \
+static bool mmu_read_mem_byte_##v(armaddr_t address, byte *data) \
+{ \
+	word val; \
+	if(mmu_read_mem(address, &val, 1, v)) \
+		return TRUE; \
+	*data = val; \
+	return FALSE; \
+} \
+static bool mmu_write_mem_word_##v(armaddr_t address, word data) \
+{ \
+	return mmu_write_mem(address, data, 4, v); \
+} \
+static bool mmu_write_mem_halfword_##v(armaddr_t address, halfword data) \
+{ \
+	return mmu_write_mem(address, data, 2, v); \
+} \
+static bool mmu_write_mem_byte_##v(armaddr_t address, byte data) \
+{ \
+	return mmu_write_mem(address, data, 1, v); \
+}
 
-	mmu_inc_perf_counter(MMU_WRITE);
+#define MMU_ACCESSOR_TABLE(v) \
+	[v] = { \
+		.read_word = mmu_read_mem_word_##v, \
+		.read_halfword = mmu_read_mem_halfword_##v, \
+		.read_byte = mmu_read_mem_byte_##v, \
+		.write_word = mmu_write_mem_word_##v, \
+		.write_halfword = mmu_write_mem_halfword_##v, \
+		.write_byte = mmu_write_mem_byte_##v, \
+	}
 
-	// alignment check
-	if(address & 1) {
-		if(mmu.flags & MMU_ALIGNMENT_FAULT_FLAG) {
-			mmu.fault_status = 0x1;
-			mmu.fault_address = address;
-			signal_data_abort(address);
-			return TRUE;			
-		}
+MMU_ACCESSORS(0)
+MMU_ACCESSORS(1)
+MMU_ACCESSORS(2)
+MMU_ACCESSORS(3)
+MMU_ACCESSORS(4)
+MMU_ACCESSORS(5)
+MMU_ACCESSORS(6)
+MMU_ACCESSORS(7)
+MMU_ACCESSORS(8)
+MMU_ACCESSORS(9)
+MMU_ACCESSORS(10)
+MMU_ACCESSORS(11)
+MMU_ACCESSORS(12)
+MMU_ACCESSORS(13)
+MMU_ACCESSORS(14)
+MMU_ACCESSORS(15)
+
+static const struct mmu_accessors mmu_access_variants[MMU_ACCESS_VARIANTS] = {
+	MMU_ACCESSOR_TABLE(0),
+	MMU_ACCESSOR_TABLE(1),
+	MMU_ACCESSOR_TABLE(2),
+	MMU_ACCESSOR_TABLE(3),
+	MMU_ACCESSOR_TABLE(4),
+	MMU_ACCESSOR_TABLE(5),
+	MMU_ACCESSOR_TABLE(6),
+	MMU_ACCESSOR_TABLE(7),
+	MMU_ACCESSOR_TABLE(8),
+	MMU_ACCESSOR_TABLE(9),
+	MMU_ACCESSOR_TABLE(10),
+	MMU_ACCESSOR_TABLE(11),
+	MMU_ACCESSOR_TABLE(12),
+	MMU_ACCESSOR_TABLE(13),
+	MMU_ACCESSOR_TABLE(14),
+	MMU_ACCESSOR_TABLE(15),
+};
+
+/* a core starts out privileged with the mmu off */
+__thread const struct mmu_accessors *mmu_access = &mmu_access_variants[MMU_ACCESS_PRIV];
+
+/* pick the accessors for the state the core is in now, after anything they specialize on changes */
+void mmu_select_access(void)
+{
+	unsigned int variant = 0;
+
+	if(mmu.present && (mmu.flags & MMU_ENABLED_FLAG))
+		variant |= MMU_ACCESS_TRANSLATE;
+	if(arm_in_priviledged())
+		variant |= MMU_ACCESS_PRIV;
+	if(mmu.flags & MMU_ALIGNMENT_FAULT_FLAG)
+		variant |= MMU_ACCESS_ALIGN;
+	if(TRACE_MMU_LEVEL >= 10 || (cpu.btrace && cpu.btrace->mem))
+		variant |= MMU_ACCESS_TRACE;
+
+	mmu_access = &mmu_access_variants[variant];
+
+	/* an inline lookup only stands in for the fast path, nothing that traces or counts */
+	if((variant & MMU_ACCESS_TRACE) || COUNT_MMU_OPS) {
+		mmu.probe.read_access = 0;
+		mmu.probe.write_access = 0;
+	} else {
+		bool priviledged = !(variant & MMU_ACCESS_TRANSLATE) || (variant & MMU_ACCESS_PRIV);
+
+		mmu.probe.read_access = tcache_access(FALSE, priviledged);
+		mmu.probe.write_access = tcache_access(TRUE, priviledged);
 	}
+}
 
-	/* do a translation lookup */
+const struct mmu_tcache_probe *mmu_get_tcache_probe(void)
+{
+	ASSERT((sizeof(mmu.tcache.set[0]) & (sizeof(mmu.tcache.set[0]) - 1)) == 0);
+
+	mmu.probe.sets = mmu.tcache.set;
+	mmu.probe.set_shift = __builtin_ctz(sizeof(mmu.tcache.set[0]));
+	mmu.probe.set_mask = NUM_TCACHE_SETS - 1;
+	mmu.probe.tag_offset = offsetof(struct translation_cache_entry, tag);
+	mmu.probe.flags_offset = offsetof(struct translation_cache_entry, flags);
+	mmu.probe.read_delta_offset = offsetof(struct translation_cache_entry, hostaddr_delta);
+	mmu.probe.write_delta_offset = offsetof(struct translation_cache_entry, write_hostaddr_delta);
+	mmu.probe.tag_base = &mmu.tag_base;
+	mmu_select_access();
+
+	return &mmu.probe;
+}
+
+void mmu_tcache_fill(armaddr_t address, bool write)
+{
+	bool translating = mmu.present && (mmu.flags & MMU_ENABLED_FLAG);
+	bool priviledged = !translating || arm_in_priviledged();
+
+	/* a hit further back is moved to the front. with the mmu off nothing can
+	 * fault, so a missing entry is made here too, the fastmem path never makes one */
+	if(!mmu_tcache_lookup(address, write, priviledged) && !translating)
+		mmu_slow_translate(address, DATA, write, priviledged);
+}
+
+/*
+ * swp and swpb, when there's more than one core. the load and store have to be a
+ * single atomic operation as far as the other cores can tell, so plain memory gets
+ * a host atomic exchange. anything else (devices, pages with decoded instructions
+ * in them) falls back to a load and a store under the cluster's swap lock, atomic
+ * against other swaps.
+ */
+static bool mmu_swap_translate(armaddr_t address, void **host_ptr)
+{
 	bool priviledged = arm_in_priviledged();
-	struct translation_cache_entry *tcache_ent = mmu_tcache_lookup(address, TRUE, priviledged);
-	if(tcache_ent) {
-		if(tcache_ent->hostaddr_delta != 0) {
-			/* fast path, can read directly from host memory */
-			mmu_inc_perf_counter(MMU_FASTPATH);
-			WRITE_MEM_HALFWORD((void *)(address + tcache_ent->hostaddr_delta), data);
-			return FALSE;
-		} else {
-			/* slow path, must call into system layer to get memory */
-			mmu_inc_perf_counter(MMU_SLOWPATH);
-			sys_write_mem_halfword(address + tcache_ent->paddr_delta, data);
-			return FALSE;
-		}
+	struct translation_cache_entry *tcache_ent;
+
+	mmu_inc_perf_counter(MMU_WRITE);
+
+	/* a swap needs write permission, which implies read */
+	tcache_ent = mmu_tcache_lookup(address, TRUE, priviledged);
+	if(!tcache_ent) {
+		mmu_slow_translate(address, DATA, TRUE, priviledged);
+		if(mmu.fault)
+			return TRUE;
+		tcache_ent = mmu_tcache_lookup(address, TRUE, priviledged);
 	}
 
-	/* do a slow lookup which will add a translation cache entry for the next time */
-	address = mmu_slow_translate(address, DATA, TRUE, priviledged);
-	if(mmu.fault)
-		return TRUE;
+	if(tcache_ent && tcache_ent->write_hostaddr_delta != 0)
+		*host_ptr = (void *)(address + tcache_ent->write_hostaddr_delta);
+	else
+		*host_ptr = NULL;
 
-	sys_write_mem_halfword(address, data);
 	return FALSE;
 }
 
-bool mmu_write_mem_byte(armaddr_t address, byte data)
+bool mmu_swap_mem_word(armaddr_t address, word data, word *old)
 {
-	MMU_TRACE(10, "mmu_write_mem_byte: addr 0x%x, data 0x%x\n", address, data);
+	void *host_ptr;
+	word raw;
+	bool fault;
 
-	mmu_inc_perf_counter(MMU_WRITE);
+	MMU_TRACE(10, "mmu_swap_mem_word: addr 0x%x, data 0x%x\n", address, data);
 
-	/* do a translation lookup */
-	bool priviledged = arm_in_priviledged();
-	struct translation_cache_entry *tcache_ent = mmu_tcache_lookup(address, TRUE, priviledged);
-	if(tcache_ent) {
-		if(tcache_ent->hostaddr_delta != 0) {
-			/* fast path, can read directly from host memory */
-			mmu_inc_perf_counter(MMU_FASTPATH);
-			WRITE_MEM_BYTE((void *)(address + tcache_ent->hostaddr_delta), data);
-			return FALSE;
-		} else {
-			/* slow path, must call into system layer to get memory */
-			mmu_inc_perf_counter(MMU_SLOWPATH);
-			sys_write_mem_byte(address + tcache_ent->paddr_delta, data);
-			return FALSE;
-		}
+	if(mmu_swap_translate(address, &host_ptr))
+		return TRUE;
+
+	if(host_ptr != NULL) {
+		mmu_inc_perf_counter(MMU_FASTPATH);
+		WRITE_MEM_WORD(&raw, data);
+		raw = atomic_set((volatile int *)host_ptr, raw);
+		*old = READ_MEM_WORD(&raw);
+		return FALSE;
 	}
 
-	/* do a slow lookup which will add a translation cache entry for the next time */
-	address = mmu_slow_translate(address, DATA, TRUE, priviledged);
-	if(mmu.fault)
-		return TRUE;
+	while(test_and_set_acquire(&cpu.cluster->swap_lock, 1, 0) != 0)
+		;
+	fault = mmu_read_mem_word(address, old) || mmu_write_mem_word(address, data);
+	atomic_store_release(&cpu.cluster->swap_lock, 0);
 
-	sys_write_mem_byte(address, data);
-	return FALSE;
+	return fault;
 }
 
+bool mmu_swap_mem_byte(armaddr_t address, byte data, byte *old)
+{
+	void *host_ptr;
+	bool fault;
+
+	MMU_TRACE(10, "mmu_swap_mem_byte: addr 0x%x, data 0x%x\n", address, data);
+
+	if(mmu_swap_translate(address, &host_ptr))
+		return TRUE;
+
+	if(host_ptr != NULL) {
+		/* no byte sized exchange to use, swap it into the word around it */
+		volatile int *ptr = (volatile int *)((uintptr_t)host_ptr & ~(uintptr_t)3);
+		unsigned int offset = (uintptr_t)host_ptr & 3;
+		int oldval, newval;
+
+		mmu_inc_perf_counter(MMU_FASTPATH);
+		do {
+			oldval = newval = *ptr;
+			((byte *)&newval)[offset] = data;
+		} while(test_and_set(ptr, newval, oldval) != oldval);
+		*old = ((byte *)&oldval)[offset];
+		return FALSE;
+	}
+
+	while(test_and_set_acquire(&cpu.cluster->swap_lock, 1, 0) != 0)
+		;
+	fault = mmu_read_mem_byte(address, old) || mmu_write_mem_byte(address, data);
+	atomic_store_release(&cpu.cluster->swap_lock, 0);
+
+	return fault;
+}
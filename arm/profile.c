@@ -0,0 +1,602 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
+#include <sys/sys.h>
+#include <config.h>
+#include <arm/arm.h>
+#include <arm/mmu.h>
+#include <arm/profile.h>
+#include <util/atomic.h>
+#include <util/endian.h>
+
+/*
+ * the sampler never stops or locks the cores, it reads each one's pc and cpsr as
+ * they stand, which is where the core's last block left them. the samples go in a
+ * ring and are only added up into the histogram when it fills and at the end, so a
+ * sample is a couple of loads and stores.
+ */
+#define PROFILE_RING_SIZE	65536 // samples, a power of 2
+#define DEFAULT_PROFILE_RATE	1000 // per second
+#define PROFILE_TOP_FUNCTIONS	32
+#define PROFILE_TOP_ADDRESSES	8
+#define PROFILE_TOP_PAGES	32
+
+struct profile_sample {
+	uint32_t pc;
+	uint32_t flags; // the cpsr's mode and thumb bits
+};
+
+struct profile_entry {
+	uint32_t pc;
+	uint32_t flags;
+	uint64_t count;
+	int sym; // index into syms, -1 if nothing covers it
+};
+
+struct profile_symbol {
+	uint32_t addr;
+	uint32_t size;
+	const char *name;
+};
+
+struct profile {
+	struct cpu_cluster *cluster;
+	SDL_Thread *thread;
+	volatile bool stopping;
+	uint interval_ns;
+
+	const char *file;
+	uint64_t start_time;
+	uint64_t end_time;
+
+	// written by the sampler only, head is published after the sample is
+	struct profile_sample *ring;
+	uint head;
+	uint tail;
+
+	// the histogram, open addressed on pc and flags
+	struct profile_entry *hash;
+	uint hash_size;
+	uint hash_count;
+	uint64_t total;
+	uint64_t core_samples[MAX_CPU_CORES];
+
+	// from the guest elf, sorted by address
+	char *elf;
+	struct profile_symbol *syms;
+	int num_syms;
+};
+
+static uint64_t profile_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint profile_hash(uint32_t pc, uint32_t flags)
+{
+	return ((pc >> 1) ^ (flags << 27)) * 0x9e3779b1;
+}
+
+static void profile_add(struct profile *prof, uint32_t pc, uint32_t flags, uint64_t count)
+{
+	uint mask, i;
+
+	// keep it under half full
+	if (prof->hash_count * 2 >= prof->hash_size) {
+		struct profile_entry *old = prof->hash;
+		uint old_size = prof->hash_size;
+
+		prof->hash_size = old_size ? old_size * 2 : 4096;
+		prof->hash = calloc(prof->hash_size, sizeof(struct profile_entry));
+		prof->hash_count = 0;
+		for (i = 0; i < old_size; i++) {
+			if (old[i].count)
+				profile_add(prof, old[i].pc, old[i].flags, old[i].count);
+		}
+		free(old);
+	}
+
+	mask = prof->hash_size - 1;
+	for (i = profile_hash(pc, flags) & mask; ; i = (i + 1) & mask) {
+		struct profile_entry *ent = &prof->hash[i];
+
+		if (ent->count == 0) {
+			ent->pc = pc;
+			ent->flags = flags;
+			prof->hash_count++;
+			break;
+		}
+		if (ent->pc == pc && ent->flags == flags)
+			break;
+	}
+	prof->hash[i].count += count;
+	prof->total += count;
+}
+
+/* add what's in the ring up into the histogram */
+static void profile_drain(struct profile *prof)
+{
+	uint head = atomic_load_acquire(&prof->head);
+
+	for (; prof->tail != head; prof->tail++) {
+		struct profile_sample *s = &prof->ring[prof->tail & (PROFILE_RING_SIZE - 1)];
+
+		profile_add(prof, s->pc, s->flags, 1);
+	}
+}
+
+static void profile_sample(struct profile *prof)
+{
+	struct cpu_cluster *cluster = prof->cluster;
+	int c;
+
+	for (c = 0; c < cluster->num_cores; c++) {
+		struct cpu_struct *core = cluster->cores[c];
+		struct profile_sample *s;
+
+		if (!core)
+			continue;
+
+		if (prof->head - prof->tail == PROFILE_RING_SIZE)
+			profile_drain(prof);
+
+		s = &prof->ring[prof->head & (PROFILE_RING_SIZE - 1)];
+		s->pc = core->pc;
+		s->flags = core->cpsr & (PSR_MODE_MASK | PSR_THUMB);
+		atomic_store_release(&prof->head, prof->head + 1);
+		prof->core_samples[c]++;
+	}
+}
+
+static int profile_thread_entry(void *args)
+{
+	struct profile *prof = args;
+	struct timespec ts;
+
+	ts.tv_sec = prof->interval_ns / 1000000000;
+	ts.tv_nsec = prof->interval_ns % 1000000000;
+
+	while (!prof->stopping) {
+		nanosleep(&ts, NULL);
+		profile_sample(prof);
+	}
+
+	return 0;
+}
+
+static int compare_symbols(const void *_a, const void *_b)
+{
+	const struct profile_symbol *a = _a, *b = _b;
+
+	if (a->addr != b->addr)
+		return a->addr < b->addr ? -1 : 1;
+	return (int)b->size - (int)a->size;
+}
+
+/*
+ * pull the functions and labels out of a little endian elf32's symbol table. the
+ * arm mapping symbols ($a, $t, $d) are skipped and the thumb bit is taken off.
+ */
+static int load_symbols(struct profile *prof, const char *path)
+{
+	FILE *fp;
+	long len;
+	byte *elf;
+	uint shoff, shentsize, shnum, i, j;
+	int n = 0;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		SYS_TRACE(0, "profile: couldn't open symbol file %s\n", path);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	elf = malloc(len + 1);
+	if (len < 0x34 || fread(elf, len, 1, fp) != 1) {
+		fclose(fp);
+		free(elf);
+		return -1;
+	}
+	fclose(fp);
+	prof->elf = (char *)elf;
+
+	// elf32, little endian
+	if (memcmp(elf, "\177ELF", 4) != 0 || elf[4] != 1 || elf[5] != 1) {
+		SYS_TRACE(0, "profile: %s isn't a little endian elf32 file\n", path);
+		return -1;
+	}
+
+	shoff = READ_MEM_WORD(elf + 0x20);
+	shentsize = READ_MEM_HALFWORD(elf + 0x2e);
+	shnum = READ_MEM_HALFWORD(elf + 0x30);
+	if (shentsize < 40 || shoff + (uint64_t)shnum * shentsize > (uint64_t)len)
+		return -1;
+
+	for (i = 0; i < shnum; i++) {
+		byte *sh = elf + shoff + i * shentsize;
+		byte *strsh;
+		uint symoff, symsize, stroff, strsize;
+
+		if (READ_MEM_WORD(sh + 4) != 2) // SHT_SYMTAB
+			continue;
+
+		symoff = READ_MEM_WORD(sh + 16);
+		symsize = READ_MEM_WORD(sh + 20);
+		if (READ_MEM_WORD(sh + 24) >= shnum)
+			continue;
+		strsh = elf + shoff + READ_MEM_WORD(sh + 24) * shentsize;
+		stroff = READ_MEM_WORD(strsh + 16);
+		strsize = READ_MEM_WORD(strsh + 20);
+		if (strsize == 0 || (uint64_t)symoff + symsize > (uint64_t)len || (uint64_t)stroff + strsize > (uint64_t)len)
+			continue;
+		elf[stroff + strsize - 1] = 0;
+
+		prof->syms = realloc(prof->syms, (n + symsize / 16) * sizeof(struct profile_symbol));
+		for (j = 0; j + 16 <= symsize; j += 16) {
+			byte *sym = elf + symoff + j;
+			uint name = READ_MEM_WORD(sym + 0);
+			uint type = sym[12] & 0xf;
+
+			// functions and untyped labels that are defined somewhere
+			if ((type != 2 && type != 0) || READ_MEM_HALFWORD(sym + 14) == 0 || name == 0 || name >= strsize)
+				continue;
+			if (elf[stroff + name] == '$' || elf[stroff + name] == 0)
+				continue;
+
+			prof->syms[n].addr = READ_MEM_WORD(sym + 4) & ~1;
+			prof->syms[n].size = READ_MEM_WORD(sym + 8);
+			prof->syms[n].name = (const char *)elf + stroff + name;
+			n++;
+		}
+	}
+
+	qsort(prof->syms, n, sizeof(struct profile_symbol), &compare_symbols);
+
+	// the ones without a size run up to the next
+	for (i = 0; (int)i < n; i++) {
+		if (prof->syms[i].size == 0)
+			prof->syms[i].size = ((int)i + 1 < n) ? prof->syms[i + 1].addr - prof->syms[i].addr : MMU_PAGESIZE;
+	}
+	prof->num_syms = n;
+
+	SYS_TRACE(1, "profile: %d symbols from %s\n", n, path);
+
+	return 0;
+}
+
+/* the symbol covering pc, -1 if there isn't one */
+static int find_symbol(struct profile *prof, uint32_t pc)
+{
+	int lo = 0, hi = prof->num_syms - 1, best = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (prof->syms[mid].addr <= pc) {
+			best = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	if (best >= 0 && pc - prof->syms[best].addr < prof->syms[best].size)
+		return best;
+	return -1;
+}
+
+static const char *mode_name(uint32_t flags)
+{
+	switch (flags & PSR_MODE_MASK) {
+		case PSR_MODE_user: return "usr";
+		case PSR_MODE_fiq: return "fiq";
+		case PSR_MODE_irq: return "irq";
+		case PSR_MODE_svc: return "svc";
+		case PSR_MODE_abt: return "abt";
+		case PSR_MODE_und: return "und";
+		case PSR_MODE_sys: return "sys";
+		default: return "???";
+	}
+}
+
+/* what a location is called in the report, the function if there is one */
+static const char *location_name(struct profile *prof, const struct profile_entry *ent, char *buf, size_t len)
+{
+	if (ent->sym >= 0)
+		return prof->syms[ent->sym].name;
+
+	snprintf(buf, len, "0x%08x", ent->pc);
+	return buf;
+}
+
+/* one line per function or unnamed address, and how many samples landed there */
+struct profile_bucket {
+	uint32_t key; // mode, if split by it
+	int sym;
+	uint32_t pc; // for the ones without a symbol
+	uint64_t count;
+	int first; // into the sorted entries
+	int num;
+};
+
+static int compare_entries(const void *_a, const void *_b)
+{
+	const struct profile_entry *a = _a, *b = _b;
+
+	if (a->sym != b->sym)
+		return a->sym < b->sym ? -1 : 1;
+	if (a->sym < 0 && a->pc != b->pc)
+		return a->pc < b->pc ? -1 : 1;
+	if ((a->flags & PSR_MODE_MASK) != (b->flags & PSR_MODE_MASK))
+		return (a->flags & PSR_MODE_MASK) < (b->flags & PSR_MODE_MASK) ? -1 : 1;
+	if (a->count != b->count)
+		return a->count > b->count ? -1 : 1;
+	return a->pc < b->pc ? -1 : 1;
+}
+
+static int compare_buckets(const void *_a, const void *_b)
+{
+	const struct profile_bucket *a = _a, *b = _b;
+
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	if (a->count != b->count)
+		return a->count > b->count ? -1 : 1;
+	return a->first - b->first;
+}
+
+static int compare_counts(const void *_a, const void *_b)
+{
+	const struct profile_entry *a = _a, *b = _b;
+
+	if (a->count != b->count)
+		return a->count > b->count ? -1 : 1;
+	return a->pc < b->pc ? -1 : 1;
+}
+
+/* group the sorted entries into buckets, by function and optionally by mode */
+static int make_buckets(struct profile_entry *ents, int n, bool by_mode, struct profile_bucket *buckets)
+{
+	int i, nb = 0;
+
+	for (i = 0; i < n; i++) {
+		uint32_t key = by_mode ? (ents[i].flags & PSR_MODE_MASK) : 0;
+		struct profile_bucket *b = nb ? &buckets[nb - 1] : NULL;
+
+		if (!b || b->sym != ents[i].sym || (ents[i].sym < 0 && b->pc != ents[i].pc) || b->key != key) {
+			b = &buckets[nb++];
+			b->key = key;
+			b->sym = ents[i].sym;
+			b->pc = ents[i].pc;
+			b->count = 0;
+			b->first = i;
+			b->num = 0;
+		}
+		b->count += ents[i].count;
+		b->num++;
+	}
+
+	qsort(buckets, nb, sizeof(struct profile_bucket), &compare_buckets);
+
+	return nb;
+}
+
+static double percent(uint64_t count, uint64_t total)
+{
+	return total ? count * 100.0 / total : 0;
+}
+
+static void write_report(struct profile *prof, FILE *fp)
+{
+	struct profile_entry *ents, *pages;
+	struct profile_bucket *buckets;
+	uint64_t modes[PSR_MODE_MASK + 1];
+	char buf[32];
+	int n = 0, nb, np, i, j, shown;
+	uint32_t mode;
+
+	ents = calloc(prof->hash_count + 1, sizeof(struct profile_entry));
+	for (i = 0; i < (int)prof->hash_size; i++) {
+		if (prof->hash[i].count) {
+			ents[n] = prof->hash[i];
+			ents[n].sym = find_symbol(prof, ents[n].pc);
+			n++;
+		}
+	}
+
+	fprintf(fp, "# armemu guest profile\n");
+	fprintf(fp, "# %llu samples over %.3f seconds, every %u us\n", (unsigned long long)prof->total,
+		(prof->end_time - prof->start_time) / 1e9, prof->interval_ns / 1000);
+	for (i = 0; i < prof->cluster->num_cores; i++)
+		fprintf(fp, "# core %d: %llu samples\n", i, (unsigned long long)prof->core_samples[i]);
+	fprintf(fp, "# %d symbols\n", prof->num_syms);
+
+	// by mode
+	memset(modes, 0, sizeof(modes));
+	for (i = 0; i < n; i++)
+		modes[ents[i].flags & PSR_MODE_MASK] += ents[i].count;
+	fprintf(fp, "\n## modes\n%10s %7s  %s\n", "samples", "%", "mode");
+	for (mode = 0; mode <= PSR_MODE_MASK; mode++) {
+		if (modes[mode])
+			fprintf(fp, "%10llu %6.2f%%  %s\n", (unsigned long long)modes[mode], percent(modes[mode], prof->total), mode_name(mode));
+	}
+
+	// flat, by function over all of the modes
+	qsort(ents, n, sizeof(struct profile_entry), &compare_entries);
+	buckets = calloc(n + 1, sizeof(struct profile_bucket));
+	nb = make_buckets(ents, n, FALSE, buckets);
+
+	fprintf(fp, "\n## flat\n%10s %7s %7s  %s\n", "samples", "%", "cum %", "function");
+	{
+		uint64_t cum = 0;
+
+		for (i = 0; i < nb; i++) {
+			cum += buckets[i].count;
+			fprintf(fp, "%10llu %6.2f%% %6.2f%%  %s\n", (unsigned long long)buckets[i].count,
+				percent(buckets[i].count, prof->total), percent(cum, prof->total),
+				location_name(prof, &ents[buckets[i].first], buf, sizeof(buf)));
+		}
+	}
+
+	// hierarchical, mode then function then the hottest addresses in it
+	nb = make_buckets(ents, n, TRUE, buckets);
+
+	fprintf(fp, "\n## by mode, function and address\n");
+	for (i = 0, shown = 0; i < nb; i++) {
+		struct profile_bucket *b = &buckets[i];
+
+		if (i == 0 || b->key != buckets[i - 1].key) {
+			fprintf(fp, "%s %llu %.2f%%\n", mode_name(b->key), (unsigned long long)modes[b->key], percent(modes[b->key], prof->total));
+			shown = 0;
+		}
+		if (shown++ >= PROFILE_TOP_FUNCTIONS)
+			continue;
+
+		fprintf(fp, "  %10llu %6.2f%%  %s\n", (unsigned long long)b->count, percent(b->count, prof->total),
+			location_name(prof, &ents[b->first], buf, sizeof(buf)));
+		if (ents[b->first].sym < 0)
+			continue;
+
+		// entries within a function and mode are already hottest first
+		for (j = 0; j < b->num && j < PROFILE_TOP_ADDRESSES; j++) {
+			struct profile_entry *e = &ents[b->first + j];
+
+			fprintf(fp, "    %10llu %6.2f%%  0x%08x%s +0x%x\n", (unsigned long long)e->count,
+				percent(e->count, prof->total), e->pc, (e->flags & PSR_THUMB) ? "t" : "",
+				e->pc - prof->syms[e->sym].addr);
+		}
+	}
+
+	// hot codepages, by virtual page and instruction set
+	pages = calloc(n + 1, sizeof(struct profile_entry));
+	for (i = 0, np = 0; i < n; i++) {
+		uint32_t page = ents[i].pc & ~(MMU_PAGESIZE - 1);
+		uint32_t thumb = ents[i].flags & PSR_THUMB;
+
+		for (j = 0; j < np; j++) {
+			if (pages[j].pc == page && pages[j].flags == thumb)
+				break;
+		}
+		if (j == np) {
+			pages[np].pc = page;
+			pages[np].flags = thumb;
+			pages[np].sym = -1;
+			np++;
+		}
+		pages[j].count += ents[i].count;
+	}
+	qsort(pages, np, sizeof(struct profile_entry), &compare_counts);
+
+	fprintf(fp, "\n## codepages\n%10s %7s  %-10s %-5s %s\n", "samples", "%", "page", "isa", "functions");
+	for (i = 0; i < np && i < PROFILE_TOP_PAGES; i++) {
+		int first = find_symbol(prof, pages[i].pc);
+
+		// the symbols in the page, as far as there's room
+		fprintf(fp, "%10llu %6.2f%%  0x%08x %-5s", (unsigned long long)pages[i].count, percent(pages[i].count, prof->total),
+			pages[i].pc, pages[i].flags ? "thumb" : "arm");
+		if (first < 0) {
+			for (first = 0; first < prof->num_syms && prof->syms[first].addr < pages[i].pc; first++)
+				;
+		}
+		for (j = first, shown = 0; j >= 0 && j < prof->num_syms && prof->syms[j].addr < pages[i].pc + MMU_PAGESIZE && shown < 4; j++, shown++)
+			fprintf(fp, " %s", prof->syms[j].name);
+		fprintf(fp, "\n");
+	}
+
+	free(pages);
+	free(buckets);
+	free(ents);
+}
+
+int start_profile(struct cpu_cluster *cluster)
+{
+	struct profile *prof;
+	const char *file = get_config_key_string("profile", "file", NULL);
+	const char *symbols = get_config_key_string("profile", "symbols", NULL);
+	uint rate;
+
+	if (!file)
+		return 0;
+
+	rate = strtoul(get_config_key_string("profile", "rate", "0"), NULL, 0);
+	if (rate == 0)
+		rate = DEFAULT_PROFILE_RATE;
+
+	prof = cluster->profile = calloc(1, sizeof(struct profile));
+	prof->cluster = cluster;
+	prof->file = file;
+	prof->interval_ns = 1000000000 / rate;
+	prof->ring = calloc(PROFILE_RING_SIZE, sizeof(struct profile_sample));
+
+	// not being able to name things still leaves the addresses
+	if (!symbols)
+		symbols = cluster->symbol_file;
+	if (symbols)
+		load_symbols(prof, symbols);
+
+	prof->start_time = profile_now();
+	prof->thread = SDL_CreateThread(&profile_thread_entry, prof);
+
+	return 0;
+}
+
+/* stop sampling and write the report out, while the cores are still there */
+void stop_profile(struct cpu_cluster *cluster)
+{
+	struct profile *prof = cluster->profile;
+	FILE *fp;
+
+	if (!prof)
+		return;
+
+	prof->stopping = TRUE;
+	SDL_WaitThread(prof->thread, NULL);
+	prof->end_time = profile_now();
+	profile_drain(prof);
+
+	fp = fopen(prof->file, "w");
+	if (fp) {
+		write_report(prof, fp);
+		fclose(fp);
+	} else {
+		SYS_TRACE(0, "profile: couldn't write %s\n", prof->file);
+	}
+
+	free(prof->hash);
+	free(prof->ring);
+	free(prof->syms);
+	free(prof->elf);
+	free(prof);
+	cluster->profile = NULL;
+}
@@ -0,0 +1,538 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <SDL/SDL.h>
+
+#include <sys/sys.h>
+#include <config.h>
+#include <arm/arm.h>
+#include <arm/uops.h>
+#include <arm/ops.h>
+#include <arm/stats.h>
+#include <util/atomic.h>
+
+#define DEFAULT_STATS_INTERVAL 1000 // ms
+
+struct cpu_stats {
+	SDL_TimerID timer;
+	uint interval;
+
+	// json lines
+	int fd;
+	bool is_socket;
+	char *line;
+	size_t line_size;
+
+	// shared memory
+	struct stats_shm_header *shm;
+	size_t shm_size;
+	char shm_name[64];
+
+	struct perf_counters last;
+	uint64_t last_time;
+
+	// the run as a whole, for the summary
+	dword max_instructions;
+	struct cpu_event budget_event;
+	bool summary;
+	bool caches;
+	SDL_mutex *report_lock; // so the cores' reports don't interleave
+	bool finished;
+	uint64_t start_time;
+	uint64_t end_time;
+	struct perf_counters final;
+};
+
+static const char *const counter_names[MAX_PERF_COUNTER] = {
+	[INS_COUNT] = "ins",
+	[EXCEPTIONS] = "exceptions",
+	[INS_DECODE] = "ins_decode",
+	[INS_PREDECODED] = "ins_predecoded",
+	[CODEPAGE_INVALIDATE] = "codepage_invalidate",
+	[CODEPAGE_EVICT] = "codepage_evict",
+	[CODEPAGE_MEM_LIVE] = "codepage_mem_live",
+	[CODEPAGE_MEM_PEAK] = "codepage_mem_peak",
+	[CODEPAGE_PRELOAD] = "codepage_preload",
+	[CODEPAGE_LOOKUP_HIT] = "codepage_lookup_hit",
+	[CODEPAGE_LOOKUP_MISS] = "codepage_lookup_miss",
+	[CODEPAGE_LOOKUP_PROBE] = "codepage_lookup_probe",
+	[CODEPAGE_LOAD] = "codepage_load",
+	[CODEPAGE_FLUSH_ALL] = "codepage_flush_all",
+	[CODEPAGE_RETRANSLATE] = "codepage_retranslate",
+	[CODEPAGE_HASH_GROW] = "codepage_hash_grow",
+	[IDLE_PARK] = "idle_park",
+	[MMU_SLOW_TRANSLATE] = "mmu_slow_translate",
+	[MMU_SLOW_FETCH] = "mmu_slow_fetch",
+	[MMU_SLOW_READ] = "mmu_slow_read",
+	[MMU_SLOW_WRITE] = "mmu_slow_write",
+	[MMU_SLOW_PERMISSION] = "mmu_slow_permission",
+	[MMU_SLOW_MMU_OFF] = "mmu_slow_mmu_off",
+	[MMU_SLOW_PTABLE_CACHED] = "mmu_slow_ptable_cached",
+	[MMU_SLOW_SECTION] = "mmu_slow_section",
+	[MMU_SLOW_PAGE] = "mmu_slow_page",
+	[MMU_SLOW_FAULT] = "mmu_slow_fault",
+	[MMU_TLB_FLUSH] = "mmu_tlb_flush",
+	[MMU_TLB_FLUSH_PAGE] = "mmu_tlb_flush_page",
+	[MMU_TLB_FLUSH_ASID] = "mmu_tlb_flush_asid",
+#if COUNT_MMU_OPS
+	[MMU_READ] = "mmu_read",
+	[MMU_WRITE] = "mmu_write",
+	[MMU_INS_FETCH] = "mmu_ins_fetch",
+	[MMU_FASTPATH] = "mmu_fastpath",
+	[MMU_SLOWPATH] = "mmu_slowpath",
+	[MMU_MULTIPLE_FASTPATH] = "mmu_multiple_fastpath",
+	[MMU_FASTMEM] = "mmu_fastmem",
+	[MMU_BIG_PAGE_HIT] = "mmu_big_page_hit",
+#endif
+#if COUNT_BRANCH_CACHE
+	[BRANCH_CACHE_HIT] = "branch_cache_hit",
+	[BRANCH_CACHE_MISS] = "branch_cache_miss",
+	[RSB_HIT] = "rsb_hit",
+	[RSB_MISS] = "rsb_miss",
+	[DIRECT_BRANCH_HIT] = "direct_branch_hit",
+	[DIRECT_BRANCH_MISS] = "direct_branch_miss",
+#endif
+#if COUNT_CYCLES
+	[CYCLE_COUNT] = "cycles",
+#endif
+#if COUNT_ARM_OPS
+	[OP_SKIPPED_CONDITION] = "op_skipped_condition",
+	[OP_NOP] = "op_nop",
+	[OP_LOAD] = "op_load",
+	[OP_STORE] = "op_store",
+	[OP_DATA_PROC] = "op_data_proc",
+	[OP_MUL] = "op_mul",
+	[OP_BRANCH] = "op_branch",
+	[OP_COP_REG_TRANS] = "op_cop_reg_trans",
+	[OP_COP_DATA_PROC] = "op_cop_data_proc",
+	[OP_COP_LOAD_STORE] = "op_cop_load_store",
+	[OP_MISC] = "op_misc",
+#endif
+};
+
+/* a name for the counter that's fine as a json key, the uop ones are built from the opcode's */
+const char *perf_counter_name(int counter, char *buf, size_t len)
+{
+	const char *prefix = "counter_", *name = NULL;
+	char *s;
+
+	if (counter >= 0 && counter < MAX_PERF_COUNTER && counter_names[counter])
+		return counter_names[counter];
+
+#if COUNT_UOPS
+	if (counter >= UOP_BASE && counter < UOP_TOP) {
+		prefix = "uop_";
+		name = uop_opcode_to_str(counter - UOP_BASE);
+	}
+#endif
+#if COUNT_FUSIONS
+	if (counter >= FUSION_BASE && counter < FUSION_TOP) {
+		prefix = "fused_";
+		name = uop_opcode_to_str(FIRST_FUSED_OPCODE + counter - FUSION_BASE);
+	}
+#endif
+#if COUNT_ARITH_UOPS
+	if (counter >= UOP_ARITH_OPCODE && counter < UOP_ARITH_OPCODE_TOP) {
+		prefix = "uop_arith_";
+		name = dp_op_to_str(counter - UOP_ARITH_OPCODE);
+	}
+#endif
+
+	if (name)
+		snprintf(buf, len, "%s%s", prefix, name);
+	else
+		snprintf(buf, len, "%s%d", prefix, counter);
+
+	for (s = buf; *s; s++)
+		*s = isalnum((unsigned char)*s) ? tolower((unsigned char)*s) : '_';
+
+	return buf;
+}
+
+/* the counters added up over every core, from any thread. they're only read, so a core can be mid update */
+void cpu_stats_snapshot(struct cpu_cluster *cluster, struct perf_counters *out)
+{
+	int i, c;
+
+	memset(out, 0, sizeof(*out));
+	for (c = 0; c < cluster->num_cores; c++) {
+		if (!cluster->cores[c])
+			continue;
+		for (i = 0; i < MAX_PERF_COUNTER; i++)
+			out->count[i] += cluster->cores[c]->perf_counters.count[i];
+	}
+}
+
+static uint64_t stats_now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_append(struct cpu_stats *stats, size_t *pos, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void stats_append(struct cpu_stats *stats, size_t *pos, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(stats->line + *pos, stats->line_size - *pos, fmt, ap);
+	va_end(ap);
+
+	if (len > 0)
+		*pos += len;
+	if (*pos >= stats->line_size)
+		*pos = stats->line_size - 1;
+}
+
+static void write_json_line(struct cpu_stats *stats, const struct perf_counters *now, uint64_t elapsed)
+{
+	double secs = elapsed ? elapsed / 1e9 : 1;
+	char name[64];
+	size_t pos = 0;
+	int i;
+
+#define RATE(c) ((now->count[c] - stats->last.count[c]) / secs)
+	stats_append(stats, &pos, "{\"time\":%.3f,\"interval\":%.3f,\"mips\":%.3f,\"decodes_per_sec\":%.1f,\"exceptions_per_sec\":%.1f",
+		stats_now(CLOCK_REALTIME) / 1e9, secs, RATE(INS_COUNT) / 1e6, RATE(INS_DECODE), RATE(EXCEPTIONS));
+#if COUNT_MMU_OPS
+	stats_append(stats, &pos, ",\"mmu_fastpath_per_sec\":%.1f,\"mmu_slowpath_per_sec\":%.1f",
+		RATE(MMU_FASTPATH), RATE(MMU_SLOWPATH));
+#endif
+#undef RATE
+
+	stats_append(stats, &pos, ",\"counters\":{");
+	for (i = 0; i < MAX_PERF_COUNTER; i++) {
+		stats_append(stats, &pos, "%s\"%s\":%lld", i ? "," : "",
+			perf_counter_name(i, name, sizeof(name)), (long long)now->count[i]);
+	}
+	stats_append(stats, &pos, "}}\n");
+
+	ssize_t err = stats->is_socket ? send(stats->fd, stats->line, pos, MSG_NOSIGNAL) : write(stats->fd, stats->line, pos);
+	if (err < 0) {
+		SYS_TRACE(0, "stats: couldn't write the stats out, giving up on them\n");
+		close(stats->fd);
+		stats->fd = -1;
+	}
+}
+
+static void update_shm(struct cpu_stats *stats, const struct perf_counters *now)
+{
+	struct stats_shm_header *shm = stats->shm;
+	int i;
+
+	atomic_store_relaxed(&shm->seq, shm->seq + 1);
+	atomic_fence();
+	for (i = 0; i < MAX_PERF_COUNTER; i++)
+		shm->counters[i] = now->count[i];
+	shm->time_ns = stats_now(CLOCK_MONOTONIC);
+	atomic_store_release(&shm->seq, shm->seq + 1);
+}
+
+static void stats_update(struct cpu_cluster *cluster)
+{
+	struct cpu_stats *stats = cluster->stats;
+	struct perf_counters now;
+	uint64_t time = stats_now(CLOCK_MONOTONIC);
+
+	cpu_stats_snapshot(cluster, &now);
+
+	if (stats->fd >= 0)
+		write_json_line(stats, &now, time - stats->last_time);
+	if (stats->shm)
+		update_shm(stats, &now);
+
+	stats->last = now;
+	stats->last_time = time;
+}
+
+/* runs on the SDL timer thread */
+static Uint32 stats_timer(Uint32 interval, void *param)
+{
+	stats_update((struct cpu_cluster *)param);
+
+	return interval;
+}
+
+static int open_stats_file(struct cpu_stats *stats, const char *path)
+{
+	if (strncmp(path, "unix:", 5) == 0) {
+		struct sockaddr_un addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path + 5);
+
+		stats->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (stats->fd < 0 || connect(stats->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			SYS_TRACE(0, "stats: couldn't connect to %s\n", path + 5);
+			return -1;
+		}
+		stats->is_socket = TRUE;
+	} else {
+		stats->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (stats->fd < 0) {
+			SYS_TRACE(0, "stats: couldn't open %s\n", path);
+			return -1;
+		}
+	}
+
+	stats->line_size = 256 + MAX_PERF_COUNTER * 64;
+	stats->line = malloc(stats->line_size);
+
+	return 0;
+}
+
+static int open_stats_shm(struct cpu_stats *stats, const char *name)
+{
+	struct stats_shm_header *shm;
+	size_t names = 0;
+	char buf[64];
+	char *p;
+	int i, fd;
+
+	for (i = 0; i < MAX_PERF_COUNTER; i++)
+		names += strlen(perf_counter_name(i, buf, sizeof(buf))) + 1;
+
+	snprintf(stats->shm_name, sizeof(stats->shm_name), "%s", name);
+	fd = shm_open(stats->shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		SYS_TRACE(0, "stats: couldn't create shared memory %s\n", stats->shm_name);
+		return -1;
+	}
+
+	stats->shm_size = sizeof(*shm) + MAX_PERF_COUNTER * sizeof(uint64_t) + names;
+	if (ftruncate(fd, stats->shm_size) < 0 ||
+			(shm = mmap(NULL, stats->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		SYS_TRACE(0, "stats: couldn't map shared memory %s\n", stats->shm_name);
+		close(fd);
+		shm_unlink(stats->shm_name);
+		return -1;
+	}
+	close(fd);
+
+	shm->version = STATS_SHM_VERSION;
+	shm->num_counters = MAX_PERF_COUNTER;
+	shm->names_offset = sizeof(*shm) + MAX_PERF_COUNTER * sizeof(uint64_t);
+	shm->pid = getpid();
+	p = (char *)shm + shm->names_offset;
+	for (i = 0; i < MAX_PERF_COUNTER; i++) {
+		strcpy(p, perf_counter_name(i, buf, sizeof(buf)));
+		p += strlen(p) + 1;
+	}
+	atomic_store_release(&shm->magic, STATS_SHM_MAGIC);
+
+	stats->shm = shm;
+
+	return 0;
+}
+
+/* the counters and the time as the run ends, the first of running out of budget or stopping */
+static void finish_run(struct cpu_cluster *cluster)
+{
+	struct cpu_stats *stats = cluster->stats;
+
+	if (stats->finished)
+		return;
+
+	cpu_stats_snapshot(cluster, &stats->final);
+	stats->end_time = stats_now(CLOCK_MONOTONIC);
+	stats->finished = TRUE;
+}
+
+/* on the boot core, once it has run [cpu] max_instructions */
+static void budget_event(void *arg)
+{
+	struct cpu_cluster *cluster = arg;
+
+	finish_run(cluster);
+	machine_halt(cluster->machine, 0);
+}
+
+/* called on each core as it starts running, the boot core counts down the instruction budget */
+void start_instruction_budget(struct cpu_cluster *cluster)
+{
+	struct cpu_stats *stats = cluster->stats;
+
+	if (stats->max_instructions && get_core_id() == 0)
+		cpu_schedule_event(&stats->budget_event, stats->max_instructions, &budget_event, cluster);
+}
+
+/* a few lines of key and value, the same ones every time so runs can be diffed */
+static void print_summary(struct cpu_stats *stats)
+{
+	static const int summary_counters[] = {
+		INS_DECODE, EXCEPTIONS, CODEPAGE_INVALIDATE, CODEPAGE_EVICT, IDLE_PARK, MMU_SLOW_TRANSLATE,
+	};
+	double secs = (stats->end_time - stats->start_time) / 1e9;
+	char name[64];
+	uint i;
+
+	printf("stats: instructions %lld\n", (long long)stats->final.count[INS_COUNT]);
+	printf("stats: seconds %.3f\n", secs);
+	printf("stats: mips %.2f\n", secs > 0 ? stats->final.count[INS_COUNT] / secs / 1e6 : 0);
+	for (i = 0; i < sizeof(summary_counters) / sizeof(summary_counters[0]); i++) {
+		printf("stats: %s %lld\n", perf_counter_name(summary_counters[i], name, sizeof(name)),
+			(long long)stats->final.count[summary_counters[i]]);
+	}
+	fflush(stdout);
+}
+
+static double percent(int64_t part, int64_t whole)
+{
+	return whole ? part * 100.0 / whole : 0;
+}
+
+/*
+ * the current core's decode cache and mmu counters, with what they work out to, then
+ * the codepages themselves. enough to tell a guest that keeps missing the codepage
+ * hash from one that keeps invalidating its own code or walking page tables.
+ */
+void dump_cache_stats(void)
+{
+	const int64_t *c = cpu.perf_counters.count;
+	int64_t lookups = c[CODEPAGE_LOOKUP_HIT] + c[CODEPAGE_LOOKUP_MISS];
+	int64_t walks = c[MMU_SLOW_TRANSLATE];
+
+	printf("cache stats, core %d, %lld instructions\n", cpu.core_id, (long long)c[INS_COUNT]);
+
+	printf("codepage lookups %lld: hit %.2f%%, %.2f chain entries looked at per lookup\n",
+		(long long)lookups, percent(c[CODEPAGE_LOOKUP_HIT], lookups),
+		lookups ? (double)c[CODEPAGE_LOOKUP_PROBE] / lookups : 0);
+	printf("codepage loads %lld, preloaded from the translation cache %lld, decodes %lld, predecoded %lld\n",
+		(long long)c[CODEPAGE_LOAD], (long long)c[CODEPAGE_PRELOAD], (long long)c[INS_DECODE], (long long)c[INS_PREDECODED]);
+	printf("codepage flushes: all %lld, retranslate %lld, store into code %lld, evict %lld, hash grow %lld\n",
+		(long long)c[CODEPAGE_FLUSH_ALL], (long long)c[CODEPAGE_RETRANSLATE], (long long)c[CODEPAGE_INVALIDATE],
+		(long long)c[CODEPAGE_EVICT], (long long)c[CODEPAGE_HASH_GROW]);
+	printf("codepage memory: %lld bytes, %lld at most\n",
+		(long long)c[CODEPAGE_MEM_LIVE], (long long)c[CODEPAGE_MEM_PEAK]);
+#if COUNT_BRANCH_CACHE
+	// only the full instrumentation loop counts these
+	if (c[DIRECT_BRANCH_HIT] + c[DIRECT_BRANCH_MISS] + c[BRANCH_CACHE_HIT] + c[BRANCH_CACHE_MISS] + c[RSB_HIT] + c[RSB_MISS]) {
+		printf("branch target hit: direct %.2f%% of %lld, indirect %.2f%% of %lld, return stack %.2f%% of %lld\n",
+			percent(c[DIRECT_BRANCH_HIT], c[DIRECT_BRANCH_HIT] + c[DIRECT_BRANCH_MISS]),
+			(long long)(c[DIRECT_BRANCH_HIT] + c[DIRECT_BRANCH_MISS]),
+			percent(c[BRANCH_CACHE_HIT], c[BRANCH_CACHE_HIT] + c[BRANCH_CACHE_MISS]),
+			(long long)(c[BRANCH_CACHE_HIT] + c[BRANCH_CACHE_MISS]),
+			percent(c[RSB_HIT], c[RSB_HIT] + c[RSB_MISS]), (long long)(c[RSB_HIT] + c[RSB_MISS]));
+	}
+#endif
+
+	printf("mmu slow translates %lld: fetch %lld, read %lld, write %lld, missing permission %lld\n",
+		(long long)walks, (long long)c[MMU_SLOW_FETCH], (long long)c[MMU_SLOW_READ],
+		(long long)c[MMU_SLOW_WRITE], (long long)c[MMU_SLOW_PERMISSION]);
+	printf("mmu slow translates found: mmu off %lld, section %lld, page %lld, fault %lld, table from the ptable cache %lld\n",
+		(long long)c[MMU_SLOW_MMU_OFF], (long long)c[MMU_SLOW_SECTION], (long long)c[MMU_SLOW_PAGE],
+		(long long)c[MMU_SLOW_FAULT], (long long)c[MMU_SLOW_PTABLE_CACHED]);
+	printf("tlb flushes: all %lld, page %lld, asid %lld\n",
+		(long long)c[MMU_TLB_FLUSH], (long long)c[MMU_TLB_FLUSH_PAGE], (long long)c[MMU_TLB_FLUSH_ASID]);
+
+	uop_dump_codepages(16);
+	fflush(stdout);
+}
+
+/* on each core's thread once it's stopped running, while its codepages are still around */
+void stats_core_stopped(struct cpu_cluster *cluster)
+{
+	struct cpu_stats *stats = cluster->stats;
+
+	if (!stats->caches)
+		return;
+
+	SDL_LockMutex(stats->report_lock);
+	dump_cache_stats();
+	SDL_UnlockMutex(stats->report_lock);
+}
+
+/* before the cores start, set up the budget and start sending the counters wherever the config says */
+int start_stats(struct cpu_cluster *cluster)
+{
+	struct cpu_stats *stats;
+	const char *file = get_config_key_string("stats", "file", NULL);
+	const char *shm = get_config_key_string("stats", "shm", NULL);
+
+	stats = cluster->stats = calloc(1, sizeof(struct cpu_stats));
+	stats->fd = -1;
+	stats->max_instructions = strtoull(get_config_key_string("cpu", "max_instructions", "0"), NULL, 0);
+	stats->summary = get_config_key_bool("stats", "summary", stats->max_instructions != 0);
+	stats->caches = get_config_key_bool("stats", "caches", FALSE);
+	stats->report_lock = SDL_CreateMutex();
+	stats->start_time = stats_now(CLOCK_MONOTONIC);
+	stats->interval = strtoul(get_config_key_string("stats", "interval", "0"), NULL, 10);
+	if (stats->interval == 0)
+		stats->interval = DEFAULT_STATS_INTERVAL;
+
+	if (file && open_stats_file(stats, file) < 0)
+		return -1;
+	if (shm && open_stats_shm(stats, shm) < 0)
+		return -1;
+
+	stats->last_time = stats->start_time;
+	if (file || shm)
+		stats->timer = SDL_AddTimer(stats->interval, &stats_timer, cluster);
+
+	return 0;
+}
+
+/* one last update, so what the cores did at the end is in there too */
+void stop_stats(struct cpu_cluster *cluster)
+{
+	struct cpu_stats *stats = cluster->stats;
+
+	if (!stats)
+		return;
+
+	if (stats->timer)
+		SDL_RemoveTimer(stats->timer);
+	if (stats->fd >= 0 || stats->shm)
+		stats_update(cluster);
+
+	finish_run(cluster);
+	if (stats->summary)
+		print_summary(stats);
+
+	if (stats->fd >= 0)
+		close(stats->fd);
+	if (stats->shm) {
+		munmap(stats->shm, stats->shm_size);
+		shm_unlink(stats->shm_name);
+	}
+	free(stats->line);
+	SDL_DestroyMutex(stats->report_lock);
+	free(stats);
+	cluster->stats = NULL;
+}
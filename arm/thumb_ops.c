@@ -509,7 +509,7 @@ void thumb_op_add_to_sp_pc(struct uop *op)
 		op->simple_dp_imm.dest_reg = Rd;
 		op->simple_dp_imm.source_reg = SP;
 	} else {
-		panic_cpu("thumb_op_add_to_sp_pc unimplemented form\n");
+		decode_panic("thumb_op_add_to_sp_pc unimplemented form\n");
 		put_reg(Rd, (get_reg(15) & 0xfffffffc) + immed);
 	}
 }
@@ -614,6 +614,7 @@ void thumb_op_software_breakpoint(struct uop *op)
 
 	op->opcode = BKPT;
 	op->cond = COND_AL;
+	op->swi.comment = ins & 0x00ff;
 
 	CPU_TRACE(5, "thumb breakpoint, ins 0x%x\n", ins);
 }
@@ -634,6 +635,7 @@ void thumb_op_swi(struct uop *op)
 
 	op->opcode = SWI;
 	op->cond = COND_AL;
+	op->swi.comment = ins & 0x00ff;
 
 	CPU_TRACE(5, "\t\tswi 0x%x\n", ins & 0x000000ff);
 }
@@ -660,8 +662,7 @@ void thumb_op_conditional_branch(struct uop *op)
 	op->cond = cond;
 	op->flags = 0;
 	op->b_immediate.target = target;
-	op->b_immediate.link_target = 0;
-	op->b_immediate.target_cp = NULL;
+	op->b_immediate.target_cp = CP_HANDLE_NONE;
 	if((op->b_immediate.target >> MMU_PAGESIZE_SHIFT) == ((pc - 8) >> MMU_PAGESIZE_SHIFT))
 		op->opcode = B_IMMEDIATE_LOCAL; // it's within the current codepage
 	else
@@ -689,8 +690,7 @@ void thumb_op_branch(struct uop *op)
 	op->cond = COND_AL;
 	op->flags = 0;
 	op->b_immediate.target = target;
-	op->b_immediate.link_target = 0;
-	op->b_immediate.target_cp = NULL;
+	op->b_immediate.target_cp = CP_HANDLE_NONE;
 	if((op->b_immediate.target >> MMU_PAGESIZE_SHIFT) == ((pc - 8) >> MMU_PAGESIZE_SHIFT))
 		op->opcode = B_IMMEDIATE_LOCAL; // it's within the current codepage
 	else
@@ -714,6 +714,7 @@ void thumb_op_bx_reg(struct uop *op)
 	op->opcode = B_REG;
 	op->flags = UOPBFLAGS_SETTHUMB_COND;
 	op->b_reg.reg = Rm;
+	op->b_reg.target_cp = CP_HANDLE_NONE;
 
 	// if this is blx...
 	if(L) {
@@ -759,6 +760,7 @@ void thumb_op_bl_blx(struct uop *op)
 			op->b_reg_offset.reg = LR;
 			op->b_reg_offset.link_offset = -2;
 			op->b_reg_offset.offset = offset;		
+			op->b_reg_offset.target_cp = CP_HANDLE_NONE;
 			op->flags |= UOPBFLAGS_LINK;
 			break;
 		case 1: // second half of blx
@@ -769,11 +771,12 @@ void thumb_op_bl_blx(struct uop *op)
 			op->b_reg_offset.reg = LR;
 			op->b_reg_offset.link_offset = -2;
 			op->b_reg_offset.offset = offset;		
+			op->b_reg_offset.target_cp = CP_HANDLE_NONE;
 			op->flags |= UOPBFLAGS_LINK;
 			op->flags |= UOPBFLAGS_UNSETTHUMB_ALWAYS; // switch back to arm unconditionally
 			break;
 		case 0: // invalid, covered by the unconditional branch instruction
 		default:
-			panic_cpu("bad decode of bl/blx instruction\n");
+			decode_panic("bad decode of bl/blx instruction\n");
 	}
 }
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * persistent translation cache. when the boot core shuts down, the decoded uops of
+ * every codepage that came out of plain memory are written out along with a copy of
+ * the page they were decoded from. the next run maps the file in, and a new codepage
+ * is filled from it instead of being decoded again, as long as the page in memory is
+ * byte for byte the one it was decoded from. a changed rom never runs stale uops.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <debug.h>
+#include <options.h>
+#include <arm/arm.h>
+#include <util/endian.h>
+#include <config.h>
+#include "uop_p.h"
+
+#define UOP_CACHE_MAGIC "ARMEMUTC"
+#define UOP_CACHE_VERSION 2
+
+struct uop_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t uop_size;
+	uint32_t opcode_hash; // the names of the opcodes, in order
+	uint32_t decode_flags; // anything else that changes what the decoder puts out
+	uint32_t isa;
+	uint32_t core;
+	uint32_t num_entries;
+	uint32_t pad;
+};
+
+#define UOP_CACHE_FUSION		0x1
+#define UOP_CACHE_IDLE_DETECT	0x2
+#define UOP_CACHE_THREADED		0x4
+
+struct uop_cache_entry {
+	uint64_t hash; // of page
+	uint32_t address; // virtual address it was decoded to run at
+	uint32_t thumb;
+	uint32_t chunk_mask; // the chunks stored after the page, lowest first
+	uint32_t size; // of the whole entry
+	byte page[MMU_PAGESIZE];
+	// followed by the chunks, each CP_CHUNK_INS + 1 uops
+};
+
+#define CHUNK_BYTES (sizeof(struct uop) * (CP_CHUNK_INS + 1))
+
+/* the mapped file, each core has its own view */
+static __thread const char *cache_path;
+static __thread byte *cache_map;
+static __thread size_t cache_map_size;
+static __thread const struct uop_cache_entry **cache_index; // sorted by hash, address, thumb
+static __thread unsigned int cache_entries;
+
+static uint64_t hash_page(const void *page)
+{
+	const byte *p = page;
+	uint64_t hash = 14695981039346656037ULL;
+	unsigned int i;
+
+	for(i = 0; i < MMU_PAGESIZE; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int compare_key(uint64_t hash, armaddr_t address, bool thumb, const struct uop_cache_entry *e)
+{
+	if(hash != e->hash)
+		return hash < e->hash ? -1 : 1;
+	if(address != e->address)
+		return address < e->address ? -1 : 1;
+	if((uint32_t)thumb != e->thumb)
+		return (uint32_t)thumb < e->thumb ? -1 : 1;
+	return 0;
+}
+
+static int compare_entries(const void *_a, const void *_b)
+{
+	const struct uop_cache_entry *a = *(const struct uop_cache_entry * const *)_a;
+	const struct uop_cache_entry *b = *(const struct uop_cache_entry * const *)_b;
+
+	return compare_key(a->hash, a->address, a->thumb, b);
+}
+
+static const struct uop_cache_entry *find_entry(uint64_t hash, armaddr_t address, bool thumb)
+{
+	unsigned int lo = 0, hi = cache_entries;
+
+	while(lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		int c = compare_key(hash, address, thumb, cache_index[mid]);
+
+		if(c == 0)
+			return cache_index[mid];
+		if(c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+static void fill_header(struct uop_cache_header *h)
+{
+	int i;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, UOP_CACHE_MAGIC, sizeof(h->magic));
+	h->version = UOP_CACHE_VERSION;
+	h->uop_size = sizeof(struct uop);
+	h->opcode_hash = 0;
+	for(i = 0; i < MAX_UOP_OPCODE; i++) {
+		const char *s;
+
+		for(s = uop_opcode_to_str(i); *s; s++)
+			h->opcode_hash = h->opcode_hash * 31 + *s;
+	}
+#if UOP_FUSION
+	h->decode_flags |= UOP_CACHE_FUSION;
+#endif
+	if(cpu.idle_detect)
+		h->decode_flags |= UOP_CACHE_IDLE_DETECT;
+#if UOP_DISPATCH == UOP_DISPATCH_THREADED
+	h->decode_flags |= UOP_CACHE_THREADED;
+#endif
+	h->isa = cpu.isa;
+	h->core = cpu.core;
+}
+
+/* map the cache file in, if there's one configured and it was made by a matching build and core */
+void uop_cache_open(void)
+{
+	struct uop_cache_header want;
+	const struct uop_cache_header *h;
+	struct stat st;
+	size_t off;
+	unsigned int i;
+	int fd;
+
+	cache_path = get_config_key_string("cpu", "translation_cache", NULL);
+	if(!cache_path)
+		return;
+
+	fd = open(cache_path, O_RDONLY);
+	if(fd < 0)
+		return;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct uop_cache_header)) {
+		close(fd);
+		return;
+	}
+	cache_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(cache_map == MAP_FAILED) {
+		cache_map = NULL;
+		return;
+	}
+	cache_map_size = st.st_size;
+
+	fill_header(&want);
+	h = (const struct uop_cache_header *)cache_map;
+	want.num_entries = h->num_entries;
+	if(memcmp(h, &want, sizeof(want)) != 0) {
+		UOP_TRACE(1, "uop: translation cache %s is from a different build or core, ignoring it\n", cache_path);
+		uop_cache_close();
+		return;
+	}
+
+	cache_index = calloc(h->num_entries ? h->num_entries : 1, sizeof(*cache_index));
+	off = sizeof(*h);
+	for(i = 0; i < h->num_entries; i++) {
+		const struct uop_cache_entry *e = (const struct uop_cache_entry *)(cache_map + off);
+
+		if(off + sizeof(*e) > cache_map_size || e->size < sizeof(*e) || off + e->size > cache_map_size)
+			break; // truncated
+		cache_index[cache_entries++] = e;
+		off += e->size;
+	}
+	qsort(cache_index, cache_entries, sizeof(*cache_index), &compare_entries);
+
+	UOP_TRACE(1, "uop: %u codepages in translation cache %s\n", cache_entries, cache_path);
+}
+
+void uop_cache_close(void)
+{
+	if(cache_map)
+		munmap(cache_map, cache_map_size);
+	cache_map = NULL;
+	cache_map_size = 0;
+	free(cache_index);
+	cache_index = NULL;
+	cache_entries = 0;
+}
+
+/*
+ * fill in a codepage that was just created from host memory, if the cache has it.
+ * cp can't be on the lru list yet, allocating its chunks may evict others.
+ */
+bool uop_cache_fill(struct uop_codepage *cp)
+{
+	const struct uop_cache_entry *e;
+	const struct uop *src;
+	int n, i;
+
+	if(!cache_entries || !cp->host_ptr)
+		return FALSE;
+
+	e = find_entry(hash_page(cp->host_ptr), cp->address, cp->thumb);
+	if(!e || memcmp(e->page, cp->host_ptr, MMU_PAGESIZE) != 0)
+		return FALSE;
+
+	src = (const struct uop *)(e + 1);
+	for(n = 0; n < cp->num_chunks; n++) {
+		struct uop *chunk;
+
+		if(!(e->chunk_mask & (1U << n)))
+			continue;
+
+		chunk = alloc_codepage_chunk(cp, n);
+		memcpy(chunk, src, CHUNK_BYTES);
+		src += CP_CHUNK_INS + 1;
+
+		for(i = 0; i <= CP_CHUNK_INS; i++) {
+			struct uop *op = &chunk[i];
+
+			// the raw instruction of an undecoded slot might not have been read in yet
+			if(i < CP_CHUNK_INS && (op->opcode == DECODE_ME_ARM || op->opcode == DECODE_ME_THUMB)) {
+				if(cp->thumb)
+					op->undecoded.raw_instruction = READ_MEM_HALFWORD(e->page + op->undecoded.slot * 2);
+				else
+					op->undecoded.raw_instruction = READ_MEM_WORD(e->page + op->undecoded.slot * 4);
+			}
+			uop_relocate(op);
+		}
+	}
+
+	inc_perf_counter(CODEPAGE_PRELOAD);
+	return TRUE;
+}
+
+static bool codepage_has_chunks(const struct uop_codepage *cp)
+{
+	int n;
+
+	for(n = 0; n < cp->num_chunks; n++) {
+		if(cp->chunks[n])
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static bool write_codepage(FILE *fp, const struct uop_codepage *cp, uint64_t hash)
+{
+	struct uop_cache_entry e;
+	int n;
+
+	memset(&e, 0, sizeof(e));
+	e.hash = hash;
+	e.address = cp->address;
+	e.thumb = cp->thumb;
+	e.size = sizeof(e);
+	for(n = 0; n < cp->num_chunks; n++) {
+		if(cp->chunks[n]) {
+			e.chunk_mask |= 1U << n;
+			e.size += CHUNK_BYTES;
+		}
+	}
+	memcpy(e.page, cp->host_ptr, MMU_PAGESIZE);
+
+	if(fwrite(&e, sizeof(e), 1, fp) != 1)
+		return TRUE;
+	for(n = 0; n < cp->num_chunks; n++) {
+		if(cp->chunks[n] && fwrite(cp->chunks[n], CHUNK_BYTES, 1, fp) != 1)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * write out what this core has decoded, along with whatever was in the old file and
+ * didn't come up this time. goes to a temporary file first, so a run that dies half
+ * way through or another machine saving at the same time can't leave a torn cache.
+ */
+void uop_cache_save(void)
+{
+	struct uop_cache_header h;
+	const struct uop_cache_entry **written;
+	unsigned int num_written = 0, max_written;
+	char *tmp;
+	FILE *fp;
+	unsigned int i;
+	bool err = FALSE;
+
+	if(!cache_path)
+		return;
+
+	max_written = cpu.codepage_count;
+	written = calloc(max_written ? max_written : 1, sizeof(*written));
+	tmp = malloc(strlen(cache_path) + 32);
+	sprintf(tmp, "%s.%d.%p", cache_path, (int)getpid(), (void *)&cpu);
+
+	fp = fopen(tmp, "wb");
+	if(!fp) {
+		UOP_TRACE(1, "uop: couldn't write translation cache %s\n", tmp);
+		free(tmp);
+		free(written);
+		return;
+	}
+
+	fill_header(&h);
+	err |= fwrite(&h, sizeof(h), 1, fp) != 1;
+
+	// the live codepages first
+	for(i = 0; i < cpu.codepage_hash_size && !err; i++) {
+		struct uop_codepage *cp;
+
+		for(cp = cpu.codepage_hash[i]; cp != NULL && !err; cp = cp->next) {
+			uint64_t hash;
+			const struct uop_cache_entry *old;
+
+			if(!cp->host_ptr || !codepage_has_chunks(cp))
+				continue;
+
+			hash = hash_page(cp->host_ptr);
+			err |= write_codepage(fp, cp, hash);
+			h.num_entries++;
+
+			// so the same page doesn't get carried over from the old file too
+			old = find_entry(hash, cp->address, cp->thumb);
+			if(old && num_written < max_written)
+				written[num_written++] = old;
+		}
+	}
+
+	// then anything from last time that wasn't used
+	for(i = 0; i < cache_entries && !err; i++) {
+		const struct uop_cache_entry *e = cache_index[i];
+		unsigned int j;
+
+		for(j = 0; j < num_written; j++) {
+			if(written[j] == e)
+				break;
+		}
+		if(j < num_written)
+			continue;
+
+		err |= fwrite(e, e->size, 1, fp) != 1;
+		h.num_entries++;
+	}
+
+	// now that it's all there, the real count
+	if(!err)
+		err |= fseek(fp, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, fp) != 1;
+	err |= fclose(fp) != 0;
+
+	if(err || rename(tmp, cache_path) != 0) {
+		UOP_TRACE(1, "uop: couldn't write translation cache %s\n", cache_path);
+		unlink(tmp);
+	} else {
+		UOP_TRACE(1, "uop: saved %u codepages to translation cache %s\n", h.num_entries, cache_path);
+	}
+
+	free(tmp);
+	free(written);
+}
@@ -27,131 +27,62 @@
 #include <options.h>
 #include <arm/arm.h>
 #include <arm/decoder.h>
+#include <arm/jit.h>
 #include <util/atomic.h>
 #include <util/math.h>
+#include <util/endian.h>
+#include <config.h>
+#include "uop_p.h"
+#include <sys/mman.h>
 
-#define ASSERT_VALID_REG(x) ASSERT((x) < 16);
-
-#define DATA_PROCESSING_OP_TABLE(opcode, result, a, b, arith_op, Rd_writeback, carry, ovl) \
-	switch(opcode) { \
-		case AOP_AND: /* AND */ \
-			result = a & b; \
-			break; \
-		case AOP_EOR: /* EOR */ \
-			result = a ^ b; \
-			break; \
-		case AOP_SUB: /* SUB */ \
-			result = do_add(a, ~b, 1, &carry, &ovl); \
-			arith_op = 1; \
-			break; \
-		case AOP_RSB: /* RSB */ \
-			result = do_add(b, ~a, 1, &carry, &ovl); \
-			arith_op = 1; \
-			break; \
-		case AOP_ADD: /* ADD */ \
-			result = do_add(a, b, 0, &carry, &ovl); \
-			arith_op = 1; \
-			break; \
-		case AOP_ADC: /* ADC */ \
-			result = do_add(a, b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl); \
-			arith_op = 1; \
-			break; \
-		case AOP_SBC: /* SBC */ \
-			result = do_add(a, ~b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl); \
-			arith_op = 1; \
-			break; \
-		case AOP_RSC: /* RSC */ \
-			result = do_add(b, ~a, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl); \
-			arith_op = 1; \
-			break; \
-		case AOP_TST: /* TST */ \
-			result = a & b; \
-			Rd_writeback = 0; \
-			break; \
-		case AOP_TEQ: /* TEQ */ \
-			result = a ^ b; \
-			Rd_writeback = 0; \
-			break; \
-		case AOP_CMP: /* CMP */ \
-			result = do_add(a, ~b, 1, &carry, &ovl); \
-			Rd_writeback = 0; \
-			arith_op = 1; \
-			break; \
-		case AOP_CMN: /* CMN */ \
-			result = do_add(a, b, 0, &carry, &ovl); \
-			Rd_writeback = 0; \
-			arith_op = 1; \
-			break; \
-		case AOP_ORR: /* ORR */ \
-			result = a | b; \
-			break; \
-		case AOP_MOV: /* MOV */ \
-			result = b; \
-			break; \
-		case AOP_BIC: /* BIC */ \
-			result = a & (~b); \
-			break; \
-		case AOP_MVN: /* MVN */ \
-			result = ~b; \
-			break; \
-	}
+/* read whole codepages in when they're loaded instead of an instruction at a time as they're decoded */
+static __thread bool prefetch_codepages;
 
-#define DATA_PROCESSING_OP_TABLE_NOFLAGS(opcode, result, a, b) \
-	switch(opcode) { \
-		case AOP_AND: /* AND */ \
-			result = a & b; \
-			break; \
-		case AOP_EOR: /* EOR */ \
-			result = a ^ b; \
-			break; \
-		case AOP_SUB: /* SUB */ \
-			result = a - b; \
-			break; \
-		case AOP_RSB: /* RSB */ \
-			result = b - a; \
-			break; \
-		case AOP_ADD: /* ADD */ \
-			result = a + b; \
-			break; \
-		case AOP_ADC: /* ADC */ \
-			result = a + b + (get_condition(PSR_CC_CARRY) ? 1 : 0); \
-			break; \
-		case AOP_SBC: /* SBC */ \
-			result = a + ~b + (get_condition(PSR_CC_CARRY) ? 1: 0); \
-			break; \
-		case AOP_RSC: /* RSC */ \
-			result = b + ~a + (get_condition(PSR_CC_CARRY) ? 1: 0); \
-			break; \
-		case AOP_TST: /* TST */ \
-			result = a & b; \
-			break; \
-		case AOP_TEQ: /* TEQ */ \
-			result = a ^ b; \
-			break; \
-		case AOP_CMP: /* CMP */ \
-			result = a - b; \
-			break; \
-		case AOP_CMN: /* CMN */ \
-			result = a + b; \
-			break; \
-		case AOP_ORR: /* ORR */ \
-			result = a | b; \
-			break; \
-		case AOP_MOV: /* MOV */ \
-			result = b; \
-			break; \
-		case AOP_BIC: /* BIC */ \
-			result = a & (~b); \
-			break; \
-		case AOP_MVN: /* MVN */ \
-			result = ~b; \
-			break; \
-	}
+static void alloc_codepage_hash(unsigned int size);
+static void codepage_memory_init(void);
+static const struct uop_variant * const uop_variants[MAX_UOP_INSTRUMENTATION];
 
 void uop_init(void)
 {
-	memset(cpu.codepage_hash, 0, sizeof(cpu.codepage_hash));
+	const char *instrumentation = get_config_key_string("cpu", "instrumentation", "icount");
+	int i;
+
+	cpu.instrumentation = UOP_INSTRUMENTATION_ICOUNT;
+	for(i = 0; i < MAX_UOP_INSTRUMENTATION; i++) {
+		if(!strcasecmp(instrumentation, uop_variants[i]->name))
+			cpu.instrumentation = i;
+	}
+	cpu.restart_dispatch = FALSE;
+
+	prefetch_codepages = get_config_key_bool("cpu", "prefetch_codepages", FALSE);
+	codepage_memory_init();
+	uop_predecode_init();
+
+	alloc_codepage_hash(CODEPAGE_HASHSIZE);
+	uop_cache_open();
+	cpu.codepage_count = 0;
+	cpu.codepage_generation = 0;
+	cpu.curr_cp = NULL;
+	memset(cpu.rsb, 0xff, sizeof(cpu.rsb));
+	cpu.vector_cp = NULL;
+}
+
+/* give back everything uop_init set up for the core on this thread */
+void uop_shutdown(void)
+{
+	// the cores would all write the same thing, only the boot core saves
+	if(cpu.core_id == 0)
+		uop_cache_save();
+	uop_cache_close();
+	uop_predecode_shutdown();
+
+	free(cpu.codepage_hash);
+	cpu.codepage_hash = NULL;
 	cpu.curr_cp = NULL;
+
+	// the codepages all live in the arena, so they go with it
+	munmap(cpu.cp_arena, cpu.cp_arena_size);
+	cpu.cp_arena = NULL;
 }
 
 const char *uop_opcode_to_str(int opcode)
@@ -162,6 +93,7 @@ const char *uop_opcode_to_str(int opcode)
 		OP_TO_STR(NOP);
 		OP_TO_STR(DECODE_ME_ARM);
 		OP_TO_STR(DECODE_ME_THUMB);
+		OP_TO_STR(CHUNK_NEXT);
 		OP_TO_STR(B_IMMEDIATE);
 		OP_TO_STR(B_IMMEDIATE_LOCAL);
 		OP_TO_STR(B_REG);
@@ -219,6 +151,9 @@ const char *uop_opcode_to_str(int opcode)
 		OP_TO_STR(BIC_REG_S);
 		OP_TO_STR(NEG_REG_S);
 		OP_TO_STR(MVN_REG_S);
+		OP_TO_STR(CMP_IMM_BCC_LOCAL);
+		OP_TO_STR(CMP_REG_BCC_LOCAL);
+		OP_TO_STR(MOV_IMM_PAIR);
 		OP_TO_STR(MULTIPLY);
 		OP_TO_STR(MULTIPLY_LONG);
 		OP_TO_STR(COUNT_LEADING_ZEROS);
@@ -237,236 +172,689 @@ const char *uop_opcode_to_str(int opcode)
 #undef OP_TO_STR
 }
 
-/* codepage cache */
-static void free_codepage(struct uop_codepage *cp)
+#if UOP_DISPATCH == UOP_DISPATCH_THREADED
+/* offset of each opcode's handler in the threaded dispatcher, set up when the core's dispatch loop starts */
+__thread int32_t uop_handler_offset[MAX_UOP_OPCODE];
+
+#define uop_set_handler(op) ((op)->handler = uop_handler_offset[(op)->opcode])
+#else
+#define uop_set_handler(op) do { } while(0)
+#endif
+
+/*
+ * Figure out where the basic blocks end. Anything that can change the flow of
+ * control, the pc, the cpu mode or the codepage has to end the block so the
+ * per block bookkeeping in the dispatch loop gets a chance to run before the
+ * next uop. Memory accesses only end it if they took an abort.
+ */
+void uop_set_block_flags(struct uop *op)
+{
+	int writes_pc = 0;
+
+	switch(op->opcode) {
+		case DECODE_ME_ARM:
+		case DECODE_ME_THUMB:
+		case CHUNK_NEXT:
+		case B_IMMEDIATE:
+		case B_IMMEDIATE_LOCAL:
+		case B_REG:
+		case B_REG_OFFSET:
+		case CMP_IMM_BCC_LOCAL:
+		case CMP_REG_BCC_LOCAL:
+		case LOAD_MULTIPLE_S:
+		case STORE_MULTIPLE_S:
+		case MOVE_TO_SR_IMM:
+		case MOVE_TO_SR_REG:
+		case UNDEFINED:
+		case SWI:
+		case BKPT:
+		case COPROC_REG_TRANSFER:
+		case COPROC_DOUBLE_REG_TRANSFER:
+		case COPROC_DATA_PROCESSING:
+		case COPROC_LOAD_STORE:
+			op->block_flags = UOP_BLOCK_END;
+			return;
+		case LOAD_IMMEDIATE_WORD:
+		case LOAD_IMMEDIATE_HALFWORD:
+		case LOAD_IMMEDIATE_BYTE:
+			writes_pc = (op->load_immediate.target_reg == PC);
+			break;
+		case LOAD_IMMEDIATE_OFFSET:
+		case STORE_IMMEDIATE_OFFSET:
+			writes_pc = (op->opcode == LOAD_IMMEDIATE_OFFSET && op->load_store_immediate_offset.target_reg == PC) ||
+				((op->flags & UOPLSFLAGS_WRITEBACK) && op->load_store_immediate_offset.source_reg == PC);
+			break;
+		case LOAD_SCALED_REG_OFFSET:
+		case STORE_SCALED_REG_OFFSET:
+			writes_pc = (op->opcode == LOAD_SCALED_REG_OFFSET && op->load_store_scaled_reg_offset.target_reg == PC) ||
+				((op->flags & UOPLSFLAGS_WRITEBACK) && op->load_store_scaled_reg_offset.source_reg == PC);
+			break;
+		case LOAD_MULTIPLE:
+		case STORE_MULTIPLE:
+			writes_pc = (op->opcode == LOAD_MULTIPLE && (op->load_store_multiple.reg_bitmap & (1 << PC))) ||
+				((op->flags & UOPLSMFLAGS_WRITEBACK) && op->load_store_multiple.base_reg == PC);
+			break;
+		case SWAP:
+			writes_pc = (op->swp.dest_reg == PC);
+			break;
+		case DATA_PROCESSING_IMM:
+		case DATA_PROCESSING_IMM_S:
+			writes_pc = (op->data_processing_imm.dest_reg == PC);
+			break;
+		case DATA_PROCESSING_REG:
+		case DATA_PROCESSING_REG_S:
+			writes_pc = (op->data_processing_reg.dest_reg == PC);
+			break;
+		case DATA_PROCESSING_IMM_SHIFT:
+			writes_pc = (op->data_processing_imm_shift.dest_reg == PC);
+			break;
+		case DATA_PROCESSING_REG_SHIFT:
+			writes_pc = (op->data_processing_reg_shift.dest_reg == PC);
+			break;
+		case MOV_IMM:
+		case MOV_IMM_NZ:
+		case CMP_IMM_S:
+		case ADD_IMM:
+		case ADD_IMM_S:
+		case AND_IMM:
+		case ORR_IMM:
+		case LSL_IMM:
+		case LSL_IMM_S:
+		case LSR_IMM:
+		case LSR_IMM_S:
+		case ASR_IMM:
+		case ASR_IMM_S:
+			writes_pc = (op->simple_dp_imm.dest_reg == PC);
+			break;
+		case MULTIPLY:
+			writes_pc = (op->mul.dest_reg == PC);
+			break;
+		case MULTIPLY_LONG:
+			writes_pc = (op->mull.destlo_reg == PC || op->mull.desthi_reg == PC);
+			break;
+		case COUNT_LEADING_ZEROS:
+			writes_pc = (op->count_leading_zeros.dest_reg == PC);
+			break;
+		case MOV_IMM_PAIR:
+			break; // never built for a pc destination
+		case MOVE_FROM_SR:
+			writes_pc = (op->move_from_sr.reg == PC);
+			break;
+		case NOP:
+			break;
+		default:
+			// the rest of the simple register forms
+			writes_pc = (op->simple_dp_reg.dest_reg == PC);
+			break;
+	}
+
+	if(writes_pc) {
+		op->block_flags = UOP_BLOCK_END;
+		return;
+	}
+
+	switch(op->opcode) {
+		case LOAD_IMMEDIATE_WORD:
+		case LOAD_IMMEDIATE_HALFWORD:
+		case LOAD_IMMEDIATE_BYTE:
+		case LOAD_IMMEDIATE_OFFSET:
+		case LOAD_SCALED_REG_OFFSET:
+		case STORE_IMMEDIATE_OFFSET:
+		case STORE_SCALED_REG_OFFSET:
+		case LOAD_MULTIPLE:
+		case STORE_MULTIPLE:
+		case SWAP:
+			op->block_flags = UOP_BLOCK_MAYFAULT;
+			break;
+		default:
+			op->block_flags = 0;
+	}
+}
+
+/* 
+ * spot the branches that might be the guest idling, see cpu_idle_branch(). only
+ * called as an instruction is decoded, when cpu.pc is the one following it.
+ */
+#define IDLE_POLL_MAX_INS 8 // how far back a possible polling loop can start
+
+static inline void uop_mark_idle_branch(struct uop *op)
 {
-	UOP_TRACE(7, "free_codepage: cp %p, thumb %d, address 0x%x\n", cp, cp->thumb, cp->address);
-	if (cp->thumb) {
-		cp->next = cpu.free_cp_thumb;
-		cpu.free_cp_thumb = cp;
-	} else {
-		cp->next = cpu.free_cp_arm;
-		cpu.free_cp_arm = cp;
+	armaddr_t pc;
+	int pc_inc;
+
+	if(op->opcode != B_IMMEDIATE_LOCAL || (op->flags & UOPBFLAGS_LINK) || !cpu.idle_detect)
+		return;
+
+	pc_inc = cpu.curr_cp->pc_inc;
+	pc = cpu.pc - pc_inc;
+	if(op->b_immediate.target == pc)
+		op->flags |= UOPBFLAGS_IDLE_LOOP;
+	else if(op->b_immediate.target < pc && pc - op->b_immediate.target <= (armaddr_t)(IDLE_POLL_MAX_INS * pc_inc))
+		op->flags |= UOPBFLAGS_IDLE_POLL;
+}
+
+/* fill in the dispatch info for a uop once its opcode and operands are set */
+static inline void uop_finish_decode(struct uop *op)
+{
+	uop_set_handler(op);
+	uop_set_block_flags(op);
+}
+
+/*
+ * a uop saved from another run or another copy of the dispatch loop. the handler
+ * offset and any cached codepage handles only meant something there.
+ */
+void uop_relocate(struct uop *op)
+{
+	uop_set_handler(op);
+
+	switch(op->opcode) {
+		case B_IMMEDIATE:
+			op->b_immediate.target_cp = CP_HANDLE_NONE;
+			break;
+		case B_REG:
+			op->b_reg.target_cp = CP_HANDLE_NONE;
+			break;
+		case B_REG_OFFSET:
+			op->b_reg_offset.target_cp = CP_HANDLE_NONE;
+			break;
 	}
 }
 
-#define CP_PREALLOCATE 16
-#define ARM_CP_SIZE (sizeof(struct uop_codepage) + sizeof(struct uop) * (NUM_CODEPAGE_INS_ARM + 1))
-#define THUMB_CP_SIZE (sizeof(struct uop_codepage) + sizeof(struct uop) * (NUM_CODEPAGE_INS_THUMB + 1))
+/* codepage cache */
+
+/*
+ * codepage headers and the chunks of uops hanging off of them are carved out of one
+ * big reservation of address space, committed a piece at a time as it fills up, and
+ * recycled through a free list per kind. a slot never changes kind, so a stale handle
+ * to a header always points at a header. keeping everything in one place lets the
+ * branch uops cache their target codepage as a 32 bit offset into the arena.
+ * the arena never shrinks, instead the total carved out is held under the configured
+ * budget by evicting the least recently used codepages.
+ */
+#define CP_ALIGN 64
+#define CP_SLOT_SIZE(size) (((size) + CP_ALIGN - 1) & ~(size_t)(CP_ALIGN - 1))
+#define CP_HEADER_SIZE CP_SLOT_SIZE(sizeof(struct uop_codepage))
+#define CP_CHUNK_SIZE CP_SLOT_SIZE(sizeof(struct uop) * (CP_CHUNK_INS + 1))
+#define CP_ARENA_CHUNK (2*1024*1024)
+#if UINTPTR_MAX > 0xffffffff
+#define CP_ARENA_RESERVE ((size_t)4*1024*1024*1024) // as far as a handle reaches
+#else
+#define CP_ARENA_RESERVE ((size_t)256*1024*1024)
+#endif
+#define CP_DEFAULT_BUDGET 64 // megabytes
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+struct cp_free_slot {
+	struct cp_free_slot *next;
+};
 
-static struct uop_codepage *alloc_codepage_arm(void)
+static void remove_codepage(struct uop_codepage *cp);
+
+static void codepage_memory_init(void)
 {
-	struct uop_codepage *cp;
-	
-	if (cpu.free_cp_arm == NULL) {
-		int i;
+	int budget = atoi(get_config_key_string("cpu", "codepage_memory", "-1"));
+	void *reserve;
 
-		uint8_t *cp_buf = malloc(ARM_CP_SIZE * CP_PREALLOCATE);
-		if (cp_buf == NULL)
-			return NULL;
+	if(budget < 0)
+		budget = CP_DEFAULT_BUDGET;
+	cpu.cp_mem_budget = (size_t)budget * 1024 * 1024; // 0 is unlimited
+	cpu.cp_hugepages = get_config_key_bool("cpu", "codepage_hugepages", FALSE);
+
+	// reserve an extra chunk so the arena can start on a huge page boundary
+	reserve = mmap(NULL, CP_ARENA_RESERVE + CP_ARENA_CHUNK, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(reserve == MAP_FAILED)
+		panic_cpu("could not reserve address space for the codepage arena!\n");
+	cpu.cp_arena = (byte *)(((uintptr_t)reserve + CP_ARENA_CHUNK - 1) & ~(uintptr_t)(CP_ARENA_CHUNK - 1));
+	cpu.cp_arena_size = CP_ARENA_RESERVE;
+
+	// hand back the slop on either side, so the arena alone can be unmapped later
+	if(cpu.cp_arena != (byte *)reserve)
+		munmap(reserve, cpu.cp_arena - (byte *)reserve);
+	munmap(cpu.cp_arena + CP_ARENA_RESERVE, ((byte *)reserve + CP_ARENA_RESERVE + CP_ARENA_CHUNK) - (cpu.cp_arena + CP_ARENA_RESERVE));
+	cpu.cp_arena_committed = 0;
+	cpu.cp_mem_used = CP_ALIGN; // the first slot would have the handle CP_HANDLE_NONE, skip it
+	cpu.free_cp_headers = cpu.free_cp_chunks = NULL;
+	cpu.lru_head = cpu.lru_tail = NULL;
+}
+
+/* make the next piece of the arena reservation usable. returns TRUE if there's no more */
+static bool commit_arena_chunk(void)
+{
+	byte *chunk = cpu.cp_arena + cpu.cp_arena_committed;
 
-		for (i=0; i < CP_PREALLOCATE; i++) {
-			cp = (struct uop_codepage *)(cp_buf + (i * ARM_CP_SIZE));
-			cp->thumb = FALSE;
-			cp->pc_inc = 4;
-			cp->pc_shift = 2;
-			free_codepage(cp);			
+	if(cpu.cp_arena_committed + CP_ARENA_CHUNK > cpu.cp_arena_size)
+		return TRUE;
+
+#ifdef MAP_HUGETLB
+	if(cpu.cp_hugepages) {
+		if(mmap(chunk, CP_ARENA_CHUNK, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_HUGETLB, -1, 0) != MAP_FAILED) {
+			cpu.cp_arena_committed += CP_ARENA_CHUNK;
+			return FALSE;
 		}
-	} 
+		UOP_TRACE(1, "codepage arena: no huge pages available, using regular pages\n");
+		cpu.cp_hugepages = FALSE;
+	}
+#endif
 
-	ASSERT(cpu.free_cp_arm != NULL);
-	cp = cpu.free_cp_arm;
-	cpu.free_cp_arm = cp->next;
-	cp->next = NULL;
+	if(mmap(chunk, CP_ARENA_CHUNK, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED)
+		return TRUE;
+#ifdef MADV_HUGEPAGE
+	madvise(chunk, CP_ARENA_CHUNK, MADV_HUGEPAGE);
+#endif
+	cpu.cp_arena_committed += CP_ARENA_CHUNK;
+	return FALSE;
+}
 
-	ASSERT(cp->thumb == FALSE);
+/* carve a brand new slot out of the arena */
+static void *carve_cp_slot(size_t size)
+{
+	void *slot;
 
-	return cp;
+	while(cpu.cp_mem_used + size > cpu.cp_arena_committed) {
+		if(commit_arena_chunk())
+			return NULL;
+	}
+
+	slot = cpu.cp_arena + cpu.cp_mem_used;
+	cpu.cp_mem_used += size;
+
+	return slot;
 }
 
-static struct uop_codepage *alloc_codepage_thumb(void)
+static inline void lru_unlink(struct uop_codepage *cp)
 {
-	struct uop_codepage *cp;
+	if(cp->lru_prev)
+		cp->lru_prev->lru_next = cp->lru_next;
+	else
+		cpu.lru_head = cp->lru_next;
+	if(cp->lru_next)
+		cp->lru_next->lru_prev = cp->lru_prev;
+	else
+		cpu.lru_tail = cp->lru_prev;
+}
 
-	if (cpu.free_cp_thumb == NULL) {
-		int i;
+static inline void lru_insert_head(struct uop_codepage *cp)
+{
+	cp->lru_prev = NULL;
+	cp->lru_next = cpu.lru_head;
+	if(cpu.lru_head)
+		cpu.lru_head->lru_prev = cp;
+	else
+		cpu.lru_tail = cp;
+	cpu.lru_head = cp;
+}
+
+/* the codepage was just looked up, move it to the front of the line */
+static inline void lru_touch(struct uop_codepage *cp)
+{
+	if(cp != cpu.lru_head) {
+		lru_unlink(cp);
+		lru_insert_head(cp);
+	}
+}
+
+/*
+ * throw out the least recently used codepage, so its memory can be reused.
+ * codepages that were reached through a cached branch since they were last looked at,
+ * and the one we're running out of, get a second chance. returns FALSE if there was
+ * nothing to evict.
+ */
+static bool evict_codepage(void)
+{
+	struct uop_codepage *cp, *prev;
+	unsigned int tries;
+
+	for(tries = 0; tries < 2; tries++) {
+		for(cp = cpu.lru_tail; cp != NULL; cp = prev) {
+			prev = cp->lru_prev;
+			if(cp == cpu.curr_cp)
+				continue;
+			if(cp->referenced) {
+				cp->referenced = FALSE;
+				continue;
+			}
+
+			UOP_TRACE(5, "evict_codepage: cp %p, address 0x%x, paddr 0x%x\n", cp, cp->address, cp->paddr);
+			remove_codepage(cp);
+			inc_perf_counter(CODEPAGE_EVICT);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void *alloc_cp_slot(void **free_list, size_t size)
+{
+	struct cp_free_slot *slot;
 
-		uint8_t *cp_buf = malloc(THUMB_CP_SIZE * CP_PREALLOCATE);
-		if (cp_buf == NULL)
+	// over budget, try to make room by pushing out old codepages.
+	// if there's nothing to evict we go over, rather than fail the load
+	while(*free_list == NULL && cpu.cp_mem_budget != 0 && cpu.cp_mem_used + size > cpu.cp_mem_budget) {
+		if(!evict_codepage())
+			break;
+	}
+
+	if(*free_list == NULL && (slot = carve_cp_slot(size)) != NULL) {
+		// fresh out of the arena
+	} else {
+		// if the arena is used up, anything that can go has to
+		while(*free_list == NULL && evict_codepage())
+			;
+		if(*free_list == NULL)
 			return NULL;
 
-		for (i=0; i < CP_PREALLOCATE; i++) {
-			cp = (struct uop_codepage *)(cp_buf + (i * THUMB_CP_SIZE));
-			cp->thumb = TRUE;
-			cp->pc_inc = 2;
-			cp->pc_shift = 1;
-			free_codepage(cp);			
+		slot = *free_list;
+		*free_list = slot->next;
+	}
+
+	add_to_perf_counter(CODEPAGE_MEM_LIVE, size);
+	if (cpu.perf_counters.count[CODEPAGE_MEM_LIVE] > cpu.perf_counters.count[CODEPAGE_MEM_PEAK])
+		cpu.perf_counters.count[CODEPAGE_MEM_PEAK] = cpu.perf_counters.count[CODEPAGE_MEM_LIVE];
+
+	return slot;
+}
+
+static void free_cp_slot(void **free_list, void *_slot, size_t size)
+{
+	struct cp_free_slot *slot = _slot;
+
+	slot->next = *free_list;
+	*free_list = slot;
+	add_to_perf_counter(CODEPAGE_MEM_LIVE, -(int)size);
+}
+
+static void free_codepage(struct uop_codepage *cp)
+{
+	int i;
+
+	UOP_TRACE(7, "free_codepage: cp %p, thumb %d, address 0x%x\n", cp, cp->thumb, cp->address);
+	if (cp->predecoded)
+		uop_predecode_forget(cp);
+	for (i = 0; i < cp->num_chunks; i++) {
+		if (cp->chunks[i]) {
+			free_cp_slot(&cpu.free_cp_chunks, cp->chunks[i], CP_CHUNK_SIZE);
+			cp->chunks[i] = NULL;
 		}
-	} 
+	}
+	free_cp_slot(&cpu.free_cp_headers, cp, CP_HEADER_SIZE);
+}
 
-	ASSERT(cpu.free_cp_thumb != NULL);
-	cp = cpu.free_cp_thumb;
-	cpu.free_cp_thumb = cp->next;
-	cp->next = NULL;
+/* raw instruction at a slot in a codepage's host page */
+static inline word codepage_host_instruction(struct uop_codepage *cp, unsigned int slot)
+{
+	if(cp->thumb)
+		return READ_MEM_HALFWORD((const byte *)cp->host_ptr + slot * 2);
+	else
+		return READ_MEM_WORD((const byte *)cp->host_ptr + slot * 4);
+}
 
-	ASSERT(cp->thumb == TRUE);
-	return cp;
+/* read in the instruction for an undecoded slot, if it wasn't already filled in when its chunk was allocated */
+static inline void uop_fetch_raw(struct uop_codepage *cp, struct uop *op)
+{
+	if(cp->lazy)
+		op->undecoded.raw_instruction = codepage_host_instruction(cp, op->undecoded.slot);
 }
 
-#define PC_TO_CPPC(pc) &cpu.curr_cp->ops[((pc) % MMU_PAGESIZE) >> (cpu.curr_cp->pc_shift)];
+/*
+ * allocate chunk n of a codepage and fill it with undecoded slots. this can evict
+ * other codepages to make room, so cp has to be the current codepage or not on the
+ * lru list yet.
+ */
+struct uop *alloc_codepage_chunk(struct uop_codepage *cp, int n)
+{
+	struct uop *chunk;
+	struct uop *end;
+	int i;
+
+	UOP_TRACE(7, "alloc_codepage_chunk: cp %p, address 0x%x, chunk %d\n", cp, cp->address, n);
+
+	chunk = alloc_cp_slot(&cpu.free_cp_chunks, CP_CHUNK_SIZE);
+	if(!chunk)
+		panic_cpu("could not allocate new codepage chunk!\n");
+
+	for(i = 0; i < CP_CHUNK_INS; i++) {
+		chunk[i].opcode = cp->thumb ? DECODE_ME_THUMB : DECODE_ME_ARM;
+		chunk[i].cond = COND_AL;
+		chunk[i].flags = 0;
+		chunk[i].undecoded.slot = n * CP_CHUNK_INS + i;
+		if(cp->host_ptr && !cp->lazy)
+			chunk[i].undecoded.raw_instruction = codepage_host_instruction(cp, chunk[i].undecoded.slot);
+		uop_finish_decode(&chunk[i]);
+	}
+
+	// the slot past the end moves on to the next chunk, or the last one branches to the next codepage
+	end = &chunk[CP_CHUNK_INS];
+	end->cond = COND_AL;
+	end->flags = 0;
+	if(n == cp->num_chunks - 1) {
+		end->opcode = B_IMMEDIATE;
+		end->b_immediate.target = cp->address + MMU_PAGESIZE;
+		end->b_immediate.target_cp = CP_HANDLE_NONE;
+	} else {
+		end->opcode = CHUNK_NEXT;
+	}
+	uop_finish_decode(end);
+
+	cp->chunks[n] = chunk;
+
+	return chunk;
+}
 
-static inline unsigned int codepage_hash(armaddr_t address, bool thumb)
+/*
+ * codepages are tagged with the physical page they were decoded from as well as
+ * the virtual address they run at (the decoded uops have pc relative values baked in).
+ * they hash on the physical page alone, so everything decoded out of a page is on one
+ * chain when a store into it has to toss them.
+ */
+static inline unsigned int codepage_hash(armaddr_t paddr)
 {
-	unsigned int hash = (address / MMU_PAGESIZE);
-	if(thumb)
-		hash = ~hash; // XXX come up with something better
-	return hash % CODEPAGE_HASHSIZE;
+	return (paddr >> MMU_PAGESIZE_SHIFT) & (cpu.codepage_hash_size - 1);
 }
 
-static struct uop_codepage *lookup_codepage(armaddr_t pc, bool thumb)
+static struct uop_codepage *lookup_codepage(armaddr_t pc, armaddr_t paddr, bool thumb)
 {
 	armaddr_t cp_addr = pc & ~(MMU_PAGESIZE-1);
-	unsigned int hash;
 	struct uop_codepage *cp;
 
-	hash = codepage_hash(cp_addr, thumb);
-
 	// search the hash chain for our codepage
-	cp = cpu.codepage_hash[hash];
+	cp = cpu.codepage_hash[codepage_hash(paddr)];
 	while(cp != NULL) {
-		if(cp->address == cp_addr && cp->thumb == thumb)
+		inc_perf_counter(CODEPAGE_LOOKUP_PROBE);
+		if(cp->paddr == paddr && cp->address == cp_addr && cp->thumb == thumb) {
+			inc_perf_counter(CODEPAGE_LOOKUP_HIT);
 			return cp;
+		}
 		cp = cp->next;
 	}
 
+	inc_perf_counter(CODEPAGE_LOOKUP_MISS);
 	return NULL;
 }
 
-static bool load_codepage_arm(armaddr_t pc, armaddr_t cp_addr, bool priviledged, struct uop_codepage **_cp, int *last_ins_index)
+static void alloc_codepage_hash(unsigned int size)
 {
-	struct uop_codepage *cp;	
-	int i;
+	cpu.codepage_hash = calloc(size, sizeof(struct uop_codepage *));
+	if(cpu.codepage_hash == NULL)
+		panic_cpu("could not allocate codepage hash table!\n");
+	cpu.codepage_hash_size = size;
+}
 
-	cp = alloc_codepage_arm();
-	if(!cp)
-		panic_cpu("could not allocate new codepage!\n");
+/* double the size of the codepage hash and move everything over */
+static void grow_codepage_hash(void)
+{
+	struct uop_codepage **old_hash = cpu.codepage_hash;
+	unsigned int old_size = cpu.codepage_hash_size;
+	unsigned int i;
 
-	// load and fill in the default codepage
-	cp->address = cp_addr;
-	for(i=0; i < NUM_CODEPAGE_INS_ARM; i++) {
-		cp->ops[i].opcode = DECODE_ME_ARM;
-		cp->ops[i].cond = COND_AL;
-		cp->ops[i].flags = 0;
-		if(mmu_read_instruction_word(cp_addr + i*4, &cp->ops[i].undecoded.raw_instruction, priviledged)) {
-			UOP_TRACE(4, "load_codepage: mmu translation made arm codepage load fail\n");
-			free(cp);
-			return TRUE;
-		}
-	}
-	*last_ins_index = NUM_CODEPAGE_INS_ARM;
+	UOP_TRACE(4, "grow_codepage_hash: %d codepages in %d buckets\n", cpu.codepage_count, old_size);
+	inc_perf_counter(CODEPAGE_HASH_GROW);
 
-	*_cp = cp;
+	alloc_codepage_hash(old_size * 2);
+	for(i = 0; i < old_size; i++) {
+		struct uop_codepage *cp, *next;
 
-	return FALSE;
+		for(cp = old_hash[i]; cp != NULL; cp = next) {
+			unsigned int hash = codepage_hash(cp->paddr);
+
+			next = cp->next;
+			cp->next = cpu.codepage_hash[hash];
+			cpu.codepage_hash[hash] = cp;
+		}
+	}
+	free(old_hash);
 }
 
-static bool load_codepage_thumb(armaddr_t pc, armaddr_t cp_addr, bool priviledged, struct uop_codepage **_cp, int *last_ins_index)
+/*
+ * read in the raw instructions of a chunk through the mmu, for pages that aren't plain
+ * memory. this has to happen while the codepage is loaded, where a fault can be taken.
+ */
+static bool fill_codepage_chunk(struct uop_codepage *cp, struct uop *chunk, int n, bool priviledged)
 {
-	struct uop_codepage *cp;	
+	armaddr_t addr = cp->address + ((n * CP_CHUNK_INS) << cp->pc_shift);
 	int i;
 
-	cp = alloc_codepage_thumb();
-	if(!cp)
-		panic_cpu("could not allocate new codepage!\n");
+	for(i = 0; i < CP_CHUNK_INS; i++, addr += cp->pc_inc) {
+		if(cp->thumb) {
+			halfword hword;
 
-	// load and fill in the default codepage
-	cp->address = cp_addr;
-	for(i=0; i < NUM_CODEPAGE_INS_THUMB; i++) {
-		halfword hword;
-		
-		cp->ops[i].opcode = DECODE_ME_THUMB;
-		cp->ops[i].cond = COND_AL;
-		cp->ops[i].flags = 0;
-		if(mmu_read_instruction_halfword(cp_addr + i*2, &hword, priviledged)) {
-			UOP_TRACE(4, "load_codepage: mmu translation made thumb codepage load fail\n");
-			free(cp);
-			return TRUE;
+			if(mmu_read_instruction_halfword(addr, &hword, priviledged))
+				return TRUE;
+			chunk[i].undecoded.raw_instruction = hword;
+		} else {
+			if(mmu_read_instruction_word(addr, &chunk[i].undecoded.raw_instruction, priviledged))
+				return TRUE;
 		}
-		cp->ops[i].undecoded.raw_instruction = hword;
 	}
-	*last_ins_index = NUM_CODEPAGE_INS_THUMB;
-
-	*_cp = cp;
-
 	return FALSE;
 }
 
-static bool load_codepage(armaddr_t pc, bool thumb, bool priviledged, struct uop_codepage **_cp)
+static bool load_codepage(armaddr_t pc, armaddr_t paddr, const void *host_ptr, bool thumb, bool priviledged, struct uop_codepage **_cp)
 {
 	armaddr_t cp_addr = pc & ~(MMU_PAGESIZE-1);
 	struct uop_codepage *cp;	
 	unsigned int hash;
-	int last_ins_index;
-	bool ret;
+	int i;
 
-	UOP_TRACE(4, "load_codepage: pc 0x%x\n", pc);
+	UOP_TRACE(4, "load_codepage: pc 0x%x paddr 0x%x\n", pc, paddr);
 
-	// load and fill in the appropriate codepage
-	if(thumb)
-		ret = load_codepage_thumb(pc, cp_addr, priviledged, &cp, &last_ins_index);
-	else
-		ret = load_codepage_arm(pc, cp_addr, priviledged, &cp, &last_ins_index);
-	if(ret)
-		return TRUE; // there was some sort of error loading the new codepage
-
-	// fill in the last instruction to branch to next codepage
-	cp->ops[last_ins_index].opcode = B_IMMEDIATE;
-	cp->ops[last_ins_index].cond = COND_AL;
-	cp->ops[last_ins_index].flags = 0;
-	cp->ops[last_ins_index].b_immediate.target = cp->address + MMU_PAGESIZE;
-	cp->ops[last_ins_index].b_immediate.link_target = 0;
-	cp->ops[last_ins_index].b_immediate.target_cp = NULL;
+	cp = alloc_cp_slot(&cpu.free_cp_headers, CP_HEADER_SIZE);
+	if(!cp)
+		panic_cpu("could not allocate new codepage!\n");
+
+	cp->address = cp_addr;
+	cp->paddr = paddr;
+	cp->thumb = thumb;
+	cp->pc_inc = thumb ? 2 : 4;
+	cp->pc_shift = thumb ? 1 : 2;
+	cp->referenced = FALSE;
+	cp->decodes = 0;
+	cp->num_chunks = (thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM) / CP_CHUNK_INS;
+	memset(cp->chunks, 0, sizeof(cp->chunks));
+	cp->predecoded = NULL;
+
+	// plain memory is left for the chunks to read as they're allocated, or
+	// with lazy set, as each slot is decoded
+	cp->host_ptr = host_ptr;
+	cp->lazy = host_ptr && !prefetch_codepages;
+	if(!host_ptr) {
+		for(i = 0; i < cp->num_chunks; i++) {
+			if(fill_codepage_chunk(cp, alloc_codepage_chunk(cp, i), i, priviledged)) {
+				UOP_TRACE(4, "load_codepage: mmu translation made codepage load fail\n");
+				free_codepage(cp);
+				return TRUE;
+			}
+		}
+	} else {
+		// maybe it was decoded in a previous run, if not get the worker going on it
+		if(!uop_cache_fill(cp) && cpu.predecoder)
+			uop_predecode_page(cp, (pc % MMU_PAGESIZE) >> cp->pc_shift);
+	}
 
 	// add it to the codepage hashtable
-	hash = codepage_hash(cp_addr, thumb);
+	if(cpu.codepage_count >= cpu.codepage_hash_size)
+		grow_codepage_hash();
+	hash = codepage_hash(paddr);
 	cp->next = cpu.codepage_hash[hash];
 	cpu.codepage_hash[hash] = cp;
+	cpu.codepage_count++;
+	lru_insert_head(cp);
+	inc_perf_counter(CODEPAGE_LOAD);
+
+	// have the mmu tell us about stores into the page
+	mmu_mark_code_page(paddr);
 
 	*_cp = cp;
 
 	return FALSE;
 }
 
-static bool set_codepage(armaddr_t pc)
+/*
+ * translate pc and find its codepage. the translation is what makes a cached codepage
+ * valid in the current address space, so the codepage is stamped with the current
+ * generation. returns NULL if there isn't one or the translation faulted.
+ */
+struct uop_codepage *find_codepage(armaddr_t pc, bool thumb)
+{
+	struct uop_codepage *cp;
+	const void *host_ptr;
+	armaddr_t paddr;
+
+	if(mmu_get_instruction_page(pc, arm_in_priviledged(), &paddr, &host_ptr))
+		return NULL;
+
+	cp = lookup_codepage(pc, paddr, thumb);
+	if(cp) {
+		cp->generation = cpu.codepage_generation;
+		lru_touch(cp);
+	}
+	return cp;
+}
+
+bool set_codepage(armaddr_t pc)
 {
 	struct uop_codepage *cp;
 	bool thumb = get_condition(PSR_THUMB) ? TRUE : FALSE;
+	bool priviledged = arm_in_priviledged();
+	const void *host_ptr;
+	armaddr_t paddr;
 
 	UOP_TRACE(6, "set_codepage: pc 0x%x thumb %d, real pc 0x%x\n", pc, thumb, cpu.pc);
 
-	cp = lookup_codepage(cpu.pc, thumb);
+	if(mmu_get_instruction_page(pc, priviledged, &paddr, &host_ptr)) {
+		UOP_TRACE(4, "set_codepage: mmu translation of pc 0x%x failed\n", pc);
+		return TRUE; // mmu fault
+	}
+
+	cp = lookup_codepage(pc, paddr, thumb);
 	if(unlikely(cp == NULL)) { // still null, create a new one
 		UOP_TRACE(7, "set_codepage: couldn't find codepage, creating new one\n");
-		if(load_codepage(pc, thumb, arm_in_priviledged(), &cpu.curr_cp)) {
+		if(load_codepage(pc, paddr, host_ptr, thumb, priviledged, &cp)) {
 			return TRUE; // mmu fault
 		}
 	} else {
 		UOP_TRACE(7, "set_codepage: found cached codepage\n");
-		cpu.curr_cp = cp;
+		lru_touch(cp);
 	}
 
-	ASSERT(cpu.curr_cp != NULL);
+	cp->generation = cpu.codepage_generation;
+	cpu.curr_cp = cp;
 	cpu.cp_pc = PC_TO_CPPC(cpu.pc);
 	return FALSE;
 }
 
 void flush_all_codepages(void)
 {
-	int i;
+	unsigned int i;
 	struct uop_codepage *cp;
 
-	/* XXX make this smarter */
-	for (i=0; i < CODEPAGE_HASHSIZE; i++) {
+	inc_perf_counter(CODEPAGE_FLUSH_ALL);
+
+	for (i=0; i < cpu.codepage_hash_size; i++) {
 		cp = cpu.codepage_hash[i];
 
 		while (cp != NULL) {
@@ -476,2697 +864,441 @@ void flush_all_codepages(void)
 		}
 		cpu.codepage_hash[i] = NULL;
 	}
+	cpu.codepage_count = 0;
+	cpu.lru_head = cpu.lru_tail = NULL;
 
 	/* force a reload of the current codepage */
 	cpu.curr_cp = NULL;
-}
 
-static inline __ALWAYS_INLINE void uop_decode_me_arm(struct uop *op) 
-{
-	// call the arm decoder and set the pc back to retry this instruction
-	ASSERT(cpu.cp_pc != NULL);
-	UOP_TRACE(6, "decoding arm opcode 0x%08x at pc 0x%x\n", op->undecoded.raw_instruction, cpu.pc);
-	arm_decode_into_uop(op);
-	cpu.pc -= 4; // back the instruction pointer up to retry this instruction
-	cpu.cp_pc--;
-	inc_perf_counter(INS_DECODE);
+	/* the return stack points into the old codepages, and so might the vector page */
+	memset(cpu.rsb, 0xff, sizeof(cpu.rsb));
+	cpu.vector_cp = NULL;
+
+#if WITH_JIT
+	/* translated code points into the codepages we just tossed */
+	jit_flush();
+#endif
 }
 
-static inline __ALWAYS_INLINE void uop_decode_me_thumb(struct uop *op) 
+/*
+ * the virtual to physical mapping may have changed. rather than tossing everything,
+ * bump the generation so every cached codepage pointer (block links, branch caches,
+ * the return stack) fails its check and goes back through a translation.
+ */
+void codepage_translations_changed(void)
 {
-	// call the arm decoder and set the pc back to retry this instruction
-	ASSERT(cpu.cp_pc != NULL);
-	UOP_TRACE(6, "decoding thumb opcode 0x%04x at pc 0x%x\n", op->undecoded.raw_instruction, cpu.pc);
-	thumb_decode_into_uop(op);
-	cpu.pc -= 2; // back the instruction pointer up to retry this instruction
-	cpu.cp_pc--;
-	inc_perf_counter(INS_DECODE);
+	cpu.codepage_generation++;
+	cpu.curr_cp = NULL;
+	inc_perf_counter(CODEPAGE_RETRANSLATE);
 }
 
-static inline __ALWAYS_INLINE void uop_b_immediate(struct uop *op)
+/*
+ * pull a single codepage out of the cache. anything else still pointing at it
+ * (branch target caches, the return stack) is checked against the codepage's
+ * address before it's used, so poisoning the address is enough to cut those off.
+ */
+static void remove_codepage(struct uop_codepage *cp)
 {
-	// branch to a fixed location outside of the current codepage. 
-	// Any offsets would have been resolved at decode time.
-	if(op->flags & UOPBFLAGS_LINK) {
-		int thumb = get_condition(PSR_THUMB) ? 1 : 0;
-		put_reg(LR, op->b_immediate.link_target | thumb);
-	}
+	struct uop_codepage **prev;
+	int i;
 
-	if(op->flags & UOPBFLAGS_SETTHUMB_ALWAYS) {
-		set_condition(PSR_THUMB, TRUE);
-		// force a codepage reload
-		cpu.curr_cp = NULL;
-	}
-	if(op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS) {
-		set_condition(PSR_THUMB, FALSE);
-		// force a codepage reload
-		cpu.curr_cp = NULL;
-	}
+	UOP_TRACE(5, "remove_codepage: cp %p, thumb %d, address 0x%x, paddr 0x%x\n", cp, cp->thumb, cp->address, cp->paddr);
 
-	cpu.pc = op->b_immediate.target;
-	if(likely(op->b_immediate.target_cp != NULL)) {
-		// we have already cached a pointer to the target codepage, use it
-		cpu.curr_cp = op->b_immediate.target_cp;
-		cpu.cp_pc = PC_TO_CPPC(cpu.pc);
-	} else {
-		// see if we can lookup the target codepage and try again
-		struct uop_codepage *cp = lookup_codepage(cpu.pc, get_condition(PSR_THUMB) ? TRUE : FALSE);
-		if(cp != NULL) {
-			// found one, cache it and set the code page
-			op->b_immediate.target_cp = cp;
-			cpu.curr_cp = cp;
-			cpu.cp_pc = PC_TO_CPPC(cpu.pc);
-		} else {
-			// didn't find one, force a codepage reload next instruction
-			cpu.curr_cp = NULL;
-		}
-	}
+	for(prev = &cpu.codepage_hash[codepage_hash(cp->paddr)]; *prev != cp; prev = &(*prev)->next)
+		ASSERT(*prev != NULL);
+	*prev = cp->next;
+	cpu.codepage_count--;
+	lru_unlink(cp);
 
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_BRANCH);
-#endif
-#if COUNT_CYCLES
-	// all branch instructions take 3 cycles on all cores
-	add_to_perf_counter(CYCLE_COUNT, 2);
+#if WITH_JIT
+	for(i = 0; i < cp->num_chunks; i++) {
+		if(cp->chunks[i])
+			jit_invalidate(cp->chunks[i], CP_CHUNK_INS + 1);
+	}
 #endif
-}
 
-static inline __ALWAYS_INLINE void uop_b_immediate_local(struct uop *op)
-{
-	// branch to a fixed location within the current codepage.
-	if(op->flags & UOPBFLAGS_LINK) {
-		int thumb = get_condition(PSR_THUMB) ? 1 : 0;
-		put_reg(LR, op->b_immediate.link_target | thumb);
-	}
+	/* if it's the one we're running out of, the dispatcher will drop out of the block and reload it */
+	if(cp == cpu.curr_cp)
+		cpu.curr_cp = NULL;
 
-	cpu.pc = op->b_immediate.target;
-	ASSERT(cpu.curr_cp != NULL);
-	cpu.cp_pc = PC_TO_CPPC(cpu.pc);
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_BRANCH);
-#endif
-#if COUNT_CYCLES
-	// all branch instructions take 3 cycles on all cores
-	add_to_perf_counter(CYCLE_COUNT, 2);
-#endif
+	cp->address = 0xffffffff;
+	free_codepage(cp);
 }
 
-static inline __ALWAYS_INLINE void uop_b_reg(struct uop *op)
+/*
+ * the vectors are nearly always the same page, so rather than look their codepage up
+ * through the mmu and the hash on every exception, keep it. it goes to the dispatcher
+ * the way a return does, through the return stack, under the return address it'll
+ * likely be coming back to. the codepage being left may be thumb, so it's let go of
+ * either way and the dispatcher has to take the one from the return stack.
+ */
+void uop_exception_entry(armaddr_t vector, bool returns_to_pc)
 {
-	armaddr_t temp_addr;
-
-	temp_addr = get_reg(op->b_reg.reg);
+	struct uop_codepage *cp = cpu.vector_cp;
 
-	// branch to register contents
-	if(op->flags & UOPBFLAGS_LINK) {
-		int thumb = get_condition(PSR_THUMB) ? 1 : 0;
-		put_reg(LR, (get_reg(PC) + op->b_reg.link_offset) | thumb);
+	if(cp == NULL || !codepage_matches(cp, vector, FALSE)) {
+		cp = find_codepage(vector, FALSE);
+		cpu.vector_cp = cp;
 	}
 
-	put_reg(PC, temp_addr & 0xfffffffe);
+	if(returns_to_pc)
+		rsb_push(cpu.pc);
+	cpu.rsb_top = (cpu.rsb_top + 1) % RSB_SIZE;
+	cpu.rsb[cpu.rsb_top].addr = vector;
+	cpu.rsb[cpu.rsb_top].cp = cp;
 
-	if((temp_addr >> MMU_PAGESIZE_SHIFT) == (cpu.pc >> MMU_PAGESIZE_SHIFT)) {
-		// it's a local branch, just recalc the position in the current codepage
-		cpu.pc = temp_addr & 0xfffffffe;
-		cpu.cp_pc = PC_TO_CPPC(cpu.pc);
-	} else {
-		// it's a remote branch
-		cpu.pc = temp_addr & 0xfffffffe;
-		cpu.curr_cp = NULL;
-	}
+	cpu.curr_cp = NULL;
+	put_reg(PC, vector);
+}
 
-	if(op->flags & UOPBFLAGS_SETTHUMB_ALWAYS) {
-		set_condition(PSR_THUMB, TRUE);
-		// force a codepage reload
-		cpu.curr_cp = NULL;
-	}
-	if(op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS) {
-		set_condition(PSR_THUMB, FALSE);
-		// force a codepage reload
-		cpu.curr_cp = NULL;
+void flush_codepages_at(armaddr_t address)
+{
+	armaddr_t paddr;
+
+	// if we don't know where it maps to anymore, play it safe
+	if(!mmu_probe_instruction_page(address, arm_in_priviledged(), &paddr)) {
+		flush_all_codepages();
+		return;
 	}
 
-	// if the bottom bit of the target address is 1, switch to thumb, otherwise switch to arm
-	if(op->flags & UOPBFLAGS_SETTHUMB_COND) {
-		bool old_condition = get_condition(PSR_THUMB) ? TRUE : FALSE;
-		bool new_condition = (temp_addr & 1) ? TRUE : FALSE;
+	invalidate_codepages_phys(paddr);
+}
+
+void invalidate_codepages_phys(armaddr_t paddr)
+{
+	struct uop_codepage *cp, *next;
 
-		if(old_condition != new_condition) {
-			set_condition(PSR_THUMB, new_condition);
-			// force a codepage reload
-			cpu.curr_cp = NULL;
-			UOP_TRACE(7, "B_REG: setting thumb to %d (new mode)\n", new_condition);
+	for(cp = cpu.codepage_hash[codepage_hash(paddr)]; cp != NULL; cp = next) {
+		next = cp->next;
+		if(cp->paddr == paddr) {
+			remove_codepage(cp);
+			inc_perf_counter(CODEPAGE_INVALIDATE);
 		}
 	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_BRANCH);
-#endif
-#if COUNT_CYCLES
-	// all branch instructions take 3 cycles on all cores
-	add_to_perf_counter(CYCLE_COUNT, 2);
-#endif
 }
 
-static inline __ALWAYS_INLINE void uop_b_reg_offset(struct uop *op)
+static int compare_decodes(const void *_a, const void *_b)
 {
-	armaddr_t temp_addr;
+	const struct uop_codepage *a = *(const struct uop_codepage **)_a;
+	const struct uop_codepage *b = *(const struct uop_codepage **)_b;
 
-	temp_addr = get_reg(op->b_reg_offset.reg);
-	temp_addr += op->b_reg_offset.offset;
+	if(a->decodes != b->decodes)
+		return a->decodes > b->decodes ? -1 : 1;
+	return a->address < b->address ? -1 : a->address > b->address;
+}
 
-	// branch to register contents
-	if(op->flags & UOPBFLAGS_LINK) {
-		int thumb = get_condition(PSR_THUMB) ? 1 : 0;
-		put_reg(LR, (get_reg(PC) + op->b_reg_offset.link_offset) | thumb);
-	}
-
-	put_reg(PC, temp_addr & 0xfffffffe);
-
-	if((temp_addr >> MMU_PAGESIZE_SHIFT) == (cpu.pc >> MMU_PAGESIZE_SHIFT)) {
-		// it's a local branch, just recalc the position in the current codepage
-		cpu.pc = temp_addr & 0xfffffffe;
-		cpu.cp_pc = PC_TO_CPPC(cpu.pc);
-	} else {
-		// it's a remote branch
-		cpu.pc = temp_addr & 0xfffffffe;
-		cpu.curr_cp = NULL;
-	}
-	
-	if(op->flags & UOPBFLAGS_SETTHUMB_ALWAYS) {
-		set_condition(PSR_THUMB, TRUE);
-		// force a codepage reload
-		cpu.curr_cp = NULL;
-	}
-	if(op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS) {
-		set_condition(PSR_THUMB, FALSE);
-		// force a codepage reload
-		cpu.curr_cp = NULL;
-	}
-	
-	// if the bottom bit of the target address is 1, switch to thumb, otherwise switch to arm
-	if(op->flags & UOPBFLAGS_SETTHUMB_COND) {
-		bool old_condition = get_condition(PSR_THUMB) ? TRUE : FALSE;
-		bool new_condition = (temp_addr & 1) ? TRUE : FALSE;
-
-		if(old_condition != new_condition) {
-			set_condition(PSR_THUMB, new_condition);
-			// force a codepage reload
-			cpu.curr_cp = NULL;
-			UOP_TRACE(7, "B_REG: setting thumb to %d (new mode)\n", new_condition);
-		}
-	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_BRANCH);
-#endif
-#if COUNT_CYCLES
-	// all branch instructions take 3 cycles on all cores
-	add_to_perf_counter(CYCLE_COUNT, 2);
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_load_immediate_word(struct uop *op)
-{
-	word temp_word;
-
-	// a very simple load, the address is already precalculated
-	if(mmu_read_mem_word(op->load_immediate.address, &temp_word))
-		return;
-
-	// XXX on armv5 this can switch to thumb
-	put_reg(op->load_immediate.target_reg, temp_word);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_LOAD);
-#endif
-#if COUNT_CYCLES
-	// cycle count
-	if(op->load_immediate.target_reg == PC)
-		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
-	else if(get_core() == ARM7)
-		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_load_immediate_halfword(struct uop *op)
-{
-	halfword temp_halfword;
-	word temp_word;
-
-	// a very simple load, the address is already precalculated
-	if(mmu_read_mem_halfword(op->load_immediate.address, &temp_halfword))
-		return;
-	temp_word = temp_halfword;
-	if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
-		temp_word = SIGN_EXTEND(temp_word, 15);
-
-	// XXX on armv5 this can switch to thumb
-	put_reg(op->load_immediate.target_reg, temp_word);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_LOAD);
-#endif
-#if COUNT_CYCLES
-	// cycle count
-	if(op->load_immediate.target_reg == PC)
-		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
-	else if(get_core() == ARM7)
-		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
-	else if(get_core() >= ARM9)
-		add_to_perf_counter(CYCLE_COUNT, 1); // byte and halfword loads are one cycle slower
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_load_immediate_byte(struct uop *op)
-{
-	byte temp_byte;
-	word temp_word;
-
-	// a very simple load, the address is already precalculated
-	if(mmu_read_mem_byte(op->load_immediate.address, &temp_byte))
-		return;
-	temp_word = temp_byte;
-	if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
-		temp_word = SIGN_EXTEND(temp_word, 7);
-
-	// XXX on armv5 this can switch to thumb
-	put_reg(op->load_immediate.target_reg, temp_word);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_LOAD);
-#endif
-#if COUNT_CYCLES
-	// cycle count
-	if(op->load_immediate.target_reg == PC)
-		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
-	else if(get_core() == ARM7)
-		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
-	else if(get_core() >= ARM9)
-		add_to_perf_counter(CYCLE_COUNT, 1); // byte and halfword loads are one cycle slower
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_load_immediate_offset(struct uop *op)
-{
-	armaddr_t temp_addr, temp_addr2, temp_addr3;
-	word temp_word;
-
-	// slightly more complex, add an offset to a register
-	temp_addr2 = get_reg(op->load_store_immediate_offset.source_reg);
-	temp_addr3 = temp_addr2 + op->load_store_immediate_offset.offset;
-
-	if(op->flags & UOPLSFLAGS_POSTINDEX)
-		temp_addr = temp_addr2; // use the pre-offset computed address
-	else
-		temp_addr = temp_addr3;
-
-	// read in the difference sizes & sign extend
-	switch(op->flags & UOPLSFLAGS_SIZE_MASK) {
-		case UOPLSFLAGS_SIZE_WORD:
-			if(mmu_read_mem_word(temp_addr, &temp_word))
-				return;
-			break;
-		case UOPLSFLAGS_SIZE_HALFWORD: {
-			halfword temp_halfword;
-
-			if(mmu_read_mem_halfword(temp_addr, &temp_halfword))
-				return;
-			temp_word = temp_halfword;
-			if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
-				temp_word = SIGN_EXTEND(temp_word, 15);
-			break;
-		}
-		case UOPLSFLAGS_SIZE_BYTE: {
-			byte temp_byte;
-
-			if(mmu_read_mem_byte(temp_addr, &temp_byte))
-				return;
-			temp_word = temp_byte;
-			if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
-				temp_word = SIGN_EXTEND(temp_word, 7);
-			break;
-		}
-		case UOPLSFLAGS_SIZE_DWORD: {
-			ASSERT((op->load_store_scaled_reg_offset.target_reg & 1) == 0);
-
-			// handle the first word
-			if(mmu_read_mem_word(temp_addr, &temp_word))
-				return;
-
-			put_reg(op->load_store_scaled_reg_offset.target_reg, temp_word);
-
-			// read the second word
-			word temp_word2;
-
-			if(mmu_read_mem_word(temp_addr + 4, &temp_word2))
-				return;
-
-			// NOTE: if second register is r15, unpredictable
-			put_reg(op->load_store_scaled_reg_offset.target_reg + 1, temp_word2);
-			break;
-		}
-	}
-
-	// store the result
-	// XXX on armv5 this can switch to thumb
-	put_reg(op->load_store_immediate_offset.target_reg, temp_word);
-
-	// do writeback
-	if(op->flags & UOPLSFLAGS_WRITEBACK)
-		put_reg(op->load_store_immediate_offset.source_reg, temp_addr3);
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_LOAD);
-#endif
-#if COUNT_CYCLES
-	// cycle count
-	if(op->load_store_immediate_offset.target_reg == PC)
-		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
-	else if(get_core() == ARM7)
-		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
-	else if(get_core() >= ARM9 && (op->flags & UOPLSFLAGS_SIZE_MASK) != UOPLSFLAGS_SIZE_WORD)
-		add_to_perf_counter(CYCLE_COUNT, 1); // byte, halfword, and dword loads are one cycle slower
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_load_scaled_reg_offset(struct uop *op)
-{
-	armaddr_t temp_addr, temp_addr2, temp_addr3;
-	word temp_word;
-
-	// pretty complex. take two registers, optionally perform a shift operation on the second one,
-	// add them together and then load that address
-	temp_addr2 = get_reg(op->load_store_scaled_reg_offset.source_reg);
-	temp_addr3 = get_reg(op->load_store_scaled_reg_offset.source2_reg);	
-	switch(op->load_store_scaled_reg_offset.shift_op) {
-		case 0: // LSL
-			temp_addr3 = LSL(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
-			break;
-		case 1: // LSR
-			if(op->load_store_scaled_reg_offset.shift_immediate == 0)
-				temp_addr3 = 0;
-			else
-				temp_addr3 = LSR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
-			break;
-		case 2: // ASR
-			if(op->load_store_scaled_reg_offset.shift_immediate == 0) {
-				if(temp_addr3 & 0x80000000)
-					temp_addr3 = 0xffffffff;
-				else
-					temp_addr3 = 0;
-			} else {
-				temp_addr3 = ASR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
-			}
-			break;
-		case 3: // ROR or RRX
-			if(op->load_store_scaled_reg_offset.shift_immediate == 0) { // RRX 
-				temp_addr3 = (cpu.cpsr ? 0x80000000 : 0) | LSR(temp_word, 1);
-			} else {
-				temp_addr3 = ROR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
-			}
-			break;
-	}
-
-	if(op->flags & UOPLSFLAGS_NEGATE_OFFSET)
-		temp_addr3 = -temp_addr3;
-
-	temp_addr3 += temp_addr2; // fully calculated address
-
-	if(op->flags & UOPLSFLAGS_POSTINDEX)
-		temp_addr = temp_addr2; // use the pre-offset computed address
-	else
-		temp_addr = temp_addr3;
-
-	// now we have an address, do the load
-	// read in the difference sizes & sign extend
-	switch(op->flags & UOPLSFLAGS_SIZE_MASK) {
-		case UOPLSFLAGS_SIZE_WORD:
-			if(mmu_read_mem_word(temp_addr, &temp_word))
-				return;
-			break;
-		case UOPLSFLAGS_SIZE_HALFWORD: {
-			halfword temp_halfword;
-		
-			if(mmu_read_mem_halfword(temp_addr, &temp_halfword))
-				return;
-			temp_word = temp_halfword;
-			if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
-				temp_word = SIGN_EXTEND(temp_word, 15);
-			break;
-		}
-		case UOPLSFLAGS_SIZE_BYTE: {
-			byte temp_byte;
-
-			if(mmu_read_mem_byte(temp_addr, &temp_byte))
-				return;
-			temp_word = temp_byte;
-			if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
-				temp_word = SIGN_EXTEND(temp_word, 7);
-			break;
-		}
-		case UOPLSFLAGS_SIZE_DWORD: {
-			ASSERT((op->load_store_scaled_reg_offset.target_reg & 1) == 0);
-
-			// handle the first word
-			if(mmu_read_mem_word(temp_addr, &temp_word))
-				return;
-
-			put_reg(op->load_store_scaled_reg_offset.target_reg, temp_word);
-
-			// read the second word
-			word temp_word2;
-
-			if(mmu_read_mem_word(temp_addr + 4, &temp_word2))
-				return;
-
-			// NOTE: if second register is r15, unpredictable
-			put_reg(op->load_store_scaled_reg_offset.target_reg + 1, temp_word2);
-			break;
-		}
-	}
-
-	// store the result
-	// XXX on armv5 this can switch to thumb
-	put_reg(op->load_store_scaled_reg_offset.target_reg, temp_word);
-
-	// do writeback
-	if(op->flags & UOPLSFLAGS_WRITEBACK)
-		put_reg(op->load_store_scaled_reg_offset.source_reg, temp_addr);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_LOAD);
-#endif
-#if COUNT_CYCLES
-	// cycle count
-	if(op->load_store_scaled_reg_offset.target_reg == PC)
-		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
-	else if(get_core() == ARM7)
-		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
-	else if(get_core() >= ARM9 && (op->flags & UOPLSFLAGS_SIZE_MASK) != UOPLSFLAGS_SIZE_WORD)
-		add_to_perf_counter(CYCLE_COUNT, 1); // byte, halfword, and dword loads are one cycle slower
-	if(get_core() == ARM9e)
-		add_to_perf_counter(CYCLE_COUNT, 1); // scaled register loads are 1 cycle slower on this core
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_store_immediate_offset(struct uop *op)
-{
-	armaddr_t temp_addr, temp_addr2, temp_addr3;
-	word temp_word;
-
-	// slightly more complex, add an offset to a register
-	temp_addr2 = get_reg(op->load_store_immediate_offset.source_reg);
-	temp_addr3 = temp_addr2 + op->load_store_immediate_offset.offset;
-
-	if(op->flags & UOPLSFLAGS_POSTINDEX)
-		temp_addr = temp_addr2; // use the pre-offset computed address
-	else
-		temp_addr = temp_addr3;
-
-	// read in what we're going to store
-	temp_word = get_reg(op->load_store_immediate_offset.target_reg);
-
-	// write it out based on the size we were requested
-	switch(op->flags & UOPLSFLAGS_SIZE_MASK) {
-		case UOPLSFLAGS_SIZE_WORD:
-			if(mmu_write_mem_word(temp_addr, temp_word))
-				return;
-			break;
-		case UOPLSFLAGS_SIZE_HALFWORD:
-			if(mmu_write_mem_halfword(temp_addr, temp_word))
-				return;
-			break;
-		case UOPLSFLAGS_SIZE_BYTE:
-			if(mmu_write_mem_byte(temp_addr, temp_word))
-				return;
-			break;
-		case UOPLSFLAGS_SIZE_DWORD:
-			ASSERT((op->load_store_scaled_reg_offset.target_reg & 1) == 0);
-
-			// handle the first word
-			if(mmu_write_mem_word(temp_addr, temp_word))
-				return;
-
-			// read the second word
-			temp_word = get_reg(op->load_store_scaled_reg_offset.target_reg + 1);
-
-			if(mmu_write_mem_word(temp_addr + 4, temp_word))
-				return;
-			break;
-	}
-
-	// do writeback
-	if(op->flags & UOPLSFLAGS_WRITEBACK)
-		put_reg(op->load_store_immediate_offset.source_reg, temp_addr3);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_STORE);
-#endif
-#if COUNT_CYCLES
-	// cycle count (arm9 is 1 cycle, arm7 is 2)
-	if(get_core() == ARM7) {
-		add_to_perf_counter(CYCLE_COUNT, 1);
-	}
-	// strd is one cycle slower
-	if ((op->flags & UOPLSFLAGS_SIZE_MASK) == UOPLSFLAGS_SIZE_DWORD) {
-		add_to_perf_counter(CYCLE_COUNT, 1);
-	}
-#endif
-}
-
-
-static inline __ALWAYS_INLINE void uop_store_scaled_reg_offset(struct uop *op)
-{
-	armaddr_t temp_addr, temp_addr2, temp_addr3;
-	word temp_word;
-
-	// pretty complex. take two registers, optionally perform a shift operation on the second one,
-	// add them together and then load that address
-	// XXX room for improvement here, since lots of times I'm sure an instruction
-	// decoded to a immediate shift of zero to get plain register add
-	temp_addr2 = get_reg(op->load_store_scaled_reg_offset.source_reg);
-	temp_addr3 = get_reg(op->load_store_scaled_reg_offset.source2_reg);	
-	switch(op->load_store_scaled_reg_offset.shift_op) {
-		case 0: // LSL
-			temp_addr3 = LSL(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
-			break;
-		case 1: // LSR
-			if(op->load_store_scaled_reg_offset.shift_immediate == 0)
-				temp_addr3 = 0;
-			else
-				temp_addr3 = LSR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
-			break;
-		case 2: // ASR
-			if(op->load_store_scaled_reg_offset.shift_immediate == 0) {
-				if(temp_addr3 & 0x80000000)
-					temp_addr3 = 0xffffffff;
-				else
-					temp_addr3 = 0;
-			} else {
-				temp_addr3 = ASR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
-			}
-			break;
-		case 3: // ROR or RRX
-			if(op->load_store_scaled_reg_offset.shift_immediate == 0) { // RRX 
-				temp_addr3 = (cpu.cpsr ? 0x80000000 : 0) | LSR(temp_addr3, 1);
-			} else {
-				temp_addr3 = ROR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
-			}
-			break;
-	}
-
-	if(op->flags & UOPLSFLAGS_NEGATE_OFFSET)
-		temp_addr3 = -temp_addr3;
-
-	temp_addr3 += temp_addr2; // fully calculated address
-
-	if(op->flags & UOPLSFLAGS_POSTINDEX)
-		temp_addr = temp_addr2; // use the pre-offset computed address
-	else
-		temp_addr = temp_addr3;
-
-	// read in what we're going to store
-	temp_word = get_reg(op->load_store_scaled_reg_offset.target_reg);
-
-	// write it out based on the size we were requested
-	switch(op->flags & UOPLSFLAGS_SIZE_MASK) {
-		case UOPLSFLAGS_SIZE_WORD:
-			if(mmu_write_mem_word(temp_addr, temp_word))
-				return;
-			break;
-		case UOPLSFLAGS_SIZE_HALFWORD:
-			if(mmu_write_mem_halfword(temp_addr, temp_word))
-				return;
-			break;
-		case UOPLSFLAGS_SIZE_BYTE:
-			if(mmu_write_mem_byte(temp_addr, temp_word))
-				return;
-			break;
-		case UOPLSFLAGS_SIZE_DWORD:
-			ASSERT((op->load_store_scaled_reg_offset.target_reg & 1) == 0);
-
-			// handle the first word
-			if(mmu_write_mem_word(temp_addr, temp_word))
-				return;
-
-			// read the second word
-			temp_word = get_reg(op->load_store_scaled_reg_offset.target_reg + 1);
-
-			if(mmu_write_mem_word(temp_addr + 4, temp_word))
-				return;
-			break;
-	}
-
-	// do writeback
-	if(op->flags & UOPLSFLAGS_WRITEBACK)
-		put_reg(op->load_store_scaled_reg_offset.source_reg, temp_addr);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_STORE);
-#endif
-#if COUNT_CYCLES
-	// cycle count (arm9 is 1 cycle, arm7 is 2)
-	if(get_core() == ARM7) {
-		add_to_perf_counter(CYCLE_COUNT, 1);
-	} else if(get_core() == ARM9e) {
-		add_to_perf_counter(CYCLE_COUNT, 1); // XXX not precisely correct, since a zero scale is no extra work
-	}
-	// strd is one cycle slower
-	if ((op->flags & UOPLSFLAGS_SIZE_MASK) == UOPLSFLAGS_SIZE_DWORD) {
-		add_to_perf_counter(CYCLE_COUNT, 1);
-	}
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_load_multiple(struct uop *op)
-{
-	armaddr_t temp_addr, temp_addr2;
-	word temp_word;
-	int i;
-	word reg_list = op->load_store_multiple.reg_bitmap;
-
-	// calculate the base address
-	temp_addr = get_reg(op->load_store_multiple.base_reg);
-	temp_addr2 = temp_addr + op->load_store_multiple.base_offset;
-
-	// scan through the list of registers, reading in each one
-	ASSERT((reg_list >> 16) == 0);
-	for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
-		if(reg_list & 1) {
-			if(mmu_read_mem_word(temp_addr2, &temp_word)) {
-				// there was a data abort, and we may have trashed the base register. Restore it.
-				put_reg(op->load_store_multiple.base_reg, temp_addr);
-				return;
-			}
-
-			// XXX on armv5 this can switch to thumb
-			put_reg(i, temp_word);
-			temp_addr2 += 4;
-		}
-	}
-
-	// writeback
-	if(op->flags & UOPLSMFLAGS_WRITEBACK) {
-		temp_addr2 = temp_addr + op->load_store_multiple.writeback_offset;
-		put_reg(op->load_store_multiple.base_reg, temp_addr2);
-	}
-
-	// see if we need to move spsr into cpsr
-	if(op->flags & UOPLSMFLAGS_LOAD_CPSR) {
-		reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-		set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-		cpu.cpsr = spsr;
-	}
-
-#if COUNT_CYCLES
-	// cycle count
-	if(get_core() == ARM7) {
-		add_to_perf_counter(CYCLE_COUNT, op->load_store_multiple.reg_count + 1);
-		if(op->load_store_multiple.reg_bitmap & 0x8000) // loaded into PC
-			add_to_perf_counter(CYCLE_COUNT, 2);
-	} else /* if(get_core() >= ARM9) */ {
-		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
-		if(op->load_store_multiple.reg_bitmap & 0x8000) {
-			add_to_perf_counter(CYCLE_COUNT, 4);
-			if(get_core() == ARM9e && op->load_store_multiple.reg_count == 0)
-				add_to_perf_counter(CYCLE_COUNT, -1); // ldm of just pc is one cycle faster on ARM9e
-		}
-	}				
-#endif
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_LOAD);
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_load_multiple_s(struct uop *op)
-{
-	armaddr_t temp_addr, temp_addr2;
-	word temp_word;
-	int i;
-	word reg_list = op->load_store_multiple.reg_bitmap;
-
-	// calculate the base address
-	temp_addr = get_reg(op->load_store_multiple.base_reg);
-	temp_addr2 = temp_addr + op->load_store_multiple.base_offset;
-
-	// r15 cannot be in the register list, would have resulted in a different instruction
-	ASSERT((reg_list & 0x8000) == 0);
-
-	// scan through the list of registers, reading in each one
-	ASSERT((reg_list >> 16) == 0);
-	for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
-		if(reg_list & 1) {
-			if(mmu_read_mem_word(temp_addr2, &temp_word)) {
-				// there was a data abort, and we may have trashed the base register. Restore it.
-				put_reg_user(op->load_store_multiple.base_reg, temp_addr);
-				return;
-			}
-			put_reg_user(i, temp_word);
-			temp_addr2 += 4;
-		}
-	}
-
-	// writeback
-	// NOTE: writeback with the S bit set is unpredictable
-	if(op->flags & UOPLSMFLAGS_WRITEBACK) {
-		temp_addr2 = temp_addr + op->load_store_multiple.writeback_offset;
-		put_reg(op->load_store_multiple.base_reg, temp_addr2);
-	}
-
-#if COUNT_CYCLES
-	// cycle count
-	if(get_core() == ARM7) {
-		add_to_perf_counter(CYCLE_COUNT, op->load_store_multiple.reg_count + 1);
-		if(op->load_store_multiple.reg_bitmap & 0x8000) // loaded into PC
-			add_to_perf_counter(CYCLE_COUNT, 2);
-	} else /* if(get_core() >= ARM9) */ {
-		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
-		if(op->load_store_multiple.reg_bitmap & 0x8000) {
-			add_to_perf_counter(CYCLE_COUNT, 4);
-			if(get_core() == ARM9e && op->load_store_multiple.reg_count == 0)
-				add_to_perf_counter(CYCLE_COUNT, -1); // ldm of just pc is one cycle faster on ARM9e
-		}
-	}				
-#endif
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_LOAD);
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_store_multiple(struct uop *op)
-{
-	armaddr_t temp_addr, temp_addr2;
-	int i;
-	word reg_list = op->load_store_multiple.reg_bitmap;
-
-	// calculate the base address
-	temp_addr = get_reg(op->load_store_multiple.base_reg);
-	temp_addr2 = temp_addr + op->load_store_multiple.base_offset;
-
-	// scan through the list of registers, storing each one
-	ASSERT((reg_list >> 16) == 0);
-	for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
-		if(reg_list & 1) {
-			if(mmu_write_mem_word(temp_addr2, get_reg(i)))
-				return; // data abort
-			temp_addr2 += 4;
-		}
-	}
-
-	// writeback
-	if(op->flags & UOPLSMFLAGS_WRITEBACK) {
-		temp_addr2 = temp_addr + op->load_store_multiple.writeback_offset;
-		put_reg(op->load_store_multiple.base_reg, temp_addr2);
-	}
-
-#if COUNT_CYCLES
-	// cycle count
-	if(get_core() == ARM7) {
-		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count - 1) + 1);
-	} else /* if(get_core() >= ARM9) */ {
-		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
-	}
-#endif
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_STORE);
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_store_multiple_s(struct uop *op)
-{
-	armaddr_t temp_addr, temp_addr2;
-	int i;
-	word reg_list = op->load_store_multiple.reg_bitmap;
-
-	// calculate the base address
-	temp_addr = get_reg(op->load_store_multiple.base_reg);
-	temp_addr2 = temp_addr + op->load_store_multiple.base_offset;
-
-	// scan through the list of registers, storing each one
-	ASSERT((reg_list >> 16) == 0);
-	for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
-		if(reg_list & 1) {
-			if(mmu_write_mem_word(temp_addr2, get_reg_user(i)))
-				return; // data abort
-			temp_addr2 += 4;
-		}
-	}
-
-	// writeback
-	// NOTE: writeback with the S bit set is unpredictable
-	if(op->flags & UOPLSMFLAGS_WRITEBACK) {
-		temp_addr2 = temp_addr + op->load_store_multiple.writeback_offset;
-		put_reg(op->load_store_multiple.base_reg, temp_addr2);
-	}
-
-#if COUNT_CYCLES
-	// cycle count
-	if(get_core() == ARM7) {
-		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count - 1) + 1);
-	} else /* if(get_core() >= ARM9) */ {
-		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
-	}
-#endif
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_STORE);
-#endif
-}
-
-// generic data process with immediate operand, no S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_imm(struct uop *op)
-{
-	word immediate = op->data_processing_imm.immediate;
-	word temp_word = get_reg(op->data_processing_imm.source_reg);
-
-	ASSERT(op->data_processing_imm.dp_opcode < 16);
-	ASSERT_VALID_REG(op->data_processing_imm.source_reg);
-	ASSERT_VALID_REG(op->data_processing_imm.dest_reg);
-
-	DATA_PROCESSING_OP_TABLE_NOFLAGS(op->data_processing_imm.dp_opcode,
-		temp_word, // result
-		temp_word, immediate); // a & b
-
-	// write the result out
-	// NOTE: if the op was originally one of the four arm test ops
-	// (TST, TEQ, CMP, CMN), we would be using the DATA_PROCESSING_IMM_S
-	// instruction form, since not having writeback makes no sense
-	put_reg(op->data_processing_imm.dest_reg, temp_word);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-#if COUNT_ARITH_UOPS
-	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_imm.dp_opcode);
-#endif
-}
-
-// generic data processing with register operand, no S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_reg(struct uop *op)
-{
-	word temp_word = get_reg(op->data_processing_reg.source_reg);
-	word operand2 = get_reg(op->data_processing_reg.source2_reg);
-	
-	ASSERT(op->data_processing_reg.dp_opcode < 16);
-	ASSERT_VALID_REG(op->data_processing_reg.source_reg);
-	ASSERT_VALID_REG(op->data_processing_reg.source2_reg);
-	ASSERT_VALID_REG(op->data_processing_reg.dest_reg);
-
-	DATA_PROCESSING_OP_TABLE_NOFLAGS(op->data_processing_reg.dp_opcode,
-		temp_word, // result
-		temp_word, operand2); // a & b
-
-	// write the result out
-	// NOTE: if the op was originally one of the four arm test ops
-	// (TST, TEQ, CMP, CMN), we would be using the DATA_PROCESSING_REG_S
-	// instruction form, since not having writeback makes no sense
-	put_reg(op->data_processing_reg.dest_reg, temp_word);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-#if COUNT_ARITH_UOPS
-	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_reg.dp_opcode);
-#endif
-}
-
-// generic data process with immediate operand, S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_imm_s(struct uop *op)
-{
-	bool Rd_writeback;
-	bool arith_op;
-	word immediate = op->data_processing_imm.immediate;
-	int carry, ovl;
-	
-	word temp_word = get_reg(op->data_processing_imm.source_reg);
-	
-	ASSERT(op->data_processing_imm.dp_opcode < 16);
-	ASSERT_VALID_REG(op->data_processing_imm.source_reg);
-	ASSERT_VALID_REG(op->data_processing_imm.dest_reg);
-
-	Rd_writeback = TRUE;
-	arith_op = FALSE;
-	carry = 0;
-	ovl = 0;
-	DATA_PROCESSING_OP_TABLE(op->data_processing_imm.dp_opcode, 
-		temp_word, // result
-		temp_word, immediate, // a & b
-		arith_op, Rd_writeback, carry, ovl);
-
-	if(Rd_writeback)
-		put_reg(op->data_processing_imm.dest_reg, temp_word);
-
-	if(op->data_processing_imm.dest_reg != PC) {
-		set_NZ_condition(temp_word);
-		if(arith_op) {
-			set_condition(PSR_CC_CARRY, carry);
-			set_condition(PSR_CC_OVL, ovl);
-		} else {
-			// carry out from the shifter depending on how it was precalculated
-			if(op->flags & UOPDPFLAGS_SET_CARRY_FROM_SHIFTER)
-				set_condition(PSR_CC_CARRY, op->flags & UOPDPFLAGS_CARRY_FROM_SHIFTER);
-		}
-	} else {
-		// destination was pc, and S bit was set, this means we swap spsr
-		reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-
-		// see if we're about to switch thumb state
-		if((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
-			cpu.curr_cp = NULL; // force a codepage reload
-
-		set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-		cpu.cpsr = spsr;
-	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-#if COUNT_ARITH_UOPS
-	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_imm.dp_opcode);
-#endif
-}
-
-// generic data processing with register operand, S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_reg_s(struct uop *op) 
-{
-	bool Rd_writeback;
-	bool arith_op;
-	int carry, ovl;
-	
-	word temp_word = get_reg(op->data_processing_reg.source_reg);
-	word temp_word2 = get_reg(op->data_processing_reg.source2_reg);
-	
-	ASSERT(op->data_processing_reg.dp_opcode < 16);
-	ASSERT_VALID_REG(op->data_processing_reg.source_reg);
-	ASSERT_VALID_REG(op->data_processing_reg.source2_reg);
-	ASSERT_VALID_REG(op->data_processing_reg.dest_reg);
-
-	Rd_writeback = TRUE;
-	arith_op = FALSE;
-	carry = 0;
-	ovl = 0;
-	DATA_PROCESSING_OP_TABLE(op->data_processing_reg.dp_opcode, 
-		temp_word, // result
-		temp_word, temp_word2, // a & b
-		arith_op, Rd_writeback, carry, ovl);
-
-	if(Rd_writeback)
-		put_reg(op->data_processing_reg.dest_reg, temp_word);
-
-	if(op->data_processing_reg.dest_reg != PC) {
-		set_NZ_condition(temp_word);
-		if(arith_op) {
-			set_condition(PSR_CC_CARRY, carry);
-			set_condition(PSR_CC_OVL, ovl);
-		}
-	} else {
-		// destination was pc, and S bit was set, this means we swap spsr
-		reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-
-		// see if we're about to switch thumb state
-		if((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
-			cpu.curr_cp = NULL; // force a codepage reload
-
-		set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-		cpu.cpsr = spsr;
-	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-#if COUNT_ARITH_UOPS
-	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_reg.dp_opcode);
-#endif
-}
-
-// generic data processing with immediate barrel shifter, no S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_imm_shift(struct uop *op)
-{
-	bool Rd_writeback;
-	bool arith_op;
-	int carry, ovl;
-	bool shifter_carry_out;
-	word shifter_operand;
-	word shift_imm;
-
-	ASSERT(op->data_processing_imm_shift.shift_opcode < 4);
-	ASSERT(op->data_processing_imm_shift.dp_opcode < 16);
-	ASSERT_VALID_REG(op->data_processing_imm_shift.source_reg);
-	ASSERT_VALID_REG(op->data_processing_imm_shift.source2_reg);
-	ASSERT_VALID_REG(op->data_processing_imm_shift.dest_reg);
-
-	// first operand
-	word temp_word = get_reg(op->data_processing_imm_shift.source_reg);
-	word temp_word2 = get_reg(op->data_processing_imm_shift.source2_reg);
-	shift_imm = op->data_processing_imm_shift.shift_imm;
-
-	// handle the immediate shift form of barrel shifter
-	switch(op->data_processing_imm_shift.shift_opcode) {
-		default: case 0: // LSL
-			if(shift_imm == 0) {
-				// shouldn't see this form, it would have been factored out into a simpler instruction
-				shifter_operand = temp_word2;
-				shifter_carry_out = get_condition(PSR_CC_CARRY);
-			} else {
-				shifter_operand = LSL(temp_word2, shift_imm);
-				shifter_carry_out = BIT(temp_word2, 32 - shift_imm);
-			}
-			break;
-		case 1: // LSR
-			if(shift_imm == 0) {
-				shifter_operand = 0;
-				shifter_carry_out = BIT(temp_word2, 31);
-			} else {
-				shifter_operand = LSR(temp_word2, shift_imm);
-				shifter_carry_out = BIT(temp_word2, shift_imm - 1);
-			}
-			break;
-		case 2: // ASR
-			if(shift_imm == 0) {
-				if(BIT(temp_word2, 31) == 0) {
-					shifter_operand = 0;
-					shifter_carry_out = 0; // Rm[31] == 0
-				} else {
-					shifter_operand = 0xffffffff;
-					shifter_carry_out = 0x80000000; // Rm[31] == 1
-				}
-			} else {
-				shifter_operand = ASR(temp_word2, shift_imm);
-				shifter_carry_out = BIT(temp_word2, shift_imm - 1);
-			}
-			break;
-		case 3: // ROR
-			if(shift_imm == 0) {
-				// RRX
-				shifter_operand = (get_condition(PSR_CC_CARRY) ? 0x80000000: 0) | LSR(temp_word2, 1);
-				shifter_carry_out = BIT(temp_word2, 0);
-			} else {
-				shifter_operand = ROR(temp_word2, shift_imm);
-				shifter_carry_out = BIT(temp_word2, shift_imm - 1);
-			}
-			break;
-	}
-
-	// do the op
-	Rd_writeback = TRUE;
-	arith_op = FALSE;
-	carry = 0;
-	ovl = 0;
-	DATA_PROCESSING_OP_TABLE(op->data_processing_imm_shift.dp_opcode, 
-		temp_word, // result
-		temp_word, shifter_operand, // a & b
-		arith_op, Rd_writeback, carry, ovl);
-
-	if(Rd_writeback)
-		put_reg(op->data_processing_imm_shift.dest_reg, temp_word);
-
-	if(op->flags & UOPDPFLAGS_S_BIT) {
-		if(op->data_processing_imm_shift.dest_reg != PC) {
-			set_NZ_condition(temp_word);
-			if(arith_op) {
-				set_condition(PSR_CC_CARRY, carry);
-				set_condition(PSR_CC_OVL, ovl);
-			} else {
-				// carry out from the shifter
-				set_condition(PSR_CC_CARRY, shifter_carry_out);
-			}
-		} else {
-			// destination was pc, and S bit was set, this means we swap spsr
-			reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-
-			// see if we're about to switch thumb state
-			if((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
-				cpu.curr_cp = NULL; // force a codepage reload
-	
-			set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-			cpu.cpsr = spsr;
-		}
-	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-#if COUNT_ARITH_UOPS
-	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_imm_shift.dp_opcode);
-#endif
-}	
-
-// generic data processing with register based barrel shifter, no S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op) 
-	{
-	bool Rd_writeback;
-	bool arith_op;
-	int carry, ovl;
-	bool shifter_carry_out;
-	word shifter_operand;
-
-	ASSERT(op->data_processing_reg_shift.shift_opcode < 4);
-	ASSERT(op->data_processing_reg_shift.dp_opcode < 16);
-	ASSERT_VALID_REG(op->data_processing_reg_shift.source_reg);
-	ASSERT_VALID_REG(op->data_processing_reg_shift.source2_reg);
-	ASSERT_VALID_REG(op->data_processing_reg_shift.dest_reg);
-
-	// operands
-	word temp_word = get_reg(op->data_processing_reg_shift.source_reg);
-	word temp_word2 = get_reg(op->data_processing_reg_shift.source2_reg);
-	word temp_word3 = get_reg(op->data_processing_reg_shift.shift_reg);
-	
-	// we only care about the bottom 8 bits of Rs
-	temp_word3 = BITS(temp_word3, 7, 0);
-
-	// handle the immediate shift form of barrel shifter
-	switch(op->data_processing_reg_shift.shift_opcode) {
-		default: case 0: // LSL by reg (page A5-10)
-			shifter_operand = LSL(temp_word2, temp_word3);
-			if(temp_word3 == 0) {
-				shifter_carry_out = get_condition(PSR_CC_CARRY);
-			} else if(temp_word3 < 32) {
-				shifter_carry_out = BIT(temp_word2, 32 - temp_word3);
-			} else if(temp_word3 == 32) {
-				shifter_carry_out = BIT(temp_word2, 0);
-			} else { // temp_word3 > 32
-				shifter_carry_out = 0;
-			}
-			break;
-		case 1: // LSR by reg (page A5-12)
-			shifter_operand = LSR(temp_word2, temp_word3);
-			if(temp_word3 == 0) {
-				shifter_carry_out = get_condition(PSR_CC_CARRY);
-			} else if(temp_word3 < 32) {
-				shifter_carry_out = BIT(temp_word2, temp_word3 - 1);
-			} else if(temp_word3 == 32) {
-				shifter_carry_out = BIT(temp_word2, 31);
-			} else {
-				shifter_carry_out = 0;
-			}
-			break;
-		case 2: // ASR by reg (page A5-14)
-			shifter_operand = ASR(temp_word2, temp_word3);
-			if(temp_word3 == 0) {
-				shifter_carry_out = get_condition(PSR_CC_CARRY);
-			} else if(temp_word3 < 32) {
-				shifter_carry_out = BIT(temp_word2, temp_word3 - 1);
-			} else if(temp_word3 >= 32) {
-				shifter_carry_out = BIT(temp_word2, 31);
-			}
-			break;
-		case 3: { // ROR by reg (page A5-16)
-			word lower_4bits = BITS(temp_word3, 4, 0);
-			shifter_operand = ROR(temp_word2, lower_4bits);
-			if(temp_word3 == 0) {
-				shifter_carry_out = get_condition(PSR_CC_CARRY);
-			} else if(lower_4bits == 0) {
-				shifter_carry_out = BIT(temp_word2, 31);
-			} else { // temp_word3 & 0x1f > 0
-				shifter_carry_out = BIT(temp_word2, lower_4bits - 1);
-			}
-			break;
-		}
-	}
-
-#if COUNT_CYCLES
-	/* shifting by a reg value costs an extra cycle */
-	add_to_perf_counter(CYCLE_COUNT, 1);
-#endif
-	// do the op
-	Rd_writeback = TRUE;
-	arith_op = FALSE;
-	carry = 0;
-	ovl = 0;
-	DATA_PROCESSING_OP_TABLE(op->data_processing_reg_shift.dp_opcode, 
-		temp_word, // result
-		temp_word, shifter_operand, // a & b
-		arith_op, Rd_writeback, carry, ovl);
-
-	if(Rd_writeback)
-		put_reg(op->data_processing_reg_shift.dest_reg, temp_word);
-
-	if(op->flags & UOPDPFLAGS_S_BIT) {
-		if(op->data_processing_reg_shift.dest_reg != PC) {
-			set_NZ_condition(temp_word);
-			if(arith_op) {
-				set_condition(PSR_CC_CARRY, carry);
-				set_condition(PSR_CC_OVL, ovl);
-			} else {
-				// carry out from the shifter
-				set_condition(PSR_CC_CARRY, shifter_carry_out);
-			}
-		} else {
-			// destination was pc, and S bit was set, this means we swap spsr
-			reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-
-			// see if we're about to switch thumb state
-			if((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
-				cpu.curr_cp = NULL; // force a codepage reload
-	
-			set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-			cpu.cpsr = spsr;
-		}
-	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-#if COUNT_ARITH_UOPS
-	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_reg_shift.dp_opcode);
-#endif
-}
-
-// simple load of immediate into register, PC may not be target
-static inline __ALWAYS_INLINE void uop_mov_imm(struct uop *op) 
-{
-	put_reg_nopc(op->simple_dp_imm.dest_reg, op->simple_dp_imm.immediate);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple load of immediate into register, set N and Z flags, PC may not be target
-static inline __ALWAYS_INLINE void uop_mov_imm_nz(struct uop *op) 
-{
-	put_reg_nopc(op->simple_dp_imm.dest_reg, op->simple_dp_imm.immediate);
-	set_NZ_condition(op->simple_dp_imm.immediate);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple mov from register to register, PC may not be target
-static inline __ALWAYS_INLINE void uop_mov_reg(struct uop *op) 
-{
-	put_reg_nopc(op->simple_dp_reg.dest_reg, get_reg(op->simple_dp_reg.source2_reg));
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple compare of register to immediate value
-static inline __ALWAYS_INLINE void uop_cmp_imm_s(struct uop *op) 
-{
-	int carry, ovl;
-	word result;
-	
-	// subtract the immediate from the source register
-	result = do_add(get_reg(op->simple_dp_imm.source_reg), ~(op->simple_dp_imm.immediate), 1, &carry, &ovl);
-
-	// set flags on the result
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	set_condition(PSR_CC_OVL, ovl);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple compare of two registers
-static inline __ALWAYS_INLINE void uop_cmp_reg_s(struct uop *op) 
-{
-	int carry, ovl;
-	word result;
-
-	// subtract the source2 reg from the source register
-	result = do_add(get_reg(op->simple_dp_reg.source_reg), ~(get_reg(op->simple_dp_reg.source2_reg)), 1, &carry, &ovl);
-
-	// set flags on the result
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	set_condition(PSR_CC_OVL, ovl);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple negative compare of two registers
-static inline __ALWAYS_INLINE void uop_cmn_reg_s(struct uop *op) 
-{
-	int carry, ovl;
-	word result;
-	
-	// subtract the source2 reg from the source register
-	result = do_add(get_reg(op->simple_dp_reg.source_reg), get_reg(op->simple_dp_reg.source2_reg), 0, &carry, &ovl);
-
-	// set flags on the result
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	set_condition(PSR_CC_OVL, ovl);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// bit test of two registers
-static inline __ALWAYS_INLINE void uop_tst_reg_s(struct uop *op) 
-{
-	word result;
-	word a;
-	word b;
-	
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	
-	result = a & b;
-
-	// set flags on the result
-	set_NZ_condition(result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple add of immediate to register, PC may not be target
-static inline __ALWAYS_INLINE void uop_add_imm(struct uop *op) 
-{
-	word a;
-	word result;
-
-	a = get_reg(op->simple_dp_imm.source_reg);
-	result = a + op->simple_dp_imm.immediate;
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple add of immediate to register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_add_imm_s(struct uop *op) 
-{
-	int carry, ovl;
-	word a;
-	word result;
-
-	a = get_reg(op->simple_dp_imm.source_reg);
-	result = do_add(a, op->simple_dp_imm.immediate, 0, &carry, &ovl);
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
-
-	// set flags on the result
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	set_condition(PSR_CC_OVL, ovl);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple add of two registers, PC may not be target
-static inline __ALWAYS_INLINE void uop_add_reg(struct uop *op) 
-{
-	word a;
-	word b;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = a + b;
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple add of two registers, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_add_reg_s(struct uop *op) 
-{
-	int carry, ovl;
-	word a;
-	word b;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = do_add(a, b, 0, &carry, &ovl);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-	// set flags on the result
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	set_condition(PSR_CC_OVL, ovl);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple add with carry of two registers, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_adc_reg_s(struct uop *op) 
-{
-	int carry, ovl;
-	word a;
-	word b;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = do_add(a, b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-	// set flags on the result
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	set_condition(PSR_CC_OVL, ovl);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple subtract of two registers, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_sub_reg_s(struct uop *op) 
-{
-	int carry, ovl;
-	word a;
-	word b;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = do_add(a, ~b, 1, &carry, &ovl);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-	// set flags on the result
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	set_condition(PSR_CC_OVL, ovl);
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// simple subtract with carry of two registers, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_sbc_reg_s(struct uop *op) 
-{
-	int carry, ovl;
-	word a;
-	word b;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = do_add(a, ~b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl);
-	put_reg(op->simple_dp_reg.dest_reg, result);
-
-	// set flags on the result
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	set_condition(PSR_CC_OVL, ovl);
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// and with immediate, PC may not be target
-static inline __ALWAYS_INLINE void uop_and_imm(struct uop *op) 
-{
-	word a;
-	word result;
-
-	a = get_reg(op->simple_dp_imm.source_reg);
-	result = a & op->simple_dp_imm.immediate;
-
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// or with immediate, PC may not be target
-static inline __ALWAYS_INLINE void uop_orr_imm(struct uop *op) 
-{
-	word a;
-	word result;
-
-	a = get_reg(op->simple_dp_imm.source_reg);
-	result = a | op->simple_dp_imm.immediate;
-
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// or by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_orr_reg_s(struct uop *op) 
-{
-	word a;
-	word b;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = a | b;
-
-	set_NZ_condition(result);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// shift left of register by immediate, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsl_imm(struct uop *op) 
-{
-	word a;
-	word shift;
-	word result;
-
-	a = get_reg(op->simple_dp_imm.source_reg);
-	shift = op->simple_dp_imm.immediate;
-
-	result = LSL(a, shift);
-
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// shift left of register by immediate, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsl_imm_s(struct uop *op) 
-{
-	int carry;
-	word a;
-	word immed;
-	word result;
-
-	a = get_reg(op->simple_dp_imm.source_reg);
-	immed = op->simple_dp_imm.immediate;
-
-	if(immed != 0) {
-		carry = BIT(a, 32 - immed);
-		result = LSL(a, immed);
-	} else {
-		carry = get_condition(PSR_CC_CARRY);
-		result = a;
-	}
-
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// shift left of register by register, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsl_reg(struct uop *op) 
+/* reports on the current core, the live codepages only, a reload starts a page's count over */
+void uop_dump_codepages(int top)
 {
-	word a;
-	word shift;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	shift = get_reg(op->simple_dp_reg.source2_reg);
-	shift &= 0xff;
-
-	result = LSL(a, shift);
+	struct uop_codepage **pages, *cp;
+	unsigned int lengths[9] = { 0 }; // the last one is 8 or more
+	unsigned int i, n = 0, used = 0, longest = 0;
 
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+	pages = malloc(cpu.codepage_count * sizeof(struct uop_codepage *) + 1);
+	for(i = 0; i < cpu.codepage_hash_size; i++) {
+		unsigned int len = 0;
 
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// shift left of register by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsl_reg_s(struct uop *op) 
-{
-	int carry;
-	word a;
-	word shift;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	shift = get_reg(op->simple_dp_reg.source2_reg);
-	shift &= 0xff;
-
-	result = LSL(a, shift);
-	if(shift == 0) {
-		carry = get_condition(PSR_CC_CARRY);
-	} else if(shift < 32) {
-		carry = BIT(a, 32 - shift);
-	} else if(shift == 32) {
-		carry = BIT(a, 0);
-	} else {
-		carry = 0;
+		for(cp = cpu.codepage_hash[i]; cp != NULL; cp = cp->next) {
+			if(pages && n < cpu.codepage_count)
+				pages[n++] = cp;
+			len++;
+		}
+		lengths[len < 8 ? len : 8]++;
+		if(len) 
+			used++;
+		if(len > longest)
+			longest = len;
 	}
 
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// logical shift right by immediate, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsr_imm(struct uop *op) 
-{
-	word a;
-	word immed;
-	word result;
-
-	a = get_reg(op->simple_dp_imm.source_reg);
-	immed = op->simple_dp_imm.immediate;
-
-	result = LSR(a, immed);
-
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
+	printf("codepages: %u in %u buckets, %u buckets used, longest chain %u\n",
+		cpu.codepage_count, cpu.codepage_hash_size, used, longest);
+	printf("chain lengths:");
+	for(i = 0; i < 9; i++)
+		printf(" %u%s:%u", i, i == 8 ? "+" : "", lengths[i]);
+	printf("\n");
 
-// logical shift right by immediate, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsr_imm_s(struct uop *op) 
-{
-	int carry;
-	word a;
-	word immed;
-	word result;
+	if(!pages)
+		return;
 
-	a = get_reg(op->simple_dp_imm.source_reg);
-	immed = op->simple_dp_imm.immediate;
+	qsort(pages, n, sizeof(struct uop_codepage *), &compare_decodes);
+	printf("codepages with the most decoding done in them:\n");
+	printf("     address      paddr        decodes  chunks\n");
+	for(i = 0; i < n && i < (unsigned int)top && pages[i]->decodes; i++) {
+		int chunks = 0, c;
 
-	if(immed != 0) {
-		carry = BIT(a, immed - 1);
-		result = LSR(a, immed);
-	} else {
-		carry = BIT(a, 31);
-		result = 0;
+		cp = pages[i];
+		for(c = 0; c < cp->num_chunks; c++)
+			chunks += cp->chunks[c] != NULL;
+		printf("  0x%08x 0x%08x %5s %8u  %d/%d\n", cp->address, cp->paddr, cp->thumb ? "thumb" : "arm",
+			cp->decodes, chunks, cp->num_chunks);
 	}
-
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
+	free(pages);
 }
 
-// logical shift right by register, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsr_reg(struct uop *op) 
+#if UOP_FUSION
+/* decode the instruction after op in place, so the peephole pass can look at it */
+static struct uop *uop_peek_next(struct uop *op)
 {
-	word a;
-	word shift;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	shift = get_reg(op->simple_dp_reg.source2_reg);
-	shift &= 0xff;
+	struct uop *next = op + 1;
+	int pc_inc = cpu.curr_cp->pc_inc;
 
-	result = LSR(a, shift);
-
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// logical shift right by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsr_reg_s(struct uop *op) 
-{
-	int carry;
-	word a;
-	word shift;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	shift = get_reg(op->simple_dp_reg.source2_reg);
-	shift &= 0xff;
-
-	result = LSR(a, shift);
-	if(shift == 0) {
-		carry = get_condition(PSR_CC_CARRY);
-	} else if(shift < 32) {
-		carry = BIT(a, shift - 1);
-	} else if(shift == 32) {
-		carry = BIT(a, 31);
-	} else {
-		carry = 0;
+	if(next->opcode == DECODE_ME_ARM || next->opcode == DECODE_ME_THUMB) {
+		// the decoders compute pc relative values off the current pc
+		cpu.pc += pc_inc;
+		cpu.r[PC] += pc_inc;
+		if(uop_take_predecoded(cpu.curr_cp, next)) {
+			inc_perf_counter(INS_PREDECODED);
+		} else {
+			uop_fetch_raw(cpu.curr_cp, next);
+			if(next->opcode == DECODE_ME_THUMB)
+				thumb_decode_into_uop(next);
+			else
+				arm_decode_into_uop(next);
+			inc_perf_counter(INS_DECODE);
+		}
+		uop_mark_idle_branch(next);
+		uop_finish_decode(next);
+		cpu.pc -= pc_inc;
+		cpu.r[PC] -= pc_inc;
+		cpu.curr_cp->decodes++;
 	}
 
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
+	return next;
 }
 
-// arithmetic shift right by immediate,  PC may not be target
-static inline __ALWAYS_INLINE void uop_asr_imm(struct uop *op) 
+/* 
+ * look at the raw instruction following a freshly decoded uop to see if it
+ * could pair up with it. keeps us from decoding ahead into literal pools.
+ */
+static bool uop_next_may_fuse(struct uop *op, int want)
 {
-	word a;
-	word immed;
-	word result;
-
-	a = get_reg(op->simple_dp_imm.source_reg);
-	immed = op->simple_dp_imm.immediate;
-
-	result = ASR(a, immed);
-
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+	struct uop *next = op + 1;
+	word ins;
 
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
+	if(next->opcode == DECODE_ME_ARM || next->opcode == DECODE_ME_THUMB)
+		uop_fetch_raw(cpu.curr_cp, next);
+	ins = next->undecoded.raw_instruction;
 
-// arithmetic shift right by immediate, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_asr_imm_s(struct uop *op) 
-{
-	int carry;
-	word a;
-	word immed;
-	word result;
-
-	a = get_reg(op->simple_dp_imm.source_reg);
-	immed = op->simple_dp_imm.immediate;
-
-	if(immed == 0) {
-		carry = BIT(a, 31);
-		if(carry)
-			result = 0;
+	if(next->opcode == DECODE_ME_ARM) {
+		if(want == B_IMMEDIATE_LOCAL)
+			return (ins & 0x0f000000) == 0x0a000000 && (ins >> COND_SHIFT) < COND_AL; // conditional b
 		else
-			result = 0xffffffff;
-	} else {
-		carry = BIT(a, immed - 1);
-		result = ASR(a, immed);
-	}
-
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// arithmetic shift right by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_asr_reg(struct uop *op) 
-{
-	word a;
-	word shift;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	shift = get_reg(op->simple_dp_reg.source2_reg);
-	shift &= 0xff;
-
-	result = ASR(a, shift);
-
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// arithmetic shift right by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_asr_reg_s(struct uop *op) 
-{
-	int carry;
-	word a;
-	word shift;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	shift = get_reg(op->simple_dp_reg.source2_reg);
-	shift &= 0xff;
-
-	result = ASR(a, shift);
-	if(shift == 0) {
-		carry = get_condition(PSR_CC_CARRY);
-	} else if(shift < 32) {
-		carry = BIT(a, shift - 1);
-	} else { // RmRsval >= 32
-		carry = BIT(a, 31);
-	}
-
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// rotate right by register, PC may not be target
-static inline __ALWAYS_INLINE void uop_ror_reg(struct uop *op) 
-{
-	word a;
-	word rotate;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	rotate = get_reg(op->simple_dp_reg.source2_reg);
-	rotate = BITS(rotate, 4, 0);
-
-	result = ROR(a, rotate);
-
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// rotate right by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_ror_reg_s(struct uop *op) 
-{
-	int carry;
-	word a;
-	word rotate;
-	word rotate_lower_4_bits;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	rotate = get_reg(op->simple_dp_reg.source2_reg);
-	rotate_lower_4_bits = BITS(rotate, 4, 0);
-
-	result = ROR(a, rotate_lower_4_bits);
-	if(BITS(rotate, 7, 0) == 0) {
-		carry = get_condition(PSR_CC_CARRY);
-	} else if(rotate_lower_4_bits == 0) {
-		carry = BIT(a, 31);
-	} else {
-		carry = BIT(a, rotate_lower_4_bits - 1);
+			return (ins & 0xffef0000) == 0xe3a00000; // mov(s) rd, #imm
+	} else if(next->opcode == DECODE_ME_THUMB) {
+		if(want == B_IMMEDIATE_LOCAL)
+			return (ins & 0xf000) == 0xd000 && ((ins >> 8) & 0xf) < COND_AL; // conditional b
+		else
+			return FALSE; // thumb immediate moves always set flags
 	}
 
-	set_NZ_condition(result);
-	set_condition(PSR_CC_CARRY, carry);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// and by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_and_reg_s(struct uop *op) 
-{
-	word a;
-	word b;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = a & b;
-
-	set_NZ_condition(result);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// xor by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_eor_reg_s(struct uop *op) 
-{
-	word a;
-	word b;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = a ^ b;
-
-	set_NZ_condition(result);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// bit clear by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_bic_reg_s(struct uop *op) 
-{
-	word a;
-	word b;
-	word result;
-
-	a = get_reg(op->simple_dp_reg.source_reg);
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = a & ~b;
-
-	set_NZ_condition(result);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// negate register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_neg_reg_s(struct uop *op) 
-{
-	int carry, ovl;
-	word b;
-	word result;
-
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = do_add(0, ~b, 1, &carry, &ovl);
-
-	set_condition(PSR_CC_CARRY, carry);
-	set_condition(PSR_CC_OVL, ovl);
-	set_NZ_condition(result);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-// bitwise negation register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_mvn_reg_s(struct uop *op) 
-{
-	word b;
-	word result;
-
-	b = get_reg(op->simple_dp_reg.source2_reg);
-	result = ~b;
-
-	set_NZ_condition(result);
-	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_DATA_PROC);
-#endif
-}
-
-static inline __ALWAYS_INLINE void uop_multiply(struct uop *op) 
-{
-	// multiply the first two operands
-	word temp_word = get_reg(op->mul.source_reg);
-	word temp_word2 = get_reg(op->mul.source2_reg) * temp_word;
-
-	// add a third one conditionally
-	if(op->flags & UOPMULFLAGS_ACCUMULATE)
-		temp_word2 += get_reg(op->mul.accum_reg);
-
-	// store the result
-	put_reg(op->mul.dest_reg, temp_word2);
-
-	// set the NZ bits on exit
-	if(op->flags & UOPMULFLAGS_S_BIT)
-		set_NZ_condition(temp_word2);
-
-#if COUNT_CYCLES
-	// cycle count
-	if(get_core() <= ARM9) {
-		int signed_word = temp_word;
-
-		if ((signed_word >> 8) == 0 || (signed_word >> 8) == -1)
-			add_to_perf_counter(CYCLE_COUNT, 1);
-		else if ((signed_word >> 16) == 0 || (signed_word >> 16) == -1)
-			add_to_perf_counter(CYCLE_COUNT, 2);
-		else if ((signed_word >> 24) == 0 || (signed_word >> 24) == -1)
-			add_to_perf_counter(CYCLE_COUNT, 3);
-	} else /* if(get_core() == ARM9e) */ {
-		/* ARM9e core can do the multiply in 2 cycles, with an interlock */
-		add_to_perf_counter(CYCLE_COUNT, 1);
-		// XXX schedule interlock here
-	}
-#endif
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_MUL);
-#endif
+	// already decoded, the opcode check will sort it out
+	return TRUE;
 }
 
-static inline __ALWAYS_INLINE void uop_multiply_long(struct uop *op) 
+/*
+ * peephole pass, run right after a uop is decoded. if it starts one of the
+ * common pairs, rewrite it into a fused uop that does both. the second slot
+ * is left holding its own uop so branches into the middle of the pair still work.
+ */
+static void uop_peephole(struct uop *op)
 {
-	word reslo, reshi;
-	uint64_t result;
+	struct uop *next;
 
-	// get the first two operands
-	word temp_word = get_reg(op->mull.source_reg);
-	word temp_word2 = get_reg(op->mull.source2_reg);
+	if(op->cond != COND_AL)
+		return;
 
-	// signed or unsigned multiply
-	// XXX is this correct
-	if(op->flags & UOPMULFLAGS_SIGNED) {
-		result = (int64_t)(int)temp_word * (int)temp_word2;
-	} else {
-		result = (uint64_t)temp_word * temp_word2;
-	}
+	switch(op->opcode) {
+		case CMP_IMM_S:
+		case CMP_REG_S: {
+			if(!uop_next_may_fuse(op, B_IMMEDIATE_LOCAL))
+				return;
+			next = uop_peek_next(op);
+			if(next->opcode != B_IMMEDIATE_LOCAL || (next->flags & UOPBFLAGS_LINK))
+				return;
 
-	// accumulate
-	if(op->flags & UOPMULFLAGS_ACCUMULATE) {
-		uint64_t acc = get_reg(op->mull.desthi_reg);
-		acc = (acc << 32) | get_reg(op->mull.destlo_reg);
-		result += acc;
-	}
+			word target = next->b_immediate.target;
+			byte branch_cond = next->cond;
+			if(op->opcode == CMP_IMM_S) {
+				word immediate = op->simple_dp_imm.immediate;
+				byte source_reg = op->simple_dp_imm.source_reg;
 
-	// store the results
-	reslo = result;
-	reshi = result >> 32;
-	put_reg(op->mull.destlo_reg, reslo);
-	put_reg(op->mull.desthi_reg, reshi);
+				op->opcode = CMP_IMM_BCC_LOCAL;
+				op->cmp_bcc.immediate = immediate;
+				op->cmp_bcc.source_reg = source_reg;
+			} else {
+				byte source_reg = op->simple_dp_reg.source_reg;
+				byte source2_reg = op->simple_dp_reg.source2_reg;
 
-	// set the NZ bits on exit
-	if(op->flags & UOPMULFLAGS_S_BIT) {
-		set_condition(PSR_CC_NEG, BIT(reshi, 31));
-		set_condition(PSR_CC_ZERO, (reslo | reshi) == 0);
-	}
+				op->opcode = CMP_REG_BCC_LOCAL;
+				op->cmp_bcc.source_reg = source_reg;
+				op->cmp_bcc.source2_reg = source2_reg;
+			}
+			op->cmp_bcc.target_offset = target % MMU_PAGESIZE;
+			op->flags = branch_cond | (next->flags & UOPBFLAGS_IDLE_POLL);
+			break;
+		}
+		case MOV_IMM: {
+			if(!uop_next_may_fuse(op, MOV_IMM))
+				return;
+			next = uop_peek_next(op);
+			if(next->opcode != MOV_IMM || next->cond != COND_AL)
+				return;
 
-#if COUNT_CYCLES
-	// cycle count
-	if(get_core() <= ARM9) {
-		if ((temp_word >> 8) == 0)
-			add_to_perf_counter(CYCLE_COUNT, 2);
-		else if ((temp_word >> 16) == 0)
-			add_to_perf_counter(CYCLE_COUNT, 3);
-		else if ((temp_word >> 24) == 0)
-			add_to_perf_counter(CYCLE_COUNT, 4);
-	} else /* if(get_core() == ARM9e) */ {
-		/* ARM9e core can do the multiply in 3 cycles, with an interlock */
-		add_to_perf_counter(CYCLE_COUNT, 2);
-		// XXX schedule interlock here
-	}
-#endif
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_MUL);
-#endif
-}
+			word immediate = op->simple_dp_imm.immediate;
+			byte dest_reg = op->simple_dp_imm.dest_reg;
 
-static inline __ALWAYS_INLINE void uop_swap(struct uop *op)
-{
-	word mem_reg_val, source_reg_val;
-	armaddr_t addr;
-
-	ASSERT_VALID_REG(op->swp.dest_reg);
-	ASSERT_VALID_REG(op->swp.source_reg);
-	ASSERT_VALID_REG(op->swp.mem_reg);
-
-	source_reg_val = get_reg(op->swp.source_reg);
-	mem_reg_val = get_reg(op->swp.mem_reg);
-
-	addr = mem_reg_val & 0xfffffffc;
-
-	if(!op->swp.b) {
-		word temp;
-		if(mmu_read_mem_word(addr, &temp))
-			return; // data abort
-
-		// simulate the weird unaligned access behavior
-		switch(mem_reg_val & 0x3) {
-			default:
-			case 0:
-				break;
-			case 1:
-				temp = ROR(temp, 8);
-				break;
-			case 2:
-				temp = ROR(temp, 16);
-				break;
-			case 3:
-				temp = ROR(temp, 24);
-				break;
+			op->opcode = MOV_IMM_PAIR;
+			op->mov_imm_pair.immediate = immediate;
+			op->mov_imm_pair.immediate2 = next->simple_dp_imm.immediate;
+			op->flags = dest_reg | (next->simple_dp_imm.dest_reg << 4);
+			break;
 		}
-
-		// do the swap
-		if(mmu_write_mem_word(addr, source_reg_val))
-			return; // data abort
-		put_reg(op->swp.dest_reg, temp);
-	} else {
-		// byte version
-		byte temp;
-		if(mmu_read_mem_byte(addr, &temp))
-			return; // data abort
-		if(mmu_write_mem_byte(addr, source_reg_val))
-			return; // data abort
-		put_reg(op->swp.dest_reg, temp);
+		default:
+			return;
 	}
-}
-
-static inline __ALWAYS_INLINE void uop_count_leading_zeros(struct uop *op)
-{
-	word val;
-	int count;
-
-	ASSERT_VALID_REG(op->count_leading_zeros.source_reg);
-	ASSERT_VALID_REG(op->count_leading_zeros.dest_reg);
-
-	// get the value we're supposed to count
-	val = get_reg(op->count_leading_zeros.source_reg);
-	
-	count = clz(val);
-	
-	// put the result back
-	put_reg(op->count_leading_zeros.dest_reg, count);
-
-	// XXX cycle count, or is it always 1 cycle?
 
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_MISC);
+	UOP_TRACE(6, "peephole: fused %s at pc 0x%x\n", uop_opcode_to_str(op->opcode), cpu.pc);
+#if COUNT_FUSIONS
+	inc_perf_counter(FUSION_BASE + op->opcode - FIRST_FUSED_OPCODE);
 #endif
 }
-
-static inline __ALWAYS_INLINE void uop_move_to_sr_imm(struct uop *op) 
-{
-	reg_t old_psr, new_psr;
-
-	if(op->flags & UOPMSR_R_BIT) {
-		// spsr
-		old_psr = cpu.spsr;
-	} else {
-		// cpsr
-		old_psr = cpu.cpsr;
-	}
-	
-	word field_mask = op->move_to_sr_imm.field_mask;
-	
-	// if we're in user mode, we can only modify the top 8 bits
-	if(!arm_in_priviledged())
-		field_mask &= 0xff000000;
-
-	// or in the new immediate value
-	new_psr = (old_psr & ~field_mask) | (op->move_to_sr_imm.immediate & field_mask);
-
-	// write the new value back
-	if(op->flags & UOPMSR_R_BIT) {
-		// spsr
-		// NOTE: UNPREDICTABLE if the cpu is in user or system mode
-		cpu.spsr = new_psr;
-	} else {
-		// cpsr
-		set_cpu_mode(new_psr & PSR_MODE_MASK);
-		cpu.cpsr = new_psr;
-
-#if COUNT_CYCLES
-		// cycle count
-		if(field_mask & 0x00ffffff)
-			add_to_perf_counter(CYCLE_COUNT, 2); // we updated something other than the status flags
-#endif
-	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_MISC);
 #endif
-}
 
-static inline __ALWAYS_INLINE void uop_move_to_sr_reg(struct uop *op) 
+void uop_decode_arm(struct uop *op)
 {
-	reg_t old_psr, new_psr;
-
-	if(op->flags & UOPMSR_R_BIT) {
-		// spsr
-		old_psr = cpu.spsr;
-	} else {
-		// cpsr
-		old_psr = cpu.cpsr;
-	}
-	
-	word field_mask = op->move_to_sr_imm.field_mask;
-	word temp_word = get_reg(op->move_to_sr_reg.reg);
-	
-	// if we're in user mode, we can only modify the top 8 bits
-	if(!arm_in_priviledged())
-		field_mask &= 0xff000000;
-
-	// or in the new immediate value
-	new_psr = (old_psr & ~field_mask) | (temp_word & field_mask);
-
-	// write the new value back
-	if(op->flags & UOPMSR_R_BIT) {
-		// spsr
-		// NOTE: UNPREDICTABLE if the cpu is in user or system mode
-		cpu.spsr = new_psr;
+	if(uop_take_predecoded(cpu.curr_cp, op)) {
+		inc_perf_counter(INS_PREDECODED);
 	} else {
-		// cpsr
-		set_cpu_mode(new_psr & PSR_MODE_MASK);
-		cpu.cpsr = new_psr;
-
-#if COUNT_CYCLES
-		// cycle count
-		if(field_mask & 0x00ffffff)
-			add_to_perf_counter(CYCLE_COUNT, 2); // we updated something other than the status flags
-#endif
+		uop_fetch_raw(cpu.curr_cp, op);
+		UOP_TRACE(6, "decoding arm opcode 0x%08x at pc 0x%x\n", op->undecoded.raw_instruction, cpu.pc);
+		arm_decode_into_uop(op);
+		inc_perf_counter(INS_DECODE);
 	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_MISC);
+	uop_mark_idle_branch(op);
+#if UOP_FUSION
+	uop_peephole(op);
 #endif
+	uop_finish_decode(op);
+	cpu.curr_cp->decodes++;
 }
 
-static inline __ALWAYS_INLINE void uop_move_from_sr(struct uop *op) 
+void uop_decode_thumb(struct uop *op)
 {
-	if(op->flags & UOPMSR_R_BIT) {
-		// NOTE: UNPREDICTABLE if the cpu is in user or system mode
-		put_reg(op->move_from_sr.reg, cpu.spsr);
+	if(uop_take_predecoded(cpu.curr_cp, op)) {
+		inc_perf_counter(INS_PREDECODED);
 	} else {
-		put_reg(op->move_from_sr.reg, cpu.cpsr);
+		uop_fetch_raw(cpu.curr_cp, op);
+		UOP_TRACE(6, "decoding thumb opcode 0x%04x at pc 0x%x\n", op->undecoded.raw_instruction, cpu.pc);
+		thumb_decode_into_uop(op);
+		inc_perf_counter(INS_DECODE);
 	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_MISC);
-#endif
-#if COUNT_CYCLES
-	// 2 cycles on arm9+
-	if(get_core() >= ARM9)
-		add_to_perf_counter(CYCLE_COUNT, 1);
+	uop_mark_idle_branch(op);
+#if UOP_FUSION
+	uop_peephole(op);
 #endif
+	uop_finish_decode(op);
+	cpu.curr_cp->decodes++;
 }
 
+/* instrumentation levels, each its own copy of the dispatch loop */
+static const struct uop_variant * const uop_variants[MAX_UOP_INSTRUMENTATION] = {
+	[UOP_INSTRUMENTATION_BARE] = &uop_variant_bare,
+	[UOP_INSTRUMENTATION_ICOUNT] = &uop_variant_icount,
+	[UOP_INSTRUMENTATION_CYCLES] = &uop_variant_cycles,
+	[UOP_INSTRUMENTATION_FULL] = &uop_variant_full,
+};
 
-static inline __ALWAYS_INLINE void uop_undefined(struct uop *op) 
-{
-	atomic_or(&cpu.pending_exceptions, EX_UNDEFINED);
-	
-//	UOP_TRACE(0, "undefined instruction at 0x%x\n", get_reg(PC));
-
-#if COUNT_CYCLES
-	if(get_core() == ARM7)
-		add_to_perf_counter(CYCLE_COUNT, 3);
-	else /* if(get_core() >= ARM9) */
-		add_to_perf_counter(CYCLE_COUNT, 2);
+#if WITH_JIT
+__thread const uop_handler_func *uop_handler_funcs;
 #endif
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_MISC);
-#endif
-}
 
-static inline __ALWAYS_INLINE void uop_swi(struct uop *op) 
+enum uop_instrumentation uop_get_instrumentation(void)
 {
-	atomic_or(&cpu.pending_exceptions, EX_SWI);
-
-	// always takes 3 cycles
-#if COUNT_CYCLES
-	add_to_perf_counter(CYCLE_COUNT, 2);
-#endif
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_MISC);
-#endif
+	return cpu.instrumentation;
 }
 
-static inline __ALWAYS_INLINE void uop_bkpt(struct uop *op) 
+/*
+ * switch to a different dispatch loop. it takes effect at the end of the current
+ * basic block, when the running loop returns to uop_dispatch_loop.
+ */
+void uop_set_instrumentation(enum uop_instrumentation level)
 {
-	atomic_or(&cpu.pending_exceptions, EX_PREFETCH);
+	int i;
 
-	// always takes 3 cycles
-#if COUNT_CYCLES
-	add_to_perf_counter(CYCLE_COUNT, 2);
-#endif
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_MISC);
-#endif
-}
+	if(level >= MAX_UOP_INSTRUMENTATION)
+		return;
 
-static inline __ALWAYS_INLINE void uop_coproc_reg_transfer(struct uop *op) 
-{
-	struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
+	// it's a property of the whole machine, every core switches over
+	for(i = 0; i < cpu.cluster->num_cores; i++) {
+		struct cpu_struct *core = cpu.cluster->cores[i];
 
-	if(cp->installed) {
-		cp->reg_transfer(op->coproc.raw_instruction, cp->data);
-	} else {
-		/* coprocessor not present, same as an undefined instruction */
-		uop_undefined(op);
+		if((int)level != core->instrumentation) {
+			core->instrumentation = level;
+			core->restart_dispatch = TRUE;
+			cpu_request_event(core);
+			cpu_wake(core);
+		}
 	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_COP_REG_TRANS);
-#endif
 }
 
-static inline __ALWAYS_INLINE void uop_coproc_double_reg_transfer(struct uop *op) 
+/* the trace levels that need the trace dispatch loop */
+static bool uop_tracing(void)
 {
-	struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
-
-	if(cp->installed) {
-		cp->double_reg_transfer(op->coproc.raw_instruction, cp->data);
-	} else {
-		/* coprocessor not present, same as an undefined instruction */
-		uop_undefined(op);
-	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_COP_REG_TRANS);
-#endif
+	return TRACE_UOP_LEVEL >= 7 || TRACE_CPU_LEVEL >= 10;
 }
 
-static inline __ALWAYS_INLINE void uop_coproc_data_processing(struct uop *op) 
+/* the trace levels are global, so every core has a look at whether it's running the right loop */
+void uop_trace_levels_changed(void)
 {
-	struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
-
-	if(cp->installed) {
-		cp->data_processing(op->coproc.raw_instruction, cp->data);
-	} else {
-		/* coprocessor not present, same as an undefined instruction */
-		uop_undefined(op);
-	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_COP_DATA_PROC);
-#endif
-}
+	int i;
 
-static inline __ALWAYS_INLINE void uop_coproc_load_store(struct uop *op) 
-{
-	struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
+	for(i = 0; i < cpu.cluster->num_cores; i++) {
+		struct cpu_struct *core = cpu.cluster->cores[i];
 
-	if(cp->installed) {
-		cp->load_store(op->coproc.raw_instruction, cp->data);
-	} else {
-		/* coprocessor not present, same as an undefined instruction */
-		uop_undefined(op);
+		core->restart_dispatch = TRUE;
+		cpu_request_event(core);
+		cpu_wake(core);
 	}
-
-#if COUNT_ARM_OPS
-	inc_perf_counter(OP_COP_LOAD_STORE);
-#endif
 }
 
 int uop_dispatch_loop(void)
 {
 	process_pending_exceptions();
 
-	/* main dispatch loop */
 	for(;;) {
-		struct uop *op;
-
-		UOP_TRACE(10, "\nUOP: start of new cycle\n");
-
-		// in the last instruction we wrote something else into r[PC], so sync it with
-		// the real program counter cpu.pc
-		if(unlikely(cpu.r15_dirty)) {
-			UOP_TRACE(9, "UOP: r15 dirty\n");
-			cpu.r15_dirty = FALSE;
-
-			if(cpu.curr_cp) {
-				if((cpu.pc >> MMU_PAGESIZE_SHIFT) == (cpu.r[PC] >> MMU_PAGESIZE_SHIFT)) {
-					cpu.cp_pc = PC_TO_CPPC(cpu.r[PC]);
-				} else {
-					cpu.curr_cp = NULL; // will load a new codepage in a few lines
-				}
-			}
-			cpu.pc = cpu.r[PC];
-		}
-
-		// check for exceptions
-		if(unlikely(cpu.pending_exceptions != 0)) {
-			// something may be pending
-			if(cpu.pending_exceptions & ~(cpu.cpsr & (PSR_IRQ_MASK|PSR_FIQ_MASK))) {
-				if(process_pending_exceptions())
-					continue;
-			}
-		}
-
-		/* see if we are off the end of a codepage, or the codepage was removed out from underneath us */
-		if(unlikely(cpu.curr_cp == NULL)) {
-			UOP_TRACE(7, "UOP: curr_cp == NULL, setting new codepage\n");
-			if(set_codepage(cpu.pc))
-				continue; // MMU translation error reading it
-		}
-
-		ASSERT(cpu.curr_cp != NULL);
-		ASSERT(cpu.cp_pc != NULL);
-
-		// instruction count
-		inc_perf_counter(INS_COUNT);
-#if COUNT_CYCLES
-		inc_perf_counter(CYCLE_COUNT);
-#endif
+		const struct uop_variant *variant;
 
-		/* get the next op and dispatch it */
-		op = cpu.cp_pc;
-		UOP_TRACE(8, "UOP: opcode %3d %32s, pc 0x%x, cp_pc %p, curr_cp %p\n", op->opcode, uop_opcode_to_str(op->opcode), cpu.pc, cpu.cp_pc, cpu.curr_cp);
-#if COUNT_UOPS
-		inc_perf_counter(UOP_BASE + op->opcode);
-#endif
+		// stop_cpu sets stopping before restart_dispatch, so clear first and then look
+		cpu.restart_dispatch = FALSE;
+		if(cpu.cluster->stopping)
+			break;
+		if(cpu.cluster->rendezvous)
+			cpu_rendezvous_arrive();
+
+		if(uop_tracing())
+			variant = &uop_variant_trace;
+		else if(cpu.btrace)
+			variant = &uop_variant_record;
+		else if(cpu.cover_map)
+			variant = &uop_variant_cover;
+		else
+			variant = uop_variants[cpu.instrumentation];
+		UOP_TRACE(1, "uop: running the %s dispatch loop\n", variant->name);
 
-		/* increment the program counter */
-		int pc_inc = cpu.curr_cp->pc_inc;
-		cpu.pc += pc_inc; // next pc
-		cpu.r[PC] = cpu.pc + pc_inc; // during the course of the instruction, r15 looks like it's +8 or +4 (arm vs thumb)
-		cpu.cp_pc++;
-
-		if(TRACE_CPU_LEVEL >= 10 
-		   && op->opcode != DECODE_ME_ARM 
-		   && op->opcode != DECODE_ME_THUMB)
-			dump_cpu();
-
-		/* check to see if we should execute it */
-		if(unlikely(!check_condition(op->cond))) {
-			UOP_TRACE(8, "UOP: opcode not executed due to condition 0x%x\n", op->cond);
-#if COUNT_ARM_OPS
-			inc_perf_counter(OP_SKIPPED_CONDITION);
+		/*
+		 * the decoded uops and any translated code refer to the handlers of the
+		 * loop they were made for, so start over with a clean slate
+		 */
+		flush_all_codepages();
+#if WITH_JIT
+		uop_handler_funcs = variant->handler_funcs;
+		jit_native_ops = !variant->counts_ops;
 #endif
-			continue; // not executed
-		}
 
-		/* dispatch */
-		switch(op->opcode) {
-			case NOP:
-#if COUNT_ARM_OPS
-				inc_perf_counter(OP_NOP);
-#endif
-				break;
-			case DECODE_ME_ARM:
-				uop_decode_me_arm(op);
-				break;
-			case DECODE_ME_THUMB:
-				uop_decode_me_thumb(op);
-				break;
-			case B_IMMEDIATE: 
-				uop_b_immediate(op);
-				break;
-			case B_IMMEDIATE_LOCAL: 
-				uop_b_immediate_local(op);
-				break;
-			case B_REG:
-				uop_b_reg(op);
-				break;
-			case B_REG_OFFSET:
-				uop_b_reg_offset(op);
-				break;
-			case LOAD_IMMEDIATE_WORD:
-				uop_load_immediate_word(op);
-				break;
-			case LOAD_IMMEDIATE_HALFWORD:
-				uop_load_immediate_halfword(op);
-				break;
-			case LOAD_IMMEDIATE_BYTE: 
-				uop_load_immediate_byte(op);
-				break;
-			case LOAD_IMMEDIATE_OFFSET:
-				uop_load_immediate_offset(op);
-				break;
-			case LOAD_SCALED_REG_OFFSET:
-				uop_load_scaled_reg_offset(op);
-				break;
-			case STORE_IMMEDIATE_OFFSET:
-				uop_store_immediate_offset(op);
-				break;
-			case STORE_SCALED_REG_OFFSET:
-				uop_store_scaled_reg_offset(op);
-				break;
-			case LOAD_MULTIPLE:			// simple multiple load, no S bit
-				uop_load_multiple(op);
-				break;
-			case LOAD_MULTIPLE_S:				// multiple load, with S bit
-				uop_load_multiple_s(op);
-				break;
-			case STORE_MULTIPLE:			// simple multiple store, no S bit
-				uop_store_multiple(op);
-				break;
-			case STORE_MULTIPLE_S:		// multiple store with S bit
-				uop_store_multiple_s(op);
-				break;
-			case DATA_PROCESSING_IMM:		// plain instruction, no barrel shifter, no condition flag update, immediate operand
-				uop_data_processing_imm(op);
-				break;
-			case DATA_PROCESSING_REG:		// plain instruction, no barrel shifter, no condition flag update, no writeback, register operand
-				uop_data_processing_reg(op);
-				break;
-			case DATA_PROCESSING_IMM_S:	// same as above but S bit set, update condition flags, writeback conditional on op
-				uop_data_processing_imm_s(op);
-				break;
-			case DATA_PROCESSING_REG_S:	// same as above but S bit set, update condition flags, writeback conditional on op
-				uop_data_processing_reg_s(op);
-				break;
-			case DATA_PROCESSING_IMM_SHIFT: // barrel shifter involved, immediate operands to shifter, S bit may apply
-				uop_data_processing_imm_shift(op);
-				break;
-			case DATA_PROCESSING_REG_SHIFT:	// barrel shifter involved, register operands to shifter, S bit may apply
-				uop_data_processing_reg_shift(op);
-				break;
-			case MOV_IMM: // move immediate value into register
-				uop_mov_imm(op);
-				break;
-			case MOV_IMM_NZ: // move immediate value into register, set NZ condition
-				uop_mov_imm_nz(op);
-				break;
-			case MOV_REG: // move one register to another
-				uop_mov_reg(op);
-				break;
-			case CMP_IMM_S: // compare with immediate, set full conditions
-				uop_cmp_imm_s(op);
-				break;
-			case CMP_REG_S: // compare with another register, set full conditions
-				uop_cmp_reg_s(op);
-				break;
-			case CMN_REG_S:
-				uop_cmn_reg_s(op);
-				break;
-			case TST_REG_S:
-				uop_tst_reg_s(op);
-				break;
-			case ADD_IMM: // add a value to a register and store it into another register
-				uop_add_imm(op);
-				break;
-			case ADD_IMM_S: // add a value to a register and store it into another register, set condition flags
-				uop_add_imm_s(op);
-				break;
-			case ADD_REG: // add two registers and store in a third
-				uop_add_reg(op);
-				break;
-			case ADD_REG_S: // add two registers and store in a third, set condition flags
-				uop_add_reg_s(op);
-				break;
-			case ADC_REG_S:
-				uop_adc_reg_s(op);
-				break;
-			case SUB_REG_S: // add two registers and store in a third, set condition flags
-				uop_sub_reg_s(op);
-				break;
-			case SBC_REG_S:
-				uop_sbc_reg_s(op);
-				break;
-			case AND_IMM:
-				uop_and_imm(op);
-				break;
-			case ORR_IMM:
-				uop_orr_imm(op);
-				break;			
-			case ORR_REG_S:
-				uop_orr_reg_s(op);
-				break;			
-			case LSL_IMM:	// logical left shift by immediate
-				uop_lsl_imm(op);
-				break;
-			case LSL_IMM_S:	// logical left shift by immediate, sets full conditions
-				uop_lsl_imm_s(op);
-				break;
-			case LSL_REG:	// logical left shift by register
-				uop_lsl_reg(op);
-				break;
-			case LSL_REG_S:	// logical left shift by register, sets full conditions
-				uop_lsl_reg_s(op);
-				break;
-			case LSR_IMM:	// logical right shift by immediate
-				uop_lsr_imm(op);
-				break;
-			case LSR_IMM_S:	// logical right shift by immediate, sets full conditions
-				uop_lsr_imm_s(op);
-				break;
-			case LSR_REG:	// logical right shift by register
-				uop_lsr_reg(op);
-				break;
-			case LSR_REG_S:	// logical right shift by register, sets full conditions
-				uop_lsr_reg_s(op);
-				break;
-			case ASR_IMM:	// arithmetic right shift by immediate
-				uop_asr_imm(op);
-				break;
-			case ASR_IMM_S:	// arithmetic right shift by immediate, sets full conditions
-				uop_asr_imm_s(op);
-				break;
-			case ASR_REG:	// arithmetic right shift by register
-				uop_asr_reg(op);
-				break;
-			case ASR_REG_S:	// arithmetic right shift by register, sets full conditions
-				uop_asr_reg_s(op);
-				break;
-			case ROR_REG:	// rotate right by register
-				uop_ror_reg(op);
-				break;
-			case ROR_REG_S:	// rotate right by register, sets full conditions
-				uop_ror_reg_s(op);
-				break;
-			case AND_REG_S:
-				uop_and_reg_s(op);
-				break;			
-			case EOR_REG_S:
-				uop_eor_reg_s(op);
-				break;			
-			case BIC_REG_S:
-				uop_bic_reg_s(op);
-				break;			
-			case NEG_REG_S:
-				uop_neg_reg_s(op);
-				break;			
-			case MVN_REG_S:
-				uop_mvn_reg_s(op);
-				break;			
-			case MULTIPLY:
-				uop_multiply(op);
-				break;
-			case MULTIPLY_LONG:
-				uop_multiply_long(op);
-				break;
-			case SWAP:
-				uop_swap(op);
-				break;
-		    case COUNT_LEADING_ZEROS:
-				uop_count_leading_zeros(op);
-				break;
-			case MOVE_TO_SR_IMM:
-				uop_move_to_sr_imm(op);
-				break;
-			case MOVE_TO_SR_REG:
-				uop_move_to_sr_reg(op);
-				break;
-			case MOVE_FROM_SR:
-				uop_move_from_sr(op);
-				break;
-			case UNDEFINED:
-				uop_undefined(op);
-				break;
-			case SWI:
-				uop_swi(op);
-				break;
-			case BKPT:
-				uop_bkpt(op);
-				break;
-			case COPROC_REG_TRANSFER:
-				uop_coproc_reg_transfer(op);
-				break;
-			case COPROC_DOUBLE_REG_TRANSFER:
-				uop_coproc_double_reg_transfer(op);
-				break;
-			case COPROC_DATA_PROCESSING:
-				uop_coproc_data_processing(op);
-				break;
-			case COPROC_LOAD_STORE:
-				uop_coproc_load_store(op);
-				break;
-			default:
-				panic_cpu("bad uop decode, bailing...\n");
-		}
+		// have a look at whatever came in while the last loop was on its way out
+		cpu_request_event(&cpu);
+		variant->dispatch_loop();
 	}
 
 	return 0;
 }
-
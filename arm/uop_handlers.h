@@ -0,0 +1,3200 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The uop handlers and the dispatch loop. This gets compiled once per level of
+ * instrumentation (see uop_variant_*.c), each with its own set of UOP_COUNT_*
+ * switches, so the uninstrumented loops have no counter code in them at all.
+ * The includer defines UOP_VARIANT, UOP_VARIANT_NAME and the UOP_COUNT_* switches.
+ * UOP_TRACE_UOPS compiles in the per uop and per block traces, only the trace
+ * variant has it so the others don't test a trace level on every uop.
+ * UOP_RECORD writes the binary trace records, see btrace.c, for the record variant.
+ * UOP_COVER counts edges into the coverage map at the branches, for the cover variant.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <debug.h>
+#include <options.h>
+#include <arm/arm.h>
+#include <arm/decoder.h>
+#include <arm/jit.h>
+#include <sys/semihost.h>
+#include <util/atomic.h>
+#include <util/endian.h>
+#include <util/math.h>
+#include "uop_p.h"
+
+#ifndef UOP_TRACE_UOPS
+#define UOP_TRACE_UOPS 0
+#endif
+#ifndef UOP_RECORD
+#define UOP_RECORD 0
+#endif
+#ifndef UOP_COVER
+#define UOP_COVER 0
+#endif
+
+#if UOP_RECORD
+#include <arm/btrace.h>
+#endif
+
+#if UOP_TRACE_UOPS
+#define UOP_HOT_TRACE(level, x...) UOP_TRACE(level, x)
+#else
+#define UOP_HOT_TRACE(level, x...) do { } while(0)
+#endif
+
+/*
+ * afl style edge coverage: the map entry for the branch at from (the pc past it)
+ * going to target goes up. only taken branches and writes to the pc get here, so
+ * nothing off the branch path pays for it, and one that isn't taken still shows
+ * as the next taken branch being a different one.
+ */
+static inline __ALWAYS_INLINE void uop_cover_edge(armaddr_t from, armaddr_t target)
+{
+#if UOP_COVER
+	uint32_t from_loc = (from * 0x9e3779b1) >> (32 - COVER_MAP_SHIFT);
+	uint32_t target_loc = (target * 0x9e3779b1) >> (32 - COVER_MAP_SHIFT);
+
+	cpu.cover_map[(from_loc >> 1) ^ target_loc]++;
+#endif
+}
+
+#define ASSERT_VALID_REG(x) ASSERT((x) < 16);
+
+#define DATA_PROCESSING_OP_TABLE(opcode, result, a, b, arith_op, Rd_writeback, carry, ovl) \
+	switch(opcode) { \
+		case AOP_AND: /* AND */ \
+			result = a & b; \
+			break; \
+		case AOP_EOR: /* EOR */ \
+			result = a ^ b; \
+			break; \
+		case AOP_SUB: /* SUB */ \
+			result = do_add(a, ~b, 1, &carry, &ovl); \
+			arith_op = 1; \
+			break; \
+		case AOP_RSB: /* RSB */ \
+			result = do_add(b, ~a, 1, &carry, &ovl); \
+			arith_op = 1; \
+			break; \
+		case AOP_ADD: /* ADD */ \
+			result = do_add(a, b, 0, &carry, &ovl); \
+			arith_op = 1; \
+			break; \
+		case AOP_ADC: /* ADC */ \
+			result = do_add(a, b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl); \
+			arith_op = 1; \
+			break; \
+		case AOP_SBC: /* SBC */ \
+			result = do_add(a, ~b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl); \
+			arith_op = 1; \
+			break; \
+		case AOP_RSC: /* RSC */ \
+			result = do_add(b, ~a, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl); \
+			arith_op = 1; \
+			break; \
+		case AOP_TST: /* TST */ \
+			result = a & b; \
+			Rd_writeback = 0; \
+			break; \
+		case AOP_TEQ: /* TEQ */ \
+			result = a ^ b; \
+			Rd_writeback = 0; \
+			break; \
+		case AOP_CMP: /* CMP */ \
+			result = do_add(a, ~b, 1, &carry, &ovl); \
+			Rd_writeback = 0; \
+			arith_op = 1; \
+			break; \
+		case AOP_CMN: /* CMN */ \
+			result = do_add(a, b, 0, &carry, &ovl); \
+			Rd_writeback = 0; \
+			arith_op = 1; \
+			break; \
+		case AOP_ORR: /* ORR */ \
+			result = a | b; \
+			break; \
+		case AOP_MOV: /* MOV */ \
+			result = b; \
+			break; \
+		case AOP_BIC: /* BIC */ \
+			result = a & (~b); \
+			break; \
+		case AOP_MVN: /* MVN */ \
+			result = ~b; \
+			break; \
+	}
+
+#define DATA_PROCESSING_OP_TABLE_NOFLAGS(opcode, result, a, b) \
+	switch(opcode) { \
+		case AOP_AND: /* AND */ \
+			result = a & b; \
+			break; \
+		case AOP_EOR: /* EOR */ \
+			result = a ^ b; \
+			break; \
+		case AOP_SUB: /* SUB */ \
+			result = a - b; \
+			break; \
+		case AOP_RSB: /* RSB */ \
+			result = b - a; \
+			break; \
+		case AOP_ADD: /* ADD */ \
+			result = a + b; \
+			break; \
+		case AOP_ADC: /* ADC */ \
+			result = a + b + (get_condition(PSR_CC_CARRY) ? 1 : 0); \
+			break; \
+		case AOP_SBC: /* SBC */ \
+			result = a + ~b + (get_condition(PSR_CC_CARRY) ? 1: 0); \
+			break; \
+		case AOP_RSC: /* RSC */ \
+			result = b + ~a + (get_condition(PSR_CC_CARRY) ? 1: 0); \
+			break; \
+		case AOP_TST: /* TST */ \
+			result = a & b; \
+			break; \
+		case AOP_TEQ: /* TEQ */ \
+			result = a ^ b; \
+			break; \
+		case AOP_CMP: /* CMP */ \
+			result = a - b; \
+			break; \
+		case AOP_CMN: /* CMN */ \
+			result = a + b; \
+			break; \
+		case AOP_ORR: /* ORR */ \
+			result = a | b; \
+			break; \
+		case AOP_MOV: /* MOV */ \
+			result = b; \
+			break; \
+		case AOP_BIC: /* BIC */ \
+			result = a & (~b); \
+			break; \
+		case AOP_MVN: /* MVN */ \
+			result = ~b; \
+			break; \
+	}
+
+
+/*
+ * the dispatcher counts every slot it runs as an instruction. take it back for the ones
+ * that aren't, so the counts and guest time don't depend on what had to be decoded.
+ */
+static inline __ALWAYS_INLINE void uop_uncount_ins(void)
+{
+	cpu.guest_time--;
+#if UOP_COUNT_INS
+	add_to_perf_counter(INS_COUNT, -1);
+#endif
+#if UOP_COUNT_CYCLES
+	add_to_perf_counter(CYCLE_COUNT, -1);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_decode_me_arm(struct uop *op) 
+{
+	// call the arm decoder and set the pc back to retry this instruction
+	ASSERT(cpu.cp_pc != NULL);
+	uop_decode_arm(op);
+	cpu.pc -= 4; // back the instruction pointer up to retry this instruction
+	cpu.cp_pc--;
+	uop_uncount_ins();
+}
+
+static inline __ALWAYS_INLINE void uop_decode_me_thumb(struct uop *op) 
+{
+	// call the arm decoder and set the pc back to retry this instruction
+	ASSERT(cpu.cp_pc != NULL);
+	uop_decode_thumb(op);
+	cpu.pc -= 2; // back the instruction pointer up to retry this instruction
+	cpu.cp_pc--;
+	uop_uncount_ins();
+}
+
+/* the sentinel at the end of a chunk, carry on at the same pc in the next one */
+static inline __ALWAYS_INLINE void uop_chunk_next(struct uop *op)
+{
+	// it isn't an instruction, undo what the dispatcher did for it
+	cpu.pc -= cpu.curr_cp->pc_inc;
+	cpu.cp_pc = PC_TO_CPPC(cpu.pc);
+	uop_uncount_ins();
+}
+
+/* if target is the return address of the last nonlocal call, pop it and return its codepage */
+static inline __ALWAYS_INLINE struct uop_codepage *rsb_pop(armaddr_t target, bool thumb)
+{
+	struct rsb_entry *e = &cpu.rsb[cpu.rsb_top];
+	struct uop_codepage *cp;
+
+	if(e->addr != target) {
+#if UOP_COUNT_BRANCH_CACHE
+		inc_perf_counter(RSB_MISS);
+#endif
+		return NULL;
+	}
+
+	cp = e->cp;
+	e->addr = 0xffffffff;
+	cpu.rsb_top = (cpu.rsb_top - 1) % RSB_SIZE;
+	if(cp == NULL || !codepage_matches(cp, target, thumb))
+		return NULL;
+	cp->referenced = TRUE;
+
+#if UOP_COUNT_BRANCH_CACHE
+	inc_perf_counter(RSB_HIT);
+#endif
+	return cp;
+}
+
+/*
+ * find the codepage for a nonlocal indirect branch. returns try the return stack,
+ * then the target cached at the branch site, then the codepage hash. NULL means
+ * the codepage has to be loaded.
+ */
+static inline __ALWAYS_INLINE struct uop_codepage *indirect_branch_cp(armaddr_t target, cp_handle_t *site_cp, bool is_call)
+{
+	bool thumb = get_condition(PSR_THUMB) ? TRUE : FALSE;
+	struct uop_codepage *cp;
+
+	if(!is_call) {
+		cp = rsb_pop(target, thumb);
+		if(cp)
+			return cp;
+	}
+
+	cp = handle_to_codepage(*site_cp);
+	if(likely(*site_cp != CP_HANDLE_NONE && codepage_matches(cp, target, thumb))) {
+#if UOP_COUNT_BRANCH_CACHE
+		inc_perf_counter(BRANCH_CACHE_HIT);
+#endif
+		cp->referenced = TRUE;
+		return cp;
+	}
+
+#if UOP_COUNT_BRANCH_CACHE
+	inc_perf_counter(BRANCH_CACHE_MISS);
+#endif
+	cp = find_codepage(target, thumb);
+	if(cp)
+		*site_cp = codepage_to_handle(cp);
+	return cp;
+}
+
+static inline __ALWAYS_INLINE void uop_b_immediate(struct uop *op)
+{
+	// branch to a fixed location outside of the current codepage. 
+	// Any offsets would have been resolved at decode time.
+	if(op->flags & UOPBFLAGS_LINK) {
+		int thumb = get_condition(PSR_THUMB) ? 1 : 0;
+		put_reg(LR, cpu.pc | thumb);
+		rsb_push(cpu.pc);
+	}
+
+	if(op->flags & UOPBFLAGS_SETTHUMB_ALWAYS) {
+		set_condition(PSR_THUMB, TRUE);
+		// force a codepage reload
+		cpu.curr_cp = NULL;
+	}
+	if(op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS) {
+		set_condition(PSR_THUMB, FALSE);
+		// force a codepage reload
+		cpu.curr_cp = NULL;
+	}
+
+	uop_cover_edge(cpu.pc, op->b_immediate.target);
+	cpu.pc = op->b_immediate.target;
+	struct uop_codepage *target_cp = handle_to_codepage(op->b_immediate.target_cp);
+	if(likely(op->b_immediate.target_cp != CP_HANDLE_NONE &&
+	          target_cp->address == (cpu.pc & ~(MMU_PAGESIZE-1)) &&
+	          target_cp->generation == cpu.codepage_generation)) {
+		// we have already cached a handle to the target codepage, use it
+#if UOP_COUNT_BRANCH_CACHE
+		inc_perf_counter(DIRECT_BRANCH_HIT);
+#endif
+		cpu.curr_cp = target_cp;
+		cpu.curr_cp->referenced = TRUE;
+		cpu.cp_pc = PC_TO_CPPC(cpu.pc);
+	} else {
+		// see if we can lookup the target codepage and try again
+#if UOP_COUNT_BRANCH_CACHE
+		inc_perf_counter(DIRECT_BRANCH_MISS);
+#endif
+		struct uop_codepage *cp = find_codepage(cpu.pc, get_condition(PSR_THUMB) ? TRUE : FALSE);
+		if(cp != NULL) {
+			// found one, cache it and set the code page. the lookup can't evict anything,
+			// but filling in the target's first chunk can, so this has to come first
+			op->b_immediate.target_cp = codepage_to_handle(cp);
+			cpu.curr_cp = cp;
+			cpu.cp_pc = PC_TO_CPPC(cpu.pc);
+		} else {
+			// didn't find one, force a codepage reload next instruction
+			cpu.curr_cp = NULL;
+		}
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_BRANCH);
+#endif
+#if UOP_COUNT_CYCLES
+	// all branch instructions take 3 cycles on all cores
+	add_to_perf_counter(CYCLE_COUNT, 2);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_b_immediate_local(struct uop *op)
+{
+	// branch to a fixed location within the current codepage.
+	if(op->flags & UOPBFLAGS_LINK) {
+		int thumb = get_condition(PSR_THUMB) ? 1 : 0;
+		put_reg(LR, cpu.pc | thumb);
+	}
+
+	uop_cover_edge(cpu.pc, op->b_immediate.target);
+	cpu.pc = op->b_immediate.target;
+	ASSERT(cpu.curr_cp != NULL);
+	cpu.cp_pc = PC_TO_CPPC(cpu.pc);
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_BRANCH);
+#endif
+#if UOP_COUNT_CYCLES
+	// all branch instructions take 3 cycles on all cores
+	add_to_perf_counter(CYCLE_COUNT, 2);
+#endif
+	if(unlikely(op->flags & (UOPBFLAGS_IDLE_POLL | UOPBFLAGS_IDLE_LOOP)))
+		cpu_idle_branch(op->flags);
+}
+
+static inline __ALWAYS_INLINE void uop_b_reg(struct uop *op)
+{
+	armaddr_t temp_addr;
+	armaddr_t link_addr = 0;
+	bool thumb_changed = FALSE;
+
+	temp_addr = get_reg(op->b_reg.reg);
+
+	// branch to register contents
+	if(op->flags & UOPBFLAGS_LINK) {
+		int thumb = get_condition(PSR_THUMB) ? 1 : 0;
+		link_addr = get_reg(PC) + op->b_reg.link_offset;
+		put_reg(LR, link_addr | thumb);
+	}
+
+	put_reg(PC, temp_addr & 0xfffffffe);
+
+	if(op->flags & UOPBFLAGS_SETTHUMB_ALWAYS) {
+		set_condition(PSR_THUMB, TRUE);
+		thumb_changed = TRUE;
+	}
+	if(op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS) {
+		set_condition(PSR_THUMB, FALSE);
+		thumb_changed = TRUE;
+	}
+
+	// if the bottom bit of the target address is 1, switch to thumb, otherwise switch to arm
+	if(op->flags & UOPBFLAGS_SETTHUMB_COND) {
+		bool old_condition = get_condition(PSR_THUMB) ? TRUE : FALSE;
+		bool new_condition = (temp_addr & 1) ? TRUE : FALSE;
+
+		if(old_condition != new_condition) {
+			set_condition(PSR_THUMB, new_condition);
+			thumb_changed = TRUE;
+			UOP_HOT_TRACE(7, "B_REG: setting thumb to %d (new mode)\n", new_condition);
+		}
+	}
+
+	if(!thumb_changed && (temp_addr >> MMU_PAGESIZE_SHIFT) == (cpu.pc >> MMU_PAGESIZE_SHIFT)) {
+		// it's a local branch, just recalc the position in the current codepage
+		cpu.pc = temp_addr & 0xfffffffe;
+		cpu.cp_pc = PC_TO_CPPC(cpu.pc);
+	} else {
+		// it's a remote branch, or into the other instruction set
+		if(op->flags & UOPBFLAGS_LINK)
+			rsb_push(link_addr);
+		cpu.pc = temp_addr & 0xfffffffe;
+		cpu.curr_cp = indirect_branch_cp(cpu.pc, &op->b_reg.target_cp, op->flags & UOPBFLAGS_LINK);
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_BRANCH);
+#endif
+#if UOP_COUNT_CYCLES
+	// all branch instructions take 3 cycles on all cores
+	add_to_perf_counter(CYCLE_COUNT, 2);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_b_reg_offset(struct uop *op)
+{
+	armaddr_t temp_addr;
+	armaddr_t link_addr = 0;
+	bool thumb_changed = FALSE;
+
+	temp_addr = get_reg(op->b_reg_offset.reg);
+	temp_addr += op->b_reg_offset.offset;
+
+	// branch to register contents
+	if(op->flags & UOPBFLAGS_LINK) {
+		int thumb = get_condition(PSR_THUMB) ? 1 : 0;
+		link_addr = get_reg(PC) + op->b_reg_offset.link_offset;
+		put_reg(LR, link_addr | thumb);
+	}
+
+	put_reg(PC, temp_addr & 0xfffffffe);
+
+	if(op->flags & UOPBFLAGS_SETTHUMB_ALWAYS) {
+		set_condition(PSR_THUMB, TRUE);
+		thumb_changed = TRUE;
+	}
+	if(op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS) {
+		set_condition(PSR_THUMB, FALSE);
+		thumb_changed = TRUE;
+	}
+
+	// if the bottom bit of the target address is 1, switch to thumb, otherwise switch to arm
+	if(op->flags & UOPBFLAGS_SETTHUMB_COND) {
+		bool old_condition = get_condition(PSR_THUMB) ? TRUE : FALSE;
+		bool new_condition = (temp_addr & 1) ? TRUE : FALSE;
+
+		if(old_condition != new_condition) {
+			set_condition(PSR_THUMB, new_condition);
+			thumb_changed = TRUE;
+			UOP_HOT_TRACE(7, "B_REG: setting thumb to %d (new mode)\n", new_condition);
+		}
+	}
+
+	if(!thumb_changed && (temp_addr >> MMU_PAGESIZE_SHIFT) == (cpu.pc >> MMU_PAGESIZE_SHIFT)) {
+		// it's a local branch, just recalc the position in the current codepage
+		cpu.pc = temp_addr & 0xfffffffe;
+		cpu.cp_pc = PC_TO_CPPC(cpu.pc);
+	} else {
+		// it's a remote branch, or into the other instruction set
+		if(op->flags & UOPBFLAGS_LINK)
+			rsb_push(link_addr);
+		cpu.pc = temp_addr & 0xfffffffe;
+		cpu.curr_cp = indirect_branch_cp(cpu.pc, &op->b_reg_offset.target_cp, op->flags & UOPBFLAGS_LINK);
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_BRANCH);
+#endif
+#if UOP_COUNT_CYCLES
+	// all branch instructions take 3 cycles on all cores
+	add_to_perf_counter(CYCLE_COUNT, 2);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_load_immediate_word(struct uop *op)
+{
+	word temp_word;
+
+	// a very simple load, the address is already precalculated
+	if(mmu_read_mem_word(op->load_immediate.address, &temp_word))
+		return;
+
+	// XXX on armv5 this can switch to thumb
+	put_reg(op->load_immediate.target_reg, temp_word);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_LOAD);
+#endif
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(op->load_immediate.target_reg == PC)
+		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+	else if(get_core() == ARM7)
+		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_load_immediate_halfword(struct uop *op)
+{
+	halfword temp_halfword;
+	word temp_word;
+
+	// a very simple load, the address is already precalculated
+	if(mmu_read_mem_halfword(op->load_immediate.address, &temp_halfword))
+		return;
+	temp_word = temp_halfword;
+	if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
+		temp_word = SIGN_EXTEND(temp_word, 15);
+
+	// XXX on armv5 this can switch to thumb
+	put_reg(op->load_immediate.target_reg, temp_word);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_LOAD);
+#endif
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(op->load_immediate.target_reg == PC)
+		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+	else if(get_core() == ARM7)
+		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+	else if(get_core() >= ARM9)
+		add_to_perf_counter(CYCLE_COUNT, 1); // byte and halfword loads are one cycle slower
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_load_immediate_byte(struct uop *op)
+{
+	byte temp_byte;
+	word temp_word;
+
+	// a very simple load, the address is already precalculated
+	if(mmu_read_mem_byte(op->load_immediate.address, &temp_byte))
+		return;
+	temp_word = temp_byte;
+	if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
+		temp_word = SIGN_EXTEND(temp_word, 7);
+
+	// XXX on armv5 this can switch to thumb
+	put_reg(op->load_immediate.target_reg, temp_word);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_LOAD);
+#endif
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(op->load_immediate.target_reg == PC)
+		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+	else if(get_core() == ARM7)
+		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+	else if(get_core() >= ARM9)
+		add_to_perf_counter(CYCLE_COUNT, 1); // byte and halfword loads are one cycle slower
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_load_immediate_offset(struct uop *op)
+{
+	armaddr_t temp_addr, temp_addr2, temp_addr3;
+	word temp_word = 0;
+
+	// slightly more complex, add an offset to a register
+	temp_addr2 = get_reg(op->load_store_immediate_offset.source_reg);
+	temp_addr3 = temp_addr2 + op->load_store_immediate_offset.offset;
+
+	if(op->flags & UOPLSFLAGS_POSTINDEX)
+		temp_addr = temp_addr2; // use the pre-offset computed address
+	else
+		temp_addr = temp_addr3;
+
+	// read in the difference sizes & sign extend
+	switch(op->flags & UOPLSFLAGS_SIZE_MASK) {
+		case UOPLSFLAGS_SIZE_WORD:
+			if(mmu_read_mem_word(temp_addr, &temp_word))
+				return;
+			break;
+		case UOPLSFLAGS_SIZE_HALFWORD: {
+			halfword temp_halfword;
+
+			if(mmu_read_mem_halfword(temp_addr, &temp_halfword))
+				return;
+			temp_word = temp_halfword;
+			if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
+				temp_word = SIGN_EXTEND(temp_word, 15);
+			break;
+		}
+		case UOPLSFLAGS_SIZE_BYTE: {
+			byte temp_byte;
+
+			if(mmu_read_mem_byte(temp_addr, &temp_byte))
+				return;
+			temp_word = temp_byte;
+			if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
+				temp_word = SIGN_EXTEND(temp_word, 7);
+			break;
+		}
+		case UOPLSFLAGS_SIZE_DWORD: {
+			ASSERT((op->load_store_scaled_reg_offset.target_reg & 1) == 0);
+
+			// handle the first word
+			if(mmu_read_mem_word(temp_addr, &temp_word))
+				return;
+
+			put_reg(op->load_store_scaled_reg_offset.target_reg, temp_word);
+
+			// read the second word
+			word temp_word2;
+
+			if(mmu_read_mem_word(temp_addr + 4, &temp_word2))
+				return;
+
+			// NOTE: if second register is r15, unpredictable
+			put_reg(op->load_store_scaled_reg_offset.target_reg + 1, temp_word2);
+			break;
+		}
+	}
+
+	// store the result
+	// XXX on armv5 this can switch to thumb
+	put_reg(op->load_store_immediate_offset.target_reg, temp_word);
+
+	// do writeback
+	if(op->flags & UOPLSFLAGS_WRITEBACK)
+		put_reg(op->load_store_immediate_offset.source_reg, temp_addr3);
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_LOAD);
+#endif
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(op->load_store_immediate_offset.target_reg == PC)
+		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+	else if(get_core() == ARM7)
+		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+	else if(get_core() >= ARM9 && (op->flags & UOPLSFLAGS_SIZE_MASK) != UOPLSFLAGS_SIZE_WORD)
+		add_to_perf_counter(CYCLE_COUNT, 1); // byte, halfword, and dword loads are one cycle slower
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_load_scaled_reg_offset(struct uop *op)
+{
+	armaddr_t temp_addr, temp_addr2, temp_addr3;
+	word temp_word = 0;
+
+	// pretty complex. take two registers, optionally perform a shift operation on the second one,
+	// add them together and then load that address
+	temp_addr2 = get_reg(op->load_store_scaled_reg_offset.source_reg);
+	temp_addr3 = get_reg(op->load_store_scaled_reg_offset.source2_reg);	
+	switch(op->load_store_scaled_reg_offset.shift_op) {
+		case 0: // LSL
+			temp_addr3 = LSL(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
+			break;
+		case 1: // LSR
+			if(op->load_store_scaled_reg_offset.shift_immediate == 0)
+				temp_addr3 = 0;
+			else
+				temp_addr3 = LSR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
+			break;
+		case 2: // ASR
+			if(op->load_store_scaled_reg_offset.shift_immediate == 0) {
+				if(temp_addr3 & 0x80000000)
+					temp_addr3 = 0xffffffff;
+				else
+					temp_addr3 = 0;
+			} else {
+				temp_addr3 = ASR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
+			}
+			break;
+		case 3: // ROR or RRX
+			if(op->load_store_scaled_reg_offset.shift_immediate == 0) { // RRX 
+				temp_addr3 = (cpu.cpsr ? 0x80000000 : 0) | LSR(temp_word, 1);
+			} else {
+				temp_addr3 = ROR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
+			}
+			break;
+	}
+
+	if(op->flags & UOPLSFLAGS_NEGATE_OFFSET)
+		temp_addr3 = -temp_addr3;
+
+	temp_addr3 += temp_addr2; // fully calculated address
+
+	if(op->flags & UOPLSFLAGS_POSTINDEX)
+		temp_addr = temp_addr2; // use the pre-offset computed address
+	else
+		temp_addr = temp_addr3;
+
+	// now we have an address, do the load
+	// read in the difference sizes & sign extend
+	switch(op->flags & UOPLSFLAGS_SIZE_MASK) {
+		case UOPLSFLAGS_SIZE_WORD:
+			if(mmu_read_mem_word(temp_addr, &temp_word))
+				return;
+			break;
+		case UOPLSFLAGS_SIZE_HALFWORD: {
+			halfword temp_halfword;
+		
+			if(mmu_read_mem_halfword(temp_addr, &temp_halfword))
+				return;
+			temp_word = temp_halfword;
+			if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
+				temp_word = SIGN_EXTEND(temp_word, 15);
+			break;
+		}
+		case UOPLSFLAGS_SIZE_BYTE: {
+			byte temp_byte;
+
+			if(mmu_read_mem_byte(temp_addr, &temp_byte))
+				return;
+			temp_word = temp_byte;
+			if(op->flags & UOPLSFLAGS_SIGN_EXTEND)
+				temp_word = SIGN_EXTEND(temp_word, 7);
+			break;
+		}
+		case UOPLSFLAGS_SIZE_DWORD: {
+			ASSERT((op->load_store_scaled_reg_offset.target_reg & 1) == 0);
+
+			// handle the first word
+			if(mmu_read_mem_word(temp_addr, &temp_word))
+				return;
+
+			put_reg(op->load_store_scaled_reg_offset.target_reg, temp_word);
+
+			// read the second word
+			word temp_word2;
+
+			if(mmu_read_mem_word(temp_addr + 4, &temp_word2))
+				return;
+
+			// NOTE: if second register is r15, unpredictable
+			put_reg(op->load_store_scaled_reg_offset.target_reg + 1, temp_word2);
+			break;
+		}
+	}
+
+	// store the result
+	// XXX on armv5 this can switch to thumb
+	put_reg(op->load_store_scaled_reg_offset.target_reg, temp_word);
+
+	// do writeback
+	if(op->flags & UOPLSFLAGS_WRITEBACK)
+		put_reg(op->load_store_scaled_reg_offset.source_reg, temp_addr);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_LOAD);
+#endif
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(op->load_store_scaled_reg_offset.target_reg == PC)
+		add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+	else if(get_core() == ARM7)
+		add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+	else if(get_core() >= ARM9 && (op->flags & UOPLSFLAGS_SIZE_MASK) != UOPLSFLAGS_SIZE_WORD)
+		add_to_perf_counter(CYCLE_COUNT, 1); // byte, halfword, and dword loads are one cycle slower
+	if(get_core() == ARM9e)
+		add_to_perf_counter(CYCLE_COUNT, 1); // scaled register loads are 1 cycle slower on this core
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_store_immediate_offset(struct uop *op)
+{
+	armaddr_t temp_addr, temp_addr2, temp_addr3;
+	word temp_word;
+
+	// slightly more complex, add an offset to a register
+	temp_addr2 = get_reg(op->load_store_immediate_offset.source_reg);
+	temp_addr3 = temp_addr2 + op->load_store_immediate_offset.offset;
+
+	if(op->flags & UOPLSFLAGS_POSTINDEX)
+		temp_addr = temp_addr2; // use the pre-offset computed address
+	else
+		temp_addr = temp_addr3;
+
+	// read in what we're going to store
+	temp_word = get_reg(op->load_store_immediate_offset.target_reg);
+
+	// write it out based on the size we were requested
+	switch(op->flags & UOPLSFLAGS_SIZE_MASK) {
+		case UOPLSFLAGS_SIZE_WORD:
+			if(mmu_write_mem_word(temp_addr, temp_word))
+				return;
+			break;
+		case UOPLSFLAGS_SIZE_HALFWORD:
+			if(mmu_write_mem_halfword(temp_addr, temp_word))
+				return;
+			break;
+		case UOPLSFLAGS_SIZE_BYTE:
+			if(mmu_write_mem_byte(temp_addr, temp_word))
+				return;
+			break;
+		case UOPLSFLAGS_SIZE_DWORD:
+			ASSERT((op->load_store_scaled_reg_offset.target_reg & 1) == 0);
+
+			// handle the first word
+			if(mmu_write_mem_word(temp_addr, temp_word))
+				return;
+
+			// read the second word
+			temp_word = get_reg(op->load_store_scaled_reg_offset.target_reg + 1);
+
+			if(mmu_write_mem_word(temp_addr + 4, temp_word))
+				return;
+			break;
+	}
+
+	// do writeback
+	if(op->flags & UOPLSFLAGS_WRITEBACK)
+		put_reg(op->load_store_immediate_offset.source_reg, temp_addr3);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_STORE);
+#endif
+#if UOP_COUNT_CYCLES
+	// cycle count (arm9 is 1 cycle, arm7 is 2)
+	if(get_core() == ARM7) {
+		add_to_perf_counter(CYCLE_COUNT, 1);
+	}
+	// strd is one cycle slower
+	if ((op->flags & UOPLSFLAGS_SIZE_MASK) == UOPLSFLAGS_SIZE_DWORD) {
+		add_to_perf_counter(CYCLE_COUNT, 1);
+	}
+#endif
+}
+
+
+static inline __ALWAYS_INLINE void uop_store_scaled_reg_offset(struct uop *op)
+{
+	armaddr_t temp_addr, temp_addr2, temp_addr3;
+	word temp_word;
+
+	// pretty complex. take two registers, optionally perform a shift operation on the second one,
+	// add them together and then load that address
+	// XXX room for improvement here, since lots of times I'm sure an instruction
+	// decoded to a immediate shift of zero to get plain register add
+	temp_addr2 = get_reg(op->load_store_scaled_reg_offset.source_reg);
+	temp_addr3 = get_reg(op->load_store_scaled_reg_offset.source2_reg);	
+	switch(op->load_store_scaled_reg_offset.shift_op) {
+		case 0: // LSL
+			temp_addr3 = LSL(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
+			break;
+		case 1: // LSR
+			if(op->load_store_scaled_reg_offset.shift_immediate == 0)
+				temp_addr3 = 0;
+			else
+				temp_addr3 = LSR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
+			break;
+		case 2: // ASR
+			if(op->load_store_scaled_reg_offset.shift_immediate == 0) {
+				if(temp_addr3 & 0x80000000)
+					temp_addr3 = 0xffffffff;
+				else
+					temp_addr3 = 0;
+			} else {
+				temp_addr3 = ASR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
+			}
+			break;
+		case 3: // ROR or RRX
+			if(op->load_store_scaled_reg_offset.shift_immediate == 0) { // RRX 
+				temp_addr3 = (cpu.cpsr ? 0x80000000 : 0) | LSR(temp_addr3, 1);
+			} else {
+				temp_addr3 = ROR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
+			}
+			break;
+	}
+
+	if(op->flags & UOPLSFLAGS_NEGATE_OFFSET)
+		temp_addr3 = -temp_addr3;
+
+	temp_addr3 += temp_addr2; // fully calculated address
+
+	if(op->flags & UOPLSFLAGS_POSTINDEX)
+		temp_addr = temp_addr2; // use the pre-offset computed address
+	else
+		temp_addr = temp_addr3;
+
+	// read in what we're going to store
+	temp_word = get_reg(op->load_store_scaled_reg_offset.target_reg);
+
+	// write it out based on the size we were requested
+	switch(op->flags & UOPLSFLAGS_SIZE_MASK) {
+		case UOPLSFLAGS_SIZE_WORD:
+			if(mmu_write_mem_word(temp_addr, temp_word))
+				return;
+			break;
+		case UOPLSFLAGS_SIZE_HALFWORD:
+			if(mmu_write_mem_halfword(temp_addr, temp_word))
+				return;
+			break;
+		case UOPLSFLAGS_SIZE_BYTE:
+			if(mmu_write_mem_byte(temp_addr, temp_word))
+				return;
+			break;
+		case UOPLSFLAGS_SIZE_DWORD:
+			ASSERT((op->load_store_scaled_reg_offset.target_reg & 1) == 0);
+
+			// handle the first word
+			if(mmu_write_mem_word(temp_addr, temp_word))
+				return;
+
+			// read the second word
+			temp_word = get_reg(op->load_store_scaled_reg_offset.target_reg + 1);
+
+			if(mmu_write_mem_word(temp_addr + 4, temp_word))
+				return;
+			break;
+	}
+
+	// do writeback
+	if(op->flags & UOPLSFLAGS_WRITEBACK)
+		put_reg(op->load_store_scaled_reg_offset.source_reg, temp_addr);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_STORE);
+#endif
+#if UOP_COUNT_CYCLES
+	// cycle count (arm9 is 1 cycle, arm7 is 2)
+	if(get_core() == ARM7) {
+		add_to_perf_counter(CYCLE_COUNT, 1);
+	} else if(get_core() == ARM9e) {
+		add_to_perf_counter(CYCLE_COUNT, 1); // XXX not precisely correct, since a zero scale is no extra work
+	}
+	// strd is one cycle slower
+	if ((op->flags & UOPLSFLAGS_SIZE_MASK) == UOPLSFLAGS_SIZE_DWORD) {
+		add_to_perf_counter(CYCLE_COUNT, 1);
+	}
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_load_multiple(struct uop *op)
+{
+	armaddr_t temp_addr, temp_addr2;
+	word temp_word;
+	int i;
+	byte *host;
+	word reg_list = op->load_store_multiple.reg_bitmap;
+
+	// calculate the base address
+	temp_addr = get_reg(op->load_store_multiple.base_reg);
+	temp_addr2 = temp_addr + op->load_store_multiple.base_offset;
+
+	// scan through the list of registers, reading in each one
+	ASSERT((reg_list >> 16) == 0);
+	host = mmu_get_data_range(temp_addr2, op->load_store_multiple.reg_count * 4, FALSE);
+	if(likely(host != NULL)) {
+		// the whole run is in one page of host memory, nothing can abort
+		for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
+			if(reg_list & 1) {
+				// XXX on armv5 this can switch to thumb
+				put_reg(i, READ_MEM_WORD(host));
+				host += 4;
+			}
+		}
+	} else {
+		for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
+			if(reg_list & 1) {
+				if(mmu_read_mem_word(temp_addr2, &temp_word)) {
+					// there was a data abort, and we may have trashed the base register. Restore it.
+					put_reg(op->load_store_multiple.base_reg, temp_addr);
+					return;
+				}
+
+				// XXX on armv5 this can switch to thumb
+				put_reg(i, temp_word);
+				temp_addr2 += 4;
+			}
+		}
+	}
+
+	// writeback
+	if(op->flags & UOPLSMFLAGS_WRITEBACK) {
+		temp_addr2 = temp_addr + op->load_store_multiple.writeback_offset;
+		put_reg(op->load_store_multiple.base_reg, temp_addr2);
+	}
+
+	// see if we need to move spsr into cpsr
+	if(op->flags & UOPLSMFLAGS_LOAD_CPSR) {
+		reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
+		set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
+		put_cpsr(spsr);
+	}
+
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(get_core() == ARM7) {
+		add_to_perf_counter(CYCLE_COUNT, op->load_store_multiple.reg_count + 1);
+		if(op->load_store_multiple.reg_bitmap & 0x8000) // loaded into PC
+			add_to_perf_counter(CYCLE_COUNT, 2);
+	} else /* if(get_core() >= ARM9) */ {
+		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
+		if(op->load_store_multiple.reg_bitmap & 0x8000) {
+			add_to_perf_counter(CYCLE_COUNT, 4);
+			if(get_core() == ARM9e && op->load_store_multiple.reg_count == 0)
+				add_to_perf_counter(CYCLE_COUNT, -1); // ldm of just pc is one cycle faster on ARM9e
+		}
+	}				
+#endif
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_LOAD);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_load_multiple_s(struct uop *op)
+{
+	armaddr_t temp_addr, temp_addr2;
+	word temp_word;
+	int i;
+	byte *host;
+	word reg_list = op->load_store_multiple.reg_bitmap;
+
+	// calculate the base address
+	temp_addr = get_reg(op->load_store_multiple.base_reg);
+	temp_addr2 = temp_addr + op->load_store_multiple.base_offset;
+
+	// r15 cannot be in the register list, would have resulted in a different instruction
+	ASSERT((reg_list & 0x8000) == 0);
+
+	// scan through the list of registers, reading in each one
+	ASSERT((reg_list >> 16) == 0);
+	host = mmu_get_data_range(temp_addr2, op->load_store_multiple.reg_count * 4, FALSE);
+	if(likely(host != NULL)) {
+		for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
+			if(reg_list & 1) {
+				put_reg_user(i, READ_MEM_WORD(host));
+				host += 4;
+			}
+		}
+	} else {
+		for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
+			if(reg_list & 1) {
+				if(mmu_read_mem_word(temp_addr2, &temp_word)) {
+					// there was a data abort, and we may have trashed the base register. Restore it.
+					put_reg_user(op->load_store_multiple.base_reg, temp_addr);
+					return;
+				}
+				put_reg_user(i, temp_word);
+				temp_addr2 += 4;
+			}
+		}
+	}
+
+	// writeback
+	// NOTE: writeback with the S bit set is unpredictable
+	if(op->flags & UOPLSMFLAGS_WRITEBACK) {
+		temp_addr2 = temp_addr + op->load_store_multiple.writeback_offset;
+		put_reg(op->load_store_multiple.base_reg, temp_addr2);
+	}
+
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(get_core() == ARM7) {
+		add_to_perf_counter(CYCLE_COUNT, op->load_store_multiple.reg_count + 1);
+		if(op->load_store_multiple.reg_bitmap & 0x8000) // loaded into PC
+			add_to_perf_counter(CYCLE_COUNT, 2);
+	} else /* if(get_core() >= ARM9) */ {
+		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
+		if(op->load_store_multiple.reg_bitmap & 0x8000) {
+			add_to_perf_counter(CYCLE_COUNT, 4);
+			if(get_core() == ARM9e && op->load_store_multiple.reg_count == 0)
+				add_to_perf_counter(CYCLE_COUNT, -1); // ldm of just pc is one cycle faster on ARM9e
+		}
+	}				
+#endif
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_LOAD);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_store_multiple(struct uop *op)
+{
+	armaddr_t temp_addr, temp_addr2;
+	int i;
+	byte *host;
+	word reg_list = op->load_store_multiple.reg_bitmap;
+
+	// calculate the base address
+	temp_addr = get_reg(op->load_store_multiple.base_reg);
+	temp_addr2 = temp_addr + op->load_store_multiple.base_offset;
+
+	// scan through the list of registers, storing each one
+	ASSERT((reg_list >> 16) == 0);
+	host = mmu_get_data_range(temp_addr2, op->load_store_multiple.reg_count * 4, TRUE);
+	if(likely(host != NULL)) {
+		for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
+			if(reg_list & 1) {
+				WRITE_MEM_WORD(host, get_reg(i));
+				host += 4;
+			}
+		}
+	} else {
+		for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
+			if(reg_list & 1) {
+				if(mmu_write_mem_word(temp_addr2, get_reg(i)))
+					return; // data abort
+				temp_addr2 += 4;
+			}
+		}
+	}
+
+	// writeback
+	if(op->flags & UOPLSMFLAGS_WRITEBACK) {
+		temp_addr2 = temp_addr + op->load_store_multiple.writeback_offset;
+		put_reg(op->load_store_multiple.base_reg, temp_addr2);
+	}
+
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(get_core() == ARM7) {
+		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count - 1) + 1);
+	} else /* if(get_core() >= ARM9) */ {
+		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
+	}
+#endif
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_STORE);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_store_multiple_s(struct uop *op)
+{
+	armaddr_t temp_addr, temp_addr2;
+	int i;
+	byte *host;
+	word reg_list = op->load_store_multiple.reg_bitmap;
+
+	// calculate the base address
+	temp_addr = get_reg(op->load_store_multiple.base_reg);
+	temp_addr2 = temp_addr + op->load_store_multiple.base_offset;
+
+	// scan through the list of registers, storing each one
+	ASSERT((reg_list >> 16) == 0);
+	host = mmu_get_data_range(temp_addr2, op->load_store_multiple.reg_count * 4, TRUE);
+	if(likely(host != NULL)) {
+		for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
+			if(reg_list & 1) {
+				WRITE_MEM_WORD(host, get_reg_user(i));
+				host += 4;
+			}
+		}
+	} else {
+		for(i = 0; reg_list != 0; i++, reg_list >>= 1) {
+			if(reg_list & 1) {
+				if(mmu_write_mem_word(temp_addr2, get_reg_user(i)))
+					return; // data abort
+				temp_addr2 += 4;
+			}
+		}
+	}
+
+	// writeback
+	// NOTE: writeback with the S bit set is unpredictable
+	if(op->flags & UOPLSMFLAGS_WRITEBACK) {
+		temp_addr2 = temp_addr + op->load_store_multiple.writeback_offset;
+		put_reg(op->load_store_multiple.base_reg, temp_addr2);
+	}
+
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(get_core() == ARM7) {
+		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count - 1) + 1);
+	} else /* if(get_core() >= ARM9) */ {
+		add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
+	}
+#endif
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_STORE);
+#endif
+}
+
+// generic data process with immediate operand, no S bit, PC may be target
+static inline __ALWAYS_INLINE void uop_data_processing_imm(struct uop *op)
+{
+	word immediate = op->data_processing_imm.immediate;
+	word temp_word = get_reg(op->data_processing_imm.source_reg);
+
+	ASSERT(op->data_processing_imm.dp_opcode < 16);
+	ASSERT_VALID_REG(op->data_processing_imm.source_reg);
+	ASSERT_VALID_REG(op->data_processing_imm.dest_reg);
+
+	DATA_PROCESSING_OP_TABLE_NOFLAGS(op->data_processing_imm.dp_opcode,
+		temp_word, // result
+		temp_word, immediate); // a & b
+
+	// write the result out
+	// NOTE: if the op was originally one of the four arm test ops
+	// (TST, TEQ, CMP, CMN), we would be using the DATA_PROCESSING_IMM_S
+	// instruction form, since not having writeback makes no sense
+	put_reg(op->data_processing_imm.dest_reg, temp_word);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+#if UOP_COUNT_ARITH_UOPS
+	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_imm.dp_opcode);
+#endif
+}
+
+// generic data processing with register operand, no S bit, PC may be target
+static inline __ALWAYS_INLINE void uop_data_processing_reg(struct uop *op)
+{
+	word temp_word = get_reg(op->data_processing_reg.source_reg);
+	word operand2 = get_reg(op->data_processing_reg.source2_reg);
+	
+	ASSERT(op->data_processing_reg.dp_opcode < 16);
+	ASSERT_VALID_REG(op->data_processing_reg.source_reg);
+	ASSERT_VALID_REG(op->data_processing_reg.source2_reg);
+	ASSERT_VALID_REG(op->data_processing_reg.dest_reg);
+
+	DATA_PROCESSING_OP_TABLE_NOFLAGS(op->data_processing_reg.dp_opcode,
+		temp_word, // result
+		temp_word, operand2); // a & b
+
+	// write the result out
+	// NOTE: if the op was originally one of the four arm test ops
+	// (TST, TEQ, CMP, CMN), we would be using the DATA_PROCESSING_REG_S
+	// instruction form, since not having writeback makes no sense
+	put_reg(op->data_processing_reg.dest_reg, temp_word);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+#if UOP_COUNT_ARITH_UOPS
+	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_reg.dp_opcode);
+#endif
+}
+
+// generic data process with immediate operand, S bit, PC may be target
+static inline __ALWAYS_INLINE void uop_data_processing_imm_s(struct uop *op)
+{
+	bool Rd_writeback;
+	bool arith_op;
+	word immediate = op->data_processing_imm.immediate;
+	int carry, ovl;
+	
+	word temp_word = get_reg(op->data_processing_imm.source_reg);
+	
+	ASSERT(op->data_processing_imm.dp_opcode < 16);
+	ASSERT_VALID_REG(op->data_processing_imm.source_reg);
+	ASSERT_VALID_REG(op->data_processing_imm.dest_reg);
+
+	Rd_writeback = TRUE;
+	arith_op = FALSE;
+	carry = 0;
+	ovl = 0;
+	DATA_PROCESSING_OP_TABLE(op->data_processing_imm.dp_opcode, 
+		temp_word, // result
+		temp_word, immediate, // a & b
+		arith_op, Rd_writeback, carry, ovl);
+
+	if(Rd_writeback)
+		put_reg(op->data_processing_imm.dest_reg, temp_word);
+
+	if(op->data_processing_imm.dest_reg != PC) {
+		set_NZ_condition(temp_word);
+		if(arith_op) {
+			set_condition(PSR_CC_CARRY, carry);
+			set_condition(PSR_CC_OVL, ovl);
+		} else {
+			// carry out from the shifter depending on how it was precalculated
+			if(op->flags & UOPDPFLAGS_SET_CARRY_FROM_SHIFTER)
+				set_condition(PSR_CC_CARRY, op->flags & UOPDPFLAGS_CARRY_FROM_SHIFTER);
+		}
+	} else {
+		// destination was pc, and S bit was set, this means we swap spsr
+		reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
+
+		// see if we're about to switch thumb state
+		if((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
+			cpu.curr_cp = NULL; // force a codepage reload
+
+		set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
+		put_cpsr(spsr);
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+#if UOP_COUNT_ARITH_UOPS
+	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_imm.dp_opcode);
+#endif
+}
+
+// generic data processing with register operand, S bit, PC may be target
+static inline __ALWAYS_INLINE void uop_data_processing_reg_s(struct uop *op) 
+{
+	bool Rd_writeback;
+	bool arith_op;
+	int carry, ovl;
+	
+	word temp_word = get_reg(op->data_processing_reg.source_reg);
+	word temp_word2 = get_reg(op->data_processing_reg.source2_reg);
+	
+	ASSERT(op->data_processing_reg.dp_opcode < 16);
+	ASSERT_VALID_REG(op->data_processing_reg.source_reg);
+	ASSERT_VALID_REG(op->data_processing_reg.source2_reg);
+	ASSERT_VALID_REG(op->data_processing_reg.dest_reg);
+
+	Rd_writeback = TRUE;
+	arith_op = FALSE;
+	carry = 0;
+	ovl = 0;
+	DATA_PROCESSING_OP_TABLE(op->data_processing_reg.dp_opcode, 
+		temp_word, // result
+		temp_word, temp_word2, // a & b
+		arith_op, Rd_writeback, carry, ovl);
+
+	if(Rd_writeback)
+		put_reg(op->data_processing_reg.dest_reg, temp_word);
+
+	if(op->data_processing_reg.dest_reg != PC) {
+		set_NZ_condition(temp_word);
+		if(arith_op) {
+			set_condition(PSR_CC_CARRY, carry);
+			set_condition(PSR_CC_OVL, ovl);
+		}
+	} else {
+		// destination was pc, and S bit was set, this means we swap spsr
+		reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
+
+		// see if we're about to switch thumb state
+		if((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
+			cpu.curr_cp = NULL; // force a codepage reload
+
+		set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
+		put_cpsr(spsr);
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+#if UOP_COUNT_ARITH_UOPS
+	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_reg.dp_opcode);
+#endif
+}
+
+// generic data processing with immediate barrel shifter, no S bit, PC may be target
+static inline __ALWAYS_INLINE void uop_data_processing_imm_shift(struct uop *op)
+{
+	bool Rd_writeback;
+	bool arith_op;
+	int carry, ovl;
+	bool shifter_carry_out;
+	word shifter_operand;
+	word shift_imm;
+
+	ASSERT(op->data_processing_imm_shift.shift_opcode < 4);
+	ASSERT(op->data_processing_imm_shift.dp_opcode < 16);
+	ASSERT_VALID_REG(op->data_processing_imm_shift.source_reg);
+	ASSERT_VALID_REG(op->data_processing_imm_shift.source2_reg);
+	ASSERT_VALID_REG(op->data_processing_imm_shift.dest_reg);
+
+	// first operand
+	word temp_word = get_reg(op->data_processing_imm_shift.source_reg);
+	word temp_word2 = get_reg(op->data_processing_imm_shift.source2_reg);
+	shift_imm = op->data_processing_imm_shift.shift_imm;
+
+	// handle the immediate shift form of barrel shifter
+	switch(op->data_processing_imm_shift.shift_opcode) {
+		default: case 0: // LSL
+			if(shift_imm == 0) {
+				// shouldn't see this form, it would have been factored out into a simpler instruction
+				shifter_operand = temp_word2;
+				shifter_carry_out = get_condition(PSR_CC_CARRY);
+			} else {
+				shifter_operand = LSL(temp_word2, shift_imm);
+				shifter_carry_out = BIT(temp_word2, 32 - shift_imm);
+			}
+			break;
+		case 1: // LSR
+			if(shift_imm == 0) {
+				shifter_operand = 0;
+				shifter_carry_out = BIT(temp_word2, 31);
+			} else {
+				shifter_operand = LSR(temp_word2, shift_imm);
+				shifter_carry_out = BIT(temp_word2, shift_imm - 1);
+			}
+			break;
+		case 2: // ASR
+			if(shift_imm == 0) {
+				if(BIT(temp_word2, 31) == 0) {
+					shifter_operand = 0;
+					shifter_carry_out = 0; // Rm[31] == 0
+				} else {
+					shifter_operand = 0xffffffff;
+					shifter_carry_out = 0x80000000; // Rm[31] == 1
+				}
+			} else {
+				shifter_operand = ASR(temp_word2, shift_imm);
+				shifter_carry_out = BIT(temp_word2, shift_imm - 1);
+			}
+			break;
+		case 3: // ROR
+			if(shift_imm == 0) {
+				// RRX
+				shifter_operand = (get_condition(PSR_CC_CARRY) ? 0x80000000: 0) | LSR(temp_word2, 1);
+				shifter_carry_out = BIT(temp_word2, 0);
+			} else {
+				shifter_operand = ROR(temp_word2, shift_imm);
+				shifter_carry_out = BIT(temp_word2, shift_imm - 1);
+			}
+			break;
+	}
+
+	// do the op
+	Rd_writeback = TRUE;
+	arith_op = FALSE;
+	carry = 0;
+	ovl = 0;
+	DATA_PROCESSING_OP_TABLE(op->data_processing_imm_shift.dp_opcode, 
+		temp_word, // result
+		temp_word, shifter_operand, // a & b
+		arith_op, Rd_writeback, carry, ovl);
+
+	if(Rd_writeback)
+		put_reg(op->data_processing_imm_shift.dest_reg, temp_word);
+
+	if(op->flags & UOPDPFLAGS_S_BIT) {
+		if(op->data_processing_imm_shift.dest_reg != PC) {
+			set_NZ_condition(temp_word);
+			if(arith_op) {
+				set_condition(PSR_CC_CARRY, carry);
+				set_condition(PSR_CC_OVL, ovl);
+			} else {
+				// carry out from the shifter
+				set_condition(PSR_CC_CARRY, shifter_carry_out);
+			}
+		} else {
+			// destination was pc, and S bit was set, this means we swap spsr
+			reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
+
+			// see if we're about to switch thumb state
+			if((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
+				cpu.curr_cp = NULL; // force a codepage reload
+	
+			set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
+			put_cpsr(spsr);
+		}
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+#if UOP_COUNT_ARITH_UOPS
+	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_imm_shift.dp_opcode);
+#endif
+}	
+
+// generic data processing with register based barrel shifter, no S bit, PC may be target
+static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op) 
+	{
+	bool Rd_writeback;
+	bool arith_op;
+	int carry, ovl;
+	bool shifter_carry_out;
+	word shifter_operand;
+
+	ASSERT(op->data_processing_reg_shift.shift_opcode < 4);
+	ASSERT(op->data_processing_reg_shift.dp_opcode < 16);
+	ASSERT_VALID_REG(op->data_processing_reg_shift.source_reg);
+	ASSERT_VALID_REG(op->data_processing_reg_shift.source2_reg);
+	ASSERT_VALID_REG(op->data_processing_reg_shift.dest_reg);
+
+	// operands
+	word temp_word = get_reg(op->data_processing_reg_shift.source_reg);
+	word temp_word2 = get_reg(op->data_processing_reg_shift.source2_reg);
+	word temp_word3 = get_reg(op->data_processing_reg_shift.shift_reg);
+	
+	// we only care about the bottom 8 bits of Rs
+	temp_word3 = BITS(temp_word3, 7, 0);
+
+	// handle the immediate shift form of barrel shifter
+	switch(op->data_processing_reg_shift.shift_opcode) {
+		default: case 0: // LSL by reg (page A5-10)
+			shifter_operand = LSL(temp_word2, temp_word3);
+			if(temp_word3 == 0) {
+				shifter_carry_out = get_condition(PSR_CC_CARRY);
+			} else if(temp_word3 < 32) {
+				shifter_carry_out = BIT(temp_word2, 32 - temp_word3);
+			} else if(temp_word3 == 32) {
+				shifter_carry_out = BIT(temp_word2, 0);
+			} else { // temp_word3 > 32
+				shifter_carry_out = 0;
+			}
+			break;
+		case 1: // LSR by reg (page A5-12)
+			shifter_operand = LSR(temp_word2, temp_word3);
+			if(temp_word3 == 0) {
+				shifter_carry_out = get_condition(PSR_CC_CARRY);
+			} else if(temp_word3 < 32) {
+				shifter_carry_out = BIT(temp_word2, temp_word3 - 1);
+			} else if(temp_word3 == 32) {
+				shifter_carry_out = BIT(temp_word2, 31);
+			} else {
+				shifter_carry_out = 0;
+			}
+			break;
+		case 2: // ASR by reg (page A5-14)
+			shifter_operand = ASR(temp_word2, temp_word3);
+			if(temp_word3 == 0) {
+				shifter_carry_out = get_condition(PSR_CC_CARRY);
+			} else if(temp_word3 < 32) {
+				shifter_carry_out = BIT(temp_word2, temp_word3 - 1);
+			} else if(temp_word3 >= 32) {
+				shifter_carry_out = BIT(temp_word2, 31);
+			}
+			break;
+		case 3: { // ROR by reg (page A5-16)
+			word lower_4bits = BITS(temp_word3, 4, 0);
+			shifter_operand = ROR(temp_word2, lower_4bits);
+			if(temp_word3 == 0) {
+				shifter_carry_out = get_condition(PSR_CC_CARRY);
+			} else if(lower_4bits == 0) {
+				shifter_carry_out = BIT(temp_word2, 31);
+			} else { // temp_word3 & 0x1f > 0
+				shifter_carry_out = BIT(temp_word2, lower_4bits - 1);
+			}
+			break;
+		}
+	}
+
+#if UOP_COUNT_CYCLES
+	/* shifting by a reg value costs an extra cycle */
+	add_to_perf_counter(CYCLE_COUNT, 1);
+#endif
+	// do the op
+	Rd_writeback = TRUE;
+	arith_op = FALSE;
+	carry = 0;
+	ovl = 0;
+	DATA_PROCESSING_OP_TABLE(op->data_processing_reg_shift.dp_opcode, 
+		temp_word, // result
+		temp_word, shifter_operand, // a & b
+		arith_op, Rd_writeback, carry, ovl);
+
+	if(Rd_writeback)
+		put_reg(op->data_processing_reg_shift.dest_reg, temp_word);
+
+	if(op->flags & UOPDPFLAGS_S_BIT) {
+		if(op->data_processing_reg_shift.dest_reg != PC) {
+			set_NZ_condition(temp_word);
+			if(arith_op) {
+				set_condition(PSR_CC_CARRY, carry);
+				set_condition(PSR_CC_OVL, ovl);
+			} else {
+				// carry out from the shifter
+				set_condition(PSR_CC_CARRY, shifter_carry_out);
+			}
+		} else {
+			// destination was pc, and S bit was set, this means we swap spsr
+			reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
+
+			// see if we're about to switch thumb state
+			if((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
+				cpu.curr_cp = NULL; // force a codepage reload
+	
+			set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
+			put_cpsr(spsr);
+		}
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+#if UOP_COUNT_ARITH_UOPS
+	inc_perf_counter(UOP_ARITH_OPCODE + op->data_processing_reg_shift.dp_opcode);
+#endif
+}
+
+// simple load of immediate into register, PC may not be target
+static inline __ALWAYS_INLINE void uop_mov_imm(struct uop *op) 
+{
+	put_reg_nopc(op->simple_dp_imm.dest_reg, op->simple_dp_imm.immediate);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple load of immediate into register, set N and Z flags, PC may not be target
+static inline __ALWAYS_INLINE void uop_mov_imm_nz(struct uop *op) 
+{
+	put_reg_nopc(op->simple_dp_imm.dest_reg, op->simple_dp_imm.immediate);
+	set_NZ_condition(op->simple_dp_imm.immediate);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple mov from register to register, PC may not be target
+static inline __ALWAYS_INLINE void uop_mov_reg(struct uop *op) 
+{
+	put_reg_nopc(op->simple_dp_reg.dest_reg, get_reg(op->simple_dp_reg.source2_reg));
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple compare of register to immediate value
+static inline __ALWAYS_INLINE void uop_cmp_imm_s(struct uop *op) 
+{
+	word a;
+	word result;
+	
+	// subtract the immediate from the source register
+	a = get_reg(op->simple_dp_imm.source_reg);
+	result = a - op->simple_dp_imm.immediate;
+
+	// set flags on the result
+	set_sub_flags(a, op->simple_dp_imm.immediate, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple compare of two registers
+static inline __ALWAYS_INLINE void uop_cmp_reg_s(struct uop *op) 
+{
+	word a;
+	word b;
+	word result;
+
+	// subtract the source2 reg from the source register
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = a - b;
+
+	// set flags on the result
+	set_sub_flags(a, b, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple negative compare of two registers
+static inline __ALWAYS_INLINE void uop_cmn_reg_s(struct uop *op) 
+{
+	word a;
+	word b;
+	word result;
+	
+	// add the source2 reg to the source register
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = a + b;
+
+	// set flags on the result
+	set_add_flags(a, b, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// bit test of two registers
+static inline __ALWAYS_INLINE void uop_tst_reg_s(struct uop *op) 
+{
+	word result;
+	word a;
+	word b;
+	
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	
+	result = a & b;
+
+	// set flags on the result
+	set_NZ_condition(result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple add of immediate to register, PC may not be target
+static inline __ALWAYS_INLINE void uop_add_imm(struct uop *op) 
+{
+	word a;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	result = a + op->simple_dp_imm.immediate;
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple add of immediate to register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_add_imm_s(struct uop *op) 
+{
+	word a;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	result = a + op->simple_dp_imm.immediate;
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+	// set flags on the result
+	set_add_flags(a, op->simple_dp_imm.immediate, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple add of two registers, PC may not be target
+static inline __ALWAYS_INLINE void uop_add_reg(struct uop *op) 
+{
+	word a;
+	word b;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = a + b;
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple add of two registers, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_add_reg_s(struct uop *op) 
+{
+	word a;
+	word b;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = a + b;
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+	// set flags on the result
+	set_add_flags(a, b, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple add with carry of two registers, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_adc_reg_s(struct uop *op) 
+{
+	int carry, ovl;
+	word a;
+	word b;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = do_add(a, b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+	// set flags on the result
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, carry);
+	set_condition(PSR_CC_OVL, ovl);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple subtract of two registers, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_sub_reg_s(struct uop *op) 
+{
+	word a;
+	word b;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = a - b;
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+	// set flags on the result
+	set_sub_flags(a, b, result);
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// simple subtract with carry of two registers, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_sbc_reg_s(struct uop *op) 
+{
+	int carry, ovl;
+	word a;
+	word b;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = do_add(a, ~b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl);
+	put_reg(op->simple_dp_reg.dest_reg, result);
+
+	// set flags on the result
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, carry);
+	set_condition(PSR_CC_OVL, ovl);
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// and with immediate, PC may not be target
+static inline __ALWAYS_INLINE void uop_and_imm(struct uop *op) 
+{
+	word a;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	result = a & op->simple_dp_imm.immediate;
+
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// or with immediate, PC may not be target
+static inline __ALWAYS_INLINE void uop_orr_imm(struct uop *op) 
+{
+	word a;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	result = a | op->simple_dp_imm.immediate;
+
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// or by register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_orr_reg_s(struct uop *op) 
+{
+	word a;
+	word b;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = a | b;
+
+	set_NZ_condition(result);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// shift left of register by immediate, PC may not be target
+static inline __ALWAYS_INLINE void uop_lsl_imm(struct uop *op) 
+{
+	word a;
+	word shift;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	shift = op->simple_dp_imm.immediate;
+
+	result = LSL(a, shift);
+
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// shift left of register by immediate, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_lsl_imm_s(struct uop *op) 
+{
+	int carry;
+	word a;
+	word immed;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	immed = op->simple_dp_imm.immediate;
+
+	if(immed != 0) {
+		carry = BIT(a, 32 - immed);
+		result = LSL(a, immed);
+	} else {
+		carry = get_condition(PSR_CC_CARRY);
+		result = a;
+	}
+
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, carry);
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// shift left of register by register, PC may not be target
+static inline __ALWAYS_INLINE void uop_lsl_reg(struct uop *op) 
+{
+	word a;
+	word shift;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	shift = get_reg(op->simple_dp_reg.source2_reg);
+	shift &= 0xff;
+
+	result = LSL(a, shift);
+
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// shift left of register by register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_lsl_reg_s(struct uop *op) 
+{
+	int carry;
+	word a;
+	word shift;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	shift = get_reg(op->simple_dp_reg.source2_reg);
+	shift &= 0xff;
+
+	result = LSL(a, shift);
+	if(shift == 0) {
+		carry = get_condition(PSR_CC_CARRY);
+	} else if(shift < 32) {
+		carry = BIT(a, 32 - shift);
+	} else if(shift == 32) {
+		carry = BIT(a, 0);
+	} else {
+		carry = 0;
+	}
+
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, carry);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// logical shift right by immediate, PC may not be target
+static inline __ALWAYS_INLINE void uop_lsr_imm(struct uop *op) 
+{
+	word a;
+	word immed;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	immed = op->simple_dp_imm.immediate;
+
+	result = LSR(a, immed);
+
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// logical shift right by immediate, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_lsr_imm_s(struct uop *op) 
+{
+	int carry;
+	word a;
+	word immed;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	immed = op->simple_dp_imm.immediate;
+
+	if(immed != 0) {
+		carry = BIT(a, immed - 1);
+		result = LSR(a, immed);
+	} else {
+		carry = BIT(a, 31);
+		result = 0;
+	}
+
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, carry);
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// logical shift right by register, PC may not be target
+static inline __ALWAYS_INLINE void uop_lsr_reg(struct uop *op) 
+{
+	word a;
+	word shift;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	shift = get_reg(op->simple_dp_reg.source2_reg);
+	shift &= 0xff;
+
+	result = LSR(a, shift);
+
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// logical shift right by register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_lsr_reg_s(struct uop *op) 
+{
+	int carry;
+	word a;
+	word shift;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	shift = get_reg(op->simple_dp_reg.source2_reg);
+	shift &= 0xff;
+
+	result = LSR(a, shift);
+	if(shift == 0) {
+		carry = get_condition(PSR_CC_CARRY);
+	} else if(shift < 32) {
+		carry = BIT(a, shift - 1);
+	} else if(shift == 32) {
+		carry = BIT(a, 31);
+	} else {
+		carry = 0;
+	}
+
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, carry);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// arithmetic shift right by immediate,  PC may not be target
+static inline __ALWAYS_INLINE void uop_asr_imm(struct uop *op) 
+{
+	word a;
+	word immed;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	immed = op->simple_dp_imm.immediate;
+
+	result = ASR(a, immed);
+
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// arithmetic shift right by immediate, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_asr_imm_s(struct uop *op) 
+{
+	int carry;
+	word a;
+	word immed;
+	word result;
+
+	a = get_reg(op->simple_dp_imm.source_reg);
+	immed = op->simple_dp_imm.immediate;
+
+	if(immed == 0) {
+		carry = BIT(a, 31);
+		if(carry)
+			result = 0;
+		else
+			result = 0xffffffff;
+	} else {
+		carry = BIT(a, immed - 1);
+		result = ASR(a, immed);
+	}
+
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, carry);
+	put_reg_nopc(op->simple_dp_imm.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// arithmetic shift right by register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_asr_reg(struct uop *op) 
+{
+	word a;
+	word shift;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	shift = get_reg(op->simple_dp_reg.source2_reg);
+	shift &= 0xff;
+
+	result = ASR(a, shift);
+
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// arithmetic shift right by register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_asr_reg_s(struct uop *op) 
+{
+	int carry;
+	word a;
+	word shift;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	shift = get_reg(op->simple_dp_reg.source2_reg);
+	shift &= 0xff;
+
+	result = ASR(a, shift);
+	if(shift == 0) {
+		carry = get_condition(PSR_CC_CARRY);
+	} else if(shift < 32) {
+		carry = BIT(a, shift - 1);
+	} else { // RmRsval >= 32
+		carry = BIT(a, 31);
+	}
+
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, carry);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// rotate right by register, PC may not be target
+static inline __ALWAYS_INLINE void uop_ror_reg(struct uop *op) 
+{
+	word a;
+	word rotate;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	rotate = get_reg(op->simple_dp_reg.source2_reg);
+	rotate = BITS(rotate, 4, 0);
+
+	result = ROR(a, rotate);
+
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// rotate right by register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_ror_reg_s(struct uop *op) 
+{
+	int carry;
+	word a;
+	word rotate;
+	word rotate_lower_4_bits;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	rotate = get_reg(op->simple_dp_reg.source2_reg);
+	rotate_lower_4_bits = BITS(rotate, 4, 0);
+
+	result = ROR(a, rotate_lower_4_bits);
+	if(BITS(rotate, 7, 0) == 0) {
+		carry = get_condition(PSR_CC_CARRY);
+	} else if(rotate_lower_4_bits == 0) {
+		carry = BIT(a, 31);
+	} else {
+		carry = BIT(a, rotate_lower_4_bits - 1);
+	}
+
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, carry);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// and by register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_and_reg_s(struct uop *op) 
+{
+	word a;
+	word b;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = a & b;
+
+	set_NZ_condition(result);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// xor by register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_eor_reg_s(struct uop *op) 
+{
+	word a;
+	word b;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = a ^ b;
+
+	set_NZ_condition(result);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// bit clear by register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_bic_reg_s(struct uop *op) 
+{
+	word a;
+	word b;
+	word result;
+
+	a = get_reg(op->simple_dp_reg.source_reg);
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = a & ~b;
+
+	set_NZ_condition(result);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// negate register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_neg_reg_s(struct uop *op) 
+{
+	word b;
+	word result;
+
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = 0 - b;
+
+	set_sub_flags(0, b, result);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+// bitwise negation register, S bit, PC may not be target
+static inline __ALWAYS_INLINE void uop_mvn_reg_s(struct uop *op) 
+{
+	word b;
+	word result;
+
+	b = get_reg(op->simple_dp_reg.source2_reg);
+	result = ~b;
+
+	set_NZ_condition(result);
+	put_reg_nopc(op->simple_dp_reg.dest_reg, result);
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+}
+
+/* step over the second half of a fused pair, it still counts as an instruction */
+static inline __ALWAYS_INLINE void uop_fused_skip(void)
+{
+	int pc_inc = cpu.curr_cp->pc_inc;
+
+	cpu.pc += pc_inc;
+	cpu.r[PC] += pc_inc;
+	cpu.cp_pc++;
+
+#if UOP_COUNT_INS
+	add_to_perf_counter(INS_COUNT, 1);
+#endif
+#if UOP_COUNT_CYCLES
+	add_to_perf_counter(CYCLE_COUNT, 1);
+#endif
+}
+
+/* the conditional local branch half of a fused compare */
+static inline __ALWAYS_INLINE void uop_fused_branch(struct uop *op)
+{
+	if(!check_condition(op->flags & COND_MASK)) {
+#if UOP_COUNT_ARM_OPS
+		inc_perf_counter(OP_SKIPPED_CONDITION);
+#endif
+		return;
+	}
+
+	uop_cover_edge(cpu.pc, cpu.curr_cp->address | op->cmp_bcc.target_offset);
+	cpu.pc = cpu.curr_cp->address | op->cmp_bcc.target_offset;
+	cpu.cp_pc = PC_TO_CPPC(cpu.pc);
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_BRANCH);
+#endif
+#if UOP_COUNT_CYCLES
+	// all branch instructions take 3 cycles on all cores
+	add_to_perf_counter(CYCLE_COUNT, 2);
+#endif
+	if(unlikely(op->flags & UOPBFLAGS_IDLE_POLL))
+		cpu_idle_branch(op->flags);
+}
+
+// compare register to immediate, then branch within the codepage on the result
+static inline __ALWAYS_INLINE void uop_cmp_imm_bcc_local(struct uop *op) 
+{
+	word a;
+
+	a = get_reg(op->cmp_bcc.source_reg);
+	set_sub_flags(a, op->cmp_bcc.immediate, a - op->cmp_bcc.immediate);
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+
+	uop_fused_skip();
+	uop_fused_branch(op);
+}
+
+// compare two registers, then branch within the codepage on the result
+static inline __ALWAYS_INLINE void uop_cmp_reg_bcc_local(struct uop *op) 
+{
+	word a;
+	word b;
+
+	a = get_reg(op->cmp_bcc.source_reg);
+	b = get_reg(op->cmp_bcc.source2_reg);
+	set_sub_flags(a, b, a - b);
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+
+	uop_fused_skip();
+	uop_fused_branch(op);
+}
+
+// two immediate moves, PC may not be target
+static inline __ALWAYS_INLINE void uop_mov_imm_pair(struct uop *op) 
+{
+	put_reg_nopc(UOP_PAIR_REG(op, 0), op->mov_imm_pair.immediate);
+	put_reg_nopc(UOP_PAIR_REG(op, 1), op->mov_imm_pair.immediate2);
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_DATA_PROC);
+	inc_perf_counter(OP_DATA_PROC);
+#endif
+
+	uop_fused_skip();
+}
+
+static inline __ALWAYS_INLINE void uop_multiply(struct uop *op) 
+{
+	// multiply the first two operands
+	word temp_word = get_reg(op->mul.source_reg);
+	word temp_word2 = get_reg(op->mul.source2_reg) * temp_word;
+
+	// add a third one conditionally
+	if(op->flags & UOPMULFLAGS_ACCUMULATE)
+		temp_word2 += get_reg(op->mul.accum_reg);
+
+	// store the result
+	put_reg(op->mul.dest_reg, temp_word2);
+
+	// set the NZ bits on exit
+	if(op->flags & UOPMULFLAGS_S_BIT)
+		set_NZ_condition(temp_word2);
+
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(get_core() <= ARM9) {
+		int signed_word = temp_word;
+
+		if ((signed_word >> 8) == 0 || (signed_word >> 8) == -1)
+			add_to_perf_counter(CYCLE_COUNT, 1);
+		else if ((signed_word >> 16) == 0 || (signed_word >> 16) == -1)
+			add_to_perf_counter(CYCLE_COUNT, 2);
+		else if ((signed_word >> 24) == 0 || (signed_word >> 24) == -1)
+			add_to_perf_counter(CYCLE_COUNT, 3);
+	} else /* if(get_core() == ARM9e) */ {
+		/* ARM9e core can do the multiply in 2 cycles, with an interlock */
+		add_to_perf_counter(CYCLE_COUNT, 1);
+		// XXX schedule interlock here
+	}
+#endif
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_MUL);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_multiply_long(struct uop *op) 
+{
+	word reslo, reshi;
+	uint64_t result;
+
+	// get the first two operands
+	word temp_word = get_reg(op->mull.source_reg);
+	word temp_word2 = get_reg(op->mull.source2_reg);
+
+	// signed or unsigned multiply
+	// XXX is this correct
+	if(op->flags & UOPMULFLAGS_SIGNED) {
+		result = (int64_t)(int)temp_word * (int)temp_word2;
+	} else {
+		result = (uint64_t)temp_word * temp_word2;
+	}
+
+	// accumulate
+	if(op->flags & UOPMULFLAGS_ACCUMULATE) {
+		uint64_t acc = get_reg(op->mull.desthi_reg);
+		acc = (acc << 32) | get_reg(op->mull.destlo_reg);
+		result += acc;
+	}
+
+	// store the results
+	reslo = result;
+	reshi = result >> 32;
+	put_reg(op->mull.destlo_reg, reslo);
+	put_reg(op->mull.desthi_reg, reshi);
+
+	// set the NZ bits on exit
+	if(op->flags & UOPMULFLAGS_S_BIT) {
+		set_condition(PSR_CC_NEG, BIT(reshi, 31));
+		set_condition(PSR_CC_ZERO, (reslo | reshi) == 0);
+	}
+
+#if UOP_COUNT_CYCLES
+	// cycle count
+	if(get_core() <= ARM9) {
+		if ((temp_word >> 8) == 0)
+			add_to_perf_counter(CYCLE_COUNT, 2);
+		else if ((temp_word >> 16) == 0)
+			add_to_perf_counter(CYCLE_COUNT, 3);
+		else if ((temp_word >> 24) == 0)
+			add_to_perf_counter(CYCLE_COUNT, 4);
+	} else /* if(get_core() == ARM9e) */ {
+		/* ARM9e core can do the multiply in 3 cycles, with an interlock */
+		add_to_perf_counter(CYCLE_COUNT, 2);
+		// XXX schedule interlock here
+	}
+#endif
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_MUL);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_swap(struct uop *op)
+{
+	word mem_reg_val, source_reg_val;
+	armaddr_t addr;
+
+	ASSERT_VALID_REG(op->swp.dest_reg);
+	ASSERT_VALID_REG(op->swp.source_reg);
+	ASSERT_VALID_REG(op->swp.mem_reg);
+
+	source_reg_val = get_reg(op->swp.source_reg);
+	mem_reg_val = get_reg(op->swp.mem_reg);
+
+	addr = mem_reg_val & 0xfffffffc;
+
+	if(!op->swp.b) {
+		word temp;
+
+		// the other cores could get in between a separate load and store
+		if(cpu.cluster->num_cores > 1) {
+			if(mmu_swap_mem_word(addr, source_reg_val, &temp))
+				return; // data abort
+		} else {
+			if(mmu_read_mem_word(addr, &temp))
+				return; // data abort
+		}
+
+		// simulate the weird unaligned access behavior
+		switch(mem_reg_val & 0x3) {
+			default:
+			case 0:
+				break;
+			case 1:
+				temp = ROR(temp, 8);
+				break;
+			case 2:
+				temp = ROR(temp, 16);
+				break;
+			case 3:
+				temp = ROR(temp, 24);
+				break;
+		}
+
+		// do the swap, unless the exchange above already did
+		if(cpu.cluster->num_cores == 1 && mmu_write_mem_word(addr, source_reg_val))
+			return; // data abort
+		put_reg(op->swp.dest_reg, temp);
+	} else {
+		// byte version, works on any byte not just the aligned one
+		byte temp;
+		if(cpu.cluster->num_cores > 1) {
+			if(mmu_swap_mem_byte(mem_reg_val, source_reg_val, &temp))
+				return; // data abort
+		} else {
+			if(mmu_read_mem_byte(mem_reg_val, &temp))
+				return; // data abort
+			if(mmu_write_mem_byte(mem_reg_val, source_reg_val))
+				return; // data abort
+		}
+		put_reg(op->swp.dest_reg, temp);
+	}
+}
+
+static inline __ALWAYS_INLINE void uop_count_leading_zeros(struct uop *op)
+{
+	word val;
+	int count;
+
+	ASSERT_VALID_REG(op->count_leading_zeros.source_reg);
+	ASSERT_VALID_REG(op->count_leading_zeros.dest_reg);
+
+	// get the value we're supposed to count
+	val = get_reg(op->count_leading_zeros.source_reg);
+	
+	count = clz(val);
+	
+	// put the result back
+	put_reg(op->count_leading_zeros.dest_reg, count);
+
+	// XXX cycle count, or is it always 1 cycle?
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_MISC);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_move_to_sr_imm(struct uop *op) 
+{
+	reg_t old_psr, new_psr;
+
+	if(op->flags & UOPMSR_R_BIT) {
+		// spsr
+		old_psr = cpu.spsr;
+	} else {
+		// cpsr
+		old_psr = get_cpsr();
+	}
+	
+	word field_mask = op->move_to_sr_imm.field_mask;
+	
+	// if we're in user mode, we can only modify the top 8 bits
+	if(!arm_in_priviledged())
+		field_mask &= 0xff000000;
+
+	// or in the new immediate value
+	new_psr = (old_psr & ~field_mask) | (op->move_to_sr_imm.immediate & field_mask);
+
+	// write the new value back
+	if(op->flags & UOPMSR_R_BIT) {
+		// spsr
+		// NOTE: UNPREDICTABLE if the cpu is in user or system mode
+		cpu.spsr = new_psr;
+	} else {
+		// cpsr
+		set_cpu_mode(new_psr & PSR_MODE_MASK);
+		put_cpsr(new_psr);
+
+#if UOP_COUNT_CYCLES
+		// cycle count
+		if(field_mask & 0x00ffffff)
+			add_to_perf_counter(CYCLE_COUNT, 2); // we updated something other than the status flags
+#endif
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_MISC);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_move_to_sr_reg(struct uop *op) 
+{
+	reg_t old_psr, new_psr;
+
+	if(op->flags & UOPMSR_R_BIT) {
+		// spsr
+		old_psr = cpu.spsr;
+	} else {
+		// cpsr
+		old_psr = get_cpsr();
+	}
+	
+	word field_mask = op->move_to_sr_imm.field_mask;
+	word temp_word = get_reg(op->move_to_sr_reg.reg);
+	
+	// if we're in user mode, we can only modify the top 8 bits
+	if(!arm_in_priviledged())
+		field_mask &= 0xff000000;
+
+	// or in the new immediate value
+	new_psr = (old_psr & ~field_mask) | (temp_word & field_mask);
+
+	// write the new value back
+	if(op->flags & UOPMSR_R_BIT) {
+		// spsr
+		// NOTE: UNPREDICTABLE if the cpu is in user or system mode
+		cpu.spsr = new_psr;
+	} else {
+		// cpsr
+		set_cpu_mode(new_psr & PSR_MODE_MASK);
+		put_cpsr(new_psr);
+
+#if UOP_COUNT_CYCLES
+		// cycle count
+		if(field_mask & 0x00ffffff)
+			add_to_perf_counter(CYCLE_COUNT, 2); // we updated something other than the status flags
+#endif
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_MISC);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_move_from_sr(struct uop *op) 
+{
+	if(op->flags & UOPMSR_R_BIT) {
+		// NOTE: UNPREDICTABLE if the cpu is in user or system mode
+		put_reg(op->move_from_sr.reg, cpu.spsr);
+	} else {
+		put_reg(op->move_from_sr.reg, get_cpsr());
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_MISC);
+#endif
+#if UOP_COUNT_CYCLES
+	// 2 cycles on arm9+
+	if(get_core() >= ARM9)
+		add_to_perf_counter(CYCLE_COUNT, 1);
+#endif
+}
+
+
+static inline __ALWAYS_INLINE void uop_undefined(struct uop *op) 
+{
+	raise_exception(EX_UNDEFINED);
+	
+//	UOP_TRACE(0, "undefined instruction at 0x%x\n", get_reg(PC));
+
+#if UOP_COUNT_CYCLES
+	if(get_core() == ARM7)
+		add_to_perf_counter(CYCLE_COUNT, 3);
+	else /* if(get_core() >= ARM9) */
+		add_to_perf_counter(CYCLE_COUNT, 2);
+#endif
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_MISC);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_swi(struct uop *op) 
+{
+	if(unlikely(cpu.semihosting) &&
+			op->swi.comment == (get_condition(PSR_THUMB) ? SEMIHOST_SWI_THUMB : SEMIHOST_SWI_ARM))
+		semihost_call();
+	else
+		raise_exception(EX_SWI);
+
+	// always takes 3 cycles
+#if UOP_COUNT_CYCLES
+	add_to_perf_counter(CYCLE_COUNT, 2);
+#endif
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_MISC);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_bkpt(struct uop *op) 
+{
+	if(unlikely(cpu.semihosting) && op->swi.comment == SEMIHOST_BKPT)
+		semihost_call();
+	else
+		raise_exception(EX_PREFETCH);
+
+	// always takes 3 cycles
+#if UOP_COUNT_CYCLES
+	add_to_perf_counter(CYCLE_COUNT, 2);
+#endif
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_MISC);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_coproc_reg_transfer(struct uop *op) 
+{
+	struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
+
+	if(cp->installed) {
+		cp->reg_transfer(op->coproc.raw_instruction, cp->data);
+	} else {
+		/* coprocessor not present, same as an undefined instruction */
+		uop_undefined(op);
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_COP_REG_TRANS);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_coproc_double_reg_transfer(struct uop *op) 
+{
+	struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
+
+	if(cp->installed) {
+		cp->double_reg_transfer(op->coproc.raw_instruction, cp->data);
+	} else {
+		/* coprocessor not present, same as an undefined instruction */
+		uop_undefined(op);
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_COP_REG_TRANS);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_coproc_data_processing(struct uop *op) 
+{
+	struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
+
+	if(cp->installed) {
+		cp->data_processing(op->coproc.raw_instruction, cp->data);
+	} else {
+		/* coprocessor not present, same as an undefined instruction */
+		uop_undefined(op);
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_COP_DATA_PROC);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_coproc_load_store(struct uop *op) 
+{
+	struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
+
+	if(cp->installed) {
+		cp->load_store(op->coproc.raw_instruction, cp->data);
+	} else {
+		/* coprocessor not present, same as an undefined instruction */
+		uop_undefined(op);
+	}
+
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_COP_LOAD_STORE);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_nop(struct uop *op) 
+{
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_NOP);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_bad_opcode(struct uop *op) 
+{
+	panic_cpu("bad uop decode, bailing...\n");
+}
+
+/* opcode -> handler list, expanded into either the switch or the threaded dispatcher */
+#define UOP_HANDLER_LIST \
+	UOP_HANDLER(NOP, uop_nop) \
+	UOP_HANDLER(DECODE_ME_ARM, uop_decode_me_arm) \
+	UOP_HANDLER(DECODE_ME_THUMB, uop_decode_me_thumb) \
+	UOP_HANDLER(CHUNK_NEXT, uop_chunk_next) \
+	UOP_HANDLER(B_IMMEDIATE, uop_b_immediate) \
+	UOP_HANDLER(B_IMMEDIATE_LOCAL, uop_b_immediate_local) \
+	UOP_HANDLER(B_REG, uop_b_reg) \
+	UOP_HANDLER(B_REG_OFFSET, uop_b_reg_offset) \
+	UOP_HANDLER(LOAD_IMMEDIATE_WORD, uop_load_immediate_word) \
+	UOP_HANDLER(LOAD_IMMEDIATE_HALFWORD, uop_load_immediate_halfword) \
+	UOP_HANDLER(LOAD_IMMEDIATE_BYTE, uop_load_immediate_byte) \
+	UOP_HANDLER(LOAD_IMMEDIATE_OFFSET, uop_load_immediate_offset) \
+	UOP_HANDLER(LOAD_SCALED_REG_OFFSET, uop_load_scaled_reg_offset) \
+	UOP_HANDLER(STORE_IMMEDIATE_OFFSET, uop_store_immediate_offset) \
+	UOP_HANDLER(STORE_SCALED_REG_OFFSET, uop_store_scaled_reg_offset) \
+	UOP_HANDLER(LOAD_MULTIPLE, uop_load_multiple) \
+	UOP_HANDLER(LOAD_MULTIPLE_S, uop_load_multiple_s) \
+	UOP_HANDLER(STORE_MULTIPLE, uop_store_multiple) \
+	UOP_HANDLER(STORE_MULTIPLE_S, uop_store_multiple_s) \
+	UOP_HANDLER(DATA_PROCESSING_IMM, uop_data_processing_imm) \
+	UOP_HANDLER(DATA_PROCESSING_REG, uop_data_processing_reg) \
+	UOP_HANDLER(DATA_PROCESSING_IMM_S, uop_data_processing_imm_s) \
+	UOP_HANDLER(DATA_PROCESSING_REG_S, uop_data_processing_reg_s) \
+	UOP_HANDLER(DATA_PROCESSING_IMM_SHIFT, uop_data_processing_imm_shift) \
+	UOP_HANDLER(DATA_PROCESSING_REG_SHIFT, uop_data_processing_reg_shift) \
+	UOP_HANDLER(MOV_IMM, uop_mov_imm) \
+	UOP_HANDLER(MOV_IMM_NZ, uop_mov_imm_nz) \
+	UOP_HANDLER(MOV_REG, uop_mov_reg) \
+	UOP_HANDLER(CMP_IMM_S, uop_cmp_imm_s) \
+	UOP_HANDLER(CMP_REG_S, uop_cmp_reg_s) \
+	UOP_HANDLER(CMN_REG_S, uop_cmn_reg_s) \
+	UOP_HANDLER(TST_REG_S, uop_tst_reg_s) \
+	UOP_HANDLER(ADD_IMM, uop_add_imm) \
+	UOP_HANDLER(ADD_IMM_S, uop_add_imm_s) \
+	UOP_HANDLER(ADD_REG, uop_add_reg) \
+	UOP_HANDLER(ADD_REG_S, uop_add_reg_s) \
+	UOP_HANDLER(ADC_REG_S, uop_adc_reg_s) \
+	UOP_HANDLER(SUB_REG_S, uop_sub_reg_s) \
+	UOP_HANDLER(SBC_REG_S, uop_sbc_reg_s) \
+	UOP_HANDLER(AND_IMM, uop_and_imm) \
+	UOP_HANDLER(ORR_IMM, uop_orr_imm) \
+	UOP_HANDLER(ORR_REG_S, uop_orr_reg_s) \
+	UOP_HANDLER(LSL_IMM, uop_lsl_imm) \
+	UOP_HANDLER(LSL_IMM_S, uop_lsl_imm_s) \
+	UOP_HANDLER(LSL_REG, uop_lsl_reg) \
+	UOP_HANDLER(LSL_REG_S, uop_lsl_reg_s) \
+	UOP_HANDLER(LSR_IMM, uop_lsr_imm) \
+	UOP_HANDLER(LSR_IMM_S, uop_lsr_imm_s) \
+	UOP_HANDLER(LSR_REG, uop_lsr_reg) \
+	UOP_HANDLER(LSR_REG_S, uop_lsr_reg_s) \
+	UOP_HANDLER(ASR_IMM, uop_asr_imm) \
+	UOP_HANDLER(ASR_IMM_S, uop_asr_imm_s) \
+	UOP_HANDLER(ASR_REG, uop_asr_reg) \
+	UOP_HANDLER(ASR_REG_S, uop_asr_reg_s) \
+	UOP_HANDLER(ROR_REG, uop_ror_reg) \
+	UOP_HANDLER(ROR_REG_S, uop_ror_reg_s) \
+	UOP_HANDLER(AND_REG_S, uop_and_reg_s) \
+	UOP_HANDLER(EOR_REG_S, uop_eor_reg_s) \
+	UOP_HANDLER(BIC_REG_S, uop_bic_reg_s) \
+	UOP_HANDLER(NEG_REG_S, uop_neg_reg_s) \
+	UOP_HANDLER(MVN_REG_S, uop_mvn_reg_s) \
+	UOP_HANDLER(CMP_IMM_BCC_LOCAL, uop_cmp_imm_bcc_local) \
+	UOP_HANDLER(CMP_REG_BCC_LOCAL, uop_cmp_reg_bcc_local) \
+	UOP_HANDLER(MOV_IMM_PAIR, uop_mov_imm_pair) \
+	UOP_HANDLER(MULTIPLY, uop_multiply) \
+	UOP_HANDLER(MULTIPLY_LONG, uop_multiply_long) \
+	UOP_HANDLER(SWAP, uop_swap) \
+	UOP_HANDLER(COUNT_LEADING_ZEROS, uop_count_leading_zeros) \
+	UOP_HANDLER(MOVE_TO_SR_IMM, uop_move_to_sr_imm) \
+	UOP_HANDLER(MOVE_TO_SR_REG, uop_move_to_sr_reg) \
+	UOP_HANDLER(MOVE_FROM_SR, uop_move_from_sr) \
+	UOP_HANDLER(UNDEFINED, uop_undefined) \
+	UOP_HANDLER(SWI, uop_swi) \
+	UOP_HANDLER(BKPT, uop_bkpt) \
+	UOP_HANDLER(COPROC_REG_TRANSFER, uop_coproc_reg_transfer) \
+	UOP_HANDLER(COPROC_DOUBLE_REG_TRANSFER, uop_coproc_double_reg_transfer) \
+	UOP_HANDLER(COPROC_DATA_PROCESSING, uop_coproc_data_processing) \
+	UOP_HANDLER(COPROC_LOAD_STORE, uop_coproc_load_store)
+
+#if WITH_JIT
+/* out of line copies of the handlers for translated code to call */
+#define UOP_HANDLER(opcode, func) \
+static void func##_call(struct uop *op) \
+{ \
+	func(op); \
+}
+
+UOP_HANDLER_LIST
+#undef UOP_HANDLER
+
+#define UOP_HANDLER(opcode, func) [opcode] = func##_call,
+static const uop_handler_func handler_funcs[MAX_UOP_OPCODE] = {
+	UOP_HANDLER_LIST
+};
+#undef UOP_HANDLER
+#endif
+
+/*
+ * Bookkeeping done once at the start of every basic block. Returns FALSE if
+ * the dispatcher should try again (exception taken or codepage fault), or
+ * leave if restart_dispatch is set.
+ */
+static inline __ALWAYS_INLINE bool uop_block_start(void)
+{
+	UOP_HOT_TRACE(10, "\nUOP: start of new block\n");
+
+	// in the last instruction we wrote something else into r[PC], so sync it with
+	// the real program counter cpu.pc
+	if(unlikely(cpu.r15_dirty)) {
+		UOP_HOT_TRACE(9, "UOP: r15 dirty\n");
+		cpu.r15_dirty = FALSE;
+		uop_cover_edge(cpu.pc, cpu.r[PC]); // B_REG and B_REG_OFFSET get their edges here too
+
+		if(cpu.curr_cp && (cpu.pc >> MMU_PAGESIZE_SHIFT) == (cpu.r[PC] >> MMU_PAGESIZE_SHIFT)) {
+			cpu.cp_pc = PC_TO_CPPC(cpu.r[PC]);
+		} else {
+			// a return through mov pc or ldm usually lands back in the page of the last
+			// call or exception, and an exception entry leaves the vector page there, see
+			// uop_exception_entry. a thumb switch lets go of the codepage, but the return
+			// stack can still have the right one
+			cpu.curr_cp = rsb_pop(cpu.r[PC], get_condition(PSR_THUMB) ? TRUE : FALSE);
+			if(cpu.curr_cp)
+				cpu.cp_pc = PC_TO_CPPC(cpu.r[PC]);
+			// otherwise will load a new codepage in a few lines
+		}
+		cpu.pc = cpu.r[PC];
+	}
+
+	// exceptions and scheduled events, only when something asked or one is due
+	if(unlikely(atomic_load_relaxed(&cpu.event_request) || cpu.guest_time >= cpu.next_event)) {
+		if(!cpu_service_events())
+			return FALSE;
+	}
+
+	/* see if we are off the end of a codepage, or the codepage was removed out from underneath us */
+	if(unlikely(cpu.curr_cp == NULL)) {
+		UOP_HOT_TRACE(7, "UOP: curr_cp == NULL, setting new codepage\n");
+		if(set_codepage(cpu.pc))
+			return FALSE; // MMU translation error reading it
+	}
+
+	ASSERT(cpu.curr_cp != NULL);
+	ASSERT(cpu.cp_pc != NULL);
+
+#if UOP_RECORD
+	btrace_block();
+#endif
+
+	return TRUE;
+}
+
+/* per uop work inside a block: fetch the next op and move the program counter past it */
+static inline __ALWAYS_INLINE struct uop *uop_next(void)
+{
+	struct uop *op;
+
+	op = cpu.cp_pc;
+	UOP_HOT_TRACE(8, "UOP: opcode %3d %32s, pc 0x%x, cp_pc %p, curr_cp %p\n", op->opcode, uop_opcode_to_str(op->opcode), cpu.pc, cpu.cp_pc, cpu.curr_cp);
+#if UOP_COUNT_UOPS
+	inc_perf_counter(UOP_BASE + op->opcode);
+#endif
+#if UOP_RECORD
+	btrace_ins(cpu.pc, op->opcode);
+#endif
+
+	/* increment the program counter */
+	int pc_inc = cpu.curr_cp->pc_inc;
+	cpu.pc += pc_inc; // next pc
+	cpu.r[PC] = cpu.pc + pc_inc; // during the course of the instruction, r15 looks like it's +8 or +4 (arm vs thumb)
+	cpu.cp_pc++;
+
+#if UOP_TRACE_UOPS
+	if(TRACE_CPU_LEVEL >= 10 
+	   && op->opcode != DECODE_ME_ARM 
+	   && op->opcode != DECODE_ME_THUMB)
+		dump_cpu();
+#endif
+
+	return op;
+}
+
+/* should we drop out of the current block after a uop with these block flags */
+static inline __ALWAYS_INLINE bool uop_block_exit(int block_flags)
+{
+	if(likely(block_flags == 0))
+		return FALSE;
+	if(block_flags & UOP_BLOCK_END)
+		return TRUE;
+
+	// memory op, see if it aborted or stored into the codepage we're running out of
+	return (atomic_load_relaxed(&cpu.pending_exceptions) & EX_DATA_ABT) != 0 || cpu.curr_cp == NULL;
+}
+
+/* bookkeeping done at the end of every basic block */
+static inline __ALWAYS_INLINE void uop_block_end(int ins_count)
+{
+	// guest time, whatever else is being counted
+	cpu.guest_time += ins_count;
+
+	// instruction count
+#if UOP_COUNT_INS
+	add_to_perf_counter(INS_COUNT, ins_count);
+#endif
+#if UOP_COUNT_CYCLES
+	add_to_perf_counter(CYCLE_COUNT, ins_count);
+#endif
+}
+
+static inline __ALWAYS_INLINE void uop_skipped_condition(struct uop *op)
+{
+	UOP_HOT_TRACE(8, "UOP: opcode not executed due to condition 0x%x\n", op->cond);
+#if UOP_COUNT_ARM_OPS
+	inc_perf_counter(OP_SKIPPED_CONDITION);
+#endif
+}
+
+/*
+ * Both engines run a basic block at a time. The per block bookkeeping (pc sync,
+ * event check, codepage lookup) is done in uop_block_start, the instruction
+ * and cycle counts for the block are accumulated locally and added in one shot
+ * at the end of the block.
+ */
+#if UOP_DISPATCH == UOP_DISPATCH_THREADED
+
+static int dispatch_loop(void)
+{
+	struct uop *op;
+	int block_flags;
+	int block_ins;
+
+	/* label table, indexed by opcode. converted to offsets off the base label for struct uop */
+#define UOP_HANDLER(opcode, func) [opcode] = &&do_##opcode,
+	static const void * const handler_labels[MAX_UOP_OPCODE] = {
+		UOP_HANDLER_LIST
+	};
+#undef UOP_HANDLER
+	int i;
+
+	for(i = 0; i < MAX_UOP_OPCODE; i++) {
+		if(handler_labels[i])
+			uop_handler_offset[i] = (const char *)handler_labels[i] - (const char *)&&do_bad_opcode;
+		else
+			uop_handler_offset[i] = 0;
+	}
+
+	/* fetch the next op and jump straight to its handler, unless the last op ended the block */
+#define DISPATCH_NEXT() \
+	do { \
+		if(unlikely(uop_block_exit(block_flags))) \
+			goto block_end; \
+		op = uop_next(); \
+		block_ins++; \
+		block_flags = op->block_flags; \
+		if(unlikely(!check_condition(op->cond))) \
+			goto skipped_condition; \
+		goto *(const void *)((const char *)&&do_bad_opcode + op->handler); \
+	} while(0)
+
+	block_ins = 0;
+
+block_end:
+	uop_block_end(block_ins);
+	block_ins = 0;
+	block_flags = 0;
+	while(unlikely(!uop_block_start())) {
+		if(unlikely(cpu.restart_dispatch))
+			return 0;
+	}
+#if WITH_JIT && !UOP_TRACE_UOPS && !UOP_RECORD && !UOP_COVER // translated code doesn't trace
+	if(jit_enabled) {
+		block_ins = jit_execute(cpu.cp_pc);
+		if(block_ins)
+			goto block_end;
+	}
+#endif
+	DISPATCH_NEXT();
+
+skipped_condition:
+	uop_skipped_condition(op);
+	DISPATCH_NEXT();
+
+do_bad_opcode:
+	uop_bad_opcode(op);
+	DISPATCH_NEXT();
+
+#define UOP_HANDLER(opcode, func) \
+do_##opcode: \
+	func(op); \
+	DISPATCH_NEXT();
+
+	UOP_HANDLER_LIST
+#undef UOP_HANDLER
+#undef DISPATCH_NEXT
+
+	return 0;
+}
+
+#else
+
+static int dispatch_loop(void)
+{
+	/* main dispatch loop */
+	for(;;) {
+		struct uop *op;
+		int block_flags;
+		int block_ins;
+
+		if(unlikely(!uop_block_start())) {
+			if(unlikely(cpu.restart_dispatch))
+				break;
+			continue;
+		}
+
+#if WITH_JIT && !UOP_TRACE_UOPS && !UOP_RECORD && !UOP_COVER
+		if(jit_enabled) {
+			block_ins = jit_execute(cpu.cp_pc);
+			if(block_ins) {
+				uop_block_end(block_ins);
+				continue;
+			}
+		}
+#endif
+
+		/* run until the end of the block */
+		block_ins = 0;
+		do {
+			/* get the next op and dispatch it */
+			op = uop_next();
+			block_ins++;
+			block_flags = op->block_flags;
+
+			if(unlikely(!check_condition(op->cond))) {
+				uop_skipped_condition(op);
+				continue; // not executed
+			}
+
+			switch(op->opcode) {
+#define UOP_HANDLER(opcode, func) \
+				case opcode: \
+					func(op); \
+					break;
+
+				UOP_HANDLER_LIST
+#undef UOP_HANDLER
+				default:
+					uop_bad_opcode(op);
+			}
+		} while(!uop_block_exit(block_flags));
+
+		uop_block_end(block_ins);
+	}
+
+	return 0;
+}
+
+#endif
+
+const struct uop_variant UOP_VARIANT = {
+	.name = UOP_VARIANT_NAME,
+	.dispatch_loop = dispatch_loop,
+#if WITH_JIT
+	.handler_funcs = handler_funcs,
+#endif
+	.counts_ops = UOP_COUNT_ARM_OPS || UOP_COUNT_UOPS || UOP_COUNT_ARITH_UOPS,
+};
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __ARM_UOP_P_H
+#define __ARM_UOP_P_H
+
+/* uop dispatch internals, shared between the codepage cache and the dispatch loops */
+#include <arm/arm.h>
+#include <arm/jit.h>
+
+/* one compiled copy of the handlers and dispatch loop, see uop_handlers.h */
+struct uop_variant {
+	const char *name;
+	int (*dispatch_loop)(void); // returns when the instrumentation level is changed
+#if WITH_JIT
+	const uop_handler_func *handler_funcs;
+#endif
+	bool counts_ops; // the handlers count themselves, so translated code can't do them inline
+};
+
+extern const struct uop_variant uop_variant_bare;
+extern const struct uop_variant uop_variant_icount;
+extern const struct uop_variant uop_variant_cycles;
+extern const struct uop_variant uop_variant_full;
+extern const struct uop_variant uop_variant_trace; // any of the above, plus the per uop traces
+extern const struct uop_variant uop_variant_record; // instruction count and the binary trace
+extern const struct uop_variant uop_variant_cover; // nothing counted, edge coverage for fuzzing
+
+#if UOP_DISPATCH == UOP_DISPATCH_THREADED
+/* offset of each opcode's handler in the running threaded dispatcher, set up when the dispatch loop starts */
+extern __thread int32_t uop_handler_offset[MAX_UOP_OPCODE];
+#endif
+
+/* decode an undecoded slot in place */
+void uop_decode_arm(struct uop *op);
+void uop_decode_thumb(struct uop *op);
+void uop_set_block_flags(struct uop *op);
+
+/* codepage cache */
+struct uop *alloc_codepage_chunk(struct uop_codepage *cp, int n);
+struct uop_codepage *find_codepage(armaddr_t pc, bool thumb);
+bool set_codepage(armaddr_t pc);
+
+static inline cp_handle_t codepage_to_handle(struct uop_codepage *cp)
+{
+	return (cp_handle_t)((byte *)cp - cpu.cp_arena);
+}
+
+static inline struct uop_codepage *handle_to_codepage(cp_handle_t handle)
+{
+	return (struct uop_codepage *)(cpu.cp_arena + handle);
+}
+
+/* find the uop slot for pc in a codepage, allocating its chunk the first time it's run */
+static inline __ALWAYS_INLINE struct uop *codepage_slot(struct uop_codepage *cp, armaddr_t pc)
+{
+	unsigned int index = (pc % MMU_PAGESIZE) >> cp->pc_shift;
+	struct uop *chunk = cp->chunks[index / CP_CHUNK_INS];
+
+	if(unlikely(chunk == NULL))
+		chunk = alloc_codepage_chunk(cp, index / CP_CHUNK_INS);
+	return &chunk[index % CP_CHUNK_INS];
+}
+
+#define PC_TO_CPPC(pc) codepage_slot(cpu.curr_cp, (pc))
+
+/* get a uop copied in from somewhere else ready to run here */
+void uop_relocate(struct uop *op);
+
+/* decoding ahead on a worker thread, see uop_predecode.c */
+void uop_predecode_init(void);
+void uop_predecode_shutdown(void);
+void uop_predecode_page(struct uop_codepage *cp, unsigned int slot);
+void uop_predecode_forget(struct uop_codepage *cp);
+bool uop_copy_predecoded(struct uop_codepage *cp, struct uop *op);
+
+/* fill in an undecoded slot from the worker's copy of it, if it got that far */
+static inline bool uop_take_predecoded(struct uop_codepage *cp, struct uop *op)
+{
+	if(likely(cp->predecoded == NULL))
+		return FALSE;
+	return uop_copy_predecoded(cp, op);
+}
+
+/* persistent translation cache, see uop_cache.c */
+void uop_cache_open(void);
+void uop_cache_close(void);
+void uop_cache_save(void);
+bool uop_cache_fill(struct uop_codepage *cp);
+
+/* is cp a valid codepage for a branch to target, in the current address space */
+static inline __ALWAYS_INLINE bool codepage_matches(struct uop_codepage *cp, armaddr_t target, bool thumb)
+{
+	return cp->address == (target & ~(MMU_PAGESIZE-1)) && cp->thumb == thumb &&
+		cp->generation == cpu.codepage_generation;
+}
+
+/* remember where a nonlocal call will return to */
+static inline __ALWAYS_INLINE void rsb_push(armaddr_t return_addr)
+{
+	cpu.rsb_top = (cpu.rsb_top + 1) % RSB_SIZE;
+	cpu.rsb[cpu.rsb_top].addr = return_addr;
+	cpu.rsb[cpu.rsb_top].cp = cpu.curr_cp;
+}
+
+#endif
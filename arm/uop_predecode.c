@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * decoding ahead of the core, [cpu] predecode. each core gets a worker thread, and
+ * when the core loads a codepage out of plain memory the worker starts decoding it
+ * at the pc that was wanted, following the code through to the static branch
+ * targets inside the page, until it gets to the end of each path.
+ *
+ * the worker never touches the codepage's own slots, the core is running out of
+ * those. it decodes into a copy of its own on the side, and publishes each uop there
+ * with a flag set once the uop is all written. when the core gets to an undecoded
+ * slot it takes the worker's uop if the flag is set, then finishes it off the way it
+ * would one it decoded itself, so nothing the core runs is ever half written.
+ *
+ * the core is the only one freeing codepages. a page the worker still has queued is
+ * dropped from the queue, and if the worker is in the middle of one the core waits
+ * for it to notice and let go first.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
+#include <debug.h>
+#include <config.h>
+#include <arm/arm.h>
+#include <arm/decoder.h>
+#include <util/atomic.h>
+#include <util/endian.h>
+#include "uop_p.h"
+
+#define PREDECODE_QUEUE 64 // codepages waiting on the worker, newest first, the oldest are dropped past this
+#define PREDECODE_TARGETS 64 // branch targets waiting to be followed in a page
+
+/* the worker's copy of one chunk of a codepage */
+struct predecoded_chunk {
+	struct uop ops[CP_CHUNK_INS];
+	volatile byte ready[CP_CHUNK_INS]; // set once ops[i] is all there
+};
+
+struct uop_predecoded {
+	struct predecoded_chunk *volatile chunks[CP_MAX_CHUNKS]; // allocated by the worker as it gets to them
+	byte visited[NUM_CODEPAGE_INS_THUMB]; // the worker's alone
+};
+
+/* what the worker needs of a codepage, it can't look at the codepage itself */
+struct predecode_request {
+	struct uop_codepage *cp; // NULL if the core has since freed it
+	struct uop_predecoded *copy;
+	armaddr_t address;
+	const void *host_ptr;
+	bool thumb;
+	unsigned int slot;
+};
+
+struct uop_predecoder {
+	SDL_Thread *thread;
+	SDL_mutex *lock;
+	SDL_cond *cond; // signalled for new work, and when the worker lets go of a page
+
+	struct predecode_request queue[PREDECODE_QUEUE];
+	unsigned int head, tail;
+	struct uop_codepage *busy; // being decoded, the core can't free it until the worker lets go
+	volatile bool cancel; // the core wants busy back
+	bool quit;
+
+	// the decoders look at these in cpu
+	enum arm_instruction_set isa;
+	enum arm_core core;
+	int core_id;
+};
+
+/* should the worker carry on past op to the next instruction */
+static bool predecode_falls_through(const struct uop *op)
+{
+	if(op->cond != COND_AL || !(op->block_flags & UOP_BLOCK_END))
+		return TRUE;
+
+	switch(op->opcode) {
+		case B_IMMEDIATE:
+		case B_IMMEDIATE_LOCAL:
+		case B_REG:
+		case B_REG_OFFSET:
+			return (op->flags & UOPBFLAGS_LINK) != 0; // calls come back
+		case SWI:
+		case BKPT:
+		case MOVE_TO_SR_IMM:
+		case MOVE_TO_SR_REG:
+		case STORE_MULTIPLE_S:
+		case COPROC_REG_TRANSFER:
+		case COPROC_DOUBLE_REG_TRANSFER:
+		case COPROC_DATA_PROCESSING:
+		case COPROC_LOAD_STORE:
+			return TRUE;
+		case LOAD_MULTIPLE_S:
+			return !(op->load_store_multiple.reg_bitmap & (1 << PC));
+		default:
+			return FALSE; // a write to the pc, or undefined
+	}
+}
+
+static void predecode_publish(struct uop_predecoded *copy, unsigned int slot, const struct uop *op)
+{
+	struct predecoded_chunk *chunk = copy->chunks[slot / CP_CHUNK_INS];
+
+	if(!chunk) {
+		chunk = calloc(1, sizeof(struct predecoded_chunk));
+		atomic_store_release(&copy->chunks[slot / CP_CHUNK_INS], chunk);
+	}
+	chunk->ops[slot % CP_CHUNK_INS] = *op;
+	atomic_store_release(&chunk->ready[slot % CP_CHUNK_INS], 1);
+}
+
+/* follow the code from req->slot, on the worker */
+static void predecode_codepage(struct uop_predecoder *pd, const struct predecode_request *req)
+{
+	unsigned int targets[PREDECODE_TARGETS];
+	int num_targets = 0;
+	int pc_inc = req->thumb ? 2 : 4;
+	int pc_shift = req->thumb ? 1 : 2;
+	unsigned int num_ins = req->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM;
+
+	targets[num_targets++] = req->slot;
+	while(num_targets > 0 && !pd->cancel) {
+		unsigned int slot;
+
+		for(slot = targets[--num_targets]; slot < num_ins && !req->copy->visited[slot] && !pd->cancel; slot++) {
+			struct uop op;
+
+			req->copy->visited[slot] = TRUE;
+
+			memset(&op, 0, sizeof(op));
+			op.opcode = req->thumb ? DECODE_ME_THUMB : DECODE_ME_ARM;
+			op.cond = COND_AL;
+			op.undecoded.slot = slot;
+			if(req->thumb)
+				op.undecoded.raw_instruction = READ_MEM_HALFWORD((const byte *)req->host_ptr + slot * 2);
+			else
+				op.undecoded.raw_instruction = READ_MEM_WORD((const byte *)req->host_ptr + slot * 4);
+
+			// as if the core was running it, the pc is the next instruction and r15 one past that
+			cpu.pc = req->address + (slot << pc_shift) + pc_inc;
+			cpu.r[PC] = cpu.pc + pc_inc;
+			cpu.predecode_failed = FALSE;
+			if(req->thumb)
+				thumb_decode_into_uop(&op);
+			else
+				arm_decode_into_uop(&op);
+			if(cpu.predecode_failed)
+				break; // probably isn't code, the core will find out for itself if it gets here
+
+			predecode_publish(req->copy, slot, &op);
+
+			uop_set_block_flags(&op);
+			if(op.opcode == B_IMMEDIATE_LOCAL && num_targets < PREDECODE_TARGETS) {
+				unsigned int target = (op.b_immediate.target % MMU_PAGESIZE) >> pc_shift;
+
+				if(!req->copy->visited[target])
+					targets[num_targets++] = target;
+			}
+			if(!predecode_falls_through(&op))
+				break;
+		}
+	}
+}
+
+static int predecode_thread_entry(void *arg)
+{
+	struct uop_predecoder *pd = arg;
+
+	// the worker's own cpu, with just what the decoders look at
+	memset(&cpu, 0, sizeof(cpu));
+	cpu.isa = pd->isa;
+	cpu.core = pd->core;
+	cpu.core_id = pd->core_id;
+	cpu.predecoding = TRUE;
+
+	SDL_LockMutex(pd->lock);
+	for(;;) {
+		struct predecode_request req;
+
+		while(!pd->quit && pd->head == pd->tail)
+			SDL_CondWait(pd->cond, pd->lock);
+		if(pd->quit)
+			break;
+
+		// the newest first, it's where the core is now
+		req = pd->queue[--pd->tail % PREDECODE_QUEUE];
+		if(!req.cp)
+			continue;
+		pd->busy = req.cp;
+		SDL_UnlockMutex(pd->lock);
+
+		predecode_codepage(pd, &req);
+
+		SDL_LockMutex(pd->lock);
+		pd->busy = NULL;
+		pd->cancel = FALSE;
+		SDL_CondBroadcast(pd->cond);
+	}
+	SDL_UnlockMutex(pd->lock);
+
+	return 0;
+}
+
+/* on the core, start the worker if it's turned on */
+void uop_predecode_init(void)
+{
+	struct uop_predecoder *pd;
+
+	cpu.predecoder = NULL;
+	if(!get_config_key_bool("cpu", "predecode", FALSE))
+		return;
+
+	pd = calloc(1, sizeof(struct uop_predecoder));
+	pd->lock = SDL_CreateMutex();
+	pd->cond = SDL_CreateCond();
+	pd->isa = cpu.isa;
+	pd->core = cpu.core;
+	pd->core_id = cpu.core_id;
+	pd->thread = SDL_CreateThread(&predecode_thread_entry, pd);
+
+	cpu.predecoder = pd;
+}
+
+/* on the core, stop the worker and drop everything it did for the codepages still around */
+void uop_predecode_shutdown(void)
+{
+	struct uop_predecoder *pd = cpu.predecoder;
+	unsigned int i;
+
+	if(!pd)
+		return;
+
+	SDL_LockMutex(pd->lock);
+	pd->quit = TRUE;
+	pd->cancel = TRUE;
+	SDL_CondBroadcast(pd->cond);
+	SDL_UnlockMutex(pd->lock);
+	SDL_WaitThread(pd->thread, NULL);
+
+	cpu.predecoder = NULL;
+	for(i = 0; i < cpu.codepage_hash_size; i++) {
+		struct uop_codepage *cp;
+
+		for(cp = cpu.codepage_hash[i]; cp != NULL; cp = cp->next) {
+			if(cp->predecoded)
+				uop_predecode_forget(cp);
+		}
+	}
+
+	SDL_DestroyCond(pd->cond);
+	SDL_DestroyMutex(pd->lock);
+	free(pd);
+}
+
+/* on the core, as cp is loaded, have the worker decode it from slot on */
+void uop_predecode_page(struct uop_codepage *cp, unsigned int slot)
+{
+	struct uop_predecoder *pd = cpu.predecoder;
+	struct predecode_request *req;
+
+	cp->predecoded = calloc(1, sizeof(struct uop_predecoded));
+
+	SDL_LockMutex(pd->lock);
+	if(pd->tail - pd->head == PREDECODE_QUEUE)
+		pd->head++; // the worker is well behind, the oldest page is the least likely to matter now
+	req = &pd->queue[pd->tail++ % PREDECODE_QUEUE];
+	req->cp = cp;
+	req->copy = cp->predecoded;
+	req->address = cp->address;
+	req->host_ptr = cp->host_ptr;
+	req->thumb = cp->thumb;
+	req->slot = slot;
+	SDL_CondSignal(pd->cond);
+	SDL_UnlockMutex(pd->lock);
+}
+
+/* on the core, cp is about to be freed. get it away from the worker and free its copy */
+void uop_predecode_forget(struct uop_codepage *cp)
+{
+	struct uop_predecoder *pd = cpu.predecoder;
+	int i;
+
+	if(pd) {
+		unsigned int n;
+
+		SDL_LockMutex(pd->lock);
+		for(n = pd->head; n != pd->tail; n++) {
+			if(pd->queue[n % PREDECODE_QUEUE].cp == cp)
+				pd->queue[n % PREDECODE_QUEUE].cp = NULL;
+		}
+		while(pd->busy == cp) {
+			pd->cancel = TRUE;
+			SDL_CondWait(pd->cond, pd->lock);
+		}
+		SDL_UnlockMutex(pd->lock);
+	}
+
+	for(i = 0; i < CP_MAX_CHUNKS; i++)
+		free(cp->predecoded->chunks[i]);
+	free(cp->predecoded);
+	cp->predecoded = NULL;
+}
+
+/* on the core, fill in the undecoded op from the worker's copy if it's there */
+bool uop_copy_predecoded(struct uop_codepage *cp, struct uop *op)
+{
+	unsigned int slot = op->undecoded.slot;
+	struct predecoded_chunk *chunk = atomic_load_acquire(&cp->predecoded->chunks[slot / CP_CHUNK_INS]);
+
+	if(!chunk || !atomic_load_acquire(&chunk->ready[slot % CP_CHUNK_INS]))
+		return FALSE;
+
+	*op = chunk->ops[slot % CP_CHUNK_INS];
+	return TRUE;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* the dispatch loop counting nothing but edge coverage at the branches, see sys-generic/fuzz.c */
+#include <options.h>
+
+#define UOP_VARIANT uop_variant_cover
+#define UOP_VARIANT_NAME "cover"
+
+#define UOP_COUNT_INS 0
+#define UOP_COUNT_CYCLES 0
+#define UOP_COUNT_ARM_OPS 0
+#define UOP_COUNT_UOPS 0
+#define UOP_COUNT_ARITH_UOPS 0
+#define UOP_COUNT_BRANCH_CACHE 0
+#define UOP_COVER 1
+
+#include "uop_handlers.h"
@@ -20,21 +20,18 @@
  * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
-#include <util/atomic.h>
 
-#if __i386__ || __I386__
+/* the dispatch loop counting instructions only */
+#include <options.h>
 
-/* defined in atomic_asm.S */
+#define UOP_VARIANT uop_variant_icount
+#define UOP_VARIANT_NAME "icount"
 
-#endif
-
-#if __ppc__ || __PPC__
-
-/* defined in atomic_asm.S */
-
-#endif
-
-#if __sparc__ || __SPARC__
-#error implement SPARC atomic_* ops
-#endif
+#define UOP_COUNT_INS 1
+#define UOP_COUNT_CYCLES 0
+#define UOP_COUNT_ARM_OPS 0
+#define UOP_COUNT_UOPS 0
+#define UOP_COUNT_ARITH_UOPS 0
+#define UOP_COUNT_BRANCH_CACHE 0
 
+#include "uop_handlers.h"
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* the dispatch loop with every counter and the per uop traces, run while those trace levels are up */
+#include <options.h>
+
+#define UOP_VARIANT uop_variant_trace
+#define UOP_VARIANT_NAME "trace"
+
+#define UOP_COUNT_INS 1
+#define UOP_COUNT_CYCLES COUNT_CYCLES
+#define UOP_COUNT_ARM_OPS COUNT_ARM_OPS
+#define UOP_COUNT_UOPS COUNT_UOPS
+#define UOP_COUNT_ARITH_UOPS COUNT_ARITH_UOPS
+#define UOP_COUNT_BRANCH_CACHE COUNT_BRANCH_CACHE
+#define UOP_TRACE_UOPS 1
+
+#include "uop_handlers.h"
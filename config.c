@@ -41,13 +41,20 @@ struct config_group {
 	struct config_key *keylist;	
 };
 
-static struct config_group *config_tree;
+/* a set of keys, anything not found in one is looked up in its parent */
+struct config {
+	struct config *parent;
+	struct config_group *groups;
+};
+
+static struct config config_tree; // the process wide config, from the config file and command line
+static __thread struct config *thread_config; // layered over config_tree for the thread, if set
 
-static struct config_group *find_config_group(const char *group)
+static struct config_group *find_config_group(struct config *config, const char *group)
 {
 	struct config_group *grp;
 	
-	for(grp = config_tree; grp != NULL; grp = grp->next) {
+	for(grp = config->groups; grp != NULL; grp = grp->next) {
 		if(strcasecmp(grp->name, group) == 0)
 			return grp;
 	}
@@ -69,15 +76,23 @@ static struct config_key *find_config_key_in_group(struct config_group *group, c
 
 static struct config_key *find_config_key(const char *group, const char *key)
 {
+	struct config *config;
 	struct config_group *grp;
+	struct config_key *k;
 	
-	grp = find_config_group(group);
-	if(grp == NULL)
-		return NULL;
-	return find_config_key_in_group(grp, key);
+	for(config = thread_config ? thread_config : &config_tree; config != NULL; config = config->parent) {
+		grp = find_config_group(config, group);
+		if(grp == NULL)
+			continue;
+		k = find_config_key_in_group(grp, key);
+		if(k != NULL)
+			return k;
+	}
+
+	return NULL;
 }
 
-int add_config_key(const char *group, const char *key, const char *val)
+static int add_config_key_to(struct config *config, const char *group, const char *key, const char *val)
 {
 	struct config_group *grp;
 	struct config_key *k;
@@ -85,7 +100,7 @@ int add_config_key(const char *group, const char *key, const char *val)
 	printf("add_config_key: %s.%s = '%s'\n", group, key, val);
 
 	/* find or create group */
-	grp = find_config_group(group);
+	grp = find_config_group(config, group);
 	if(grp == NULL) {
 		/* create a new one */
 		grp = malloc(sizeof(struct config_group));
@@ -93,8 +108,8 @@ int add_config_key(const char *group, const char *key, const char *val)
 		grp->keylist = NULL;
 		
 		/* add it to the group list */
-		grp->next = config_tree;
-		config_tree = grp;	
+		grp->next = config->groups;
+		config->groups = grp;	
 	}	
 
 	/* find or create key */
@@ -118,6 +133,51 @@ int add_config_key(const char *group, const char *key, const char *val)
 	return 0;
 }
 
+int add_config_key(const char *group, const char *key, const char *val)
+{
+	return add_config_key_to(&config_tree, group, key, val);
+}
+
+/* a layer of keys over the process wide config, for one machine */
+struct config *create_config(void)
+{
+	struct config *config = calloc(1, sizeof(struct config));
+
+	config->parent = &config_tree;
+
+	return config;
+}
+
+void destroy_config(struct config *config)
+{
+	struct config_group *grp, *next_grp;
+	struct config_key *k, *next_k;
+
+	for(grp = config->groups; grp != NULL; grp = next_grp) {
+		next_grp = grp->next;
+		for(k = grp->keylist; k != NULL; k = next_k) {
+			next_k = k->next;
+			free(k->name);
+			free(k->val);
+			free(k);
+		}
+		free(grp->name);
+		free(grp);
+	}
+	free(config);
+}
+
+int add_local_config_key(struct config *config, const char *group, const char *key, const char *val)
+{
+	return add_config_key_to(config, group, key, val);
+}
+
+/* look keys up in config before the process wide one on this thread, NULL to go back to just that */
+void set_thread_config(struct config *config)
+{
+	thread_config = config;
+}
+
 const char *get_config_key_string(const char *group, const char *key, const char *default_val)
 {
 	struct config_key *k;
@@ -261,7 +321,8 @@ static int load_config_file(const char *filename)
 int load_config(int argc, char **argv)
 {
 	/* initialize the config tree */
-	config_tree = NULL;
+	config_tree.parent = NULL;
+	config_tree.groups = NULL;
 
 	/* load from the config file */
 	load_config_file(get_config_key_string("config", "file", "armemu.conf"));
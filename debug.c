@@ -21,6 +21,10 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "debug.h"
 
 #if DYNAMIC_TRACE_LEVELS
@@ -30,12 +34,103 @@ int TRACE_SYS_LEVEL = DEFAULT_TRACE_SYS_LEVEL;
 int TRACE_MMU_LEVEL = DEFAULT_TRACE_MMU_LEVEL;
 #endif
 
+/*
+ * trace output is formatted into a ring belonging to the thread doing the tracing,
+ * so cores tracing at once never meet on stdio's lock. only the owner ever touches
+ * it. it's written out when it gets half full, on trace_flush() and when the
+ * thread exits.
+ */
+#define TRACE_RING_SIZE (64*1024)
+#define TRACE_LINE_MAX 512
+
+struct trace_ring {
+	unsigned int head; // bytes put in
+	unsigned int tail; // bytes written out
+	char buf[TRACE_RING_SIZE];
+};
+
+static __thread struct trace_ring *trace_ring;
+static pthread_key_t trace_ring_key;
+static pthread_once_t trace_ring_once = PTHREAD_ONCE_INIT;
+
+static void write_all(const char *buf, unsigned int len)
+{
+	while(len > 0) {
+		ssize_t err = write(1, buf, len);
+		if(err <= 0)
+			return;
+		buf += err;
+		len -= err;
+	}
+}
+
+void trace_flush(void)
+{
+	struct trace_ring *ring = trace_ring;
+	unsigned int start, len;
+
+	if(!ring || ring->head == ring->tail)
+		return;
+
+	// keep it in order with anything printed the regular way
+	fflush(stdout);
+
+	start = ring->tail % TRACE_RING_SIZE;
+	len = ring->head - ring->tail;
+	if(start + len > TRACE_RING_SIZE) {
+		write_all(ring->buf + start, TRACE_RING_SIZE - start);
+		len -= TRACE_RING_SIZE - start;
+		start = 0;
+	}
+	write_all(ring->buf + start, len);
+	ring->tail = ring->head;
+}
+
+static void trace_ring_exit(void *arg)
+{
+	trace_flush();
+	free(trace_ring);
+	trace_ring = NULL;
+}
+
+static void trace_ring_init(void)
+{
+	pthread_key_create(&trace_ring_key, &trace_ring_exit);
+	atexit(&trace_flush); // the main thread goes out this way rather than through the key
+}
+
 void _dprintf(const char *fmt, ...)
 {
+	struct trace_ring *ring = trace_ring;
+	char line[TRACE_LINE_MAX];
+	unsigned int start, len;
 	va_list ap;
+	int err;
+
+	if(!ring) {
+		pthread_once(&trace_ring_once, &trace_ring_init);
+		ring = trace_ring = calloc(1, sizeof(struct trace_ring));
+		pthread_setspecific(trace_ring_key, ring);
+	}
 
 	va_start(ap, fmt);
-	vprintf(fmt, ap);
+	err = vsnprintf(line, sizeof(line), fmt, ap);
 	va_end(ap);
+	if(err <= 0)
+		return;
+	len = (err < TRACE_LINE_MAX) ? err : TRACE_LINE_MAX - 1;
+
+	/* it never holds more than half plus a line, so nothing unwritten is overwritten */
+	start = ring->head % TRACE_RING_SIZE;
+	if(start + len > TRACE_RING_SIZE) {
+		memcpy(ring->buf + start, line, TRACE_RING_SIZE - start);
+		memcpy(ring->buf, line + (TRACE_RING_SIZE - start), len - (TRACE_RING_SIZE - start));
+	} else {
+		memcpy(ring->buf + start, line, len);
+	}
+	ring->head += len;
+
+	if(ring->head - ring->tail >= TRACE_RING_SIZE / 2)
+		trace_flush();
 }
 
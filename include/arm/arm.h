@@ -25,6 +25,7 @@
 
 #include "debug.h"
 #include "systypes.h"
+#include <util/atomic.h>
 
 typedef word reg_t;
 typedef word armaddr_t;
@@ -36,6 +37,12 @@ typedef word armaddr_t;
 void panic_cpu(const char *fmt, ...);
 void shutdown_cpu(void);
 
+/*
+ * an instruction the decoders can't handle. fatal when the core is about to run it,
+ * but the predecode worker decoding ahead of it just gives up there, see uop_predecode.c
+ */
+#define decode_panic(x...) do { if(cpu.predecoding) { cpu.predecode_failed = TRUE; return; } panic_cpu(x); } while(0)
+
 enum arm_instruction_set {
 	ARM_V4 = 0,
 	ARM_V5,
@@ -57,6 +64,36 @@ enum perf_counter_type {
 	EXCEPTIONS,
 
 	INS_DECODE,
+	INS_PREDECODED, // taken from the predecode worker instead of decoded
+
+	CODEPAGE_INVALIDATE,
+	CODEPAGE_EVICT,
+	CODEPAGE_MEM_LIVE, // bytes, not a rate
+	CODEPAGE_MEM_PEAK,
+	CODEPAGE_PRELOAD, // filled in from the translation cache instead of decoded
+	CODEPAGE_LOOKUP_HIT, // codepage hash lookups, off the decode loop so always counted
+	CODEPAGE_LOOKUP_MISS,
+	CODEPAGE_LOOKUP_PROBE, // hash chain entries looked at, over hits and misses
+	CODEPAGE_LOAD,
+	CODEPAGE_FLUSH_ALL,
+	CODEPAGE_RETRANSLATE, // translations changed, every cached codepage pointer rechecked
+	CODEPAGE_HASH_GROW,
+
+	IDLE_PARK, // times the core went to sleep waiting for an interrupt
+
+	MMU_SLOW_TRANSLATE, // page table walks, cheap enough next to the walk to always count
+	MMU_SLOW_FETCH, // the walks by what wanted them
+	MMU_SLOW_READ,
+	MMU_SLOW_WRITE,
+	MMU_SLOW_PERMISSION, // there was a translation, just not one allowing this access
+	MMU_SLOW_MMU_OFF, // and by what they found
+	MMU_SLOW_PTABLE_CACHED, // the first level descriptor came out of the ptable cache
+	MMU_SLOW_SECTION,
+	MMU_SLOW_PAGE,
+	MMU_SLOW_FAULT,
+	MMU_TLB_FLUSH,
+	MMU_TLB_FLUSH_PAGE,
+	MMU_TLB_FLUSH_ASID,
 
 #if COUNT_MMU_OPS
 	MMU_READ,
@@ -64,7 +101,18 @@ enum perf_counter_type {
 	MMU_INS_FETCH,
 	MMU_FASTPATH,
 	MMU_SLOWPATH,
-	MMU_SLOW_TRANSLATE,
+	MMU_MULTIPLE_FASTPATH, // ldm/stm done in one go out of host memory
+	MMU_FASTMEM, // straight through the fastmem window
+	MMU_BIG_PAGE_HIT, // 4KB entry filled in from a section or large page without a walk
+#endif
+
+#if COUNT_BRANCH_CACHE
+	BRANCH_CACHE_HIT,
+	BRANCH_CACHE_MISS,
+	RSB_HIT,
+	RSB_MISS,
+	DIRECT_BRANCH_HIT, // target codepage cached at a direct branch out of the page
+	DIRECT_BRANCH_MISS,
 #endif
 
 #if COUNT_CYCLES
@@ -89,6 +137,11 @@ enum perf_counter_type {
 	UOP_TOP = UOP_BASE + MAX_UOP_OPCODE,
 #endif
 
+#if COUNT_FUSIONS
+	FUSION_BASE,
+	FUSION_TOP = FUSION_BASE + NUM_FUSED_OPCODES,
+#endif
+
 #if COUNT_ARITH_UOPS
 	UOP_ARITH_OPCODE,
 	UOP_ARITH_OPCODE_TOP = UOP_ARITH_OPCODE + 16,
@@ -99,7 +152,7 @@ enum perf_counter_type {
 };
 
 struct perf_counters {
-	int count[MAX_PERF_COUNTER];
+	int64_t count[MAX_PERF_COUNTER];
 };
 
 struct arm_coprocessor {
@@ -122,18 +175,65 @@ struct cpu_struct {
 	reg_t spsr;
 	bool r15_dirty;		// if we wrote into r[15] in the last instruction
 
-	// pending interrupts and mode changes
-	volatile int pending_exceptions;
+	// lazily evaluated condition codes, NZCV in cpsr is stale unless flags_op == LAZY_FLAGS_NONE
+	int flags_op;
+	word flags_a;
+	word flags_b;
+	word flags_result;
+
+	// pending interrupts and mode changes, only ever touched through util/atomic.h
+	int pending_exceptions;
+
+	// the dispatcher only looks at pending exceptions and scheduled events at the start of
+	// a block where event_request is set, or guest time has caught up with next_event
+	int event_request; // a single store from anywhere, see cpu_request_event()
+	dword guest_time; // instructions retired
+	dword next_event; // guest time the first scheduled event is due
+	struct cpu_event *events; // scheduled events on this core, soonest first
 	reg_t old_cpsr; // in case of a mode switch, we store the old mode
 	armaddr_t exception_base; // 0 or 0xffff0000 on cpus that support it
 
 	// cache of uop codepages
 	struct uop_codepage *curr_cp;
-	struct uop_codepage *codepage_hash[CODEPAGE_HASHSIZE];
-
-	// free list of codepage structures
-	struct uop_codepage *free_cp_arm;
-	struct uop_codepage *free_cp_thumb;
+	struct uop_codepage **codepage_hash; // by physical page, codepage_hash_size buckets
+	unsigned int codepage_hash_size;
+	unsigned int codepage_count;
+	unsigned int codepage_generation; // bumped whenever virtual to physical translations may have changed
+
+	// return stack buffer, predicts the codepage a cross page call will return to
+#define RSB_SIZE 16
+	struct rsb_entry {
+		armaddr_t addr;
+		struct uop_codepage *cp;
+	} rsb[RSB_SIZE];
+	unsigned int rsb_top;
+	struct uop_codepage *vector_cp; // the exception vectors' codepage, checked before use
+
+	// free lists of codepage headers and uop chunks
+	void *free_cp_headers;
+	void *free_cp_chunks;
+
+	// codepage memory, carved out of one reserved arena and held under a budget
+	struct uop_codepage *lru_head; // most recently looked up
+	struct uop_codepage *lru_tail;
+	byte *cp_arena; // base of the reservation, codepage handles are offsets from here
+	size_t cp_arena_size; // bytes reserved
+	size_t cp_arena_committed; // bytes made accessible so far
+	size_t cp_mem_used; // total carved out of the arena
+	size_t cp_mem_budget; // 0 for no limit
+	bool cp_hugepages;
+
+	// decoding newly loaded codepages ahead of the core on another thread, NULL if it's off
+	struct uop_predecoder *predecoder;
+	bool predecoding; // this is the worker's own copy of cpu, the decoders run on it
+	bool predecode_failed;
+
+	// the dispatch loop variant to run, and if the running one should return to uop_dispatch_loop
+	int instrumentation; // enum uop_instrumentation
+	struct btrace_core *btrace; // recording a binary trace, see btrace.c
+	byte *cover_map; // edge coverage for a fuzzer, see set_cpu_cover_map()
+	volatile bool restart_dispatch; // may be set by another core
+	unsigned int rendezvous_seen; // the last of the cluster's rendezvous this core took part in
 
 	// truth table of the arm conditions
 	unsigned short condition_table[16];
@@ -141,24 +241,95 @@ struct cpu_struct {
 	// cpu config
 	enum arm_instruction_set isa;
 	enum arm_core core;
-
-	// tracks emulator performance including cycle count and instruction count
-	struct perf_counters perf_counters;
+	int core_id; // which of the cores this is, 0 is the boot core
+	struct cpu_cluster *cluster; // the rest of the cores of this machine
+
+	// parking the host thread while the guest waits for an interrupt
+	volatile int idle; // TRUE while asleep in cpu_idle, the waker has to signal idle_cond
+	struct SDL_mutex *idle_lock;
+	struct SDL_cond *idle_cond;
+	bool idle_detect; // treat branches to self and device polling loops like wfi
+	bool semihosting; // swi and bkpt with the semihosting numbers go to semihost_call()
+
+	// device register accesses since the last pass through a possible polling loop
+	armaddr_t poll_addr;
+	word poll_val;
+	int poll_flags;
+	int poll_count; // passes in a row that read back the same thing
 
 	// routines for the arm's 16 coprocessor slots
 	struct arm_coprocessor coproc[16];
 
 	// banked_regs
 	reg_t usr_regs_low[5]; // non-fiq r8-r12
-	reg_t usr_regs[2];     // sp, lr
+	reg_t usr_regs[3];     // sp, lr, and a spsr that isn't there, see set_cpu_mode
 	reg_t irq_regs[3];     // sp, lr, spsr
 	reg_t svc_regs[3];     //     "
 	reg_t abt_regs[3];     //     "
 	reg_t und_regs[3];     //     "
 	reg_t fiq_regs[8];     // r8-r12, sp, lr, spsr
+
+	// tracks emulator performance including cycle count and instruction count
+	struct perf_counters perf_counters;
 };
 
-extern struct cpu_struct cpu;
+/*
+ * each emulated core runs on its own host thread, with its own copy of the
+ * cpu state. code running on a core sees its own through cpu, the cluster is
+ * for reaching into the other cores of the same machine.
+ */
+#define MAX_CPU_CORES 8
+
+/* the edge coverage map, the same size as afl's */
+#define COVER_MAP_SHIFT 16
+#define COVER_MAP_SIZE (1 << COVER_MAP_SHIFT)
+
+extern __thread struct cpu_struct cpu;
+
+struct machine;
+struct SDL_mutex;
+struct SDL_cond;
+struct SDL_Thread;
+struct cpu_rendezvous;
+struct SDL_semaphore;
+struct _SDL_TimerID;
+
+struct cpu_cluster {
+	struct machine *machine; // the cores run with this as their current machine
+	const char *core_type;   // what every core is built as
+	int num_cores;
+
+	struct cpu_struct *cores[MAX_CPU_CORES]; // filled in as the cores come up
+	struct SDL_Thread *threads[MAX_CPU_CORES];
+	struct SDL_semaphore *cores_up;
+	struct SDL_semaphore *cores_go;
+	struct SDL_semaphore *cores_stopped; // posted by each core as it leaves its dispatch loop
+	struct SDL_semaphore *cores_done; // stopped cores hold on to their state until stop_cpu lets go
+	int starting_core; // the core being brought up by start_cpu
+	struct _SDL_TimerID *speedtimer;
+	struct perf_counters speedtimer_counters; // as of the last time the speedtimer went off
+	struct cpu_stats *stats; // exporting the counters, see stats.c
+	struct profile *profile; // sampling where the cores are, see profile.c
+	struct btrace_file *btrace;
+	volatile int swap_lock; // for SWP on memory the host can't swap atomically
+
+	// an elf rom says where to start and names the guest's code, see set_cpu_entry_point()
+	bool has_entry_point;
+	armaddr_t entry_point; // bit 0 set for thumb
+	const char *symbol_file;
+
+	byte *cover_map; // COVER_MAP_SIZE bytes, NULL if nothing is being fuzzed
+	bool semihosting;
+
+	// every core stopped between blocks at once, see cpu_request_rendezvous()
+	struct SDL_mutex *rendezvous_lock;
+	struct SDL_cond *rendezvous_cond;
+	const struct cpu_rendezvous *volatile rendezvous; // NULL unless one is under way
+	unsigned int rendezvous_generation;
+	int rendezvous_count; // cores that have got there
+
+	volatile bool stopping; // the cores leave their dispatch loops at the end of the block
+};
 
 // special registers
 #define PC 15
@@ -205,6 +376,14 @@ extern struct cpu_struct cpu;
 #define COND_SPECIAL  0xf
 #define COND_SHIFT    28
 
+/* what the last flag setting operation was, see sync_condition_flags() */
+enum lazy_flags_op {
+	LAZY_FLAGS_NONE = 0,	// cpsr is up to date
+	LAZY_FLAGS_NZ,			// N and Z come from flags_result, C and V are in cpsr
+	LAZY_FLAGS_ADD,			// NZCV of flags_a + flags_b = flags_result
+	LAZY_FLAGS_SUB,			// NZCV of flags_a - flags_b = flags_result
+};
+
 /* pending exception bits */
 #define EX_RESET      0x01
 #define EX_UNDEFINED  0x02
@@ -265,7 +444,7 @@ reg_t get_reg_user(int num);            /* "user" mode reg access */
 void put_reg_user(int num, reg_t data); /* same */
 void set_cpu_mode(int mode);
 
-static inline word do_add(word a, word b, int carry_in, int *carry, int *ovl)
+static inline __ALWAYS_INLINE word do_add(word a, word b, int carry_in, int *carry, int *ovl)
 {
 	word val;
 
@@ -298,36 +477,139 @@ if (!IS_64HOST) {
 	return val;
 }
 
-static inline void set_condition(unsigned int condition, bool set)
+/* fold any pending lazy flag state into cpsr */
+static inline __ALWAYS_INLINE void sync_condition_flags(void)
+{
+#if LAZY_FLAGS
+	word a, b, result;
+	reg_t nzcv;
+
+	if(likely(cpu.flags_op == LAZY_FLAGS_NONE))
+		return;
+
+	a = cpu.flags_a;
+	b = cpu.flags_b;
+	result = cpu.flags_result;
+
+	nzcv = (result & PSR_CC_NEG) | (result == 0 ? PSR_CC_ZERO : 0);
+	switch(cpu.flags_op) {
+		case LAZY_FLAGS_NZ:
+			nzcv |= cpu.cpsr & (PSR_CC_CARRY|PSR_CC_OVL);
+			break;
+		case LAZY_FLAGS_ADD:
+			nzcv |= (result < a) ? PSR_CC_CARRY : 0;
+			nzcv |= ((~(a ^ b) & (a ^ result)) >> 3) & PSR_CC_OVL;
+			break;
+		case LAZY_FLAGS_SUB:
+			nzcv |= (a >= b) ? PSR_CC_CARRY : 0;
+			nzcv |= (((a ^ b) & (a ^ result)) >> 3) & PSR_CC_OVL;
+			break;
+	}
+
+	cpu.cpsr = (cpu.cpsr & ~(PSR_CC_NEG|PSR_CC_ZERO|PSR_CC_CARRY|PSR_CC_OVL)) | nzcv;
+	cpu.flags_op = LAZY_FLAGS_NONE;
+#endif
+}
+
+static inline __ALWAYS_INLINE void set_condition(unsigned int condition, bool set)
 {
 	if(condition == PSR_THUMB) {
 		CPU_TRACE(7, "setting THUMB bit to %d\n", set);
 	}
 
+#if LAZY_FLAGS
+	// C and V can be set on top of a pending NZ, everything else has to be folded in first
+	if(condition & (PSR_CC_NEG|PSR_CC_ZERO))
+		sync_condition_flags();
+	else if((condition & (PSR_CC_CARRY|PSR_CC_OVL)) && cpu.flags_op != LAZY_FLAGS_NZ)
+		sync_condition_flags();
+#endif
+
 	if(set)
 		cpu.cpsr |= condition;
 	else
 		cpu.cpsr &= ~condition;
 }
 
-static inline void set_NZ_condition(reg_t val)
+static inline __ALWAYS_INLINE void set_NZ_condition(reg_t val)
 {
+#if LAZY_FLAGS
+	// keep the C and V of a pending add/sub
+	if(cpu.flags_op > LAZY_FLAGS_NZ)
+		sync_condition_flags();
+	cpu.flags_op = LAZY_FLAGS_NZ;
+	cpu.flags_result = val;
+#else
 	set_condition(PSR_CC_NEG, BIT(val, 31));
 	set_condition(PSR_CC_ZERO, val == 0);
+#endif
+}
+
+/* set all four flags for result = a + b */
+static inline __ALWAYS_INLINE void set_add_flags(word a, word b, word result)
+{
+#if LAZY_FLAGS
+	cpu.flags_op = LAZY_FLAGS_ADD;
+	cpu.flags_a = a;
+	cpu.flags_b = b;
+	cpu.flags_result = result;
+#else
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, result < a);
+	set_condition(PSR_CC_OVL, ISNEG(~(a ^ b) & (a ^ result)));
+#endif
+}
+
+/* set all four flags for result = a - b */
+static inline __ALWAYS_INLINE void set_sub_flags(word a, word b, word result)
+{
+#if LAZY_FLAGS
+	cpu.flags_op = LAZY_FLAGS_SUB;
+	cpu.flags_a = a;
+	cpu.flags_b = b;
+	cpu.flags_result = result;
+#else
+	set_NZ_condition(result);
+	set_condition(PSR_CC_CARRY, a >= b);
+	set_condition(PSR_CC_OVL, ISNEG((a ^ b) & (a ^ result)));
+#endif
 }
 
-static inline unsigned int get_condition(unsigned int condition)
+static inline __ALWAYS_INLINE unsigned int get_condition(unsigned int condition)
 {
+#if LAZY_FLAGS
+	if(condition & (PSR_CC_NEG|PSR_CC_ZERO|PSR_CC_CARRY|PSR_CC_OVL))
+		sync_condition_flags();
+#endif
 	return (cpu.cpsr & condition);
 }
 
-static inline reg_t get_reg(int num)
+/* the full cpsr, with the condition codes up to date */
+static inline __ALWAYS_INLINE reg_t get_cpsr(void)
+{
+	sync_condition_flags();
+	return cpu.cpsr;
+}
+
+/* replace the whole cpsr, dropping any pending lazy flags */
+static inline __ALWAYS_INLINE void put_cpsr(reg_t val)
+{
+#if LAZY_FLAGS
+	cpu.flags_op = LAZY_FLAGS_NONE;
+#endif
+	// unmasking may let in an interrupt that has been waiting
+	if(cpu.cpsr & ~val & (PSR_IRQ_MASK|PSR_FIQ_MASK))
+		atomic_store_relaxed(&cpu.event_request, TRUE);
+	cpu.cpsr = val;
+}
+
+static inline __ALWAYS_INLINE reg_t get_reg(int num)
 {
 	ASSERT(num >= 0 && num < 16);
 	return cpu.r[num];
 }
 
-static inline void put_reg(int num, reg_t data)
+static inline __ALWAYS_INLINE void put_reg(int num, reg_t data)
 {
 	ASSERT(num >= 0 && num < 16);
 	cpu.r[num] = data;
@@ -337,17 +619,74 @@ static inline void put_reg(int num, reg_t data)
 	}
 }
 
-static inline void put_reg_nopc(int num, reg_t data)
+static inline __ALWAYS_INLINE void put_reg_nopc(int num, reg_t data)
 {
 	ASSERT(num >= 0 && num < 15);
 	cpu.r[num] = data;
 }
 
-static inline bool check_condition(byte condition)
+#if LAZY_FLAGS
+/*
+ * evaluate a condition straight from a pending flag setting op, without folding
+ * it into cpsr. N and Z come from the result for every op, C and V only exist
+ * for add and sub. returns -1 if the condition needs flags that are only in cpsr.
+ */
+static inline __ALWAYS_INLINE int lazy_check_condition(byte condition)
+{
+	word a = cpu.flags_a;
+	word b = cpu.flags_b;
+	word result = cpu.flags_result;
+	bool carry, ge;
+
+	switch(condition) {
+		case COND_EQ: return result == 0;
+		case COND_NE: return result != 0;
+		case COND_MI: return ISNEG(result) != 0;
+		case COND_PL: return ISPOS(result);
+	}
+
+	// same carry and overflow as sync_condition_flags(), ge is N == V
+	switch(cpu.flags_op) {
+		case LAZY_FLAGS_ADD:
+			carry = result < a;
+			ge = ISPOS(result ^ (~(a ^ b) & (a ^ result)));
+			break;
+		case LAZY_FLAGS_SUB:
+			carry = a >= b;
+			ge = ISPOS(result ^ ((a ^ b) & (a ^ result)));
+			break;
+		default:
+			return -1;
+	}
+
+	switch(condition) {
+		case COND_CS: return carry;
+		case COND_CC: return !carry;
+		case COND_HI: return carry && result != 0;
+		case COND_LS: return !carry || result == 0;
+		case COND_GE: return ge;
+		case COND_LT: return !ge;
+		case COND_GT: return ge && result != 0;
+		case COND_LE: return !ge || result == 0;
+		default: return -1;
+	}
+}
+#endif
+
+static inline __ALWAYS_INLINE bool check_condition(byte condition)
 {
 	// this happens far more often than not
 	if(likely(condition == COND_AL))
 		return TRUE;
+#if LAZY_FLAGS
+	// most conditions follow a compare, work them out without building NZCV
+	if(likely(cpu.flags_op != LAZY_FLAGS_NONE)) {
+		int taken = lazy_check_condition(condition);
+		if(likely(taken >= 0))
+			return taken;
+		sync_condition_flags();
+	}
+#endif
 	// check the instructions condition mask against precomputed values of cpsr		
 	return cpu.condition_table[cpu.cpsr >> COND_SHIFT] & (1 << (condition));
 }
@@ -367,6 +706,66 @@ static inline enum arm_core get_core(void)
 	return cpu.core;
 }
 
+static inline int get_core_id(void)
+{
+	return cpu.core_id;
+}
+
+/* idle detection, sys device accesses are watched for polling loops */
+#define POLL_READ		0x1
+#define POLL_CHANGED	0x2 // read something different than last time, or a different register
+#define POLL_WROTE		0x4
+
+static inline void cpu_note_device_read(armaddr_t address, word val)
+{
+	if(address != cpu.poll_addr || val != cpu.poll_val) {
+		cpu.poll_addr = address;
+		cpu.poll_val = val;
+		cpu.poll_flags |= POLL_CHANGED;
+	}
+	cpu.poll_flags |= POLL_READ;
+}
+
+static inline void cpu_note_device_write(void)
+{
+	cpu.poll_flags |= POLL_WROTE;
+}
+
+/*
+ * get core to look at its pending exceptions and events before it starts another block.
+ * released, so whatever the caller set up for it is there once it sees the request
+ */
+static inline void cpu_request_event(struct cpu_struct *core)
+{
+	atomic_store_release(&core->event_request, TRUE);
+}
+
+/* an exception raised by the instruction running on this core, only it looks at these bits */
+static inline void raise_exception(int ex)
+{
+	atomic_or_relaxed(&cpu.pending_exceptions, ex);
+	cpu_request_event(&cpu);
+}
+
+/*
+ * something that happens to this core at a point in guest time. the owner keeps the
+ * struct around while it's scheduled, and the callback runs on the core between blocks.
+ */
+typedef void (*cpu_event_callback)(void *arg);
+
+struct cpu_event {
+	struct cpu_event *next;
+	dword when;
+	cpu_event_callback callback;
+	void *arg;
+	bool scheduled;
+};
+
+static inline dword get_guest_time(void)
+{
+	return cpu.guest_time;
+}
+
 static inline void add_to_perf_counter(enum perf_counter_type counter, int add)
 {
 	if(counter < MAX_PERF_COUNTER)
@@ -379,21 +778,40 @@ static inline void inc_perf_counter(enum perf_counter_type counter)
 }
 
 #if COUNT_CYCLES
-static inline int get_cycle_count(void)
+static inline dword get_cycle_count(void)
 {
 	return cpu.perf_counters.count[CYCLE_COUNT];
 }
 #endif
 
-static inline int get_instruction_count(void)
+static inline dword get_instruction_count(void)
 {
 	return cpu.perf_counters.count[INS_COUNT];
 }
 
+/*
+ * stop every core of the cluster at the end of its current block, run each on all of
+ * them on their own threads and then last on whichever got there last, while the
+ * others wait. nothing in the guest moves in the meantime.
+ */
+struct cpu_rendezvous {
+	cpu_event_callback each;
+	cpu_event_callback last;
+	void *arg;
+};
+
 /* function prototypes */
-int initialize_cpu(const char *cpu_type);
-void reset_cpu(void);
-int start_cpu(void);
+struct cpu_cluster *initialize_cpu(struct machine *m, const char *cpu_type);
+void reset_cpu(struct cpu_cluster *cluster);
+void set_cpu_entry_point(struct cpu_cluster *cluster, armaddr_t entry, const char *symbol_file);
+void set_cpu_cover_map(struct cpu_cluster *cluster, byte *map);
+void set_cpu_semihosting(struct cpu_cluster *cluster, bool semihosting);
+int start_cpu(struct cpu_cluster *cluster);
+void stop_cpu(struct cpu_cluster *cluster);
+void cpu_request_stop(struct cpu_cluster *cluster);
+int cpu_request_rendezvous(struct cpu_cluster *cluster, const struct cpu_rendezvous *r);
+void cpu_rendezvous_arrive(void);
+void destroy_cpu(struct cpu_cluster *cluster);
 void dump_cpu(void);
 void dump_registers(void);
 int build_condition_table(void);
@@ -403,16 +821,36 @@ void set_exception_base(armaddr_t base);
 /* coprocessor 15 is for system mode stuff */
 void install_cp15(void);
 
+/* the current core's state in and out of a snapshot, see include/sys/snapshot.h */
+struct snapshot;
+struct snapshot_cp15;
+void cpu_save_state(struct snapshot *s);
+int cpu_restore_state(struct snapshot *s);
+void cp15_save_state(struct snapshot_cp15 *state);
+void cp15_restore_state(const struct snapshot_cp15 *state);
+
 /* exceptions */
-void raise_irq(void);
-void lower_irq(void);
-void raise_fiq(void);
-void lower_fiq(void);
+void cpu_idle(bool wfi, int timeout_ms);
+void cpu_idle_branch(int flags);
+void cpu_wake(struct cpu_struct *core);
+void cpu_wake_all(struct cpu_cluster *cluster);
+void raise_irq(struct cpu_cluster *cluster, int core);
+void lower_irq(struct cpu_cluster *cluster, int core);
+void raise_fiq(struct cpu_cluster *cluster, int core);
+void lower_fiq(struct cpu_cluster *cluster, int core);
 void signal_data_abort(armaddr_t addr);
 void signal_prefetch_abort(armaddr_t addr);
 int process_pending_exceptions(void);
 
+/* events, scheduled on the current core's guest time */
+void cpu_schedule_event(struct cpu_event *event, dword delay, cpu_event_callback callback, void *arg);
+void cpu_cancel_event(struct cpu_event *event);
+bool cpu_service_events(void);
+
 /* codepage maintenance */
 void flush_all_codepages(void); /* throw away all cached instructions */
+void flush_codepages_at(armaddr_t address); /* throw away the instructions cached for a virtual page */
+void codepage_translations_changed(void); /* the mmu mappings changed, recheck cached codepages before using them */
+void invalidate_codepages_phys(armaddr_t paddr); /* throw away the instructions decoded out of a physical page */
 
 #endif
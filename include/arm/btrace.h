@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __ARM_BTRACE_H
+#define __ARM_BTRACE_H
+
+#include <arm/arm.h>
+#include <arm/btrace_format.h>
+
+/*
+ * binary execution trace, configured in [trace]:
+ *
+ *  file = boot.trace   turns it on, the cores run the record dispatch loop
+ *  records = block     block, ins or mem. each adds to the one before it
+ *  size = 64           megabytes of ring per core
+ *
+ * a record is a few stores into the core's ring, which is mapped straight from the file.
+ */
+struct btrace_core {
+	struct btrace_record *ring;
+	uint64_t mask;
+	uint64_t head; // published to the file's header at the start of each block
+	uint64_t *file_head;
+	bool ins;
+	bool mem;
+};
+
+static inline __ALWAYS_INLINE struct btrace_record *btrace_next(struct btrace_core *t)
+{
+	return &t->ring[t->head++ & t->mask];
+}
+
+static inline __ALWAYS_INLINE void btrace_block(void)
+{
+	struct btrace_core *t = cpu.btrace;
+	struct btrace_record *rec;
+
+	*t->file_head = t->head;
+
+	rec = btrace_next(t);
+	rec->pc = cpu.pc;
+	rec->arg = cpu.guest_time;
+	rec->data = cpu.guest_time >> 32;
+	rec->opcode = 0;
+	rec->type = BTRACE_BLOCK;
+	rec->flags = cpu.cpsr & (PSR_MODE_MASK | PSR_THUMB);
+}
+
+static inline __ALWAYS_INLINE void btrace_ins(armaddr_t pc, int opcode)
+{
+	struct btrace_core *t = cpu.btrace;
+	struct btrace_record *rec;
+
+	if (!t->ins)
+		return;
+
+	rec = btrace_next(t);
+	rec->pc = pc;
+	rec->arg = 0;
+	rec->data = 0;
+	rec->opcode = opcode;
+	rec->type = BTRACE_INS;
+	rec->flags = 0;
+}
+
+/* only called through the mmu's tracing accessors, which are only picked with mem set */
+static inline void btrace_mem(int type, armaddr_t address, int size, word data)
+{
+	struct btrace_record *rec = btrace_next(cpu.btrace);
+
+	rec->pc = cpu.curr_cp ? cpu.pc - cpu.curr_cp->pc_inc : cpu.pc; // already moved on to the next instruction
+	rec->arg = address;
+	rec->data = data;
+	rec->opcode = size;
+	rec->type = type;
+	rec->flags = 0;
+}
+
+int start_btrace(struct cpu_cluster *cluster);
+void btrace_core_started(struct cpu_cluster *cluster);
+void stop_btrace(struct cpu_cluster *cluster);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __ARM_BTRACE_FORMAT_H
+#define __ARM_BTRACE_FORMAT_H
+
+/*
+ * layout of the binary execution trace file ([trace] file). it stands alone so
+ * tools/btrace_dump.c, or anything else reading a trace, can include it without the
+ * rest of the emulator.
+ *
+ * the file is the header, the uop opcode names, nul terminated one after another, the
+ * path of the elf the guest was loaded from if it was, and then a ring of records per
+ * core. head[n] counts every record core n ever wrote, the
+ * last ring_records of them are still in its ring, the oldest at head % ring_records.
+ * everything is host endian, the emulator maps the file and writes straight into it,
+ * so even a trace of a machine that crashed can be read back.
+ */
+#include <stdint.h>
+
+#define BTRACE_MAGIC		0x52544541 // "AETR"
+#define BTRACE_VERSION		2
+#define BTRACE_MAX_CORES	8
+
+struct btrace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;	// sizeof(struct btrace_record)
+	uint32_t num_cores;
+	uint32_t num_opcodes;
+	uint32_t names_offset;	// of the opcode names
+	uint32_t symbols_offset; // of the guest elf's path, 0 if there isn't one
+	uint32_t pad;
+	uint64_t ring_records;	// per core, a power of 2
+	uint64_t ring_offset;	// of core 0's ring, the others follow it
+	uint64_t head[BTRACE_MAX_CORES];
+};
+
+enum btrace_type {
+	BTRACE_BLOCK = 1,	// a basic block started at pc
+	BTRACE_INS,		// a uop ran, at pc
+	BTRACE_READ,		// a load from the virtual address in arg
+	BTRACE_WRITE,		// a store of data to the virtual address in arg
+};
+
+#define BTRACE_FLAG_MODE_MASK	0x1f // the cpsr's mode bits
+#define BTRACE_FLAG_THUMB	0x20
+
+struct btrace_record {
+	uint32_t pc;
+	uint32_t arg;		// blocks: guest time, the low half. reads and writes: address
+	uint32_t data;		// blocks: guest time, the high half. writes: the value
+	uint16_t opcode;	// instructions: the uop opcode. reads and writes: the size in bytes
+	uint8_t type;		// enum btrace_type
+	uint8_t flags;		// blocks: BTRACE_FLAG_*
+};
+
+#endif
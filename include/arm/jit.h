@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __ARM_JIT_H
+#define __ARM_JIT_H
+
+#include <arm/arm.h>
+
+#if WITH_JIT
+
+/* out of line versions of the uop handlers, used by translated code for anything it doesn't do natively */
+typedef void (*uop_handler_func)(struct uop *op);
+extern __thread const uop_handler_func *uop_handler_funcs; // of the running dispatch loop
+
+/* each core translates into its own code buffer */
+extern __thread bool jit_enabled;
+extern __thread bool jit_native_ops; // simple uops may be emitted inline, off when the handlers have to count them
+
+void jit_init(void);
+void jit_shutdown(void);
+void jit_flush(void);
+
+/* drop any translations of the len uops starting at start */
+void jit_invalidate(struct uop *start, int len);
+
+/*
+ * run the translated block starting at op, if there is one, promoting the block
+ * if it's hot enough. returns the number of uops executed, 0 if the caller should
+ * interpret the block.
+ */
+int jit_execute(struct uop *op);
+
+#endif
+
+#endif
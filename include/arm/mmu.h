@@ -30,17 +30,94 @@
  */
 bool mmu_read_instruction_word(armaddr_t address, word *data, bool priviledged);
 bool mmu_read_instruction_halfword(armaddr_t address, halfword *data, bool priviledged);
-bool mmu_read_mem_word(armaddr_t address, word *data);
-bool mmu_read_mem_halfword(armaddr_t address, halfword *data);
-bool mmu_read_mem_byte(armaddr_t address, byte *data);
+bool mmu_get_instruction_page(armaddr_t address, bool priviledged, armaddr_t *paddr, const void **host_ptr);
+bool mmu_probe_instruction_page(armaddr_t address, bool priviledged, armaddr_t *paddr);
 
-bool mmu_write_mem_word(armaddr_t address, word data);
-bool mmu_write_mem_halfword(armaddr_t address, halfword data);
-bool mmu_write_mem_byte(armaddr_t address, byte data);
+/* data accesses go through a set of these specialized for the core's current state */
+struct mmu_accessors {
+	bool (*read_word)(armaddr_t address, word *data);
+	bool (*read_halfword)(armaddr_t address, halfword *data);
+	bool (*read_byte)(armaddr_t address, byte *data);
+	bool (*write_word)(armaddr_t address, word data);
+	bool (*write_halfword)(armaddr_t address, halfword data);
+	bool (*write_byte)(armaddr_t address, byte data);
+};
+
+extern __thread const struct mmu_accessors *mmu_access;
+
+/* call when the cpu mode, the mmu flags or the mmu trace level changes */
+void mmu_select_access(void);
+
+static inline bool mmu_read_mem_word(armaddr_t address, word *data)
+{
+	return mmu_access->read_word(address, data);
+}
+
+static inline bool mmu_read_mem_halfword(armaddr_t address, halfword *data)
+{
+	return mmu_access->read_halfword(address, data);
+}
+
+static inline bool mmu_read_mem_byte(armaddr_t address, byte *data)
+{
+	return mmu_access->read_byte(address, data);
+}
+
+static inline bool mmu_write_mem_word(armaddr_t address, word data)
+{
+	return mmu_access->write_word(address, data);
+}
+
+static inline bool mmu_write_mem_halfword(armaddr_t address, halfword data)
+{
+	return mmu_access->write_halfword(address, data);
+}
+
+static inline bool mmu_write_mem_byte(armaddr_t address, byte data)
+{
+	return mmu_access->write_byte(address, data);
+}
+
+/*
+ * translated code does the common case of a load or store itself, with a probe of
+ * the most recently used way of the translation cache set. this describes where
+ * the sets are and how an entry is laid out. the access bits follow the state of
+ * the core, they're 0 while everything has to go through the accessors above.
+ */
+struct mmu_tcache_probe {
+	const void *sets;			// NUM_TCACHE_SETS of them, indexed by page number
+	int set_shift;				// log2 of the size of a set
+	word set_mask;
+	int tag_offset;				// of the fields of an entry
+	int flags_offset;
+	int read_delta_offset;		// add to the address for the host address, 0 if there isn't one
+	int write_delta_offset;
+	const dword *tag_base;		// or in the page address for the tag of a live entry
+	unsigned int read_access;	// flag bit a load needs in the entry
+	unsigned int write_access;
+};
+
+const struct mmu_tcache_probe *mmu_get_tcache_probe(void);
+
+/* after a probe misses, bring the page to the front of its set if it can be done without faulting */
+void mmu_tcache_fill(armaddr_t address, bool write);
+
+/* host pointer for a whole ldm/stm transfer, NULL if it has to go word by word */
+void *mmu_get_data_range(armaddr_t address, int len, bool write);
+void *mmu_get_data_run(armaddr_t address, size_t *len, bool write);
+
+/* atomic against the other cores, for swp */
+bool mmu_swap_mem_word(armaddr_t address, word data, word *old);
+bool mmu_swap_mem_byte(armaddr_t address, byte data, byte *old);
 
 /* initialization */
 void mmu_init(int with_mmu);
 
+/* in and out of a snapshot, the translation cache isn't in it */
+struct snapshot_mmu;
+void mmu_save_state(struct snapshot_mmu *state);
+void mmu_restore_state(const struct snapshot_mmu *state);
+
 /* mmu flags (cr1 flags in cp15) */
 #define MMU_ENABLED_FLAG          (1<<0)
 #define MMU_ALIGNMENT_FAULT_FLAG  (1<<1)
@@ -59,10 +136,16 @@ enum mmu_registers {
 	MMU_DOMAIN_ACCESS_CONTROL_REG,
 	MMU_FAULT_STATUS_REG,
 	MMU_FAULT_ADDRESS_REG,
+	MMU_CONTEXT_ID_REG, // the low 8 bits are the asid translations are tagged with
 };
 
 void mmu_set_register(enum mmu_registers reg, word val);
 word mmu_get_register(enum mmu_registers reg);
 void mmu_invalidate_tcache(void);
+void mmu_invalidate_tcache_page(armaddr_t mva);
+void mmu_invalidate_tcache_asid(word asid);
+
+/* watch a physical page for stores, it has instructions decoded out of it */
+void mmu_mark_code_page(armaddr_t paddr);
 
 #endif
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __ARM_STATS_H
+#define __ARM_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * exporting the perf counters, added up over every core, for something outside the
+ * emulator to watch. configured in the [stats] section:
+ *
+ *  print = yes       the old once a second rates on stdout
+ *  file = path       a line of json every interval, path can be unix:/socket/path
+ *  shm = /name       a posix shared memory segment laid out as below
+ *  interval = 1000   ms
+ *  summary = no      totals for the whole run on stdout as it stops, on by default
+ *                    with an instruction budget ([cpu] max_instructions or -n)
+ *  caches = no       each core's decode cache and mmu report as it stops, the guest
+ *                    can ask for its core's at any time through DEBUG_CACHE_STATS
+ */
+
+#define STATS_SHM_MAGIC		0x54534541 // "AEST"
+#define STATS_SHM_VERSION	1
+
+/*
+ * seq is odd while the counters are being updated, a reader that sees the same even
+ * value before and after has a consistent set. the names are nul terminated, one per
+ * counter in the same order, starting at names_offset.
+ */
+struct stats_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_counters;
+	uint32_t names_offset;
+	uint32_t seq;
+	uint32_t pid;
+	uint64_t time_ns;	// CLOCK_MONOTONIC as of the last update
+	uint64_t counters[];
+};
+
+struct cpu_cluster;
+struct perf_counters;
+
+void cpu_stats_snapshot(struct cpu_cluster *cluster, struct perf_counters *out);
+const char *perf_counter_name(int counter, char *buf, size_t len);
+int start_stats(struct cpu_cluster *cluster);
+void start_instruction_budget(struct cpu_cluster *cluster);
+void stats_core_stopped(struct cpu_cluster *cluster);
+void stop_stats(struct cpu_cluster *cluster);
+void dump_cache_stats(void);
+
+#endif
@@ -28,6 +28,7 @@ enum uop_opcode {
 	DECODE_ME_ARM = 0,
 	DECODE_ME_THUMB,
 	NOP,
+	CHUNK_NEXT,					// sentinel at the end of a codepage chunk, carries on in the next one
 	B_IMMEDIATE,
 	B_IMMEDIATE_LOCAL,			// immediate branch, local to this codepage, has to be in the same mode (ARM or THUMB)
 	B_REG,
@@ -94,6 +95,13 @@ enum uop_opcode {
 	NEG_REG_S,					// subtract from 0, sets full condition bits
 	MVN_REG_S,					// bitwise reverse, sets NZ condition bits
 
+	// fused pairs built by the peephole pass, the second slot is left intact for branches into it
+	CMP_IMM_BCC_LOCAL,			// CMP_IMM_S followed by a conditional B_IMMEDIATE_LOCAL
+	CMP_REG_BCC_LOCAL,			// CMP_REG_S followed by a conditional B_IMMEDIATE_LOCAL
+	MOV_IMM_PAIR,				// two MOV_IMMs in a row
+#define FIRST_FUSED_OPCODE CMP_IMM_BCC_LOCAL
+#define NUM_FUSED_OPCODES (MOV_IMM_PAIR - FIRST_FUSED_OPCODE + 1)
+
 	// multiply variants
 	MULTIPLY,
 	MULTIPLY_LONG,
@@ -122,15 +130,31 @@ enum uop_opcode {
 	MAX_UOP_OPCODE,
 };
 
+/*
+ * cached branch targets are kept as handles instead of pointers, to keep the uop small.
+ * a handle is the offset of the codepage into the codepage arena, 0 is no codepage.
+ */
+typedef uint32_t cp_handle_t;
+#define CP_HANDLE_NONE 0
+
 /* description for the internal opcode format and decoder routines */
 struct uop {
-	halfword opcode;
+	byte opcode;
 	byte cond; // 4 bits of condition
 	byte flags; // up to 8 flags
+
+	// basic block bookkeeping, filled in at decode time
+#define UOP_BLOCK_END		0x1 // always leave the current block after this uop (branch, pc write, mode change, etc)
+#define UOP_BLOCK_MAYFAULT	0x2 // memory access, leave the block if it raised an abort
+	byte block_flags;
+#if UOP_DISPATCH == UOP_DISPATCH_THREADED
+	int32_t handler; // offset of the dispatch handler, filled in as the opcode is set
+#endif
 	union {
 		struct {
 			// undecoded, arm or thumb
 			word raw_instruction;
+			halfword slot; // index into the codepage, for fetching the instruction when it's first decoded
 		} undecoded;
 
 		// branch opcodes
@@ -138,19 +162,22 @@ struct uop {
 #define UOPBFLAGS_SETTHUMB_ALWAYS 		0x2
 #define UOPBFLAGS_UNSETTHUMB_ALWAYS 	0x4
 #define UOPBFLAGS_SETTHUMB_COND			0x8 // set the thumb bit conditionally on the new value loaded
+#define UOPBFLAGS_IDLE_POLL				0x10 // a short loop back, might be polling a device (fused cmp_bcc too)
+#define UOPBFLAGS_IDLE_LOOP				0x20 // branch to self, nothing but an exception gets out of it
 		struct {
-			word target;
-			word link_target;
-			struct uop_codepage *target_cp; // once it's executed, cache a copy of the target codepage, if it's a nonlocal jump
+			word target; // the link target, if any, is the address of the next instruction
+			cp_handle_t target_cp; // once it's executed, cache a copy of the target codepage, if it's a nonlocal jump
 		} b_immediate;
 		struct {
-			word reg;
-			word link_offset;
+			byte reg;
+			signed char link_offset;
+			cp_handle_t target_cp; // codepage of the last nonlocal target, checked before use
 		} b_reg;
 		struct {
-			word reg;
-			word link_offset;
-			word offset;
+			byte reg;
+			signed char link_offset;
+			int16_t offset; // only used by the second half of thumb bl, 12 bits at most
+			cp_handle_t target_cp; // same as b_reg
 		} b_reg_offset;
 
 		// load/store opcodes
@@ -236,6 +263,21 @@ struct uop {
 			byte source2_reg;
 		} simple_dp_reg;
 
+		// fused pairs. to fit, the branch condition of cmp_bcc (along with
+		// UOPBFLAGS_IDLE_POLL) and the destination registers of mov_imm_pair
+		// are packed into the flags byte
+#define UOP_PAIR_REG(op, n) (((op)->flags >> ((n) * 4)) & 0xf)
+		struct {
+			word immediate;
+			halfword target_offset; // the branch is local, so just the offset into the codepage
+			byte source_reg;
+			byte source2_reg;
+		} cmp_bcc;
+		struct {
+			word immediate;
+			word immediate2;
+		} mov_imm_pair;
+
 		// multiply
 #define UOPMULFLAGS_S_BIT					0x1 // set NZ condition
 #define UOPMULFLAGS_ACCUMULATE				0x2 // add the contents of the accum reg to the product
@@ -285,25 +327,45 @@ struct uop {
 			word raw_instruction;			// the coprocessor parses the instruction
 			byte cp_num;
 		} coproc;
+
+		// swi and bkpt
+		struct {
+			word comment; // the immediate, the os (or semihosting) reads it to see what's being asked
+		} swi;
 		
 		struct sizing {
-			// space it out to 16 bytes
+			// space it out to 8 bytes, 16 for the whole uop
 			unsigned int data0;
 			unsigned int data1;
-			unsigned int data2;
 		} _sizing;
 	};
 };
 
-#define CODEPAGE_HASHSIZE 1024
+#define CODEPAGE_HASHSIZE 1024 // starting size, the hash doubles as codepages are added
 
 #define NUM_CODEPAGE_INS_ARM 	(MMU_PAGESIZE / 4)
 #define NUM_CODEPAGE_INS_THUMB 	(MMU_PAGESIZE / 2)
 
+/*
+ * the uops of a codepage are allocated in chunks, as the code in them is first run.
+ * each chunk has one extra slot on the end, holding a CHUNK_NEXT to get to the next
+ * chunk, or for the last one in the page a branch to the next codepage.
+ */
+#define CP_CHUNK_INS			64
+#define CP_MAX_CHUNKS			(NUM_CODEPAGE_INS_THUMB / CP_CHUNK_INS)
+
 /* a page of uops at a time */
 struct uop_codepage {
 	struct uop_codepage *next;
 	armaddr_t address;
+	armaddr_t paddr; // physical page the instructions came from, stores into it toss the codepage
+	unsigned int generation; // translation generation the address -> paddr mapping was last checked in
+
+	/* lru list of live codepages, for eviction when over the memory budget */
+	struct uop_codepage *lru_prev;
+	struct uop_codepage *lru_next;
+	bool referenced; // reached through a cached branch since the last eviction pass
+	unsigned int decodes; // instructions decoded into it since it was loaded
 
 	bool thumb; /* arm or thumb */
 
@@ -314,14 +376,49 @@ struct uop_codepage {
 	int pc_inc;
 	int pc_shift; // number of bits the real pc should be shifted to get to the codepage index (2 for arm, 1 for thumb)
 
-	struct uop ops[0]; /* we will allocate a different amount of space if it's arm or thumb */
+	/*
+	 * the page in host memory. if lazy is set, undecoded slots read their instruction
+	 * from here when they are first decoded, otherwise raw_instruction is filled in
+	 * as the chunk is allocated. pages that aren't plain memory have all of their
+	 * chunks allocated and filled in through the mmu at load time.
+	 */
+	const void *host_ptr;
+	bool lazy;
+
+	int num_chunks;
+	struct uop *chunks[CP_MAX_CHUNKS]; /* NULL until something in that part of the page runs */
+
+	struct uop_predecoded *predecoded; // what the predecode worker has done of it, see uop_predecode.c
 };
 
 /* main dispatch routine, returns on internal abort */
 int uop_dispatch_loop(void);
 
+/* the codepage hash chains and the codepages with the most decoding done in them */
+void uop_dump_codepages(int top);
+
+/*
+ * how much counting the dispatch loop does. each level is a separately compiled
+ * copy of the loop, so the lower ones don't pay for the counters at all.
+ */
+enum uop_instrumentation {
+	UOP_INSTRUMENTATION_BARE,	// nothing, not even the instruction count
+	UOP_INSTRUMENTATION_ICOUNT,	// instruction count
+	UOP_INSTRUMENTATION_CYCLES,	// instruction and cycle counts
+	UOP_INSTRUMENTATION_FULL,	// every counter compiled in with the COUNT_* options
+	MAX_UOP_INSTRUMENTATION,
+};
+
+enum uop_instrumentation uop_get_instrumentation(void);
+void uop_set_instrumentation(enum uop_instrumentation level); // takes effect at the end of the current block
+void uop_trace_levels_changed(void); // the per uop traces are only in their own dispatch loop, switch to or from it
+
+/* branch to an exception vector, the handler likely coming back to cpu.pc if returns_to_pc */
+void uop_exception_entry(armaddr_t vector, bool returns_to_pc);
+
 const char *uop_opcode_to_str(int opcode);
 
 void uop_init(void);
+void uop_shutdown(void);
 
 #endif
@@ -8,4 +8,11 @@ const char *get_config_key_string(const char *group, const char *key, const char
 
 int get_config_key_bool(const char *group, const char *key, int default_val);
 
+/* per machine overrides, layered on top of the keys above */
+struct config;
+struct config *create_config(void);
+void destroy_config(struct config *config);
+int add_local_config_key(struct config *config, const char *group, const char *key, const char *val);
+void set_thread_config(struct config *config);
+
 #endif
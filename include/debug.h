@@ -27,6 +27,7 @@
 #include <options.h> // for TRACE_XXX_LEVEL
 
 void _dprintf(const char *fmt, ...);
+void trace_flush(void); // write out what this thread has traced so far
 
 #if DYNAMIC_TRACE_LEVELS
 extern int TRACE_CPU_LEVEL;
@@ -35,11 +36,12 @@ extern int TRACE_SYS_LEVEL;
 extern int TRACE_MMU_LEVEL;
 #endif
 
-/* trace */
-#define CPU_TRACE(level, x...) { if((level) <= TRACE_CPU_LEVEL) _dprintf(x); } while(0)
-#define UOP_TRACE(level, x...) { if((level) <= TRACE_UOP_LEVEL) _dprintf(x); } while(0)
-#define SYS_TRACE(level, x...) { if((level) <= TRACE_SYS_LEVEL) _dprintf(x); } while(0)
-#define MMU_TRACE(level, x...) { if((level) <= TRACE_MMU_LEVEL) _dprintf(x); } while(0)
+/* trace. the ones run per uop or per memory access are compiled into their own
+ * variants of the dispatch loop and the mmu accessors, so they're not here */
+#define CPU_TRACE(level, x...) do { if(__builtin_expect((level) <= TRACE_CPU_LEVEL, 0)) _dprintf(x); } while(0)
+#define UOP_TRACE(level, x...) do { if(__builtin_expect((level) <= TRACE_UOP_LEVEL, 0)) _dprintf(x); } while(0)
+#define SYS_TRACE(level, x...) do { if(__builtin_expect((level) <= TRACE_SYS_LEVEL, 0)) _dprintf(x); } while(0)
+#define MMU_TRACE(level, x...) do { if(__builtin_expect((level) <= TRACE_MMU_LEVEL, 0)) _dprintf(x); } while(0)
 
 #endif
 
@@ -39,11 +39,51 @@
 
 #define DUMP_STATS      0 // should we run a thread that dumps stats once a second
 
+// counters compiled in. in the dispatch loop these only cost anything when the cycles
+// or full instrumentation level is selected (cpu/instrumentation in the config)
 #define COUNT_CYCLES 	1 // should we try to accurately count cycles
-#define COUNT_ARM_OPS	0
-#define COUNT_UOPS		0
-#define COUNT_ARITH_UOPS 0
-#define COUNT_MMU_OPS   0
+#define COUNT_ARM_OPS	1
+#define COUNT_UOPS		1
+#define COUNT_FUSIONS	1 // how many times each peephole fusion was made
+#define UOP_FUSION		1 // peephole pass that fuses common instruction pairs at decode time
+#define COUNT_ARITH_UOPS 1
+#define COUNT_MMU_OPS   0 // counted in the mmu itself, always paid for
+#define COUNT_BRANCH_CACHE 1 // hit rates of the indirect branch caches and the return stack
+
+#ifndef LAZY_FLAGS
+#define LAZY_FLAGS		1 // record the last flag setting op and only work out NZCV when something looks at it
+#endif
+
+// uop dispatch engine, override with -DUOP_DISPATCH=UOP_DISPATCH_xxx
+#define UOP_DISPATCH_SWITCH		0 // one big switch on the opcode, portable
+#define UOP_DISPATCH_THREADED	1 // each handler jumps straight to the next through a computed goto, needs gcc labels-as-values
+
+#ifndef UOP_DISPATCH
+#if defined(__GNUC__)
+#define UOP_DISPATCH UOP_DISPATCH_THREADED
+#else
+#define UOP_DISPATCH UOP_DISPATCH_SWITCH
+#endif
+#endif
+
+// x86-64 translator for hot basic blocks, turned on at runtime with 'jit = yes' in the [cpu] config section
+#ifndef WITH_JIT
+#if defined(__x86_64__)
+#define WITH_JIT 1
+#else
+#define WITH_JIT 0
+#endif
+#endif
+
+// guest physical memory mirrored in a 4GB host window, turned on at runtime with 'fastmem = yes' in the [system] config section.
+// faulting accesses are recovered from in a SIGSEGV handler, which needs the x86-64 linux signal context
+#ifndef WITH_FASTMEM
+#if defined(__x86_64__) && defined(__linux__)
+#define WITH_FASTMEM 1
+#else
+#define WITH_FASTMEM 0
+#endif
+#endif
 
 // compiler hints
 #define likely(x)   __builtin_expect(!!(x), 1)
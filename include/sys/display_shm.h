@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __SYS_DISPLAY_SHM_H
+#define __SYS_DISPLAY_SHM_H
+
+/*
+ * layout of the posix shared memory segment the headless display backend publishes
+ * the screen in ([display] backend = shm). it stands alone so a viewer or encoder
+ * can include it without the rest of the emulator.
+ *
+ * the header is followed by the pixels at offset, height lines of pitch bytes each, in
+ * the guest's format (rgb565 or xrgb8888, host endian) scaled up by the display scale.
+ *
+ * the emulator makes seq odd while it copies lines in and even again when it's done,
+ * a reader that sees the same even value before and after its own copy has a whole
+ * frame. each update bumps frame and sets the bits of the lines it touched in dirty,
+ * a reader takes the bits it has dealt with back out with an atomic and/exchange.
+ */
+#include <stdint.h>
+
+#define DISPLAY_SHM_MAGIC		0x42464541 // "AEFB"
+#define DISPLAY_SHM_VERSION		1
+#define DISPLAY_SHM_MAX_LINES	16384
+
+struct display_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bpp;		// 16 or 32
+	uint32_t pitch;
+	uint32_t offset;	// of the pixels from the start of the segment
+	uint32_t seq;
+	uint32_t frame;
+	uint32_t pid;		// of the emulator, so a viewer can tell a stale segment
+	uint32_t dirty[DISPLAY_SHM_MAX_LINES / 32];
+};
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __SYS_FASTMEM_H
+#define __SYS_FASTMEM_H
+
+#include <systypes.h>
+#include <options.h>
+
+/*
+ * fastmem: each machine can reserve 4GB of host address space that mirrors the
+ * guest physical address space. ram is mapped into it for real, everything else
+ * is left inaccessible. with the mmu not translating, a load or store is then a
+ * single host access at base + address.
+ *
+ * the accesses below are the only ones allowed to fault. each one leaves an entry
+ * in the fastmem_fixup section, and the SIGSEGV handler moves a faulting access on
+ * to its fixup, which reports the failure so the caller can take the regular path.
+ */
+#if WITH_FASTMEM
+
+byte *sys_get_fastmem(void); // NULL if the machine isn't using it
+void sys_fastmem_protect(armaddr_t paddr, bool protect); // keep stores out of a page, it has decoded instructions
+
+struct fastmem_fixup {
+	int32_t fault; // offset from this field to the access that may fault
+	int32_t fixup; // offset from this field to where it picks up again
+};
+
+#define FASTMEM_FIXUP(fault_reg) \
+	".pushsection fastmem_fixup, \"a\"\n" \
+	".balign 4\n" \
+	".long 1b - ., 3f - .\n" \
+	".popsection\n" \
+	".pushsection .text.fastmem, \"ax\"\n" \
+	"3:	movl $1, " fault_reg "\n" \
+	"	jmp 2b\n" \
+	".popsection\n"
+
+/* these all return TRUE if the address wasn't ram */
+static inline bool fastmem_read_word(const byte *ptr, word *data)
+{
+	word val;
+	bool fault = FALSE;
+
+	asm volatile("1:	movl %2, %0\n2:\n" FASTMEM_FIXUP("%1")
+		: "=r" (val), "+r" (fault) : "m" (*(const word *)ptr));
+	*data = val;
+	return fault;
+}
+
+static inline bool fastmem_read_halfword(const byte *ptr, halfword *data)
+{
+	word val;
+	bool fault = FALSE;
+
+	asm volatile("1:	movzwl %2, %0\n2:\n" FASTMEM_FIXUP("%1")
+		: "=r" (val), "+r" (fault) : "m" (*(const halfword *)ptr));
+	*data = val;
+	return fault;
+}
+
+static inline bool fastmem_read_byte(const byte *ptr, byte *data)
+{
+	word val;
+	bool fault = FALSE;
+
+	asm volatile("1:	movzbl %2, %0\n2:\n" FASTMEM_FIXUP("%1")
+		: "=r" (val), "+r" (fault) : "m" (*(const byte *)ptr));
+	*data = val;
+	return fault;
+}
+
+static inline bool fastmem_write_word(byte *ptr, word data)
+{
+	bool fault = FALSE;
+
+	asm volatile("1:	movl %2, %0\n2:\n" FASTMEM_FIXUP("%1")
+		: "=m" (*(word *)ptr), "+r" (fault) : "r" (data));
+	return fault;
+}
+
+static inline bool fastmem_write_halfword(byte *ptr, halfword data)
+{
+	bool fault = FALSE;
+
+	asm volatile("1:	movw %w2, %0\n2:\n" FASTMEM_FIXUP("%1")
+		: "=m" (*(halfword *)ptr), "+r" (fault) : "r" (data));
+	return fault;
+}
+
+static inline bool fastmem_write_byte(byte *ptr, byte data)
+{
+	bool fault = FALSE;
+
+	asm volatile("1:	movb %b2, %0\n2:\n" FASTMEM_FIXUP("%1")
+		: "=m" (*ptr), "+r" (fault) : "r" (data));
+	return fault;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __SYS_FUZZ_H
+#define __SYS_FUZZ_H
+
+/*
+ * running a guest under afl-fuzz, configured in [fuzz]:
+ *
+ *  enable = no         turns it on, so does input
+ *  input = case.bin    where each run's test case comes from, afl's @@. stdin if not given
+ *
+ * the guest boots as usual, sets up the buffer the test case goes in through
+ * DEBUG_FUZZ_INPUT_ADDR and DEBUG_FUZZ_INPUT_SIZE, and writes DEBUG_FUZZ_START.
+ * that's the fork server: the machine as it is then is forked for every run, and
+ * the run carries on from the write with the test case in the buffer and its length
+ * in DEBUG_FUZZ_INPUT_LEN. halting ends the run, a panic (DEBUG_HALT with 1 among
+ * them) is a crash. not under afl-fuzz the one test case is run and that's it.
+ *
+ * with __AFL_SHM_ID the cores count edges into afl's map, at the branches. with
+ * afl++'s __AFL_SHM_FUZZ_ID the test cases come through shared memory instead.
+ *
+ * only the core thread goes through a fork, so it takes a single core with
+ * [pit] virtual_time, no fastmem (its ram is shared, not copied), no predecode,
+ * and none of the display, network or block devices.
+ */
+
+/* a panic on the core, in a run it's reported to afl as a crash */
+void fuzz_crash(void);
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __SYS_SEMIHOST_H
+#define __SYS_SEMIHOST_H
+
+/*
+ * arm semihosting, turned on with [debug] semihosting = yes. a swi 0x123456 (0xab
+ * in thumb) or bkpt 0xab is a call to the emulator instead of an exception, r0
+ * says which and r1 points at its arguments, the result comes back in r0. it's
+ * there for test binaries built against a semihosting libc: files on the host,
+ * opened by their host path, and the console, which is ":tt" and goes out with
+ * the debug console.
+ *
+ * the calls are SYS_OPEN, CLOSE, WRITEC, WRITE0, WRITE, READ, ISTTY, SEEK, FLEN,
+ * CLOCK, ERRNO, EXIT and EXIT_EXTENDED. buffers move straight between the file
+ * and guest memory, through the host's pointer to it where it's plain memory.
+ * a bad pointer fails the call with EFAULT rather than aborting. the open files
+ * aren't part of a snapshot.
+ */
+#define SEMIHOST_SWI_ARM	0x123456
+#define SEMIHOST_SWI_THUMB	0xab
+#define SEMIHOST_BKPT		0xab
+
+/* on the core, for its swi or bkpt */
+void semihost_call(void);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __SYS_SNAPSHOT_H
+#define __SYS_SNAPSHOT_H
+
+#include <stdint.h>
+
+/*
+ * a snapshot of a whole machine, configured in [snapshot]:
+ *
+ *  save = boot.snap    where a snapshot goes, written when the guest asks through
+ *                      DEBUG_SNAPSHOT or once save_at comes around
+ *  save_at = 0         guest time (instructions on the boot core) to save at
+ *  halt = no           halt the machine once it's saved, exiting 0
+ *  restore = boot.snap start from this snapshot instead of the reset vector
+ *
+ * the file is the header, the ram at ram_offset and then the sections, each a
+ * fixed size block of state for one core or device. everything is host endian.
+ * the ram is page aligned in the file so a restore maps it copy on write straight
+ * over the machine's ram: only the pages the guest touches are read in, and any
+ * number of machines restored from the same file share the rest. that can't be
+ * done to ram that's mapped twice for fastmem or is made of huge pages, then it's
+ * read in. pages that were all zeroes are left as holes.
+ *
+ * the block device image isn't in it. a restore has to be against the image as it
+ * was saved, an overlay_discard image nothing wrote to before the save, or a copy
+ * of the overlay file taken along with the snapshot.
+ */
+#define SNAPSHOT_MAGIC		0x50534e41 // "ANSP"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_MAX_SECTIONS	64
+#define SNAPSHOT_RAM_OFFSET	0x10000 // a multiple of any host's page size
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_cores;
+	uint32_t num_sections;
+	char core_type[16];	// [cpu] core, it has to match on restore
+	uint64_t ram_base;	// guest physical
+	uint64_t ram_size;
+	uint64_t ram_offset;	// in the file
+	uint64_t guest_time;	// of the boot core, when it was saved
+	struct snapshot_section {
+		uint32_t tag;
+		uint32_t size;
+		uint64_t offset;
+	} sections[SNAPSHOT_MAX_SECTIONS];
+};
+
+#define SNAPSHOT_TAG_CPU(n)	('CPU0' + (n))
+#define SNAPSHOT_TAG_MMU(n)	('MMU0' + (n))
+#define SNAPSHOT_TAG_CP15(n)	('SCP0' + (n))
+#define SNAPSHOT_TAG_PIC	'PIC '
+#define SNAPSHOT_TAG_PIT	'PIT '
+#define SNAPSHOT_TAG_TIMER	'TIMR'
+#define SNAPSHOT_TAG_BDEV	'BDEV'
+#define SNAPSHOT_TAG_DISPLAY	'DISP'
+#define SNAPSHOT_TAG_MEMOP	'MEMO'
+
+/* a core's registers, taken between blocks */
+struct snapshot_cpu {
+	uint32_t pc;
+	uint32_t cpsr;
+	uint32_t r[15];
+	uint32_t spsr;
+	uint32_t old_cpsr;
+	uint32_t exception_base;
+	uint32_t pending_exceptions; // but for EX_IRQ and EX_FIQ, the pic puts those back
+	uint32_t usr_regs_low[5];
+	uint32_t usr_regs[2];
+	uint32_t irq_regs[3];
+	uint32_t svc_regs[3];
+	uint32_t abt_regs[3];
+	uint32_t und_regs[3];
+	uint32_t fiq_regs[8];
+	uint64_t guest_time;
+};
+
+/* the mmu's registers, its translation cache starts over empty */
+struct snapshot_mmu {
+	uint32_t present;
+	uint32_t flags;
+	uint32_t translation_table;
+	uint32_t domain_access_control;
+	uint32_t fault_status;
+	uint32_t fault_address;
+	uint32_t context_id;
+	uint32_t asid_switching;
+};
+
+struct snapshot_cp15 {
+	uint32_t id;
+	uint32_t cr1;
+	uint32_t process_id;
+};
+
+/* the sections of the snapshot being saved or restored */
+struct snapshot;
+
+void snapshot_put(struct snapshot *s, uint32_t tag, const void *data, uint32_t size);
+const void *snapshot_get(struct snapshot *s, uint32_t tag, uint32_t size);
+
+/* on each core's own thread as it comes up, before any of them run */
+struct cpu_cluster;
+void snapshot_core_started(struct cpu_cluster *cluster);
+
+#endif
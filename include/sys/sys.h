@@ -26,15 +26,49 @@
 #include <systypes.h>
 #include <arm/arm.h>
 
-int initialize_system(void);
-void system_reset(void);
-void system_start(void);
-int system_message_loop(void);
-void install_mem_handler(armaddr_t base, armaddr_t len,
-	word (*get_put)(armaddr_t address, word data, int size, int put),
-	void* (*get_ptr)(armaddr_t address));
+/*
+ * one emulated machine: its cores, memory map and devices. any number of them
+ * can run at once, each on its own threads. code running on behalf of a machine
+ * (its cores, device threads and timers) finds it through machine.
+ */
+struct machine;
+
+extern __thread struct machine *machine;
+
+struct machine *machine_create(void);
+int machine_set_config(struct machine *m, const char *group, const char *key, const char *val);
+int machine_start(struct machine *m);
+void machine_reset(struct machine *m);
+void machine_halt(struct machine *m, int exit_code);
+int machine_wait(struct machine *m);
+void machine_destroy(struct machine *m);
+void machine_enter(struct machine *m);
+
+int system_message_loop(struct machine *m);
 void dump_sys(void);
 
+/*
+ * the handlers for one region of the physical address space, each is passed the
+ * ctx the region was installed with. plain memory also has get_ptr, so the cpu can
+ * go around the handlers, and has to be contiguous in host memory. a device only fills in the sizes it answers to, accesses
+ * of any other size are dropped and read as 0.
+ */
+struct mem_handler {
+	word (*read_word)(void *ctx, armaddr_t address);
+	halfword (*read_halfword)(void *ctx, armaddr_t address);
+	byte (*read_byte)(void *ctx, armaddr_t address);
+	void (*write_word)(void *ctx, armaddr_t address, word data);
+	void (*write_halfword)(void *ctx, armaddr_t address, halfword data);
+	void (*write_byte)(void *ctx, armaddr_t address, byte data);
+	void* (*get_ptr)(void *ctx, armaddr_t address);
+};
+
+/* regions are mapped a page at a time, base and len have to be multiples of it */
+#define MEMMAP_PAGE_SHIFT 12
+#define MEMMAP_PAGE_SIZE (1 << MEMMAP_PAGE_SHIFT)
+
+int install_mem_handler(armaddr_t base, armaddr_t len, const struct mem_handler *handler, void *ctx);
+
 /* referenced by the cpu */
 word sys_read_mem_word(armaddr_t address);
 halfword sys_read_mem_halfword(armaddr_t address);
@@ -44,5 +78,21 @@ void sys_write_mem_halfword(armaddr_t address, halfword data);
 void sys_write_mem_byte(armaddr_t address, byte data);
 
 void *sys_get_mem_ptr(armaddr_t address);
+void *sys_dma_map(armaddr_t address, size_t len, size_t *chunk);
+
+/*
+ * an installed region. the cpu looks it up once per page and keeps it with the
+ * translation, so later accesses go straight to the handler for their size.
+ */
+struct mem_region;
+
+const struct mem_region *sys_get_mem_region(armaddr_t address);
+word sys_region_read_word(const struct mem_region *region, armaddr_t address);
+halfword sys_region_read_halfword(const struct mem_region *region, armaddr_t address);
+byte sys_region_read_byte(const struct mem_region *region, armaddr_t address);
+void sys_region_write_word(const struct mem_region *region, armaddr_t address, word data);
+void sys_region_write_halfword(const struct mem_region *region, armaddr_t address, halfword data);
+void sys_region_write_byte(const struct mem_region *region, armaddr_t address, byte data);
+void *sys_region_get_ptr(const struct mem_region *region, armaddr_t address);
 
 #endif
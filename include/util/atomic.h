@@ -23,11 +23,40 @@
 #ifndef __ATOMIC_H
 #define __ATOMIC_H
 
-int atomic_add(volatile int *val, int incr);
-int atomic_and(volatile int *val, int incr);
-int atomic_or(volatile int *val, int incr);
-int atomic_set(volatile int *val, int set_to);
-int test_and_set(volatile int *val, int set_to, int test_val);
+/*
+ * atomic operations on a word, inline compiler builtins. the plain ones are
+ * full barriers, the _relaxed, _acquire and _release ones only order what
+ * their name says, for the places that have worked out that's all they need.
+ * the read-modify-writes return what was there before.
+ */
+#define atomic_add(val, incr)		__atomic_fetch_add((val), (incr), __ATOMIC_SEQ_CST)
+#define atomic_and(val, incr)		__atomic_fetch_and((val), (incr), __ATOMIC_SEQ_CST)
+#define atomic_or(val, incr)		__atomic_fetch_or((val), (incr), __ATOMIC_SEQ_CST)
+#define atomic_set(val, set_to)		__atomic_exchange_n((val), (set_to), __ATOMIC_SEQ_CST)
+
+#define atomic_add_relaxed(val, incr)	__atomic_fetch_add((val), (incr), __ATOMIC_RELAXED)
+#define atomic_and_relaxed(val, incr)	__atomic_fetch_and((val), (incr), __ATOMIC_RELAXED)
+#define atomic_or_relaxed(val, incr)	__atomic_fetch_or((val), (incr), __ATOMIC_RELAXED)
+#define atomic_add_release(val, incr)	__atomic_fetch_add((val), (incr), __ATOMIC_RELEASE)
+
+/* set_to goes in if test_val is there, either way returns what was there */
+#define __test_and_set(val, set_to, test_val, order) ({ \
+	__typeof__(*(val) + 0) __old = (test_val); \
+	__atomic_compare_exchange_n((val), &__old, (set_to), 0, (order), (order)); \
+	__old; \
+})
+#define test_and_set(val, set_to, test_val)		__test_and_set(val, set_to, test_val, __ATOMIC_SEQ_CST)
+#define test_and_set_acquire(val, set_to, test_val)	__test_and_set(val, set_to, test_val, __ATOMIC_ACQUIRE)
+
+#define atomic_load(val)		__atomic_load_n((val), __ATOMIC_SEQ_CST)
+#define atomic_load_relaxed(val)	__atomic_load_n((val), __ATOMIC_RELAXED)
+#define atomic_load_acquire(val)	__atomic_load_n((val), __ATOMIC_ACQUIRE)
+
+#define atomic_store(val, set_to)		__atomic_store_n((val), (set_to), __ATOMIC_SEQ_CST)
+#define atomic_store_relaxed(val, set_to)	__atomic_store_n((val), (set_to), __ATOMIC_RELAXED)
+#define atomic_store_release(val, set_to)	__atomic_store_n((val), (set_to), __ATOMIC_RELEASE)
+
+#define atomic_fence()			__atomic_thread_fence(__ATOMIC_SEQ_CST)
 
 #endif
 
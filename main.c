@@ -40,7 +40,7 @@ static struct termios oldstdout;
 
 static void usage(int argc, char **argv)
 {
-	fprintf(stderr, "usage: %s [-b binary] [-c cpu type] [-r romfile] [-n cycle count]\n", argv[0]);
+	fprintf(stderr, "usage: %s [-c cpu type] [-r romfile] [-n instruction count] [-f fuzz test case]\n", argv[0]);
 
 	exit(1);
 }
@@ -87,6 +87,9 @@ static void setconsole(void)
 
 int main(int argc, char **argv)
 {
+	struct machine *m;
+	int exit_code;
+
 	// load the configuration of the emulator from the command line and config file
 	load_config(argc, argv);
 
@@ -98,10 +101,12 @@ int main(int argc, char **argv)
 		static struct option long_options[] = {
 			{"rom", 1, 0, 'r'},
 			{"cpu", 1, 0, 'c'},
+			{"instructions", 1, 0, 'n'},
+			{"fuzz-input", 1, 0, 'f'},
 			{0, 0, 0, 0},
 		};
 		
-		c = getopt_long(argc, argv, "r:c:", long_options, &option_index);
+		c = getopt_long(argc, argv, "r:c:n:f:", long_options, &option_index);
 		if(c == -1)
 			break;
 
@@ -114,6 +119,14 @@ int main(int argc, char **argv)
 				printf("cpu core option: '%s'\n", optarg);
 				add_config_key("cpu", "core", optarg);
 				break;
+			case 'n':
+				printf("instruction count option: '%s'\n", optarg);
+				add_config_key("cpu", "max_instructions", optarg);
+				break;
+			case 'f':
+				printf("fuzz input option: '%s'\n", optarg);
+				add_config_key("fuzz", "input", optarg);
+				break;
 			default:
 				usage(argc, argv);
 				break;
@@ -128,18 +141,18 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	// initialize the system
-	if (initialize_system() < 0) {
+	// build the machine and start it, should spawn a thread per cpu core
+	m = machine_create();
+	if (machine_start(m) < 0) {
 		fprintf(stderr, "failed to initialize system, bailing\n");
 		return 1;
 	}
 
-	// start the system, should spawn a cpu thread
-	system_start();
+	// run the SDL message loop until the machine halts
+	exit_code = system_message_loop(m);
 
-	// run the SDL message loop
-	system_message_loop();
+	machine_destroy(m);
 
-	return 0;
+	return exit_code;
 }
 
@@ -20,12 +20,16 @@
  * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
+#define _GNU_SOURCE // O_DIRECT
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -35,6 +39,7 @@
 #include <config.h>
 #include <arm/arm.h>
 #include <sys/sys.h>
+#include <sys/snapshot.h>
 #include "sys_p.h"
 #include <util/endian.h>
 #include <util/atomic.h>
@@ -44,11 +49,26 @@
 #include <linux/fs.h>
 #endif
 
-static struct bdev {
+/* host threads doing ring transfers, so that many can be in flight at once */
+#define BDEV_WORKERS 4
+
+struct bdev {
 	int fd;
+	int direct_fd; // the same image O_DIRECT, -1 unless block.sync is set
+	bool is_blkdev;
+
+	// overlay mode, see overlay_transfer()
+	const byte *base; // the image mapped read only, NULL if it isn't in overlay mode
+	int overlay_fd;
+	uint32_t *bitmap;
+	off_t overlay_data; // where the copy of the image starts in the overlay file
+	bool overlay_persist;
+	SDL_mutex *overlay_lock;
 
 	off_t length;
 
+	struct bdev_cache *cache; // NULL unless block.cache is set
+
 	// pending command stuff
 	uint cmd;
 	armaddr_t trans_addr;
@@ -57,33 +77,448 @@ static struct bdev {
 
 	// error codes
 	uint last_err;
-} *bdev;
 
+	// command ring
+	armaddr_t ring_addr;
+	uint ring_len;
+	uint ring_head; // next descriptor to pick up
+	uint ring_done;
+
+	// descriptors waiting for a worker
+	SDL_mutex *queue_lock;
+	SDL_cond *queue_cond;
+	struct bdev_request *queue_head;
+	struct bdev_request *queue_tail;
+	SDL_Thread *workers[BDEV_WORKERS];
+	bool stopping;
+};
+
+/* a descriptor from the ring, copied out when it was handed over */
+struct bdev_request {
+	struct bdev_request *next;
+	armaddr_t desc;
+	uint cmd;
+	armaddr_t addr;
+	off_t off;
+	size_t len;
+};
+
+/*
+ * with block.sync the image is opened a second time O_DIRECT. a transfer that lines
+ * up on BDEV_DIRECT_ALIGN in host memory and in the image goes through that one and
+ * skips the page cache, anything else takes the regular O_SYNC descriptor.
+ */
+#define BDEV_DIRECT_ALIGN 512
+
+static bool file_transfer(int fd, void *ptr, off_t offset, size_t length, bool write)
+{
+	while (length > 0) {
+		ssize_t err = write ? pwrite(fd, ptr, length, offset) : pread(fd, ptr, length, offset);
+
+		if (err < 0 && errno == EINTR)
+			continue;
+		if (err == 0)
+			errno = EIO;
+		if (err <= 0)
+			return FALSE;
+
+		ptr = (byte *)ptr + err;
+		offset += err;
+		length -= err;
+	}
+
+	return TRUE;
+}
+
+static bool overlay_transfer(struct bdev *bdev, void *ptr, off_t offset, size_t length, bool write);
+
+static bool bdev_transfer(struct bdev *bdev, void *ptr, off_t offset, size_t length, bool write)
+{
+	if (bdev->base)
+		return overlay_transfer(bdev, ptr, offset, length, write);
+
+	if (bdev->direct_fd >= 0 && (((uintptr_t)ptr | (uintptr_t)offset | length) & (BDEV_DIRECT_ALIGN - 1)) == 0) {
+		if (file_transfer(bdev->direct_fd, ptr, offset, length, write))
+			return TRUE;
+		/* anything but the underlying device wanting a bigger alignment is a real error */
+		if (errno != EINVAL)
+			return FALSE;
+	}
+
+	return file_transfer(bdev->fd, ptr, offset, length, write);
+}
+
+/*
+ * the block cache, off unless block.cache is set. guest filesystems like to go through
+ * the image a sector or two at a time, so rather than a syscall apiece those come out of
+ * copies of the image's blocks kept here. a read that carries on from where the last one
+ * ended is taken for a stream, and a miss in one fetches that many more of the blocks
+ * after it in the same go, twice as many each time up to block.readahead. writes land
+ * in the cache and go out later, runs of neighbouring dirty blocks in one transfer,
+ * unless block.sync is set, then they go straight through. transfers too big to gain
+ * anything skip it, they only pick up or update whatever copies it has.
+ *
+ * the one lock covers the cache and the i/o done for it, the workers take turns.
+ */
+#define BDEV_CACHE_BLOCK 4096
+#define BDEV_CACHE_RUN 32 // blocks filled or written back in one transfer, at least
+#define BDEV_CACHE_WINDOW 4 // blocks read ahead once a stream is spotted
+
+struct bdev_cache_block {
+	off_t block; // -1 while it's unused
+	bool dirty;
+	byte *data;
+	struct bdev_cache_block *hash_next;
+	struct bdev_cache_block *prev, *next; // lru list, most recently used first
+};
+
+struct bdev_cache {
+	SDL_mutex *lock;
+	struct bdev_cache_block *blocks;
+	uint num_blocks;
+	struct bdev_cache_block **hash;
+	uint hash_mask;
+	struct bdev_cache_block lru;
+	uint dirty;
+	bool write_through;
+
+	// read-ahead
+	off_t stream_next; // where the last read ended
+	uint window; // 0 until a stream has been seen
+	uint max_window;
+
+	// a run's worth of blocks each, filled and written back in one go
+	uint run;
+	byte *fill_buf;
+	byte *flush_buf;
+	struct bdev_cache_block **flush_run;
+
+	uint64_t hits, misses, readahead, writebacks, written;
+};
+
+static inline uint cache_hash(struct bdev_cache *cache, off_t block)
+{
+	return (uint)(block ^ (block >> 16)) & cache->hash_mask;
+}
+
+static struct bdev_cache_block *cache_lookup(struct bdev_cache *cache, off_t block)
+{
+	struct bdev_cache_block *b;
+
+	for (b = cache->hash[cache_hash(cache, block)]; b; b = b->hash_next) {
+		if (b->block == block)
+			return b;
+	}
+	return NULL;
+}
+
+static void cache_touch(struct bdev_cache *cache, struct bdev_cache_block *b)
+{
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+
+	b->next = cache->lru.next;
+	b->prev = &cache->lru;
+	b->next->prev = b;
+	cache->lru.next = b;
+}
+
+/* forget what's in b, dirty or not, and make it the first to be reused */
+static void cache_drop(struct bdev_cache *cache, struct bdev_cache_block *b)
+{
+	struct bdev_cache_block **p;
+
+	for (p = &cache->hash[cache_hash(cache, b->block)]; *p != b; p = &(*p)->hash_next)
+		;
+	*p = b->hash_next;
+
+	if (b->dirty) {
+		b->dirty = FALSE;
+		cache->dirty--;
+	}
+	b->block = -1;
+
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+
+	b->prev = cache->lru.prev;
+	b->next = &cache->lru;
+	b->prev->next = b;
+	cache->lru.prev = b;
+}
+
+/* write back dirty block b, along with as many of the dirty ones either side as fit in a run */
+static bool cache_write_run(struct bdev *bdev, struct bdev_cache_block *b)
+{
+	struct bdev_cache *cache = bdev->cache;
+	struct bdev_cache_block *n;
+	off_t first = b->block;
+	off_t offset;
+	uint count = 0;
+	uint i;
+
+	while (first > 0 && b->block - first < cache->run / 2 &&
+			(n = cache_lookup(cache, first - 1)) && n->dirty)
+		first--;
+	while (count < cache->run && (n = cache_lookup(cache, first + count)) && n->dirty) {
+		cache->flush_run[count] = n;
+		memcpy(cache->flush_buf + count * BDEV_CACHE_BLOCK, n->data, BDEV_CACHE_BLOCK);
+		count++;
+	}
+
+	offset = first * BDEV_CACHE_BLOCK;
+	if (!bdev_transfer(bdev, cache->flush_buf, offset,
+			MIN((off_t)count * BDEV_CACHE_BLOCK, bdev->length - offset), TRUE))
+		return FALSE;
+
+	for (i = 0; i < count; i++)
+		cache->flush_run[i]->dirty = FALSE;
+	cache->dirty -= count;
+	cache->writebacks++;
+	cache->written += count;
+
+	return TRUE;
+}
+
+static bool cache_flush(struct bdev *bdev)
+{
+	struct bdev_cache *cache = bdev->cache;
+	uint i;
+
+	for (i = 0; i < cache->num_blocks && cache->dirty > 0; i++) {
+		if (cache->blocks[i].dirty && !cache_write_run(bdev, &cache->blocks[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* take over the least recently used block for block, writing it back first if it has to be */
+static struct bdev_cache_block *cache_alloc(struct bdev *bdev, off_t block)
+{
+	struct bdev_cache *cache = bdev->cache;
+	struct bdev_cache_block *b = cache->lru.prev;
+	uint h;
+
+	if (b->dirty && !cache_write_run(bdev, b))
+		return NULL;
+	if (b->block >= 0)
+		cache_drop(cache, b);
+
+	b->block = block;
+	h = cache_hash(cache, block);
+	b->hash_next = cache->hash[h];
+	cache->hash[h] = b;
+	cache_touch(cache, b);
+
+	return b;
+}
+
+/*
+ * read block in, along with the ones after it up to ahead that aren't in yet, in one
+ * transfer. the ones past last weren't asked for, they're the read-ahead.
+ */
+static struct bdev_cache_block *cache_fill(struct bdev *bdev, off_t block, off_t last, off_t ahead)
+{
+	struct bdev_cache *cache = bdev->cache;
+	struct bdev_cache_block *b = NULL;
+	off_t offset = block * BDEV_CACHE_BLOCK;
+	size_t length;
+	uint count = 1;
+	int i;
+
+	ahead = MIN(ahead, (bdev->length - 1) / BDEV_CACHE_BLOCK);
+	while (block + count <= ahead && count < cache->run && !cache_lookup(cache, block + count))
+		count++;
+
+	length = MIN((off_t)count * BDEV_CACHE_BLOCK, bdev->length - offset);
+	if (!bdev_transfer(bdev, cache->fill_buf, offset, length, FALSE))
+		return NULL;
+
+	cache->misses++;
+	if (block + count - 1 > last)
+		cache->readahead += block + count - 1 - last;
+
+	// backwards, so the one that was asked for ends up the most recently used
+	for (i = count - 1; i >= 0; i--) {
+		size_t valid = MIN(BDEV_CACHE_BLOCK, length - i * BDEV_CACHE_BLOCK);
+
+		b = cache_alloc(bdev, block + i);
+		if (!b)
+			return NULL;
+		memcpy(b->data, cache->fill_buf + i * BDEV_CACHE_BLOCK, valid);
+		memset(b->data + valid, 0, BDEV_CACHE_BLOCK - valid);
+	}
+
+	return b;
+}
+
+/* bring ptr and whatever copies the cache has of the range up to date with each other */
+static void cache_sync_range(struct bdev_cache *cache, void *ptr, off_t offset, size_t length, bool write)
+{
+	while (length > 0) {
+		size_t skip = offset % BDEV_CACHE_BLOCK;
+		size_t chunk = MIN(length, BDEV_CACHE_BLOCK - skip);
+		struct bdev_cache_block *b = cache_lookup(cache, offset / BDEV_CACHE_BLOCK);
+
+		if (b && write)
+			memcpy(b->data + skip, ptr, chunk);
+		else if (b && b->dirty)
+			memcpy(ptr, b->data + skip, chunk);
+
+		ptr = (byte *)ptr + chunk;
+		offset += chunk;
+		length -= chunk;
+	}
+}
+
+static bool cache_transfer(struct bdev *bdev, void *ptr, off_t offset, size_t length, bool write)
+{
+	struct bdev_cache *cache = bdev->cache;
+	off_t last = (offset + length - 1) / BDEV_CACHE_BLOCK;
+	off_t ahead = last;
+	bool ok = TRUE;
+
+	if (offset < 0 || (uint64_t)offset + length > (uint64_t)bdev->length)
+		return FALSE;
+	if (length == 0)
+		return TRUE;
+
+	SDL_LockMutex(cache->lock);
+
+	if (!write) {
+		/* carrying on from the last one, read further ahead each time */
+		if (offset == cache->stream_next && cache->max_window)
+			cache->window = cache->window ? MIN(cache->window * 2, cache->max_window) : MIN(BDEV_CACHE_WINDOW, cache->max_window);
+		else
+			cache->window = 0;
+		cache->stream_next = offset + length;
+		ahead += cache->window;
+	}
+
+	if (length >= cache->run * BDEV_CACHE_BLOCK || (write && cache->write_through)) {
+		/* straight through, a write first so the copies never get ahead of the image */
+		if (write && !bdev_transfer(bdev, ptr, offset, length, TRUE))
+			ok = FALSE;
+		else if (!write && !bdev_transfer(bdev, ptr, offset, length, FALSE))
+			ok = FALSE;
+		else
+			cache_sync_range(cache, ptr, offset, length, write);
+		goto done;
+	}
+
+	while (length > 0) {
+		off_t block = offset / BDEV_CACHE_BLOCK;
+		size_t skip = offset % BDEV_CACHE_BLOCK;
+		size_t chunk = MIN(length, BDEV_CACHE_BLOCK - skip);
+		struct bdev_cache_block *b = cache_lookup(cache, block);
+
+		if (b) {
+			cache->hits++;
+			cache_touch(cache, b);
+		} else if (write && skip == 0 && (chunk == BDEV_CACHE_BLOCK || offset + (off_t)chunk == bdev->length)) {
+			/* all of it is about to be written, no need to read it */
+			b = cache_alloc(bdev, block);
+			if (b)
+				memset(b->data + chunk, 0, BDEV_CACHE_BLOCK - chunk);
+		} else {
+			b = cache_fill(bdev, block, last, ahead);
+		}
+		if (!b) {
+			ok = FALSE;
+			break;
+		}
+
+		if (write) {
+			memcpy(b->data + skip, ptr, chunk);
+			if (!b->dirty) {
+				b->dirty = TRUE;
+				cache->dirty++;
+			}
+		} else {
+			memcpy(ptr, b->data + skip, chunk);
+		}
+
+		ptr = (byte *)ptr + chunk;
+		offset += chunk;
+		length -= chunk;
+	}
+
+	// don't let the dirty ones pile up to where every miss has to write one back
+	if (ok && cache->dirty > cache->num_blocks / 2)
+		ok = cache_flush(bdev);
+
+done:
+	SDL_UnlockMutex(cache->lock);
+	return ok;
+}
+
+/* called with the cache locked, before the range gets erased underneath it */
+static bool cache_erase(struct bdev *bdev, off_t offset, size_t length)
+{
+	struct bdev_cache *cache = bdev->cache;
+	uint i;
+
+	for (i = 0; i < cache->num_blocks; i++) {
+		struct bdev_cache_block *b = &cache->blocks[i];
+		off_t start = b->block * BDEV_CACHE_BLOCK;
+
+		if (b->block < 0 || start + BDEV_CACHE_BLOCK <= offset || start >= (off_t)(offset + length))
+			continue;
+
+		// the part outside the range has to survive
+		if (b->dirty && (start < offset || start + BDEV_CACHE_BLOCK > (off_t)(offset + length)) &&
+				!cache_write_run(bdev, b))
+			return FALSE;
+		cache_drop(cache, b);
+	}
+
+	return TRUE;
+}
+
+/* reads and writes go through here, the cache if there is one */
+static bool bdev_cached_transfer(struct bdev *bdev, void *ptr, off_t offset, size_t length, bool write)
+{
+	if (bdev->cache)
+		return cache_transfer(bdev, ptr, offset, length, write);
+	return bdev_transfer(bdev, ptr, offset, length, write);
+}
+
+/*
+ * the transfers go straight between the image and guest memory, a chunk at a time
+ * for as far as the memory is contiguous. only something that isn't plain memory
+ * gets bounced through a buffer and its handlers.
+ */
 static uint bdev_read(armaddr_t address, off_t offset, size_t length)
 {
+	struct bdev *bdev = machine->bdev;
+
 	SYS_TRACE(1, "sys: bdev_read at 0x%08x, offset 0x%16llx, size %zd\n", 
 		address, offset, length);
 
-	byte buf[4096];
-
-	lseek(bdev->fd, offset, SEEK_SET);
 	while (length > 0) {
-		size_t tohandle = MIN(sizeof(buf), length);
+		size_t chunk;
+		void *ptr = sys_dma_map(address, length, &chunk);
 
-		ssize_t err = read(bdev->fd, buf, tohandle);
-		if (err != (ssize_t)tohandle)
-			return BDEV_CMD_ERR_GENERAL;
+		if (ptr) {
+			if (!bdev_cached_transfer(bdev, ptr, offset, chunk, FALSE))
+				return BDEV_CMD_ERR_GENERAL;
+		} else {
+			byte buf[4096];
+			size_t i;
 
-		size_t i;
-		for (i = 0; i < tohandle / 4; i++) {
-			sys_write_mem_word(address + i*4, *(word *)(&buf[i * 4]));
+			chunk = MIN(sizeof(buf), length);
+			if (!bdev_cached_transfer(bdev, buf, offset, chunk, FALSE))
+				return BDEV_CMD_ERR_GENERAL;
+
+			for (i = 0; i < chunk / 4; i++)
+				sys_write_mem_word(address + i*4, *(word *)(&buf[i * 4]));
+			for (i *= 4; i < chunk; i++)
+				sys_write_mem_byte(address + i, buf[i]);
 		}
-		
-		for (; i < tohandle; i++)
-			sys_write_mem_byte(address + i, *(word *)(&buf[i]));
 
-		length -= tohandle;
-		address += tohandle;
+		length -= chunk;
+		address += chunk;
+		offset += chunk;
 	}
 
 	return BDEV_CMD_ERR_NONE;
@@ -91,29 +526,225 @@ static uint bdev_read(armaddr_t address, off_t offset, size_t length)
 
 static uint bdev_write(armaddr_t address, off_t offset, size_t length)
 {
+	struct bdev *bdev = machine->bdev;
+
 	SYS_TRACE(5, "sys: bdev_write at 0x%08x, offset 0x%16llx, size %zd\n", 
 		address, offset, length);
 
-	byte buf[4096];
+	while (length > 0) {
+		size_t chunk;
+		void *ptr = sys_dma_map(address, length, &chunk);
+
+		if (ptr) {
+			if (!bdev_cached_transfer(bdev, ptr, offset, chunk, TRUE))
+				return BDEV_CMD_ERR_GENERAL;
+		} else {
+			byte buf[4096];
+			size_t i;
+
+			chunk = MIN(sizeof(buf), length);
+			for (i = 0; i < chunk / 4; i++)
+				*(word *)(&buf[i * 4]) = sys_read_mem_word(address + i*4);
+			for (i *= 4; i < chunk; i++)
+				buf[i] = sys_read_mem_byte(address + i);
+
+			if (!bdev_cached_transfer(bdev, buf, offset, chunk, TRUE))
+				return BDEV_CMD_ERR_GENERAL;
+		}
+
+		length -= chunk;
+		address += chunk;
+		offset += chunk;
+	}
+
+	return BDEV_CMD_ERR_NONE;
+}
+
+/*
+ * overlay mode. the image is opened read only and mapped, so every machine using it
+ * shares the one copy in the page cache. writes go to a sparse overlay file of the
+ * machine's own instead, at the same offset past a header and a bitmap with a bit set
+ * for each block that's been written. a block only partly written is copied over from
+ * the image first. the bitmap is kept in the overlay file too, so it can be picked up
+ * again next time, unless the overlay is thrown away on exit.
+ */
+#define BDEV_OVERLAY_BLOCK 4096
+#define BDEV_OVERLAY_HEADER 4096
+#define BDEV_OVERLAY_MAGIC "ARMOVLY1"
+
+struct bdev_overlay_header {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t pad;
+	uint64_t base_length;
+};
+
+static byte bdev_zeroes[64*1024] __attribute__((aligned(4096)));
+
+static inline bool overlay_has(struct bdev *bdev, off_t block)
+{
+	return (bdev->bitmap[block / 32] & (1U << (block % 32))) != 0;
+}
+
+/* blocks first to last are in the overlay now */
+static bool overlay_mark(struct bdev *bdev, off_t first, off_t last)
+{
+	off_t block;
+
+	for (block = first; block <= last; block++)
+		bdev->bitmap[block / 32] |= 1U << (block % 32);
+
+	if (!bdev->overlay_persist)
+		return TRUE;
+	return file_transfer(bdev->overlay_fd, &bdev->bitmap[first / 32],
+		BDEV_OVERLAY_HEADER + (first / 32) * 4, (last / 32 - first / 32 + 1) * 4, TRUE);
+}
+
+static bool overlay_copy_up(struct bdev *bdev, off_t block)
+{
+	off_t offset = block * BDEV_OVERLAY_BLOCK;
+	size_t length = MIN(BDEV_OVERLAY_BLOCK, bdev->length - offset);
+
+	return file_transfer(bdev->overlay_fd, (void *)(bdev->base + offset), bdev->overlay_data + offset, length, TRUE);
+}
+
+/* called with the overlay lock held */
+static bool overlay_write(struct bdev *bdev, const void *ptr, off_t offset, size_t length)
+{
+	off_t first = offset / BDEV_OVERLAY_BLOCK;
+	off_t last = (offset + length - 1) / BDEV_OVERLAY_BLOCK;
+
+	if (offset % BDEV_OVERLAY_BLOCK && !overlay_has(bdev, first)) {
+		if (!overlay_copy_up(bdev, first))
+			return FALSE;
+	}
+	if ((offset + length) % BDEV_OVERLAY_BLOCK && !overlay_has(bdev, last) &&
+			!(last == first && offset % BDEV_OVERLAY_BLOCK)) {
+		if (!overlay_copy_up(bdev, last))
+			return FALSE;
+	}
+
+	if (!file_transfer(bdev->overlay_fd, (void *)ptr, bdev->overlay_data + offset, length, TRUE))
+		return FALSE;
+	return overlay_mark(bdev, first, last);
+}
+
+static bool overlay_transfer(struct bdev *bdev, void *ptr, off_t offset, size_t length, bool write)
+{
+	bool ok;
+
+	if (offset < 0 || (uint64_t)offset + length > (uint64_t)bdev->length)
+		return FALSE;
+	if (length == 0)
+		return TRUE;
+
+	if (write) {
+		SDL_LockMutex(bdev->overlay_lock);
+		ok = overlay_write(bdev, ptr, offset, length);
+		SDL_UnlockMutex(bdev->overlay_lock);
+		return ok;
+	}
 
-	lseek(bdev->fd, offset, SEEK_SET);
+	/* a bit is only set once its block is in the overlay, so reads can go without the lock */
 	while (length > 0) {
-		size_t tohandle = MIN(sizeof(buf), length);
+		off_t block = offset / BDEV_OVERLAY_BLOCK;
+		size_t run = MIN(length, BDEV_OVERLAY_BLOCK - offset % BDEV_OVERLAY_BLOCK);
+		bool in = overlay_has(bdev, block);
 
-		size_t i;
-		for (i = 0; i < tohandle / 4; i++) {
-			*(word *)(&buf[i * 4]) = sys_read_mem_word(address + i*4);
+		// take in the following blocks for as long as they're in the same place
+		while (run < length && overlay_has(bdev, ++block) == in)
+			run += MIN(length - run, BDEV_OVERLAY_BLOCK);
+
+		if (in) {
+			if (!file_transfer(bdev->overlay_fd, ptr, bdev->overlay_data + offset, run, FALSE))
+				return FALSE;
+		} else {
+			memcpy(ptr, bdev->base + offset, run);
 		}
-		
-		for (; i < tohandle; i++)
-			*(word *)(&buf[i]) = sys_read_mem_byte(address + i);
 
-		ssize_t err = write(bdev->fd, buf, tohandle);
-		if (err != (ssize_t)tohandle)
+		ptr = (byte *)ptr + run;
+		offset += run;
+		length -= run;
+	}
+
+	return TRUE;
+}
+
+/* whole blocks get a hole punched in the overlay, the ends are written with zeroes */
+static bool overlay_erase(struct bdev *bdev, off_t offset, size_t length)
+{
+	off_t start = (offset + BDEV_OVERLAY_BLOCK - 1) & ~(off_t)(BDEV_OVERLAY_BLOCK - 1);
+	off_t end = (offset + length) & ~(off_t)(BDEV_OVERLAY_BLOCK - 1);
+	bool ok = TRUE;
+
+	if (offset < 0 || (uint64_t)offset + length > (uint64_t)bdev->length)
+		return FALSE;
+	if (length == 0)
+		return TRUE;
+
+	SDL_LockMutex(bdev->overlay_lock);
+
+	if (end <= start) {
+		/* all inside a block or two */
+		ok = overlay_write(bdev, bdev_zeroes, offset, length);
+		goto done;
+	}
+
+	if (offset < start)
+		ok = overlay_write(bdev, bdev_zeroes, offset, start - offset);
+	if (ok && end < (off_t)(offset + length))
+		ok = overlay_write(bdev, bdev_zeroes, end, offset + length - end);
+	if (!ok)
+		goto done;
+
+#ifdef __LINUX
+	if (fallocate(bdev->overlay_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, bdev->overlay_data + start, end - start) != 0)
+#endif
+	{
+		off_t pos;
+
+		for (pos = start; ok && pos < end; pos += sizeof(bdev_zeroes))
+			ok = file_transfer(bdev->overlay_fd, bdev_zeroes, bdev->overlay_data + pos, MIN((off_t)sizeof(bdev_zeroes), end - pos), TRUE);
+	}
+	if (ok)
+		ok = overlay_mark(bdev, start / BDEV_OVERLAY_BLOCK, end / BDEV_OVERLAY_BLOCK - 1);
+
+done:
+	SDL_UnlockMutex(bdev->overlay_lock);
+	return ok;
+}
+
+/*
+ * erasing gives back zeroes. a file gets a hole punched in it, so a sparse image stays
+ * sparse, and a block device is asked to zero the range itself, which it does with a
+ * discard if that's guaranteed to read back as zeroes. anything that can't is written
+ * over with zeroes a big chunk at a time.
+ */
+static uint erase_range(struct bdev *bdev, off_t offset, size_t length)
+{
+	if (bdev->base)
+		return overlay_erase(bdev, offset, length) ? BDEV_CMD_ERR_NONE : BDEV_CMD_ERR_GENERAL;
+
+#ifdef __LINUX
+	if (bdev->is_blkdev) {
+		uint64_t range[2] = { offset, length };
+
+		if (ioctl(bdev->fd, BLKZEROOUT, range) == 0)
+			return BDEV_CMD_ERR_NONE;
+	} else {
+		if (fallocate(bdev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+			return BDEV_CMD_ERR_NONE;
+	}
+#endif
+
+	while (length > 0) {
+		size_t towrite = MIN(sizeof(bdev_zeroes), length);
+
+		if (!bdev_transfer(bdev, bdev_zeroes, offset, towrite, TRUE))
 			return BDEV_CMD_ERR_GENERAL;
 
-		length -= tohandle;
-		address += tohandle;
+		length -= towrite;
+		offset += towrite;
 	}
 
 	return BDEV_CMD_ERR_NONE;
@@ -121,134 +752,484 @@ static uint bdev_write(armaddr_t address, off_t offset, size_t length)
 
 static uint bdev_erase(off_t offset, size_t length)
 {
+	struct bdev *bdev = machine->bdev;
+	uint err;
+
 	SYS_TRACE(5, "sys: bdev_erase offset 0x%16llx, size %zd\n", 
 		offset, length);
 
-	char buf[512];
-	memset(buf, 0, sizeof(buf));
+	if (!bdev->cache)
+		return erase_range(bdev, offset, length);
 
-	lseek(bdev->fd, offset, SEEK_SET);
-	while (length > 0) {
-		size_t towrite = MIN(sizeof(buf), length);
+	/* held across the erase too, so nothing can read the old contents back in meanwhile */
+	SDL_LockMutex(bdev->cache->lock);
+	if (cache_erase(bdev, offset, length))
+		err = erase_range(bdev, offset, length);
+	else
+		err = BDEV_CMD_ERR_GENERAL;
+	SDL_UnlockMutex(bdev->cache->lock);
 
-		int err = write(bdev->fd, buf, towrite);
-		if (err != 0)
-			return BDEV_CMD_ERR_GENERAL;
+	return err;
+}
 
-		length -= towrite;
+static uint bdev_command(uint cmd, armaddr_t address, off_t offset, size_t length)
+{
+	switch (cmd & BDEV_CMD_MASK) {
+		case BDEV_CMD_READ:
+			return bdev_read(address, offset, length);
+		case BDEV_CMD_WRITE:
+			return bdev_write(address, offset, length);
+		case BDEV_CMD_ERASE:
+			return bdev_erase(offset, length);
 	}
 
 	return BDEV_CMD_ERR_NONE;
 }
 
-static word bdev_regs_get_put(armaddr_t address, word data, int size, int put)
+/*
+ * the workers take descriptors off the queue and run them the same as a register
+ * command, on their own threads so the core carries on in the meantime.
+ */
+static int bdev_worker(void *args)
+{
+	struct bdev *bdev;
+
+	machine_enter((struct machine *)args);
+	bdev = machine->bdev;
+
+	SDL_LockMutex(bdev->queue_lock);
+	for (;;) {
+		struct bdev_request *req;
+		uint err;
+
+		while (!bdev->queue_head && !bdev->stopping)
+			SDL_CondWait(bdev->queue_cond, bdev->queue_lock);
+		req = bdev->queue_head;
+		if (!req)
+			break;
+		bdev->queue_head = req->next;
+		if (!bdev->queue_head)
+			bdev->queue_tail = NULL;
+		SDL_UnlockMutex(bdev->queue_lock);
+
+		err = bdev_command(req->cmd, req->addr, req->off, req->len);
+		sys_write_mem_word(req->desc + BDEV_DESC_CMD, (req->cmd & BDEV_CMD_MASK) | BDEV_DESC_DONE | err);
+		free(req);
+
+		SDL_LockMutex(bdev->queue_lock);
+		bdev->ring_done++;
+		if (bdev->ring_done == bdev->ring_head)
+			SDL_CondBroadcast(bdev->queue_cond); // blockdev_save_state() may be waiting for the ring to drain
+		SDL_UnlockMutex(bdev->queue_lock);
+
+		pic_assert_level(INT_BDEV);
+
+		SDL_LockMutex(bdev->queue_lock);
+	}
+	SDL_UnlockMutex(bdev->queue_lock);
+
+	return 0;
+}
+
+/* pick up the descriptors the guest has filled in, up to head */
+static void bdev_submit(struct bdev *bdev, uint head)
+{
+	uint in_flight;
+
+	if (bdev->ring_len == 0 || !bdev->workers[0])
+		return;
+
+	SDL_LockMutex(bdev->queue_lock);
+
+	/* only the free slots can be handed over. a head further on, or behind the
+	 * current one, would wrap around onto descriptors that are still in flight */
+	in_flight = bdev->ring_head - bdev->ring_done;
+	if (in_flight > bdev->ring_len || head - bdev->ring_head > bdev->ring_len - in_flight) {
+		SYS_TRACE(0, "sys: bdev ring head %u out of range, head %u, done %u, ring of %u\n",
+			head, bdev->ring_head, bdev->ring_done, bdev->ring_len);
+		SDL_UnlockMutex(bdev->queue_lock);
+		return;
+	}
+
+	while (bdev->ring_head != head) {
+		struct bdev_request *req = calloc(1, sizeof(*req));
+
+		req->desc = bdev->ring_addr + (bdev->ring_head & (bdev->ring_len - 1)) * BDEV_DESC_SIZE;
+		req->cmd = sys_read_mem_word(req->desc + BDEV_DESC_CMD);
+		req->addr = sys_read_mem_word(req->desc + BDEV_DESC_ADDR);
+		req->off = sys_read_mem_word(req->desc + BDEV_DESC_OFF) |
+			((off_t)sys_read_mem_word(req->desc + BDEV_DESC_OFF + 4) << 32);
+		req->len = sys_read_mem_word(req->desc + BDEV_DESC_LEN);
+
+		SYS_TRACE(5, "sys: bdev descriptor %u, cmd %u, addr 0x%08x, off 0x%llx, len %zd\n",
+			bdev->ring_head, req->cmd, req->addr, (unsigned long long)req->off, req->len);
+
+		if (bdev->queue_tail)
+			bdev->queue_tail->next = req;
+		else
+			bdev->queue_head = req;
+		bdev->queue_tail = req;
+
+		bdev->ring_head++;
+	}
+	SDL_CondBroadcast(bdev->queue_cond);
+	SDL_UnlockMutex(bdev->queue_lock);
+}
+
+static word bdev_regs_read(void *ctx, armaddr_t address)
 {
-	word val;
+	struct bdev *bdev = ctx;
 
-	SYS_TRACE(5, "sys: bdev_regs_get_put at 0x%08x, data 0x%08x, size %d, put %d\n", 
-		address, data, size, put);
+	SYS_TRACE(5, "sys: bdev_regs_read at 0x%08x\n", address);
 
-	val = 0;
 	switch (address) {
 		case BDEV_CMD:
-			if (put) {
-				/* mask out the command portion of the write */
-				data &= BDEV_CMD_MASK;
-
-				switch (data) {
-					case BDEV_CMD_READ:
-						bdev->last_err = bdev_read(bdev->trans_addr, bdev->trans_off, bdev->trans_len);
-						break;
-					case BDEV_CMD_WRITE:
-						bdev->last_err = bdev_write(bdev->trans_addr, bdev->trans_off, bdev->trans_len);
-						break;
-					case BDEV_CMD_ERASE:
-						bdev->last_err = bdev_erase(bdev->trans_off, bdev->trans_len);
-						break;
-				}
-			} else {
-				// read last error
-				val = (bdev->last_err << BDEV_CMD_ERRSHIFT) | bdev->cmd;
-			}
+			// read last error
+			return (bdev->last_err << BDEV_CMD_ERRSHIFT) | bdev->cmd;
+		case BDEV_CMD_ADDR:
+			return bdev->trans_addr;
+		case BDEV_CMD_OFF:
+			return (bdev->trans_off & 0xffffffff);
+		case BDEV_CMD_OFF + 4:
+			return (bdev->trans_off >> 32);
+		case BDEV_CMD_LEN:
+			return bdev->trans_len;
+		case BDEV_LEN:
+			return (bdev->length & 0xffffffff);
+		case BDEV_LEN + 4:
+			return (bdev->length >> 32);
+		case BDEV_RING_ADDR:
+			return bdev->ring_addr;
+		case BDEV_RING_LEN:
+			return bdev->ring_len;
+		case BDEV_RING_HEAD:
+			return bdev->ring_head;
+		case BDEV_RING_DONE: {
+			word done;
+
+			SDL_LockMutex(bdev->queue_lock);
+			done = bdev->ring_done;
+			SDL_UnlockMutex(bdev->queue_lock);
+			return done;
+		}
+		case BDEV_INT_ACK:
+			return 0;
+		default:
+			SYS_TRACE(0, "sys: unhandled bdev address 0x%08x\n", address);
+			return 0;
+	}
+}
+
+static void bdev_regs_write(void *ctx, armaddr_t address, word data)
+{
+	struct bdev *bdev = ctx;
+
+	SYS_TRACE(5, "sys: bdev_regs_write at 0x%08x, data 0x%08x\n", address, data);
+
+	switch (address) {
+		case BDEV_CMD:
+			/* a single command runs right here, the core waits for it */
+			bdev->last_err = bdev_command(data, bdev->trans_addr, bdev->trans_off, bdev->trans_len);
 			break;
 		case BDEV_CMD_ADDR:
-			if (put) {
-				bdev->trans_addr = data;
-			} else {
-				val = bdev->trans_addr;
-			}
+			bdev->trans_addr = data;
 			break;
 		case BDEV_CMD_OFF:
-			if (put) {
-				bdev->trans_off = (bdev->trans_off & 0xffffffff00000000ULL) | data;
-			} else {
-				val = (bdev->trans_off & 0xffffffff);
-			}
+			bdev->trans_off = (bdev->trans_off & 0xffffffff00000000ULL) | data;
 			break;
 		case BDEV_CMD_OFF + 4:
-			if (put) {
-				bdev->trans_off = (bdev->trans_off & 0xffffffff) | ((off_t)data << 32);
-			} else {
-				val = (bdev->trans_off >> 32);
-			}
+			bdev->trans_off = (bdev->trans_off & 0xffffffff) | ((off_t)data << 32);
 			break;
 		case BDEV_CMD_LEN:
-			if (put) {
-				bdev->trans_len = data;
-			} else {
-				val = bdev->trans_len;
-			}
+			bdev->trans_len = data;
 			break;
 		case BDEV_LEN:
-			if (!put) {
-				val = (bdev->length & 0xffffffff);
-			}
-			break;
 		case BDEV_LEN + 4:
-			if (!put) {
-				val = (bdev->length >> 32);
-			}
+		case BDEV_RING_DONE:
+			/* read/only */
+			break;
+		case BDEV_RING_ADDR:
+			bdev->ring_addr = data;
+			break;
+		case BDEV_RING_LEN:
+			/* has to be a power of 2 */
+			bdev->ring_len = (data & (data - 1)) ? 0 : data;
+			break;
+		case BDEV_RING_HEAD:
+			bdev_submit(bdev, data);
+			break;
+		case BDEV_INT_ACK:
+			if (data)
+				pic_deassert_level(INT_BDEV);
 			break;
-
 		default:
 			SYS_TRACE(0, "sys: unhandled bdev address 0x%08x\n", address);
-			return 0;
+			break;
+	}
+}
+
+WORD_REG_HANDLERS(bdev_regs);
+
+struct bdev_state {
+	uint64_t length;
+	uint64_t trans_off;
+	uint32_t cmd;
+	uint32_t trans_addr;
+	uint32_t trans_len;
+	uint32_t last_err;
+	uint32_t ring_addr;
+	uint32_t ring_len;
+	uint32_t ring_head;
+	uint32_t ring_done;
+};
+
+/*
+ * with the cores stopped, nothing more goes on the ring. whatever is on it is let
+ * finish and the cache written back, so the image is in step with the snapshot.
+ */
+void blockdev_save_state(struct snapshot *s)
+{
+	struct bdev *bdev = machine->bdev;
+	struct bdev_state state;
+
+	SDL_LockMutex(bdev->queue_lock);
+	while (bdev->ring_done != bdev->ring_head)
+		SDL_CondWait(bdev->queue_cond, bdev->queue_lock);
+	SDL_UnlockMutex(bdev->queue_lock);
+
+	if (bdev->cache && !cache_flush(bdev))
+		SYS_TRACE(0, "sys: bdev couldn't write back its cache for the snapshot\n");
+
+	memset(&state, 0, sizeof(state));
+	state.length = bdev->length;
+	state.trans_off = bdev->trans_off;
+	state.cmd = bdev->cmd;
+	state.trans_addr = bdev->trans_addr;
+	state.trans_len = bdev->trans_len;
+	state.last_err = bdev->last_err;
+	state.ring_addr = bdev->ring_addr;
+	state.ring_len = bdev->ring_len;
+	state.ring_head = bdev->ring_head;
+	state.ring_done = bdev->ring_done;
+	snapshot_put(s, SNAPSHOT_TAG_BDEV, &state, sizeof(state));
+}
+
+/* the registers and the ring's position, the image itself has to be the one it was saved with */
+int blockdev_restore_state(struct snapshot *s)
+{
+	struct bdev *bdev = machine->bdev;
+	const struct bdev_state *state = snapshot_get(s, SNAPSHOT_TAG_BDEV, sizeof(struct bdev_state));
+
+	if (!state)
+		return -1;
+	if ((off_t)state->length != bdev->length) {
+		SYS_TRACE(0, "sys: the snapshot's block device was %llu bytes, this one is %lld\n",
+			(unsigned long long)state->length, (long long)bdev->length);
+		return -1;
+	}
+
+	bdev->trans_off = state->trans_off;
+	bdev->cmd = state->cmd;
+	bdev->trans_addr = state->trans_addr;
+	bdev->trans_len = state->trans_len;
+	bdev->last_err = state->last_err;
+	bdev->ring_addr = state->ring_addr;
+	bdev->ring_len = state->ring_len;
+	SDL_LockMutex(bdev->queue_lock);
+	bdev->ring_head = state->ring_head;
+	bdev->ring_done = state->ring_done;
+	SDL_UnlockMutex(bdev->queue_lock);
+
+	return 0;
+}
+
+/* put the image in overlay mode, with its writes in path or a temporary file if discard is set */
+static int open_overlay(struct bdev *bdev, const char *path, bool discard, bool sync)
+{
+	size_t blocks = (bdev->length + BDEV_OVERLAY_BLOCK - 1) / BDEV_OVERLAY_BLOCK;
+	size_t bitmap_len = ((blocks + 31) / 32) * 4;
+	struct bdev_overlay_header hdr;
+	void *base;
+
+	if (bdev->length == 0) {
+		SYS_TRACE(0, "sys: empty block device image can't have an overlay\n");
+		return -1;
+	}
+
+	base = mmap(NULL, bdev->length, PROT_READ, MAP_SHARED, bdev->fd, 0);
+	if (base == MAP_FAILED) {
+		SYS_TRACE(0, "sys: unable to map the block device image\n");
+		return -1;
+	}
+
+	bdev->bitmap = calloc(1, bitmap_len);
+	bdev->overlay_data = BDEV_OVERLAY_HEADER + ((bitmap_len + BDEV_OVERLAY_BLOCK - 1) & ~(size_t)(BDEV_OVERLAY_BLOCK - 1));
+	bdev->overlay_lock = SDL_CreateMutex();
+
+	if (discard) {
+		char name[PATH_MAX];
+
+		// nobody else ever sees it, it goes away with the last descriptor
+		snprintf(name, sizeof(name), "%s.XXXXXX", path ? path : "/tmp/armemu-overlay");
+		bdev->overlay_fd = mkostemp(name, sync ? O_SYNC : 0);
+		if (bdev->overlay_fd >= 0)
+			unlink(name);
+	} else {
+		bdev->overlay_fd = open(path, O_RDWR | O_CREAT | (sync ? O_SYNC : 0), 0644);
+		bdev->overlay_persist = TRUE;
+	}
+	if (bdev->overlay_fd < 0) {
+		SYS_TRACE(0, "sys: unable to open block device overlay '%s'\n", path ? path : "(temporary)");
+		munmap(base, bdev->length);
+		return -1;
+	}
+
+	// pick up the blocks already in it, if it was made for this image
+	if (bdev->overlay_persist && file_transfer(bdev->overlay_fd, &hdr, 0, sizeof(hdr), FALSE) &&
+			memcmp(hdr.magic, BDEV_OVERLAY_MAGIC, sizeof(hdr.magic)) == 0 &&
+			hdr.block_size == BDEV_OVERLAY_BLOCK && hdr.base_length == (uint64_t)bdev->length &&
+			file_transfer(bdev->overlay_fd, bdev->bitmap, BDEV_OVERLAY_HEADER, bitmap_len, FALSE)) {
+		SYS_TRACE(1, "sys: reusing block device overlay '%s'\n", path);
+	} else {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, BDEV_OVERLAY_MAGIC, sizeof(hdr.magic));
+		hdr.block_size = BDEV_OVERLAY_BLOCK;
+		hdr.base_length = bdev->length;
+
+		if (ftruncate(bdev->overlay_fd, 0) < 0 ||
+				!file_transfer(bdev->overlay_fd, &hdr, 0, sizeof(hdr), TRUE)) {
+			SYS_TRACE(0, "sys: unable to set up block device overlay\n");
+			munmap(base, bdev->length);
+			return -1;
+		}
+	}
+
+	// sparse, only what's written takes up any space
+	if (ftruncate(bdev->overlay_fd, bdev->overlay_data + bdev->length) < 0) {
+		SYS_TRACE(0, "sys: unable to size block device overlay\n");
+		munmap(base, bdev->length);
+		return -1;
+	}
+
+	bdev->base = base;
+	return 0;
+}
+
+/* size and readahead in KB */
+static void open_cache(struct bdev *bdev, size_t size, size_t readahead, bool sync)
+{
+	struct bdev_cache *cache;
+	uint i;
+
+	cache = bdev->cache = calloc(1, sizeof(*cache));
+	cache->lock = SDL_CreateMutex();
+	cache->write_through = sync;
+	cache->stream_next = -1;
+	cache->max_window = readahead * 1024 / BDEV_CACHE_BLOCK;
+	cache->run = MAX(BDEV_CACHE_RUN, cache->max_window + 1);
+
+	// room for a few runs at least, so a fill never pushes out what it's just read
+	cache->num_blocks = MAX(size * 1024 / BDEV_CACHE_BLOCK, 4 * cache->run);
+	for (cache->hash_mask = 1; cache->hash_mask < cache->num_blocks; cache->hash_mask <<= 1)
+		;
+	cache->hash = calloc(cache->hash_mask, sizeof(*cache->hash));
+	cache->hash_mask--;
+
+	// aligned, so that they can go O_DIRECT
+	cache->blocks = calloc(cache->num_blocks, sizeof(*cache->blocks));
+	posix_memalign((void **)&cache->blocks[0].data, BDEV_CACHE_BLOCK, (size_t)cache->num_blocks * BDEV_CACHE_BLOCK);
+	posix_memalign((void **)&cache->fill_buf, BDEV_CACHE_BLOCK, cache->run * BDEV_CACHE_BLOCK);
+	posix_memalign((void **)&cache->flush_buf, BDEV_CACHE_BLOCK, cache->run * BDEV_CACHE_BLOCK);
+	cache->flush_run = calloc(cache->run, sizeof(*cache->flush_run));
+
+	cache->lru.next = cache->lru.prev = &cache->lru;
+	for (i = 0; i < cache->num_blocks; i++) {
+		struct bdev_cache_block *b = &cache->blocks[i];
+
+		b->block = -1;
+		b->data = cache->blocks[0].data + (size_t)i * BDEV_CACHE_BLOCK;
+		b->prev = cache->lru.prev;
+		b->next = &cache->lru;
+		b->prev->next = b;
+		cache->lru.prev = b;
 	}
 
-	return val;
+	SYS_TRACE(1, "sys: bdev cache %u blocks, read-ahead up to %u\n", cache->num_blocks, cache->max_window);
+}
+
+static void close_cache(struct bdev *bdev)
+{
+	struct bdev_cache *cache = bdev->cache;
+
+	if (!cache_flush(bdev))
+		SYS_TRACE(0, "sys: error writing back the block device cache\n");
+
+	SYS_TRACE(0, "sys: bdev cache %llu hits, %llu misses, %llu blocks read ahead, %llu blocks written back in %llu writes\n",
+		(unsigned long long)cache->hits, (unsigned long long)cache->misses, (unsigned long long)cache->readahead,
+		(unsigned long long)cache->written, (unsigned long long)cache->writebacks);
+
+	free(cache->blocks[0].data);
+	free(cache->blocks);
+	free(cache->hash);
+	free(cache->fill_buf);
+	free(cache->flush_buf);
+	free(cache->flush_run);
+	SDL_DestroyMutex(cache->lock);
+	free(cache);
+	bdev->cache = NULL;
 }
 
 int initialize_blockdev(void)
 {
+	struct bdev *bdev;
 	const char *str;
 
-	bdev = calloc(sizeof(*bdev), 1);
+	bdev = machine->bdev = calloc(sizeof(*bdev), 1);
 	bdev->fd = -1;
+	bdev->direct_fd = -1;
+	bdev->overlay_fd = -1;
+	bdev->queue_lock = SDL_CreateMutex();
+	bdev->queue_cond = SDL_CreateCond();
 
-	install_mem_handler(BDEV_REGS_BASE, BDEV_REGS_SIZE, &bdev_regs_get_put, NULL);
+	install_mem_handler(BDEV_REGS_BASE, BDEV_REGS_SIZE, &bdev_regs_handler, bdev);
 
 	str = get_config_key_string("block", "file", "");
 	if (strlen(str) == 0)
 		return -1;
 
 	unsigned int flags = O_RDWR;
+	bool sync = get_config_key_bool("block", "sync", 0);
+	const char *overlay = get_config_key_string("block", "overlay", NULL);
+	bool discard = get_config_key_bool("block", "overlay_discard", FALSE);
 
-	if (get_config_key_bool("block", "sync", 0))
+	if (sync)
 		flags |= O_SYNC;
 
+	// in overlay mode the image itself is never written
+	if (overlay || discard)
+		flags = O_RDONLY;
+
 	bdev->fd = open(str, flags);
 	if (bdev->fd < 0) {
 		SYS_TRACE(0, "sys: unable to open block device file '%s'\n", str);
 		return -1;
 	}
 
+#ifdef O_DIRECT
+	// not every filesystem can do it, then everything goes through the O_SYNC one
+	if (sync && flags != O_RDONLY)
+		bdev->direct_fd = open(str, flags | O_DIRECT);
+#endif
+
 	/* existing file/device, get length */
 	struct stat st;
 	fstat(bdev->fd, &st);
 
 #ifdef __LINUX
-	if (st.st_mode & S_IFBLK) {
+	if (S_ISBLK(st.st_mode)) {
 		long blocks = 0;
+
+		bdev->is_blkdev = TRUE;
 		ioctl(bdev->fd, BLKGETSIZE, &blocks);
 
 		bdev->length = (uint64_t)blocks * 512;
@@ -259,6 +1240,74 @@ int initialize_blockdev(void)
 	}
 	SYS_TRACE(0, "sys: bdev fd %d, len %lld\n", bdev->fd, bdev->length);
 
+	if ((overlay || discard) && open_overlay(bdev, overlay, discard, sync) < 0)
+		return -1;
+
+	size_t cache_size = strtoul(get_config_key_string("block", "cache", "0"), NULL, 0);
+	if (cache_size > 0 && bdev->length > 0)
+		open_cache(bdev, cache_size, strtoul(get_config_key_string("block", "readahead", "128"), NULL, 0), sync);
+
+	// start the workers for the command ring
+	int i;
+	for (i = 0; i < BDEV_WORKERS; i++)
+		bdev->workers[i] = SDL_CreateThread(&bdev_worker, machine);
+
 	return 0;		
 }
 
+/* let the workers finish whatever the guest handed them, and stop them */
+void stop_blockdev(void)
+{
+	struct bdev *bdev = machine->bdev;
+	int i;
+
+	if (!bdev || !bdev->workers[0])
+		return;
+
+	SDL_LockMutex(bdev->queue_lock);
+	bdev->stopping = TRUE;
+	SDL_CondBroadcast(bdev->queue_cond);
+	SDL_UnlockMutex(bdev->queue_lock);
+
+	for (i = 0; i < BDEV_WORKERS; i++) {
+		SDL_WaitThread(bdev->workers[i], NULL);
+		bdev->workers[i] = NULL;
+	}
+}
+
+void destroy_blockdev(void)
+{
+	struct bdev *bdev = machine->bdev;
+
+	if (!bdev)
+		return;
+
+	// it may not have got as far as starting, or something was handed over on the way down
+	stop_blockdev();
+	while (bdev->queue_head) {
+		struct bdev_request *req = bdev->queue_head;
+
+		bdev->queue_head = req->next;
+		free(req);
+	}
+
+	// still has to write back to the image, so before anything is closed
+	if (bdev->cache)
+		close_cache(bdev);
+
+	if (bdev->fd >= 0)
+		close(bdev->fd);
+	if (bdev->direct_fd >= 0)
+		close(bdev->direct_fd);
+	if (bdev->base)
+		munmap((void *)bdev->base, bdev->length);
+	if (bdev->overlay_fd >= 0)
+		close(bdev->overlay_fd);
+	if (bdev->overlay_lock)
+		SDL_DestroyMutex(bdev->overlay_lock);
+	free(bdev->bitmap);
+	SDL_DestroyCond(bdev->queue_cond);
+	SDL_DestroyMutex(bdev->queue_lock);
+	free(bdev);
+	machine->bdev = NULL;
+}
@@ -35,12 +35,12 @@
 
 #define KB_BUFSIZE 1024
 
-static struct console {
+struct console {
 	// XXX implement keyboard buffer
 	int head;
 	int tail;
 	unsigned int keybuffer[1024];
-} console;
+};
 
 enum {
 	KEY_MOD_LSHIFT = 0x00010000,
@@ -58,17 +58,19 @@ enum {
 	KEY_MOD_MASK   = 0xffff0000,
 };
 
-#define IS_BUF_FULL (((console.tail - 1) % KB_BUFSIZE) == console.head)
-#define IS_BUF_EMPTY (console.tail == console.head)
-#define USED_BUF_ENTRIES ((console.head - console.tail) % KB_BUFSIZE)
+#define IS_BUF_FULL (((console->tail - 1) % KB_BUFSIZE) == console->head)
+#define IS_BUF_EMPTY (console->tail == console->head)
+#define USED_BUF_ENTRIES ((console->head - console->tail) % KB_BUFSIZE)
 #define REMAING_BUF_ENTRIES (KB_BUFSIZE - USED_BUF_ENTRIES)
 
 static void insert_key(SDLKey key)
 {
+	struct console *console = machine->console;
+
 	/* for now, just stuff the raw sdl key into the buffer */
 	if(!IS_BUF_FULL) {
-		console.keybuffer[console.head] = key;
-		console.head = (console.head + 1) % KB_BUFSIZE;
+		console->keybuffer[console->head] = key;
+		console->head = (console->head + 1) % KB_BUFSIZE;
 	}
 
 	/* assert an interrupt */
@@ -77,11 +79,12 @@ static void insert_key(SDLKey key)
 
 static unsigned int read_key(void)
 {
+	struct console *console = machine->console;
 	unsigned int key = 0;
 
 	if(!IS_BUF_EMPTY) {
-		key = console.keybuffer[console.tail];
-		console.tail = (console.tail + 1) % KB_BUFSIZE;
+		key = console->keybuffer[console->tail];
+		console->tail = (console->tail + 1) % KB_BUFSIZE;
 	}
 
 	/* if the buffer is now empty, deassert interrupt */
@@ -91,15 +94,12 @@ static unsigned int read_key(void)
 	return key;
 }
 
-static word console_regs_get_put(armaddr_t address, word data, int size, int put)
+static word console_regs_read(void *ctx, armaddr_t address)
 {
+	struct console *console = ctx;
 	word val;
 
-	SYS_TRACE(5, "sys: console_regs_get_put at 0x%08x, data 0x%08x, size %d, put %d\n", 
-		address, data, size, put);
-
-	if(put)
-		return 0; /* can't write to the keyboard */
+	SYS_TRACE(5, "sys: console_regs_read at 0x%08x\n", address);
 
 	switch(address) {
 		case KYBD_STAT: /* status register */
@@ -116,6 +116,14 @@ static word console_regs_get_put(armaddr_t address, word data, int size, int put
 	return val;
 }
 
+static void console_regs_write(void *ctx, armaddr_t address, word data)
+{
+	/* can't write to the keyboard */
+	SYS_TRACE(5, "sys: console_regs_write at 0x%08x, data 0x%08x\n", address, data);
+}
+
+WORD_REG_HANDLERS(console_regs);
+
 void console_keydown(SDLKey key)
 {
 //	printf("console_keydown: key 0x%x\n", key);
@@ -132,10 +140,16 @@ void console_keyup(SDLKey key)
 
 int initialize_console(void)
 {
-	memset(&console, 0, sizeof(console));
+	machine->console = calloc(1, sizeof(struct console));
 
 	// install the console register handlers
-	install_mem_handler(CONSOLE_REGS_BASE, CONSOLE_REGS_SIZE, &console_regs_get_put, NULL);
+	install_mem_handler(CONSOLE_REGS_BASE, CONSOLE_REGS_SIZE, &console_regs_handler, machine->console);
 
 	return 0;
 }
+
+void destroy_console(void)
+{
+	free(machine->console);
+	machine->console = NULL;
+}
@@ -2,20 +2,172 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <fcntl.h>
 #include <sys/types.h>
 
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
 #include <debug.h>
 #include <config.h>
 #include <arm/arm.h>
+#include <arm/mmu.h>
+#include <arm/uops.h>
+#include <arm/stats.h>
 #include <sys/sys.h>
 #include "sys_p.h"
 
+#define DEBUG_OUT_BUF_SIZE	4096
+#define DEBUG_FLUSH_MS		100
+
+enum debug_buffering {
+	DEBUG_UNBUFFERED,
+	DEBUG_LINE_BUFFERED,
+	DEBUG_FULLY_BUFFERED,
+};
+
 struct sys_debug {
 	armaddr_t memory_dump_addr;
 	unsigned int memory_dump_len;
+
+	/*
+	 * what the guest writes to DEBUG_STDOUT is gathered up here rather than going
+	 * out a character at a time. it's written out when it fills up, at the end of
+	 * a line if line buffered, every DEBUG_FLUSH_MS from a timer so nothing sits in
+	 * it for long, and before the emulator prints anything of its own.
+	 */
+	SDL_mutex *out_lock;
+	int out_fd;
+	enum debug_buffering buffering;
+	char out_buf[DEBUG_OUT_BUF_SIZE];
+	size_t out_len;
+	SDL_TimerID flush_timer;
+
+	armaddr_t write_addr;
 };
 
-static struct sys_debug debug;
+static void write_all(int fd, const void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t err = write(fd, buf, len);
+
+		if (err <= 0)
+			return; // nowhere else to report it
+		buf = (const char *)buf + err;
+		len -= err;
+	}
+}
+
+/* with the lock held */
+static void out_flush(struct sys_debug *debug)
+{
+	write_all(debug->out_fd, debug->out_buf, debug->out_len);
+	debug->out_len = 0;
+}
+
+/* with the lock held */
+static void out_write(struct sys_debug *debug, const void *buf, size_t len)
+{
+	if (debug->buffering == DEBUG_UNBUFFERED || len > sizeof(debug->out_buf)) {
+		out_flush(debug);
+		write_all(debug->out_fd, buf, len);
+		return;
+	}
+
+	if (debug->out_len + len > sizeof(debug->out_buf))
+		out_flush(debug);
+	memcpy(debug->out_buf + debug->out_len, buf, len);
+	debug->out_len += len;
+
+	if (debug->buffering == DEBUG_LINE_BUFFERED && memchr(buf, '\n', len))
+		out_flush(debug);
+}
+
+static Uint32 flush_callback(Uint32 interval, void *param)
+{
+	struct sys_debug *debug = param;
+
+	SDL_LockMutex(debug->out_lock);
+	if (debug->out_len > 0)
+		out_flush(debug);
+	SDL_UnlockMutex(debug->out_lock);
+
+	return interval;
+}
+
+/* the guest writing to the debug console some other way, semihosting */
+void debug_console_write(const void *buf, size_t len)
+{
+	struct sys_debug *debug = machine->debug;
+
+	SDL_LockMutex(debug->out_lock);
+	out_write(debug, buf, len);
+	SDL_UnlockMutex(debug->out_lock);
+}
+
+/* push out whatever the guest has written so far */
+void flush_debug(void)
+{
+	struct sys_debug *debug = machine->debug;
+
+	if (!debug)
+		return;
+
+	SDL_LockMutex(debug->out_lock);
+	out_flush(debug);
+	SDL_UnlockMutex(debug->out_lock);
+	fflush(stdout);
+}
+
+/*
+ * around a fork, so the child doesn't start off with the lock held by the flush
+ * timer, or with a copy of what the parent has yet to write out. the child can't
+ * let go of the lock it inherits, it's recursive and belongs to the parent's
+ * thread, so it gets a fresh one instead.
+ */
+void debug_fork_begin(void)
+{
+	struct sys_debug *debug = machine->debug;
+
+	fflush(stdout);
+	SDL_LockMutex(debug->out_lock);
+	out_flush(debug);
+}
+
+void debug_fork_end(bool child)
+{
+	struct sys_debug *debug = machine->debug;
+
+	if (child)
+		debug->out_lock = SDL_CreateMutex();
+	else
+		SDL_UnlockMutex(debug->out_lock);
+}
+
+/* DEBUG_WRITE_LEN, a whole buffer out of guest memory in one go */
+static void debug_write_buffer(struct sys_debug *debug, armaddr_t address, unsigned int len)
+{
+	SDL_LockMutex(debug->out_lock);
+	while (len > 0) {
+		size_t chunk;
+		void *ptr = sys_dma_map(address, len, &chunk);
+
+		if (ptr) {
+			out_write(debug, ptr, chunk);
+		} else {
+			// not plain memory, a byte at a time through the handlers
+			char x = sys_read_mem_byte(address);
+
+			out_write(debug, &x, 1);
+			chunk = 1;
+		}
+		address += chunk;
+		len -= chunk;
+	}
+	SDL_UnlockMutex(debug->out_lock);
+}
+
 
 static void dump_memory_byte(armaddr_t address, unsigned int len)
 {
@@ -83,83 +235,166 @@ static void dump_memory_word(armaddr_t address, unsigned int len)
 }
 
 
-static word debug_get_put(armaddr_t address, word data, int size, int put)
-{
-    char x;
-        
-    if(put) {
-        switch(address){
-        case DEBUG_STDOUT: 
-            x = data;
-            write(1, &x, 1);
-            return 0;
-        case DEBUG_REGDUMP:
-            dump_registers();
-            return 0;
-		case DEBUG_HALT:
-			if (data == 1)
-				panic_cpu("debug halt\n");
-			else
-				exit(1);
-			return 0;
-		case DEBUG_MEMDUMPADDR:
-			debug.memory_dump_addr = data;
-			return 0;
-		case DEBUG_MEMDUMPLEN:
-			debug.memory_dump_len = data;
-			return 0;
-		case DEBUG_MEMDUMP_BYTE:
-			dump_memory_byte(debug.memory_dump_addr, debug.memory_dump_len);
-			return 0;
-		case DEBUG_MEMDUMP_HALFWORD:
-			dump_memory_halfword(debug.memory_dump_addr, debug.memory_dump_len);
-			return 0;
-		case DEBUG_MEMDUMP_WORD:
-			dump_memory_word(debug.memory_dump_addr, debug.memory_dump_len);
-			return 0;
+static void debug_write(void *ctx, armaddr_t address, word data)
+{
+	struct sys_debug *debug = ctx;
+	char x;
+
+	switch(address) {
+	case DEBUG_STDOUT: 
+		x = data;
+		SDL_LockMutex(debug->out_lock);
+		out_write(debug, &x, 1);
+		SDL_UnlockMutex(debug->out_lock);
+		break;
+	case DEBUG_WRITE_ADDR:
+		debug->write_addr = data;
+		break;
+	case DEBUG_WRITE_LEN:
+		debug_write_buffer(debug, debug->write_addr, data);
+		break;
+	case DEBUG_REGDUMP:
+		flush_debug();
+		dump_registers();
+		break;
+	case DEBUG_HALT:
+		flush_debug();
+		if (data == 1)
+			panic_cpu("debug halt\n");
+		else
+			machine_halt(machine, 1);
+		break;
+	case DEBUG_MEMDUMPADDR:
+		debug->memory_dump_addr = data;
+		break;
+	case DEBUG_MEMDUMPLEN:
+		debug->memory_dump_len = data;
+		break;
+	case DEBUG_MEMDUMP_BYTE:
+		flush_debug();
+		dump_memory_byte(debug->memory_dump_addr, debug->memory_dump_len);
+		break;
+	case DEBUG_MEMDUMP_HALFWORD:
+		flush_debug();
+		dump_memory_halfword(debug->memory_dump_addr, debug->memory_dump_len);
+		break;
+	case DEBUG_MEMDUMP_WORD:
+		flush_debug();
+		dump_memory_word(debug->memory_dump_addr, debug->memory_dump_len);
+		break;
 #if DYNAMIC_TRACE_LEVELS
-		case DEBUG_SET_TRACELEVEL_CPU:
-			TRACE_CPU_LEVEL = data;
-			return 0;
-		case DEBUG_SET_TRACELEVEL_UOP:
-			TRACE_UOP_LEVEL = data;
-			return 0;
-		case DEBUG_SET_TRACELEVEL_SYS:
-			TRACE_SYS_LEVEL = data;
-			return 0;
-		case DEBUG_SET_TRACELEVEL_MMU:
-			TRACE_MMU_LEVEL = data;
-			return 0;
+	case DEBUG_SET_TRACELEVEL_CPU:
+		TRACE_CPU_LEVEL = data;
+		uop_trace_levels_changed();
+		break;
+	case DEBUG_SET_TRACELEVEL_UOP:
+		TRACE_UOP_LEVEL = data;
+		uop_trace_levels_changed();
+		break;
+	case DEBUG_SET_TRACELEVEL_SYS:
+		TRACE_SYS_LEVEL = data;
+		break;
+	case DEBUG_SET_TRACELEVEL_MMU:
+		TRACE_MMU_LEVEL = data;
+		mmu_select_access(); // this core's, the others see it on their next mode change
+		break;
 #endif			
-        default:
-            return 0;
-        }
-    } else {
-        switch(address) {
-        case DEBUG_STDIN: 
-            if(read(0, &x, 1) == 1){
-                return x;
-            } else {
-                return -1;
-            }
+	case DEBUG_INSTRUMENTATION:
+		uop_set_instrumentation(data);
+		break;
+	case DEBUG_CACHE_STATS:
+		flush_debug();
+		dump_cache_stats();
+		dump_mmio_stats();
+		break;
+	case DEBUG_SNAPSHOT:
+		snapshot_request();
+		break;
+	case DEBUG_FUZZ_INPUT_ADDR:
+	case DEBUG_FUZZ_INPUT_SIZE:
+	case DEBUG_FUZZ_START:
+		fuzz_write(address, data);
+		break;
+	}
+}
+
+static word debug_read(void *ctx, armaddr_t address)
+{
+	char x;
+
+	switch(address) {
+	case DEBUG_STDIN: 
+		if(read(0, &x, 1) == 1){
+			return x;
+		} else {
+			return -1;
+		}
 #if COUNT_CYCLES
-		case DEBUG_CYCLE_COUNT:
-			return get_cycle_count();
+	case DEBUG_CYCLE_COUNT:
+		return get_cycle_count();
 #endif
-		case DEBUG_INS_COUNT:
-			return get_instruction_count();
-        default:
-            return 0;
-        }
-    }
+	case DEBUG_INS_COUNT:
+		return get_instruction_count();
+	case DEBUG_INSTRUMENTATION:
+		return uop_get_instrumentation();
+	case DEBUG_FUZZ_INPUT_LEN:
+		return fuzz_read(address);
+	default:
+		return 0;
+	}
 }
 
+WORD_REG_HANDLERS(debug);
+
 int initialize_debug(void)
 {
-    install_mem_handler(DEBUG_REGS_BASE, DEBUG_REGS_SIZE,
-                        debug_get_put, NULL);
+	struct sys_debug *debug;
+
+	debug = machine->debug = calloc(1, sizeof(struct sys_debug));
+
+	debug->out_lock = SDL_CreateMutex();
+	debug->out_fd = 1;
+
+	const char *str = get_config_key_string("debug", "log", NULL);
+	if (str) {
+		debug->out_fd = open(str, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (debug->out_fd < 0) {
+			SYS_TRACE(0, "sys: couldn't open debug log %s\n", str);
+			return -1;
+		}
+	}
 
-	memset(&debug, 0, sizeof(debug));
+	str = get_config_key_string("debug", "buffer", "line");
+	if (!strcasecmp(str, "none")) {
+		debug->buffering = DEBUG_UNBUFFERED;
+	} else if (!strcasecmp(str, "full")) {
+		debug->buffering = DEBUG_FULLY_BUFFERED;
+	} else {
+		debug->buffering = DEBUG_LINE_BUFFERED;
+	}
+
+	if (debug->buffering != DEBUG_UNBUFFERED)
+		debug->flush_timer = SDL_AddTimer(DEBUG_FLUSH_MS, &flush_callback, debug);
+
+    install_mem_handler(DEBUG_REGS_BASE, DEBUG_REGS_SIZE,
+                        &debug_handler, machine->debug);
     return 0;
 }
 
+void destroy_debug(void)
+{
+	struct sys_debug *debug = machine->debug;
+
+	if (!debug)
+		return;
+
+	if (debug->flush_timer)
+		SDL_RemoveTimer(debug->flush_timer);
+	flush_debug();
+	if (debug->out_fd != 1)
+		close(debug->out_fd);
+	SDL_DestroyMutex(debug->out_lock);
+	free(debug);
+	machine->debug = NULL;
+}
+
@@ -24,56 +24,159 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <strings.h>
+#include <sys/stat.h>
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_thread.h>
 
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <config.h>
 #include <arm/arm.h>
 #include <sys/sys.h>
 #include "sys_p.h"
+#include <sys/display_shm.h>
+#include <sys/snapshot.h>
 #include <util/endian.h>
 #include <util/atomic.h>
 
 #define DEFAULT_SCREEN_X 		640
 #define DEFAULT_SCREEN_Y 		480
 #define DEFAULT_SCREEN_DEPTH 	32
-
-static struct display {
-	// SDL surface structure
+#define MAX_SCALE				4
+#define DEFAULT_SNAPSHOT_INTERVAL	1000 // ms
+
+/* the pixel layouts rows can be converted between */
+enum pixel_format {
+	PIXEL_OTHER,
+	PIXEL_RGB565,
+	PIXEL_XRGB8888,
+	PIXEL_XBGR8888,
+};
+
+struct display {
+	// SDL surface structure, or the shared memory segment when there's no window
 	SDL_Surface *screen;
+	struct display_shm_header *shm;
+	size_t shm_size;
+	char shm_name[64];
+
+	// periodically write the screen out to a file
+	const char *snapshot;
+	uint snapshot_interval;
+	struct timespec next_snapshot;
 
 	// geometry
 	uint screen_x;
 	uint screen_y;
 	uint screen_depth;
 	uint screen_size;
+	uint line_size;
+
+	// what the window is in, it's made at whatever size and format the host likes and
+	// the guest's lines are converted and scaled up on the way into it
+	uint scale;
+	enum pixel_format guest_format;
+	enum pixel_format host_format;
+	uint host_bpp; // bytes
+	byte *row; // a converted line before it's stretched
 	
-	// framebuffer backing store
+	// framebuffer backing store, mapped so its pages can be write protected
 	byte *fb;
 	SDL_Surface *fbsurface;
 	
-	// dirty flag
+	// set by the first store to a page since it was last copied out, see display_fault()
 	int dirty;
-} display;
+	byte *dirty_pages;
+	size_t page_size;
+	uint num_pages; // the pages with some of the screen in them
+	SDL_Rect *rects;
+
+	// the thread that pushes the framebuffer out to the window
+	SDL_Thread *thread;
+	volatile bool stopping;
+};
+
+/* SDL only gives us the one window, so only one machine at a time can have a display */
+static int display_in_use;
+
+/*
+ * the framebuffer is plain memory, the cpu stores straight into it through get_ptr like
+ * any other ram. its pages are kept read only until something stores to them, the fault
+ * marks the page dirty and opens it back up, so it costs one fault per page between
+ * refreshes however much is stored there, and nothing at all while the screen sits still.
+ * it doesn't matter where the store comes from, the cpu's fast path, a device's dma or
+ * the handlers below.
+ */
+static struct display *fault_display;
+static struct sigaction old_segv_action;
+static struct sigaction old_bus_action; // what some hosts raise for a store to a read only page instead
+static pthread_once_t display_handler_once = PTHREAD_ONCE_INIT;
+
+static void display_fault(int sig, siginfo_t *info, void *context)
+{
+	struct display *display = fault_display;
+	byte *addr = info->si_addr;
+	struct sigaction *old = (sig == SIGBUS) ? &old_bus_action : &old_segv_action;
+
+	if(display && addr >= display->fb && addr < display->fb + display->num_pages * display->page_size) {
+		size_t page = (addr - display->fb) / display->page_size;
 
-static word display_regs_get_put(armaddr_t address, word data, int size, int put)
+		atomic_store_release(&display->dirty_pages[page], 1);
+		atomic_store_release(&display->dirty, 1);
+		mprotect(display->fb + page * display->page_size, display->page_size, PROT_READ | PROT_WRITE);
+		return;
+	}
+
+	/* not ours, hand it to whoever had it before */
+	if(old->sa_flags & SA_SIGINFO) {
+		old->sa_sigaction(sig, info, context);
+	} else if(old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+		old->sa_handler(sig);
+	} else {
+		/* put the default back and let the access fault again on the way out */
+		sigaction(sig, old, NULL);
+	}
+}
+
+static void install_display_handler(void)
 {
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = &display_fault;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old_segv_action);
+	sigaction(SIGBUS, &sa, &old_bus_action);
+}
+
+static word display_regs_read(void *ctx, armaddr_t address)
+{
+	struct display *display = ctx;
 	word ret;
 
-	SYS_TRACE(5, "sys: display_regs_get_put at 0x%08x, data 0x%08x, size %d, put %d\n", 
-		address, data, size, put);
+	SYS_TRACE(5, "sys: display_regs_read at 0x%08x\n", address);
 
 	switch (address) {
 		case DISPLAY_WIDTH:
-			ret = display.screen_x;
+			ret = display->screen_x;
 			break;
 		case DISPLAY_HEIGHT:
-			ret = display.screen_y;
+			ret = display->screen_y;
 			break;
 		case DISPLAY_BPP:
-			ret = display.screen_depth;
+			ret = display->screen_depth;
 			break;
 		default:
 			ret = 0;
@@ -83,139 +186,669 @@ static word display_regs_get_put(armaddr_t address, word data, int size, int put
 	return ret;
 }
 
-static word display_get_put(armaddr_t address, word data, int size, int put)
+static void display_regs_write(void *ctx, armaddr_t address, word data)
 {
-	byte *ptr;
+	SYS_TRACE(5, "sys: display_regs_write at 0x%08x, data 0x%08x\n", address, data);
+}
 
+WORD_REG_HANDLERS(display_regs);
+
+static inline byte *display_fb_ptr(struct display *display, armaddr_t address)
+{
 	address -= DISPLAY_FRAMEBUFFER;
 
 	if(unlikely(address > DISPLAY_SIZE))
-		SYS_TRACE(0, "sys: display_get_put with invalid address 0x%08x\n", address);
+		SYS_TRACE(0, "sys: display access with invalid address 0x%08x\n", address);
 
-	ptr = display.fb + address;
+	return display->fb + address;
+}
 
-	switch(size) {
-		case 4:
-			if(put)
-				WRITE_MEM_WORD(ptr, data);
-			else
-				data = READ_MEM_WORD(ptr);
-			break;
-		case 2:
-			if(put)
-				WRITE_MEM_HALFWORD(ptr, data);
-			else
-				data = READ_MEM_HALFWORD(ptr);
-			break;
-		case 1:
-			if(put)
-				WRITE_MEM_BYTE(ptr, data);
-			else
-				data = READ_MEM_BYTE(ptr);
-			break;
+static void *display_get_ptr(void *ctx, armaddr_t address)
+{
+	return display_fb_ptr(ctx, address);
+}
+
+static word display_read_word(void *ctx, armaddr_t address)
+{
+	SYS_TRACE(6, "sys: display_read_word at 0x%08x\n", address);
+	return READ_MEM_WORD(display_fb_ptr(ctx, address));
+}
+
+static halfword display_read_halfword(void *ctx, armaddr_t address)
+{
+	SYS_TRACE(6, "sys: display_read_halfword at 0x%08x\n", address);
+	return READ_MEM_HALFWORD(display_fb_ptr(ctx, address));
+}
+
+static byte display_read_byte(void *ctx, armaddr_t address)
+{
+	SYS_TRACE(6, "sys: display_read_byte at 0x%08x\n", address);
+	return READ_MEM_BYTE(display_fb_ptr(ctx, address));
+}
+
+static void display_write_word(void *ctx, armaddr_t address, word data)
+{
+	SYS_TRACE(6, "sys: display_write_word at 0x%08x, data 0x%08x\n", address, data);
+	WRITE_MEM_WORD(display_fb_ptr(ctx, address), data);
+}
+
+static void display_write_halfword(void *ctx, armaddr_t address, halfword data)
+{
+	SYS_TRACE(6, "sys: display_write_halfword at 0x%08x, data 0x%04x\n", address, data);
+	WRITE_MEM_HALFWORD(display_fb_ptr(ctx, address), data);
+}
+
+static void display_write_byte(void *ctx, armaddr_t address, byte data)
+{
+	SYS_TRACE(6, "sys: display_write_byte at 0x%08x, data 0x%02x\n", address, data);
+	WRITE_MEM_BYTE(display_fb_ptr(ctx, address), data);
+}
+
+static const struct mem_handler display_handler = {
+	.read_word = &display_read_word,
+	.read_halfword = &display_read_halfword,
+	.read_byte = &display_read_byte,
+	.write_word = &display_write_word,
+	.write_halfword = &display_write_halfword,
+	.write_byte = &display_write_byte,
+	.get_ptr = &display_get_ptr,
+};
+
+/*
+ * row conversions, a line at a time from the framebuffer into the window. the sse2
+ * versions do the bulk of a line and leave the odd pixels at the end to the plain
+ * loops, which are written so the compiler can vectorize them on other hosts.
+ */
+static void convert_565_to_8888(word *dst, const halfword *src, uint count, bool bgr)
+{
+	uint i = 0;
+
+#if __SSE2__
+	const __m128i mask_r = _mm_set1_epi16(0xf800);
+	const __m128i mask_g = _mm_set1_epi16(0x07e0);
+
+	for(; i + 8 <= count; i += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+		// widen each channel to 8 bits, copying its top bits into the bottom
+		__m128i r = _mm_and_si128(p, mask_r);
+		__m128i g = _mm_and_si128(p, mask_g);
+		__m128i b = _mm_slli_epi16(p, 11);
+		r = _mm_or_si128(_mm_srli_epi16(r, 8), _mm_srli_epi16(r, 13));
+		g = _mm_or_si128(_mm_srli_epi16(g, 3), _mm_srli_epi16(g, 9));
+		b = _mm_or_si128(_mm_srli_epi16(b, 8), _mm_srli_epi16(b, 13));
+		if(bgr) {
+			__m128i t = r;
+			r = b;
+			b = t;
+		}
+		// b | g << 8 in the low halfword, r in the high one
+		__m128i lo = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(lo, r));
+		_mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(lo, r));
+	}
+#endif
+
+	for(; i < count; i++) {
+		word p = src[i];
+		word r = ((p >> 8) & 0xf8) | (p >> 13);
+		word g = ((p >> 3) & 0xfc) | ((p >> 9) & 0x3);
+		word b = ((p << 3) & 0xf8) | ((p >> 2) & 0x7);
+		dst[i] = bgr ? (b << 16 | g << 8 | r) : (r << 16 | g << 8 | b);
+	}
+}
+
+static void convert_8888_to_565(halfword *dst, const word *src, uint count)
+{
+	uint i = 0;
+
+#if __SSE2__
+	const __m128i mask_r = _mm_set1_epi32(0xf800);
+	const __m128i mask_g = _mm_set1_epi32(0x07e0);
+	const __m128i mask_b = _mm_set1_epi32(0x001f);
+
+	for(; i + 8 <= count; i += 8) {
+		__m128i p0 = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i p1 = _mm_loadu_si128((const __m128i *)(src + i + 4));
+		__m128i q0 = _mm_or_si128(_mm_or_si128(
+				_mm_and_si128(_mm_srli_epi32(p0, 8), mask_r),
+				_mm_and_si128(_mm_srli_epi32(p0, 5), mask_g)),
+				_mm_and_si128(_mm_srli_epi32(p0, 3), mask_b));
+		__m128i q1 = _mm_or_si128(_mm_or_si128(
+				_mm_and_si128(_mm_srli_epi32(p1, 8), mask_r),
+				_mm_and_si128(_mm_srli_epi32(p1, 5), mask_g)),
+				_mm_and_si128(_mm_srli_epi32(p1, 3), mask_b));
+		// there's no unsigned pack until sse4.1, sign extend so the signed one doesn't saturate
+		q0 = _mm_srai_epi32(_mm_slli_epi32(q0, 16), 16);
+		q1 = _mm_srai_epi32(_mm_slli_epi32(q1, 16), 16);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(q0, q1));
+	}
+#endif
+
+	for(; i < count; i++) {
+		word p = src[i];
+		dst[i] = ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x001f);
+	}
+}
+
+static void convert_8888_swap(word *dst, const word *src, uint count)
+{
+	uint i = 0;
+
+#if __SSE2__
+	const __m128i mask_g = _mm_set1_epi32(0xff00ff00);
+	const __m128i mask_rb = _mm_set1_epi32(0x00ff00ff);
+
+	for(; i + 4 <= count; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i rb = _mm_and_si128(p, mask_rb);
+		rb = _mm_shufflehi_epi16(_mm_shufflelo_epi16(rb, 0xb1), 0xb1);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(p, mask_g), rb));
 	}
+#endif
 
-	if(put)
-		atomic_or(&display.dirty, 1);
+	for(; i < count; i++) {
+		word p = src[i];
+		dst[i] = (p & 0xff00ff00) | ((p & 0xff) << 16) | ((p >> 16) & 0xff);
+	}
+}
 
-	SYS_TRACE(6, "sys: display_get_put at 0x%08x, data 0x%08x, size %d, put %d\n", 
-		address, data, size, put);
+static void convert_row(struct display *display, byte *dst, const byte *src)
+{
+	enum pixel_format from = display->guest_format;
+	enum pixel_format to = display->host_format;
+
+	if(from == to)
+		memcpy(dst, src, display->line_size);
+	else if(from == PIXEL_RGB565)
+		convert_565_to_8888((word *)dst, (const halfword *)src, display->screen_x, to == PIXEL_XBGR8888);
+	else if(to == PIXEL_RGB565)
+		convert_8888_to_565((halfword *)dst, (const word *)src, display->screen_x);
+	else
+		convert_8888_swap((word *)dst, (const word *)src, display->screen_x);
+}
 
-	return data;
+/* stretch a converted line sideways, it's copied down into the other rows afterwards */
+static void scale_row(struct display *display, byte *dst, const byte *src)
+{
+	uint scale = display->scale;
+	uint count = display->screen_x;
+	uint i = 0, j;
+
+	if(display->host_bpp == 4) {
+		const word *s = (const word *)src;
+		word *d = (word *)dst;
+
+#if __SSE2__
+		if(scale == 2) {
+			for(; i + 4 <= count; i += 4) {
+				__m128i p = _mm_loadu_si128((const __m128i *)(s + i));
+				_mm_storeu_si128((__m128i *)(d + i * 2), _mm_unpacklo_epi32(p, p));
+				_mm_storeu_si128((__m128i *)(d + i * 2 + 4), _mm_unpackhi_epi32(p, p));
+			}
+		}
+#endif
+		for(; i < count; i++)
+			for(j = 0; j < scale; j++)
+				d[i * scale + j] = s[i];
+	} else {
+		const halfword *s = (const halfword *)src;
+		halfword *d = (halfword *)dst;
+
+#if __SSE2__
+		if(scale == 2) {
+			for(; i + 8 <= count; i += 8) {
+				__m128i p = _mm_loadu_si128((const __m128i *)(s + i));
+				_mm_storeu_si128((__m128i *)(d + i * 2), _mm_unpacklo_epi16(p, p));
+				_mm_storeu_si128((__m128i *)(d + i * 2 + 8), _mm_unpackhi_epi16(p, p));
+			}
+		}
+#endif
+		for(; i < count; i++)
+			for(j = 0; j < scale; j++)
+				d[i * scale + j] = s[i];
+	}
+}
+
+static void copy_lines(struct display *display, byte *pixels, uint pitch, uint y, uint end)
+{
+	uint width = display->screen_x * display->scale * display->host_bpp;
+	uint i;
+
+	for(; y < end; y++) {
+		const byte *src = display->fb + y * display->line_size;
+		byte *dst = pixels + y * display->scale * pitch;
+
+		if(display->scale == 1) {
+			convert_row(display, dst, src);
+			continue;
+		}
+
+		convert_row(display, display->row, src);
+		scale_row(display, dst, display->row);
+		for(i = 1; i < display->scale; i++)
+			memcpy(dst + i * pitch, dst, width);
+	}
+}
+
+/* tell a viewer of the shared memory segment which lines changed */
+static void mark_shm_lines(struct display *display, uint y, uint end)
+{
+	for(y *= display->scale, end *= display->scale; y < end; y++)
+		atomic_or_relaxed(&display->shm->dirty[y / 32], 1U << (y % 32));
+}
+
+/* a binary ppm of the guest's screen, written aside and renamed over so a reader never sees half of one */
+static void write_snapshot(struct display *display)
+{
+	char tmp[4096];
+	FILE *fp;
+	byte *line;
+	uint x, y;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", display->snapshot);
+	fp = fopen(tmp, "wb");
+	if(!fp) {
+		SYS_TRACE(0, "sys: couldn't write display snapshot %s\n", tmp);
+		return;
+	}
+
+	line = malloc(display->screen_x * 3);
+	fprintf(fp, "P6\n%u %u\n255\n", display->screen_x, display->screen_y);
+	for(y = 0; y < display->screen_y; y++) {
+		const byte *src = display->fb + y * display->line_size;
+
+		for(x = 0; x < display->screen_x; x++) {
+			word p;
+
+			if(display->guest_format == PIXEL_RGB565) {
+				p = ((const halfword *)src)[x];
+				line[x * 3 + 0] = ((p >> 8) & 0xf8) | (p >> 13);
+				line[x * 3 + 1] = ((p >> 3) & 0xfc) | ((p >> 9) & 0x3);
+				line[x * 3 + 2] = ((p << 3) & 0xf8) | ((p >> 2) & 0x7);
+			} else {
+				p = ((const word *)src)[x];
+				line[x * 3 + 0] = p >> 16;
+				line[x * 3 + 1] = p >> 8;
+				line[x * 3 + 2] = p;
+			}
+		}
+		fwrite(line, 3, display->screen_x, fp);
+	}
+	free(line);
+
+	if(fclose(fp) != 0 || rename(tmp, display->snapshot) < 0) {
+		SYS_TRACE(0, "sys: couldn't write display snapshot %s\n", display->snapshot);
+		unlink(tmp);
+	}
 }
 
-// main display loop
+static void check_snapshot(struct display *display)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(now.tv_sec < display->next_snapshot.tv_sec ||
+			(now.tv_sec == display->next_snapshot.tv_sec && now.tv_nsec < display->next_snapshot.tv_nsec))
+		return;
+
+	write_snapshot(display);
+
+	display->next_snapshot = now;
+	display->next_snapshot.tv_sec += display->snapshot_interval / 1000;
+	display->next_snapshot.tv_nsec += (display->snapshot_interval % 1000) * 1000000;
+	if(display->next_snapshot.tv_nsec >= 1000000000) {
+		display->next_snapshot.tv_sec++;
+		display->next_snapshot.tv_nsec -= 1000000000;
+	}
+}
+
+static enum pixel_format surface_format(SDL_Surface *surface)
+{
+	const SDL_PixelFormat *format = surface->format;
+
+	if(format->BitsPerPixel == 16 && format->Rmask == 0xf800 && format->Gmask == 0x07e0 && format->Bmask == 0x001f)
+		return PIXEL_RGB565;
+	if(format->BitsPerPixel == 32 && format->Rmask == 0xff0000 && format->Gmask == 0xff00 && format->Bmask == 0xff)
+		return PIXEL_XRGB8888;
+	if(format->BitsPerPixel == 32 && format->Rmask == 0xff && format->Gmask == 0xff00 && format->Bmask == 0xff0000)
+		return PIXEL_XBGR8888;
+	return PIXEL_OTHER;
+}
+
+/*
+ * main display loop. a run of dirty pages is protected again before it's copied, so a
+ * store that lands meanwhile either makes it into the copy or marks the page for next
+ * time. the scanlines they cover are copied out and updated, neighbouring runs as one
+ * rectangle. without a window they go into the shared memory segment instead, inside
+ * an odd seq so a viewer can tell it raced with the copy.
+ */
 static int display_thread_entry(void *args)
 {
-	word *src;
-	word *dest;
-	SDL_Surface *surface = display.screen;
+	struct display *display;
+	SDL_Surface *surface;
+	struct display_shm_header *shm;
+
+	machine_enter((struct machine *)args);
+	display = machine->display;
+	surface = display->screen;
+	shm = display->shm;
+
+	while(!display->stopping) {
+		uint page, last, y;
+		int count = 0, i;
+		byte *pixels;
+		uint pitch;
 
-	for(;;) {
 		SDL_Delay(20);
+
+		if(display->snapshot)
+			check_snapshot(display);
 	
 		// is the surface dirty?
-		if(atomic_set(&display.dirty, 0)) {			
-			// redraw the entire window
+		if(!atomic_set(&display->dirty, 0))
+			continue;
+
+		if(shm) {
+			atomic_store_relaxed(&shm->seq, shm->seq + 1);
+			atomic_fence();
+			pixels = (byte *)shm + shm->offset;
+			pitch = shm->pitch;
+		} else {
 			SDL_LockSurface(surface);
-			
-			src = (word *)display.fb;
-			dest = (word *)surface->pixels;
-			
-			memcpy(dest, src, display.screen_size);
-		
-			SDL_UnlockSurface(surface);
-			SDL_Flip(surface);
-		}	
+			pixels = surface->pixels;
+			pitch = surface->pitch;
+		}
+
+		for(page = 0; page < display->num_pages; page = last + 1) {
+			last = page;
+			if(!display->dirty_pages[page] || !atomic_set(&display->dirty_pages[page], 0))
+				continue;
+			while(last + 1 < display->num_pages && display->dirty_pages[last + 1] &&
+					atomic_set(&display->dirty_pages[last + 1], 0))
+				last++;
+
+			mprotect(display->fb + page * display->page_size, (last - page + 1) * display->page_size, PROT_READ);
+
+			y = page * display->page_size / display->line_size;
+			uint end = MIN(((last + 1) * display->page_size - 1) / display->line_size + 1, display->screen_y);
+
+			// a line can straddle the end of one run and the start of the next, it's copied again
+			if(count > 0 && display->rects[count - 1].y + display->rects[count - 1].h >= (int)y) {
+				display->rects[count - 1].h = end - display->rects[count - 1].y;
+			} else {
+				display->rects[count].x = 0;
+				display->rects[count].y = y;
+				display->rects[count].w = display->screen_x;
+				display->rects[count].h = end - y;
+				count++;
+			}
+
+			copy_lines(display, pixels, pitch, y, end);
+			if(shm)
+				mark_shm_lines(display, y, end);
+		}
+
+		if(shm) {
+			atomic_store_release(&shm->seq, shm->seq + 1);
+			atomic_add_release(&shm->frame, 1);
+			continue;
+		}
+
+		SDL_UnlockSurface(surface);
+		for(i = 0; i < count; i++) {
+			display->rects[i].y *= display->scale;
+			display->rects[i].w *= display->scale;
+			display->rects[i].h *= display->scale;
+		}
+		if(count > 0)
+			SDL_UpdateRects(surface, count, display->rects);
 	}
 
 	return 0;
 }
 
-int initialize_display(void)
+static int open_window(struct display *display)
 {
 	// initialize the SDL display
 	if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0)
 		return -1;
 
-	memset(&display, 0, sizeof(display));
+	// create the emulator window. a software surface, a double buffered one can't take partial updates.
+	// take whatever format the host is in if we can convert to it, so SDL doesn't have to on every update
+	display->screen = SDL_SetVideoMode(display->screen_x * display->scale, display->screen_y * display->scale,
+			display->screen_depth, SDL_SWSURFACE | SDL_ANYFORMAT);
+	if (display->screen && surface_format(display->screen) == PIXEL_OTHER)
+		display->screen = SDL_SetVideoMode(display->screen_x * display->scale, display->screen_y * display->scale,
+				display->screen_depth, SDL_SWSURFACE);
+	if (!display->screen) {
+		SYS_TRACE(0, "sys: error creating SDL surface\n");
+		return -1;
+	}
+	display->host_format = surface_format(display->screen);
+	if (display->host_format == PIXEL_OTHER)
+		display->host_format = display->guest_format; // SDL's shadow surface is in the depth we asked for
+
+	SYS_TRACE(1, "created screen: w %d h %d pitch %d bpp %d\n", display->screen->w, display->screen->h,
+			display->screen->pitch, display->screen->format->BitsPerPixel);
+
+	SDL_UpdateRect(display->screen, 0,0,0,0); // Update entire surface
+
+	SDL_WM_SetCaption("ARMemu","ARMemu");
+
+	return 0;
+}
+
+/* no window, publish the screen in a shared memory segment for something else to show or encode */
+static int open_shm(struct display *display)
+{
+	struct display_shm_header *shm;
+	uint pitch = display->screen_x * display->scale * (display->screen_depth / 8);
+	uint offset = (sizeof(*shm) + 4095) & ~4095;
+	int fd;
+
+	const char *name = get_config_key_string("display", "shm_name", NULL);
+	if (name)
+		snprintf(display->shm_name, sizeof(display->shm_name), "%s", name);
+	else
+		snprintf(display->shm_name, sizeof(display->shm_name), "/armemu-%d", (int)getpid());
+
+	fd = shm_open(display->shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		SYS_TRACE(0, "sys: couldn't create display shared memory %s\n", display->shm_name);
+		return -1;
+	}
+
+	display->shm_size = offset + pitch * display->screen_y * display->scale;
+	if (ftruncate(fd, display->shm_size) < 0 ||
+			(shm = mmap(NULL, display->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		SYS_TRACE(0, "sys: couldn't map display shared memory %s\n", display->shm_name);
+		close(fd);
+		shm_unlink(display->shm_name);
+		return -1;
+	}
+	close(fd);
+
+	shm->version = DISPLAY_SHM_VERSION;
+	shm->width = display->screen_x * display->scale;
+	shm->height = display->screen_y * display->scale;
+	shm->bpp = display->screen_depth;
+	shm->pitch = pitch;
+	shm->offset = offset;
+	shm->pid = getpid();
+	atomic_store_release(&shm->magic, DISPLAY_SHM_MAGIC); // last, the rest is good once it's there
+
+	display->shm = shm;
+	display->host_format = display->guest_format;
+
+	SYS_TRACE(1, "sys: display in shared memory %s: w %d h %d pitch %d\n", display->shm_name,
+			shm->width, shm->height, shm->pitch);
+
+	return 0;
+}
+
+int initialize_display(void)
+{
+	struct display *display;
+	bool headless;
+	int err;
+
+	if (test_and_set_acquire(&display_in_use, 1, 0) != 0) {
+		SYS_TRACE(0, "sys: another machine already has the display\n");
+		return -1;
+	}
+
+	const char *backend = get_config_key_string("display", "backend", "sdl");
+	if (!strcasecmp(backend, "shm")) {
+		headless = TRUE;
+	} else if (!strcasecmp(backend, "sdl")) {
+		headless = FALSE;
+	} else {
+		SYS_TRACE(0, "sys: unknown display backend %s\n", backend);
+		atomic_store_release(&display_in_use, 0);
+		return -1;
+	}
+
+	display = machine->display = calloc(1, sizeof(struct display));
 
 	// set up default geometry
-	display.screen_x = DEFAULT_SCREEN_X;
-	display.screen_y = DEFAULT_SCREEN_Y;
-	display.screen_depth = DEFAULT_SCREEN_DEPTH;
+	display->screen_x = DEFAULT_SCREEN_X;
+	display->screen_y = DEFAULT_SCREEN_Y;
+	display->screen_depth = DEFAULT_SCREEN_DEPTH;
+	display->scale = 1;
 
 	// see if any config variables override it
 	const char *str;
 	str = get_config_key_string("display", "width", NULL);
 	if (str)
-		display.screen_x = strtoul(str, NULL, 10);
+		display->screen_x = strtoul(str, NULL, 10);
 	str = get_config_key_string("display", "height", NULL);
 	if (str)
-		display.screen_y = strtoul(str, NULL, 10);
+		display->screen_y = strtoul(str, NULL, 10);
 	str = get_config_key_string("display", "depth", NULL);
 	if (str)
-		display.screen_depth = strtoul(str, NULL, 10);
+		display->screen_depth = strtoul(str, NULL, 10);
+	str = get_config_key_string("display", "scale", NULL);
+	if (str)
+		display->scale = strtoul(str, NULL, 10);
+	display->snapshot = get_config_key_string("display", "snapshot", NULL);
+	display->snapshot_interval = strtoul(get_config_key_string("display", "snapshot_interval", "0"), NULL, 10);
+	if (display->snapshot_interval == 0)
+		display->snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
 
 	// sanity check geometry
-	if (display.screen_x == 0 || display.screen_x > 4096) {
-		SYS_TRACE(0, "sys: display width out of range %d\n", display.screen_x);
+	if (display->screen_x == 0 || display->screen_x > 4096) {
+		SYS_TRACE(0, "sys: display width out of range %d\n", display->screen_x);
 		return -1;
 	}
-	if (display.screen_y == 0 || display.screen_y > 4096) {
-		SYS_TRACE(0, "sys: display height out of range %d\n", display.screen_y);
+	if (display->screen_y == 0 || display->screen_y > 4096) {
+		SYS_TRACE(0, "sys: display height out of range %d\n", display->screen_y);
 		return -1;
 	}
-	if (display.screen_depth != 16 && display.screen_depth != 32) {
-		SYS_TRACE(0, "sys: invalid display depth %d\n", display.screen_depth);
+	if (display->screen_depth != 16 && display->screen_depth != 32) {
+		SYS_TRACE(0, "sys: invalid display depth %d\n", display->screen_depth);
+		return -1;
+	}
+	if (display->scale == 0 || display->scale > MAX_SCALE) {
+		SYS_TRACE(0, "sys: display scale out of range %d\n", display->scale);
 		return -1;
 	}
 
 	// calculate size 
-	display.screen_size = display.screen_x * display.screen_y * (display.screen_depth / 8);
+	display->line_size = display->screen_x * (display->screen_depth / 8);
+	display->screen_size = display->line_size * display->screen_y;
+	display->rects = calloc(display->screen_y, sizeof(SDL_Rect));
+
+	// create and register a memory range for the framebuffer, the screen's part of it starts out clean
+	display->fb = mmap(NULL, DISPLAY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (display->fb == MAP_FAILED) {
+		display->fb = NULL;
+		SYS_TRACE(0, "sys: couldn't allocate the framebuffer\n");
+		return -1;
+	}
+	display->page_size = sysconf(_SC_PAGESIZE);
+	display->num_pages = (MIN(display->screen_size, DISPLAY_SIZE) + display->page_size - 1) / display->page_size;
+	display->dirty_pages = calloc(display->num_pages, 1);
+
+	pthread_once(&display_handler_once, &install_display_handler);
+	fault_display = display;
+	mprotect(display->fb, display->num_pages * display->page_size, PROT_READ);
 
-	// create and register a memory range for the framebuffer
-	display.fb = (byte *)calloc(DISPLAY_SIZE, 1);
-	install_mem_handler(DISPLAY_BASE, DISPLAY_SIZE, &display_get_put, NULL);
+	install_mem_handler(DISPLAY_BASE, DISPLAY_SIZE, &display_handler, display);
 
 	// install the display register handlers
-	install_mem_handler(DISPLAY_REGS_BASE, DISPLAY_REGS_SIZE, &display_regs_get_put, NULL);
+	install_mem_handler(DISPLAY_REGS_BASE, DISPLAY_REGS_SIZE, &display_regs_handler, display);
 
-	// create the emulator window
-	display.screen = SDL_SetVideoMode(display.screen_x, display.screen_y, display.screen_depth, SDL_HWSURFACE|SDL_DOUBLEBUF);
-	if (!display.screen) {
-		SYS_TRACE(0, "sys: error creating SDL surface\n");
+	display->guest_format = (display->screen_depth == 16) ? PIXEL_RGB565 : PIXEL_XRGB8888;
+	err = headless ? open_shm(display) : open_window(display);
+	if (err < 0)
+		return err;
+	display->host_bpp = (display->host_format == PIXEL_RGB565) ? 2 : 4;
+	display->row = malloc(display->screen_x * display->host_bpp);
+
+	// spawn a thread to deal with the display
+	display->thread = SDL_CreateThread(&display_thread_entry, machine);
+
+	return 0;
+}
+
+/* the screen's part of the framebuffer, the rest of it is only scratch */
+static size_t display_state_size(struct display *display)
+{
+	return MIN(display->screen_size, DISPLAY_SIZE);
+}
+
+void display_save_state(struct snapshot *s)
+{
+	struct display *display = machine->display;
+
+	snapshot_put(s, SNAPSHOT_TAG_DISPLAY, display->fb, display_state_size(display));
+}
+
+/* storing it back faults every page dirty, so the whole screen goes out on the next refresh */
+int display_restore_state(struct snapshot *s)
+{
+	struct display *display = machine->display;
+	const void *fb = snapshot_get(s, SNAPSHOT_TAG_DISPLAY, display_state_size(display));
+
+	if (!fb) {
+		SYS_TRACE(0, "sys: the snapshot's screen isn't %ux%ux%u\n", display->screen_x, display->screen_y, display->screen_depth);
 		return -1;
 	}
-	
-	SYS_TRACE(1, "created screen: w %d h %d pitch %d\n", display.screen->w, display.screen->h, display.screen->pitch);
+	memcpy(display->fb, fb, display_state_size(display));
 
-	SDL_UpdateRect(display.screen, 0,0,0,0); // Update entire surface
+	return 0;
+}
 
-	SDL_WM_SetCaption("ARMemu","ARMemu");
+void stop_display(void)
+{
+	struct display *display = machine->display;
 
-	// spawn a thread to deal with the display
-	SDL_CreateThread(&display_thread_entry, NULL);
+	if (!display || !display->thread)
+		return;
 
-	return 0;
+	display->stopping = TRUE;
+	SDL_WaitThread(display->thread, NULL);
+	display->thread = NULL;
+}
+
+void destroy_display(void)
+{
+	struct display *display = machine->display;
+
+	if (!display)
+		return;
+
+	fault_display = NULL;
+	if (display->fb)
+		munmap(display->fb, DISPLAY_SIZE);
+	if (display->shm) {
+		munmap(display->shm, display->shm_size);
+		shm_unlink(display->shm_name);
+	}
+	free(display->dirty_pages);
+	free(display->rects);
+	free(display->row);
+	free(display);
+	machine->display = NULL;
+	atomic_store_release(&display_in_use, 0);
 }
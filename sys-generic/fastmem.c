@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _GNU_SOURCE // REG_RIP
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include <config.h>
+#include <arm/arm.h>
+#include <arm/mmu.h>
+#include <sys/sys.h>
+#include <sys/fastmem.h>
+#include "sys_p.h"
+
+#if WITH_FASTMEM
+
+#define FASTMEM_SIZE (1ULL << 32)
+
+/* the linker brackets the section with these */
+extern const struct fastmem_fixup __start_fastmem_fixup[] __attribute__((weak));
+extern const struct fastmem_fixup __stop_fastmem_fixup[] __attribute__((weak));
+
+static struct sigaction old_segv_action;
+static pthread_once_t fastmem_handler_once = PTHREAD_ONCE_INIT;
+
+static void fastmem_fault(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+	unsigned long ip = uc->uc_mcontext.gregs[REG_RIP];
+	const struct fastmem_fixup *f;
+
+	for(f = __start_fastmem_fixup; f < __stop_fastmem_fixup; f++) {
+		if((unsigned long)&f->fault + f->fault == ip) {
+			uc->uc_mcontext.gregs[REG_RIP] = (unsigned long)&f->fixup + f->fixup;
+			return;
+		}
+	}
+
+	/* not one of ours, hand it to whoever had it before */
+	if(old_segv_action.sa_flags & SA_SIGINFO) {
+		old_segv_action.sa_sigaction(sig, info, context);
+	} else if(old_segv_action.sa_handler != SIG_DFL && old_segv_action.sa_handler != SIG_IGN) {
+		old_segv_action.sa_handler(sig);
+	} else {
+		/* put the default back and let the access fault again on the way out */
+		sigaction(SIGSEGV, &old_segv_action, NULL);
+	}
+}
+
+static void install_fastmem_handler(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = &fastmem_fault;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old_segv_action);
+}
+
+int initialize_fastmem(void)
+{
+	void *base;
+
+	if(!get_config_key_bool("system", "fastmem", FALSE))
+		return 0;
+
+	/* reserve it all, ram gets mapped in over the top as it's set up. the extra page
+	 * catches a halfword or word access hanging off the top of the address space */
+	base = mmap(NULL, FASTMEM_SIZE + MMU_PAGESIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(base == MAP_FAILED) {
+		printf("sys: couldn't reserve address space for fastmem, running without it\n");
+		return 0;
+	}
+
+	pthread_once(&fastmem_handler_once, &install_fastmem_handler);
+
+	machine->fastmem = base;
+	return 0;
+}
+
+/* put the reservation back over a piece of the window */
+static void fastmem_reserve(armaddr_t base, armaddr_t len)
+{
+	mmap(machine->fastmem + base, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+static void *fastmem_map_ram_fd(armaddr_t base, armaddr_t len, unsigned int memfd_flags)
+{
+	void *ptr;
+	int fd;
+
+	fd = memfd_create("armemu-ram", memfd_flags);
+	if(fd < 0)
+		return NULL;
+	if(ftruncate(fd, len) < 0)
+		goto err;
+
+	ptr = mmap(machine->fastmem + base, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	if(ptr == MAP_FAILED) {
+		fastmem_reserve(base, len);
+		goto err;
+	}
+
+	ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(ptr == MAP_FAILED) {
+		fastmem_reserve(base, len);
+		goto err;
+	}
+
+	close(fd);
+	return ptr;
+
+err:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * allocate len bytes of guest ram at base. the pages are mapped twice, once in the
+ * fastmem window and once somewhere of their own for everything else to use (the
+ * get_ptr handler, devices, the translation cache). that way protecting a code page
+ * in the window only sends the window's stores the long way round.
+ * returns the second mapping, or NULL if fastmem is off and the caller should allocate it.
+ * like any other ram the pages are only committed as they're touched.
+ */
+void *fastmem_map_ram(armaddr_t base, armaddr_t len, bool hugepages)
+{
+	void *ptr;
+
+	if(!machine->fastmem)
+		return NULL;
+
+#ifdef MFD_HUGETLB
+	/* the huge pages are reserved when they're mapped, so this fails cleanly if there aren't enough */
+	if(hugepages) {
+		ptr = fastmem_map_ram_fd(base, len, MFD_HUGETLB);
+		if(ptr)
+			return ptr;
+		SYS_TRACE(1, "sys: no huge pages available for mainmem, using regular pages\n");
+	}
+#endif
+
+	ptr = fastmem_map_ram_fd(base, len, 0);
+#ifdef MADV_HUGEPAGE
+	if(ptr && hugepages) {
+		madvise(machine->fastmem + base, len, MADV_HUGEPAGE);
+		madvise(ptr, len, MADV_HUGEPAGE);
+	}
+#endif
+	return ptr;
+}
+
+void fastmem_unmap_ram(void *ptr, armaddr_t len)
+{
+	munmap(ptr, len);
+}
+
+byte *sys_get_fastmem(void)
+{
+	return machine->fastmem;
+}
+
+/*
+ * stores into a page with instructions decoded out of it have to be seen by the
+ * mmu. make the page read only, the store faults and takes the regular path.
+ */
+void sys_fastmem_protect(armaddr_t paddr, bool protect)
+{
+	if(!machine->fastmem || !sys_get_mem_ptr(paddr))
+		return;
+
+	paddr &= ~(MMU_PAGESIZE-1);
+	mprotect(machine->fastmem + paddr, MMU_PAGESIZE, protect ? PROT_READ : (PROT_READ | PROT_WRITE));
+}
+
+void destroy_fastmem(void)
+{
+	if(!machine->fastmem)
+		return;
+
+	munmap(machine->fastmem, FASTMEM_SIZE + MMU_PAGESIZE);
+	machine->fastmem = NULL;
+}
+
+#else
+
+int initialize_fastmem(void)
+{
+	if(get_config_key_bool("system", "fastmem", FALSE))
+		printf("sys: fastmem isn't supported on this host, running without it\n");
+	return 0;
+}
+
+void *fastmem_map_ram(armaddr_t base, armaddr_t len, bool hugepages)
+{
+	return NULL;
+}
+
+void fastmem_unmap_ram(void *ptr, armaddr_t len)
+{
+}
+
+void destroy_fastmem(void)
+{
+}
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/shm.h>
+
+#include <config.h>
+#include <arm/arm.h>
+#include <sys/sys.h>
+#include <sys/fuzz.h>
+#include "sys_p.h"
+
+/* afl's side of it */
+#define AFL_SHM_ENV		"__AFL_SHM_ID"
+#define AFL_SHM_FUZZ_ENV	"__AFL_SHM_FUZZ_ID"
+#define FORKSRV_FD		198 // commands come in on it, replies go out on the one after
+#define FS_OPT_ENABLED		0x80000001
+#define FS_OPT_SHDMEM_FUZZ	0x01000000
+
+struct fuzz {
+	const char *input_path; // NULL for stdin
+	uint32_t *shm_input; // afl++'s test case, the length and then the bytes. NULL if it's not in use
+	byte *cover_map; // afl's, NULL if there isn't one
+
+	// the guest's buffer for the test case
+	armaddr_t input_addr;
+	armaddr_t input_size;
+	word input_len;
+
+	bool started;
+	bool child; // this process is one run
+};
+
+/* up to len bytes of the test case from offset, how many there were */
+static size_t read_input(struct fuzz *f, int fd, void *buf, size_t len, size_t offset)
+{
+	size_t got = 0;
+
+	if (f->shm_input) {
+		if (offset < f->shm_input[0]) {
+			got = f->shm_input[0] - offset < len ? f->shm_input[0] - offset : len;
+			memcpy(buf, (byte *)(f->shm_input + 1) + offset, got);
+		}
+		return got;
+	}
+
+	while (got < len) {
+		ssize_t err = read(fd, (byte *)buf + got, len - got);
+
+		if (err <= 0)
+			break;
+		got += err;
+	}
+	return got;
+}
+
+/* this run's test case into the guest's buffer, straight into its ram where it can */
+static void load_input(struct fuzz *f)
+{
+	int fd = -1;
+
+	if (!f->shm_input) {
+		fd = f->input_path ? open(f->input_path, O_RDONLY) : 0;
+		if (fd < 0) {
+			SYS_TRACE(0, "fuzz: couldn't open %s\n", f->input_path);
+			f->input_len = 0;
+			return;
+		}
+	}
+
+	f->input_len = 0;
+	while (f->input_len < f->input_size) {
+		armaddr_t address = f->input_addr + f->input_len;
+		size_t chunk, got;
+		void *ptr = sys_dma_map(address, f->input_size - f->input_len, &chunk);
+
+		if (ptr) {
+			got = read_input(f, fd, ptr, chunk, f->input_len);
+		} else {
+			// not plain memory, a byte at a time through the handlers
+			byte x;
+
+			chunk = 1;
+			got = read_input(f, fd, &x, 1, f->input_len);
+			if (got)
+				sys_write_mem_byte(address, x);
+		}
+		f->input_len += got;
+		if (got < chunk)
+			break;
+	}
+
+	if (fd > 0)
+		close(fd);
+}
+
+/*
+ * afl's fork server. it asks for a run by writing 4 bytes, gets back the pid of a
+ * fresh fork of the machine and then how it exited. returns in each of the children,
+ * and in the one process there is if afl isn't there to talk to.
+ */
+static void fork_server(struct fuzz *f)
+{
+	uint32_t hello = f->shm_input ? FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ : 0;
+	uint32_t command;
+
+	if (write(FORKSRV_FD + 1, &hello, 4) != 4) {
+		// not under afl, the one run goes on from here
+		if (f->shm_input) {
+			shmdt(f->shm_input);
+			f->shm_input = NULL;
+		}
+		return;
+	}
+
+	// afl++ says yes to the test cases through shared memory
+	if (f->shm_input) {
+		if (read(FORKSRV_FD, &command, 4) != 4)
+			_exit(1);
+		if ((command & FS_OPT_SHDMEM_FUZZ) == 0) {
+			shmdt(f->shm_input);
+			f->shm_input = NULL;
+		}
+	}
+
+	SYS_TRACE(1, "fuzz: fork server up, test cases from %s\n",
+		f->shm_input ? "shared memory" : f->input_path ? f->input_path : "stdin");
+
+	for (;;) {
+		pid_t pid;
+		int status;
+
+		if (read(FORKSRV_FD, &command, 4) != 4)
+			_exit(0); // afl is done
+
+		debug_fork_begin();
+		pid = fork();
+		debug_fork_end(pid == 0);
+		if (pid < 0)
+			_exit(1);
+		if (pid == 0) {
+			close(FORKSRV_FD);
+			close(FORKSRV_FD + 1);
+			f->child = TRUE;
+			return;
+		}
+
+		if (write(FORKSRV_FD + 1, &pid, 4) != 4)
+			_exit(1);
+		if (waitpid(pid, &status, 0) < 0)
+			_exit(1);
+		if (write(FORKSRV_FD + 1, &status, 4) != 4)
+			_exit(1);
+	}
+}
+
+/* the guest is set up and waiting for its test case */
+static void fuzz_start(struct fuzz *f)
+{
+	if (f->started) {
+		SYS_TRACE(0, "fuzz: the guest started fuzzing twice, the second is ignored\n");
+		return;
+	}
+	f->started = TRUE;
+
+	fork_server(f);
+	load_input(f);
+}
+
+void fuzz_write(armaddr_t address, word data)
+{
+	struct fuzz *f = machine->fuzz;
+
+	if (!f) {
+		if (address == DEBUG_FUZZ_START)
+			SYS_TRACE(0, "fuzz: the guest asked to be fuzzed, but [fuzz] isn't turned on\n");
+		return;
+	}
+
+	switch (address) {
+	case DEBUG_FUZZ_INPUT_ADDR:
+		f->input_addr = data;
+		break;
+	case DEBUG_FUZZ_INPUT_SIZE:
+		f->input_size = data;
+		break;
+	case DEBUG_FUZZ_START:
+		fuzz_start(f);
+		break;
+	}
+}
+
+word fuzz_read(armaddr_t address)
+{
+	struct fuzz *f = machine->fuzz;
+
+	if (!f)
+		return 0;
+
+	switch (address) {
+	case DEBUG_FUZZ_INPUT_LEN:
+		return f->input_len;
+	default:
+		return 0;
+	}
+}
+
+/* the end of a run, the process goes with it. atexit handlers would wait for threads the fork left behind */
+void fuzz_halt(int exit_code)
+{
+	struct fuzz *f = machine->fuzz;
+
+	if (!f || !f->child)
+		return;
+
+	flush_debug();
+	_exit(exit_code);
+}
+
+void fuzz_crash(void)
+{
+	struct fuzz *f = machine->fuzz;
+
+	if (!f || !f->child)
+		return;
+
+	flush_debug();
+	abort();
+}
+
+static void *attach_shm(const char *env)
+{
+	const char *id = getenv(env);
+	void *ptr;
+
+	if (!id)
+		return NULL;
+
+	ptr = shmat(atoi(id), NULL, 0);
+	if (ptr == (void *)-1) {
+		SYS_TRACE(0, "fuzz: couldn't attach afl's shared memory %s\n", id);
+		return NULL;
+	}
+	return ptr;
+}
+
+int initialize_fuzz(uint features)
+{
+	struct fuzz *f;
+	const char *input_path = get_config_key_string("fuzz", "input", NULL);
+
+	if (!input_path && !get_config_key_bool("fuzz", "enable", FALSE))
+		return 0;
+
+	// only the core's thread makes it through a fork
+	if (machine->cpu->num_cores > 1 ||
+			!get_config_key_bool("pit", "virtual_time", FALSE) ||
+			get_config_key_bool("system", "fastmem", FALSE) ||
+			get_config_key_bool("cpu", "predecode", FALSE) ||
+			(features & (SYSINFO_FEATURE_DISPLAY | SYSINFO_FEATURE_NETWORK | SYSINFO_FEATURE_BLOCKDEV))) {
+		printf("fuzz: needs a single core, [pit] virtual_time, no fastmem or predecode and no display, network or block device\n");
+		return -1;
+	}
+
+	f = machine->fuzz = calloc(1, sizeof(struct fuzz));
+	f->input_path = input_path;
+	f->shm_input = attach_shm(AFL_SHM_FUZZ_ENV);
+	f->cover_map = attach_shm(AFL_SHM_ENV);
+	if (f->cover_map)
+		set_cpu_cover_map(machine->cpu, f->cover_map);
+
+	return 0;
+}
+
+void destroy_fuzz(void)
+{
+	struct fuzz *f = machine->fuzz;
+
+	if (!f)
+		return;
+
+	if (f->shm_input)
+		shmdt(f->shm_input);
+	if (f->cover_map)
+		shmdt(f->cover_map);
+	free(f);
+	machine->fuzz = NULL;
+}
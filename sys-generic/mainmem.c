@@ -20,96 +20,439 @@
  * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
+#define _GNU_SOURCE // SEEK_DATA
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
+#include <config.h>
 #include <arm/arm.h>
 #include <sys/sys.h>
+#include <sys/snapshot.h>
 #include "sys_p.h"
 #include <util/endian.h>
 
-/* global system state */
+/* main memory of one machine */
 struct mainmem {
 	/* main memory backing store */
 	byte *mem;
 	armaddr_t base;
 	armaddr_t size;
-} mainmem;
+	bool fastmem; // mem is the host side of ram mapped into the fastmem window
+	bool hugepages;
+};
 
-static word mainmem_get_put(armaddr_t address, word data, int size, int put)
+static word mainmem_read_word(void *ctx, armaddr_t address)
 {
-	void *ptr;
+	struct mainmem *mainmem = ctx;
 
-	ptr = mainmem.mem + (address - mainmem.base);
+	SYS_TRACE(5, "sys: mainmem_read_word at 0x%08x\n", address);
+	return READ_MEM_WORD(mainmem->mem + (address - mainmem->base));
+}
 
-	switch(size) {
-		case 4:
-			if(put)
-				WRITE_MEM_WORD(ptr, data);
-			else
-				data = READ_MEM_WORD(ptr);
-			break;
-		case 2:
-			if(put)
-				WRITE_MEM_HALFWORD(ptr, data);
-			else
-				data = READ_MEM_HALFWORD(ptr);
-			break;
-		case 1:
-			if(put)
-				WRITE_MEM_BYTE(ptr, data);
-			else
-				data = READ_MEM_BYTE(ptr);
-			break;
-	}
+static halfword mainmem_read_halfword(void *ctx, armaddr_t address)
+{
+	struct mainmem *mainmem = ctx;
+
+	SYS_TRACE(5, "sys: mainmem_read_halfword at 0x%08x\n", address);
+	return READ_MEM_HALFWORD(mainmem->mem + (address - mainmem->base));
+}
+
+static byte mainmem_read_byte(void *ctx, armaddr_t address)
+{
+	struct mainmem *mainmem = ctx;
+
+	SYS_TRACE(5, "sys: mainmem_read_byte at 0x%08x\n", address);
+	return READ_MEM_BYTE(mainmem->mem + (address - mainmem->base));
+}
+
+static void mainmem_write_word(void *ctx, armaddr_t address, word data)
+{
+	struct mainmem *mainmem = ctx;
+
+	SYS_TRACE(5, "sys: mainmem_write_word at 0x%08x, data 0x%08x\n", address, data);
+	WRITE_MEM_WORD(mainmem->mem + (address - mainmem->base), data);
+}
+
+static void mainmem_write_halfword(void *ctx, armaddr_t address, halfword data)
+{
+	struct mainmem *mainmem = ctx;
 
-	SYS_TRACE(5, "sys: mainmem_get_put at 0x%08x, data 0x%08x, size %d, put %d\n", 
-		address, data, size, put);
+	SYS_TRACE(5, "sys: mainmem_write_halfword at 0x%08x, data 0x%04x\n", address, data);
+	WRITE_MEM_HALFWORD(mainmem->mem + (address - mainmem->base), data);
+}
+
+static void mainmem_write_byte(void *ctx, armaddr_t address, byte data)
+{
+	struct mainmem *mainmem = ctx;
 
-	return data;
+	SYS_TRACE(5, "sys: mainmem_write_byte at 0x%08x, data 0x%02x\n", address, data);
+	WRITE_MEM_BYTE(mainmem->mem + (address - mainmem->base), data);
 }
 
-static void *mainmem_get_ptr(armaddr_t address)
+static void *mainmem_get_ptr(void *ctx, armaddr_t address)
 {
-	return mainmem.mem + (address - mainmem.base);
+	struct mainmem *mainmem = ctx;
+
+	return mainmem->mem + (address - mainmem->base);
 }
 
+static const struct mem_handler mainmem_handler = {
+	.read_word = &mainmem_read_word,
+	.read_halfword = &mainmem_read_halfword,
+	.read_byte = &mainmem_read_byte,
+	.write_word = &mainmem_write_word,
+	.write_halfword = &mainmem_write_halfword,
+	.write_byte = &mainmem_write_byte,
+	.get_ptr = &mainmem_get_ptr,
+};
+
 int dump_mainmem(void)
 {
+	struct mainmem *mainmem = machine->mainmem;
 	FILE *fp;
 
-	fp = fopen("mainmem.bin", "w+");
+	fp = fopen("mainmem->bin", "w+");
 	if(fp) {
-		fwrite(mainmem.mem, mainmem.size, 1, fp);
+		fwrite(mainmem->mem, mainmem->size, 1, fp);
 		fclose(fp);
 	}
 
 	return 0;
 }
 
-int initialize_mainmem(const char *rom_file, long load_offset)
+/*
+ * ram is an anonymous mapping, so pages are only committed as the guest touches
+ * them. explicit huge pages are used if asked for and there are any, otherwise
+ * transparent huge pages are asked for instead.
+ */
+static byte *alloc_ram(armaddr_t size, bool hugepages)
 {
-	// allocate some ram
-	mainmem.size = MAINMEM_SIZE;
-	mainmem.base = MAINMEM_BASE;
-	mainmem.mem = calloc(1, mainmem.size);	
+	void *ptr;
 
-	printf("sys: initializing mainmem from rom file %s, offset %ld\n", rom_file, load_offset);
+#ifdef MAP_HUGETLB
+	/* not MAP_NORESERVE, the huge pages have to be there now or it'll fault when they're touched */
+	if(hugepages) {
+		ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if(ptr != MAP_FAILED)
+			return ptr;
+		SYS_TRACE(1, "sys: no huge pages available for mainmem, using regular pages\n");
+	}
+#endif
 
-	// put it in the memory map
-	install_mem_handler(mainmem.base, mainmem.size, &mainmem_get_put, &mainmem_get_ptr);
-
-	// read in a file, if specified
-	if(rom_file) {
-		FILE *fp = fopen(rom_file, "r");
-		if(fp) {
-			fread(mainmem.mem + load_offset, 1, mainmem.size, fp);
-			fclose(fp);
+	ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(ptr == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if(hugepages)
+		madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	return ptr;
+}
+
+/*
+ * put len bytes of the file at file_offset in ram at offset. the whole pages of it
+ * are mapped copy on write right over the ram if the two line up, so only the parts
+ * the guest touches are read in. that can't be done to ram that's mapped twice for
+ * fastmem, so then it's all read in the regular way, as are the partial pages at
+ * either end that have other parts of the file next to them.
+ */
+static int map_file(struct mainmem *mainmem, int fd, off_t file_offset, armaddr_t offset, size_t len)
+{
+	size_t start = offset, end = offset + len;
+	struct stat st;
+
+	if(!mainmem->fastmem && ((file_offset - offset) & (MMU_PAGESIZE-1)) == 0) {
+		size_t map_start = (start + MMU_PAGESIZE - 1) & ~(size_t)(MMU_PAGESIZE-1);
+		size_t map_end = end & ~(size_t)(MMU_PAGESIZE-1);
+
+		// a partial last page can be mapped too if it's the end of the file, the rest of it reads as zeroes
+		if(fstat(fd, &st) == 0 && file_offset + (off_t)len >= st.st_size)
+			map_end = (end + MMU_PAGESIZE - 1) & ~(size_t)(MMU_PAGESIZE-1);
+
+		if(map_start < map_end &&
+				mmap(mainmem->mem + map_start, map_end - map_start, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED,
+					fd, file_offset + (map_start - start)) != MAP_FAILED) {
+			if(pread(fd, mainmem->mem + start, map_start - start, file_offset) < 0)
+				return -1;
+			if(map_end < end && pread(fd, mainmem->mem + map_end, end - map_end, file_offset + (map_end - start)) < 0)
+				return -1;
+			return 0;
+		}
+	}
+
+	if(pread(fd, mainmem->mem + offset, len, file_offset) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * an arm elf32 rom. each PT_LOAD segment goes at its physical address, mapped from
+ * the file as far as it can be. the ram past the end of the file part of one is
+ * left alone, it's fresh anonymous memory that reads as zeroes until it's touched.
+ */
+static int load_elf(struct mainmem *mainmem, int fd, const byte *ehdr, const char *rom_file)
+{
+	uint phoff, phentsize, phnum, i;
+	armaddr_t entry;
+	byte *phdrs;
+
+	if(ehdr[4] != 1 || ehdr[5] != 1 || READ_MEM_HALFWORD(ehdr + 0x12) != 40) { // elf32, little endian, EM_ARM
+		printf("sys: rom file %s isn't a little endian arm elf32 file\n", rom_file);
+		return -1;
+	}
+
+	entry = READ_MEM_WORD(ehdr + 0x18);
+	phoff = READ_MEM_WORD(ehdr + 0x1c);
+	phentsize = READ_MEM_HALFWORD(ehdr + 0x2a);
+	phnum = READ_MEM_HALFWORD(ehdr + 0x2c);
+	if(phentsize < 32 || phnum == 0) {
+		printf("sys: rom file %s has no program headers\n", rom_file);
+		return -1;
+	}
+
+	phdrs = malloc(phnum * phentsize);
+	if(pread(fd, phdrs, phnum * phentsize, phoff) != (ssize_t)(phnum * phentsize)) {
+		printf("sys: error reading rom file %s\n", rom_file);
+		free(phdrs);
+		return -1;
+	}
+
+	for(i = 0; i < phnum; i++) {
+		const byte *ph = phdrs + i * phentsize;
+		uint offset = READ_MEM_WORD(ph + 4);
+		armaddr_t paddr = READ_MEM_WORD(ph + 12);
+		uint filesz = READ_MEM_WORD(ph + 16);
+		uint memsz = READ_MEM_WORD(ph + 20);
+
+		if(READ_MEM_WORD(ph + 0) != 1 || memsz == 0) // PT_LOAD
+			continue;
+
+		if(paddr < mainmem->base || paddr - mainmem->base >= mainmem->size ||
+				memsz > mainmem->size - (paddr - mainmem->base) || filesz > memsz) {
+			printf("sys: rom file %s segment of 0x%x bytes at 0x%08x isn't in mainmem\n", rom_file, memsz, paddr);
+			free(phdrs);
+			return -1;
+		}
+
+		SYS_TRACE(1, "sys: elf segment at 0x%08x, 0x%x bytes from the file, 0x%x in all\n", paddr, filesz, memsz);
+		if(filesz && map_file(mainmem, fd, offset, paddr - mainmem->base, filesz) < 0) {
+			printf("sys: error reading rom file %s\n", rom_file);
+			free(phdrs);
+			return -1;
+		}
+	}
+	free(phdrs);
+
+	printf("sys: initializing mainmem from elf rom file %s, entry point 0x%08x\n", rom_file, entry);
+
+	// the cores start at the entry point, and the rom names the code they run
+	set_cpu_entry_point(machine->cpu, entry, rom_file);
+
+	return 0;
+}
+
+/* put the rom in ram, an elf file where it says it goes and anything else at load_address */
+static int load_rom(struct mainmem *mainmem, const char *rom_file, armaddr_t load_address)
+{
+	byte ehdr[0x34];
+	struct stat st;
+	armaddr_t offset;
+	size_t len;
+	int fd, err;
+
+	fd = open(rom_file, O_RDONLY);
+	if(fd < 0) {
+		printf("sys: couldn't open rom file %s\n", rom_file);
+		return 0;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	if(st.st_size >= (off_t)sizeof(ehdr) && pread(fd, ehdr, sizeof(ehdr), 0) == sizeof(ehdr) &&
+			memcmp(ehdr, "\177ELF", 4) == 0) {
+		err = load_elf(mainmem, fd, ehdr, rom_file);
+		close(fd);
+		return err;
+	}
+
+	if(load_address < mainmem->base || load_address - mainmem->base >= mainmem->size) {
+		printf("sys: rom address 0x%08x isn't in mainmem\n", load_address);
+		close(fd);
+		return -1;
+	}
+	offset = load_address - mainmem->base;
+
+	len = st.st_size;
+	if(len > mainmem->size - offset)
+		len = mainmem->size - offset;
+
+	printf("sys: initializing mainmem from rom file %s, address 0x%08x\n", rom_file, load_address);
+
+	if(map_file(mainmem, fd, 0, offset, len) < 0)
+		printf("sys: error reading rom file %s\n", rom_file);
+
+	close(fd);
+	return 0;
+}
+
+static bool page_is_zero(const byte *page)
+{
+	const uint64_t *p = (const uint64_t *)page;
+	unsigned int i;
+
+	for(i = 0; i < MMU_PAGESIZE / sizeof(uint64_t); i++) {
+		if(p[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * ram into a snapshot at header->ram_offset. the file is sized to hold all of it and
+ * only the pages with something in them are written, the rest stay holes.
+ */
+int mainmem_save_state(struct snapshot_header *header, int fd)
+{
+	struct mainmem *mainmem = machine->mainmem;
+	armaddr_t off, run;
+
+	header->ram_base = mainmem->base;
+	header->ram_size = mainmem->size;
+	if(ftruncate(fd, header->ram_offset + mainmem->size) < 0)
+		return -1;
+
+	for(off = 0; off < mainmem->size; off += run) {
+		if(page_is_zero(mainmem->mem + off)) {
+			run = MMU_PAGESIZE;
+			continue;
 		}
+
+		// write runs of pages in one go
+		for(run = MMU_PAGESIZE; off + run < mainmem->size && !page_is_zero(mainmem->mem + off + run); run += MMU_PAGESIZE)
+			;
+		if(pwrite(fd, mainmem->mem + off, run, header->ram_offset + off) != (ssize_t)run)
+			return -1;
 	}
 
 	return 0;
 }
 
+/* read the parts of the snapshot's ram that aren't holes */
+static int read_ram(struct mainmem *mainmem, int fd, off_t offset)
+{
+	off_t data = 0, hole;
+
+	for(;;) {
+#ifdef SEEK_DATA
+		data = lseek(fd, offset + data, SEEK_DATA);
+		if(data < 0 || data >= offset + (off_t)mainmem->size)
+			return 0;
+		hole = lseek(fd, data, SEEK_HOLE);
+		data -= offset;
+		hole -= offset;
+		if(hole > (off_t)mainmem->size)
+			hole = mainmem->size;
+#else
+		hole = mainmem->size;
+#endif
+		if(pread(fd, mainmem->mem + data, hole - data, offset + data) != hole - data)
+			return -1;
+		if(hole >= (off_t)mainmem->size)
+			return 0;
+		data = hole;
+	}
+}
+
+/*
+ * put the ram back from a snapshot. like a rom, it's mapped copy on write over
+ * the ram if it can be, so machines restored from the same file share the pages
+ * none of them have written to.
+ */
+int mainmem_restore_state(const struct snapshot_header *header, int fd)
+{
+	struct mainmem *mainmem = machine->mainmem;
+
+	if(header->ram_base != mainmem->base || header->ram_size != mainmem->size) {
+		printf("sys: the snapshot has 0x%llx bytes of ram at 0x%08llx, this machine 0x%x at 0x%08x\n",
+			(unsigned long long)header->ram_size, (unsigned long long)header->ram_base, mainmem->size, mainmem->base);
+		return -1;
+	}
+
+	if(!mainmem->fastmem && !mainmem->hugepages) {
+		if(mmap(mainmem->mem, mainmem->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, header->ram_offset) != MAP_FAILED)
+			return 0;
+	}
+
+	// the ram is fresh, no rom was loaded, so anything left out is already zeroes
+	if(read_ram(mainmem, fd, header->ram_offset) < 0) {
+		printf("sys: error reading the snapshot's ram\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* load_address is where the rom goes in the physical address space */
+int initialize_mainmem(const char *rom_file, armaddr_t load_address)
+{
+	struct mainmem *mainmem;
+	unsigned long size;
+
+	mainmem = machine->mainmem = calloc(1, sizeof(struct mainmem));
+
+	// where the ram goes and how big it is, in megabytes
+	size = strtoul(get_config_key_string("memory", "size", "0"), NULL, 0) * 1024 * 1024;
+	if(size == 0)
+		size = MAINMEM_SIZE;
+	mainmem->base = strtoul(get_config_key_string("memory", "base", "0"), NULL, 0);
+	mainmem->hugepages = get_config_key_bool("memory", "hugepages", FALSE);
+
+	if((mainmem->base & (MMU_PAGESIZE-1)) || mainmem->base >= PERIPHERAL_BASE || size > PERIPHERAL_BASE - mainmem->base) {
+		printf("sys: mainmem of 0x%lx bytes at 0x%08x doesn't fit below the peripherals\n", size, mainmem->base);
+		return -1;
+	}
+	mainmem->size = size;
+
+	// allocate some ram
+	mainmem->mem = fastmem_map_ram(mainmem->base, mainmem->size, mainmem->hugepages);
+	if(mainmem->mem)
+		mainmem->fastmem = TRUE;
+	else
+		mainmem->mem = alloc_ram(mainmem->size, mainmem->hugepages);
+	if(!mainmem->mem) {
+		printf("sys: couldn't allocate 0x%x bytes of mainmem\n", mainmem->size);
+		return -1;
+	}
+
+	// put it in the memory map
+	install_mem_handler(mainmem->base, mainmem->size, &mainmem_handler, mainmem);
+
+	// map in a file, if specified
+	if(rom_file)
+		return load_rom(mainmem, rom_file, load_address);
+
+	return 0;
+}
+
+void destroy_mainmem(void)
+{
+	struct mainmem *mainmem = machine->mainmem;
+
+	if (!mainmem)
+		return;
+
+	if(mainmem->fastmem)
+		fastmem_unmap_ram(mainmem->mem, mainmem->size);
+	else if(mainmem->mem)
+		munmap(mainmem->mem, mainmem->size);
+	free(mainmem);
+	machine->mainmem = NULL;
+}
@@ -47,6 +47,8 @@
 #define SYSINFO_FEATURE_CONSOLE 0x00000002
 #define SYSINFO_FEATURE_NETWORK 0x00000004
 #define SYSINFO_FEATURE_BLOCKDEV 0x00000008
+#define SYSINFO_FEATURE_TIMER   0x00000010
+#define SYSINFO_FEATURE_MEMOP   0x00000020
 
     /* a write to this register latches the current emulator system time, so the next two regs can be read atomically */
 #define SYSINFO_TIME_LATCH (SYSINFO_REGS_BASE + 4)
@@ -102,13 +104,28 @@
 	 * or 0xffffffff if no interrupt is active
 	 */
 #define PIC_CURRENT_NUM   (PIC_REGS_BASE + 20)
+	/* number of the core doing the access, read-only */
+#define PIC_CPU_ID        (PIC_REGS_BASE + 24)
+	/* number of cores in the system, read-only */
+#define PIC_CPU_COUNT     (PIC_REGS_BASE + 28)
+	/* raise INT_IPI on every core with its bit set in the written value */
+#define PIC_IPI_SEND      (PIC_REGS_BASE + 32)
+	/* a nonzero write clears the pending INT_IPI of the core doing the access */
+#define PIC_IPI_CLEAR     (PIC_REGS_BASE + 36)
 
 	/* interrupt map */
 #define INT_PIT      0
 #define INT_KEYBOARD 1
 #define INT_NET      2
+#define INT_BDEV     3
+#define INT_TIMER(n) (4 + (n)) /* one per high resolution timer channel */
+#define INT_IPI      31 /* inter-processor interrupt, banked per core */
 #define PIC_MAX_INT 32
 
+	/* the masks, PIC_STAT, and the current interrupt registers are all banked per core.
+	 * device interrupts start out unmasked on core 0 and masked on the rest.
+	 */
+
 /* debug interface */
 #define DEBUG_REGS_BASE (PIC_REGS_BASE + PIC_REGS_SIZE)
 #define DEBUG_REGS_SIZE MEMBANK_SIZE
@@ -134,6 +151,32 @@
 #define DEBUG_CYCLE_COUNT (DEBUG_REGS_BASE + 48)
 #define DEBUG_INS_COUNT (DEBUG_REGS_BASE + 52)
 
+/* select how much the emulator counts from within the emulator, 0 (nothing) to 3 (everything).
+ * takes effect at the end of the current basic block */
+#define DEBUG_INSTRUMENTATION (DEBUG_REGS_BASE + 56)
+
+/* write a whole buffer to stdout (or the debug log) at once. set the address, then
+ * writing the length sends it. */
+#define DEBUG_WRITE_ADDR (DEBUG_REGS_BASE + 60)
+#define DEBUG_WRITE_LEN  (DEBUG_REGS_BASE + 64)
+
+/* writes to this register print the writing core's decode cache and mmu statistics,
+ * and its codepages with the most decoding done in them. and the device register
+ * profile so far, with [stats] mmio on */
+#define DEBUG_CACHE_STATS (DEBUG_REGS_BASE + 68)
+
+/* writes to this register save a snapshot of the machine to [snapshot] save, once
+ * every core gets to the end of its current basic block */
+#define DEBUG_SNAPSHOT (DEBUG_REGS_BASE + 72)
+
+/* fuzzing, see include/sys/fuzz.h. set the buffer the test case goes in, then writing
+ * DEBUG_FUZZ_START starts the fork server. each run carries on from there with the
+ * test case in the buffer, DEBUG_FUZZ_INPUT_LEN reads back how long it is. */
+#define DEBUG_FUZZ_INPUT_ADDR (DEBUG_REGS_BASE + 76)
+#define DEBUG_FUZZ_INPUT_SIZE (DEBUG_REGS_BASE + 80)
+#define DEBUG_FUZZ_START (DEBUG_REGS_BASE + 84)
+#define DEBUG_FUZZ_INPUT_LEN (DEBUG_REGS_BASE + 88)
+
 /* network interface */
 #define NET_REGS_BASE (DEBUG_REGS_BASE + DEBUG_REGS_SIZE)
 #define NET_REGS_SIZE MEMBANK_SIZE
@@ -150,6 +193,29 @@
 #define NET_IN_BUF_LEN (NET_REGS_BASE + 16)	/* length of the currently selected in buffer, via tail register */
 #define NET_IN_BUF	(NET_REGS_BASE + NET_BUF_LEN*2)
 
+/* descriptor rings, packets go straight in and out of buffers in memory. once the rx ring
+ * is set up, received packets go there instead of the in buffers above. */
+#define NET_RX_RING_ADDR (NET_REGS_BASE + 20)	/* address of the ring of receive descriptors */
+#define NET_RX_RING_LEN	(NET_REGS_BASE + 24)	/* number of descriptors in the ring, a power of 2, 0 turns it off */
+#define NET_RX_HEAD	(NET_REGS_BASE + 28)	/* count of descriptors handed to the device to receive into */
+#define NET_RX_DONE	(NET_REGS_BASE + 32)	/* count of descriptors filled with a packet, read/only */
+#define NET_TX_RING_ADDR (NET_REGS_BASE + 36)	/* address of the ring of transmit descriptors */
+#define NET_TX_RING_LEN	(NET_REGS_BASE + 40)	/* number of descriptors in the ring, a power of 2 */
+#define NET_TX_HEAD	(NET_REGS_BASE + 44)	/* count of descriptors filled in, writing it sends the new ones */
+#define NET_TX_DONE	(NET_REGS_BASE + 48)	/* count of descriptors sent, read/only. caught up by the time the write to NET_TX_HEAD is done */
+#define NET_INT_ACK	(NET_REGS_BASE + 52)	/* a nonzero write clears INT_NET */
+#define NET_COALESCE_PACKETS (NET_REGS_BASE + 56) /* raise INT_NET once this many packets have come into the rx ring */
+#define NET_COALESCE_USECS (NET_REGS_BASE + 60)	/* or this long after the first of them, whichever is first */
+#define NET_RX_OVERRUNS	(NET_REGS_BASE + 64)	/* count of times packets were waiting with nowhere to put them, read/only */
+
+/* a descriptor, descriptor n is at the ring's address + (n % its length) * NET_DESC_SIZE */
+#define NET_DESC_SIZE	16
+#define NET_DESC_ADDR	0	/* address of the buffer */
+#define NET_DESC_LEN	4	/* length of the buffer, the device puts the length of the packet it received here */
+#define NET_DESC_FLAGS	8	/* cleared by the guest, set by the device when it's done with the descriptor */
+#define NET_DESC_DONE	(0x1)
+#define NET_DESC_ERR	(0x2)	/* couldn't be sent, or the packet didn't fit in the buffer and was cut short */
+
 /* block device interface */
 #define BDEV_REGS_BASE (NET_REGS_BASE + NET_REGS_SIZE)
 #define BDEV_REGS_SIZE MEMBANK_SIZE
@@ -161,6 +227,24 @@
 
 #define BDEV_LEN	(BDEV_REGS_BASE + 20)	/* length of block device, 64bit */
 
+/* command ring, for more than one transfer at a time without waiting on any of them */
+#define BDEV_RING_ADDR	(BDEV_REGS_BASE + 28)	/* address of the ring of descriptors in memory */
+#define BDEV_RING_LEN	(BDEV_REGS_BASE + 32)	/* number of descriptors in the ring, a power of 2 */
+#define BDEV_RING_HEAD	(BDEV_REGS_BASE + 36)	/* count of descriptors filled in, writing it hands the new ones to the device.
+										 * at most BDEV_RING_LEN past BDEV_RING_DONE, a write outside that is ignored */
+#define BDEV_RING_DONE	(BDEV_REGS_BASE + 40)	/* count of descriptors finished, read/only */
+#define BDEV_INT_ACK	(BDEV_REGS_BASE + 44)	/* a nonzero write clears INT_BDEV, raised each time a descriptor finishes */
+
+/* a descriptor in the ring, descriptor n is at BDEV_RING_ADDR + (n % BDEV_RING_LEN) * BDEV_DESC_SIZE.
+ * they can finish in any order, the device sets BDEV_DESC_DONE and the error bits in the
+ * command when it's done with one. */
+#define BDEV_DESC_SIZE	32
+#define BDEV_DESC_CMD	0	/* command, BDEV_CMD_* */
+#define BDEV_DESC_ADDR	4	/* address of the transfer, 32bit */
+#define BDEV_DESC_OFF	8	/* offset of the transfer, 64bit */
+#define BDEV_DESC_LEN	16	/* length of the transfer, 32bit */
+#define BDEV_DESC_DONE	(0x100)
+
 /* BDEV_CMD bits */
 #define BDEV_CMD_MASK	(0x3)
 #define BDEV_CMD_NOP	(0)
@@ -173,4 +257,49 @@
 #define BDEV_CMD_ERR_GENERAL (1 << BDEV_CMD_ERRSHIFT)
 #define BDEV_CMD_ERR_BAD_OFFSET (2 << BDEV_CMD_ERRSHIFT)
 
+/* high resolution timer, a free running counter and channels that fire at a value of it */
+#define TIMER_REGS_BASE (BDEV_REGS_BASE + BDEV_REGS_SIZE)
+#define TIMER_REGS_SIZE MEMBANK_SIZE
+
+#define TIMER_COUNT_LO	(TIMER_REGS_BASE + 0)	/* free running 64bit counter, read/only. reading the low half */
+#define TIMER_COUNT_HI	(TIMER_REGS_BASE + 4)	/* latches the high half for the same core to read next */
+#define TIMER_FREQ	(TIMER_REGS_BASE + 8)	/* counter ticks per second, read/only */
+#define TIMER_CHANNEL_COUNT (TIMER_REGS_BASE + 12) /* number of channels, read/only */
+
+#define TIMER_NUM_CHANNELS 4
+#define TIMER_CHANNEL_SIZE 32
+#define TIMER_CHANNEL(n) (TIMER_REGS_BASE + 32 + (n) * TIMER_CHANNEL_SIZE) /* channel n raises INT_TIMER(n) */
+
+/* channel registers, offsets from TIMER_CHANNEL(n) */
+#define TIMER_CTRL	0	/* TIMER_CTRL_* */
+#define TIMER_STATUS	4	/* TIMER_STATUS_*, a nonzero write clears the pending interrupt */
+#define TIMER_COMPARE_LO 8	/* the channel fires once the counter reaches this 64bit value, */
+#define TIMER_COMPARE_HI 12	/* set it with the channel disabled, or use TIMER_DELAY */
+#define TIMER_PERIOD	16	/* added to the compare value each time a periodic channel fires */
+#define TIMER_DELAY	20	/* write only, sets the compare value to the counter plus what's written */
+
+#define TIMER_CTRL_ENABLE	0x1	/* cleared when a oneshot channel fires */
+#define TIMER_CTRL_PERIODIC	0x2
+#define TIMER_STATUS_INT_PEND	0x1
+
+/* bulk memory operations, memmove, memset and memcmp done by the emulator in one go.
+ * the addresses are virtual, translated as the core doing it would, and the registers
+ * are banked per core. writing MEMOP_CMD does the whole thing before the store finishes.
+ * a fault part way aborts the store with the registers left describing what's still to
+ * do, so writing the command again once the fault's dealt with carries on. */
+#define MEMOP_REGS_BASE (TIMER_REGS_BASE + TIMER_REGS_SIZE)
+#define MEMOP_REGS_SIZE MEMBANK_SIZE
+
+#define MEMOP_SRC	(MEMOP_REGS_BASE + 0)	/* source of a copy, first buffer of a compare */
+#define MEMOP_DST	(MEMOP_REGS_BASE + 4)	/* destination of a copy or fill, second buffer of a compare */
+#define MEMOP_LEN	(MEMOP_REGS_BASE + 8)	/* bytes, counts down to what's left as it goes */
+#define MEMOP_FILL	(MEMOP_REGS_BASE + 12)	/* the byte a fill writes */
+#define MEMOP_CMD	(MEMOP_REGS_BASE + 16)	/* write only, MEMOP_CMD_* */
+#define MEMOP_RESULT	(MEMOP_REGS_BASE + 20)	/* read only, a compare's first differing source byte minus */
+						/* destination byte, 0 if equal. the other registers stop at it */
+
+#define MEMOP_CMD_COPY		1	/* memmove, overlapping buffers are fine */
+#define MEMOP_CMD_FILL		2
+#define MEMOP_CMD_COMPARE	3
+
 #endif
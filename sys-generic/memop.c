@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <arm/arm.h>
+#include <arm/mmu.h>
+#include <sys/sys.h>
+#include <sys/snapshot.h>
+#include "sys_p.h"
+
+/*
+ * the bulk memory operations device, see memmap.h. each op goes a page at a time,
+ * straight through the host's pointers to both buffers where they're plain memory the
+ * core has a translation for. otherwise it's a byte through the mmu's accessors, which
+ * brings the translation in, takes the fault, or throws out the instructions decoded
+ * out of a code page and puts it back on the fast path, and then it carries on.
+ */
+struct memop {
+	struct memop_core {
+		word src;
+		word dst;
+		word len;
+		word fill;
+		word result;
+	} core[MAX_CPU_CORES];
+};
+
+/* how far to the end of the page address is in, or from the start of it to address if backwards */
+static size_t page_left(armaddr_t address, bool backward)
+{
+	if (backward)
+		return ((address - 1) & (MMU_PAGESIZE - 1)) + 1;
+	return MMU_PAGESIZE - (address & (MMU_PAGESIZE - 1));
+}
+
+/* the most of len that's in one page of both a and b */
+static size_t chunk_size(armaddr_t a, armaddr_t b, size_t len, bool backward)
+{
+	size_t chunk = len;
+
+	if (chunk > page_left(a, backward))
+		chunk = page_left(a, backward);
+	if (chunk > page_left(b, backward))
+		chunk = page_left(b, backward);
+	return chunk;
+}
+
+/* the rest return TRUE if they faulted */
+static bool copy_byte(armaddr_t src, armaddr_t dst)
+{
+	byte val;
+
+	return mmu_read_mem_byte(src, &val) || mmu_write_mem_byte(dst, val);
+}
+
+/* a memmove, from the end if dst overlaps the end of src */
+static bool memop_copy(struct memop_core *c)
+{
+	bool backward = c->dst > c->src && c->dst - c->src < c->len;
+
+	while (c->len > 0) {
+		armaddr_t src = backward ? c->src + c->len : c->src;
+		armaddr_t dst = backward ? c->dst + c->len : c->dst;
+		size_t chunk = chunk_size(src, dst, c->len, backward);
+		const void *from;
+		void *to;
+
+		if (backward) {
+			src -= chunk;
+			dst -= chunk;
+		}
+		from = mmu_get_data_run(src, &chunk, FALSE);
+		to = from ? mmu_get_data_run(dst, &chunk, TRUE) : NULL;
+		if (to) {
+			memmove(to, from, chunk);
+		} else {
+			chunk = 1;
+			if (backward) {
+				src = c->src + c->len - 1;
+				dst = c->dst + c->len - 1;
+			}
+			if (copy_byte(src, dst))
+				return TRUE;
+		}
+
+		c->len -= chunk;
+		if (!backward) {
+			c->src += chunk;
+			c->dst += chunk;
+		}
+	}
+	return FALSE;
+}
+
+static bool memop_fill(struct memop_core *c)
+{
+	while (c->len > 0) {
+		size_t chunk = c->len;
+		void *to = mmu_get_data_run(c->dst, &chunk, TRUE);
+
+		if (to) {
+			memset(to, c->fill, chunk);
+		} else {
+			chunk = 1;
+			if (mmu_write_mem_byte(c->dst, c->fill))
+				return TRUE;
+		}
+
+		c->dst += chunk;
+		c->len -= chunk;
+	}
+	return FALSE;
+}
+
+/* stops at the first difference, with src and dst pointing at it */
+static bool memop_compare(struct memop_core *c)
+{
+	c->result = 0;
+	while (c->len > 0) {
+		size_t chunk = chunk_size(c->src, c->dst, c->len, FALSE), i;
+		const byte *a = mmu_get_data_run(c->src, &chunk, FALSE);
+		const byte *b = a ? mmu_get_data_run(c->dst, &chunk, FALSE) : NULL;
+		byte x, y;
+
+		if (b) {
+			if (memcmp(a, b, chunk) != 0) {
+				for (i = 0; a[i] == b[i]; i++)
+					;
+				c->src += i;
+				c->dst += i;
+				c->len -= i;
+				c->result = (int)a[i] - (int)b[i];
+				return FALSE;
+			}
+		} else {
+			chunk = 1;
+			if (mmu_read_mem_byte(c->src, &x) || mmu_read_mem_byte(c->dst, &y))
+				return TRUE;
+			if (x != y) {
+				c->result = (int)x - (int)y;
+				return FALSE;
+			}
+		}
+
+		c->src += chunk;
+		c->dst += chunk;
+		c->len -= chunk;
+	}
+	return FALSE;
+}
+
+static word memop_regs_read(void *ctx, armaddr_t address)
+{
+	struct memop *memop = ctx;
+	struct memop_core *c = &memop->core[get_core_id()];
+
+	switch (address) {
+	case MEMOP_SRC:
+		return c->src;
+	case MEMOP_DST:
+		return c->dst;
+	case MEMOP_LEN:
+		return c->len;
+	case MEMOP_FILL:
+		return c->fill;
+	case MEMOP_RESULT:
+		return c->result;
+	}
+
+	return 0;
+}
+
+static void memop_regs_write(void *ctx, armaddr_t address, word data)
+{
+	struct memop *memop = ctx;
+	struct memop_core *c = &memop->core[get_core_id()];
+
+	switch (address) {
+	case MEMOP_SRC:
+		c->src = data;
+		break;
+	case MEMOP_DST:
+		c->dst = data;
+		break;
+	case MEMOP_LEN:
+		c->len = data;
+		break;
+	case MEMOP_FILL:
+		c->fill = data & 0xff;
+		break;
+	case MEMOP_CMD:
+		SYS_TRACE(5, "sys: memop %d, src 0x%08x dst 0x%08x len %u\n", data, c->src, c->dst, c->len);
+
+		// a fault leaves the data abort raised, it's taken as the store to MEMOP_CMD finishes
+		switch (data) {
+		case MEMOP_CMD_COPY:
+			memop_copy(c);
+			break;
+		case MEMOP_CMD_FILL:
+			memop_fill(c);
+			break;
+		case MEMOP_CMD_COMPARE:
+			memop_compare(c);
+			break;
+		}
+		break;
+	}
+}
+
+WORD_REG_HANDLERS(memop_regs);
+
+struct memop_state {
+	struct {
+		uint32_t src;
+		uint32_t dst;
+		uint32_t len;
+		uint32_t fill;
+		uint32_t result;
+	} core[MAX_CPU_CORES];
+};
+
+void memop_save_state(struct snapshot *s)
+{
+	struct memop *memop = machine->memop;
+	struct memop_state state;
+	int i;
+
+	for (i = 0; i < MAX_CPU_CORES; i++) {
+		state.core[i].src = memop->core[i].src;
+		state.core[i].dst = memop->core[i].dst;
+		state.core[i].len = memop->core[i].len;
+		state.core[i].fill = memop->core[i].fill;
+		state.core[i].result = memop->core[i].result;
+	}
+	snapshot_put(s, SNAPSHOT_TAG_MEMOP, &state, sizeof(state));
+}
+
+/* a snapshot from before there was one doesn't have it, it starts out clear then */
+int memop_restore_state(struct snapshot *s)
+{
+	struct memop *memop = machine->memop;
+	const struct memop_state *state = snapshot_get(s, SNAPSHOT_TAG_MEMOP, sizeof(struct memop_state));
+	int i;
+
+	if (!state)
+		return 0;
+
+	for (i = 0; i < MAX_CPU_CORES; i++) {
+		memop->core[i].src = state->core[i].src;
+		memop->core[i].dst = state->core[i].dst;
+		memop->core[i].len = state->core[i].len;
+		memop->core[i].fill = state->core[i].fill;
+		memop->core[i].result = state->core[i].result;
+	}
+	return 0;
+}
+
+int initialize_memop(void)
+{
+	machine->memop = calloc(1, sizeof(struct memop));
+
+	install_mem_handler(MEMOP_REGS_BASE, MEMOP_REGS_SIZE, &memop_regs_handler, machine->memop);
+
+	return 0;
+}
+
+void destroy_memop(void)
+{
+	free(machine->memop);
+	machine->memop = NULL;
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <config.h>
+#include <arm/arm.h>
+#include <sys/sys.h>
+#include "sys_p.h"
+
+/*
+ * device register profiling, [stats] mmio. every access to a device's registers is
+ * counted by register, size and direction, and the time spent waiting for io_lock and
+ * in the handler goes into a log2 histogram for the region. it's all updated from the
+ * accessors in sys.c, under io_lock if there is one, so it needs no locking of its own.
+ * a guest polling a register stands out at the top of the register list, a handler
+ * that's slow or waits on other threads in the histograms.
+ */
+#define MMIO_REG_HASH_SIZE 4096	// registers, far more than any guest uses
+#define MMIO_HIST_BUCKETS 40	// up to 2^39 ticks, minutes
+#define MMIO_TOP_REGS 32
+
+struct mmio_reg_stats {
+	armaddr_t address;
+	byte size;
+	bool write;
+	uint64_t count;
+	uint64_t busy; // ticks in the handler
+	uint64_t wait; // ticks waiting for io_lock
+};
+
+struct mmio_region_stats {
+	armaddr_t base;
+	uint64_t count;
+	uint64_t busy;
+	uint64_t wait;
+	uint64_t busy_hist[MMIO_HIST_BUCKETS];
+	uint64_t wait_hist[MMIO_HIST_BUCKETS];
+	struct mmio_region_stats *next;
+};
+
+struct mmio_stats {
+	struct mmio_region_stats *regions;
+	struct mmio_reg_stats regs[MMIO_REG_HASH_SIZE];
+	unsigned int reg_count;
+	uint64_t dropped; // accesses to registers that didn't fit in the table
+	bool locked; // there's an io_lock to wait for, more than one core
+
+	// to work out what a tick is when it's time to print them
+	uint64_t start_ticks;
+	struct timespec start_time;
+};
+
+static const struct {
+	armaddr_t base;
+	const char *name;
+} region_names[] = {
+	{ SYSINFO_REGS_BASE, "sysinfo" },
+	{ DISPLAY_REGS_BASE, "display" },
+	{ CONSOLE_REGS_BASE, "console" },
+	{ PIT_REGS_BASE, "pit" },
+	{ PIC_REGS_BASE, "pic" },
+	{ DEBUG_REGS_BASE, "debug" },
+	{ NET_REGS_BASE, "network" },
+	{ BDEV_REGS_BASE, "block" },
+	{ TIMER_REGS_BASE, "timer" },
+	{ MEMOP_REGS_BASE, "memop" },
+};
+
+static const char *region_name(armaddr_t base)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(region_names) / sizeof(region_names[0]); i++) {
+		if (region_names[i].base == base)
+			return region_names[i].name;
+	}
+	return "?";
+}
+
+static unsigned int hist_bucket(uint64_t ticks)
+{
+	unsigned int bucket = ticks ? 64 - __builtin_clzll(ticks) : 0;
+
+	return bucket < MMIO_HIST_BUCKETS ? bucket : MMIO_HIST_BUCKETS - 1;
+}
+
+static unsigned int reg_hash(armaddr_t address, int size, bool write)
+{
+	uint32_t key = address ^ (size << 1) ^ write;
+
+	return (key * 2654435761u) >> 20; // 12 bits, MMIO_REG_HASH_SIZE
+}
+
+struct mmio_region_stats *mmio_stats_region(armaddr_t base)
+{
+	struct mmio_stats *stats = machine->mmio_stats;
+	struct mmio_region_stats *r;
+
+	if (!stats)
+		return NULL;
+
+	r = calloc(1, sizeof(struct mmio_region_stats));
+	r->base = base;
+	r->next = stats->regions;
+	stats->regions = r;
+	return r;
+}
+
+void mmio_stats_add(struct mmio_region_stats *r, armaddr_t address, int size, bool write, uint64_t wait, uint64_t busy)
+{
+	struct mmio_stats *stats = machine->mmio_stats;
+	unsigned int i = reg_hash(address, size, write);
+	unsigned int probes;
+
+	r->count++;
+	r->busy += busy;
+	r->wait += wait;
+	r->busy_hist[hist_bucket(busy)]++;
+	r->wait_hist[hist_bucket(wait)]++;
+
+	for (probes = 0; probes < MMIO_REG_HASH_SIZE; probes++, i = (i + 1) % MMIO_REG_HASH_SIZE) {
+		struct mmio_reg_stats *reg = &stats->regs[i];
+
+		if (reg->count == 0) {
+			reg->address = address;
+			reg->size = size;
+			reg->write = write;
+			stats->reg_count++;
+		} else if (reg->address != address || reg->size != size || reg->write != write) {
+			continue;
+		}
+		reg->count++;
+		reg->busy += busy;
+		reg->wait += wait;
+		return;
+	}
+	stats->dropped++;
+}
+
+static void print_time(double ns)
+{
+	if (ns < 1000)
+		printf("%.0fns", ns);
+	else if (ns < 1000000)
+		printf("%.1fus", ns / 1000);
+	else
+		printf("%.1fms", ns / 1000000);
+}
+
+/* a bucket is up to a power of two ticks, printed as what that comes to */
+static void print_hist(const char *what, const uint64_t *hist, double ns_per_tick)
+{
+	int i;
+
+	printf("  %s:", what);
+	for (i = 0; i < MMIO_HIST_BUCKETS; i++) {
+		if (hist[i]) {
+			printf(" <");
+			print_time((1ULL << i) * ns_per_tick);
+			printf(" %llu", (unsigned long long)hist[i]);
+		}
+	}
+	printf("\n");
+}
+
+static int compare_regs(const void *_a, const void *_b)
+{
+	const struct mmio_reg_stats *a = _a, *b = _b;
+
+	if (a->count != b->count)
+		return a->count < b->count ? 1 : -1;
+	return a->address < b->address ? -1 : a->address > b->address;
+}
+
+void dump_mmio_stats(void)
+{
+	struct mmio_stats *stats = machine->mmio_stats;
+	struct mmio_region_stats *r;
+	struct mmio_reg_stats *regs;
+	struct timespec now;
+	uint64_t elapsed;
+	double ns_per_tick;
+	unsigned int i, n;
+
+	if (!stats)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - stats->start_time.tv_sec) * 1000000000ULL + now.tv_nsec - stats->start_time.tv_nsec;
+	ns_per_tick = (double)elapsed / (mmio_ticks() - stats->start_ticks);
+
+	printf("mmio stats, %.3fns a tick\n", ns_per_tick);
+	for (r = stats->regions; r; r = r->next) {
+		if (r->count == 0)
+			continue;
+		printf("%s 0x%08x: accesses %llu, in the handler %.0fns avg",
+			region_name(r->base), r->base, (unsigned long long)r->count, r->busy * ns_per_tick / r->count);
+		if (stats->locked)
+			printf(", waiting for the lock %.0fns avg", r->wait * ns_per_tick / r->count);
+		printf("\n");
+		print_hist("handler", r->busy_hist, ns_per_tick);
+		if (stats->locked)
+			print_hist("lock wait", r->wait_hist, ns_per_tick);
+	}
+
+	// the busiest registers first
+	regs = malloc(stats->reg_count * sizeof(struct mmio_reg_stats));
+	for (i = 0, n = 0; i < MMIO_REG_HASH_SIZE; i++) {
+		if (stats->regs[i].count)
+			regs[n++] = stats->regs[i];
+	}
+	qsort(regs, n, sizeof(struct mmio_reg_stats), &compare_regs);
+
+	for (i = 0; i < n && i < MMIO_TOP_REGS; i++) {
+		printf("0x%08x %-5s %d: %llu, in the handler %.0fns avg",
+			regs[i].address, regs[i].write ? "write" : "read", regs[i].size * 8,
+			(unsigned long long)regs[i].count, regs[i].busy * ns_per_tick / regs[i].count);
+		if (stats->locked)
+			printf(", waiting %.0fns avg", regs[i].wait * ns_per_tick / regs[i].count);
+		printf("\n");
+	}
+	if (n > MMIO_TOP_REGS)
+		printf("%u more registers\n", n - MMIO_TOP_REGS);
+	if (stats->dropped)
+		printf("%llu accesses to registers past the end of the table\n", (unsigned long long)stats->dropped);
+	free(regs);
+
+	fflush(stdout);
+}
+
+/* has to come before any regions are installed, they're only profiled if it's on when they are */
+int initialize_mmio_stats(bool locked)
+{
+	struct mmio_stats *stats;
+
+	if (!get_config_key_bool("stats", "mmio", FALSE))
+		return 0;
+
+	stats = machine->mmio_stats = calloc(1, sizeof(struct mmio_stats));
+	stats->locked = locked;
+	clock_gettime(CLOCK_MONOTONIC, &stats->start_time);
+	stats->start_ticks = mmio_ticks();
+
+	return 0;
+}
+
+void destroy_mmio_stats(void)
+{
+	struct mmio_stats *stats = machine->mmio_stats;
+
+	if (!stats)
+		return;
+
+	while (stats->regions) {
+		struct mmio_region_stats *r = stats->regions;
+
+		stats->regions = r->next;
+		free(r);
+	}
+	free(stats);
+	machine->mmio_stats = NULL;
+}
@@ -20,6 +20,7 @@
  * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
+#define _GNU_SOURCE // ppoll
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -42,25 +43,77 @@
 /* tuntap stuff */
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/eventfd.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 
 #define PACKET_LEN 2048
 #define PACKET_QUEUE_LEN 32	/* must be power of 2 */
+#define NET_MAX_QUEUES 8	/* tap queues, with network.queues */
+#define NET_RX_BATCH 64		/* most packets taken off a tap queue at a time */
 
-static struct network {
-	int fd;
+/*
+ * the queues between the cpu and the network thread each have one side putting things
+ * in and the other taking them out, so they go without locks. a slot is published with
+ * a release store of the index past it, and the other side picks that up with an
+ * acquire load before it touches the slot. handing a slot back works the same way.
+ */
 
-	int head;
-	int tail;
+struct network {
+	int fd[NET_MAX_QUEUES];
+	int num_queues;
+	int wake_fd; // an eventfd, to get the thread out of poll()
 
-	uint out_packet_len;
-	uint8_t out_packet[PACKET_LEN];
+	// the thread sleeping in poll(), and doing it with nowhere to put a packet
+	int asleep;
+	int no_room;
+
+	// received packets for the register interface, the thread moves head and the guest tail
+	uint head;
+	uint tail;
 	uint in_packet_len[PACKET_QUEUE_LEN];
 	uint8_t in_packet[PACKET_QUEUE_LEN][PACKET_LEN];
-} *network;
 
-static word buffer_read(const void *_ptr, uint offset, int size)
+	// packets to send from the register interface, the cpu moves tx_head and the thread tx_tail
+	uint out_packet_len;
+	uint8_t out_packet[PACKET_LEN];
+	uint tx_head;
+	uint tx_tail;
+	uint tx_len[PACKET_QUEUE_LEN];
+	uint8_t tx_packet[PACKET_QUEUE_LEN][PACKET_LEN];
+
+	// descriptor rings, see rx_ring_packet() and network_tx()
+	armaddr_t rx_ring_addr;
+	uint rx_ring_len;
+	uint rx_head;
+	uint rx_done;
+	armaddr_t tx_ring_addr;
+	uint tx_ring_len;
+	uint tx_done;
+	uint8_t rx_bounce[PACKET_LEN];
+	uint8_t tx_bounce[PACKET_LEN];
+
+	// interrupt coalescing, pending is how many packets the guest hasn't been told about
+	uint coalesce_packets;
+	uint coalesce_usecs;
+	uint pending;
+	uint64_t deadline;
+
+	// counted by the thread, but for tx_stalls
+	uint rx_packets;
+	uint rx_overruns; // times the guest had nowhere left to put packets
+	uint tx_packets;
+	uint tx_errors;
+	uint tx_stalls; // times a send had to wait for the queue to empty out
+
+	SDL_Thread *thread;
+	volatile bool stopping;
+};
+
+static inline __ALWAYS_INLINE word buffer_read(const void *_ptr, uint offset, int size)
 {
 	const uint8_t *ptr = (const uint8_t *)_ptr;
 
@@ -78,7 +131,7 @@ static word buffer_read(const void *_ptr, uint offset, int size)
 	}
 }
 
-static word buffer_write(void *_ptr, uint offset, word data, int size)
+static inline __ALWAYS_INLINE void buffer_write(void *_ptr, uint offset, word data, int size)
 {
 	uint8_t *ptr = (uint8_t *)_ptr;
 
@@ -94,89 +147,445 @@ static word buffer_write(void *_ptr, uint offset, word data, int size)
 			*(uint32_t *)&ptr[offset] = data;
 			break;
 	}
+}
+
+/* copy between buf and guest memory, as far as it's contiguous at a time */
+static void dma_copy(armaddr_t address, void *buf, size_t len, bool to_guest)
+{
+	while (len > 0) {
+		size_t chunk;
+		byte *ptr = sys_dma_map(address, len, &chunk);
+
+		if (!ptr) {
+			chunk = 1;
+			if (to_guest)
+				sys_write_mem_byte(address, *(byte *)buf);
+			else
+				*(byte *)buf = sys_read_mem_byte(address);
+		} else if (to_guest) {
+			memcpy(ptr, buf, chunk);
+		} else {
+			memcpy(buf, ptr, chunk);
+		}
+
+		buf = (byte *)buf + chunk;
+		address += chunk;
+		len -= chunk;
+	}
+}
+
+/* get the thread out of poll() if it's asleep, or if it has to be waiting on room for packets */
+static void network_kick(struct network *network, bool room)
+{
+	uint64_t one = 1;
 
-	return data;
+	// whatever was just handed over has to be visible before the flags are looked at
+	atomic_fence();
+	if (atomic_load_relaxed(room ? &network->no_room : &network->asleep))
+		write(network->wake_fd, &one, sizeof(one));
 }
 
-static word network_regs_get_put(armaddr_t address, word data, int size, int put)
+/* queue up what's in the out buffer for the thread to send */
+static void network_send(struct network *network)
 {
-	word val;
-	uint offset;
+	uint head = network->tx_head;
+	uint slot = head % PACKET_QUEUE_LEN;
+
+	while (head - atomic_load_acquire(&network->tx_tail) == PACKET_QUEUE_LEN) {
+		network->tx_stalls++;
+		network_kick(network, FALSE);
+		sched_yield();
+	}
 
-	SYS_TRACE(5, "sys: network_regs_get_put at 0x%08x, data 0x%08x, size %d, put %d\n", 
-		address, data, size, put);
+	memcpy(network->tx_packet[slot], network->out_packet, network->out_packet_len);
+	network->tx_len[slot] = network->out_packet_len;
+	atomic_store_release(&network->tx_head, head + 1);
+
+	network_kick(network, FALSE);
+}
+
+/*
+ * send the descriptors the guest has filled in, up to head. a buffer in one piece goes
+ * to the tap as it is, anything else is gathered up first. it's done before the write
+ * to NET_TX_HEAD finishes, so there's nothing to raise an interrupt about.
+ */
+static void network_tx(struct network *network, uint head)
+{
+	if (network->tx_ring_len == 0)
+		return;
+
+	while (network->tx_done != head) {
+		armaddr_t desc = network->tx_ring_addr + (network->tx_done & (network->tx_ring_len - 1)) * NET_DESC_SIZE;
+		armaddr_t addr = sys_read_mem_word(desc + NET_DESC_ADDR);
+		uint len = sys_read_mem_word(desc + NET_DESC_LEN);
+		word flags = NET_DESC_DONE;
+		size_t chunk;
+		void *ptr = sys_dma_map(addr, len, &chunk);
+
+		SYS_TRACE(5, "sys: network tx descriptor %u, addr 0x%08x, len %u\n", network->tx_done, addr, len);
+
+		if (!ptr || chunk < len) {
+			ptr = network->tx_bounce;
+			if (len > PACKET_LEN)
+				len = 0;
+			else
+				dma_copy(addr, ptr, len, FALSE);
+		}
+		if (len == 0 || write(network->fd[0], ptr, len) != (ssize_t)len)
+			flags |= NET_DESC_ERR;
+
+		sys_write_mem_word(desc + NET_DESC_FLAGS, flags);
+		network->tx_done++;
+	}
+}
+
+/* the registers don't care about the size of an access, the buffers do. size is a constant in each handler below */
+static inline __ALWAYS_INLINE word network_regs_read(struct network *network, armaddr_t address, int size)
+{
+	SYS_TRACE(5, "sys: network_regs_read at 0x%08x, size %d\n", address, size);
 
 	switch (address) {
 		case NET_HEAD:
-			/* head is read/only */
-			val = network->head;
+			return atomic_load_acquire(&network->head);
+		case NET_TAIL:
+			return network->tail;
+		case NET_SEND:
+			return 0;
+		case NET_SEND_LEN:
+			return network->out_packet_len;
+		case NET_IN_BUF_LEN:
+			return network->in_packet_len[network->tail];
+		case NET_RX_RING_ADDR:
+			return network->rx_ring_addr;
+		case NET_RX_RING_LEN:
+			return network->rx_ring_len;
+		case NET_RX_HEAD:
+			return network->rx_head;
+		case NET_RX_DONE:
+			return atomic_load_acquire(&network->rx_done);
+		case NET_RX_OVERRUNS:
+			return network->rx_overruns;
+		case NET_TX_RING_ADDR:
+			return network->tx_ring_addr;
+		case NET_TX_RING_LEN:
+			return network->tx_ring_len;
+		case NET_TX_HEAD:
+		case NET_TX_DONE:
+			return network->tx_done;
+		case NET_INT_ACK:
+			return 0;
+		case NET_COALESCE_PACKETS:
+			return network->coalesce_packets;
+		case NET_COALESCE_USECS:
+			return network->coalesce_usecs;
+		case NET_OUT_BUF...(NET_OUT_BUF + NET_BUF_LEN - 1):
+			return buffer_read(network->out_packet, address - NET_OUT_BUF, size);
+		case NET_IN_BUF...(NET_IN_BUF + NET_BUF_LEN - 1):
+			return buffer_read(network->in_packet[network->tail], address - NET_IN_BUF, size);
+		default:
+			SYS_TRACE(0, "sys: unhandled network address 0x%08x\n", address);
+			return 0;
+	}
+}
+
+static inline __ALWAYS_INLINE void network_regs_write(struct network *network, armaddr_t address, word data, int size)
+{
+	SYS_TRACE(5, "sys: network_regs_write at 0x%08x, data 0x%08x, size %d\n", address, data, size);
+
+	switch (address) {
+		case NET_HEAD:
+		case NET_IN_BUF_LEN:
+			/* read/only */
 			break;
 		case NET_TAIL:
-			if (put) {
-				network->tail = data % PACKET_QUEUE_LEN;
-				if (network->head == network->tail) {
-					pic_deassert_level(INT_NET);
-				}
+			atomic_store_release(&network->tail, data % PACKET_QUEUE_LEN);
+			if (atomic_load_acquire(&network->head) == network->tail) {
+				pic_deassert_level(INT_NET);
+				// one may have come in right before it went down
+				if (atomic_load_acquire(&network->head) != network->tail)
+					pic_assert_level(INT_NET);
 			}
-			val = network->tail;
+			network_kick(network, TRUE);
 			break;
 		case NET_SEND:
-			if (put) {
-				write(network->fd, network->out_packet, network->out_packet_len);
-			}
-			val = 0;
+			network_send(network);
 			break;
 		case NET_SEND_LEN:
-			if (put) {
-				network->out_packet_len = data % PACKET_LEN;
-			}
-			val = network->out_packet_len;
+			network->out_packet_len = data % PACKET_LEN;
 			break;
-		case NET_IN_BUF_LEN:
+		case NET_RX_DONE:
+		case NET_TX_DONE:
+		case NET_RX_OVERRUNS:
 			/* read/only */
-			val = network->in_packet_len[network->tail];
+			break;
+		case NET_RX_RING_ADDR:
+			network->rx_ring_addr = data;
+			break;
+		case NET_RX_RING_LEN:
+			/* has to be a power of 2 */
+			network->rx_ring_len = (data & (data - 1)) ? 0 : data;
+			break;
+		case NET_RX_HEAD:
+			atomic_store_release(&network->rx_head, data);
+			network_kick(network, TRUE);
+			break;
+		case NET_TX_RING_ADDR:
+			network->tx_ring_addr = data;
+			break;
+		case NET_TX_RING_LEN:
+			network->tx_ring_len = (data & (data - 1)) ? 0 : data;
+			break;
+		case NET_TX_HEAD:
+			network_tx(network, data);
+			break;
+		case NET_INT_ACK:
+			if (data)
+				pic_deassert_level(INT_NET);
+			break;
+		case NET_COALESCE_PACKETS:
+			network->coalesce_packets = data;
+			break;
+		case NET_COALESCE_USECS:
+			network->coalesce_usecs = data;
 			break;
 		case NET_OUT_BUF...(NET_OUT_BUF + NET_BUF_LEN - 1):
-			offset = address - NET_OUT_BUF;
-			if (put) {
-				val = buffer_write(network->out_packet, offset, data, size);
-			} else {
-				val = buffer_read(network->out_packet, offset, size);
-			}
+			buffer_write(network->out_packet, address - NET_OUT_BUF, data, size);
 			break;
 		case NET_IN_BUF...(NET_IN_BUF + NET_BUF_LEN - 1):
-			offset = address - NET_IN_BUF;
-
 			/* in buffers are read/only */
-			val = buffer_read(network->in_packet[network->tail], offset, size);
 			break;
 		default:
 			SYS_TRACE(0, "sys: unhandled network address 0x%08x\n", address);
-			return 0;
+			break;
+	}
+}
+
+static word network_regs_read_word(void *ctx, armaddr_t address)
+{
+	return network_regs_read(ctx, address, 4);
+}
+
+static halfword network_regs_read_halfword(void *ctx, armaddr_t address)
+{
+	return network_regs_read(ctx, address, 2);
+}
+
+static byte network_regs_read_byte(void *ctx, armaddr_t address)
+{
+	return network_regs_read(ctx, address, 1);
+}
+
+static void network_regs_write_word(void *ctx, armaddr_t address, word data)
+{
+	network_regs_write(ctx, address, data, 4);
+}
+
+static void network_regs_write_halfword(void *ctx, armaddr_t address, halfword data)
+{
+	network_regs_write(ctx, address, data, 2);
+}
+
+static void network_regs_write_byte(void *ctx, armaddr_t address, byte data)
+{
+	network_regs_write(ctx, address, data, 1);
+}
+
+static const struct mem_handler network_regs_handler = {
+	.read_word = &network_regs_read_word,
+	.read_halfword = &network_regs_read_halfword,
+	.read_byte = &network_regs_read_byte,
+	.write_word = &network_regs_write_word,
+	.write_halfword = &network_regs_write_halfword,
+	.write_byte = &network_regs_write_byte,
+};
+
+static uint64_t now_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void rx_signal(struct network *network)
+{
+	network->pending = 0;
+	pic_assert_level(INT_NET);
+}
+
+/* somewhere to put another packet, in the rx ring if it's set up or the register interface's queue */
+static bool rx_room(struct network *network)
+{
+	if (network->rx_ring_len)
+		return network->rx_done != atomic_load_acquire(&network->rx_head);
+	return (network->head + 1) % PACKET_QUEUE_LEN != atomic_load_acquire(&network->tail);
+}
+
+/* read a packet from fd into the buffer of the next rx descriptor, FALSE if there wasn't one */
+static bool rx_ring_packet(struct network *network, int fd)
+{
+	armaddr_t desc = network->rx_ring_addr + (network->rx_done & (network->rx_ring_len - 1)) * NET_DESC_SIZE;
+	armaddr_t addr = sys_read_mem_word(desc + NET_DESC_ADDR);
+	uint size = sys_read_mem_word(desc + NET_DESC_LEN);
+	word flags = NET_DESC_DONE;
+	size_t chunk;
+	void *ptr = sys_dma_map(addr, size, &chunk);
+	ssize_t len;
+
+	if (ptr && chunk == size && size >= PACKET_LEN) {
+		len = read(fd, ptr, size);
+	} else {
+		// in pieces, or small enough that a packet could be cut short without anyone knowing
+		len = read(fd, network->rx_bounce, PACKET_LEN);
+		if (len > (ssize_t)size) {
+			len = size;
+			flags |= NET_DESC_ERR;
+		}
+		if (len > 0)
+			dma_copy(addr, network->rx_bounce, len, TRUE);
 	}
+	if (len <= 0)
+		return FALSE;
+
+	SYS_TRACE(2, "sys: network rx descriptor %u, size %zd\n", network->rx_done, len);
+
+	sys_write_mem_word(desc + NET_DESC_LEN, len);
+	sys_write_mem_word(desc + NET_DESC_FLAGS, flags);
+	atomic_store_release(&network->rx_done, network->rx_done + 1);
 
-	return val;
+	if (network->pending++ == 0)
+		network->deadline = now_usecs() + network->coalesce_usecs;
+	return TRUE;
 }
 
+/* take what's waiting on a tap queue, up to a batch, for as long as there's room for it */
+static int rx_drain(struct network *network, int fd)
+{
+	int count;
+
+	for (count = 0; count < NET_RX_BATCH; count++) {
+		if (!rx_room(network)) {
+			network->rx_overruns++;
+			break;
+		}
+
+		if (network->rx_ring_len) {
+			if (!rx_ring_packet(network, fd))
+				break;
+		} else {
+			uint head = network->head;
+			ssize_t len = read(fd, network->in_packet[head], PACKET_LEN);
+
+			if (len <= 0)
+				break;
+
+			SYS_TRACE(2, "sys: got network data, size %d, head %d, tail %d\n", len, head, network->tail);
+
+			network->in_packet_len[head] = len;
+			atomic_store_release(&network->head, (head + 1) % PACKET_QUEUE_LEN);
+		}
+	}
+
+	network->rx_packets += count;
+	return count;
+}
+
+/* send what the register interface has queued up */
+static void tx_drain(struct network *network)
+{
+	uint head = atomic_load_acquire(&network->tx_head);
+
+	while (network->tx_tail != head) {
+		uint slot = network->tx_tail % PACKET_QUEUE_LEN;
+
+		if (write(network->fd[0], network->tx_packet[slot], network->tx_len[slot]) < 0)
+			network->tx_errors++;
+		else
+			network->tx_packets++;
+
+		atomic_store_release(&network->tx_tail, network->tx_tail + 1);
+	}
+}
+
+/*
+ * the thread sleeps in one poll() on every tap queue and the wakeup eventfd, and takes
+ * everything that's ready each time it wakes up. the tap queues are left out while
+ * there's nowhere to put a packet, they hold on to them until the guest makes room.
+ *
+ * with the rx ring, INT_NET goes up once coalesce_packets packets are in, coalesce_usecs
+ * after the first of them, or when the ring has run out of buffers, whichever is first.
+ * the register interface raises it each time something comes in, as it always has.
+ */
 static int network_thread(void *args)
 {
-	for (;;) {
-		ssize_t ret;
-		ret = read(network->fd, network->in_packet[network->head], PACKET_LEN);
-		if (ret > 0) {
-			SYS_TRACE(2, "sys: got network data, size %d, head %d, tail %d\n", ret, network->head, network->tail);
+	struct network *network;
+
+	machine_enter((struct machine *)args);
+	network = machine->network;
+
+	while (!network->stopping) {
+		struct pollfd pfd[NET_MAX_QUEUES + 1];
+		struct timespec ts;
+		uint64_t now, wait = 100000;
+		bool room;
+		int received = 0;
+		int i, n = 0;
+
+		if (network->pending) {
+			now = now_usecs();
+			wait = network->deadline > now ? network->deadline - now : 0;
+		}
 
-			network->in_packet_len[network->head] = ret;
+		// the flags go up before looking, so whatever's handed over meanwhile comes with a kick.
+		// the fence pairs with the one in network_kick()
+		atomic_store_relaxed(&network->asleep, TRUE);
+		atomic_store_relaxed(&network->no_room, TRUE);
+		atomic_fence();
+		room = rx_room(network);
+		if (room)
+			atomic_store_relaxed(&network->no_room, FALSE);
+		if (network->tx_tail != atomic_load_acquire(&network->tx_head))
+			wait = 0;
+
+		pfd[n++] = (struct pollfd){ network->wake_fd, POLLIN, 0 };
+		for (i = 0; room && i < network->num_queues; i++)
+			pfd[n++] = (struct pollfd){ network->fd[i], POLLIN, 0 };
+
+		ts.tv_sec = wait / 1000000;
+		ts.tv_nsec = (wait % 1000000) * 1000;
+		ppoll(pfd, n, &ts, NULL);
+
+		atomic_store_relaxed(&network->asleep, FALSE);
+		atomic_store_relaxed(&network->no_room, FALSE);
+
+		if (pfd[0].revents & POLLIN) {
+			uint64_t count;
+
+			read(network->wake_fd, &count, sizeof(count));
+		}
+
+		tx_drain(network);
+
+		for (i = 1; i < n; i++) {
+			if (pfd[i].revents & POLLIN)
+				received += rx_drain(network, pfd[i].fd);
+		}
 
-			network->head = (network->head + 1) % PACKET_QUEUE_LEN;
-			pic_assert_level(INT_NET);
+		if (!network->rx_ring_len) {
+			if (received)
+				pic_assert_level(INT_NET);
+		} else if (network->pending) {
+			// the guest is behind if it's out of buffers, no use holding anything back from it
+			if (network->pending >= network->coalesce_packets || !rx_room(network) ||
+					now_usecs() >= network->deadline)
+				rx_signal(network);
 		}
 	}
 
 	return 0;
 }
 
-static int open_tun(const char *dev)
+static int open_tun(const char *dev, bool multi_queue)
 {
 	struct ifreq ifr;
 	int fd, err;
@@ -194,7 +603,7 @@ static int open_tun(const char *dev)
 	*
 	*        IFF_NO_PI - Do not provide packet information
 	*/
-	ifr.ifr_flags = IFF_TAP;
+	ifr.ifr_flags = IFF_TAP | (multi_queue ? IFF_MULTI_QUEUE : 0);
 	if( *dev )
 		strncpy(ifr.ifr_name, dev, IFNAMSIZ);
 
@@ -209,12 +618,16 @@ static int open_tun(const char *dev)
 int initialize_network(void)
 {
 #if WITH_TUNTAP
+	struct network *network;
 	const char *str;
 
-	network = calloc(sizeof(*network), 1);
+	network = machine->network = calloc(sizeof(*network), 1);
+	network->wake_fd = -1;
+	network->coalesce_packets = strtoul(get_config_key_string("network", "coalesce_packets", "8"), NULL, 0);
+	network->coalesce_usecs = strtoul(get_config_key_string("network", "coalesce_usecs", "50"), NULL, 0);
 
 	// install the network register handlers
-	install_mem_handler(NET_REGS_BASE, NET_REGS_SIZE, &network_regs_get_put, NULL);
+	install_mem_handler(NET_REGS_BASE, NET_REGS_SIZE, &network_regs_handler, network);
 
 	// try to intialize the tun/tap interface
 	str = get_config_key_string("network", "device", NULL);
@@ -223,17 +636,64 @@ int initialize_network(void)
 		exit(1);
 	}
 
-	// try to open the device
-	network->fd = open_tun(str);
-	if (network->fd < 0) {
-		SYS_TRACE(0, "sys: failed to open tun/tap interface at '%s'\n", str);
-		exit(1);
+	// try to open the device, a descriptor per queue. they're drained a batch at a time so they can't block
+	network->num_queues = strtoul(get_config_key_string("network", "queues", "1"), NULL, 0);
+	network->num_queues = MAX(1, MIN(network->num_queues, NET_MAX_QUEUES));
+	int i;
+	for (i = 0; i < network->num_queues; i++) {
+		network->fd[i] = open_tun(str, network->num_queues > 1);
+		if (network->fd[i] < 0) {
+			SYS_TRACE(0, "sys: failed to open tun/tap interface at '%s'\n", str);
+			exit(1);
+		}
+		fcntl(network->fd[i], F_SETFL, fcntl(network->fd[i], F_GETFL) | O_NONBLOCK);
 	}
 
+	network->wake_fd = eventfd(0, EFD_NONBLOCK);
+
 	// start a network reader/writer thread
-	SDL_CreateThread(&network_thread, NULL);
+	network->thread = SDL_CreateThread(&network_thread, machine);
 #endif
 
 	return 0;		
 }
 
+void stop_network(void)
+{
+#if WITH_TUNTAP
+	struct network *network = machine->network;
+
+	if (!network || !network->thread)
+		return;
+
+	network->stopping = TRUE;
+	atomic_store_relaxed(&network->asleep, TRUE);
+	network_kick(network, FALSE);
+	SDL_WaitThread(network->thread, NULL);
+	network->thread = NULL;
+#endif
+}
+
+void destroy_network(void)
+{
+#if WITH_TUNTAP
+	struct network *network = machine->network;
+
+	if (!network)
+		return;
+
+	SYS_TRACE(1, "sys: network %u packets in, %u overruns, %u packets out, %u errors, %u stalls\n",
+		network->rx_packets, network->rx_overruns, network->tx_packets, network->tx_errors, network->tx_stalls);
+
+	int i;
+	for (i = 0; i < network->num_queues; i++) {
+		if (network->fd[i] >= 0)
+			close(network->fd[i]);
+	}
+	if (network->wake_fd >= 0)
+		close(network->wake_fd);
+	free(network);
+	machine->network = NULL;
+#endif
+}
+
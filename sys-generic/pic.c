@@ -25,123 +25,148 @@
 #include <string.h>
 #include <sys/types.h>
 
-#include <SDL/SDL.h>
-#include <SDL/SDL_thread.h>
-
 #include <arm/arm.h>
 #include <sys/sys.h>
+#include <sys/snapshot.h>
+#include <util/atomic.h>
 #include <util/endian.h>
 #include "sys_p.h"
 
-static struct pic {
-	SDL_mutex *mutex;
-	bool irq_active;
+/*
+ * the interrupt lines are shared, everything else is banked per core. each core
+ * sees its own mask and its own inter-processor interrupt through the same registers.
+ *
+ * there's no lock. the state is a handful of words changed with atomic ops, from the
+ * device threads and from whichever core touches the registers, and a core's irq line
+ * is its EX_IRQ bit, worked out from them. whoever moves the line looks at the state
+ * again afterwards and goes round until what they set still holds, so whichever update
+ * lands last leaves the line right. that needs every thread to see the state and the
+ * lines change in the same order, so they're full barrier atomics, but for the reads
+ * nothing hangs off.
+ */
+struct pic {
 	uint32_t vector_active;    // 1 if active
-	uint32_t vector_mask;      // 1 if the interrupt is masked
-} pic;
 
-/* set cpu irq status based off of current interrupt controller inputs */
-static void set_irq_status(void)
+	struct pic_core {
+		uint32_t ipi_pending;      // 1 << INT_IPI if there is one
+		uint32_t vector_mask;      // 1 if the interrupt is masked
+	} core[MAX_CPU_CORES];
+};
+
+static inline uint32_t ready_interrupts(struct pic *pic, int core)
 {
-	if (pic.vector_active & ~pic.vector_mask) {
-		if (!pic.irq_active)
-			raise_irq();
-		pic.irq_active = TRUE;
-	} else {
-		if (pic.irq_active)
-			lower_irq();
-		pic.irq_active = FALSE;
+	uint32_t active = atomic_load(&pic->vector_active) |
+		atomic_load(&pic->core[core].ipi_pending);
+
+	return active & ~atomic_load(&pic->core[core].vector_mask);
+}
+
+static void set_core_irq_status(struct pic *pic, int i)
+{
+	struct cpu_cluster *cluster = machine->cpu;
+	bool want = ready_interrupts(pic, i) != 0;
+
+	for (;;) {
+		bool raised = (atomic_load(&cluster->cores[i]->pending_exceptions) & EX_IRQ) != 0;
+
+		if (want && !raised)
+			raise_irq(cluster, i);
+		else if (!want && raised)
+			lower_irq(cluster, i);
+
+		bool now = ready_interrupts(pic, i) != 0;
+		if (now == want)
+			break;
+		want = now;
 	}
 }
 
-static int get_current_interrupt(void)
+/* set each core's irq status based off of current interrupt controller inputs */
+static void set_irq_status(struct pic *pic)
 {
+	struct cpu_cluster *cluster = machine->cpu;
 	int i;
 
-	uint32_t ready_ints = pic.vector_active & ~pic.vector_mask;
-	if (ready_ints == 0)
-		return -1;
+	for (i = 0; i < cluster->num_cores; i++) {
+		if (cluster->cores[i] == NULL)
+			continue; // not up yet, pic_cores_started() will catch it up
 
-	for (i=0; i < PIC_MAX_INT; i++) {
-		if (ready_ints & (1 << i))
-			return i;
+		set_core_irq_status(pic, i);
 	}
+}
+
+static int get_current_interrupt(struct pic *pic, int core)
+{
+	uint32_t ready_ints = ready_interrupts(pic, core);
 
-	return -1;
+	if (ready_ints == 0)
+		return -1;
+
+	return __builtin_ctz(ready_ints);
 }
 
 int pic_assert_level(int vector)
 {
+	struct pic *pic = machine->pic;
+
 	if(vector < 0 || vector >= PIC_MAX_INT)
 		return -1;
 
-	SDL_LockMutex(pic.mutex);
-
 	SYS_TRACE(5, "sys: pic_assert_level %d\n", vector);
 
-	pic.vector_active |= (1<<vector);
-	set_irq_status();
+	// already up, nothing to tell anyone
+	if (atomic_or(&pic->vector_active, 1U << vector) & (1U << vector))
+		return 0;
+	set_irq_status(pic);
 
-	SDL_UnlockMutex(pic.mutex);
+	// a core might be polling the device instead of taking the interrupt
+	cpu_wake_all(machine->cpu);
 
 	return 0;
 }
 
 int pic_deassert_level(int vector)
 {
+	struct pic *pic = machine->pic;
+
 	if(vector < 0 || vector >= PIC_MAX_INT)
 		return -1;
 
-	SDL_LockMutex(pic.mutex);
-
 	SYS_TRACE(5, "sys: pic_deassert_level %d\n", vector);
 
-	pic.vector_active &= ~(1<<vector);
-	set_irq_status();
-
-	SDL_UnlockMutex(pic.mutex);
+	if (!(atomic_and(&pic->vector_active, ~(1U << vector)) & (1U << vector)))
+		return 0;
+	set_irq_status(pic);
+	cpu_wake_all(machine->cpu);
 
 	return 0;
 }
 
-static word pic_regs_get_put(armaddr_t address, word data, int size, int put)
+static word pic_regs_read(void *ctx, armaddr_t address)
 {
+	struct pic *pic = ctx;
 	word val;
+	int core_id = get_core_id();
+	struct pic_core *core = &pic->core[core_id];
 
-	SYS_TRACE(5, "sys: pic_regs_get_put at 0x%08x, data 0x%08x, size %d, put %d\n", 
-		address, data, size, put);
-
-	if(size < 4)
-		return 0; /* only word accesses supported */
-
-	SDL_LockMutex(pic.mutex);
+	SYS_TRACE(5, "sys: pic_regs_read at 0x%08x, core %d\n", address, core_id);
 
 	switch(address) {
-		/* read/write to the current interrupt mask */
-	case PIC_MASK_LATCH: /* 1s are latched into the current mask */
-		data |= pic.vector_mask;
-		goto set_mask;
-	case PIC_UNMASK_LATCH: /* 1s are latched as 0s in the current mask */
-		data = pic.vector_mask & ~data;
-set_mask:
+		/* the current interrupt mask */
 	case PIC_MASK:
-		if(put) {
-			pic.vector_mask = data;
-			val = 0;
-			set_irq_status();
-		} else {
-			val = pic.vector_mask;
-		}
+	case PIC_MASK_LATCH:
+	case PIC_UNMASK_LATCH:
+		val = atomic_load_relaxed(&core->vector_mask);
 		break;
 
 		/* each bit corresponds to the current status of the interrupt line */
 	case PIC_STAT:
-		val = pic.vector_active;
+		val = atomic_load_relaxed(&pic->vector_active) | atomic_load_relaxed(&core->ipi_pending);
 		break;
 
 		/* one bit set for the highest priority non-masked active interrupt */
 	case PIC_CURRENT_BIT: {
-		int current_int = get_current_interrupt();
+		int current_int = get_current_interrupt(pic, core_id);
 
 		val = (current_int >= 0) ? (1 << current_int) : 0;
 		break;
@@ -149,31 +174,145 @@ set_mask:
 
 		/* holds the current interrupt number, check PIC_CURRENT_BIT to see if something is pending */
 	case PIC_CURRENT_NUM: {
-		int current_int = get_current_interrupt();
+		int current_int = get_current_interrupt(pic, core_id);
 		val = (current_int >= 0) ? (word)current_int : 0xffffffff;
 		break;
 	}
 
+	case PIC_CPU_ID:
+		val = core_id;
+		break;
+
+	case PIC_CPU_COUNT:
+		val = machine->cpu->num_cores;
+		break;
+
 	default:
 		val = 0;
 	}
 
-	SDL_UnlockMutex(pic.mutex);
-
 	return val;
 }
 
+static void pic_regs_write(void *ctx, armaddr_t address, word data)
+{
+	struct pic *pic = ctx;
+	int core_id = get_core_id();
+	struct pic_core *core = &pic->core[core_id];
+	int i;
+
+	SYS_TRACE(5, "sys: pic_regs_write at 0x%08x, data 0x%08x, core %d\n", address, data, core_id);
+
+	switch(address) {
+		/* write to the current interrupt mask, only this core ever does */
+	case PIC_MASK_LATCH: /* 1s are latched into the current mask */
+		data |= core->vector_mask;
+		goto set_mask;
+	case PIC_UNMASK_LATCH: /* 1s are latched as 0s in the current mask */
+		data = core->vector_mask & ~data;
+set_mask:
+	case PIC_MASK:
+		atomic_store(&core->vector_mask, data);
+		set_core_irq_status(pic, core_id);
+		break;
+
+		/* raise INT_IPI on every core with a bit set */
+	case PIC_IPI_SEND:
+		for(i = 0; i < machine->cpu->num_cores; i++) {
+			if(data & (1 << i))
+				atomic_store(&pic->core[i].ipi_pending, 1U << INT_IPI);
+		}
+		set_irq_status(pic);
+		break;
+
+	case PIC_IPI_CLEAR:
+		if(data) {
+			atomic_store(&core->ipi_pending, 0);
+			set_core_irq_status(pic, core_id);
+		}
+		break;
+	}
+}
+
+/* only word accesses are supported */
+static const struct mem_handler pic_regs_handler = {
+	.read_word = &pic_regs_read,
+	.write_word = &pic_regs_write,
+};
+
+/* the cores are up now, hand them anything that was asserted before they could take it */
+void pic_cores_started(void)
+{
+	struct pic *pic = machine->pic;
+
+	set_irq_status(pic);
+}
+
+struct pic_state {
+	uint32_t vector_active;
+	uint32_t ipi_pending[MAX_CPU_CORES];
+	uint32_t vector_mask[MAX_CPU_CORES];
+};
+
+void pic_save_state(struct snapshot *s)
+{
+	struct pic *pic = machine->pic;
+	struct pic_state state;
+	int i;
+
+	state.vector_active = atomic_load_relaxed(&pic->vector_active);
+	for (i = 0; i < MAX_CPU_CORES; i++) {
+		state.ipi_pending[i] = atomic_load_relaxed(&pic->core[i].ipi_pending);
+		state.vector_mask[i] = atomic_load_relaxed(&pic->core[i].vector_mask);
+	}
+	snapshot_put(s, SNAPSHOT_TAG_PIC, &state, sizeof(state));
+}
+
+/* before the cores are up, pic_cores_started() raises their irqs from it */
+int pic_restore_state(struct snapshot *s)
+{
+	struct pic *pic = machine->pic;
+	const struct pic_state *state = snapshot_get(s, SNAPSHOT_TAG_PIC, sizeof(struct pic_state));
+	int i;
+
+	if (!state)
+		return -1;
+
+	atomic_store_relaxed(&pic->vector_active, state->vector_active);
+	for (i = 0; i < MAX_CPU_CORES; i++) {
+		atomic_store_relaxed(&pic->core[i].ipi_pending, state->ipi_pending[i]);
+		atomic_store_relaxed(&pic->core[i].vector_mask, state->vector_mask[i]);
+	}
+
+	return 0;
+}
+
 int initialize_pic(void)
 {
-	memset(&pic, 0, sizeof(pic));
+	struct pic *pic;
+	int i;
+
+	pic = machine->pic = calloc(1, sizeof(struct pic));
 
-	// create a mutex to lock us
-	pic.mutex = SDL_CreateMutex();
+//	pic->vector_mask = 0xffffffff; /* everything starts out masked */
 
-//	pic.vector_mask = 0xffffffff; /* everything starts out masked */
+	// device interrupts go to the boot core, the others only take IPIs until they unmask something
+	for(i = 1; i < MAX_CPU_CORES; i++)
+		pic->core[i].vector_mask = ~(1U << INT_IPI);
 
 	// install the pic register handlers
-	install_mem_handler(PIC_REGS_BASE, PIC_REGS_SIZE, &pic_regs_get_put, NULL);
+	install_mem_handler(PIC_REGS_BASE, PIC_REGS_SIZE, &pic_regs_handler, pic);
 
 	return 0;
 }
+
+void destroy_pic(void)
+{
+	struct pic *pic = machine->pic;
+
+	if (!pic)
+		return;
+
+	free(pic);
+	machine->pic = NULL;
+}
@@ -28,120 +28,310 @@
 #include <SDL/SDL.h>
 #include <SDL/SDL_thread.h>
 
+#include <config.h>
 #include <arm/arm.h>
 #include <sys/sys.h>
+#include <sys/snapshot.h>
 #include <util/endian.h>
 #include "sys_p.h"
 
-static struct pit {
+struct pit {
 	SDL_mutex *mutex;
 	SDL_TimerID curr_timer;
 
+	// in virtual time mode the timer counts guest instructions on the core instead
+	bool virtual_time;
+	dword ins_per_ms;
+	struct cpu_event event;
+	bool event_active;
+	dword restore_remaining; // an event to put back on the boot core, from a snapshot
+
 	reg_t curr_interval;
 	bool periodic;
 	reg_t status;
-} pit;
+};
 
 static Uint32 pit_callback(Uint32 interval, void *param)
 {
+	struct pit *pit;
+
+	// the timer thread is shared by every machine
+	machine_enter((struct machine *)param);
+	pit = machine->pit;
+
 	SYS_TRACE(5, "pit_callback: interval %d\n", interval);
 
-	SDL_LockMutex(pit.mutex);
+	SDL_LockMutex(pit->mutex);
 
 	// make sure there is still an active timer
-	if (pit.curr_timer == NULL)
+	if (pit->curr_timer == NULL)
 		goto exit;
 
 	// level trigger an interrupt
-	pit.status |= PIT_STATUS_INT_PEND;
+	pit->status |= PIT_STATUS_INT_PEND;
 	pic_assert_level(INT_PIT);
 
-	if (!pit.periodic) {
+	if (!pit->periodic) {
 		// cancel the timer
-		SDL_RemoveTimer(pit.curr_timer);
-		pit.curr_timer = NULL;
-		pit.status &= ~PIT_STATUS_ACTIVE;
+		SDL_RemoveTimer(pit->curr_timer);
+		pit->curr_timer = NULL;
+		pit->status &= ~PIT_STATUS_ACTIVE;
 	}
 
   exit:
-	SDL_UnlockMutex(pit.mutex);
+	SDL_UnlockMutex(pit->mutex);
 
 	return interval;
 }
 
-static word pit_regs_get_put(armaddr_t address, word data, int size, int put)
+/* the interval in guest instructions, never 0 so a periodic timer can't keep the core from running */
+static dword pit_interval_ins(struct pit *pit)
 {
-	word val = 0;
+	dword ins = (dword)pit->curr_interval * pit->ins_per_ms;
+
+	return ins ? ins : 1;
+}
+
+/* virtual time expiry, runs on the core between blocks */
+static void pit_event(void *param)
+{
+	struct pit *pit = (struct pit *)param;
+
+	SYS_TRACE(5, "pit_event: guest time %lld\n", (long long)get_guest_time());
+
+	SDL_LockMutex(pit->mutex);
+
+	pit->status |= PIT_STATUS_INT_PEND;
+	pic_assert_level(INT_PIT);
+
+	if (pit->periodic) {
+		cpu_schedule_event(&pit->event, pit_interval_ins(pit), &pit_event, pit);
+	} else {
+		pit->event_active = FALSE;
+		pit->status &= ~PIT_STATUS_ACTIVE;
+	}
+
+	SDL_UnlockMutex(pit->mutex);
+}
+
+static void pit_start_timer(struct pit *pit)
+{
+	if (pit->virtual_time) {
+		cpu_schedule_event(&pit->event, pit_interval_ins(pit), &pit_event, pit);
+		pit->event_active = TRUE;
+	} else {
+		pit->curr_timer = SDL_AddTimer(pit->curr_interval, &pit_callback, machine);
+	}
+	pit->status |= PIT_STATUS_ACTIVE;
+}
+
+static void pit_cancel_timer(struct pit *pit)
+{
+	if (pit->event_active) {
+		cpu_cancel_event(&pit->event);
+		pit->event_active = FALSE;
+	}
+	if (pit->curr_timer != NULL) {
+		SDL_RemoveTimer(pit->curr_timer);
+		pit->curr_timer = NULL;
+	}
+	pit->status &= ~PIT_STATUS_ACTIVE;
+}
 
-	SYS_TRACE(5, "sys: pit_regs_get_put at 0x%08x, data 0x%08x, size %d, put %d\n", 
-		address, data, size, put);
+static word pit_regs_read(void *ctx, armaddr_t address)
+{
+	struct pit *pit = ctx;
+	word val = 0;
 
-	if(size < 4)
-		return 0; /* only word accesses supported */
+	SYS_TRACE(5, "sys: pit_regs_read at 0x%08x\n", address);
 
-	SDL_LockMutex(pit.mutex);
+	SDL_LockMutex(pit->mutex);
 
 	switch(address) {
 	case PIT_STATUS: // status bit
-		val = pit.status;
+		val = pit->status;
 		break;
 	case PIT_INTERVAL:
-		if (put && data != 0) {
-			pit.curr_interval = data;
-		}
-		val = pit.curr_interval;
+		val = pit->curr_interval;
 		break;
-	case PIT_START_ONESHOT:
-		if (put && data != 0) {
-			pit.periodic = FALSE;
-			goto set_timer;
-		}
+	}
+
+	SDL_UnlockMutex(pit->mutex);
+
+	return val;
+}
+
+static void pit_regs_write(void *ctx, armaddr_t address, word data)
+{
+	struct pit *pit = ctx;
+
+	SYS_TRACE(5, "sys: pit_regs_write at 0x%08x, data 0x%08x\n", address, data);
+
+	if (data == 0)
+		return; /* every register only acts on a nonzero write */
+
+	SDL_LockMutex(pit->mutex);
+
+	switch(address) {
+	case PIT_INTERVAL:
+		pit->curr_interval = data;
 		break;
+	case PIT_START_ONESHOT:
+		pit->periodic = FALSE;
+		goto set_timer;
 	case PIT_START_PERIODIC:
-		if (put && data != 0) {
-			pit.periodic = TRUE;
-			goto set_timer;
-		}
-		break;
+		pit->periodic = TRUE;
+		goto set_timer;
 
   set_timer:
 		// clear any old timer
-		if (pit.curr_timer != NULL) {
-			SDL_RemoveTimer(pit.curr_timer);
-			pit.curr_timer = NULL;
-		}
-		pit.curr_timer = SDL_AddTimer(pit.curr_interval, &pit_callback, NULL);
-		pit.status |= PIT_STATUS_ACTIVE;
+		pit_cancel_timer(pit);
+		pit_start_timer(pit);
 		break;
 	case PIT_CLEAR:
-		if (put && data != 0 && pit.curr_timer != NULL) {
-			SDL_RemoveTimer(pit.curr_timer);
-			pit.curr_timer = NULL;
-			pit.status &= ~PIT_STATUS_ACTIVE;
-		}
+		pit_cancel_timer(pit);
 		break;
 	case PIT_CLEAR_INT:
-		if (put && data != 0) {
-			pit.status &= ~PIT_STATUS_INT_PEND;
-			pic_deassert_level(INT_PIT);
-		}
+		pit->status &= ~PIT_STATUS_INT_PEND;
+		pic_deassert_level(INT_PIT);
 		break;
 	}
 
-	SDL_UnlockMutex(pit.mutex);
+	SDL_UnlockMutex(pit->mutex);
+}
 
-	return val;
+/* only word accesses are supported */
+static const struct mem_handler pit_regs_handler = {
+	.read_word = &pit_regs_read,
+	.write_word = &pit_regs_write,
+};
+
+struct pit_state {
+	uint32_t curr_interval;
+	uint32_t periodic;
+	uint32_t status;
+	uint32_t pad;
+	uint64_t remaining; // virtual time: instructions until it goes off
+};
+
+/* with the cores stopped, so a virtual time event isn't going anywhere */
+void pit_save_state(struct snapshot *s)
+{
+	struct pit *pit = machine->pit;
+	struct pit_state state;
+
+	SDL_LockMutex(pit->mutex);
+	memset(&state, 0, sizeof(state));
+	state.curr_interval = pit->curr_interval;
+	state.periodic = pit->periodic;
+	state.status = pit->status;
+	if (pit->event_active) {
+		dword now = machine->cpu->cores[0]->guest_time;
+
+		state.remaining = pit->event.when > now ? pit->event.when - now : 1;
+	}
+	SDL_UnlockMutex(pit->mutex);
+
+	snapshot_put(s, SNAPSHOT_TAG_PIT, &state, sizeof(state));
+}
+
+/*
+ * a running timer starts over on the host clock with a whole interval, in virtual time
+ * it's the boot core's to schedule once it's up, see pit_restore_events()
+ */
+int pit_restore_state(struct snapshot *s)
+{
+	struct pit *pit = machine->pit;
+	const struct pit_state *state = snapshot_get(s, SNAPSHOT_TAG_PIT, sizeof(struct pit_state));
+
+	if (!state)
+		return -1;
+
+	SDL_LockMutex(pit->mutex);
+	pit->curr_interval = state->curr_interval;
+	pit->periodic = state->periodic;
+	pit->status = state->status & ~PIT_STATUS_ACTIVE;
+	pit->restore_remaining = 0;
+	if (state->status & PIT_STATUS_ACTIVE) {
+		if (pit->virtual_time)
+			pit->restore_remaining = state->remaining ? state->remaining : pit_interval_ins(pit);
+		else
+			pit_start_timer(pit);
+		pit->status |= PIT_STATUS_ACTIVE;
+	}
+	SDL_UnlockMutex(pit->mutex);
+
+	return 0;
+}
+
+/* on the boot core as it comes up from a snapshot */
+void pit_restore_events(void)
+{
+	struct pit *pit = machine->pit;
+
+	SDL_LockMutex(pit->mutex);
+	if (pit->restore_remaining) {
+		cpu_schedule_event(&pit->event, pit->restore_remaining, &pit_event, pit);
+		pit->event_active = TRUE;
+		pit->restore_remaining = 0;
+	}
+	SDL_UnlockMutex(pit->mutex);
 }
 
 int initialize_pit(void)
 {
-	memset(&pit, 0, sizeof(pit));
+	struct pit *pit;
+
+	pit = machine->pit = calloc(1, sizeof(struct pit));
 
 	// create a mutex to lock us
-	pit.mutex = SDL_CreateMutex();
+	pit->mutex = SDL_CreateMutex();
+
+	/*
+	 * virtual time runs the timer off the guest time of the core that programs
+	 * it, so it's only deterministic, and only safe, on a single core machine
+	 */
+	pit->virtual_time = get_config_key_bool("pit", "virtual_time", FALSE);
+	pit->ins_per_ms = atoi(get_config_key_string("pit", "mips", "100")) * 1000;
+	if (pit->virtual_time && machine->cpu->num_cores > 1) {
+		printf("pit: virtual time needs a single core, using the host clock\n");
+		pit->virtual_time = FALSE;
+	}
 
 	// install the pic register handlers
-	install_mem_handler(PIT_REGS_BASE, PIT_REGS_SIZE, &pit_regs_get_put, NULL);
+	install_mem_handler(PIT_REGS_BASE, PIT_REGS_SIZE, &pit_regs_handler, pit);
 
 	return 0;
 }
+
+/*
+ * cancel any running timer, so it can't interrupt the cores on the way down.
+ * a virtual time event is on a core's own list, it goes away with the core.
+ */
+void stop_pit(void)
+{
+	struct pit *pit = machine->pit;
+
+	if (!pit)
+		return;
+
+	SDL_LockMutex(pit->mutex);
+	if (pit->curr_timer != NULL) {
+		SDL_RemoveTimer(pit->curr_timer);
+		pit->curr_timer = NULL;
+		pit->status &= ~PIT_STATUS_ACTIVE;
+	}
+	SDL_UnlockMutex(pit->mutex);
+}
+
+void destroy_pit(void)
+{
+	struct pit *pit = machine->pit;
+
+	if (!pit)
+		return;
+
+	SDL_DestroyMutex(pit->mutex);
+	free(pit);
+	machine->pit = NULL;
+}
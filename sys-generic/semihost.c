@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <SDL/SDL.h>
+
+#include <config.h>
+#include <arm/arm.h>
+#include <arm/mmu.h>
+#include <sys/sys.h>
+#include <sys/semihost.h>
+#include <util/atomic.h>
+#include "sys_p.h"
+
+/* what's being asked, in r0 */
+#define SYS_OPEN		0x01
+#define SYS_CLOSE		0x02
+#define SYS_WRITEC		0x03
+#define SYS_WRITE0		0x04
+#define SYS_WRITE		0x05
+#define SYS_READ		0x06
+#define SYS_ISTTY		0x09
+#define SYS_SEEK		0x0a
+#define SYS_FLEN		0x0c
+#define SYS_CLOCK		0x10
+#define SYS_ERRNO		0x13
+#define SYS_EXIT		0x18
+#define SYS_EXIT_EXTENDED	0x20
+
+#define ADP_STOPPED_APPLICATION_EXIT	0x20026
+
+#define SEMIHOST_MAX_FILES	64
+#define SEMIHOST_BOUNCE		256 // bytes going through the mmu's accessors at a time
+
+struct semihost_file {
+	int fd; // -1 if the slot is free
+	bool console; // ":tt", fd is the host's stdin, stdout or stderr
+};
+
+struct semihost {
+	SDL_mutex *lock; // the cores share the file table
+	struct semihost_file files[SEMIHOST_MAX_FILES];
+	int err; // for SYS_ERRNO, from the last call that failed
+	struct timespec start; // SYS_CLOCK counts from here
+};
+
+/* the open modes, as fopen's "r", "rb", "r+", "r+b", "w", "wb" and so on */
+static const int open_flags[] = {
+	O_RDONLY, O_RDONLY, O_RDWR, O_RDWR,
+	O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_TRUNC, O_RDWR | O_CREAT | O_TRUNC, O_RDWR | O_CREAT | O_TRUNC,
+	O_WRONLY | O_CREAT | O_APPEND, O_WRONLY | O_CREAT | O_APPEND, O_RDWR | O_CREAT | O_APPEND, O_RDWR | O_CREAT | O_APPEND,
+};
+
+/*
+ * the guest's memory is gone through as the instruction making the call would, but
+ * a bad pointer fails the call instead of aborting. the abort the access raised is
+ * taken back out, the mmu's fault registers are left as they are.
+ */
+static void drop_abort(struct semihost *s)
+{
+	atomic_and_relaxed(&cpu.pending_exceptions, ~EX_DATA_ABT);
+	s->err = EFAULT;
+}
+
+/* the call's argument block, TRUE if it isn't there */
+static bool read_args(struct semihost *s, armaddr_t address, word *args, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (mmu_read_mem_word(address + i * 4, &args[i])) {
+			drop_abort(s);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* len bytes of guest memory into buf, TRUE if some of it isn't there */
+static bool copy_from_guest(struct semihost *s, void *buf, armaddr_t address, size_t len)
+{
+	while (len > 0) {
+		size_t chunk = len;
+		const void *ptr = mmu_get_data_run(address, &chunk, FALSE);
+
+		if (ptr) {
+			memcpy(buf, ptr, chunk);
+		} else {
+			chunk = 1;
+			if (mmu_read_mem_byte(address, buf)) {
+				drop_abort(s);
+				return TRUE;
+			}
+		}
+		buf = (byte *)buf + chunk;
+		address += chunk;
+		len -= chunk;
+	}
+	return FALSE;
+}
+
+static struct semihost_file *get_file(struct semihost *s, word handle)
+{
+	if (handle < 1 || handle > SEMIHOST_MAX_FILES || s->files[handle - 1].fd < 0) {
+		s->err = EBADF;
+		return NULL;
+	}
+	return &s->files[handle - 1];
+}
+
+static ssize_t file_write(struct semihost_file *f, const void *buf, size_t len)
+{
+	if (f->console && f->fd == STDOUT_FILENO) {
+		debug_console_write(buf, len);
+		return len;
+	}
+	if (f->console && f->fd == STDERR_FILENO)
+		flush_debug(); // keep it in order with what's gone to the debug console
+
+	return write(f->fd, buf, len);
+}
+
+/* guest memory out to a file, returns how much of it didn't go */
+static size_t write_from_guest(struct semihost *s, struct semihost_file *f, armaddr_t address, size_t len)
+{
+	byte bounce[SEMIHOST_BOUNCE];
+
+	while (len > 0) {
+		size_t chunk = len;
+		const void *ptr = mmu_get_data_run(address, &chunk, FALSE);
+		ssize_t n;
+
+		if (!ptr) {
+			// not plain memory, or not translated yet, a little at a time through the mmu
+			size_t i;
+
+			if (chunk > sizeof(bounce))
+				chunk = sizeof(bounce);
+			for (i = 0; i < chunk; i++) {
+				if (mmu_read_mem_byte(address + i, &bounce[i])) {
+					drop_abort(s);
+					break;
+				}
+			}
+			if (i == 0)
+				break;
+			chunk = i;
+			ptr = bounce;
+		}
+
+		n = file_write(f, ptr, chunk);
+		if (n <= 0) {
+			s->err = n < 0 ? errno : EIO;
+			break;
+		}
+		address += n;
+		len -= n;
+	}
+	return len;
+}
+
+/* a file into guest memory, returns how much of len there wasn't */
+static size_t read_to_guest(struct semihost *s, struct semihost_file *f, armaddr_t address, size_t len)
+{
+	byte bounce[SEMIHOST_BOUNCE];
+
+	while (len > 0) {
+		size_t chunk = len, i;
+		void *ptr = mmu_get_data_run(address, &chunk, TRUE);
+		ssize_t n;
+
+		if (ptr) {
+			n = read(f->fd, ptr, chunk);
+		} else {
+			// the same through the mmu, which is also how a page with decoded instructions
+			// in it finds out it's been written to
+			if (chunk > sizeof(bounce))
+				chunk = sizeof(bounce);
+			n = read(f->fd, bounce, chunk);
+			for (i = 0; n > 0 && i < (size_t)n; i++) {
+				if (mmu_write_mem_byte(address + i, bounce[i])) {
+					drop_abort(s);
+					return len - i;
+				}
+			}
+		}
+		if (n < 0) {
+			s->err = errno;
+			break;
+		}
+		address += n;
+		len -= n;
+
+		// the end of the file, or all the console has for now
+		if ((size_t)n < chunk)
+			break;
+	}
+	return len;
+}
+
+/* a nul terminated string out to the console */
+static void write0(struct semihost *s, armaddr_t address)
+{
+	for (;;) {
+		size_t chunk = SEMIHOST_BOUNCE;
+		const char *ptr = mmu_get_data_run(address, &chunk, FALSE);
+		byte c;
+
+		if (ptr) {
+			const char *end = memchr(ptr, 0, chunk);
+
+			debug_console_write(ptr, end ? (size_t)(end - ptr) : chunk);
+			if (end)
+				return;
+			address += chunk;
+			continue;
+		}
+
+		if (mmu_read_mem_byte(address, &c)) {
+			drop_abort(s);
+			return;
+		}
+		if (c == 0)
+			return;
+		debug_console_write(&c, 1);
+		address++;
+	}
+}
+
+static word sys_open(struct semihost *s, word name, word mode, word len)
+{
+	char path[PATH_MAX];
+	int i, fd;
+
+	if (mode >= sizeof(open_flags) / sizeof(open_flags[0]) || len >= sizeof(path)) {
+		s->err = EINVAL;
+		return -1;
+	}
+	if (copy_from_guest(s, path, name, len))
+		return -1;
+	path[len] = 0;
+
+	// the console's read, write and append are stdin, stdout and stderr
+	if (!strcmp(path, ":tt")) {
+		fd = mode < 4 ? STDIN_FILENO : mode < 8 ? STDOUT_FILENO : STDERR_FILENO;
+	} else {
+		fd = open(path, open_flags[mode], 0644);
+		if (fd < 0) {
+			s->err = errno;
+			return -1;
+		}
+	}
+
+	SDL_LockMutex(s->lock);
+	for (i = 0; i < SEMIHOST_MAX_FILES; i++) {
+		if (s->files[i].fd < 0) {
+			s->files[i].fd = fd;
+			s->files[i].console = !strcmp(path, ":tt");
+			SDL_UnlockMutex(s->lock);
+			return i + 1;
+		}
+	}
+	SDL_UnlockMutex(s->lock);
+
+	if (strcmp(path, ":tt"))
+		close(fd);
+	s->err = EMFILE;
+	return -1;
+}
+
+static word sys_close(struct semihost *s, word handle)
+{
+	struct semihost_file *f;
+
+	SDL_LockMutex(s->lock);
+	f = get_file(s, handle);
+	if (f) {
+		if (!f->console)
+			close(f->fd);
+		f->fd = -1;
+	}
+	SDL_UnlockMutex(s->lock);
+
+	return f ? 0 : -1;
+}
+
+static word sys_clock(struct semihost *s)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - s->start.tv_sec) * 100 + (now.tv_nsec - s->start.tv_nsec) / 10000000;
+}
+
+static void sys_exit(word reason, word subcode)
+{
+	SYS_TRACE(1, "sys: semihosting exit, reason 0x%x subcode %d\n", reason, subcode);
+	machine_halt(machine, reason == ADP_STOPPED_APPLICATION_EXIT ? (int)subcode : 1);
+}
+
+void semihost_call(void)
+{
+	struct semihost *s = machine->semihost;
+	struct semihost_file *f;
+	word op = cpu.r[0];
+	word arg = cpu.r[1];
+	word args[3];
+	word ret = -1;
+	struct stat st;
+	byte c;
+
+	SYS_TRACE(5, "sys: semihosting call 0x%x, arg 0x%x\n", op, arg);
+
+	switch (op) {
+	case SYS_OPEN:
+		if (!read_args(s, arg, args, 3))
+			ret = sys_open(s, args[0], args[1], args[2]);
+		break;
+	case SYS_CLOSE:
+		if (!read_args(s, arg, args, 1))
+			ret = sys_close(s, args[0]);
+		break;
+	case SYS_WRITEC:
+		if (mmu_read_mem_byte(arg, &c))
+			drop_abort(s);
+		else
+			debug_console_write(&c, 1);
+		ret = cpu.r[0]; // r0 isn't changed
+		break;
+	case SYS_WRITE0:
+		write0(s, arg);
+		ret = cpu.r[0];
+		break;
+	case SYS_WRITE:
+		if (read_args(s, arg, args, 3))
+			break;
+		f = get_file(s, args[0]);
+		ret = f ? write_from_guest(s, f, args[1], args[2]) : args[2];
+		break;
+	case SYS_READ:
+		if (read_args(s, arg, args, 3))
+			break;
+		f = get_file(s, args[0]);
+		ret = f ? read_to_guest(s, f, args[1], args[2]) : args[2];
+		break;
+	case SYS_ISTTY:
+		if (!read_args(s, arg, args, 1) && (f = get_file(s, args[0])))
+			ret = f->console;
+		break;
+	case SYS_SEEK:
+		if (!read_args(s, arg, args, 2) && (f = get_file(s, args[0]))) {
+			if (lseek(f->fd, args[1], SEEK_SET) < 0)
+				s->err = errno;
+			else
+				ret = 0;
+		}
+		break;
+	case SYS_FLEN:
+		if (!read_args(s, arg, args, 1) && (f = get_file(s, args[0]))) {
+			if (fstat(f->fd, &st) < 0)
+				s->err = errno;
+			else
+				ret = st.st_size;
+		}
+		break;
+	case SYS_CLOCK:
+		ret = sys_clock(s);
+		break;
+	case SYS_ERRNO:
+		ret = s->err;
+		break;
+	case SYS_EXIT:
+		// the reason's in r1 itself on 32 bit, there's no exit code
+		sys_exit(arg, 0);
+		ret = 0;
+		break;
+	case SYS_EXIT_EXTENDED:
+		if (!read_args(s, arg, args, 2)) {
+			sys_exit(args[0], args[1]);
+			ret = 0;
+		}
+		break;
+	default:
+		SYS_TRACE(1, "sys: unsupported semihosting call 0x%x\n", op);
+		s->err = ENOSYS;
+		break;
+	}
+
+	cpu.r[0] = ret;
+}
+
+int initialize_semihost(void)
+{
+	struct semihost *s;
+	int i;
+
+	if (!get_config_key_bool("debug", "semihosting", FALSE))
+		return 0;
+
+	s = machine->semihost = calloc(1, sizeof(struct semihost));
+	s->lock = SDL_CreateMutex();
+	for (i = 0; i < SEMIHOST_MAX_FILES; i++)
+		s->files[i].fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+
+	set_cpu_semihosting(machine->cpu, TRUE);
+
+	return 0;
+}
+
+void destroy_semihost(void)
+{
+	struct semihost *s = machine->semihost;
+	int i;
+
+	if (!s)
+		return;
+
+	for (i = 0; i < SEMIHOST_MAX_FILES; i++) {
+		if (s->files[i].fd >= 0 && !s->files[i].console)
+			close(s->files[i].fd);
+	}
+	SDL_DestroyMutex(s->lock);
+	free(s);
+	machine->semihost = NULL;
+}
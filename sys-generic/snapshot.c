@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <SDL/SDL.h>
+
+#include <config.h>
+#include <arm/arm.h>
+#include <sys/sys.h>
+#include <sys/snapshot.h>
+#include "sys_p.h"
+
+struct snapshot_data {
+	uint32_t tag;
+	uint32_t size;
+	void *data;
+};
+
+struct snapshot {
+	// the cores put their sections in all at once
+	SDL_mutex *lock;
+	struct snapshot_data sections[SNAPSHOT_MAX_SECTIONS];
+	int num_sections;
+
+	// saving
+	const char *save_path;
+	dword save_at;
+	bool halt;
+	bool saving;
+	struct cpu_event save_event;
+	struct cpu_rendezvous rendezvous;
+
+	// restoring, the cores take their state out of the sections as they come up
+	bool restoring;
+};
+
+void snapshot_put(struct snapshot *s, uint32_t tag, const void *data, uint32_t size)
+{
+	struct snapshot_data *d = NULL;
+	int i;
+
+	SDL_LockMutex(s->lock);
+	for (i = 0; i < s->num_sections; i++) {
+		if (s->sections[i].tag == tag)
+			d = &s->sections[i];
+	}
+	if (!d) {
+		if (s->num_sections == SNAPSHOT_MAX_SECTIONS) {
+			SDL_UnlockMutex(s->lock);
+			SYS_TRACE(0, "snapshot: out of sections\n");
+			return;
+		}
+		d = &s->sections[s->num_sections++];
+		d->tag = tag;
+	}
+	free(d->data);
+	d->data = malloc(size);
+	d->size = size;
+	memcpy(d->data, data, size);
+	SDL_UnlockMutex(s->lock);
+}
+
+/* NULL if there's no section tag, or it's not the size it should be */
+const void *snapshot_get(struct snapshot *s, uint32_t tag, uint32_t size)
+{
+	const void *data = NULL;
+	int i;
+
+	SDL_LockMutex(s->lock);
+	for (i = 0; i < s->num_sections; i++) {
+		if (s->sections[i].tag == tag && s->sections[i].size == size)
+			data = s->sections[i].data;
+	}
+	SDL_UnlockMutex(s->lock);
+
+	return data;
+}
+
+static void clear_sections(struct snapshot *s)
+{
+	int i;
+
+	for (i = 0; i < s->num_sections; i++)
+		free(s->sections[i].data);
+	memset(s->sections, 0, sizeof(s->sections));
+	s->num_sections = 0;
+}
+
+/* into a temporary file that's renamed over path, so machines running off the old one keep their pages */
+static int write_snapshot(struct snapshot *s)
+{
+	struct cpu_cluster *cluster = machine->cpu;
+	struct snapshot_header *header;
+	char name[PATH_MAX];
+	uint64_t offset;
+	int i, fd, err = -1;
+
+	snprintf(name, sizeof(name), "%s.XXXXXX", s->save_path);
+	fd = mkstemp(name);
+	if (fd < 0)
+		return -1;
+	fchmod(fd, 0644);
+
+	header = calloc(1, sizeof(*header));
+	header->magic = SNAPSHOT_MAGIC;
+	header->version = SNAPSHOT_VERSION;
+	header->num_cores = cluster->num_cores;
+	strncpy(header->core_type, cluster->core_type, sizeof(header->core_type) - 1);
+	header->ram_offset = SNAPSHOT_RAM_OFFSET;
+	header->guest_time = cluster->cores[0]->guest_time;
+
+	if (mainmem_save_state(header, fd) < 0)
+		goto out;
+
+	// the sections go after the ram
+	offset = header->ram_offset + header->ram_size;
+	for (i = 0; i < s->num_sections; i++) {
+		header->sections[i].tag = s->sections[i].tag;
+		header->sections[i].size = s->sections[i].size;
+		header->sections[i].offset = offset;
+		if (pwrite(fd, s->sections[i].data, s->sections[i].size, offset) != (ssize_t)s->sections[i].size)
+			goto out;
+		offset += (s->sections[i].size + 7) & ~7;
+	}
+	header->num_sections = s->num_sections;
+
+	if (pwrite(fd, header, sizeof(*header), 0) != sizeof(*header))
+		goto out;
+	if (rename(name, s->save_path) < 0)
+		goto out;
+	err = 0;
+
+out:
+	if (err < 0)
+		unlink(name);
+	close(fd);
+	free(header);
+	return err;
+}
+
+/* on every core at the rendezvous */
+static void save_core(void *arg)
+{
+	cpu_save_state(arg);
+}
+
+/* on the last core to the rendezvous, the others are waiting and the devices are quiet */
+static void save_machine(void *arg)
+{
+	struct snapshot *s = arg;
+
+	flush_debug();
+
+	pic_save_state(s);
+	pit_save_state(s);
+	timer_save_state(s);
+	memop_save_state(s);
+	if (machine->bdev)
+		blockdev_save_state(s);
+	if (machine->display)
+		display_save_state(s);
+
+	if (write_snapshot(s) < 0)
+		SYS_TRACE(0, "snapshot: couldn't write %s\n", s->save_path);
+	else
+		SYS_TRACE(0, "snapshot: saved to %s at guest time %llu\n", s->save_path,
+			(unsigned long long)machine->cpu->cores[0]->guest_time);
+
+	SDL_LockMutex(s->lock);
+	s->saving = FALSE;
+	SDL_UnlockMutex(s->lock);
+
+	if (s->halt)
+		machine_halt(machine, 0);
+}
+
+/*
+ * take a snapshot, from anywhere. it's saved once every core has got to the end of the
+ * block it's in, so a core asking for one runs to the end of its own block first.
+ */
+int snapshot_request(void)
+{
+	struct snapshot *s = machine->snapshot;
+
+	if (!s || !s->save_path) {
+		SYS_TRACE(0, "snapshot: asked for one, but there's no [snapshot] save to put it in\n");
+		return -1;
+	}
+
+	SDL_LockMutex(s->lock);
+	if (s->saving) {
+		SDL_UnlockMutex(s->lock);
+		return -1;
+	}
+	s->saving = TRUE;
+	clear_sections(s);
+	SDL_UnlockMutex(s->lock);
+
+	if (cpu_request_rendezvous(machine->cpu, &s->rendezvous) < 0) {
+		SDL_LockMutex(s->lock);
+		s->saving = FALSE;
+		SDL_UnlockMutex(s->lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void save_event(void *arg)
+{
+	snapshot_request();
+}
+
+void snapshot_core_started(struct cpu_cluster *cluster)
+{
+	struct snapshot *s = machine->snapshot;
+
+	if (!s)
+		return;
+
+	if (s->restoring) {
+		cpu_restore_state(s);
+
+		// the virtual time events go on the boot core's list
+		if (get_core_id() == 0) {
+			pit_restore_events();
+			timer_restore_events();
+		}
+	}
+
+	if (get_core_id() == 0 && s->save_path && s->save_at > get_guest_time())
+		cpu_schedule_event(&s->save_event, s->save_at - get_guest_time(), &save_event, NULL);
+}
+
+/* the ram and devices come back here, the cores as they come up in snapshot_core_started() */
+static int restore_snapshot(struct snapshot *s, const char *path)
+{
+	struct cpu_cluster *cluster = machine->cpu;
+	struct snapshot_header *header;
+	uint32_t i;
+	int fd, err = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		SYS_TRACE(0, "snapshot: couldn't open %s\n", path);
+		return -1;
+	}
+
+	header = calloc(1, sizeof(*header));
+	if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+			header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION ||
+			header->num_sections > SNAPSHOT_MAX_SECTIONS) {
+		SYS_TRACE(0, "snapshot: %s isn't a snapshot this understands\n", path);
+		goto out;
+	}
+	if (header->num_cores != (uint32_t)cluster->num_cores ||
+			strncasecmp(header->core_type, cluster->core_type, sizeof(header->core_type)) != 0) {
+		SYS_TRACE(0, "snapshot: %s is of %u %.16s cores, this machine has %d %s\n", path,
+			header->num_cores, header->core_type, cluster->num_cores, cluster->core_type);
+		goto out;
+	}
+
+	for (i = 0; i < header->num_sections; i++) {
+		struct snapshot_data *d = &s->sections[i];
+
+		d->tag = header->sections[i].tag;
+		d->size = header->sections[i].size;
+		d->data = malloc(d->size);
+		s->num_sections++;
+		if (pread(fd, d->data, d->size, header->sections[i].offset) != (ssize_t)d->size) {
+			SYS_TRACE(0, "snapshot: %s is cut short\n", path);
+			goto out;
+		}
+	}
+
+	if (mainmem_restore_state(header, fd) < 0 ||
+			pic_restore_state(s) < 0 ||
+			pit_restore_state(s) < 0 ||
+			timer_restore_state(s) < 0 ||
+			memop_restore_state(s) < 0 ||
+			(machine->bdev && blockdev_restore_state(s) < 0) ||
+			(machine->display && display_restore_state(s) < 0)) {
+		SYS_TRACE(0, "snapshot: %s doesn't fit this machine\n", path);
+		goto out;
+	}
+
+	SYS_TRACE(0, "snapshot: restoring %s, guest time %llu\n", path, (unsigned long long)header->guest_time);
+	s->restoring = TRUE;
+	err = 0;
+
+out:
+	// the ram's mapping holds on to the file by itself
+	close(fd);
+	free(header);
+	return err;
+}
+
+int initialize_snapshot(void)
+{
+	struct snapshot *s;
+	const char *save_path = get_config_key_string("snapshot", "save", NULL);
+	const char *restore_path = get_config_key_string("snapshot", "restore", NULL);
+
+	if (!save_path && !restore_path)
+		return 0;
+
+	s = machine->snapshot = calloc(1, sizeof(struct snapshot));
+	s->lock = SDL_CreateMutex();
+	s->save_path = save_path;
+	s->save_at = strtoull(get_config_key_string("snapshot", "save_at", "0"), NULL, 0);
+	s->halt = get_config_key_bool("snapshot", "halt", FALSE);
+	s->rendezvous.each = &save_core;
+	s->rendezvous.last = &save_machine;
+	s->rendezvous.arg = s;
+
+	if (restore_path)
+		return restore_snapshot(s, restore_path);
+
+	return 0;
+}
+
+void destroy_snapshot(void)
+{
+	struct snapshot *s = machine->snapshot;
+
+	if (!s)
+		return;
+
+	clear_sections(s);
+	SDL_DestroyMutex(s->lock);
+	free(s);
+	machine->snapshot = NULL;
+}
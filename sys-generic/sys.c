@@ -34,17 +34,31 @@
 #include <sys/sys.h>
 #include "sys_p.h"
 
-typedef struct _memory_map {
-	word (*get_put)(armaddr_t address, word data, int size, int put);
-	void* (*get_ptr)(armaddr_t address);
-} memory_map;
+/* an installed region, with the sizes its device left out filled in so an access never has to check */
+struct mem_region {
+	armaddr_t base;
+	armaddr_t len;
+	struct mem_handler handler;
+	void *ctx;
+	struct mmio_region_stats *stats; // if device accesses are being profiled, see mmio_stats.c
+};
 
+/*
+ * the memory map is a table of regions for every page, split up by 4MB bank.
+ * a bank's table is only allocated once something is installed in it.
+ */
 #define MEMORY_BANK_SHIFT 22	 // 4MB
 #define MEMORY_BANK_SIZE (1 << MEMORY_BANK_SHIFT)
 #define ADDR_TO_BANK(x) ((x) >> MEMORY_BANK_SHIFT) 
 #define MEMORY_BANK_COUNT (1<<(32-MEMORY_BANK_SHIFT))
+#define MEMORY_BANK_PAGES (1<<(MEMORY_BANK_SHIFT-MEMMAP_PAGE_SHIFT))
+#define ADDR_TO_BANK_PAGE(x) (((x) >> MEMMAP_PAGE_SHIFT) & (MEMORY_BANK_PAGES-1))
+
+#define MAX_MEM_REGIONS 32
+
+__thread struct machine *machine; // the machine this thread is running for
 
-/* global system state */
+/* the system state of one machine */
 struct sys {
 	/* features */
 	uint features;
@@ -53,11 +67,17 @@ struct sys {
 	struct timeval current_time;
 
 	/* main memory map */
-	memory_map memmap[MEMORY_BANK_COUNT];
-} sys;
+	struct mem_region **memmap[MEMORY_BANK_COUNT]; // NULL if nothing is installed in the bank
+	struct mem_region regions[MAX_MEM_REGIONS];
+	int region_count;
+	struct mem_region unhandled;
+
+	/* device registers are only ever touched by one core at a time */
+	SDL_mutex *io_lock;
+};
 
 // function decls
-static word unhandled_get_put(armaddr_t address, word data, int size, int put);
+static const struct mem_handler unhandled_handler;
 static int initialize_sysinfo_regs(void);
 
 static bool has_sys_feature(const char *name, bool def)
@@ -65,33 +85,71 @@ static bool has_sys_feature(const char *name, bool def)
 	return get_config_key_bool("system", name, def);
 }
     
-static void load_feature_config(void)
+static void load_feature_config(struct sys *sys)
 {
-	sys.features = 0;
+	sys->features = 0;
 
 	// load system feature config
-	sys.features |= has_sys_feature("console", FALSE) ? SYSINFO_FEATURE_CONSOLE : 0;
-	sys.features |= has_sys_feature("display", FALSE) ? SYSINFO_FEATURE_DISPLAY : 0;
-	sys.features |= has_sys_feature("network", FALSE) ? SYSINFO_FEATURE_NETWORK : 0;
-	sys.features |= has_sys_feature("block", FALSE) ? SYSINFO_FEATURE_BLOCKDEV : 0;
+	sys->features |= has_sys_feature("console", FALSE) ? SYSINFO_FEATURE_CONSOLE : 0;
+	sys->features |= has_sys_feature("display", FALSE) ? SYSINFO_FEATURE_DISPLAY : 0;
+	sys->features |= has_sys_feature("network", FALSE) ? SYSINFO_FEATURE_NETWORK : 0;
+	sys->features |= has_sys_feature("block", FALSE) ? SYSINFO_FEATURE_BLOCKDEV : 0;
+	sys->features |= SYSINFO_FEATURE_TIMER;
+	sys->features |= SYSINFO_FEATURE_MEMOP;
 }
 
-int initialize_system(void)
+struct machine *machine_create(void)
 {
-	unsigned int i;
+	struct machine *m;
+
+	m = calloc(1, sizeof(struct machine));
+	m->config = create_config();
+	m->halt_lock = SDL_CreateMutex();
+	m->halt_cond = SDL_CreateCond();
+
+	return m;
+}
+
+/* override a config key for just this machine, before it's started */
+int machine_set_config(struct machine *m, const char *group, const char *key, const char *val)
+{
+	return add_local_config_key(m->config, group, key, val);
+}
+
+/* make m the machine this thread works for, config lookups included */
+void machine_enter(struct machine *m)
+{
+	machine = m;
+	set_thread_config(m ? m->config : NULL);
+}
+
+static int initialize_system(struct machine *m)
+{
+	struct sys *sys;
 	int err;
 	
 	// create a cpu
-	initialize_cpu(get_config_key_string("cpu", "core", "arm7tdmi"));
+	m->cpu = initialize_cpu(m, get_config_key_string("cpu", "core", "arm7tdmi"));
 
-	memset(&sys, 0, sizeof(sys));
+	sys = m->sys = calloc(1, sizeof(struct sys));
 
 	// load the feature set
-	load_feature_config();
+	load_feature_config(sys);
 	
-	// create the default memory map
-	for(i=0; i < MEMORY_BANK_COUNT; i++)
-		sys.memmap[i].get_put = &unhandled_get_put;
+	// anything not installed later panics
+	sys->unhandled.len = 0;
+	sys->unhandled.handler = unhandled_handler;
+
+	if (m->cpu->num_cores > 1)
+		sys->io_lock = SDL_CreateMutex();
+
+	// before any of the devices are installed
+	initialize_mmio_stats(sys->io_lock != NULL);
+
+	// fuzzing has to know before the cores start if they're counting edges
+	err = initialize_fuzz(sys->features);
+	if (err < 0)
+		return err;
 
 	// add the sysinfo registers
 	initialize_sysinfo_regs();
@@ -99,77 +157,254 @@ int initialize_system(void)
 	// initialize the interrupt controller
 	initialize_pic();
 
-	// initialize the timer
+	// initialize the timers
 	initialize_pit();
+	err = initialize_timer();
+	if (err < 0)
+		return err;
 
-	// initialize the main memory
-	initialize_mainmem(get_config_key_string("rom", "file", NULL), 
-			atol(get_config_key_string("rom", "address", "0")));
+	initialize_memop();
+
+	// reserve the fastmem window before any ram goes in
+	initialize_fastmem();
+
+	// initialize the main memory, a snapshot being restored already has the rom in it
+	err = initialize_mainmem(get_config_key_string("snapshot", "restore", NULL) ? NULL : get_config_key_string("rom", "file", NULL),
+			strtoul(get_config_key_string("rom", "address", "0"), NULL, 0));
+	if (err < 0)
+		return err;
 
 	err = 0;
-    if (sys.features & SYSINFO_FEATURE_DISPLAY){
+    if (sys->features & SYSINFO_FEATURE_DISPLAY){
             // initialize the display
         err = initialize_display();
 		if (err < 0)
 			return err;
     }
 
-    if (sys.features & SYSINFO_FEATURE_CONSOLE){
+    if (sys->features & SYSINFO_FEATURE_CONSOLE){
             // initialize the console (keyboard)
         err = initialize_console();
 		if (err < 0)
 			return err;
     }
 
-    if (sys.features & SYSINFO_FEATURE_NETWORK){
+    if (sys->features & SYSINFO_FEATURE_NETWORK){
             // initialize the network (via tun/tap)
         err = initialize_network();
 		if (err < 0)
 			return err;
     }
 
-    if (sys.features & SYSINFO_FEATURE_BLOCKDEV){
+    if (sys->features & SYSINFO_FEATURE_BLOCKDEV){
             // initialize the block device
         err = initialize_blockdev();
 		if (err < 0)
 			return err;
     }
 // debug device
-    initialize_debug();
-    
-	return err;
+    err = initialize_debug();
+	if (err < 0)
+		return err;
+
+	err = initialize_semihost();
+	if (err < 0)
+		return err;
+
+	// put everything back the way it was in a snapshot, if there is one
+	return initialize_snapshot();
 }
 
-void install_mem_handler(armaddr_t base, armaddr_t len,
-	word (*get_put)(armaddr_t address, word data, int size, int put),
-	void* (*get_ptr)(armaddr_t address))
+static word ignored_read_word(void *ctx, armaddr_t address) { return 0; }
+static halfword ignored_read_halfword(void *ctx, armaddr_t address) { return 0; }
+static byte ignored_read_byte(void *ctx, armaddr_t address) { return 0; }
+static void ignored_write_word(void *ctx, armaddr_t address, word data) { }
+static void ignored_write_halfword(void *ctx, armaddr_t address, halfword data) { }
+static void ignored_write_byte(void *ctx, armaddr_t address, byte data) { }
+
+int install_mem_handler(armaddr_t base, armaddr_t len, const struct mem_handler *handler, void *ctx)
 {
-	unsigned int i;
+	struct sys *sys = machine->sys;
+	struct mem_region *region;
+	armaddr_t page;
+
+	SYS_TRACE(5, "install_mem_handler: base 0x%08x, len 0x%08x, handler %p, ctx %p\n", base, len, handler, ctx);
+
+	if(len == 0 || ((base | len) & (MEMMAP_PAGE_SIZE-1)) != 0) {
+		printf("sys: memory region at 0x%08x, len 0x%08x isn't page aligned\n", base, len);
+		return -1;
+	}
+	if(sys->region_count == MAX_MEM_REGIONS) {
+		printf("sys: too many memory regions\n");
+		return -1;
+	}
 
-	SYS_TRACE(5, "install_mem_handler: base 0x%08x, len 0x%08x, get_put %p, get_ptr %p\n", base, len, get_put, get_ptr);
+	region = &sys->regions[sys->region_count++];
+	region->base = base;
+	region->len = len;
+	region->handler = *handler;
+	region->ctx = ctx;
+	region->stats = handler->get_ptr ? NULL : mmio_stats_region(base);
+
+	if(!region->handler.read_word)
+		region->handler.read_word = &ignored_read_word;
+	if(!region->handler.read_halfword)
+		region->handler.read_halfword = &ignored_read_halfword;
+	if(!region->handler.read_byte)
+		region->handler.read_byte = &ignored_read_byte;
+	if(!region->handler.write_word)
+		region->handler.write_word = &ignored_write_word;
+	if(!region->handler.write_halfword)
+		region->handler.write_halfword = &ignored_write_halfword;
+	if(!region->handler.write_byte)
+		region->handler.write_byte = &ignored_write_byte;
 
 	// put it in the memory map
-	for(i = ADDR_TO_BANK(base); i <= ADDR_TO_BANK(base + (len - 1)); i++) {
-		sys.memmap[i].get_put = get_put;
-		sys.memmap[i].get_ptr = get_ptr;
+	page = base;
+	do {
+		struct mem_region ***bank = &sys->memmap[ADDR_TO_BANK(page)];
+
+		if(*bank == NULL) {
+			int i;
+
+			*bank = malloc(MEMORY_BANK_PAGES * sizeof(struct mem_region *));
+			for(i = 0; i < MEMORY_BANK_PAGES; i++)
+				(*bank)[i] = &sys->unhandled;
+		}
+		(*bank)[ADDR_TO_BANK_PAGE(page)] = region;
+
+		page += MEMMAP_PAGE_SIZE;
+	} while(page != base + len);
+
+	return 0;
+}
+
+/* bring up the devices and cores of m, and set it running */
+int machine_start(struct machine *m)
+{
+	int err;
+
+	machine_enter(m);
+
+	err = initialize_system(m);
+	if (err < 0)
+		return err;
+
+	machine_reset(m);
+	start_cpu(m->cpu);
+	pic_cores_started();
+	m->started = TRUE;
+
+	return 0;
+}
+
+void machine_reset(struct machine *m)
+{
+	reset_cpu(m->cpu);
+}
+
+/*
+ * stop the machine's cores and wake up anyone waiting on it. it's called from
+ * the cores themselves, so the threads are only cleaned up by machine_destroy.
+ */
+void machine_halt(struct machine *m, int exit_code)
+{
+	// a fuzzing run ends right here, see fuzz.c
+	fuzz_halt(exit_code);
+
+	SDL_LockMutex(m->halt_lock);
+	if (!m->halted) {
+		m->halted = TRUE;
+		m->exit_code = exit_code;
+		SDL_CondBroadcast(m->halt_cond);
+	}
+	SDL_UnlockMutex(m->halt_lock);
+
+	if (m->cpu)
+		cpu_request_stop(m->cpu);
+
+	// get the message loop to notice
+	if (m->display) {
+		SDL_Event event;
+
+		event.type = SDL_QUIT;
+		SDL_PushEvent(&event);
 	}
 }
 
-void system_reset(void)
+/* wait for m to halt, returns its exit code */
+int machine_wait(struct machine *m)
 {
-	reset_cpu();
+	int exit_code;
+
+	SDL_LockMutex(m->halt_lock);
+	while (!m->halted)
+		SDL_CondWait(m->halt_cond, m->halt_lock);
+	exit_code = m->exit_code;
+	SDL_UnlockMutex(m->halt_lock);
+
+	return exit_code;
 }
 
-void system_start(void)
+void machine_destroy(struct machine *m)
 {
-	system_reset();
-	start_cpu();
+	machine_enter(m);
+
+	if (m->started) {
+		// shut off everything that can interrupt a core before the cores go away
+		stop_pit();
+		stop_timer();
+		stop_display();
+		stop_network();
+		stop_blockdev();
+		stop_cpu(m->cpu);
+		dump_mmio_stats();
+	}
+
+	destroy_snapshot();
+	destroy_fuzz();
+	destroy_semihost();
+	destroy_debug();
+	destroy_blockdev();
+	destroy_network();
+	destroy_console();
+	destroy_display();
+	destroy_mainmem();
+	destroy_fastmem();
+	destroy_memop();
+	destroy_timer();
+	destroy_pit();
+	destroy_pic();
+	destroy_mmio_stats();
+
+	if (m->cpu)
+		destroy_cpu(m->cpu);
+	if (m->sys) {
+		int i;
+
+		if (m->sys->io_lock)
+			SDL_DestroyMutex(m->sys->io_lock);
+		for (i = 0; i < MEMORY_BANK_COUNT; i++)
+			free(m->sys->memmap[i]);
+		free(m->sys);
+	}
+
+	machine_enter(NULL);
+
+	destroy_config(m->config);
+	SDL_DestroyCond(m->halt_cond);
+	SDL_DestroyMutex(m->halt_lock);
+	free(m);
 }
 
-int system_message_loop(void)
+/*
+ * SDL only has the one event queue and window, so this is for the machine that
+ * has the display. runs until it halts or the window is closed, returns the exit code.
+ */
+int system_message_loop(struct machine *m)
 {
 
-	if (sys.features & SYSINFO_FEATURE_DISPLAY) {
+	if (m->display) {
 		SDL_Event event;
 		int quit = 0;
 		while(!quit) {
@@ -191,95 +426,234 @@ int system_message_loop(void)
 					break;
 			}
 		}
-	} else {
-		// we don't have a display, and thus cannot have an event loop
-		
-		// wait here for ^c
-		for(;;)
-			sleep(10000);
+
+		// closing the window halts it, if it hasn't already
+		machine_halt(m, 0);
 	}
 
-	return 0;
+	// without a display there's no event loop, just wait for it to halt
+	return machine_wait(m);
 }
 
 void dump_sys(void)
 {
+	flush_debug();
 	printf("dumping system state...\n");
 
 	dump_mainmem();
 
 }
 
-static word unhandled_get_put(armaddr_t address, word data, int size, int put)
+static void unhandled_access(armaddr_t address, word data, int size, int put)
 {
-	SYS_TRACE(1, "sys: unhandled get_put at 0x%08x, data 0x%08x, size %d, put %d\n", 
+	SYS_TRACE(1, "sys: unhandled access at 0x%08x, data 0x%08x, size %d, put %d\n", 
 		address, data, size, put);
 	panic_cpu("unhandled memory\n");
+}
+
+static word unhandled_read_word(void *ctx, armaddr_t address)
+{
+	unhandled_access(address, 0, 4, 0);
 	return 0;
 }
 
-word sys_read_mem_word(armaddr_t address)
+static halfword unhandled_read_halfword(void *ctx, armaddr_t address)
 {
-	return sys.memmap[ADDR_TO_BANK(address)].get_put(address, 0, 4, 0);
+	unhandled_access(address, 0, 2, 0);
+	return 0;
 }
 
-halfword sys_read_mem_halfword(armaddr_t address)
+static byte unhandled_read_byte(void *ctx, armaddr_t address)
 {
-	return sys.memmap[ADDR_TO_BANK(address)].get_put(address, 0, 2, 0);
+	unhandled_access(address, 0, 1, 0);
+	return 0;
+}
+
+static void unhandled_write_word(void *ctx, armaddr_t address, word data)
+{
+	unhandled_access(address, data, 4, 1);
+}
+
+static void unhandled_write_halfword(void *ctx, armaddr_t address, halfword data)
+{
+	unhandled_access(address, data, 2, 1);
+}
+
+static void unhandled_write_byte(void *ctx, armaddr_t address, byte data)
+{
+	unhandled_access(address, data, 1, 1);
+}
+
+static const struct mem_handler unhandled_handler = {
+	.read_word = &unhandled_read_word,
+	.read_halfword = &unhandled_read_halfword,
+	.read_byte = &unhandled_read_byte,
+	.write_word = &unhandled_write_word,
+	.write_halfword = &unhandled_write_halfword,
+	.write_byte = &unhandled_write_byte,
+};
+
+static inline struct mem_region *lookup_mem_region(armaddr_t address)
+{
+	struct sys *sys = machine->sys;
+	struct mem_region **bank = sys->memmap[ADDR_TO_BANK(address)];
+
+	if(bank == NULL)
+		return &sys->unhandled;
+	return bank[ADDR_TO_BANK_PAGE(address)];
 }
 
-byte sys_read_mem_byte(armaddr_t address)
+const struct mem_region *sys_get_mem_region(armaddr_t address)
 {
-	return sys.memmap[ADDR_TO_BANK(address)].get_put(address, 0, 1, 0);
+	return lookup_mem_region(address);
 }
 
-void sys_write_mem_word(armaddr_t address, word data)
+/*
+ * with more than one core, anything that isn't plain memory is serialized so
+ * none of the device models have to worry about being reentered. device accesses
+ * are also where the cores look for polling loops, see cpu_idle_branch().
+ * when they're being profiled, the time spent waiting for the lock and in the
+ * handler is timed with the lock still held, so the stats are serialized too.
+ */
+static inline void device_access_begin(const struct mem_region *region, uint64_t *ticks)
 {
-	sys.memmap[ADDR_TO_BANK(address)].get_put(address, data, 4, 1);
+	struct sys *sys = machine->sys;
+
+	if (unlikely(region->stats != NULL))
+		ticks[0] = ticks[1] = mmio_ticks();
+	if (sys->io_lock) {
+		SDL_LockMutex(sys->io_lock);
+		if (unlikely(region->stats != NULL))
+			ticks[1] = mmio_ticks();
+	}
 }
 
-void sys_write_mem_halfword(armaddr_t address, halfword data)
+static inline void device_access_end(const struct mem_region *region, const uint64_t *ticks,
+		armaddr_t address, int size, bool write)
 {
-	sys.memmap[ADDR_TO_BANK(address)].get_put(address, data, 2, 1);
+	struct sys *sys = machine->sys;
+
+	if (unlikely(region->stats != NULL))
+		mmio_stats_add(region->stats, address, size, write, ticks[1] - ticks[0], mmio_ticks() - ticks[1]);
+	if (sys->io_lock)
+		SDL_UnlockMutex(sys->io_lock);
 }
 
-void sys_write_mem_byte(armaddr_t address, byte data)
+#define SYS_MEM_ACCESSORS(type) \
+type sys_region_read_##type(const struct mem_region *region, armaddr_t address) \
+{ \
+	type val; \
+	uint64_t ticks[2] = { 0, 0 }; \
+\
+	if (region->handler.get_ptr != NULL) \
+		return region->handler.read_##type(region->ctx, address); \
+\
+	device_access_begin(region, ticks); \
+	val = region->handler.read_##type(region->ctx, address); \
+	device_access_end(region, ticks, address, sizeof(type), FALSE); \
+\
+	/* let the core see if it's sitting in a loop polling this */ \
+	cpu_note_device_read(address, val); \
+	return val; \
+} \
+\
+void sys_region_write_##type(const struct mem_region *region, armaddr_t address, type data) \
+{ \
+	uint64_t ticks[2] = { 0, 0 }; \
+\
+	if (region->handler.get_ptr != NULL) { \
+		region->handler.write_##type(region->ctx, address, data); \
+		return; \
+	} \
+\
+	device_access_begin(region, ticks); \
+	region->handler.write_##type(region->ctx, address, data); \
+	device_access_end(region, ticks, address, sizeof(type), TRUE); \
+\
+	cpu_note_device_write(); \
+} \
+\
+type sys_read_mem_##type(armaddr_t address) \
+{ \
+	return sys_region_read_##type(lookup_mem_region(address), address); \
+} \
+\
+void sys_write_mem_##type(armaddr_t address, type data) \
+{ \
+	sys_region_write_##type(lookup_mem_region(address), address, data); \
+}
+
+SYS_MEM_ACCESSORS(word)
+SYS_MEM_ACCESSORS(halfword)
+SYS_MEM_ACCESSORS(byte)
+
+void *sys_region_get_ptr(const struct mem_region *region, armaddr_t address)
 {
-	sys.memmap[ADDR_TO_BANK(address)].get_put(address, data, 1, 1);
+	if(region->handler.get_ptr == NULL)
+		return NULL;
+	return region->handler.get_ptr(region->ctx, address);
 }
 
 void *sys_get_mem_ptr(armaddr_t address)
 {
-	if(sys.memmap[ADDR_TO_BANK(address)].get_ptr == NULL)
+	return sys_region_get_ptr(lookup_mem_region(address), address);
+}
+
+/*
+ * for devices moving data to or from guest memory. returns a host pointer to the
+ * start of the run of len bytes at address, and in *chunk how much of it carries on
+ * from there in host memory. NULL if address isn't plain memory, then the device
+ * has to go through sys_read/write_mem.
+ */
+void *sys_dma_map(armaddr_t address, size_t len, size_t *chunk)
+{
+	struct mem_region *region = lookup_mem_region(address);
+	size_t left;
+
+	if(region->handler.get_ptr == NULL)
 		return NULL;
-	return sys.memmap[ADDR_TO_BANK(address)].get_ptr(address);
+
+	left = (size_t)region->base + region->len - address;
+	*chunk = len < left ? len : left;
+
+	return region->handler.get_ptr(region->ctx, address);
 }
 
 /* sysinfo register handlers */
 
-static word sysinfo_get_put(armaddr_t address, word data, int size, int put)
+static word sysinfo_regs_read(void *ctx, armaddr_t address)
 {
+	struct sys *sys = ctx;
+
 	switch(address) {
 	case SYSINFO_FEATURES:
-		return sys.features;
-	case SYSINFO_TIME_LATCH:
-		if (put) {
-			gettimeofday(&sys.current_time, NULL);
-		}
-		break;
+		return sys->features;
 	case SYSINFO_TIME_SECS:
-		return sys.current_time.tv_sec;
+		return sys->current_time.tv_sec;
 	case SYSINFO_TIME_USECS:
-		return sys.current_time.tv_usec;
+		return sys->current_time.tv_usec;
 	}
 
 	return 0;
 }
 
+static void sysinfo_regs_write(void *ctx, armaddr_t address, word data)
+{
+	struct sys *sys = ctx;
+
+	switch(address) {
+	case SYSINFO_TIME_LATCH:
+		gettimeofday(&sys->current_time, NULL);
+		break;
+	}
+}
+
+WORD_REG_HANDLERS(sysinfo_regs);
+
 static int initialize_sysinfo_regs(void)
 {
     install_mem_handler(SYSINFO_REGS_BASE, SYSINFO_REGS_SIZE,
-                        sysinfo_get_put, NULL);
+                        &sysinfo_regs_handler, machine->sys);
 
 	return 0;
 }
@@ -23,36 +23,187 @@
 #ifndef __SYS_P_H
 #define __SYS_P_H
 
+#include <time.h>
 #include <SDL/SDL.h>
 
+/* everything that makes up one machine, the devices keep their state behind these */
+struct machine {
+	struct config *config; // layered over the process wide config
+	struct cpu_cluster *cpu;
+
+	struct sys *sys;
+	struct mainmem *mainmem;
+	struct pic *pic;
+	struct pit *pit;
+	struct timer *timer;
+	struct display *display;
+	struct console *console;
+	struct network *network;
+	struct bdev *bdev;
+	struct sys_debug *debug;
+	struct snapshot *snapshot;
+	struct fuzz *fuzz;
+	struct semihost *semihost;
+	struct memop *memop;
+	struct mmio_stats *mmio_stats; // NULL unless device accesses are being profiled
+
+	byte *fastmem; // 4GB window onto the guest physical address space, NULL if not in use
+
+	bool started;
+
+	// set once the machine has halted itself, or been told to
+	SDL_mutex *halt_lock;
+	SDL_cond *halt_cond;
+	bool halted;
+	int exit_code;
+};
+
+/*
+ * a device whose registers are all a word wide and that doesn't care how big an
+ * access is provides name##_read and name##_write, this fills in the narrower sizes
+ * with the same registers and puts the lot in name##_handler.
+ */
+#define WORD_REG_HANDLERS(name) \
+static halfword name##_read_halfword(void *ctx, armaddr_t address) \
+{ \
+	return name##_read(ctx, address); \
+} \
+static byte name##_read_byte(void *ctx, armaddr_t address) \
+{ \
+	return name##_read(ctx, address); \
+} \
+static void name##_write_halfword(void *ctx, armaddr_t address, halfword data) \
+{ \
+	name##_write(ctx, address, data); \
+} \
+static void name##_write_byte(void *ctx, armaddr_t address, byte data) \
+{ \
+	name##_write(ctx, address, data); \
+} \
+static const struct mem_handler name##_handler = { \
+	.read_word = &name##_read, \
+	.read_halfword = &name##_read_halfword, \
+	.read_byte = &name##_read_byte, \
+	.write_word = &name##_write, \
+	.write_halfword = &name##_write_halfword, \
+	.write_byte = &name##_write_byte, \
+}
+
+struct snapshot;
+struct snapshot_header;
+
+// fastmem window
+int initialize_fastmem(void);
+void *fastmem_map_ram(armaddr_t base, armaddr_t len, bool hugepages);
+void fastmem_unmap_ram(void *ptr, armaddr_t len);
+void destroy_fastmem(void);
+
 // main memory
 int dump_mainmem(void);
-int initialize_mainmem(const char *rom_file, long load_offset);
+int initialize_mainmem(const char *rom_file, armaddr_t load_address);
+int mainmem_save_state(struct snapshot_header *header, int fd);
+int mainmem_restore_state(const struct snapshot_header *header, int fd);
+void destroy_mainmem(void);
 
 // interrupt controller
 int initialize_pic(void);
 int pic_assert_level(int vector);   /* level triggered interrupts use these */
 int pic_deassert_level(int vector);
+void pic_cores_started(void);
+void pic_save_state(struct snapshot *s);
+int pic_restore_state(struct snapshot *s);
+void destroy_pic(void);
 
 // timer
 int initialize_pit(void);
+void stop_pit(void);
+void pit_save_state(struct snapshot *s);
+int pit_restore_state(struct snapshot *s);
+void pit_restore_events(void);
+void destroy_pit(void);
+
+// high resolution timer
+int initialize_timer(void);
+void stop_timer(void);
+void timer_save_state(struct snapshot *s);
+int timer_restore_state(struct snapshot *s);
+void timer_restore_events(void);
+void destroy_timer(void);
+
+// bulk memory operations
+int initialize_memop(void);
+void memop_save_state(struct snapshot *s);
+int memop_restore_state(struct snapshot *s);
+void destroy_memop(void);
 
 // display
 int initialize_display(void);
+void stop_display(void);
+void display_save_state(struct snapshot *s);
+int display_restore_state(struct snapshot *s);
+void destroy_display(void);
 
 // console
 int initialize_console(void);
 void console_keydown(SDLKey key);
 void console_keyup(SDLKey key);
+void destroy_console(void);
 
 // network
 int initialize_network(void);
+void stop_network(void);
+void destroy_network(void);
 
 // block device
 int initialize_blockdev(void);
+void stop_blockdev(void);
+void blockdev_save_state(struct snapshot *s);
+int blockdev_restore_state(struct snapshot *s);
+void destroy_blockdev(void);
 
 // debug  
 int initialize_debug(void);
+void flush_debug(void);
+void debug_console_write(const void *buf, size_t len);
+void debug_fork_begin(void);
+void debug_fork_end(bool child);
+void destroy_debug(void);
+
+// snapshots, see include/sys/snapshot.h
+int initialize_snapshot(void);
+int snapshot_request(void);
+void destroy_snapshot(void);
+
+// fuzzing, see include/sys/fuzz.h
+int initialize_fuzz(uint features);
+void fuzz_write(armaddr_t address, word data);
+word fuzz_read(armaddr_t address);
+void fuzz_halt(int exit_code);
+void destroy_fuzz(void);
+
+// semihosting, see include/sys/semihost.h
+int initialize_semihost(void);
+void destroy_semihost(void);
+
+// device register profiling
+int initialize_mmio_stats(bool locked);
+struct mmio_region_stats *mmio_stats_region(armaddr_t base);
+void mmio_stats_add(struct mmio_region_stats *r, armaddr_t address, int size, bool write, uint64_t wait, uint64_t busy);
+void dump_mmio_stats(void);
+void destroy_mmio_stats(void);
+
+/* a cheap timestamp, in whatever units the host counts in */
+static inline uint64_t mmio_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
 
 // memory map
 #include "memmap.h"
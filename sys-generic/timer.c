@@ -0,0 +1,478 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
+#include <config.h>
+#include <arm/arm.h>
+#include <sys/sys.h>
+#include <sys/snapshot.h>
+#include <util/endian.h>
+#include "sys_p.h"
+
+#ifdef __LINUX
+#include <sys/timerfd.h>
+#endif
+
+#define NSECS_PER_SEC 1000000000ULL
+
+/*
+ * the high resolution timer. a free running 64 bit counter and a few channels, each
+ * with its own interrupt, that fire when the counter reaches their compare value.
+ *
+ * on the host clock the counter is in nanoseconds since the machine started. one
+ * thread sleeps until the soonest compare value, in a timerfd where there is one, and
+ * whatever programs a channel moves the wakeup along. with [pit] virtual_time it counts
+ * guest instructions instead and the wakeup is an event on the core, like the pit's.
+ */
+struct timer_channel {
+	reg_t ctrl;
+	reg_t status;
+	uint64_t compare;
+	reg_t period;
+};
+
+struct timer {
+	SDL_mutex *mutex;
+	struct timer_channel channel[TIMER_NUM_CHANNELS];
+
+	// the high half of the counter as of each core's last read of the low half
+	reg_t count_hi[MAX_CPU_CORES];
+
+	bool virtual_time;
+	dword ins_per_sec;
+	struct cpu_event event;
+	bool event_active;
+
+	// host clock
+	uint64_t base; // CLOCK_MONOTONIC at the start, in ns
+	SDL_Thread *thread;
+	volatile bool stopping;
+#ifdef __LINUX
+	int fd;
+#else
+	SDL_cond *cond;
+	uint64_t deadline; // 0 if nothing is armed
+#endif
+};
+
+static uint64_t host_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t timer_count(struct timer *timer)
+{
+	if (timer->virtual_time)
+		return get_guest_time();
+
+	return host_nsecs() - timer->base;
+}
+
+/* fire every enabled channel whose time has come */
+static void timer_expire(struct timer *timer, uint64_t now)
+{
+	int i;
+
+	for (i = 0; i < TIMER_NUM_CHANNELS; i++) {
+		struct timer_channel *chan = &timer->channel[i];
+
+		if (!(chan->ctrl & TIMER_CTRL_ENABLE) || chan->compare > now)
+			continue;
+
+		SYS_TRACE(5, "sys: timer channel %d fired at %llu\n", i, (unsigned long long)now);
+
+		chan->status |= TIMER_STATUS_INT_PEND;
+		pic_assert_level(INT_TIMER(i));
+
+		if ((chan->ctrl & TIMER_CTRL_PERIODIC) && chan->period != 0) {
+			// skip whatever periods were missed rather than firing for each of them
+			chan->compare += ((now - chan->compare) / chan->period + 1) * chan->period;
+		} else {
+			chan->ctrl &= ~TIMER_CTRL_ENABLE;
+		}
+	}
+}
+
+static void timer_event(void *param);
+
+/* point the wakeup at the soonest enabled channel */
+static void timer_rearm(struct timer *timer)
+{
+	uint64_t next = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < TIMER_NUM_CHANNELS; i++) {
+		if ((timer->channel[i].ctrl & TIMER_CTRL_ENABLE) && timer->channel[i].compare < next)
+			next = timer->channel[i].compare;
+	}
+
+	if (timer->virtual_time) {
+		if (timer->event_active) {
+			cpu_cancel_event(&timer->event);
+			timer->event_active = FALSE;
+		}
+		if (next != UINT64_MAX) {
+			uint64_t now = get_guest_time();
+
+			cpu_schedule_event(&timer->event, next > now ? next - now : 1, &timer_event, timer);
+			timer->event_active = TRUE;
+		}
+		return;
+	}
+
+#ifdef __LINUX
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (next != UINT64_MAX) {
+		uint64_t when = timer->base + next;
+
+		its.it_value.tv_sec = when / NSECS_PER_SEC;
+		its.it_value.tv_nsec = when % NSECS_PER_SEC;
+	}
+	timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &its, NULL);
+#else
+	timer->deadline = (next != UINT64_MAX) ? timer->base + next : 0;
+	SDL_CondSignal(timer->cond);
+#endif
+}
+
+/* virtual time expiry, runs on the core between blocks */
+static void timer_event(void *param)
+{
+	struct timer *timer = (struct timer *)param;
+
+	SDL_LockMutex(timer->mutex);
+	timer->event_active = FALSE;
+	timer_expire(timer, get_guest_time());
+	timer_rearm(timer);
+	SDL_UnlockMutex(timer->mutex);
+}
+
+static int timer_thread_entry(void *args)
+{
+	struct timer *timer;
+
+	machine_enter((struct machine *)args);
+	timer = machine->timer;
+
+	SDL_LockMutex(timer->mutex);
+	while (!timer->stopping) {
+#ifdef __LINUX
+		uint64_t expirations;
+
+		SDL_UnlockMutex(timer->mutex);
+		if (read(timer->fd, &expirations, sizeof(expirations)) < 0)
+			expirations = 0;
+		SDL_LockMutex(timer->mutex);
+#else
+		if (timer->deadline == 0) {
+			SDL_CondWait(timer->cond, timer->mutex);
+		} else {
+			uint64_t now = host_nsecs();
+
+			if (timer->deadline > now)
+				SDL_CondWaitTimeout(timer->cond, timer->mutex, (timer->deadline - now + 999999) / 1000000);
+		}
+#endif
+		if (timer->stopping)
+			break;
+
+		timer_expire(timer, timer_count(timer));
+		timer_rearm(timer);
+	}
+	SDL_UnlockMutex(timer->mutex);
+
+	return 0;
+}
+
+static word timer_regs_read(void *ctx, armaddr_t address)
+{
+	struct timer *timer = ctx;
+	word val = 0;
+
+	SYS_TRACE(5, "sys: timer_regs_read at 0x%08x\n", address);
+
+	switch (address) {
+	case TIMER_COUNT_LO: {
+		// no lock, the counter is just the clock
+		uint64_t count = timer_count(timer);
+
+		timer->count_hi[get_core_id()] = count >> 32;
+		return count;
+	}
+	case TIMER_COUNT_HI:
+		return timer->count_hi[get_core_id()];
+	case TIMER_FREQ:
+		return timer->virtual_time ? timer->ins_per_sec : NSECS_PER_SEC;
+	case TIMER_CHANNEL_COUNT:
+		return TIMER_NUM_CHANNELS;
+	}
+
+	if (address < TIMER_CHANNEL(0) || address >= TIMER_CHANNEL(TIMER_NUM_CHANNELS))
+		return 0;
+
+	struct timer_channel *chan = &timer->channel[(address - TIMER_CHANNEL(0)) / TIMER_CHANNEL_SIZE];
+
+	SDL_LockMutex(timer->mutex);
+
+	switch ((address - TIMER_CHANNEL(0)) % TIMER_CHANNEL_SIZE) {
+	case TIMER_CTRL:
+		val = chan->ctrl;
+		break;
+	case TIMER_STATUS:
+		val = chan->status;
+		break;
+	case TIMER_COMPARE_LO:
+		val = chan->compare;
+		break;
+	case TIMER_COMPARE_HI:
+		val = chan->compare >> 32;
+		break;
+	case TIMER_PERIOD:
+		val = chan->period;
+		break;
+	}
+
+	SDL_UnlockMutex(timer->mutex);
+
+	return val;
+}
+
+static void timer_regs_write(void *ctx, armaddr_t address, word data)
+{
+	struct timer *timer = ctx;
+	int n;
+
+	SYS_TRACE(5, "sys: timer_regs_write at 0x%08x, data 0x%08x\n", address, data);
+
+	if (address < TIMER_CHANNEL(0) || address >= TIMER_CHANNEL(TIMER_NUM_CHANNELS))
+		return;
+
+	n = (address - TIMER_CHANNEL(0)) / TIMER_CHANNEL_SIZE;
+	struct timer_channel *chan = &timer->channel[n];
+
+	SDL_LockMutex(timer->mutex);
+
+	switch ((address - TIMER_CHANNEL(0)) % TIMER_CHANNEL_SIZE) {
+	case TIMER_CTRL:
+		chan->ctrl = data & (TIMER_CTRL_ENABLE | TIMER_CTRL_PERIODIC);
+		break;
+	case TIMER_STATUS:
+		if (data) {
+			chan->status &= ~TIMER_STATUS_INT_PEND;
+			pic_deassert_level(INT_TIMER(n));
+		}
+		break;
+	case TIMER_COMPARE_LO:
+		chan->compare = (chan->compare & ~0xffffffffULL) | data;
+		break;
+	case TIMER_COMPARE_HI:
+		chan->compare = (chan->compare & 0xffffffffULL) | ((uint64_t)data << 32);
+		break;
+	case TIMER_PERIOD:
+		chan->period = data;
+		break;
+	case TIMER_DELAY:
+		chan->compare = timer_count(timer) + data;
+		break;
+	default:
+		SDL_UnlockMutex(timer->mutex);
+		return;
+	}
+
+	// something may already be due, fire it now rather than on the next wakeup
+	timer_expire(timer, timer_count(timer));
+	timer_rearm(timer);
+
+	SDL_UnlockMutex(timer->mutex);
+}
+
+WORD_REG_HANDLERS(timer_regs);
+
+struct timer_state {
+	struct {
+		uint32_t ctrl;
+		uint32_t status;
+		uint64_t compare;
+		uint32_t period;
+		uint32_t pad;
+	} channel[TIMER_NUM_CHANNELS];
+	uint32_t count_hi[MAX_CPU_CORES];
+	uint64_t count;
+};
+
+/* with the cores stopped, so in virtual time the count is the boot core's guest time */
+void timer_save_state(struct snapshot *s)
+{
+	struct timer *timer = machine->timer;
+	struct timer_state state;
+	int i;
+
+	memset(&state, 0, sizeof(state));
+	SDL_LockMutex(timer->mutex);
+	for (i = 0; i < TIMER_NUM_CHANNELS; i++) {
+		state.channel[i].ctrl = timer->channel[i].ctrl;
+		state.channel[i].status = timer->channel[i].status;
+		state.channel[i].compare = timer->channel[i].compare;
+		state.channel[i].period = timer->channel[i].period;
+	}
+	memcpy(state.count_hi, timer->count_hi, sizeof(state.count_hi));
+	state.count = timer->virtual_time ? machine->cpu->cores[0]->guest_time : host_nsecs() - timer->base;
+	SDL_UnlockMutex(timer->mutex);
+
+	snapshot_put(s, SNAPSHOT_TAG_TIMER, &state, sizeof(state));
+}
+
+/*
+ * the counter carries on from where it was saved. on the host clock that's moving the
+ * base back, in virtual time it's the restored guest time and the boot core puts the
+ * wakeup back itself, see timer_restore_events()
+ */
+int timer_restore_state(struct snapshot *s)
+{
+	struct timer *timer = machine->timer;
+	const struct timer_state *state = snapshot_get(s, SNAPSHOT_TAG_TIMER, sizeof(struct timer_state));
+	int i;
+
+	if (!state)
+		return -1;
+
+	SDL_LockMutex(timer->mutex);
+	for (i = 0; i < TIMER_NUM_CHANNELS; i++) {
+		timer->channel[i].ctrl = state->channel[i].ctrl;
+		timer->channel[i].status = state->channel[i].status;
+		timer->channel[i].compare = state->channel[i].compare;
+		timer->channel[i].period = state->channel[i].period;
+	}
+	memcpy(timer->count_hi, state->count_hi, sizeof(timer->count_hi));
+	if (!timer->virtual_time) {
+		timer->base = host_nsecs() - state->count;
+		timer_rearm(timer);
+	}
+	SDL_UnlockMutex(timer->mutex);
+
+	return 0;
+}
+
+/* on the boot core as it comes up from a snapshot */
+void timer_restore_events(void)
+{
+	struct timer *timer = machine->timer;
+
+	if (!timer->virtual_time)
+		return;
+
+	SDL_LockMutex(timer->mutex);
+	timer_rearm(timer);
+	SDL_UnlockMutex(timer->mutex);
+}
+
+int initialize_timer(void)
+{
+	struct timer *timer;
+
+	timer = machine->timer = calloc(1, sizeof(struct timer));
+
+	timer->mutex = SDL_CreateMutex();
+
+	// same as the pit, so the two agree on what time it is
+	timer->virtual_time = get_config_key_bool("pit", "virtual_time", FALSE);
+	timer->ins_per_sec = atoi(get_config_key_string("pit", "mips", "100")) * 1000000;
+	if (timer->virtual_time && machine->cpu->num_cores > 1)
+		timer->virtual_time = FALSE; // the pit has already said so
+
+	if (!timer->virtual_time) {
+		timer->base = host_nsecs();
+#ifdef __LINUX
+		timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (timer->fd < 0) {
+			SYS_TRACE(0, "sys: couldn't create the timer's timerfd\n");
+			return -1;
+		}
+#else
+		timer->cond = SDL_CreateCond();
+#endif
+		timer->thread = SDL_CreateThread(&timer_thread_entry, machine);
+	}
+
+	install_mem_handler(TIMER_REGS_BASE, TIMER_REGS_SIZE, &timer_regs_handler, timer);
+
+	return 0;
+}
+
+/* stop the thread so nothing fires while the cores go away */
+void stop_timer(void)
+{
+	struct timer *timer = machine->timer;
+
+	if (!timer || !timer->thread)
+		return;
+
+	SDL_LockMutex(timer->mutex);
+	timer->stopping = TRUE;
+#ifdef __LINUX
+	// an expiry in the past goes off straight away
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = 1;
+	timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &its, NULL);
+#else
+	SDL_CondSignal(timer->cond);
+#endif
+	SDL_UnlockMutex(timer->mutex);
+
+	SDL_WaitThread(timer->thread, NULL);
+	timer->thread = NULL;
+}
+
+void destroy_timer(void)
+{
+	struct timer *timer = machine->timer;
+
+	if (!timer)
+		return;
+
+#ifdef __LINUX
+	if (!timer->virtual_time && timer->fd >= 0)
+		close(timer->fd);
+#else
+	if (timer->cond)
+		SDL_DestroyCond(timer->cond);
+#endif
+	SDL_DestroyMutex(timer->mutex);
+	free(timer);
+	machine->timer = NULL;
+}
@@ -0,0 +1,18 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include "../memmap.h"
+
+/* scratch memory for the kernels that move data around, well clear of the code */
+#define BENCH_SRC	0x00100000
+#define BENCH_DST	0x00200000
+
+/* every kernel starts at 0 in svc mode, with the mmu off and interrupts masked */
+#define BENCH_START \
+	.text; \
+	.arm; \
+	.globl _start; \
+_start: \
+	ldr		sp, =0x00080000
+
+#endif
@@ -0,0 +1,22 @@
+#!/bin/sh
+# usage: run.sh armemu [instructions] [kernel...]
+#
+# runs each kernel headless for a fixed number of instructions and prints what
+# it did as "kernel key value" lines, the same ones in the same order every time
+# so two runs can be diffed.
+
+ARMEMU=$1
+INSTRUCTIONS=${2:-100000000}
+shift 2 2>/dev/null
+BENCHES=${*:-"alu branch memcpy ldmstm thumb mmu mmio"}
+
+case $ARMEMU in
+	/*) ;;
+	*) ARMEMU=$PWD/$ARMEMU ;;
+esac
+
+cd "$(dirname "$0")" || exit 1
+
+for b in $BENCHES; do
+	"$ARMEMU" -r $b.bin -n $INSTRUCTIONS < /dev/null | sed -n "s/^stats: /$b /p"
+done
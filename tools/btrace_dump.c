@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2005-2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * reads back the binary execution trace the emulator records with [trace] file.
+ *
+ * usage: btrace_dump [-c core] [-n count] [-s] [-e elf] tracefile
+ *
+ *  -c core    only that core's records
+ *  -n count   only the newest count records of each core
+ *  -s         a summary instead of the records: counts by type, the hottest
+ *             blocks and the most run uops
+ *  -e elf     name the blocks from this elf's symbols, rather than from the elf
+ *             rom the trace says the guest was loaded from
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <arm/btrace_format.h>
+
+#define TOP_BLOCKS 20
+#define TOP_OPCODES 20
+
+struct count {
+	uint32_t key;
+	uint64_t count;
+};
+
+static const char *opcode_names[65536];
+
+/* the guest's functions, sorted by address */
+struct symbol {
+	uint32_t addr;
+	uint32_t size;
+	const char *name;
+};
+
+static struct symbol *syms;
+static int num_syms;
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-c core] [-n count] [-s] [-e elf] tracefile\n", name);
+	exit(1);
+}
+
+static uint32_t read_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t read_le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static int compare_symbols(const void *_a, const void *_b)
+{
+	const struct symbol *a = _a, *b = _b;
+
+	if (a->addr != b->addr)
+		return a->addr < b->addr ? -1 : 1;
+	return (int)b->size - (int)a->size;
+}
+
+/* the functions and labels in a little endian elf32's symbol table, as the profiler takes them */
+static void load_symbols(const char *path)
+{
+	unsigned char *elf;
+	struct stat st;
+	uint32_t shoff, shentsize, shnum, i, j;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < 0x34) {
+		fprintf(stderr, "%s: couldn't read symbols\n", path);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	elf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (elf == MAP_FAILED || memcmp(elf, "\177ELF", 4) != 0 || elf[4] != 1 || elf[5] != 1) {
+		fprintf(stderr, "%s: not a little endian elf32 file\n", path);
+		return;
+	}
+
+	shoff = read_le32(elf + 0x20);
+	shentsize = read_le16(elf + 0x2e);
+	shnum = read_le16(elf + 0x30);
+	if (shentsize < 40 || shoff + (uint64_t)shnum * shentsize > (uint64_t)st.st_size)
+		return;
+
+	for (i = 0; i < shnum; i++) {
+		unsigned char *sh = elf + shoff + i * shentsize;
+		unsigned char *strsh;
+		uint32_t symoff, symsize, stroff, strsize;
+
+		if (read_le32(sh + 4) != 2 || read_le32(sh + 24) >= shnum) // SHT_SYMTAB
+			continue;
+
+		symoff = read_le32(sh + 16);
+		symsize = read_le32(sh + 20);
+		strsh = elf + shoff + read_le32(sh + 24) * shentsize;
+		stroff = read_le32(strsh + 16);
+		strsize = read_le32(strsh + 20);
+		if (strsize == 0 || (uint64_t)symoff + symsize > (uint64_t)st.st_size || (uint64_t)stroff + strsize > (uint64_t)st.st_size)
+			continue;
+		elf[stroff + strsize - 1] = 0;
+
+		syms = realloc(syms, (num_syms + symsize / 16) * sizeof(struct symbol));
+		for (j = 0; j + 16 <= symsize; j += 16) {
+			unsigned char *sym = elf + symoff + j;
+			uint32_t name = read_le32(sym + 0);
+			uint32_t type = sym[12] & 0xf;
+
+			if ((type != 2 && type != 0) || read_le16(sym + 14) == 0 || name == 0 || name >= strsize)
+				continue;
+			if (elf[stroff + name] == '$' || elf[stroff + name] == 0)
+				continue;
+
+			syms[num_syms].addr = read_le32(sym + 4) & ~1;
+			syms[num_syms].size = read_le32(sym + 8);
+			syms[num_syms].name = (const char *)elf + stroff + name;
+			num_syms++;
+		}
+	}
+
+	qsort(syms, num_syms, sizeof(struct symbol), &compare_symbols);
+	for (i = 0; (int)i < num_syms; i++) {
+		if (syms[i].size == 0)
+			syms[i].size = ((int)i + 1 < num_syms) ? syms[i + 1].addr - syms[i].addr : 4096;
+	}
+}
+
+/* "name+offset" for pc, or nothing if no symbol covers it */
+static const char *symbol_name(uint32_t pc)
+{
+	static char buf[256];
+	int lo = 0, hi = num_syms - 1, best = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (syms[mid].addr <= pc) {
+			best = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (best < 0 || pc - syms[best].addr >= syms[best].size)
+		return "";
+
+	if (pc == syms[best].addr)
+		snprintf(buf, sizeof(buf), " %s", syms[best].name);
+	else
+		snprintf(buf, sizeof(buf), " %s+0x%x", syms[best].name, pc - syms[best].addr);
+	return buf;
+}
+
+static const char *mode_name(int flags)
+{
+	switch (flags & BTRACE_FLAG_MODE_MASK) {
+		case 0x10: return "usr";
+		case 0x11: return "fiq";
+		case 0x12: return "irq";
+		case 0x13: return "svc";
+		case 0x17: return "abt";
+		case 0x1b: return "und";
+		case 0x1f: return "sys";
+		default: return "???";
+	}
+}
+
+static const char *opcode_name(int opcode)
+{
+	return opcode_names[opcode] ? opcode_names[opcode] : "?";
+}
+
+static void print_record(int core, const struct btrace_record *rec)
+{
+	switch (rec->type) {
+		case BTRACE_BLOCK:
+			printf("%d block %12llu 0x%08x %s %s%s\n", core,
+				(unsigned long long)(((uint64_t)rec->data << 32) | rec->arg), rec->pc,
+				mode_name(rec->flags), (rec->flags & BTRACE_FLAG_THUMB) ? "thumb" : "arm", symbol_name(rec->pc));
+			break;
+		case BTRACE_INS:
+			printf("%d ins                0x%08x %s\n", core, rec->pc, opcode_name(rec->opcode));
+			break;
+		case BTRACE_READ:
+			printf("%d read               0x%08x [0x%08x] size %d\n", core, rec->pc, rec->arg, rec->opcode);
+			break;
+		case BTRACE_WRITE:
+			printf("%d write              0x%08x [0x%08x] size %d data 0x%08x\n", core, rec->pc, rec->arg, rec->opcode, rec->data);
+			break;
+		default:
+			printf("%d type %d\n", core, rec->type);
+	}
+}
+
+/* counting how often each key turns up, a small open addressed table */
+struct counter {
+	struct count *slots;
+	size_t size;
+	size_t used;
+};
+
+static void count_key(struct counter *c, uint32_t key)
+{
+	size_t i;
+
+	if (c->used * 2 >= c->size) {
+		struct counter bigger = { NULL, c->size ? c->size * 2 : 1024, 0 };
+
+		bigger.slots = calloc(bigger.size, sizeof(struct count));
+		for (i = 0; i < c->size; i++) {
+			if (c->slots[i].count) {
+				size_t j = (c->slots[i].key * 0x9e3779b1u) & (bigger.size - 1);
+
+				while (bigger.slots[j].count)
+					j = (j + 1) & (bigger.size - 1);
+				bigger.slots[j] = c->slots[i];
+				bigger.used++;
+			}
+		}
+		free(c->slots);
+		*c = bigger;
+	}
+
+	for (i = (key * 0x9e3779b1u) & (c->size - 1); c->slots[i].count && c->slots[i].key != key; i = (i + 1) & (c->size - 1))
+		;
+	if (c->slots[i].count == 0) {
+		c->slots[i].key = key;
+		c->used++;
+	}
+	c->slots[i].count++;
+}
+
+static int compare_counts(const void *_a, const void *_b)
+{
+	const struct count *a = _a, *b = _b;
+
+	if (a->count != b->count)
+		return a->count > b->count ? -1 : 1;
+	return a->key < b->key ? -1 : 1;
+}
+
+static void print_top(struct counter *c, const char *title, int top, int opcodes)
+{
+	uint64_t total = 0;
+	size_t i;
+	int shown = 0;
+
+	qsort(c->slots, c->size, sizeof(struct count), &compare_counts);
+	for (i = 0; i < c->used; i++)
+		total += c->slots[i].count;
+
+	printf("\n%s\n", title);
+	for (i = 0; i < c->used && shown < top; i++, shown++) {
+		printf("%12llu %6.2f%%  ", (unsigned long long)c->slots[i].count, c->slots[i].count * 100.0 / total);
+		if (opcodes)
+			printf("%s\n", opcode_name(c->slots[i].key));
+		else
+			printf("0x%08x%s\n", c->slots[i].key, symbol_name(c->slots[i].key));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const struct btrace_header *header;
+	const char *names, *symbols = NULL;
+	struct stat st;
+	uint64_t last = 0, type_counts[BTRACE_WRITE + 1];
+	struct counter blocks = { NULL, 0, 0 }, opcodes = { NULL, 0, 0 };
+	int only_core = -1, summary = 0;
+	uint32_t core, i;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "c:n:se:")) != -1) {
+		switch (c) {
+			case 'c': only_core = atoi(optarg); break;
+			case 'n': last = strtoull(optarg, NULL, 0); break;
+			case 's': summary = 1; break;
+			case 'e': symbols = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if ((size_t)st.st_size < sizeof(*header) || header->magic != BTRACE_MAGIC || header->version != BTRACE_VERSION ||
+			header->record_size != sizeof(struct btrace_record) || header->num_cores > BTRACE_MAX_CORES ||
+			header->ring_offset + header->num_cores * header->ring_records * sizeof(struct btrace_record) > (uint64_t)st.st_size) {
+		fprintf(stderr, "%s: not a trace this understands\n", argv[optind]);
+		return 1;
+	}
+
+	names = (const char *)header + header->names_offset;
+	for (i = 0; i < header->num_opcodes && i < 65536; i++) {
+		opcode_names[i] = names;
+		names += strlen(names) + 1;
+	}
+	if (!symbols && header->symbols_offset && header->symbols_offset < header->ring_offset)
+		symbols = (const char *)header + header->symbols_offset;
+	if (symbols)
+		load_symbols(symbols);
+
+	memset(type_counts, 0, sizeof(type_counts));
+	for (core = 0; core < header->num_cores; core++) {
+		const struct btrace_record *ring = (const struct btrace_record *)((const char *)header + header->ring_offset) +
+			core * header->ring_records;
+		uint64_t head = header->head[core];
+		uint64_t n = head < header->ring_records ? head : header->ring_records;
+		uint64_t r;
+
+		if (only_core >= 0 && (uint32_t)only_core != core)
+			continue;
+		if (last && n > last)
+			n = last;
+
+		if (summary)
+			printf("core %u: %llu records, the newest %llu of them kept\n", core, (unsigned long long)head, (unsigned long long)n);
+
+		for (r = head - n; r < head; r++) {
+			const struct btrace_record *rec = &ring[r & (header->ring_records - 1)];
+
+			if (!summary) {
+				print_record(core, rec);
+				continue;
+			}
+
+			if (rec->type <= BTRACE_WRITE)
+				type_counts[rec->type]++;
+			if (rec->type == BTRACE_BLOCK)
+				count_key(&blocks, rec->pc);
+			else if (rec->type == BTRACE_INS)
+				count_key(&opcodes, rec->opcode);
+		}
+	}
+
+	if (summary) {
+		printf("\n%12llu blocks\n%12llu instructions\n%12llu reads\n%12llu writes\n",
+			(unsigned long long)type_counts[BTRACE_BLOCK], (unsigned long long)type_counts[BTRACE_INS],
+			(unsigned long long)type_counts[BTRACE_READ], (unsigned long long)type_counts[BTRACE_WRITE]);
+		if (blocks.used)
+			print_top(&blocks, "hottest blocks", TOP_BLOCKS, 0);
+		if (opcodes.used)
+			print_top(&opcodes, "most run uops", TOP_OPCODES, 1);
+	}
+
+	return 0;
+}